@@ -9,6 +9,16 @@
 #include <future>
 #include <chrono>
 #include "Progress.h"
+#include "ParallelFor.h"
+
+
+/*!
+ * Decides when an AsyncTask gets to run, e.g. to limit how many tasks of a kind are in flight at once.
+ *
+ * It is handed the task, which it must run exactly once (from any thread), and a function telling whether the
+ * task still needs to be computed. Once the task has been canceled or abandoned, running it is a cheap no-op.
+ */
+using TaskLauncher = std::function<void(ThreadPool::Task run, std::function<bool()> pending)>;
 
 
 template <typename T>
@@ -39,24 +49,71 @@ public:
 	 * @param compute The function to execute asyncrhonously
 	 */
 	AsyncTask(NoProgressTaskFunc compute)
-		: m_compute([compute](AtomicProgress &){return compute();}), m_progress(false)
+		: m_compute([compute](AtomicProgress &){return compute();}), m_progress(true)
 	{
+		// no progress is reported, but keep the state around so the task can still be canceled
+		m_progress.setBusy();
+	}
 
+	/*!
+	 * A computation that is already running on the pool may still refer to data owned by the caller, so wait
+	 * for it to finish, but make sure that one that has not been started yet never will be.
+	 *
+	 * If get() ran the computation itself, the queued stub only finds the claim taken, so there is nothing to wait for.
+	 */
+	~AsyncTask()
+	{
+		if (m_future.valid() && m_claimed && !m_ranInline && m_claimed->exchange(true))
+			m_future.wait();
 	}
 
 	/*!
 	 * Start the computation (if it hasn't already been started)
+	 *
+	 * The computation is queued on the shared ThreadPool instead of spawning a new thread.
+	 * If the task is canceled before it gets to run, it throws a CanceledError right away.
 	 */
 	void compute()
+	{
+		compute([](ThreadPool::Task run, std::function<bool()>){ThreadPool::instance().enqueue(std::move(run));});
+	}
+
+	/*!
+	 * Start the computation (if it hasn't already been started), leaving it up to @p launch when it runs.
+	 *
+	 * Until then, get() still computes the result right away on the calling thread.
+	 */
+	void compute(const TaskLauncher & launch)
 	{
 		// start only if not done and not already started
-		if (!m_future.valid() && !m_ready)
+		if (m_future.valid() || m_ready)
+			return;
+
+		if (policy == std::launch::deferred)
 			m_future = std::async(policy, m_compute, std::ref(m_progress));
+		else
+		{
+			// the queued task only holds on to copies, so it never outlives the data it refers to
+			auto claimed = m_claimed = std::make_shared<std::atomic<bool>>(false);
+			TaskFunc func = m_compute;
+			AtomicProgress progress = m_progress;
+			auto task = std::make_shared<std::packaged_task<T()>>(
+				[claimed,func,progress]() mutable
+				{
+					// the task was abandoned, or get() already ran it on its own thread
+					if (claimed->exchange(true))
+						throw CanceledError();
+					return run(func, progress);
+				});
+			m_future = task->get_future();
+			launch([task]{(*task)();}, [claimed,progress]{return !*claimed && !progress.canceled();});
+		}
 	}
 
 	/*!
 	 * Waits until the task has finished, and returns the result.
 	 * The tasks return value is cached, so get can be called multiple times.
+	 * Throws a CanceledError if the task was canceled before it completed.
 	 *
 	 * @return	The result of the computation
 	 */
@@ -65,7 +122,14 @@ public:
 		if (m_ready)
 			return m_value;
 
-		m_value = m_future.valid() ? m_future.get() : m_compute(m_progress);
+		// if the pool hasn't gotten around to the task yet, run it right here instead of waiting for it
+		if (!m_future.valid() || (m_claimed && !m_claimed->exchange(true)))
+		{
+			m_ranInline = m_claimed != nullptr;
+			m_value = run(m_compute, m_progress);
+		}
+		else
+			m_value = m_future.get();
 
 		m_ready = true;
 		return m_value;
@@ -87,6 +151,22 @@ public:
 		m_progress.resetProgress(p);
 	}
 
+	/*!
+	 * Ask the computation to stop as soon as possible.
+	 *
+	 * Cancellation is cooperative: a queued task will not run at all, while a running task stops
+	 * the next time it calls AtomicProgress::checkCanceled().
+	 */
+	void cancel()
+	{
+		m_progress.cancel();
+	}
+
+	bool canceled() const
+	{
+		return m_progress.canceled();
+	}
+
 	/*!
 	 * @return true if the computation has finished
 	 */
@@ -106,9 +186,17 @@ public:
 	}
 
 private:
+	static T run(const TaskFunc & compute, AtomicProgress & progress)
+	{
+		progress.checkCanceled();
+		return compute(progress);
+	}
+
 	TaskFunc m_compute;
 	std::future<T> m_future;
 	T m_value;
 	AtomicProgress m_progress;
+	std::shared_ptr<std::atomic<bool>> m_claimed;   ///< Set by whoever gets to run the computation first
 	bool m_ready = false;
+	bool m_ranInline = false;                       ///< Whether get() won the claim and ran a queued computation itself
 };
\ No newline at end of file
@@ -0,0 +1,298 @@
+//
+// Copyright (C) Wojciech Jarosz <wjarosz@gmail.com>. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can
+// be found in the LICENSE.txt file.
+//
+
+#include "BufferPool.h"
+#include "ParallelFor.h"
+#include "Trace.h"
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <mutex>
+#include <new>
+#include <utility>
+#include <vector>
+#include <spdlog/fmt/fmt.h>
+
+#if defined(_WIN32)
+#define NOMINMAX
+#include <windows.h>
+#include <malloc.h>
+#else
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+namespace
+{
+
+const size_t HugePageSize = size_t(2) << 20;
+
+struct Pool
+{
+	mutex guard;
+	vector<pair<size_t, void *>> cached;    ///< Freed buffers and their bucket sizes, oldest first
+	BufferPool::Stats stats;
+	size_t capacity = size_t(1) << 30;
+	bool hugePages = true;
+};
+
+// never destroyed, since images in static variables may still be freed after the end of main
+Pool & pool()
+{
+	static Pool * p = new Pool;
+	return *p;
+}
+
+size_t pageSize()
+{
+#if defined(_WIN32)
+	static size_t size = []{SYSTEM_INFO info; GetSystemInfo(&info); return size_t(info.dwPageSize);}();
+#else
+	static size_t size = size_t(sysconf(_SC_PAGESIZE));
+#endif
+	return size;
+}
+
+/*!
+ * The size of the bucket that a request of @p bytes is served from. The buckets are spaced an eighth of a
+ * power of two apart, so a buffer is at most 12.5% larger than requested, and images that differ in size by
+ * a few scanlines (e.g. after cropping a border) still share buffers.
+ */
+size_t bucketSize(size_t bytes)
+{
+	size_t power = size_t(1);
+	while (power <= bytes / 2)
+		power *= 2;
+	size_t granularity = max(power / 8, pageSize());
+	return (bytes + granularity - 1) / granularity * granularity;
+}
+
+void * mapPages(size_t bytes, bool hugePages)
+{
+#if defined(_WIN32)
+	(void) hugePages;
+	return VirtualAlloc(nullptr, bytes, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+#else
+	bool huge = false;
+#if defined(MADV_HUGEPAGE)
+	huge = hugePages && bytes >= HugePageSize;
+#else
+	(void) hugePages;
+#endif
+	// huge pages only back naturally aligned 2 MB ranges, so map a bit more and trim it to such a range
+	size_t mapped = huge ? bytes + HugePageSize : bytes;
+	void * p = mmap(nullptr, mapped, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED)
+		return nullptr;
+	if (!huge)
+		return p;
+
+	uintptr_t begin = uintptr_t(p), aligned = (begin + HugePageSize - 1) / HugePageSize * HugePageSize;
+	if (aligned > begin)
+		munmap(p, aligned - begin);
+	if (begin + mapped > aligned + bytes)
+		munmap((void *) (aligned + bytes), begin + mapped - aligned - bytes);
+#if defined(MADV_HUGEPAGE)
+	madvise((void *) aligned, bytes, MADV_HUGEPAGE);
+#endif
+	return (void *) aligned;
+#endif
+}
+
+void unmapPages(void * ptr, size_t bytes)
+{
+#if defined(_WIN32)
+	(void) bytes;
+	VirtualFree(ptr, 0, MEM_RELEASE);
+#else
+	munmap(ptr, bytes);
+#endif
+}
+
+// fault the pages in from all threads, instead of one by one on whichever thread writes the buffer first
+void touchPages(void * ptr, size_t bytes)
+{
+	TRACE_ZONE("BufferPool::touchPages");
+	char * data = static_cast<char *>(ptr);
+	size_t page = pageSize();
+	parallel_for(BlockedRange(0, int((bytes + page - 1) / page)), [data,page](int begin, int end)
+	{
+		for (int i = begin; i < end; ++i)
+			data[size_t(i) * page] = 0;
+	});
+}
+
+// move the buffers that have been cached the longest out of the pool until the rest fits in its capacity
+void evictOldest(Pool & p, vector<pair<size_t, void *>> & evicted)
+{
+	auto end = p.cached.begin();
+	while (p.stats.bytesCached > p.capacity)
+	{
+		p.stats.bytesCached -= end->first;
+		evicted.push_back(*end++);
+	}
+	p.cached.erase(p.cached.begin(), end);
+}
+
+#if defined(HDRVIEW_TRACING)
+void traceStats(const BufferPool::Stats & stats)
+{
+	TRACE_COUNTER("pooled buffers in use (MB)", stats.bytesInUse >> 20);
+	TRACE_COUNTER("pooled buffers cached (MB)", stats.bytesCached >> 20);
+	TRACE_COUNTER("fresh buffer allocations", stats.fresh);
+}
+#else
+void traceStats(const BufferPool::Stats &) {}
+#endif
+
+} // namespace
+
+
+void * BufferPool::allocate(size_t bytes)
+{
+	if (bytes < MinSize)
+	{
+		void * p = nullptr;
+#if defined(_WIN32)
+		p = _aligned_malloc(max(bytes, size_t(1)), Alignment);
+#else
+		if (posix_memalign(&p, Alignment, max(bytes, size_t(1))) != 0)
+			p = nullptr;
+#endif
+		if (!p)
+			throw bad_alloc();
+		return p;
+	}
+
+	size_t size = bucketSize(bytes);
+	Pool & p = pool();
+	void * buffer = nullptr;
+	bool hugePages;
+	Stats stats;
+	{
+		lock_guard<mutex> lock(p.guard);
+		// prefer the most recently freed buffer, whose pages are the most likely to still be in the caches
+		for (auto it = p.cached.rbegin(); it != p.cached.rend(); ++it)
+			if (it->first == size)
+			{
+				buffer = it->second;
+				p.cached.erase(next(it).base());
+				p.stats.bytesCached -= size;
+				++p.stats.reused;
+				break;
+			}
+		if (!buffer)
+			++p.stats.fresh;
+		p.stats.bytesInUse += size;
+		hugePages = p.hugePages;
+		stats = p.stats;
+	}
+
+	if (!buffer)
+	{
+		buffer = mapPages(size, hugePages);
+		if (!buffer)
+		{
+			lock_guard<mutex> lock(p.guard);
+			p.stats.bytesInUse -= size;
+			throw bad_alloc();
+		}
+		touchPages(buffer, size);
+	}
+
+	traceStats(stats);
+	return buffer;
+}
+
+void BufferPool::release(void * ptr, size_t bytes)
+{
+	if (!ptr)
+		return;
+
+	if (bytes < MinSize)
+	{
+#if defined(_WIN32)
+		_aligned_free(ptr);
+#else
+		free(ptr);
+#endif
+		return;
+	}
+
+	size_t size = bucketSize(bytes);
+	Pool & p = pool();
+	vector<pair<size_t, void *>> evicted;
+	Stats stats;
+	{
+		lock_guard<mutex> lock(p.guard);
+		p.stats.bytesInUse -= size;
+		p.cached.emplace_back(size, ptr);
+		p.stats.bytesCached += size;
+		evictOldest(p, evicted);
+		stats = p.stats;
+	}
+
+	for (auto & e : evicted)
+		unmapPages(e.second, e.first);
+	traceStats(stats);
+}
+
+size_t BufferPool::capacity()
+{
+	lock_guard<mutex> lock(pool().guard);
+	return pool().capacity;
+}
+
+void BufferPool::setCapacity(size_t bytes)
+{
+	vector<pair<size_t, void *>> evicted;
+	{
+		lock_guard<mutex> lock(pool().guard);
+		pool().capacity = bytes;
+		evictOldest(pool(), evicted);
+	}
+	for (auto & e : evicted)
+		unmapPages(e.second, e.first);
+}
+
+bool BufferPool::hugePages()
+{
+	lock_guard<mutex> lock(pool().guard);
+	return pool().hugePages;
+}
+
+void BufferPool::setHugePages(bool enabled)
+{
+	lock_guard<mutex> lock(pool().guard);
+	pool().hugePages = enabled;
+}
+
+void BufferPool::trim()
+{
+	vector<pair<size_t, void *>> evicted;
+	{
+		lock_guard<mutex> lock(pool().guard);
+		evicted.swap(pool().cached);
+		pool().stats.bytesCached = 0;
+	}
+	for (auto & e : evicted)
+		unmapPages(e.second, e.first);
+}
+
+BufferPool::Stats BufferPool::stats()
+{
+	lock_guard<mutex> lock(pool().guard);
+	return pool().stats;
+}
+
+string BufferPool::summary()
+{
+	Stats s = stats();
+	return fmt::format("Buffers: {:.1f} MB in use, {:.1f} MB cached, {} reused, {} fresh allocations",
+	                   s.bytesInUse / double(1 << 20), s.bytesCached / double(1 << 20), s.reused, s.fresh);
+}
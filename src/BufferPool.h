@@ -0,0 +1,86 @@
+//
+// Copyright (C) Wojciech Jarosz <wjarosz@gmail.com>. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can
+// be found in the LICENSE.txt file.
+//
+
+#pragma once
+
+#include <cstddef>
+#include <string>
+
+/*!
+ * @brief A process-wide pool of large, page-aligned memory buffers, bucketed by size.
+ *
+ * Image operations return new images by value, so processing a batch of images (or repeatedly filtering one)
+ * allocates and frees buffers of the same few sizes over and over. Freed buffers are kept here instead, and a
+ * later request from the same size bucket reuses one without going back to the operating system, so the pages
+ * are already mapped and the steady state of such a loop does no fresh allocations at all.
+ *
+ * The pixels of every Eigen array of Color4, and so of every HDRImage, live in this pool (see the end of
+ * Color.h). Smaller requests than MinSize are passed through to the regular aligned allocator.
+ *
+ * The pages of a fresh buffer are first touched in parallel by the ThreadPool, which spreads the page faults
+ * over all threads, and on NUMA systems places the pages near the threads that will process them.
+ *
+ * All functions can be called from any thread.
+ */
+class BufferPool
+{
+public:
+	static constexpr size_t MinSize = size_t(1) << 20;   ///< Smaller buffers bypass the pool
+	static constexpr size_t Alignment = 64;             ///< Alignment of all buffers, including small ones
+
+	/// Counts since the start of the program, and the current sizes
+	struct Stats
+	{
+		size_t reused = 0;          ///< Pooled requests served by a buffer freed earlier
+		size_t fresh = 0;           ///< Pooled requests that needed new memory from the operating system
+		size_t bytesInUse = 0;      ///< Memory of the pooled buffers currently handed out
+		size_t bytesCached = 0;     ///< Memory of the freed buffers kept for reuse
+	};
+
+	/// Memory of at least @p bytes, aligned to Alignment. Throws std::bad_alloc if there is none.
+	static void * allocate(size_t bytes);
+	/// Return memory from allocate, with the same @p bytes
+	static void release(void * ptr, size_t bytes);
+
+	/// Upper bound on bytesCached. Freed buffers that do not fit are given back to the operating system.
+	static size_t capacity();
+	static void setCapacity(size_t bytes);
+
+	/// Whether fresh buffers ask for transparent huge pages (where the platform supports them)
+	static bool hugePages();
+	static void setHugePages(bool enabled);
+
+	/// Give all cached buffers back to the operating system
+	static void trim();
+
+	static Stats stats();
+	/// A one-line summary of stats() for the HUD and logs
+	static std::string summary();
+};
+
+
+/// An uninitialized scratch array of @p n trivially constructible T, e.g. for the intermediate results of a filter
+template <typename T>
+class PooledArray
+{
+public:
+	explicit PooledArray(size_t n) :
+		m_data(n ? static_cast<T *>(BufferPool::allocate(n * sizeof(T))) : nullptr), m_size(n) {}
+	~PooledArray() {BufferPool::release(m_data, m_size * sizeof(T));}
+
+	PooledArray(const PooledArray &) = delete;
+	PooledArray & operator=(const PooledArray &) = delete;
+
+	T * data()                          {return m_data;}
+	const T * data() const              {return m_data;}
+	size_t size() const                 {return m_size;}
+	T & operator[](size_t i)            {return m_data[i];}
+	const T & operator[](size_t i) const {return m_data[i];}
+
+private:
+	T * m_data;
+	size_t m_size;
+};
@@ -6,9 +6,11 @@
 
 #pragma once
 
+#include <algorithm>
 #include <iostream>
 #include <cmath>
 #include <Eigen/Core>
+#include "BufferPool.h"
 #include "Fwd.h"
 
 
@@ -218,6 +220,8 @@ public:
     Color4(const Color3 &c, float a) : Color3(c), a(a) {}
     explicit Color4(float x) : Color3(x), a(x) {}
     explicit Color4(const float* c) : Color3(c), a(c[3]) {}
+    template <typename Derived>
+    explicit Color4(const Eigen::ArrayBase<Derived> & c) {array() = c;}
     const Color4 & operator=(float c) {r = g = b = a = c; return *this;}
     //@}
 
@@ -237,100 +241,60 @@ public:
     const float & operator[](int i) const {return(&r)[i];}
     void set(float x) {r = g = b = a = x;}
     void set(float x, float y, float z, float w) {r = x; g = y; b = z; a = w;}
+
+    /// The four channels as an Eigen array. The arithmetic operators go through this view so that
+    /// Eigen vectorizes them with whatever SIMD instruction set (SSE, NEON, ...) the build targets.
+    Eigen::Map<Eigen::Array4f> array() {return Eigen::Map<Eigen::Array4f>(&r);}
+    Eigen::Map<const Eigen::Array4f> array() const {return Eigen::Map<const Eigen::Array4f>(&r);}
     //@}
 
 
     //-----------------------------------------------------------------------
     //@{ \name Addition.
     //-----------------------------------------------------------------------
-    Color4 operator+(const Color4& v) const
-    {
-        return {r + v.r, g + v.g, b + v.b, a + v.a};
-    }
-    const Color4 & operator+=(const Color4& v)
-    {
-        r += v.r; g += v.g; b += v.b; a += v.a; return *this;
-    }
-    const Color4 & operator+=(float c)
-    {
-        r += c; g += c; b += c; a += c; return *this;
-    }
+    Color4 operator+(const Color4& v) const {return Color4(array() + v.array());}
+    const Color4 & operator+=(const Color4& v) {array() += v.array(); return *this;}
+    const Color4 & operator+=(float c) {array() += c; return *this;}
     //@}
 
 
     //-----------------------------------------------------------------------
     //@{ \name Subtraction.
     //-----------------------------------------------------------------------
-    Color4 operator-(const Color4& v) const
-    {
-        return {r - v.r, g - v.g, b - v.b, a - v.a};
-    }
-    const Color4 & operator-=(const Color4& v)
-    {
-        r -= v.r; g -= v.g; b -= v.b; a -= v.a; return *this;
-    }
-    const Color4 & operator-=(float c)
-    {
-        r -= c; g -= c; b -= c; a -= c; return *this;
-    }
+    Color4 operator-(const Color4& v) const {return Color4(array() - v.array());}
+    const Color4 & operator-=(const Color4& v) {array() -= v.array(); return *this;}
+    const Color4 & operator-=(float c) {array() -= c; return *this;}
     //@}
 
 
     //-----------------------------------------------------------------------
     //@{ \name Multiplication.
     //-----------------------------------------------------------------------
-    Color4 operator*(float c) const
-    {
-        return {r * c, g * c, b * c, a * c};
-    }
-    Color4 operator*(const Color4& v) const
-    {
-        return Color4(r * v.r, g * v.g, b * v.b, a * v.a);
-    }
-    const Color4 & operator*=(float c)
-    {
-        r *= c; g *= c; b *= c; a *= c; return *this;
-    }
-    const Color4 & operator*=(const Color4& v)
-    {
-        r *= v.r; g *= v.g; b *= v.b; a *= v.a; return *this;
-    }
-    Color4 operator-() const {return {-r, -g, -b, -a};}
+    Color4 operator*(float c) const {return Color4(array() * c);}
+    Color4 operator*(const Color4& v) const {return Color4(array() * v.array());}
+    const Color4 & operator*=(float c) {array() *= c; return *this;}
+    const Color4 & operator*=(const Color4& v) {array() *= v.array(); return *this;}
+    Color4 operator-() const {return Color4(-array());}
     //@}
 
 
     //-----------------------------------------------------------------------
     //@{ \name Division.
     //-----------------------------------------------------------------------
-    Color4 operator/(float c) const
-    {
-        float inv = 1.0f / c;
-        return {r * inv, g * inv, b * inv, a * inv};
-    }
-    Color4 operator/(const Color4 & v) const
-    {
-        return {r / v.r, g / v.g, b / v.b, a / v.a};
-    }
-    const Color4 & operator/=(float c)
-    {
-        float inv = 1.0f / c;
-        r *= inv; g *= inv; b *= inv; a *= inv;
-        return *this;
-    }
-    const Color4 & operator/=(const Color4 & v)
-    {
-        r /= v.r; g /= v.g; b /= v.b; a /= v.a; return *this;
-    }
+    Color4 operator/(float c) const {return Color4(array() * (1.0f / c));}
+    Color4 operator/(const Color4 & v) const {return Color4(array() / v.array());}
+    const Color4 & operator/=(float c) {array() *= 1.0f / c; return *this;}
+    const Color4 & operator/=(const Color4 & v) {array() /= v.array(); return *this;}
     //@}
 
     float sum() const       {return r + g + b + a;}
     float average() const   {return sum() / 4.0f;}
     float min() const {return std::min(Color3::min(), a);}
-    Color4 min(const Color4 & m) const {return Color4(Color3::min(m), std::min(a,m.a));}
-    Color4 min(float m) const {return Color4(Color3::min(m), std::min(a,m));}
+    Color4 min(const Color4 & m) const {return Color4(array().min(m.array()));}
+    Color4 min(float m) const {return Color4(array().min(m));}
     float max() const {return std::max(Color3::max(), a);}
-    Color4 max(const Color4 & m) const {return Color4(Color3::max(m), std::max(a,m.a));}
-    Color4 max(float m) const {return Color4(Color3::max(m), std::max(a,m));}
+    Color4 max(const Color4 & m) const {return Color4(array().max(m.array()));}
+    Color4 max(float m) const {return Color4(array().max(m));}
 
 
 
@@ -364,7 +328,7 @@ public:
     }
     friend Color4 operator*(float s, const Color4& c)
     {
-	   return {c.r * s, c.g * s, c.b * s, c.a * s};
+	   return c * s;
     }
     friend Color4 operator+(float s, const Color4& c)
     {
@@ -376,6 +340,8 @@ public:
     }
 };
 
+static_assert(sizeof(Color4) == 4 * sizeof(float), "Color4 needs to be 4 tightly packed floats");
+
 
 #define COLOR_FUNCTION_WRAPPER(FUNC) \
     inline Color3 FUNC(const Color3 & c) \
@@ -475,4 +441,35 @@ template<> struct NumTraits<Color4>
     };
 };
 
+namespace internal
+{
+
+// The storage of dynamic-size arrays of Color4 (and so the pixels of every HDRImage) comes from the BufferPool.
+// Color4 is trivially constructible, so there are no elements to construct or destruct.
+#define POOLED_COLOR4_STORAGE(Align)                                                                            \
+template<> inline Color4 * conditional_aligned_new_auto<Color4, Align>(std::size_t size)                     \
+{                                                                                                             \
+    check_size_for_overflow<Color4>(size);                                                                    \
+    return size ? static_cast<Color4 *>(BufferPool::allocate(sizeof(Color4) * size)) : nullptr;             \
+}                                                                                                             \
+template<> inline void conditional_aligned_delete_auto<Color4, Align>(Color4 * ptr, std::size_t size)          \
+{                                                                                                             \
+    BufferPool::release(ptr, sizeof(Color4) * size);                                                          \
+}                                                                                                             \
+template<> inline Color4 * conditional_aligned_realloc_new_auto<Color4, Align>(Color4 * ptr, std::size_t newSize,\
+                                                                              std::size_t oldSize)          \
+{                                                                                                             \
+    Color4 * result = conditional_aligned_new_auto<Color4, Align>(newSize);                                  \
+    std::copy_n(ptr, std::min(newSize, oldSize), result);                                                     \
+    conditional_aligned_delete_auto<Color4, Align>(ptr, oldSize);                                             \
+    return result;                                                                                            \
+}
+
+POOLED_COLOR4_STORAGE(true)
+POOLED_COLOR4_STORAGE(false)
+
+#undef POOLED_COLOR4_STORAGE
+
+} // namespace internal
+
 } // namespace Eigen
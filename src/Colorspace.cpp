@@ -7,6 +7,8 @@
 #include "Colorspace.h"
 #include "Common.h"
 #include "Color.h"
+#include "PixelKernels.h"
+#include <algorithm>
 #include <cmath>
 
 namespace
@@ -93,6 +95,77 @@ Color4 SRGBToLinear(const Color4 &c)
 
 
 
+namespace
+{
+
+// raise pre(in) to the exponent in small blocks on the stack, and combine the results with the input using post
+template <typename Pre, typename Post>
+void transferBatch(const float * in, float * out, size_t n, float exponent, Pre pre, Post post)
+{
+	const size_t blockSize = 256;
+	float block[blockSize];
+	for (size_t i = 0; i < n; i += blockSize)
+	{
+		size_t m = std::min(blockSize, n - i);
+		for (size_t j = 0; j < m; ++j)
+			block[j] = pre(in[i + j]);
+		powValues(block, block, m, exponent);
+		for (size_t j = 0; j < m; ++j)
+			out[i + j] = post(in[i + j], block[j]);
+	}
+}
+
+} // namespace
+
+void SRGBToLinear(const float * in, float * out, size_t n)
+{
+	transferBatch(in, out, n, 2.4f,
+	              [](float a) {return (a + 0.055f) * (1.0f / 1.055f);},
+	              [](float a, float p) {return a < 0.04045f ? (1.0f / 12.92f) * a : p;});
+}
+
+void LinearToSRGB(const float * in, float * out, size_t n)
+{
+	transferBatch(in, out, n, 1.0f / 2.4f,
+	              [](float a) {return a;},
+	              [](float a, float p) {return a < 0.0031308f ? 12.92f * a : 1.055f * p - 0.055f;});
+}
+
+void AdobeRGBToLinear(const float * in, float * out, size_t n)
+{
+	powValues(out, in, n, 2.19921875f);
+}
+
+void LinearToAdobeRGB(const float * in, float * out, size_t n)
+{
+	powValues(out, in, n, 1.f / 2.19921875f);
+}
+
+const vector<float> & SRGBToLinearLUT8()
+{
+	static const vector<float> lut = []
+	{
+		vector<float> values(256);
+		for (size_t i = 0; i < values.size(); ++i)
+			values[i] = SRGBToLinear(i / 255.f);
+		return values;
+	}();
+	return lut;
+}
+
+const vector<float> & SRGBToLinearLUT16()
+{
+	static const vector<float> lut = []
+	{
+		vector<float> values(65536);
+		for (size_t i = 0; i < values.size(); ++i)
+			values[i] = SRGBToLinear(i / 65535.f);
+		return values;
+	}();
+	return lut;
+}
+
+
 Color3 LinearToAdobeRGB(const Color3 &c)
 {
 	return Color3(LinearToAdobeRGB(c.r), LinearToAdobeRGB(c.g), LinearToAdobeRGB(c.b));
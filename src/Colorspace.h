@@ -7,6 +7,7 @@
 #pragma once
 
 #include "Fwd.h"
+#include <cstddef>
 #include <string>
 #include <vector>
 
@@ -45,6 +46,19 @@ void LinearToAdobeRGB(float * r, float * g, float * b);
 Color3 LinearToAdobeRGB(const Color3 &c);
 Color4 LinearToAdobeRGB(const Color4 &c);
 
+// batch versions for the n floats starting at in, which may be the same array as out. These use a vectorized
+// approximation of pow, accurate to a few ulps (see powValues), map negative values to zero where pow would
+// give NaNs, and pass infinities and NaNs through.
+void SRGBToLinear(const float * in, float * out, size_t n);
+void LinearToSRGB(const float * in, float * out, size_t n);
+void AdobeRGBToLinear(const float * in, float * out, size_t n);
+void LinearToAdobeRGB(const float * in, float * out, size_t n);
+
+// exact linear values of all 8- and 16-bit sRGB encoded values, i.e. SRGBToLinear(i / 255.f) and
+// SRGBToLinear(i / 65535.f)
+const std::vector<float> & SRGBToLinearLUT8();
+const std::vector<float> & SRGBToLinearLUT16();
+
 // to and from XYZ
 void XYZToLinearSRGB(float *R, float *G, float *B, float X, float Y, float z);
 void LinearSRGBToXYZ(float *X, float *Y, float *Z, float R, float G, float B);
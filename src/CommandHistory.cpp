@@ -0,0 +1,308 @@
+//
+// Copyright (C) Wojciech Jarosz <wjarosz@gmail.com>. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can
+// be found in the LICENSE.txt file.
+//
+
+#include "CommandHistory.h"
+#include "ParallelFor.h"
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+#include <zlib.h>
+
+using namespace std;
+
+namespace
+{
+
+size_t imageBytes(const HDRImage & img)
+{
+	return img.isSingleChannel() ? img.intensity().size() * sizeof(float) : img.size() * sizeof(Color4);
+}
+
+// XOR the bits of a row of pixels into delta
+void toggleRow(uint32_t * delta, const Color4 * pixels, int width)
+{
+	vector<uint32_t> bits(size_t(width) * 4);
+	memcpy(bits.data(), pixels, bits.size() * sizeof(uint32_t));
+	for (size_t i = 0; i < bits.size(); ++i)
+		delta[i] ^= bits[i];
+}
+
+} // namespace
+
+
+size_t CommandHistory::s_memoryBudget = size_t(1024) << 20;
+
+
+shared_ptr<FILE> spillPixels(const HDRImage & img)
+{
+	shared_ptr<FILE> file(tmpfile(), [](FILE * f){if (f) fclose(f);});
+	if (!file)
+		throw runtime_error("cannot create a temporary file");
+
+	int32_t header[3] = {img.width(), img.height(), img.isSingleChannel()};
+	bool ok = fwrite(header, sizeof(header), 1, file.get()) == 1;
+	if (img.isSingleChannel())
+	{
+		auto values = img.intensity();
+		for (int y = 0; ok && y < img.height(); ++y)
+			ok = fwrite(values.data() + y * values.outerStride(), sizeof(float), img.width(), file.get()) == size_t(img.width());
+	}
+	else
+		ok = ok && fwrite(img.data(), sizeof(Color4), img.size(), file.get()) == size_t(img.size());
+
+	if (!ok || fflush(file.get()) != 0)
+		throw runtime_error("cannot write to the temporary file");
+	return file;
+}
+
+shared_ptr<HDRImage> unspillPixels(FILE * file)
+{
+	int32_t header[3];
+	if (fseek(file, 0, SEEK_SET) != 0 || fread(header, sizeof(header), 1, file) != 1)
+		throw runtime_error("cannot read the temporary file");
+
+	auto img = make_shared<HDRImage>();
+	bool ok;
+	if (header[2])
+	{
+		HDRImage::Intensity values(header[0], header[1]);
+		ok = fread(values.data(), sizeof(float), values.size(), file) == size_t(values.size());
+		img->setSingleChannel(move(values));
+	}
+	else
+	{
+		img->resize(header[0], header[1]);
+		ok = fread(img->data(), sizeof(Color4), img->size(), file) == size_t(img->size());
+	}
+
+	if (!ok)
+		throw runtime_error("cannot read the temporary file");
+	return img;
+}
+
+
+void FullImageUndo::undo(shared_ptr<HDRImage> & img)
+{
+	if (m_spillFile)
+	{
+		m_undoImage = unspillPixels(m_spillFile.get());
+		m_spillFile = nullptr;
+	}
+	img.swap(m_undoImage);
+}
+
+size_t FullImageUndo::bytes() const
+{
+	return m_spillFile ? 0 : imageBytes(*m_undoImage);
+}
+
+bool FullImageUndo::spill()
+{
+	if (m_spillFile)
+		return false;
+
+	try
+	{
+		m_spillFile = spillPixels(*m_undoImage);
+	}
+	catch (const exception &)
+	{
+		return false;
+	}
+	m_undoImage = nullptr;
+	return true;
+}
+
+
+TileDeltaUndo::TileDeltaUndo(const HDRImage & before, const HDRImage & after)
+{
+	if (before.width() != after.width() || before.height() != after.height() ||
+	    before.isSingleChannel() || after.isSingleChannel())
+		throw invalid_argument("TileDeltaUndo needs two four-channel images of the same size");
+
+	int w = after.width(), h = after.height();
+	int tilesX = (w + TileSize - 1) / TileSize, tilesY = (h + TileSize - 1) / TileSize;
+
+	vector<Tile> tiles(size_t(tilesX) * tilesY);
+	parallel_for(0, int(tiles.size()), [&](int i)
+	{
+		Tile & tile = tiles[i];
+		tile.x = (i % tilesX) * TileSize;
+		tile.y = (i / tilesX) * TileSize;
+		tile.width = min(TileSize, w - tile.x);
+		tile.height = min(TileSize, h - tile.y);
+		tile.compressed = false;
+		tile.offset = -1;
+		tile.size = 0;
+
+		bool changed = false;
+		for (int y = tile.y; y < tile.y + tile.height && !changed; ++y)
+			changed = memcmp(&before(tile.x, y), &after(tile.x, y), tile.width * sizeof(Color4)) != 0;
+		if (!changed)
+			return;
+
+		size_t rowWords = size_t(tile.width) * 4;
+		vector<uint32_t> delta(rowWords * tile.height, 0u);
+		for (int y = 0; y < tile.height; ++y)
+		{
+			toggleRow(delta.data() + y * rowWords, &before(tile.x, tile.y + y), tile.width);
+			toggleRow(delta.data() + y * rowWords, &after(tile.x, tile.y + y), tile.width);
+		}
+
+		// only keep the compressed version if it saves something
+		uLong rawSize = uLong(delta.size() * sizeof(uint32_t));
+		uLongf size = compressBound(rawSize);
+		tile.data.resize(size);
+		if (compress2(tile.data.data(), &size, reinterpret_cast<const Bytef *>(delta.data()), rawSize, Z_BEST_SPEED) == Z_OK &&
+		    size < rawSize)
+		{
+			tile.compressed = true;
+			tile.data.resize(size);
+		}
+		else
+		{
+			tile.data.resize(rawSize);
+			memcpy(tile.data.data(), delta.data(), rawSize);
+		}
+		tile.data.shrink_to_fit();
+		tile.size = tile.data.size();
+	});
+
+	for (auto & tile : tiles)
+		if (tile.size)
+			m_tiles.push_back(move(tile));
+}
+
+size_t TileDeltaUndo::bytes() const
+{
+	if (m_spillFile)
+		return 0;
+
+	size_t total = 0;
+	for (auto & tile : m_tiles)
+		total += tile.size;
+	return total;
+}
+
+bool TileDeltaUndo::changedRegions(vector<Eigen::AlignedBox2i> & regions) const
+{
+	regions.clear();
+	for (auto & tile : m_tiles)
+		regions.emplace_back(Eigen::Vector2i(tile.x, tile.y), Eigen::Vector2i(tile.x + tile.width, tile.y + tile.height));
+	return true;
+}
+
+bool TileDeltaUndo::spill()
+{
+	if (m_spillFile || m_tiles.empty())
+		return false;
+
+	shared_ptr<FILE> file(tmpfile(), [](FILE * f){if (f) fclose(f);});
+	if (!file)
+		return false;
+
+	long offset = 0;
+	for (auto & tile : m_tiles)
+	{
+		if (fwrite(tile.data.data(), 1, tile.size, file.get()) != tile.size)
+			return false;
+		tile.offset = offset;
+		offset += long(tile.size);
+	}
+	if (fflush(file.get()) != 0)
+		return false;
+
+	for (auto & tile : m_tiles)
+		vector<unsigned char>().swap(tile.data);
+	m_spillFile = file;
+	return true;
+}
+
+void TileDeltaUndo::restore()
+{
+	if (!m_spillFile)
+		return;
+
+	for (auto & tile : m_tiles)
+	{
+		tile.data.resize(tile.size);
+		if (fseek(m_spillFile.get(), tile.offset, SEEK_SET) != 0 ||
+		    fread(tile.data.data(), 1, tile.size, m_spillFile.get()) != tile.size)
+			throw runtime_error("cannot read the undo history back from its temporary file");
+	}
+	m_spillFile = nullptr;
+}
+
+void TileDeltaUndo::apply(shared_ptr<HDRImage> & img)
+{
+	restore();
+
+	// others (e.g. a texture upload) may still be reading the pixels
+	if (img.use_count() > 1)
+		img = make_shared<HDRImage>(*img);
+	HDRImage & image = *img;
+
+	parallel_for(0, int(m_tiles.size()), [&](int i)
+	{
+		const Tile & tile = m_tiles[i];
+		size_t rowWords = size_t(tile.width) * 4;
+		vector<uint32_t> delta(rowWords * tile.height);
+		uLongf size = uLongf(delta.size() * sizeof(uint32_t));
+		if (tile.compressed)
+			uncompress(reinterpret_cast<Bytef *>(delta.data()), &size, tile.data.data(), uLong(tile.size));
+		else
+			memcpy(delta.data(), tile.data.data(), tile.size);
+
+		for (int y = 0; y < tile.height; ++y)
+		{
+			Color4 * row = &image(tile.x, tile.y + y);
+			toggleRow(delta.data() + y * rowWords, row, tile.width);
+			memcpy(static_cast<void *>(row), delta.data() + y * rowWords, rowWords * sizeof(uint32_t));
+		}
+	});
+}
+
+
+UndoPtr createImageUndo(const HDRImage & before, const shared_ptr<const HDRImage> & after)
+{
+	if (after && after->width() == before.width() && after->height() == before.height() &&
+	    !before.isSingleChannel() && !after->isSingleChannel())
+		return make_shared<TileDeltaUndo>(before, *after);
+	return make_shared<FullImageUndo>(before);
+}
+
+
+size_t CommandHistory::bytes() const
+{
+	size_t total = 0;
+	for (auto & cmd : m_history)
+		total += cmd->bytes();
+	return total;
+}
+
+void CommandHistory::enforceMemoryBudget()
+{
+	if (!s_memoryBudget)
+		return;
+
+	// spill the oldest states first
+	size_t total = bytes();
+	for (size_t i = 0; i < m_history.size() && total > s_memoryBudget; ++i)
+	{
+		size_t b = m_history[i]->bytes();
+		if (b && m_history[i]->spill())
+			total -= b;
+	}
+
+	// and drop them if that didn't help
+	while (total > s_memoryBudget && !m_history.empty())
+	{
+		total -= m_history.front()->bytes();
+		m_history.erase(m_history.begin());
+		m_currentState--;
+		m_savedState--;
+	}
+}
@@ -7,7 +7,10 @@
 #pragma once
 
 #include <cstdint>             // for uint32_t
+#include <cstdio>              // for FILE
 #include <Eigen/Core>          // for Vector2i, Matrix4f, Vector3f
+#include <Eigen/Geometry>      // for AlignedBox2i
+#include <memory>              // for shared_ptr
 #include <vector>              // for vector, allocator
 #include "HDRImage.h"          // for HDRImage
 #include "Fwd.h"               // for HDRImage
@@ -20,6 +23,17 @@ public:
 
     virtual void undo(std::shared_ptr<HDRImage> & img) = 0;
     virtual void redo(std::shared_ptr<HDRImage> & img) = 0;
+
+    /// Bytes of pixel data held in memory
+    virtual size_t bytes() const {return 0;}
+    /// Move the pixel data to a temporary file, it is read back once it is needed. Returns false if not possible
+    virtual bool spill() {return false;}
+
+    /**
+     * The pixels [min, max) of each box are the only ones that undo and redo change (without changing the size
+     * of the image). Returns false if that is not known, i.e. everything may change.
+     */
+    virtual bool changedRegions(std::vector<Eigen::AlignedBox2i> & /*regions*/) const {return false;}
 };
 
 using UndoPtr = std::shared_ptr<ImageCommandUndo>;
@@ -29,6 +43,12 @@ using ImageCommand = std::function<ImageCommandResult(const std::shared_ptr<cons
 using ImageCommandWithProgress = std::function<ImageCommandResult(const std::shared_ptr<const HDRImage> &, AtomicProgress &)>;
 
 
+/// Write the pixels to an anonymous temporary file, which the system deletes once it is closed. Throws on failure
+std::shared_ptr<FILE> spillPixels(const HDRImage & img);
+/// Read back the pixels written by spillPixels. Throws on failure
+std::shared_ptr<HDRImage> unspillPixels(FILE * file);
+
+
 //! Brute-force undo: Saves the entire image data so that we can copy it back
 class FullImageUndo : public ImageCommandUndo
 {
@@ -36,15 +56,67 @@ public:
     explicit FullImageUndo(const HDRImage & img) : m_undoImage(std::make_shared<HDRImage>(img)) {}
     ~FullImageUndo() override = default;
 
-    void undo(std::shared_ptr<HDRImage> & img) override {img.swap(m_undoImage);}
+    void undo(std::shared_ptr<HDRImage> & img) override;
     void redo(std::shared_ptr<HDRImage> & img) override {undo(img);}
 
+    size_t bytes() const override;
+    bool spill() override;
+
 	const std::shared_ptr<HDRImage> image() const {return m_undoImage;}
 
 private:
     std::shared_ptr<HDRImage> m_undoImage;
+    std::shared_ptr<FILE> m_spillFile;      ///< Holds the pixels instead of m_undoImage once spilled
+};
+
+/*!
+ * Delta undo: Saves only the tiles of the image that a command changed
+ *
+ * Each changed tile is stored as the bitwise XOR of its pixels before and after the command, compressed with
+ * zlib whenever that makes it smaller. XORing it into the image again toggles between the two states, so undo and
+ * redo are the same operation, and regions that only changed in a few bits (or channels) compress well.
+ */
+class TileDeltaUndo : public ImageCommandUndo
+{
+public:
+    static const int TileSize = 64;
+
+    /// The images need to have the same size, and four channels
+    TileDeltaUndo(const HDRImage & before, const HDRImage & after);
+    ~TileDeltaUndo() override = default;
+
+    void undo(std::shared_ptr<HDRImage> & img) override {apply(img);}
+    void redo(std::shared_ptr<HDRImage> & img) override {apply(img);}
+
+    size_t bytes() const override;
+    bool spill() override;
+    bool changedRegions(std::vector<Eigen::AlignedBox2i> & regions) const override;
+
+    int numTiles() const    {return int(m_tiles.size());}
+
+private:
+    struct Tile
+    {
+        int x, y, width, height;
+        bool compressed;
+        std::vector<unsigned char> data;    ///< Empty once spilled
+        long offset;                        ///< Position in the spill file
+        size_t size;                        ///< Size of data, also while it is spilled
+    };
+
+    void apply(std::shared_ptr<HDRImage> & img);
+    void restore();
+
+    std::vector<Tile> m_tiles;
+    std::shared_ptr<FILE> m_spillFile;
 };
 
+/*!
+ * The cheapest undo for a command that turned before into after: a TileDeltaUndo if the command kept the size of
+ * the image, and a FullImageUndo otherwise.
+ */
+UndoPtr createImageUndo(const HDRImage & before, const std::shared_ptr<const HDRImage> & after);
+
 //! Specify the undo and redo commands using lambda expressions
 class LambdaUndo : public ImageCommandUndo
 {
@@ -61,7 +133,34 @@ private:
     std::function<void(std::shared_ptr<HDRImage> & img)> m_undo, m_redo;
 };
 
-//! Stores and manages an undo history list for image modifications
+/*!
+ * A change of the orientation the pixels are displayed with (see HDRImage::Orientation), which leaves the
+ * pixels themselves untouched. It reports no changed regions, so there is nothing to upload either.
+ */
+class OrientationUndo : public ImageCommandUndo
+{
+public:
+    /// @p orientation is where the owner of the history keeps the current orientation
+    OrientationUndo(HDRImage::Orientation & orientation, const HDRImage::Orientation & change) :
+        m_orientation(orientation), m_change(change) {}
+    ~OrientationUndo() override = default;
+
+    void undo(std::shared_ptr<HDRImage> &) override {m_orientation = m_orientation.then(m_change.inverse());}
+    void redo(std::shared_ptr<HDRImage> &) override {m_orientation = m_orientation.then(m_change);}
+
+    bool changedRegions(std::vector<Eigen::AlignedBox2i> & regions) const override {regions.clear(); return true;}
+
+private:
+    HDRImage::Orientation & m_orientation;
+    HDRImage::Orientation m_change;
+};
+
+/*!
+ * Stores and manages an undo history list for image modifications
+ *
+ * The pixel data of the history is kept within a memory budget (shared by all histories as a setting, but
+ * enforced per history): beyond it, the oldest states are spilled to temporary files, and dropped if that fails.
+ */
 class CommandHistory
 {
 public:
@@ -84,6 +183,9 @@ public:
     int size() const            {return m_history.size();}
     bool hasUndo() const        {return m_currentState > 0;}
     bool hasRedo() const        {return m_currentState < size();}
+    /// The command that undo() and redo() would apply next, or nullptr
+    const ImageCommandUndo * undoCommand() const    {return hasUndo() ? m_history[m_currentState - 1].get() : nullptr;}
+    const ImageCommandUndo * redoCommand() const    {return hasRedo() ? m_history[m_currentState].get() : nullptr;}
 
     void addCommand(UndoPtr cmd)
     {
@@ -93,8 +195,17 @@ public:
         // add the new command and increment state
         m_history.push_back(std::move(cmd));
         m_currentState++;
+
+        enforceMemoryBudget();
     }
 
+    /// Bytes of pixel data held in memory by the whole history
+    size_t bytes() const;
+
+    /// Budget in bytes for the pixel data of each history in memory. A budget of zero means unlimited.
+    static size_t memoryBudget()                {return s_memoryBudget;}
+    static void setMemoryBudget(size_t bytes)   {s_memoryBudget = bytes;}
+
     bool undo(std::shared_ptr<HDRImage> & img)
     {
         // check if there is anything to undo
@@ -115,6 +226,8 @@ public:
     }
 
 private:
+    void enforceMemoryBudget();
+
     std::vector<UndoPtr> m_history;
 
     // it is best to think of this state as pointing in between the entries in the m_history vector
@@ -122,5 +235,7 @@ private:
     // m_currentState == 0 indicates that there is nothing to undo
     // m_currentState == size() indicates that there is nothing to redo
     int m_currentState;
-    int m_savedState;
+    int m_savedState;       ///< Negative if the saved state has been dropped from the history
+
+    static size_t s_memoryBudget;
 };
\ No newline at end of file
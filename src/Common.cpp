@@ -5,6 +5,7 @@
 //
 
 #include "Common.h"
+#include <cstdio>
 #include <regex>
 
 using namespace std;
@@ -112,47 +113,65 @@ string toUpper(string str)
     return str;
 }
 
-bool matches(string text, string filter, bool isRegex)
+string jsonString(const string & s)
 {
-    auto matchesFuzzy = [](string text, string filter)
+    string escaped = "\"";
+    for (char c : s)
+    {
+        if (c == '"' || c == '\\')
+            escaped += string("\\") + c;
+        else if ((unsigned char) c < 0x20)
         {
-            if (filter.empty())
-                return true;
+            char code[7];
+            snprintf(code, sizeof(code), "\\u%04x", int(c));
+            escaped += code;
+        }
+        else
+            escaped += c;
+    }
+    return escaped + "\"";
+}
 
-            // Perform matching on lowercase strings
-            text = toLower(text);
-            filter = toLower(filter);
+bool matches(string text, string filter, bool isRegex)
+{
+    return matcher(filter, isRegex)(text);
+}
 
-            auto words = split(filter, ", ");
-            // We don't want people entering multiple spaces in a row to match everything.
-            words.erase(remove(begin(words), end(words), ""), end(words));
+function<bool(const string & text)> matcher(const string & filter, bool isRegex)
+{
+    if (filter.empty())
+        return [](const string &){return true;};
 
-            if (words.empty())
-                return true;
+    if (isRegex)
+    {
+        shared_ptr<const regex> searchRegex;
+        try
+        {
+            searchRegex = make_shared<regex>(filter, std::regex_constants::ECMAScript | std::regex_constants::icase);
+        }
+        catch (const regex_error&)
+        {
+            return [](const string &){return false;};
+        }
+        return [searchRegex](const string & text){return regex_search(text, *searchRegex);};
+    }
+
+    // Perform matching on lowercase strings
+    auto words = split(toLower(filter), ", ");
+    // We don't want people entering multiple spaces in a row to match everything.
+    words.erase(remove(begin(words), end(words), ""), end(words));
+
+    if (words.empty())
+        return [](const string &){return true;};
 
+    return [words](const string & text)
+        {
             // Match every word of the filter separately.
+            string lower = toLower(text);
             for (const auto& word : words)
-                if (text.find(word) != string::npos)
+                if (lower.find(word) != string::npos)
                     return true;
 
             return false;
         };
-
-    auto matchesRegex = [](string text, string filter)
-        {
-            if (filter.empty())
-                return true;
-
-            try
-            {
-                regex searchRegex{filter, std::regex_constants::ECMAScript | std::regex_constants::icase};
-                return regex_search(text, searchRegex);
-            }
-            catch (const regex_error&)
-            {
-                return false;
-            }
-        };
-
-    return isRegex ? matchesRegex(text, filter) : matchesFuzzy(text, filter);
 }
\ No newline at end of file
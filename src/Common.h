@@ -16,6 +16,7 @@
 #include <vector>
 #include <algorithm>
 #include <memory>
+#include <functional>
 #include "Fwd.h"
 
 
@@ -365,7 +366,11 @@ inline int codePointLength(char first)
 std::vector<std::string> split(std::string text, const std::string& delim);
 std::string toLower(std::string str);
 std::string toUpper(std::string str);
+/// The string as a quoted JSON string literal, with quotes, backslashes and control characters escaped
+std::string jsonString(const std::string & s);
 bool matches(std::string text, std::string filter, bool isRegex);
+/// A predicate equivalent to matches(text, filter, isRegex), which parses (or compiles) the filter only once
+std::function<bool(const std::string & text)> matcher(const std::string & filter, bool isRegex);
 
 
 enum EDirection
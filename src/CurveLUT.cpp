@@ -0,0 +1,53 @@
+//
+// Copyright (C) Wojciech Jarosz <wjarosz@gmail.com>. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can
+// be found in the LICENSE.txt file.
+//
+
+#include "CurveLUT.h"
+#include "Common.h"
+#include <algorithm>
+#include <cmath>
+
+using namespace std;
+
+constexpr int CurveLUT::Size;
+constexpr float CurveLUT::MaxValue;
+constexpr float CurveLUT::Epsilon;
+
+CurveLUT::CurveLUT(const function<float(float)> & curve) :
+	m_values(Size)
+{
+	float maxWarp = warp(MaxValue);
+	for (int i = 0; i < Size; ++i)
+		m_values[i] = curve(unwarp(maxWarp * (2.f * i / (Size - 1) - 1.f)));
+}
+
+/*!
+ * Linearly interpolate the two entries around v. This mirrors lookupCurve in the fragment shader of
+ * ImageShader, so keep the two in sync.
+ */
+float CurveLUT::lookup(float v) const
+{
+	if (std::isnan(v))
+		return v;
+
+	float maxWarp = warp(MaxValue);
+	float x = (::clamp(warp(v), -maxWarp, maxWarp) / maxWarp * 0.5f + 0.5f) * (Size - 1);
+	int i = std::min(int(std::floor(x)), Size - 2);
+	float t = x - float(i);
+	// don't let a curve that is undefined for some values (e.g. a power of negative values) leak into its neighbors
+	if (t == 0.f)
+		return m_values[i];
+	return m_values[i] + t * (m_values[i + 1] - m_values[i]);
+}
+
+float CurveLUT::warp(float v)
+{
+	return std::copysign(std::log2(1.f + std::abs(v) / Epsilon), v);
+}
+
+float CurveLUT::unwarp(float w)
+{
+	return std::copysign((std::exp2(std::abs(w)) - 1.f) * Epsilon, w);
+}
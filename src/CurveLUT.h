@@ -0,0 +1,45 @@
+//
+// Copyright (C) Wojciech Jarosz <wjarosz@gmail.com>. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can
+// be found in the LICENSE.txt file.
+//
+
+#pragma once
+
+#include <functional>
+#include <vector>
+#include "Color.h"
+
+/*!
+ * @brief A tone curve applied to each color channel, baked into a lookup table.
+ *
+ * The table samples the curve uniformly in the warped domain sign(v) * log2(1 + |v|/Epsilon), which is linear
+ * around zero and logarithmic for large magnitudes, so its entries cover the whole range of HDR values with a
+ * spacing of about one percent of the value. Values beyond +-MaxValue are clamped to it.
+ *
+ * The same table is uploaded as a texture to preview the curve on the GPU (see ImageShader::Adjustment), and
+ * lookup() interpolates it like the shader does, so applying the curve to an image matches its preview.
+ */
+class CurveLUT
+{
+public:
+	static constexpr int Size = 4097;           ///< Number of entries, odd so that zero is one of them
+	static constexpr float MaxValue = 1048576.f;
+	static constexpr float Epsilon = 1.f / 1024.f;
+
+	/// The identity curve
+	CurveLUT() : CurveLUT([](float v){return v;}) {}
+	explicit CurveLUT(const std::function<float(float)> & curve);
+
+	float lookup(float v) const;
+	Color4 lookup(const Color4 & c) const       {return Color4(lookup(c.r), lookup(c.g), lookup(c.b), c.a);}
+
+	/// The Size values of the curve, at equally spaced warped inputs from -warp(MaxValue) to warp(MaxValue)
+	const std::vector<float> & values() const   {return m_values;}
+
+	static float warp(float v);
+	static float unwarp(float w);
+
+private:
+	std::vector<float> m_values;
+};
@@ -0,0 +1,313 @@
+//
+// Copyright (C) Wojciech Jarosz <wjarosz@gmail.com>. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can
+// be found in the LICENSE.txt file.
+//
+
+#include "DifferenceShader.h"
+#include "HDRImage.h"
+#include "Timer.h"
+#include <algorithm>
+#include <climits>
+#include <cmath>
+#include <limits>
+#include <spdlog/spdlog.h>
+
+using namespace nanogui;
+using namespace Eigen;
+using namespace std;
+
+namespace
+{
+
+// the render targets hold Columns x Rows partial results, pixel p goes into texel p % Cells
+const int Columns = 1024;
+const int Rows = 16;
+const int Cells = Columns * Rows;
+// Number of points to draw per call, to avoid stalling the GPU for too long at once
+const int BatchSize = 1 << 22;
+
+// One point per pixel of the region, whose blended value is computed like in ImageShader's fragment shader
+constexpr char const *const vertexShader =
+R"(#version 330
+
+    uniform sampler2D image;
+    uniform sampler2D reference;
+    uniform sampler2D colormap;
+    uniform bool imageSingleChannel;
+    uniform vec2 imageRange;
+    uniform int imageColormap;
+    uniform mat3 imageOrientation;
+    uniform bool referenceSingleChannel;
+    uniform vec2 referenceRange;
+    uniform int referenceColormap;
+    uniform mat3 referenceOrientation;
+
+    uniform ivec2 regionMin;
+    uniform int regionWidth;
+    uniform vec2 imageSize;
+    uniform vec2 referenceSize;
+    uniform vec2 referenceOffset;
+    uniform int blendMode;
+    uniform bool rangePass;
+
+    flat out vec4 value;
+
+    vec4 singleChannelColor(float v, vec2 range, int map)
+    {
+        if (isnan(v) || v < range.x)
+            return vec4(0.0);
+        // clamp before converting, since infinite values don't fit in an int
+        float t = range.y > 0.0 ? min(255.0 * (v - range.x) / range.y, 255.0) : 0.0;
+        return texelFetch(colormap, ivec2(int(round(t)), map), 0);
+    }
+
+    vec4 sampleImage(sampler2D tex, vec2 uv, mat3 orientation, bool singleChannel, vec2 range, int map)
+    {
+        if (any(lessThan(uv, vec2(0.0))) || any(greaterThan(uv, vec2(1.0))))
+            return vec4(0.0);
+        vec4 value = texture(tex, (orientation * vec3(uv, 1.0)).xy);
+        return singleChannel ? singleChannelColor(value.r, range, map) : value;
+    }
+
+    vec3 blend(vec4 imageVal, vec4 referenceVal)
+    {
+        vec3 diff = imageVal.rgb - referenceVal.rgb;
+        switch (blendMode)
+        {
+            case NORMAL_BLEND:              return imageVal.rgb*imageVal.a + referenceVal.rgb*referenceVal.a*(1-imageVal.a);
+            case MULTIPLY_BLEND:            return imageVal.rgb * referenceVal.rgb;
+            case DIVIDE_BLEND:              return imageVal.rgb / referenceVal.rgb;
+            case ADD_BLEND:                 return imageVal.rgb + referenceVal.rgb;
+            case AVERAGE_BLEND:             return 0.5*(imageVal.rgb + referenceVal.rgb);
+            case SUBTRACT_BLEND:            return diff;
+            case DIFFERENCE_BLEND:          return abs(diff);
+            case RELATIVE_DIFFERENCE_BLEND: return abs(diff) / (referenceVal.rgb + vec3(0.01));
+        }
+        return vec3(0.0);
+    }
+
+    void main()
+    {
+        int p = gl_VertexID;
+        vec2 pixel = vec2(regionMin + ivec2(p % regionWidth, p / regionWidth)) + 0.5;
+        vec3 v = blend(sampleImage(image, pixel / imageSize, imageOrientation, imageSingleChannel, imageRange, imageColormap),
+                       sampleImage(reference, (pixel + referenceOffset) / referenceSize, referenceOrientation,
+                                   referenceSingleChannel, referenceRange, referenceColormap));
+
+        // pixels without a finite value are clipped away
+        if (any(isnan(v)) || any(isinf(v)))
+        {
+            gl_Position = vec4(2.0, 2.0, 0.0, 1.0);
+            return;
+        }
+
+        value = rangePass ? vec4(max(max(v.r, v.g), v.b), -min(min(v.r, v.g), v.b), 0.0, 0.0)
+                          : vec4(dot(v, vec3(1.0/3.0)), dot(v*v, vec3(1.0/3.0)), 1.0, 0.0);
+
+        int i = p % CELLS;
+        vec2 cell = vec2(i % COLUMNS, i / COLUMNS);
+        gl_Position = vec4((cell + 0.5) / vec2(COLUMNS, ROWS) * 2.0 - 1.0, 0.0, 1.0);
+    }
+)";
+
+constexpr char const *const fragmentShader =
+R"(#version 330
+
+    flat in vec4 value;
+    out vec4 out_color;
+
+    void main()
+    {
+        out_color = value;
+    }
+)";
+
+GLuint createTexture(int width, int height, const GLvoid * data)
+{
+	GLuint id;
+	glGenTextures(1, &id);
+	glBindTexture(GL_TEXTURE_2D, id);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F, width, height, 0, GL_RGBA, GL_FLOAT, data);
+	return id;
+}
+
+void bindTexture(GLShader & shader, const char * name, int unit, GLuint id)
+{
+	glActiveTexture(GL_TEXTURE0 + unit);
+	glBindTexture(GL_TEXTURE_2D, id);
+	shader.setUniform(name, unit);
+}
+
+} // namespace
+
+#define DEFINE_PARAMS(parent,name) m_shader.define(#name, to_string(parent::name))
+
+DifferenceShader::DifferenceShader()
+{
+	DEFINE_PARAMS(EBlendMode, NORMAL_BLEND);
+	DEFINE_PARAMS(EBlendMode, MULTIPLY_BLEND);
+	DEFINE_PARAMS(EBlendMode, DIVIDE_BLEND);
+	DEFINE_PARAMS(EBlendMode, ADD_BLEND);
+	DEFINE_PARAMS(EBlendMode, AVERAGE_BLEND);
+	DEFINE_PARAMS(EBlendMode, SUBTRACT_BLEND);
+	DEFINE_PARAMS(EBlendMode, DIFFERENCE_BLEND);
+	DEFINE_PARAMS(EBlendMode, RELATIVE_DIFFERENCE_BLEND);
+	m_shader.define("COLUMNS", to_string(Columns));
+	m_shader.define("ROWS", to_string(Rows));
+	m_shader.define("CELLS", to_string(Cells));
+
+	if (!m_shader.init("Difference statistics", vertexShader, fragmentShader))
+	{
+		spdlog::get("console")->warn("Could not compile the difference statistics shader.");
+		return;
+	}
+
+	// the sums, and the maximum and (negated) minimum
+	m_targets[0] = createTexture(Columns, Rows, nullptr);
+	m_targets[1] = createTexture(Columns, Rows, nullptr);
+
+	// the false-color maps for single-channel images, one per row like in ImageShader
+	vector<Color4> colors;
+	for (int c = 0; c < HDRImage::NUM_COLORMAPS; ++c)
+	{
+		const vector<Color4> & map = HDRImage::singleChannelColormap(HDRImage::Colormap(c));
+		colors.insert(colors.end(), map.begin(), map.end());
+	}
+	m_colormapTexture = createTexture(256, HDRImage::NUM_COLORMAPS, colors.data());
+	glBindTexture(GL_TEXTURE_2D, 0);
+
+	GLint previousFramebuffer;
+	glGetIntegerv(GL_FRAMEBUFFER_BINDING, &previousFramebuffer);
+
+	bool complete = true;
+	glGenFramebuffers(2, m_framebuffers);
+	for (int i = 0; i < 2; ++i)
+	{
+		glBindFramebuffer(GL_FRAMEBUFFER, m_framebuffers[i]);
+		glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, m_targets[i], 0);
+		complete = complete && glCheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE;
+	}
+
+	glBindFramebuffer(GL_FRAMEBUFFER, previousFramebuffer);
+
+	if (!complete)
+		spdlog::get("console")->warn("Floating-point render targets are not supported. Difference statistics are not available.");
+	m_valid = complete;
+}
+
+DifferenceShader::~DifferenceShader()
+{
+	m_shader.free();
+	glDeleteFramebuffers(2, m_framebuffers);
+	glDeleteTextures(2, m_targets);
+	glDeleteTextures(1, &m_colormapTexture);
+}
+
+bool DifferenceShader::compute(const ImageShader::Texture & image, const Vector2i & imageSize,
+                               const ImageShader::Texture & reference, const Vector2i & referenceSize,
+                               EBlendMode mode, const Vector2i & regionMin, const Vector2i & regionMax,
+                               DifferenceStatistics & statistics)
+{
+	Vector2i lo = regionMin.cwiseMax(Vector2i::Zero());
+	Vector2i hi = regionMax.cwiseMin(imageSize);
+	if (!m_valid || !image.id || !reference.id || (hi.array() <= lo.array()).any() ||
+	    (referenceSize.array() <= 0).any())
+		return false;
+
+	// the vertex ids need to fit in an int
+	long long numPixels = (long long) (hi.x() - lo.x()) * (hi.y() - lo.y());
+	if (numPixels > INT_MAX)
+		return false;
+
+	Timer timer;
+
+	// save the state we are about to change
+	GLint previousFramebuffer, viewport[4];
+	glGetIntegerv(GL_FRAMEBUFFER_BINDING, &previousFramebuffer);
+	glGetIntegerv(GL_VIEWPORT, viewport);
+	GLboolean blend = glIsEnabled(GL_BLEND);
+	GLboolean scissor = glIsEnabled(GL_SCISSOR_TEST);
+	GLboolean depth = glIsEnabled(GL_DEPTH_TEST);
+
+	glDisable(GL_SCISSOR_TEST);
+	glDisable(GL_DEPTH_TEST);
+	glEnable(GL_BLEND);
+	glBlendFunc(GL_ONE, GL_ONE);
+	glViewport(0, 0, Columns, Rows);
+
+	m_shader.bind();
+	bindTexture(m_shader, "image", 0, image.id);
+	bindTexture(m_shader, "reference", 1, reference.id);
+	bindTexture(m_shader, "colormap", 2, m_colormapTexture);
+	m_shader.setUniform("imageSingleChannel", (int)image.singleChannel);
+	m_shader.setUniform("imageRange", image.range);
+	m_shader.setUniform("imageColormap", image.colormap);
+	m_shader.setUniform("imageOrientation", image.orientation);
+	m_shader.setUniform("referenceSingleChannel", (int)reference.singleChannel);
+	m_shader.setUniform("referenceRange", reference.range);
+	m_shader.setUniform("referenceColormap", reference.colormap);
+	m_shader.setUniform("referenceOrientation", reference.orientation);
+	m_shader.setUniform("regionMin", lo);
+	m_shader.setUniform("regionWidth", hi.x() - lo.x());
+	m_shader.setUniform("imageSize", Vector2f(imageSize.cast<float>()));
+	m_shader.setUniform("referenceSize", Vector2f(referenceSize.cast<float>()));
+	// the viewer centers both images, so the reference is shifted by half the difference in size
+	m_shader.setUniform("referenceOffset", Vector2f((referenceSize - imageSize).cast<float>() / 2));
+	m_shader.setUniform("blendMode", (int)mode);
+
+	const GLfloat zero[] = {0.f, 0.f, 0.f, 0.f};
+	const GLfloat lowest[] = {-numeric_limits<float>::max(), -numeric_limits<float>::max(),
+	                          -numeric_limits<float>::max(), -numeric_limits<float>::max()};
+	vector<GLfloat> results[2];
+	for (int pass = 0; pass < 2; ++pass)
+	{
+		glBindFramebuffer(GL_FRAMEBUFFER, m_framebuffers[pass]);
+		glClearBufferfv(GL_COLOR, 0, pass == 0 ? zero : lowest);
+		glBlendEquation(pass == 0 ? GL_FUNC_ADD : GL_MAX);
+		m_shader.setUniform("rangePass", pass);
+		for (long long first = 0; first < numPixels; first += BatchSize)
+			m_shader.drawArray(GL_POINTS, int(first), int(min<long long>(BatchSize, numPixels - first)));
+
+		results[pass].resize(4 * Cells);
+		glReadBuffer(GL_COLOR_ATTACHMENT0);
+		glReadPixels(0, 0, Columns, Rows, GL_RGBA, GL_FLOAT, results[pass].data());
+	}
+
+	// restore the state
+	glBindFramebuffer(GL_FRAMEBUFFER, previousFramebuffer);
+	glViewport(viewport[0], viewport[1], viewport[2], viewport[3]);
+	glBlendEquation(GL_FUNC_ADD);
+	glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+	if (!blend) glDisable(GL_BLEND);
+	if (scissor) glEnable(GL_SCISSOR_TEST);
+	if (depth) glEnable(GL_DEPTH_TEST);
+
+	// merge the partial results
+	double sum = 0, sumSquares = 0, count = 0;
+	float maximum = -numeric_limits<float>::max(), negMinimum = -numeric_limits<float>::max();
+	for (int i = 0; i < Cells; ++i)
+	{
+		sum += results[0][4 * i + 0];
+		sumSquares += results[0][4 * i + 1];
+		count += results[0][4 * i + 2];
+		maximum = max(maximum, results[1][4 * i + 0]);
+		negMinimum = max(negMinimum, results[1][4 * i + 1]);
+	}
+
+	statistics = DifferenceStatistics();
+	statistics.numPixels = int(count);
+	if (count > 0)
+	{
+		statistics.mean = sum / count;
+		statistics.rmse = sqrt(sumSquares / count);
+		statistics.minimum = -negMinimum;
+		statistics.maximum = maximum;
+	}
+
+	spdlog::get("console")->trace("Computing the difference statistics on the GPU took {} seconds.", (timer.elapsed() / 1000.f));
+	return true;
+}
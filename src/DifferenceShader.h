@@ -0,0 +1,59 @@
+//
+// Copyright (C) Wojciech Jarosz <wjarosz@gmail.com>. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can
+// be found in the LICENSE.txt file.
+//
+
+#pragma once
+
+#include <nanogui/opengl.h>
+#include <nanogui/glutil.h>
+#include <Eigen/Core>
+#include "Common.h"
+#include "ImageShader.h"
+
+/// Statistics of the blend of an image with a reference, over the RGB channels of the pixels of a region
+struct DifferenceStatistics
+{
+	int numPixels = 0;      ///< Number of pixels with a finite blended value, only these make it into the statistics
+	double mean = 0;
+	double rmse = 0;        ///< Root of the mean of the squared blended values
+	double minimum = 0;
+	double maximum = 0;
+};
+
+/*!
+ * Computes DifferenceStatistics of an image and a reference that are already resident on the GPU, for
+ * showing error numbers live while comparing images.
+ *
+ * The two textures are blended exactly like ImageShader displays them, with the reference centered on the
+ * image. Each pixel of the region is scattered as a point into a small floating-point render target, with
+ * additive blending for the sums and a second pass with GL_MAX blending for the range, so nothing but a few
+ * thousand partial results ever goes back to the CPU.
+ *
+ * Needs a current OpenGL context.
+ */
+class DifferenceShader
+{
+public:
+	DifferenceShader();
+	~DifferenceShader();
+
+	/*!
+	 * Compute the statistics of blending image with reference using mode, over the pixels [regionMin, regionMax)
+	 * of the image (clamped to the image).
+	 *
+	 * @return False if the GPU path cannot handle this, e.g. because the region is empty
+	 */
+	bool compute(const ImageShader::Texture & image, const Eigen::Vector2i & imageSize,
+	             const ImageShader::Texture & reference, const Eigen::Vector2i & referenceSize,
+	             EBlendMode mode, const Eigen::Vector2i & regionMin, const Eigen::Vector2i & regionMax,
+	             DifferenceStatistics & statistics);
+
+private:
+	nanogui::GLShader m_shader;
+	GLuint m_framebuffers[2] = {0, 0};
+	GLuint m_targets[2] = {0, 0};
+	GLuint m_colormapTexture = 0;
+	bool m_valid = false;
+};
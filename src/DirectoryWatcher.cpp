@@ -0,0 +1,239 @@
+//
+// Copyright (C) Wojciech Jarosz <wjarosz@gmail.com>. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can
+// be found in the LICENSE.txt file.
+//
+
+#include "DirectoryWatcher.h"
+#include "Timer.h"
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <cstdlib>
+#include <stdexcept>
+#include <thread>
+#include <sys/stat.h>
+
+#if defined(_WIN32)
+#define NOMINMAX
+#include <windows.h>
+#elif defined(__linux__)
+#include <poll.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+#endif
+
+#include <tinydir.h>
+
+using namespace std;
+
+namespace
+{
+
+// how long to wait for a changed file to settle before scanning again
+const int SettleTime = 500;
+// how often to scan the directory without notifications from the operating system
+const int PollInterval = 1000;
+
+} // namespace
+
+
+string canonicalPath(const string & path)
+{
+#if defined(_WIN32)
+	char * result = _fullpath(nullptr, path.c_str(), 0);
+#else
+	char * result = realpath(path.c_str(), nullptr);
+#endif
+	if (!result)
+		return path;
+	string canonical = result;
+	free(result);
+	return canonical;
+}
+
+bool fileStamp(const string & filename, FileStamp & stamp)
+{
+	// a file rewritten within the same second must still count as changed, so use the full precision
+#if defined(_WIN32)
+	WIN32_FILE_ATTRIBUTE_DATA data;
+	if (!GetFileAttributesExA(filename.c_str(), GetFileExInfoStandard, &data))
+		return false;
+	// FILETIMEs count 100 ns intervals since 1601
+	int64_t ticks = (int64_t(data.ftLastWriteTime.dwHighDateTime) << 32) | data.ftLastWriteTime.dwLowDateTime;
+	stamp.size = (int64_t(data.nFileSizeHigh) << 32) | data.nFileSizeLow;
+	stamp.modified = (ticks - 116444736000000000LL) * 100;
+#else
+	struct stat st;
+	if (stat(filename.c_str(), &st) != 0)
+		return false;
+#if defined(__APPLE__)
+	const timespec & mtime = st.st_mtimespec;
+#else
+	const timespec & mtime = st.st_mtim;
+#endif
+	stamp.size = int64_t(st.st_size);
+	stamp.modified = int64_t(mtime.tv_sec) * 1000000000 + mtime.tv_nsec;
+#endif
+	return true;
+}
+
+
+DirectoryWatcher::DirectoryWatcher(const string & directory, const set<string> & extensions) :
+	m_directory(canonicalPath(directory)), m_extensions(extensions)
+{
+	tinydir_dir dir;
+	if (tinydir_open(&dir, m_directory.c_str()) == -1)
+		throw runtime_error("DirectoryWatcher: Cannot open directory '" + directory + "'");
+	tinydir_close(&dir);
+
+#if defined(__linux__)
+	// files written in place are complete once closed, and files moved in are complete already
+	m_notify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (m_notify >= 0 &&
+	    inotify_add_watch(m_notify, m_directory.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE | IN_MODIFY) < 0)
+	{
+		close(m_notify);
+		m_notify = -1;
+	}
+#elif defined(_WIN32)
+	HANDLE changes = FindFirstChangeNotificationA(m_directory.c_str(), FALSE,
+	                                              FILE_NOTIFY_CHANGE_FILE_NAME | FILE_NOTIFY_CHANGE_SIZE |
+	                                              FILE_NOTIFY_CHANGE_LAST_WRITE);
+	if (changes != INVALID_HANDLE_VALUE)
+		m_changes = changes;
+#endif
+}
+
+DirectoryWatcher::~DirectoryWatcher()
+{
+#if defined(__linux__)
+	if (m_notify >= 0)
+		close(m_notify);
+#elif defined(_WIN32)
+	if (m_changes)
+		FindCloseChangeNotification(m_changes);
+#endif
+}
+
+void DirectoryWatcher::setHandled(const string & path, const FileStamp & stamp)
+{
+	Entry & e = m_files[path];
+	e.seen = e.reported = stamp;
+}
+
+void DirectoryWatcher::ignore(const string & path)
+{
+	m_ignored.insert(canonicalPath(path));
+}
+
+vector<string> DirectoryWatcher::waitForChanges(int milliseconds)
+{
+	Timer timer;
+	while (true)
+	{
+		vector<string> changed = scan();
+		int remaining = milliseconds - int(timer.elapsed());
+		if (!changed.empty() || remaining <= 0)
+			return changed;
+
+		if (pending())
+		{
+			this_thread::sleep_for(chrono::milliseconds(min(remaining, SettleTime)));
+			drainEvents();
+		}
+		else if (!wait(remaining))
+			return changed;
+	}
+}
+
+/// Update the stamps of all files, returning the ones that are done changing since they were last reported
+vector<string> DirectoryWatcher::scan()
+{
+	vector<string> changed;
+	set<string> present;
+
+	tinydir_dir dir;
+	if (tinydir_open(&dir, m_directory.c_str()) == -1)
+		return changed;
+
+	for (; dir.has_next; tinydir_next(&dir))
+	{
+		tinydir_file file;
+		if (tinydir_readfile(&dir, &file) == -1)
+			break;
+
+		string ext = file.extension;
+		transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
+		if (!file.is_reg || file.name[0] == '.' || !m_extensions.count(ext) || m_ignored.count(file.path))
+			continue;
+
+		FileStamp stamp;
+		if (!fileStamp(file.path, stamp))
+			continue;
+
+		present.insert(file.path);
+		Entry & e = m_files[file.path];
+		if (e.seen != stamp)
+			e.seen = stamp;
+		else if (e.reported != stamp)
+		{
+			e.reported = stamp;
+			changed.push_back(file.path);
+		}
+	}
+	tinydir_close(&dir);
+
+	// forget removed files, so they are reported again if they come back
+	for (auto it = m_files.begin(); it != m_files.end();)
+		it = present.count(it->first) ? next(it) : m_files.erase(it);
+
+	sort(changed.begin(), changed.end());
+	return changed;
+}
+
+bool DirectoryWatcher::pending() const
+{
+	for (const auto & f : m_files)
+		if (f.second.seen != f.second.reported)
+			return true;
+	return false;
+}
+
+bool DirectoryWatcher::wait(int milliseconds)
+{
+#if defined(__linux__)
+	if (m_notify >= 0)
+	{
+		pollfd fd = {m_notify, POLLIN, 0};
+		int ready = poll(&fd, 1, milliseconds);
+		if (ready < 0)
+			return errno != EINTR;
+		drainEvents();
+		return true;
+	}
+#elif defined(_WIN32)
+	if (m_changes)
+	{
+		// the notification is re-armed right away, the scan finds out what changed
+		if (WaitForSingleObject(m_changes, DWORD(milliseconds)) == WAIT_OBJECT_0)
+			FindNextChangeNotification(m_changes);
+		return true;
+	}
+#endif
+	this_thread::sleep_for(chrono::milliseconds(min(milliseconds, PollInterval)));
+	return true;
+}
+
+void DirectoryWatcher::drainEvents()
+{
+#if defined(__linux__)
+	// the events only serve as a wake-up call, the scan finds out what changed
+	char buffer[4096];
+	while (m_notify >= 0 && read(m_notify, buffer, sizeof(buffer)) > 0)
+		continue;
+#elif defined(_WIN32)
+	while (m_changes && WaitForSingleObject(m_changes, 0) == WAIT_OBJECT_0)
+		FindNextChangeNotification(m_changes);
+#endif
+}
@@ -0,0 +1,84 @@
+//
+// Copyright (C) Wojciech Jarosz <wjarosz@gmail.com>. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can
+// be found in the LICENSE.txt file.
+//
+
+#pragma once
+
+#include <cstdint>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+/// The size and modification time of a file, which tell whether it changed since it was last looked at
+struct FileStamp
+{
+	int64_t size = -1;
+	int64_t modified = 0;   ///< In nanoseconds since the epoch, as precise as the file system records it
+
+	bool operator==(const FileStamp & o) const  {return size == o.size && modified == o.modified;}
+	bool operator!=(const FileStamp & o) const  {return !(*this == o);}
+};
+
+/// Get the stamp of a file, returns false if it does not exist
+bool fileStamp(const std::string & filename, FileStamp & stamp);
+
+/// The absolute path without any symbolic links, or the path itself if that fails (e.g. it does not exist)
+std::string canonicalPath(const std::string & path);
+
+/*!
+ * @brief Reports the files that appear or change in a directory, once they have been completely written.
+ *
+ * The directory is scanned whenever the operating system reports a change in it, which uses inotify on Linux
+ * and change notifications on Windows. Everywhere else (including macOS), or if the notifications cannot be set
+ * up, there is no notification and the directory is simply scanned once per second instead. A new or changed
+ * file is only reported once a later scan finds it with the same size and modification time, so files that are
+ * still being written are left alone until they are done.
+ * Only regular files with one of the given extensions are considered, and hidden files are ignored. The
+ * reported paths start with the absolute path of the directory.
+ */
+class DirectoryWatcher
+{
+public:
+	/// Throws a runtime_error if the directory cannot be watched
+	DirectoryWatcher(const std::string & directory, const std::set<std::string> & extensions);
+	~DirectoryWatcher();
+
+	DirectoryWatcher(const DirectoryWatcher &) = delete;
+	DirectoryWatcher & operator=(const DirectoryWatcher &) = delete;
+
+	/// Only report the file (a reported path) if it changes from stamp, e.g. when restoring a checkpoint
+	void setHandled(const std::string & path, const FileStamp & stamp);
+	/// Never report the existing file at path (any path to it), e.g. because it is written by the caller
+	void ignore(const std::string & path);
+
+	/*!
+	 * Wait for new or changed files.
+	 *
+	 * @return  The paths of the files that are new or changed and completely written, or an empty list
+	 *          if there are none after @p milliseconds (or if waiting got interrupted by a signal)
+	 */
+	std::vector<std::string> waitForChanges(int milliseconds);
+
+private:
+	struct Entry
+	{
+		FileStamp seen;         ///< As of the last scan
+		FileStamp reported;     ///< The last reported (or handled) version
+	};
+
+	std::vector<std::string> scan();
+	bool pending() const;
+	/// Returns early if the directory changes, returns false if interrupted
+	bool wait(int milliseconds);
+	void drainEvents();
+
+	std::string m_directory;
+	std::set<std::string> m_extensions;
+	std::map<std::string, Entry> m_files;
+	std::set<std::string> m_ignored;
+	int m_notify = -1;          ///< The inotify file descriptor, if used (Linux)
+	void * m_changes = nullptr; ///< The change notification handle, if used (Windows)
+};
@@ -6,17 +6,27 @@
 
 #include "EditImagePanel.h"
 #include "Common.h"
+#include "CurveLUT.h"
 #include "GLImage.h"
 #include "HDRViewer.h"
 #include "HDRImage.h"
+#include "HDRImageViewer.h"
 #include "ImageListPanel.h"
 #include "EnvMap.h"
+#include "EnvMapShader.h"
+#include "Resampler.h"
 #include "Colorspace.h"
 #include "HSLGradient.h"
 #include "MultiGraph.h"
 #include "FilmicToneCurve.h"
+#include "ParallelFor.h"
 #include <spdlog/spdlog.h>
 #include <Eigen/Geometry>
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <limits>
+#include <stdexcept>
 
 using namespace std;
 
@@ -84,6 +94,75 @@ void addOKCancelButtons(FormHelper * gui, Window * window,
 	gui->addWidget("", w);
 }
 
+// adds a variable to the form, like FormHelper::addVariable, but also calls cb whenever it is changed
+template <typename T>
+detail::FormWidget<T> * addVariable(FormHelper * gui, const string & label, T & value,
+                                    const function<void()> & cb, bool editable = true)
+{
+	return gui->addVariable<T>(label,
+	                           [&value,cb](const T & v){value = v; cb();},
+	                           [&value](){return value;},
+	                           editable);
+}
+
+// the OK and Cancel buttons of a filter dialog, which both end its preview
+void addFilterOKCancelButtons(FormHelper * gui, Window * window, HDRViewScreen * screen,
+                              const function<void()> &OKCallback)
+{
+	addOKCancelButtons(gui, window,
+		[screen,OKCallback]()
+		{
+			screen->imageViewer()->clearFilterPreview();
+			OKCallback();
+		},
+		[screen]()
+		{
+			screen->imageViewer()->clearFilterPreview();
+		});
+}
+
+// the curves of the point-wise adjustments, which are previewed on the GPU and applied to the pixels the same way
+CurveLUT exposureGammaCurve(float exposure, float offset, float gamma)
+{
+	return CurveLUT([exposure, offset, gamma](float v){return pow(pow(2.0f, exposure) * v + offset, 1.0f/gamma);});
+}
+
+// whether scaling img by gain is undone exactly by scaling back: gain needs to be a power of two, and no finite,
+// non-zero value may overflow or lose bits as a denormal
+bool exactlyInvertibleGain(const HDRImage & img, float gain)
+{
+	int exponent;
+	if (img.isSingleChannel() || frexp(gain, &exponent) != 0.5f)
+		return false;
+
+	atomic<bool> invertible(true);
+	parallel_for(BlockedRange(0, int(img.size()), 1 << 16), [&img,&invertible,gain](int begin, int end)
+	{
+		for (int i = begin; i < end && invertible; ++i)
+			for (int c = 0; c < 3; ++c)
+			{
+				float v = std::abs(img(i)[c]);
+				float scaled = v * gain;
+				if (std::isfinite(v) && v != 0.f &&
+				    !(scaled >= numeric_limits<float>::min() && scaled <= numeric_limits<float>::max()))
+					invertible = false;
+			}
+	});
+	return invertible;
+}
+
+CurveLUT brightnessContrastCurve(float brightness, float contrast, bool linear)
+{
+	float slope = float(std::tan(lerp(0.0, M_PI_2, contrast/2.0 + 0.5)));
+	if (linear)
+	{
+		float midpoint = (1.f-brightness)/2.f;
+		return CurveLUT([slope, midpoint](float v){return brightnessContrastL(v, slope, midpoint);});
+	}
+	float bias = (brightness + 1.f) / 2.f;
+	return CurveLUT([slope, bias](float v){return brightnessContrastNL(v, slope, bias);});
+}
+
 Button * createColorSpaceButton(Widget *parent, HDRViewScreen * screen, ImageListPanel * imagesPanel)
 {
 	static string name = "Convert color space...";
@@ -158,7 +237,7 @@ Button * createExposureGammaButton(Widget *parent, HDRViewScreen * screen, Image
 			graph->setYTicks(xTicks);
 			gui->addWidget("", graph);
 
-			auto graphCb = [graph]()
+			auto graphCb = [graph,screen]()
 			{
 				VectorXf lCurve = VectorXf::LinSpaced(257, 0.0f, 1.0f).unaryExpr(
 					[](float v)
@@ -166,6 +245,9 @@ Button * createExposureGammaButton(Widget *parent, HDRViewScreen * screen, Image
 						return pow(pow(2.0f, exposure) * v + offset, 1.0f/gamma);
 					});
 				graph->setValues(lCurve, 1);
+
+				CurveLUT curve = exposureGammaCurve(exposure, offset, gamma);
+				screen->imageViewer()->setAdjustmentPreview(&curve);
 			};
 
 			graphCb();
@@ -184,15 +266,32 @@ Button * createExposureGammaButton(Widget *parent, HDRViewScreen * screen, Image
 			                        0.0001f, 10.f, 0.1f, graphCb);
 
 			addOKCancelButtons(gui, window,
-				[&]()
+				[&, screen]()
 				{
+					screen->imageViewer()->clearAdjustmentPreview();
+					CurveLUT curve = exposureGammaCurve(exposure, offset, gamma);
 					imagesPanel->modifyImage(
-						[&](const shared_ptr<const HDRImage> & img) -> ImageCommandResult
+						[&, curve](const shared_ptr<const HDRImage> & img) -> ImageCommandResult
 						{
 							spdlog::get("console")->debug("{}; {}; {}", exposure, offset, gamma);
-							return {make_shared<HDRImage>((Color4(pow(2.0f, exposure), 1.f) * (*img) + Color4(offset, 0.f)).pow(Color4(1.0f/gamma))),
-							        nullptr};
+
+							// a pure exposure change by a power of two can be undone by scaling back, without storing
+							// any pixels, as long as that is exact. Everything else gets the regular (tile delta) undo
+							float gain = pow(2.0f, exposure);
+							if (offset == 0.f && gamma == 1.f && exactlyInvertibleGain(*img, gain))
+							{
+								return {make_shared<HDRImage>(Color4(gain, 1.f) * (*img)),
+								        make_shared<LambdaUndo>([gain](shared_ptr<HDRImage> & img2) { *img2 = Color4(1.f/gain, 1.f) * (*img2); },
+								                                [gain](shared_ptr<HDRImage> & img2) { *img2 = Color4(gain, 1.f) * (*img2); })};
+							}
+							if (offset == 0.f && gamma == 1.f)
+								return {make_shared<HDRImage>(Color4(gain, 1.f) * (*img)), nullptr};
+							return {make_shared<HDRImage>(img->curveMapped(curve)), nullptr};
 						});
+				},
+				[screen]()
+				{
+					screen->imageViewer()->clearAdjustmentPreview();
 				});
 
 			window->center();
@@ -250,7 +349,19 @@ Button * createBrightnessContrastButton(Widget *parent, HDRViewScreen * screen,
 
 			gui->addWidget("", graph);
 
-			auto graphCb = [graph]()
+			// only the RGB channels are adjusted by a curve, the others are not previewed
+			auto previewCb = [screen]()
+			{
+				if (channel == RGB)
+				{
+					CurveLUT curve = brightnessContrastCurve(brightness, contrast, linear);
+					screen->imageViewer()->setAdjustmentPreview(&curve);
+				}
+				else
+					screen->imageViewer()->clearAdjustmentPreview();
+			};
+
+			auto graphCb = [graph,previewCb]()
 			{
 				float slope = float(std::tan(lerp(0.0, M_PI_2, contrast/2.0 + 0.5)));
 				float midpoint = (1.f-brightness)/2.f;
@@ -270,6 +381,8 @@ Button * createBrightnessContrastButton(Widget *parent, HDRViewScreen * screen,
 					});
 				nlCurve.tail<1>()(0) = 1;
 				graph->setValues(nlCurve, 2);
+
+				previewCb();
 			};
 
 			graphCb();
@@ -289,14 +402,22 @@ Button * createBrightnessContrastButton(Widget *parent, HDRViewScreen * screen,
 			                        -1.f, 1.f, 0.01f, graphCb, help);
 
 			auto lCheck = gui->addVariable("Linear:", linear, true);
-			gui->addVariable("Channel:", channel, true)->setItems({"RGB", "Luminance", "Chromaticity"});
+			auto channelBox = gui->addVariable("Channel:", channel, true);
+			channelBox->setItems({"RGB", "Luminance", "Chromaticity"});
 
 			lCheck->setCallback(
-				[graph](bool b)
+				[graph,previewCb](bool b)
 				{
 					linear = b;
 					graph->setForegroundColor(linear ? activeColor : inactiveColor, 1);
 					graph->setForegroundColor(linear ? inactiveColor : activeColor, 2);
+					previewCb();
+				});
+			channelBox->setCallback(
+				[previewCb](int i)
+				{
+					channel = EChannel(i);
+					previewCb();
 				});
 
 			graph->setDragCallback(
@@ -307,14 +428,22 @@ Button * createBrightnessContrastButton(Widget *parent, HDRViewScreen * screen,
 				});
 
 			addOKCancelButtons(gui, window,
-               [&]()
+               [&, screen]()
                {
+	               screen->imageViewer()->clearAdjustmentPreview();
+	               CurveLUT curve = brightnessContrastCurve(brightness, contrast, linear);
 	               imagesPanel->modifyImage(
-		               [&](const shared_ptr<const HDRImage> &img) -> ImageCommandResult
+		               [&, curve](const shared_ptr<const HDRImage> &img) -> ImageCommandResult
 		               {
+			               if (channel == RGB)
+				               return {make_shared<HDRImage>(img->curveMapped(curve)), nullptr};
 			               return {make_shared<HDRImage>(img->brightnessContrast(brightness, contrast, linear, channelMap[channel])),
 			                       nullptr};
 		               });
+               },
+               [screen]()
+               {
+	               screen->imageViewer()->clearAdjustmentPreview();
                });
 
 			window->center();
@@ -349,7 +478,7 @@ Button * createFilmicTonemappingButton(Widget *parent, HDRViewScreen * screen, I
 			graph->setWell(false);
 			gui->addWidget("", graph);
 
-			auto graphCb = [graph]()
+			auto graphCb = [graph,screen]()
 			{
 				float range = pow(2.f, vizFstops);
 				FilmicToneCurve::CurveParamsDirect directParams;
@@ -392,6 +521,9 @@ Button * createFilmicTonemappingButton(Widget *parent, HDRViewScreen * screen, I
 					xTickLabels[i] = fmt::format("{:.2f}", range*xTicks[i]);
 				graph->setXTicks(xTicks, xTickLabels);
 				graph->setYTicks(VectorXf::LinSpaced(3, 0.0f, 1.0f));
+
+				CurveLUT curve([](float v){return fCurve.eval(v);});
+				screen->imageViewer()->setAdjustmentPreview(&curve);
 			};
 
 			graphCb();
@@ -425,27 +557,19 @@ Button * createFilmicTonemappingButton(Widget *parent, HDRViewScreen * screen, I
 			                        0.f, 5.f, 0.01f, graphCb);
 
 			addOKCancelButtons(gui, window,
-				[&]()
+				[&, screen]()
 				{
+				   screen->imageViewer()->clearAdjustmentPreview();
+				   CurveLUT curve([](float v){return fCurve.eval(v);});
 				   imagesPanel->modifyImage(
-				       [&](const shared_ptr<const HDRImage> &img) -> ImageCommandResult
+				       [curve](const shared_ptr<const HDRImage> &img) -> ImageCommandResult
 				       {
-				           return {make_shared<HDRImage>(img->unaryExpr(
-				               [](const Color4 & c)
-				               {
-//					               float srcLum = c.average();
-//					               float dstLum = fCurve.eval(srcLum);
-////					               return c * (dstLum/srcLum);
-//					               return Color4(c.r * (dstLum/srcLum),
-//					                             c.g * (dstLum/srcLum),
-//					                             c.b * (dstLum/srcLum),
-//					                             c.a);
-				                   return Color4(fCurve.eval(c.r),
-				                                 fCurve.eval(c.g),
-				                                 fCurve.eval(c.b),
-				                                 c.a);
-				               }).eval()), nullptr};
+				           return {make_shared<HDRImage>(img->curveMapped(curve)), nullptr};
 				       });
+				},
+				[screen]()
+				{
+				   screen->imageViewer()->clearAdjustmentPreview();
 				});
 
 			window->center();
@@ -480,11 +604,12 @@ Button * createHueSaturationButton(Widget *parent, HDRViewScreen * screen, Image
 			fixedRainbow->setFixedWidth(256);
 			dynamicRainbow->setFixedWidth(256);
 
-			auto cb = [dynamicRainbow]()
+			auto cb = [dynamicRainbow,screen]()
 			{
 				dynamicRainbow->setHueOffset(hue);
 				dynamicRainbow->setSaturation((saturation + 100.f)/200.f);
 				dynamicRainbow->setLightness((lightness + 100.f)/200.f);
+				screen->imageViewer()->setAdjustmentPreview(nullptr, Vector3f(hue, (saturation+100.f)/100.f, lightness/100.f));
 			};
 
 			createFloatBoxAndSlider(gui, window,
@@ -511,9 +636,12 @@ Button * createHueSaturationButton(Widget *parent, HDRViewScreen * screen, Image
 
 			gui->addWidget("", dynamicRainbow);
 
+			cb();
+
 			addOKCancelButtons(gui, window,
-			                   [&]()
+			                   [&, screen]()
 			                   {
+				                   screen->imageViewer()->clearAdjustmentPreview();
 				                   imagesPanel->modifyImage(
 					                   [&](const shared_ptr<const HDRImage> &img) -> ImageCommandResult
 					                   {
@@ -524,6 +652,10 @@ Button * createHueSaturationButton(Widget *parent, HDRViewScreen * screen, Image
 									                   return c.HSLAdjust(hue, (saturation+100.f)/100.f, (lightness)/100.f);
 								                   }).eval()), nullptr};
 					                   });
+			                   },
+			                   [screen]()
+			                   {
+				                   screen->imageViewer()->clearAdjustmentPreview();
 			                   });
 
 			window->center();
@@ -549,26 +681,41 @@ Button * createGaussianFilterButton(Widget *parent, HDRViewScreen * screen, Imag
 			auto window = gui->addWindow(Eigen::Vector2i(10, 10), name);
 			// window->setModal(true);    // BUG: this should be set to modal, but doesn't work with comboboxes
 
-			auto w = gui->addVariable("Width:", width);
+			// the proxy is smaller than the image by scale, and so are the distances of the filter
+			auto preview = [screen]()
+			{
+				float w = width, h = height;
+				auto mX = borderModeX, mY = borderModeY;
+				bool ex = exact;
+				screen->imageViewer()->setFilterPreview(
+					[w,h,mX,mY,ex](const HDRImage & proxy, float scale, AtomicProgress & progress)
+					{
+						return ex ? proxy.GaussianBlurred(w * scale, h * scale, progress, mX, mY) :
+						            proxy.fastGaussianBlurred(w * scale, h * scale, progress, mX, mY);
+					}, 3.f * std::max(w, h));
+			};
+
+			auto w = addVariable(gui, "Width:", width, preview);
 			w->setSpinnable(true);
 			w->setMinValue(0.0f);
 			w->setValueIncrement(5.f);
 			w->setUnits("px");
-			w = gui->addVariable("Height:", height);
+			w = addVariable(gui, "Height:", height, preview);
 			w->setSpinnable(true);
 			w->setMinValue(0.0f);
 			w->setValueIncrement(5.f);
 			w->setUnits("px");
 
-			gui->addVariable("Border mode X:", borderModeX, true)
+			addVariable(gui, "Border mode X:", borderModeX, preview)
 			   ->setItems(HDRImage::borderModeNames());
-			gui->addVariable("Border mode Y:", borderModeY, true)
+			addVariable(gui, "Border mode Y:", borderModeY, preview)
 			   ->setItems(HDRImage::borderModeNames());
 
-			gui->addVariable("Exact (slow!):", exact, true);
+			addVariable(gui, "Exact (slow!):", exact, preview);
 
+			preview();
 
-			addOKCancelButtons(gui, window,
+			addFilterOKCancelButtons(gui, window, screen,
 				[&]()
 				{
 					imagesPanel->modifyImage(
@@ -602,21 +749,34 @@ Button * createBoxFilterButton(Widget *parent, HDRViewScreen * screen, ImageList
 			auto window = gui->addWindow(Eigen::Vector2i(10, 10), name);
 //           window->setModal(true);    // BUG: this should be set to modal, but doesn't work with comboboxes
 
-			auto w = gui->addVariable("Width:", width);
+			auto preview = [screen]()
+			{
+				float w = width, h = height;
+				auto mX = borderModeX, mY = borderModeY;
+				screen->imageViewer()->setFilterPreview(
+					[w,h,mX,mY](const HDRImage & proxy, float scale, AtomicProgress & progress)
+					{
+						return proxy.boxBlurred(int(std::round(w * scale)), int(std::round(h * scale)), progress, mX, mY);
+					}, std::max(w, h));
+			};
+
+			auto w = addVariable(gui, "Width:", width, preview);
 			w->setSpinnable(true);
 			w->setMinValue(0.0f);
 			w->setUnits("px");
-			w = gui->addVariable("Height:", height);
+			w = addVariable(gui, "Height:", height, preview);
 			w->setSpinnable(true);
 			w->setMinValue(0.0f);
 			w->setUnits("px");
 
-			gui->addVariable("Border mode X:", borderModeX, true)
+			addVariable(gui, "Border mode X:", borderModeX, preview)
 			   ->setItems(HDRImage::borderModeNames());
-			gui->addVariable("Border mode Y:", borderModeY, true)
+			addVariable(gui, "Border mode Y:", borderModeY, preview)
 			   ->setItems(HDRImage::borderModeNames());
 
-			addOKCancelButtons(gui, window,
+			preview();
+
+			addFilterOKCancelButtons(gui, window, screen,
 				[&]()
 				{
 					imagesPanel->modifyImage(
@@ -637,6 +797,7 @@ Button * createBilateralFilterButton(Widget *parent, HDRViewScreen * screen, Ima
 {
 	static float rangeSigma = 1.0f, valueSigma = 0.1f;
 	static HDRImage::BorderMode borderModeX = HDRImage::EDGE, borderModeY = HDRImage::EDGE;
+	static bool exact = false;
 	static string name = "Bilateral filter...";
 	auto b = new Button(parent, name, ENTYPO_ICON_DROP);
 	b->setFixedHeight(21);
@@ -649,26 +810,46 @@ Button * createBilateralFilterButton(Widget *parent, HDRViewScreen * screen, Ima
 			auto window = gui->addWindow(Eigen::Vector2i(10, 10), name);
 //           window->setModal(true);    // BUG: this should be set to modal, but doesn't work with comboboxes
 
-			auto w = gui->addVariable("Range sigma:", rangeSigma);
+			// the range sigma is the spatial one, which gets scaled with the proxy
+			auto preview = [screen]()
+			{
+				float rs = rangeSigma, vs = valueSigma;
+				auto mX = borderModeX, mY = borderModeY;
+				bool ex = exact;
+				screen->imageViewer()->setFilterPreview(
+					[rs,vs,mX,mY,ex](const HDRImage & proxy, float scale, AtomicProgress & progress)
+					{
+						return ex ? proxy.bilateralFiltered(vs, rs * scale, progress, mX, mY) :
+						            proxy.fastBilateralFiltered(vs, rs * scale, progress, mX, mY);
+					}, 3.f * rs);
+			};
+
+			auto w = addVariable(gui, "Range sigma:", rangeSigma, preview);
 			w->setSpinnable(true);
 			w->setMinValue(0.0f);
-			w = gui->addVariable("Value sigma:", valueSigma);
+			w = addVariable(gui, "Value sigma:", valueSigma, preview);
 			w->setSpinnable(true);
 			w->setMinValue(0.0f);
 
-			gui->addVariable("Border mode X:", borderModeX, true)
+			addVariable(gui, "Border mode X:", borderModeX, preview)
 			   ->setItems(HDRImage::borderModeNames());
-			gui->addVariable("Border mode Y:", borderModeY, true)
+			addVariable(gui, "Border mode Y:", borderModeY, preview)
 			   ->setItems(HDRImage::borderModeNames());
 
-			addOKCancelButtons(gui, window,
+			addVariable(gui, "Exact (slow!):", exact, preview);
+
+			preview();
+
+			addFilterOKCancelButtons(gui, window, screen,
 				[&]()
 				{
 					imagesPanel->modifyImage(
 						[&](const shared_ptr<const HDRImage> & img, AtomicProgress & progress) -> ImageCommandResult
 						{
-							return {make_shared<HDRImage>(img->bilateralFiltered(valueSigma, rangeSigma,
-							                              progress, borderModeX, borderModeY)),
+							return {make_shared<HDRImage>(exact ? img->bilateralFiltered(valueSigma, rangeSigma,
+							                                                     progress, borderModeX, borderModeY) :
+							                              img->fastBilateralFiltered(valueSigma, rangeSigma,
+							                                                         progress, borderModeX, borderModeY)),
 							        nullptr};
 						});
 				});
@@ -695,19 +876,32 @@ Button * createUnsharpMaskFilterButton(Widget *parent, HDRViewScreen * screen, I
 			auto window = gui->addWindow(Eigen::Vector2i(10, 10), name);
 //           window->setModal(true);    // BUG: this should be set to modal, but doesn't work with comboboxes
 
-			auto w = gui->addVariable("Sigma:", sigma);
+			auto preview = [screen]()
+			{
+				float sg = sigma, st = strength;
+				auto mX = borderModeX, mY = borderModeY;
+				screen->imageViewer()->setFilterPreview(
+					[sg,st,mX,mY](const HDRImage & proxy, float scale, AtomicProgress & progress)
+					{
+						return proxy.unsharpMasked(sg * scale, st, progress, mX, mY);
+					}, 3.f * sg);
+			};
+
+			auto w = addVariable(gui, "Sigma:", sigma, preview);
 			w->setSpinnable(true);
 			w->setMinValue(0.0f);
-			w = gui->addVariable("Strength:", strength);
+			w = addVariable(gui, "Strength:", strength, preview);
 			w->setSpinnable(true);
 			w->setMinValue(0.0f);
 
-			gui->addVariable("Border mode X:", borderModeX, true)
+			addVariable(gui, "Border mode X:", borderModeX, preview)
 			   ->setItems(HDRImage::borderModeNames());
-			gui->addVariable("Border mode Y:", borderModeY, true)
+			addVariable(gui, "Border mode Y:", borderModeY, preview)
 			   ->setItems(HDRImage::borderModeNames());
 
-			addOKCancelButtons(gui, window,
+			preview();
+
+			addFilterOKCancelButtons(gui, window, screen,
 				[&]()
 				{
 					imagesPanel->modifyImage(
@@ -741,16 +935,29 @@ Button * createMedianFilterButton(Widget *parent, HDRViewScreen * screen, ImageL
 			auto window = gui->addWindow(Eigen::Vector2i(10, 10), name);
 //           window->setModal(true);    // BUG: this should be set to modal, but doesn't work with comboboxes
 
-			auto w = gui->addVariable("Radius:", radius);
+			auto preview = [screen]()
+			{
+				float r = radius;
+				auto mX = borderModeX, mY = borderModeY;
+				screen->imageViewer()->setFilterPreview(
+					[r,mX,mY](const HDRImage & proxy, float scale, AtomicProgress & progress)
+					{
+						return proxy.medianFiltered(r * scale, progress, mX, mY);
+					}, r);
+			};
+
+			auto w = addVariable(gui, "Radius:", radius, preview);
 			w->setSpinnable(true);
 			w->setMinValue(0.0f);
 
-			gui->addVariable("Border mode X:", borderModeX, true)
+			addVariable(gui, "Border mode X:", borderModeX, preview)
 			   ->setItems(HDRImage::borderModeNames());
-			gui->addVariable("Border mode Y:", borderModeY, true)
+			addVariable(gui, "Border mode Y:", borderModeY, preview)
 			   ->setItems(HDRImage::borderModeNames());
 
-			addOKCancelButtons(gui, window,
+			preview();
+
+			addFilterOKCancelButtons(gui, window, screen,
 				[&]()
 				{
 					imagesPanel->modifyImage(
@@ -767,11 +974,60 @@ Button * createMedianFilterButton(Widget *parent, HDRViewScreen * screen, ImageL
 	return b;
 }
 
+Button * createConvolveButton(Widget *parent, HDRViewScreen * screen, ImageListPanel * imagesPanel)
+{
+	static HDRImage::BorderMode borderModeX = HDRImage::EDGE, borderModeY = HDRImage::EDGE;
+	static string name = "Convolve...";
+	auto b = new Button(parent, name, ENTYPO_ICON_DROP);
+	b->setFixedHeight(21);
+	b->setCallback(
+		[&, screen, imagesPanel]()
+		{
+			FormHelper *gui = new FormHelper(screen);
+			gui->setFixedSize(Vector2i(75, 20));
+
+			auto window = gui->addWindow(Eigen::Vector2i(10, 10), name);
+//           window->setModal(true);    // BUG: this should be set to modal, but doesn't work with comboboxes
+
+			// the kernel is the average of the color channels of the reference image
+			gui->addWidget("Kernel:", new Label(window, "Reference image"));
+
+			gui->addVariable("Border mode X:", borderModeX, true)
+			   ->setItems(HDRImage::borderModeNames());
+			gui->addVariable("Border mode Y:", borderModeY, true)
+			   ->setItems(HDRImage::borderModeNames());
+
+			addOKCancelButtons(gui, window,
+				[&, imagesPanel]()
+				{
+					auto ref = imagesPanel->referenceImage();
+					if (!ref)
+						return;
+
+					// large kernels are convolved using FFTs
+					auto average = [](const Color4 & c){return (c.r + c.g + c.b) / 3.f;};
+					HDRImage shown = ref->image().expanded().oriented(ref->orientation());
+					auto kernel = make_shared<ArrayXXf>(ArrayXXf(shown.unaryExpr(average)));
+					imagesPanel->modifyImage(
+						[&, kernel](const shared_ptr<const HDRImage> & img, AtomicProgress & progress) -> ImageCommandResult
+						{
+							return {make_shared<HDRImage>(img->convolved(*kernel, progress, borderModeX, borderModeY)),
+							        nullptr};
+						});
+				});
+
+			window->center();
+			window->requestFocus();
+		});
+	return b;
+}
+
 Button * createResizeButton(Widget *parent, HDRViewScreen * screen, ImageListPanel * imagesPanel)
 {
 	static int width = 128, height = 128;
 	static string name = "Resize...";
 	static bool aspect = true;
+	static HDRImage::ResizeFilter filter = HDRImage::LANCZOS_FILTER;
 	auto b = new Button(parent, name, ENTYPO_ICON_RESIZE_FULL_SCREEN);
 	b->setFixedHeight(21);
 	b->setCallback(
@@ -853,13 +1109,16 @@ Button * createResizeButton(Widget *parent, HDRViewScreen * screen, ImageListPan
 
 			gui->addWidget("", row);
 
+			gui->addVariable("Filter:", filter, true)
+			   ->setItems(HDRImage::resizeFilterNames());
+
 			addOKCancelButtons(gui, window,
 				[&]()
 				{
 					imagesPanel->modifyImage(
-						[&](const shared_ptr<const HDRImage> & img) -> ImageCommandResult
+						[&](const shared_ptr<const HDRImage> & img, AtomicProgress & progress) -> ImageCommandResult
 						{
-							return {make_shared<HDRImage>(img->resized(width, height)),
+							return {make_shared<HDRImage>(img->resized(width, height, filter, progress)),
 							        nullptr};
 						});
 				});
@@ -870,6 +1129,71 @@ Button * createResizeButton(Widget *parent, HDRViewScreen * screen, ImageListPan
 	return b;
 }
 
+namespace
+{
+
+/*!
+ * Shows the current image remapped with the settings of the remap dialog, rendered on the GPU every frame so
+ * that it follows the settings live.
+ *
+ * The render callback remaps into the EnvMapShader at a size that fits the given one, and returns false when
+ * there is nothing to show.
+ */
+class RemapPreview : public Widget
+{
+public:
+	using RenderFn = function<bool(EnvMapShader &, const Vector2i &)>;
+
+	RemapPreview(Widget * parent, Screen * screen, const RenderFn & render) :
+		Widget(parent), m_screen(screen), m_render(render)
+	{
+		// empty
+	}
+
+	void draw(NVGcontext * ctx) override
+	{
+		Widget::draw(ctx);
+
+		// the shaders need the GL context, which is current while drawing
+		if (!m_remapper)
+		{
+			m_remapper.reset(new EnvMapShader);
+			m_display.reset(new ImageShader);
+		}
+
+		if (!m_remapper->valid() || !m_render(*m_remapper, size()))
+		{
+			nvgFontSize(ctx, 14.f);
+			nvgFontFace(ctx, "sans");
+			nvgTextAlign(ctx, NVG_ALIGN_CENTER | NVG_ALIGN_MIDDLE);
+			nvgFillColor(ctx, mTheme->mDisabledTextColor);
+			nvgText(ctx, mPos.x() + mSize.x() / 2.f, mPos.y() + mSize.y() / 2.f, "No preview", nullptr);
+			return;
+		}
+
+		nvgEndFrame(ctx); // Flush the NanoVG draw stack, like HDRImageViewer
+
+		Vector2f screenSize = m_screen->size().cast<float>();
+		Vector2f shown = m_remapper->size().cast<float>();
+		Vector2f position = absolutePosition().cast<float>() + (size().cast<float>() - shown) / 2;
+
+		glEnable(GL_SCISSOR_TEST);
+		float r = m_screen->pixelRatio();
+		glScissor(position.x() * r, (screenSize.y() - position.y() - shown.y()) * r, shown.x() * r, shown.y() * r);
+		m_display->draw(ImageShader::Texture(m_remapper->texture()), shown.cwiseQuotient(screenSize),
+		                position.cwiseQuotient(screenSize), 1.f, 2.2f, true, false, RGB, NORMAL_BLEND);
+		glDisable(GL_SCISSOR_TEST);
+	}
+
+private:
+	Screen * m_screen;
+	RenderFn m_render;
+	unique_ptr<EnvMapShader> m_remapper;
+	unique_ptr<ImageShader> m_display;
+};
+
+} // namespace
+
 Button * createRemapButton(Widget *parent, HDRViewScreen *screen, ImageListPanel *imagesPanel)
 {
 	static EEnvMappingUVMode from = ANGULAR_MAP, to = ANGULAR_MAP;
@@ -992,18 +1316,54 @@ Button * createRemapButton(Widget *parent, HDRViewScreen *screen, ImageListPanel
 			w->setSpinnable(true);
 			w->setMinValue(1);
 
+			// the GPU can remap images whose texture is complete (and not paged in tile by tile), and the CPU
+			// handles everything else
+			auto remapOnGPU = [imagesPanel](EnvMapShader & remapper, const Vector2i & size) -> bool
+			{
+				auto img = imagesPanel->currentImage();
+				return img && img->textureResident() && !img->virtualTexture() &&
+				       remapper.remap(ImageShader::Texture(img->glTextureId(), img->displayedImage().isSingleChannel(),
+				                                           Vector2f::Zero(), img->orientation().storedUV()),
+				                      Vector2i(img->width(), img->height()),
+				                      from, to, size, samples, sampler, borderModeX, borderModeY);
+			};
+
+			auto spacer2 = new Widget(window);
+			spacer2->setFixedHeight(5);
+			gui->addWidget("", spacer2);
+
+			auto preview = new RemapPreview(window, screen,
+				[remapOnGPU](EnvMapShader & remapper, const Vector2i & available) -> bool
+				{
+					// fit the output size into the preview, the supersampling still applies per output pixel
+					float scale = min(1.f, min(available.x() / float(width), available.y() / float(height)));
+					Vector2i size = (Vector2f(width, height) * scale).cast<int>().cwiseMax(Vector2i(1, 1));
+					return remapOnGPU(remapper, size);
+				});
+			preview->setFixedSize(Vector2i(gui->fixedSize().x(), 100));
+			gui->addWidget("Preview:", preview);
+
 			addOKCancelButtons(gui, window,
-				[&]()
+				[&, remapOnGPU]()
 				{
-//					auto dst2xyz = envMapUVToXYZ(to);
-//					auto xyz2src = XYZToEnvMapUV(from);
-//					auto warp = [dst2xyz,xyz2src](const Vector2f &uv) { return xyz2src(dst2xyz(uv)); };
-					auto warp = [](const Vector2f &uv) { return convertEnvMappingUV(from, to, uv); };
+					// render at full resolution now, while the GL context is current, and hand over the result.
+					// A half-float texture would quantize (and clamp) the image, so only the preview uses that
+					shared_ptr<HDRImage> remapped;
+					EnvMapShader remapper;
+					auto img = imagesPanel->currentImage();
+					if (img && img->textureFullPrecision() && remapOnGPU(remapper, Vector2i(width, height)))
+						remapped = make_shared<HDRImage>(remapper.download());
 
 					imagesPanel->modifyImage(
-						[&](const shared_ptr<const HDRImage> & img, AtomicProgress & progress) -> ImageCommandResult
+						[&, remapped](const shared_ptr<const HDRImage> & img, AtomicProgress & progress) -> ImageCommandResult
 						{
-							return {make_shared<HDRImage>(img->resampled(width, height, progress, warp, samples, sampler,
+							if (remapped)
+								return {remapped, nullptr};
+
+							// the warp is cached, so trying out samplers or converting more images of this size is fast
+							auto warp = envMapWarpField(to, from, width, height, img->width(), img->height(), samples,
+							                            AtomicProgress(progress, 0.5f));
+							return {make_shared<HDRImage>(img->resampled(*warp, AtomicProgress(progress, 0.5f), sampler,
 							                                            borderModeX, borderModeY)),
 							        nullptr};
 						});
@@ -1642,17 +2002,7 @@ EditImagePanel::EditImagePanel(Widget *parent, HDRViewScreen * screen, ImageList
 	// rotate cw
 	m_filterButtons.push_back(new Button(grid, "Rotate CW", ENTYPO_ICON_CW));
 	m_filterButtons.back()->setFixedHeight(21);
-	m_filterButtons.back()->setCallback(
-		[this]()
-		{
-			m_imagesPanel->modifyImage(
-				[](const shared_ptr<const HDRImage> & img) -> ImageCommandResult
-				{
-					return {make_shared<HDRImage>(img->rotated90CW()),
-					        make_shared<LambdaUndo>([](shared_ptr<HDRImage> & img2) { *img2 = img2->rotated90CCW(); },
-					                                [](shared_ptr<HDRImage> & img2) { *img2 = img2->rotated90CW(); })};
-				});
-		});
+	m_filterButtons.back()->setCallback([&](){m_imagesPanel->reorientImage(HDRImage::Orientation::rotate90CW());});
 
 	// flip v
 	m_filterButtons.push_back(new Button(grid, "Flip V", ENTYPO_ICON_ALIGN_VERTICAL_MIDDLE));
@@ -1662,17 +2012,7 @@ EditImagePanel::EditImagePanel(Widget *parent, HDRViewScreen * screen, ImageList
 	// rotate ccw
 	m_filterButtons.push_back(new Button(grid, "Rotate CCW", ENTYPO_ICON_CCW));
 	m_filterButtons.back()->setFixedHeight(21);
-	m_filterButtons.back()->setCallback(
-		[this]()
-		{
-			m_imagesPanel->modifyImage(
-				[](const shared_ptr<const HDRImage> & img) -> ImageCommandResult
-				{
-					return {make_shared<HDRImage>(img->rotated90CCW()),
-					        make_shared<LambdaUndo>([](shared_ptr<HDRImage> & img2) { *img2 = img2->rotated90CW(); },
-					                                [](shared_ptr<HDRImage> & img2) { *img2 = img2->rotated90CCW(); })};
-				});
-		});
+	m_filterButtons.back()->setCallback([&](){m_imagesPanel->reorientImage(HDRImage::Orientation::rotate90CCW());});
 
 	// shift
 	m_filterButtons.push_back(createShiftButton(grid, m_screen, m_imagesPanel));
@@ -1688,6 +2028,25 @@ EditImagePanel::EditImagePanel(Widget *parent, HDRViewScreen * screen, ImageList
 	// remap
 	m_filterButtons.push_back(createRemapButton(grid, m_screen, m_imagesPanel));
 
+	// develop a DNG that was loaded as a preview
+	m_developButton = new Button(grid, "Develop DNG", ENTYPO_ICON_CAMERA);
+	m_developButton->setFixedHeight(21);
+	m_developButton->setTooltip("Reload the raw file with full AHD demosaicing, e.g. after loading it with --dng=preview.");
+	m_developButton->setCallback(
+		[this]()
+		{
+			string filename = m_imagesPanel->currentImage()->filename();
+			m_imagesPanel->modifyImage(
+				[filename](const shared_ptr<const HDRImage> & img) -> ImageCommandResult
+				{
+					// developDNG logs why it failed, and throwing leaves the image and its history as they are
+					auto developed = make_shared<HDRImage>();
+					if (!developed->developDNG(filename))
+						throw runtime_error("Developing the DNG file failed.");
+					return {developed, createImageUndo(*img, developed)};
+				});
+		});
+
 
 	new Label(this, "Color/range adjustments", "sans-bold");
 	buttonRow = new Widget(this);
@@ -1767,6 +2126,7 @@ EditImagePanel::EditImagePanel(Widget *parent, HDRViewScreen * screen, ImageList
 	m_filterButtons.push_back(createBilateralFilterButton(buttonRow, m_screen, m_imagesPanel));
 	m_filterButtons.push_back(createUnsharpMaskFilterButton(buttonRow, m_screen, m_imagesPanel));
 	m_filterButtons.push_back(createMedianFilterButton(buttonRow, m_screen, m_imagesPanel));
+	m_filterButtons.push_back(createConvolveButton(buttonRow, m_screen, m_imagesPanel));
 }
 
 
@@ -1783,6 +2143,10 @@ void EditImagePanel::draw(NVGcontext *ctx)
 			btn->setEnabled(canModify);
 	}
 
+	string extension = img ? getExtension(img->filename()) : "";
+	transform(extension.begin(), extension.end(), extension.begin(), ::tolower);
+	m_developButton->setEnabled(canModify && extension == "dng");
+
 	m_undoButton->setEnabled(canModify && img->hasUndo());
 	m_redoButton->setEnabled(canModify && img->hasRedo());
 
@@ -23,6 +23,7 @@ private:
     ImageListPanel * m_imagesPanel = nullptr;
 	Button * m_undoButton = nullptr;
 	Button * m_redoButton = nullptr;
+	Button * m_developButton = nullptr;
 	std::vector<Button*> m_filterButtons;
 
 public:
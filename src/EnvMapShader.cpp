@@ -0,0 +1,402 @@
+//
+// Copyright (C) Wojciech Jarosz <wjarosz@gmail.com>. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can
+// be found in the LICENSE.txt file.
+//
+
+#include "EnvMapShader.h"
+#include "Timer.h"
+#include <algorithm>
+#include <string>
+#include <spdlog/spdlog.h>
+
+using namespace nanogui;
+using namespace Eigen;
+using namespace std;
+
+namespace
+{
+
+// Number of rows rendered per draw call, to avoid stalling the GPU for too long with heavy supersampling
+const int BandHeight = 256;
+
+constexpr char const *const vertexShader =
+R"(#version 330
+
+    void main()
+    {
+        // a triangle covering the whole viewport
+        vec2 p = vec2((gl_VertexID << 1) & 2, gl_VertexID & 2);
+        gl_Position = vec4(p * 2.0 - 1.0, 0.0, 1.0);
+    }
+)";
+
+// The warps are direct translations of the ones in EnvMap.cpp, and the samplers of the ones in HDRImage.cpp
+constexpr char const *const fragmentShader =
+R"(#version 330
+
+    uniform sampler2D image;
+    uniform ivec2 imageSize;
+    uniform mat3 orientation;
+    uniform vec2 size;
+    uniform int superSample;
+    uniform int from;
+    uniform int to;
+    uniform int sampler;
+    uniform ivec2 borderMode;
+
+    out vec4 out_color;
+
+    const float PI = 3.14159265358979323846;
+
+    float lerpFactor(float a, float b, float m) { return (m - a) / (b - a); }
+
+    vec3 angularMapToXYZ(vec2 uv)
+    {
+        vec2 xy = 2.0 * uv - 1.0;
+        float phi = clamp(length(xy) * PI, 0.0, PI);
+        float theta = atan(xy.y, xy.x);
+        float sinPhi = sin(phi);
+        return vec3(sinPhi * cos(theta), -sinPhi * sin(theta), cos(phi));
+    }
+
+    vec3 mirrorBallToXYZ(vec2 uv)
+    {
+        vec2 xy = 2.0 * uv - 1.0;
+        float phi = 2.0 * asin(clamp(length(xy), 0.0, 1.0));
+        float theta = atan(xy.y, xy.x);
+        float sinPhi = sin(phi);
+        return vec3(sinPhi * cos(theta), -sinPhi * sin(theta), cos(phi));
+    }
+
+    vec3 latLongToXYZ(vec2 uv)
+    {
+        float theta = mix(1.5 * PI, -0.5 * PI, uv.x);
+        float phi = uv.y * PI;
+        float sinPhi = sin(phi);
+        return vec3(sinPhi * cos(theta), cos(phi), sinPhi * sin(theta));
+    }
+
+    vec3 cylindricalToXYZ(vec2 uv)
+    {
+        float theta = mix(1.5 * PI, -0.5 * PI, uv.x);
+        float cosPhi = mix(1.0, -1.0, uv.y);
+        float sinPhi = sqrt(1.0 - cosPhi * cosPhi);
+        return vec3(sinPhi * cos(theta), cosPhi, sinPhi * sin(theta));
+    }
+
+    vec3 cubeMapToXYZ(vec2 uv)
+    {
+        // a vertical cross
+        vec3 xyz;
+        if (uv.x >= 1.0 / 3.0 && uv.x <= 2.0 / 3.0)
+        {
+            xyz.x = (uv.x - 0.5) * 6.0;
+            if (uv.y >= 0.0 && uv.y <= 0.25)
+                xyz.yz = vec2(1.0, (uv.y - 0.125) * 8.0);
+            else if (uv.y >= 0.25 && uv.y <= 0.5)
+                xyz.yz = vec2((0.375 - uv.y) * 8.0, 1.0);
+            else if (uv.y >= 0.5 && uv.y <= 0.75)
+                xyz.yz = vec2(-1.0, (0.625 - uv.y) * 8.0);
+            else
+                xyz.yz = vec2((uv.y - 0.875) * 8.0, -1.0);
+        }
+        else if (uv.x >= 0.0 && uv.x <= 1.0 / 3.0)
+        {
+            float k = clamp(uv.y, 0.25, 0.5);
+            xyz = vec3(-1.0, (0.375 - k) * 8.0, (uv.x - 1.0 / 6.0) * 6.0);
+        }
+        else
+        {
+            float k = clamp(uv.y, 0.25, 0.5);
+            float j = clamp(uv.x, 2.0 / 3.0, 1.0);
+            xyz = vec3(1.0, (0.375 - k) * 8.0, (5.0 / 6.0 - j) * 6.0);
+        }
+        return normalize(xyz);
+    }
+
+    vec2 XYZToAngularMap(vec3 xyz)
+    {
+        float phi = acos(xyz.z);
+        float theta = atan(xyz.y, xyz.x);
+        return 0.5 * (vec2(cos(theta), -sin(theta)) * phi / PI + 1.0);
+    }
+
+    vec2 XYZToMirrorBall(vec3 xyz)
+    {
+        float phi = acos(xyz.z);
+        float theta = atan(xyz.y, xyz.x);
+        float sinPhi2 = sin(phi / 2.0);
+        return 0.5 * (vec2(sinPhi2 * cos(theta), -sinPhi2 * sin(theta)) + 1.0);
+    }
+
+    vec2 XYZToLatLong(vec3 xyz)
+    {
+        float phi = acos(xyz.y);
+        float theta = atan(xyz.z, xyz.x);
+        return vec2(fract(lerpFactor(1.5 * PI, -0.5 * PI, theta)), phi / PI);
+    }
+
+    vec2 XYZToCylindrical(vec3 xyz)
+    {
+        float theta = atan(xyz.z, xyz.x);
+        return vec2(fract(lerpFactor(1.5 * PI, -0.5 * PI, theta)), lerpFactor(1.0, -1.0, xyz.y));
+    }
+
+    vec2 XYZToCubeMap(vec3 xyz)
+    {
+        vec3 a = abs(xyz);
+        int flg;
+        float l;
+        if (a.z > max(a.x, a.y))      { l = a.z; flg = 3 * int(sign(xyz.z)); }
+        else if (a.y > a.x)           { l = a.y; flg = 2 * int(sign(xyz.y)); }
+        else                          { l = a.x; flg = int(sign(xyz.x)); }
+        vec3 t = xyz / l;
+
+        if (flg == 3)       return vec2(t.x / 6.0 + 0.5, -t.y / 8.0 + 0.375);
+        else if (flg == -1) return vec2(t.z / 6.0 + 1.0 / 6.0, -t.y / 8.0 + 0.375);
+        else if (flg == 1)  return vec2(-t.z / 6.0 + 5.0 / 6.0, -t.y / 8.0 + 0.375);
+        else if (flg == 2)  return vec2(t.x / 6.0 + 0.5, t.z / 8.0 + 0.125);
+        else if (flg == -2) return vec2(t.x / 6.0 + 0.5, -t.z / 8.0 + 0.625);
+        else                return vec2(t.x / 6.0 + 0.5, t.y / 8.0 + 0.875);
+    }
+
+    vec3 toXYZ(int mode, vec2 uv)
+    {
+        if (mode == ANGULAR_MAP)        return angularMapToXYZ(uv);
+        else if (mode == MIRROR_BALL)   return mirrorBallToXYZ(uv);
+        else if (mode == LAT_LONG)      return latLongToXYZ(uv);
+        else if (mode == CYLINDRICAL)   return cylindricalToXYZ(uv);
+        else                            return cubeMapToXYZ(uv);
+    }
+
+    vec2 fromXYZ(int mode, vec3 xyz)
+    {
+        if (mode == ANGULAR_MAP)        return XYZToAngularMap(xyz);
+        else if (mode == MIRROR_BALL)   return XYZToMirrorBall(xyz);
+        else if (mode == LAT_LONG)      return XYZToLatLong(xyz);
+        else if (mode == CYLINDRICAL)   return XYZToCylindrical(xyz);
+        else                            return XYZToCubeMap(xyz);
+    }
+
+    // a mod b for negative a, GLSL's % is undefined there
+    int positiveMod(int a, int b)
+    {
+        return a - b * int(floor(float(a) / float(b)));
+    }
+
+    int wrapCoord(int p, int n, int mode)
+    {
+        if (p >= 0 && p < n)
+            return p;
+        if (mode == EDGE)
+            return clamp(p, 0, n - 1);
+        if (mode == REPEAT)
+            return positiveMod(p, n);
+        if (mode == MIRROR)
+        {
+            int frac = positiveMod(p, n);
+            return ((abs(p) / n) % 2 != 0) ? n - 1 - frac : frac;
+        }
+        return -1;
+    }
+
+    vec4 fetch(int x, int y)
+    {
+        x = wrapCoord(x, imageSize.x, borderMode.x);
+        y = wrapCoord(y, imageSize.y, borderMode.y);
+        if (x < 0 || y < 0)
+            return vec4(0.0);
+        // imageSize is the displayed size, the texture may hold the pixels flipped or rotated
+        vec2 uv = (orientation * vec3((vec2(x, y) + 0.5) / vec2(imageSize), 1.0)).xy;
+        return texelFetch(image, ivec2(uv * vec2(textureSize(image, 0))), 0);
+    }
+
+    float bicubicWeight(float d)
+    {
+        const float A = -0.75;
+        d = abs(d);
+        return (d <= 1.0) ? ((A + 2.0) * d - (A + 3.0)) * d * d + 1.0 :
+                            ((A * d - 5.0 * A) * d + 8.0 * A) * d - 4.0 * A;
+    }
+
+    vec4 sampleImage(vec2 s)
+    {
+        if (sampler == NEAREST)
+            return fetch(int(floor(s.x)), int(floor(s.y)));
+
+        // pixels are defined at their centers
+        s -= 0.5;
+        int x0 = int(floor(s.x)), y0 = int(floor(s.y));
+        if (sampler == BILINEAR)
+        {
+            vec2 t = s - vec2(x0, y0);
+            return mix(mix(fetch(x0, y0), fetch(x0 + 1, y0), t.x),
+                       mix(fetch(x0, y0 + 1), fetch(x0 + 1, y0 + 1), t.x), t.y);
+        }
+
+        vec4 val = vec4(0.0);
+        float totalWeight = 0.0;
+        for (int j = -1; j < 3; ++j)
+        {
+            float wy = bicubicWeight(s.y - float(y0 + j));
+            for (int i = -1; i < 3; ++i)
+            {
+                float w = bicubicWeight(s.x - float(x0 + i)) * wy;
+                val += fetch(x0 + i, y0 + j) * w;
+                totalWeight += w;
+            }
+        }
+        return val / totalWeight;
+    }
+
+    void main()
+    {
+        vec2 pixel = floor(gl_FragCoord.xy);
+        vec4 sum = vec4(0.0);
+        for (int yy = 0; yy < superSample; ++yy)
+            for (int xx = 0; xx < superSample; ++xx)
+            {
+                vec2 uv = (pixel + (vec2(xx, yy) + 0.5) / float(superSample)) / size;
+                // map the target uv back to the source parametrization
+                if (from != to)
+                    uv = fromXYZ(from, toXYZ(to, uv));
+                sum += sampleImage(uv * vec2(imageSize));
+            }
+        out_color = sum / float(superSample * superSample);
+    }
+)";
+
+} // namespace
+
+#define DEFINE_PARAMS(parent,name) m_shader.define(#name, to_string(parent::name))
+
+EnvMapShader::EnvMapShader()
+{
+	m_shader.define("ANGULAR_MAP", to_string(ANGULAR_MAP));
+	m_shader.define("MIRROR_BALL", to_string(MIRROR_BALL));
+	m_shader.define("LAT_LONG", to_string(LAT_LONG));
+	m_shader.define("CYLINDRICAL", to_string(CYLINDRICAL));
+	m_shader.define("CUBE_MAP", to_string(CUBE_MAP));
+	DEFINE_PARAMS(HDRImage, NEAREST);
+	DEFINE_PARAMS(HDRImage, BILINEAR);
+	DEFINE_PARAMS(HDRImage, BICUBIC);
+	DEFINE_PARAMS(HDRImage, BLACK);
+	DEFINE_PARAMS(HDRImage, EDGE);
+	DEFINE_PARAMS(HDRImage, REPEAT);
+	DEFINE_PARAMS(HDRImage, MIRROR);
+
+	if (!m_shader.init("Environment map remap", vertexShader, fragmentShader))
+	{
+		spdlog::get("console")->warn("Could not compile the environment map shader, remapping on the CPU instead.");
+		return;
+	}
+
+	glGenTextures(1, &m_target);
+	glGenFramebuffers(1, &m_framebuffer);
+	m_valid = m_target && m_framebuffer;
+}
+
+EnvMapShader::~EnvMapShader()
+{
+	m_shader.free();
+	glDeleteFramebuffers(1, &m_framebuffer);
+	glDeleteTextures(1, &m_target);
+}
+
+bool EnvMapShader::remap(const ImageShader::Texture & image, const Vector2i & imageSize,
+                         EEnvMappingUVMode from, EEnvMappingUVMode to, const Vector2i & size,
+                         int superSample, HDRImage::Sampler sampler, HDRImage::BorderMode mX, HDRImage::BorderMode mY)
+{
+	GLint maxSize;
+	glGetIntegerv(GL_MAX_TEXTURE_SIZE, &maxSize);
+	if (!m_valid || !image.id || image.singleChannel || (imageSize.array() <= 0).any() ||
+	    (size.array() <= 0).any() || (size.array() > maxSize).any())
+		return false;
+
+	Timer timer;
+
+	// save the state we are about to change
+	GLint previousFramebuffer, viewport[4], scissorBox[4];
+	glGetIntegerv(GL_FRAMEBUFFER_BINDING, &previousFramebuffer);
+	glGetIntegerv(GL_VIEWPORT, viewport);
+	glGetIntegerv(GL_SCISSOR_BOX, scissorBox);
+	GLboolean blend = glIsEnabled(GL_BLEND);
+	GLboolean scissor = glIsEnabled(GL_SCISSOR_TEST);
+	GLboolean depth = glIsEnabled(GL_DEPTH_TEST);
+
+	if (size != m_size)
+	{
+		glBindTexture(GL_TEXTURE_2D, m_target);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, 0);
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F, size.x(), size.y(), 0, GL_RGBA, GL_FLOAT, nullptr);
+		glBindFramebuffer(GL_FRAMEBUFFER, m_framebuffer);
+		glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, m_target, 0);
+		if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+		{
+			spdlog::get("console")->warn("Floating-point render targets are not supported, remapping on the CPU instead.");
+			m_valid = false;
+			m_size = Vector2i::Zero();
+			glBindFramebuffer(GL_FRAMEBUFFER, previousFramebuffer);
+			return false;
+		}
+		m_size = size;
+	}
+
+	glBindFramebuffer(GL_FRAMEBUFFER, m_framebuffer);
+	glDisable(GL_BLEND);
+	glDisable(GL_DEPTH_TEST);
+	glEnable(GL_SCISSOR_TEST);
+	glViewport(0, 0, size.x(), size.y());
+
+	m_shader.bind();
+	glActiveTexture(GL_TEXTURE0);
+	glBindTexture(GL_TEXTURE_2D, image.id);
+	m_shader.setUniform("image", 0);
+	m_shader.setUniform("imageSize", imageSize);
+	m_shader.setUniform("orientation", image.orientation);
+	m_shader.setUniform("size", Vector2f(size.cast<float>()));
+	m_shader.setUniform("superSample", max(1, superSample));
+	m_shader.setUniform("from", (int) from);
+	m_shader.setUniform("to", (int) to);
+	m_shader.setUniform("sampler", (int) sampler);
+	m_shader.setUniform("borderMode", Vector2i(mX, mY));
+
+	for (int y = 0; y < size.y(); y += BandHeight)
+	{
+		glScissor(0, y, size.x(), min(BandHeight, size.y() - y));
+		m_shader.drawArray(GL_TRIANGLES, 0, 3);
+		glFlush();
+	}
+
+	// restore the state
+	glBindFramebuffer(GL_FRAMEBUFFER, previousFramebuffer);
+	glViewport(viewport[0], viewport[1], viewport[2], viewport[3]);
+	glScissor(scissorBox[0], scissorBox[1], scissorBox[2], scissorBox[3]);
+	if (blend) glEnable(GL_BLEND);
+	if (!scissor) glDisable(GL_SCISSOR_TEST);
+	if (depth) glEnable(GL_DEPTH_TEST);
+
+	spdlog::get("console")->trace("Remapping the environment map on the GPU took {} seconds.", (timer.elapsed() / 1000.f));
+	return true;
+}
+
+HDRImage EnvMapShader::download() const
+{
+	HDRImage result(m_size.x(), m_size.y());
+	if (result.isNull())
+		return result;
+
+	GLint previousFramebuffer;
+	glGetIntegerv(GL_FRAMEBUFFER_BINDING, &previousFramebuffer);
+	glBindFramebuffer(GL_FRAMEBUFFER, m_framebuffer);
+	glReadBuffer(GL_COLOR_ATTACHMENT0);
+	glPixelStorei(GL_PACK_ALIGNMENT, 4);
+	glPixelStorei(GL_PACK_ROW_LENGTH, 0);
+	// the rows of the target are in the same order as the rows of an HDRImage
+	glReadPixels(0, 0, m_size.x(), m_size.y(), GL_RGBA, GL_FLOAT, result.data());
+	glBindFramebuffer(GL_FRAMEBUFFER, previousFramebuffer);
+	return result;
+}
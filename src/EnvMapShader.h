@@ -0,0 +1,56 @@
+//
+// Copyright (C) Wojciech Jarosz <wjarosz@gmail.com>. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can
+// be found in the LICENSE.txt file.
+//
+
+#pragma once
+
+#include <nanogui/opengl.h>
+#include <nanogui/glutil.h>
+#include <Eigen/Core>
+#include "EnvMap.h"
+#include "HDRImage.h"
+#include "ImageShader.h"
+
+/*!
+ * Converts an environment map that is already resident on the GPU from one parametrization to another,
+ * with the same warps (see EnvMap.h), samplers, border modes and supersampling as HDRImage::resampled.
+ *
+ * The result is rendered into a floating-point texture owned by the shader, which can be displayed directly
+ * (e.g. for a live preview) or read back with download(). The result has the precision of the source
+ * texture, so reading it back only preserves the image if that stores 32-bit floats. Needs a current OpenGL context; hdrbatch, which
+ * has none, uses the CPU path.
+ */
+class EnvMapShader
+{
+public:
+	EnvMapShader();
+	~EnvMapShader();
+
+	/// Whether the shader compiled and floating-point render targets are supported
+	bool valid() const                  {return m_valid;}
+
+	/*!
+	 * Remap the imageSize image with parametrization from into a size image with parametrization to.
+	 *
+	 * @return False if the GPU path cannot handle this, e.g. for single-channel images or too large sizes
+	 */
+	bool remap(const ImageShader::Texture & image, const Eigen::Vector2i & imageSize,
+	           EEnvMappingUVMode from, EEnvMappingUVMode to, const Eigen::Vector2i & size,
+	           int superSample, HDRImage::Sampler sampler, HDRImage::BorderMode mX, HDRImage::BorderMode mY);
+
+	/// The texture holding the result of the last successful remap
+	GLuint texture() const              {return m_target;}
+	const Eigen::Vector2i & size() const {return m_size;}
+
+	/// Read the result of the last successful remap back into an image
+	HDRImage download() const;
+
+private:
+	nanogui::GLShader m_shader;
+	GLuint m_framebuffer = 0;
+	GLuint m_target = 0;
+	Eigen::Vector2i m_size = Eigen::Vector2i::Zero();
+	bool m_valid = false;
+};
@@ -0,0 +1,216 @@
+//
+// Copyright (C) Wojciech Jarosz <wjarosz@gmail.com>. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can
+// be found in the LICENSE.txt file.
+//
+
+#include "ErrorMetrics.h"
+#include "Colorspace.h"
+#include "Common.h"
+#include "ParallelFor.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <limits>
+#include <stdexcept>
+#include <spdlog/fmt/fmt.h>
+
+using namespace std;
+
+namespace
+{
+
+// scanlines per partial sum. This is fixed, so that the order of the sums doesn't depend on the number of threads
+const int BLOCK_ROWS = 16;
+
+struct Sums
+{
+	double squared = 0, absolute = 0, relative = 0, maximum = 0, ssim = 0;
+};
+
+// the pixels of scanline y, with the raw values of single-channel images turned into gray pixels in buffer
+const Color4 * rowPixels(const HDRImage & image, int y, vector<Color4> & buffer)
+{
+	if (!image.isSingleChannel())
+		return &image(0, y);
+
+	auto values = image.intensity();
+	const float * row = values.data() + y * values.outerStride();
+	buffer.resize(image.width());
+	for (int x = 0; x < image.width(); ++x)
+		buffer[x] = Color4(row[x], 1.f);
+	return buffer.data();
+}
+
+// sum up the Sums of all scanlines, computed by body(y, sums)
+template <typename Body>
+Sums reduceRows(int height, const Body & body)
+{
+	vector<Sums> partial((height + BLOCK_ROWS - 1) / BLOCK_ROWS);
+	parallel_for(0, int(partial.size()), [&](int b)
+	{
+		for (int y = b * BLOCK_ROWS; y < min(height, (b + 1) * BLOCK_ROWS); ++y)
+			body(y, partial[b]);
+	});
+
+	Sums total;
+	for (auto & p : partial)
+	{
+		total.squared += p.squared;
+		total.absolute += p.absolute;
+		total.relative += p.relative;
+		total.maximum = max(total.maximum, p.maximum);
+		total.ssim += p.ssim;
+	}
+	return total;
+}
+
+double meanSSIM(const HDRImage & image, const HDRImage & reference)
+{
+	int w = image.width(), h = image.height();
+
+	// the local means, variances and covariance all come from blurring the values and their products
+	HDRImage moments(w, h), products(w, h);
+	parallel_for(0, h, [&](int y)
+	{
+		vector<Color4> bufferA, bufferB;
+		const Color4 * a = rowPixels(image, y, bufferA);
+		const Color4 * b = rowPixels(reference, y, bufferB);
+		for (int x = 0; x < w; ++x)
+		{
+			float la = LinearToSRGB(clamp(a[x].luminance(), 0.f, 1.f));
+			float lb = LinearToSRGB(clamp(b[x].luminance(), 0.f, 1.f));
+			moments(x, y) = Color4(la, lb, la * la, lb * lb);
+			products(x, y) = Color4(la * lb, 0.f, 0.f, 0.f);
+		}
+	});
+
+	// truncating at 3.3 sigma gives the usual 11x11 window
+	AtomicProgress progress;
+	moments = moments.GaussianBlurred(1.5f, 1.5f, progress, HDRImage::EDGE, HDRImage::EDGE, 3.3f, 3.3f);
+	products = products.GaussianBlurred(1.5f, 1.5f, progress, HDRImage::EDGE, HDRImage::EDGE, 3.3f, 3.3f);
+
+	const double C1 = 0.01 * 0.01, C2 = 0.03 * 0.03;
+	Sums sums = reduceRows(h, [&](int y, Sums & s)
+	{
+		for (int x = 0; x < w; ++x)
+		{
+			const Color4 & m = moments(x, y);
+			double mx = m.r, my = m.g;
+			double vx = m.b - mx * mx, vy = m.a - my * my, cxy = products(x, y).r - mx * my;
+			s.ssim += ((2 * mx * my + C1) * (2 * cxy + C2)) / ((mx * mx + my * my + C1) * (vx + vy + C2));
+		}
+	});
+	return sums.ssim / (double(w) * h);
+}
+
+string jsonNumber(double v)
+{
+	return isfinite(v) ? fmt::format("{:.9g}", v) : "null";
+}
+
+string jsonString(const string & s)
+{
+	string escaped = "\"";
+	for (char c : s)
+	{
+		if (c == '"' || c == '\\')
+			escaped += string("\\") + c;
+		else if ((unsigned char) c < 0x20)
+			escaped += fmt::format("\\u{:04x}", int(c));
+		else
+			escaped += c;
+	}
+	return escaped + "\"";
+}
+
+string csvString(const string & s)
+{
+	if (s.find_first_of(",\"\n") == string::npos)
+		return s;
+
+	string quoted = "\"";
+	for (char c : s)
+		quoted += c == '"' ? string("\"\"") : string(1, c);
+	return quoted + "\"";
+}
+
+} // namespace
+
+
+ErrorMetrics computeErrorMetrics(const HDRImage & image, const HDRImage & reference, bool ssim)
+{
+	if (image.width() != reference.width() || image.height() != reference.height())
+		throw invalid_argument("Images must have same dimensions!");
+
+	int w = image.width(), h = image.height();
+	Sums sums = reduceRows(h, [&](int y, Sums & s)
+	{
+		vector<Color4> bufferA, bufferB;
+		const Color4 * a = rowPixels(image, y, bufferA);
+		const Color4 * b = rowPixels(reference, y, bufferB);
+		for (int x = 0; x < w; ++x)
+			for (int c = 0; c < 3; ++c)
+			{
+				double d = double(a[x][c]) - b[x][c];
+				double r = b[x][c];
+				s.squared += d * d;
+				s.absolute += abs(d);
+				s.relative += d * d / (r * r + 1e-3);
+				s.maximum = max(s.maximum, abs(d));
+			}
+	});
+
+	double n = 3. * w * h;
+	ErrorMetrics metrics;
+	metrics.mse = sums.squared / n;
+	metrics.rmse = sqrt(metrics.mse);
+	metrics.relMSE = sums.relative / n;
+	metrics.mae = sums.absolute / n;
+	metrics.maxError = sums.maximum;
+	metrics.psnr = metrics.mse > 0 ? -10. * log10(metrics.mse) : numeric_limits<double>::infinity();
+	if (ssim)
+		metrics.ssim = meanSSIM(image, reference);
+	return metrics;
+}
+
+
+bool writeErrorMetrics(const string & filename, const vector<string> & names,
+                       const vector<ErrorMetrics> & metrics, bool ssim)
+{
+	string extension = getExtension(filename);
+	transform(extension.begin(), extension.end(), extension.begin(), ::tolower);
+	bool json = extension == "json";
+
+	string contents = json ? "[\n" : string("file,mse,rmse,relmse,mae,max,psnr") + (ssim ? ",ssim\n" : "\n");
+	for (size_t i = 0; i < metrics.size(); ++i)
+	{
+		const ErrorMetrics & m = metrics[i];
+		if (json)
+		{
+			contents += fmt::format("  {{\"file\": {}, \"mse\": {}, \"rmse\": {}, \"relmse\": {}, \"mae\": {}, "
+			                        "\"max\": {}, \"psnr\": {}",
+			                        jsonString(names[i]), jsonNumber(m.mse), jsonNumber(m.rmse), jsonNumber(m.relMSE),
+			                        jsonNumber(m.mae), jsonNumber(m.maxError), jsonNumber(m.psnr));
+			if (ssim)
+				contents += fmt::format(", \"ssim\": {}", jsonNumber(m.ssim));
+			contents += i + 1 < metrics.size() ? "},\n" : "}\n";
+		}
+		else
+		{
+			contents += fmt::format("{},{:.9g},{:.9g},{:.9g},{:.9g},{:.9g},{:.9g}", csvString(names[i]),
+			                        m.mse, m.rmse, m.relMSE, m.mae, m.maxError, m.psnr);
+			contents += ssim ? fmt::format(",{:.9g}\n", m.ssim) : "\n";
+		}
+	}
+	if (json)
+		contents += "]\n";
+
+	FILE * f = fopen(filename.c_str(), "wb");
+	if (!f)
+		throw runtime_error(fmt::format("Cannot open \"{}\" for writing the error metrics.", filename));
+	bool written = fwrite(contents.data(), 1, contents.size(), f) == contents.size();
+	if (fclose(f) != 0 || !written)
+		throw runtime_error(fmt::format("Cannot write the error metrics to \"{}\".", filename));
+	return true;
+}
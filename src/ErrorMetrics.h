@@ -0,0 +1,44 @@
+//
+// Copyright (C) Wojciech Jarosz <wjarosz@gmail.com>. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can
+// be found in the LICENSE.txt file.
+//
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include "HDRImage.h"
+
+/// Scalar measures of the difference between an image and a reference, over all pixels and the RGB channels
+struct ErrorMetrics
+{
+	double mse = 0;         ///< Mean squared error
+	double rmse = 0;        ///< Root mean squared error
+	double relMSE = 0;      ///< Mean of the squared errors relative to the squared reference (+ 1e-3)
+	double mae = 0;         ///< Mean absolute error
+	double maxError = 0;    ///< Largest absolute error
+	double psnr = 0;        ///< Peak signal-to-noise ratio in dB, for a peak value of 1 (infinite for identical images)
+	double ssim = 0;        ///< Mean structural similarity, only computed if requested
+};
+
+/*!
+ * Compare an image against a reference of the same size, without creating an error image.
+ *
+ * All metrics but SSIM are summed up in a single parallel pass over the pixels, in double precision and in a
+ * fixed order, so the results don't depend on the number of threads. The SSIM compares the luminances of the
+ * sRGB-encoded and clipped images with the usual 11x11 Gaussian window (sigma = 1.5), and takes a few more passes.
+ * Single-channel images are compared by their raw values.
+ *
+ * Throws an invalid_argument if the images do not have the same size.
+ */
+ErrorMetrics computeErrorMetrics(const HDRImage & image, const HDRImage & reference, bool ssim = false);
+
+/*!
+ * Write the metrics of a list of images as CSV (one line per image) or JSON (an array of one object per image),
+ * depending on whether the extension of the filename is .json.
+ *
+ * @return True on success, otherwise throws a runtime_error
+ */
+bool writeErrorMetrics(const std::string & filename, const std::vector<std::string> & names,
+                       const std::vector<ErrorMetrics> & metrics, bool ssim);
@@ -14,6 +14,7 @@ class ImageCommandUndo;
 class FullImageUndo;
 class LambdaUndo;
 class CommandHistory;
+class CurveLUT;
 class GLImage;
 class HDRImage;
 class HDRViewScreen;
@@ -22,8 +23,10 @@ class HelpWindow;
 class MultiGraph;
 class EditImagePanel;
 class HistogramPanel;
+class HistogramShader;
 class ImageListPanel;
 class Timer;
+class WarpField;
 template<typename T> class Range;
 
 
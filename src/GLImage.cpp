@@ -7,126 +7,661 @@
 #include "GLImage.h"
 #include "Common.h"
 #include "Timer.h"
+#include "Trace.h"
 #include "Colorspace.h"
 #include "ParallelFor.h"
+#include <algorithm>
 #include <random>
 #include <nanogui/common.h>
 #include <nanogui/glutil.h>
+#include <half.h>
 #include <cmath>
 #include <spdlog/spdlog.h>
 #include "MultiGraph.h"
+#include "HistogramShader.h"
 
 using namespace nanogui;
 using namespace Eigen;
 using namespace std;
 
-shared_ptr<ImageStatistics> ImageStatistics::computeStatistics(const HDRImage &img, float exposure)
+namespace
 {
-	static const int numBins = 256;
-	static const int numTicks = 8;
-	float displayMax = pow(2.f, -exposure);
 
-	auto ret = make_shared<ImageStatistics>();
-	for (int i = 0; i < ENumAxisScales; ++i)
-		ret->histogram[i].values = MatrixX3f::Zero(numBins, 3);
+const int NumPixelBuffers = 4;
+const int PixelBufferSize = 512 * 512 * sizeof(Color4);  ///< in bytes
 
-	ret->exposure = exposure;
-	ret->average = 0;
+const float HalfMax = 65504.f;
+const float HalfMinNormal = 6.10351562e-5f;
 
-	ret->maximum = img.max().Color3::max();
-	ret->minimum = img.min().Color3::min();
+/// Whether half precision keeps the value with its usual relative precision of about 1/2048, i.e. it is neither
+/// too large nor so small that it would become a subnormal (or zero) and lose significant digits
+inline bool halfKeeps(float v)
+{
+	float a = std::fabs(v);
+	return !std::isfinite(v) || a == 0.f || (a >= HalfMinNormal && a <= HalfMax);
+}
+
+inline int mipSize(int size, int level)
+{
+	return max(1, size >> level);
+}
+
+/// Halve the resolution of an image with a box filter, rounding the size down like glGenerateMipmap
+HDRImage downsampled(const HDRImage & src)
+{
+	if (src.isSingleChannel())
+	{
+		// average only the positive values, so that invalid (e.g. missing depth) pixels don't bleed into valid ones
+		HDRImage::IntensityMap in = src.intensity();
+		HDRImage::Intensity out(max(1, src.width() / 2), max(1, src.height() / 2));
+		parallel_for(BlockedRange(0, int(out.cols())), [&in,&out](int y0, int y1)
+		{
+			for (int y = y0; y < y1; ++y)
+			{
+				int sy0 = min(2 * y, int(in.cols()) - 1), sy1 = min(2 * y + 1, int(in.cols()) - 1);
+				for (int x = 0; x < out.rows(); ++x)
+				{
+					int sx0 = min(2 * x, int(in.rows()) - 1), sx1 = min(2 * x + 1, int(in.rows()) - 1);
+					float v[4] = {in(sx0, sy0), in(sx1, sy0), in(sx0, sy1), in(sx1, sy1)};
+					float sum = 0.f;
+					int count = 0;
+					for (float p : v)
+						if (p > 0.f)
+						{
+							sum += p;
+							++count;
+						}
+					out(x, y) = count ? sum / count : 0.f;
+				}
+			}
+		});
+		HDRImage dst;
+		dst.setSingleChannel(out);
+		return dst;
+	}
+
+	HDRImage dst(max(1, src.width() / 2), max(1, src.height() / 2));
+	parallel_for(BlockedRange(0, dst.height()), [&src,&dst](int y0, int y1)
+	{
+		for (int y = y0; y < y1; ++y)
+		{
+			int sy0 = min(2 * y, src.height() - 1), sy1 = min(2 * y + 1, src.height() - 1);
+			for (int x = 0; x < dst.width(); ++x)
+			{
+				int sx0 = min(2 * x, src.width() - 1), sx1 = min(2 * x + 1, src.width() - 1);
+				dst(x, y) = (src(sx0, sy0) + src(sx1, sy0) + src(sx0, sy1) + src(sx1, sy1)) * 0.25f;
+			}
+		}
+	});
+	return dst;
+}
+
+/// Copy (and convert) the pixels [begin,end) of src into the tightly packed buffer dst with the given format
+template <typename T>
+void convertPixels(const Color4 * begin, const Color4 * end, int channels, T * dst)
+{
+	for (const Color4 * p = begin; p != end; ++p)
+		for (int c = 0; c < channels; ++c)
+			*dst++ = T((*p)[c]);
+}
 
-	Color4 gain(pow(2.f, exposure), 1.f);
-	float d = 1.f / (img.width() * img.height());
+// regions beyond this many are merged into their bounding box, so that a scattered edit doesn't take a draw call per tile
+const int MaxDirtyRegions = 64;
 
-	for (Eigen::DenseIndex i = 0; i < img.size(); ++i)
+// Renders one mip level from the one above it, with the same box filter as downsampled
+constexpr char const *const mipVertexShader =
+R"(#version 330
+
+    void main()
     {
-        Color4 val = gain * img(i);
-        ret->average += val[0] + val[1] + val[2];
+        // a triangle covering the whole viewport
+        vec2 p = vec2((gl_VertexID << 1) & 2, gl_VertexID & 2);
+        gl_Position = vec4(p * 2.0 - 1.0, 0.0, 1.0);
+    }
+)";
 
-        for (int c = 0; c < 3; ++c)
+constexpr char const *const mipFragmentShader =
+R"(#version 330
+
+    uniform sampler2D source;
+    uniform ivec2 sourceSize;
+    uniform bool rawValues;
+
+    out vec4 out_color;
+
+    void main()
+    {
+        ivec2 p = ivec2(gl_FragCoord.xy);
+        ivec2 s0 = min(2 * p, sourceSize - 1), s1 = min(2 * p + 1, sourceSize - 1);
+        vec4 v[4] = vec4[4](texelFetch(source, s0, 0), texelFetch(source, ivec2(s1.x, s0.y), 0),
+                            texelFetch(source, ivec2(s0.x, s1.y), 0), texelFetch(source, s1, 0));
+        if (!rawValues)
         {
-	        ret->histogram[ELinear].values(clamp(int(floor(val[c] * numBins)), 0, numBins - 1), c) += d;
-	        ret->histogram[ESRGB].values(clamp(int(floor(LinearToSRGB(val[c]) * numBins)), 0, numBins - 1), c) += d;
-	        ret->histogram[ELog].values(clamp(int(floor(normalizedLogScale(val[c]) * numBins)), 0, numBins - 1), c) += d;
+            out_color = 0.25 * (v[0] + v[1] + v[2] + v[3]);
+            return;
         }
+
+        // average only the positive raw values, like downsampled
+        float sum = 0.0;
+        int count = 0;
+        for (int i = 0; i < 4; ++i)
+            if (v[i].r > 0.0)
+            {
+                sum += v[i].r;
+                ++count;
+            }
+        out_color = vec4(count > 0 ? sum / float(count) : 0.0);
     }
+)";
+
+/// The shared shader for updateMipRegions, or nullptr if it does not compile
+GLShader * mipShader()
+{
+	static GLShader shader;
+	static bool valid = shader.init("Mip level", mipVertexShader, mipFragmentShader);
+	return valid ? &shader : nullptr;
+}
 
-	ret->average /= 3 * img.width() * img.height();
+inline int numMipLevels(int width, int height)
+{
+	return 1 + int(floor(log2(max(width, height))));
+}
+
+GLint maxTextureSize()
+{
+	static GLint size = []{GLint s = 0; glGetIntegerv(GL_MAX_TEXTURE_SIZE, &s); return s;}();
+	return size;
+}
 
+// keeps paging in the visible tiles of a virtual texture from stalling interaction
+const int MaxPageMilliseconds = 10;
 
-	// Normalize each histogram according to its 10th-largest bin
-	MatrixXf temp;
-	for (int i = 0; i < ENumAxisScales; ++i)
+/// Copy a page of src starting at (x0,y0), and a border of one texel around it, into the tightly packed slot dst
+template <typename T>
+void fillPage(const HDRImage & src, bool rawValues, int x0, int y0, int channels, T * dst)
+{
+	int slotSize = VirtualTexture::SlotSize;
+	HDRImage::IntensityMap values = src.intensity();
+	parallel_for(BlockedRange(0, slotSize), [&](int begin, int end)
 	{
-		temp = ret->histogram[i].values;
-		DenseIndex idx = temp.size() - 10;
-		nth_element(temp.data(), temp.data() + idx, temp.data() + temp.size());
-		ret->histogram[i].values /= temp(idx);
-	}
+		for (int j = begin; j < end; ++j)
+		{
+			// pages at the edges of the image are padded with copies of the edge texels
+			int y = ::clamp(y0 - 1 + j, 0, src.height() - 1);
+			T * row = dst + size_t(j) * slotSize * channels;
+			for (int i = 0; i < slotSize; ++i)
+			{
+				int x = ::clamp(x0 - 1 + i, 0, src.width() - 1);
+				if (rawValues)
+					row[i] = T(values(x, y));
+				else
+				{
+					const Color4 & p = src(x, y);
+					for (int c = 0; c < channels; ++c)
+						row[i * channels + c] = T(p[c]);
+				}
+			}
+		}
+	});
+}
 
-	// create the tick marks
-	ret->histogram[ELinear].xTicks.setLinSpaced(numTicks+1, 0.0f, 1.0f);
-	ret->histogram[ESRGB].xTicks = ret->histogram[ELinear].xTicks.unaryExpr([](float v){return LinearToSRGB(v);});
-	ret->histogram[ELog].xTicks = ret->histogram[ELinear].xTicks.unaryExpr([](float v){return normalizedLogScale(v);});
+} // namespace
 
-	// create the tick labels
-	auto & hist = ret->histogram[ELinear];
-	hist.xTickLabels.resize(numTicks + 1);
-	for (int i = 0; i <= numTicks; ++i)
-		hist.xTickLabels[i] = fmt::format("{:.3f}", displayMax * hist.xTicks[i]);
-	ret->histogram[ESRGB].xTickLabels = ret->histogram[ELog].xTickLabels = hist.xTickLabels;
 
-	return ret;
+LazyGLTextureLoader::Precision LazyGLTextureLoader::s_precision = LazyGLTextureLoader::AUTO_PRECISION;
+
+const vector<string> & LazyGLTextureLoader::precisionNames()
+{
+	static const vector<string> names =
+	{
+		"auto",
+		"float",
+		"half"
+	};
+	return names;
 }
 
+LazyGLTextureLoader::Format LazyGLTextureLoader::chooseFormat(const HDRImage & img, Precision precision)
+{
+	TRACE_ZONE("LazyGLTextureLoader::chooseFormat");
+	if (img.isSingleChannel())
+	{
+		// the raw values go to the GPU as they are, and the shader maps them to colors
+		HDRImage::IntensityMap values = img.intensity();
+		atomic<bool> fitsHalf(true);
+		parallel_for(BlockedRange(0, int(values.cols())), [&values,&fitsHalf](int y0, int y1)
+		{
+			for (int y = y0; y < y1; ++y)
+				for (int x = 0; x < values.rows(); ++x)
+					if (!halfKeeps(values(x, y)))
+					{
+						fitsHalf = false;
+						return;
+					}
+		});
+
+		// the colormap spreads the range of the values, so half's rounding at the top of the range has
+		// to stay well below one of its 256 steps, or e.g. depths far from the camera would show bands
+		Vector2f range = img.singleChannelRange();
+		if (range[1] > 0.f && (range[0] + range[1]) / 2048.f > range[1] / 256.f)
+			fitsHalf = false;
+
+		bool useHalf = precision == HALF_PRECISION || (precision == AUTO_PRECISION && fitsHalf);
+
+		Format f;
+		f.channels = 1;
+		f.format = GL_RED;
+		f.type = useHalf ? GL_HALF_FLOAT : GL_FLOAT;
+		f.internalFormat = useHalf ? GL_R16F : GL_R32F;
+		return f;
+	}
+
+	// determine in parallel whether the image is gray and opaque, and whether half precision keeps all its values
+	atomic<bool> gray(true), fitsHalf(true);
+	parallel_for(BlockedRange(0, int(img.size())), [&img,&gray,&fitsHalf](int begin, int end)
+	{
+		bool g = true, h = true;
+		for (int i = begin; i < end && (g || h); ++i)
+		{
+			const Color4 & p = img(i);
+			g = g && p.r == p.g && p.r == p.b && p.a == 1.f;
+			for (int c = 0; c < 4 && h; ++c)
+				h = halfKeeps(p[c]);
+		}
+		if (!g) gray = false;
+		if (!h) fitsHalf = false;
+	});
+
+	bool useHalf = precision == HALF_PRECISION || (precision == AUTO_PRECISION && fitsHalf);
+
+	Format f;
+	f.channels = gray ? 1 : 4;
+	f.format = gray ? GL_RED : GL_RGBA;
+	f.type = useHalf ? GL_HALF_FLOAT : GL_FLOAT;
+	f.internalFormat = gray ? (useHalf ? GL_R16F : GL_R32F) : (useHalf ? GL_RGBA16F : GL_RGBA32F);
+	return f;
+}
 
 
 LazyGLTextureLoader::~LazyGLTextureLoader()
 {
+	releaseBuffers(true);
 	if (m_texture)
 		glDeleteTextures(1, &m_texture);
 }
 
+GLuint LazyGLTextureLoader::textureID() const
+{
+	return m_useVirtual ? m_virtual->cacheTexture() : m_texture;
+}
+
+bool LazyGLTextureLoader::uploaded() const
+{
+	return m_useVirtual ? m_virtual->ready() : m_texture && !m_dirty;
+}
+
+size_t LazyGLTextureLoader::bytes() const
+{
+	return m_bytes + (m_virtual ? m_virtual->bytes() : 0);
+}
+
+void LazyGLTextureLoader::setDirty()
+{
+	// whether the image still needs a virtual texture is decided again on the next upload
+	if (m_virtual)
+		m_virtual->setDirty();
+	m_useVirtual = false;
+	m_dirty = true;
+	m_dirtyRegions.clear();
+	m_allocated = false;
+	m_nextScanline = 0;
+	m_nextLevel = 0;
+	m_uploadTime = 0;
+	releaseBuffers(false);
+}
+
+void LazyGLTextureLoader::setDirty(const vector<AlignedBox2i> & regions)
+{
+	// the pages of a virtual texture are derived from the CPU mip chain, which has to be computed again anyway
+	if (m_useVirtual)
+		return setDirty();
+
+	if (m_texture && !m_dirty)
+	{
+		// nothing changed
+		if (regions.empty())
+			return;
+		m_dirty = true;
+		m_dirtyRegions = regions;
+	}
+	else if (m_dirty && !m_dirtyRegions.empty())
+		// an update of other regions is still pending
+		m_dirtyRegions.insert(m_dirtyRegions.end(), regions.begin(), regions.end());
+	else
+		setDirty();
+
+	if (m_dirtyRegions.size() > size_t(MaxDirtyRegions))
+	{
+		AlignedBox2i bounds = m_dirtyRegions.front();
+		for (auto & r : m_dirtyRegions)
+			bounds.extend(r);
+		m_dirtyRegions.assign(1, bounds);
+	}
+}
+
+void LazyGLTextureLoader::release()
+{
+	setDirty();
+	releaseBuffers(true);
+	if (m_texture)
+		glDeleteTextures(1, &m_texture);
+	m_texture = 0;
+	m_bytes = 0;
+	if (m_virtual)
+		m_virtual->release();
+}
+
+void LazyGLTextureLoader::releaseBuffers(bool deleteBuffers)
+{
+	// abandon the background work for a previous upload
+	m_mipChain = nullptr;
+	m_formatTask = nullptr;
+
+	for (auto & pbo : m_buffers)
+	{
+		if (pbo.fill)
+		{
+			// wait for (or abandon) the copy before giving the mapped memory back to GL
+			pbo.fill = nullptr;
+			glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pbo.id);
+			glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+		}
+		if (pbo.fence)
+		{
+			glDeleteSync(pbo.fence);
+			pbo.fence = nullptr;
+		}
+		if (deleteBuffers && pbo.id)
+			glDeleteBuffers(1, &pbo.id);
+	}
+
+	if (!m_buffers.empty())
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+	if (deleteBuffers)
+		m_buffers.clear();
+}
+
+void LazyGLTextureLoader::allocateTexture(const HDRImage & img, int numLevels, const Format & format)
+{
+	TRACE_ZONE("LazyGLTextureLoader::allocateTexture");
+	if (!m_texture)
+		glGenTextures(1, &m_texture);
+
+	glBindTexture(GL_TEXTURE_2D, m_texture);
+
+	m_format = format;
+	m_width = img.width();
+	m_height = img.height();
+	m_rawValues = img.isSingleChannel();
+	m_bytes = 0;
+	for (int l = 0; l < numLevels; ++l)
+	{
+		glTexImage2D(GL_TEXTURE_2D, l, format.internalFormat,
+		             mipSize(img.width(), l), mipSize(img.height(), l),
+		             0, format.format, format.type, nullptr);
+		m_bytes += size_t(mipSize(img.width(), l)) * mipSize(img.height(), l) * format.bytesPerPixel();
+	}
+
+	// single-channel textures are expanded to opaque gray when sampled
+	const GLint grayMask[] = { GL_RED, GL_RED, GL_RED, GL_ONE };
+	const GLint rgbaMask[] = { GL_RED, GL_GREEN, GL_BLUE, GL_ALPHA };
+	glTexParameteriv(GL_TEXTURE_2D, GL_TEXTURE_SWIZZLE_RGBA, format.channels == 1 ? grayMask : rgbaMask);
+
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+//	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	// interpolating the raw values of single-channel images would blend valid and invalid pixels
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER,
+	                img.isSingleChannel() ? GL_NEAREST_MIPMAP_NEAREST : GL_LINEAR_MIPMAP_LINEAR);
+
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_BORDER);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_BORDER);
+	const GLfloat borderColor[] = { 0.0f, 0.0f, 0.0f, 0.0f };
+	glTexParameterfv(GL_TEXTURE_2D, GL_TEXTURE_BORDER_COLOR, borderColor);
+}
+
 bool LazyGLTextureLoader::uploadToGPU(const std::shared_ptr<const HDRImage> &img,
                                       int milliseconds,
                                       int chunkSize)
 {
+	TRACE_ZONE("LazyGLTextureLoader::uploadToGPU");
 	if (img->isNull())
 	{
 		m_dirty = false;
 		return false;
 	}
 
+	if (m_dirty && !m_useVirtual && m_dirtyRegions.empty())
+	{
+		// images too large for a single texture only upload the tiles that are visible
+		m_useVirtual = VirtualTexture::needed(*img);
+		if (m_useVirtual)
+		{
+			releaseBuffers(true);
+			if (m_texture)
+				glDeleteTextures(1, &m_texture);
+			m_texture = 0;
+			m_bytes = 0;
+			if (!m_virtual)
+				m_virtual.reset(new VirtualTexture);
+		}
+		else if (m_virtual)
+			m_virtual->release();
+	}
+
+	if (m_useVirtual)
+	{
+		bool ready = m_virtual->update(img, milliseconds, s_precision);
+		m_dirty = !m_virtual->ready();
+		return ready;
+	}
+
 	// check if we need to upload the image to the GPU
 	if (!m_dirty && m_texture)
 		return false;
 
+	// patch the changed regions into the texture if possible, and start over otherwise
+	if (!m_dirtyRegions.empty() && uploadRegions(*img))
+		return true;
+
+	return m_usePBO ? uploadStreamed(img, milliseconds) : uploadDirect(img, milliseconds, chunkSize);
+}
+
+bool LazyGLTextureLoader::canHoldRegion(const HDRImage & img, const AlignedBox2i & region) const
+{
+	if (m_format.channels == 4 && m_format.type == GL_FLOAT)
+		return true;
+
+	// the format was chosen for the old contents, check that it still fits the new pixels
+	bool checkHalf = m_format.type == GL_HALF_FLOAT && s_precision == AUTO_PRECISION;
+	bool checkGray = m_format.channels == 1;
+	atomic<bool> fits(true);
+	parallel_for(region.min().y(), region.max().y(), [&](int y)
+	{
+		for (int x = region.min().x(); x < region.max().x() && fits; ++x)
+		{
+			const Color4 & p = img(x, y);
+			if (checkGray && !(p.r == p.g && p.r == p.b && p.a == 1.f))
+				fits = false;
+			for (int c = 0; c < 4 && checkHalf; ++c)
+				if (!halfKeeps(p[c]))
+					fits = false;
+		}
+	});
+	return fits;
+}
+
+bool LazyGLTextureLoader::uploadRegions(const HDRImage & img)
+{
+	TRACE_ZONE("LazyGLTextureLoader::uploadRegions");
 	Timer timer;
-	// Allocate texture memory for the image
-	if (!m_texture)
-		glGenTextures(1, &m_texture);
+	if (img.isSingleChannel() || m_rawValues || img.width() != m_width || img.height() != m_height)
+	{
+		setDirty();
+		return false;
+	}
+
+	vector<AlignedBox2i> regions;
+	for (auto & r : m_dirtyRegions)
+	{
+		AlignedBox2i clipped = r.intersection(AlignedBox2i(Vector2i(0, 0), Vector2i(m_width, m_height)));
+		if ((clipped.min().array() < clipped.max().array()).all())
+			regions.push_back(clipped);
+	}
+	for (auto & r : regions)
+		if (!canHoldRegion(img, r))
+		{
+			setDirty();
+			return false;
+		}
 
 	glBindTexture(GL_TEXTURE_2D, m_texture);
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+	glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+	glPixelStorei(GL_UNPACK_SKIP_ROWS, 0);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
 
-	// allocate a new texture and set parameters only if this is the first scanline
-	if (m_nextScanline == 0)
+	vector<char> staging;
+	for (auto & r : regions)
+	{
+		int w = r.sizes().x(), h = r.sizes().y();
+		staging.resize(size_t(w) * h * m_format.bytesPerPixel());
+		char * dst = staging.data();
+		size_t rowBytes = size_t(w) * m_format.bytesPerPixel();
+		Format fmt = m_format;
+		parallel_for(0, h, [&](int j)
+		{
+			const Color4 * begin = &img(r.min().x(), r.min().y() + j);
+			char * row = dst + j * rowBytes;
+			if (fmt.type == GL_FLOAT)
+				convertPixels(begin, begin + w, fmt.channels, (float *) row);
+			else
+				convertPixels(begin, begin + w, fmt.channels, (::half *) row);
+		});
+
+		glTexSubImage2D(GL_TEXTURE_2D, 0, r.min().x(), r.min().y(), w, h,
+		                m_format.format, m_format.type, (const GLvoid *) staging.data());
+	}
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+
+	updateMipRegions(regions);
+
+	m_dirtyRegions.clear();
+	m_dirty = false;
+	spdlog::get("console")->trace("Updating {} region(s) of the texture took {} ms", regions.size(), timer.elapsed());
+	return true;
+}
+
+void LazyGLTextureLoader::updateMipRegions(const vector<AlignedBox2i> & regions)
+{
+	TRACE_ZONE("LazyGLTextureLoader::updateMipRegions");
+	int numLevels = numMipLevels(m_width, m_height);
+	if (numLevels <= 1 || regions.empty())
+		return;
+
+	GLShader * shader = mipShader();
+	GLuint framebuffer = 0;
+	if (shader)
+		glGenFramebuffers(1, &framebuffer);
+	if (!framebuffer)
+	{
+		glGenerateMipmap(GL_TEXTURE_2D);
+		return;
+	}
+
+	// save the state we are about to change
+	GLint previousFramebuffer, viewport[4], scissorBox[4];
+	glGetIntegerv(GL_FRAMEBUFFER_BINDING, &previousFramebuffer);
+	glGetIntegerv(GL_VIEWPORT, viewport);
+	glGetIntegerv(GL_SCISSOR_BOX, scissorBox);
+	GLboolean blend = glIsEnabled(GL_BLEND);
+	GLboolean scissor = glIsEnabled(GL_SCISSOR_TEST);
+	GLboolean depth = glIsEnabled(GL_DEPTH_TEST);
+
+	glDisable(GL_BLEND);
+	glDisable(GL_DEPTH_TEST);
+	glEnable(GL_SCISSOR_TEST);
+	glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+
+	shader->bind();
+	glActiveTexture(GL_TEXTURE0);
+	glBindTexture(GL_TEXTURE_2D, m_texture);
+	shader->setUniform("source", 0);
+	shader->setUniform("rawValues", (int) m_rawValues);
+
+	// each level is rendered from the one above it, which is the only level the shader may sample from
+	vector<AlignedBox2i> dirty = regions;
+	for (int l = 1; l < numLevels; ++l)
 	{
-		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA,
-		             img->width(), img->height(),
-		             0, GL_RGBA, GL_FLOAT, nullptr);
+		int w = mipSize(m_width, l), h = mipSize(m_height, l);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, l - 1);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, l - 1);
+		glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, m_texture, l);
+		if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+		{
+			spdlog::get("console")->warn("Cannot render into the mip levels, regenerating all of them instead.");
+			glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, 0, 0);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, 0);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, numLevels - 1);
+			glGenerateMipmap(GL_TEXTURE_2D);
+			break;
+		}
+		glViewport(0, 0, w, h);
+		shader->setUniform("sourceSize", Vector2i(mipSize(m_width, l - 1), mipSize(m_height, l - 1)));
+
+		// the texels of this level that read from the changed texels of the previous one
+		for (auto & r : dirty)
+		{
+			r = AlignedBox2i(r.min() / 2, ((r.max().array() + 1) / 2).matrix().cwiseMin(Vector2i(w, h)).eval());
+			glScissor(r.min().x(), r.min().y(), r.sizes().x(), r.sizes().y());
+			shader->drawArray(GL_TRIANGLES, 0, 3);
+		}
+	}
 
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-//		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+	// restore the state
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, 0);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, numLevels - 1);
+	glBindFramebuffer(GL_FRAMEBUFFER, previousFramebuffer);
+	glDeleteFramebuffers(1, &framebuffer);
+	glViewport(viewport[0], viewport[1], viewport[2], viewport[3]);
+	glScissor(scissorBox[0], scissorBox[1], scissorBox[2], scissorBox[3]);
+	if (blend) glEnable(GL_BLEND);
+	if (!scissor) glDisable(GL_SCISSOR_TEST);
+	if (depth) glEnable(GL_DEPTH_TEST);
+}
 
-		glPixelStorei(GL_UNPACK_ROW_LENGTH, img->width());
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_BORDER);
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_BORDER);
-		const GLfloat borderColor[] = { 0.0f, 0.0f, 0.0f, 0.0f };
-		glTexParameterfv(GL_TEXTURE_2D, GL_TEXTURE_BORDER_COLOR, borderColor);
+bool LazyGLTextureLoader::uploadDirect(const std::shared_ptr<const HDRImage> &img,
+                                       int milliseconds,
+                                       int chunkSize)
+{
+	TRACE_ZONE("LazyGLTextureLoader::uploadDirect");
+	Timer timer;
+	// allocate a new texture and set parameters only if this is the first scanline
+	if (m_nextScanline == 0)
+	{
+		Format f;
+		if (img->isSingleChannel())
+		{
+			f.internalFormat = GL_R32F;
+			f.format = GL_RED;
+			f.channels = 1;
+		}
+		allocateTexture(*img, 1, f);
 	}
+	else
+		glBindTexture(GL_TEXTURE_2D, m_texture);
 
+	glPixelStorei(GL_UNPACK_ROW_LENGTH, img->width());
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, 0);
 
 	int maxLines = max(1, chunkSize / img->width());
@@ -136,14 +671,25 @@ bool LazyGLTextureLoader::uploadToGPU(const std::shared_ptr<const HDRImage> &img
 		int remaining = img->height() - m_nextScanline;
 		int numLines = std::min(maxLines, remaining);
 
-		glPixelStorei(GL_UNPACK_SKIP_ROWS, m_nextScanline);
-		glTexSubImage2D(GL_TEXTURE_2D,
-		                0,		                     // level
-		                0, m_nextScanline,	         // xoffset, yoffset
-		                img->width(), numLines,      // tile width and height
-		                GL_RGBA,			         // format
-		                GL_FLOAT,		             // type
-		                (const GLvoid *) img->data());
+		if (img->isSingleChannel())
+		{
+			// the scanlines of single-channel images may be anywhere in memory, so upload them one at a time
+			glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+			HDRImage::IntensityMap values = img->intensity();
+			for (int y = m_nextScanline; y < m_nextScanline + numLines; ++y)
+				glTexSubImage2D(GL_TEXTURE_2D, 0, 0, y, img->width(), 1, GL_RED, GL_FLOAT, (const GLvoid *) (values.data() + y * values.outerStride()));
+		}
+		else
+		{
+			glPixelStorei(GL_UNPACK_SKIP_ROWS, m_nextScanline);
+			glTexSubImage2D(GL_TEXTURE_2D,
+			                0,		                     // level
+			                0, m_nextScanline,	         // xoffset, yoffset
+			                img->width(), numLines,      // tile width and height
+			                GL_RGBA,			         // format
+			                GL_FLOAT,		             // type
+			                (const GLvoid *) img->data());
+		}
 
 		m_nextScanline += maxLines;
 
@@ -168,9 +714,602 @@ bool LazyGLTextureLoader::uploadToGPU(const std::shared_ptr<const HDRImage> &img
 		spdlog::get("console")->trace("Generating mipmaps took {} ms", timer.lap());
 	}
 
+	glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+	glPixelStorei(GL_UNPACK_SKIP_ROWS, 0);
+
 	return !m_dirty;
 }
 
+bool LazyGLTextureLoader::uploadStreamed(const std::shared_ptr<const HDRImage> &img,
+                                         int milliseconds)
+{
+	TRACE_ZONE("LazyGLTextureLoader::uploadStreamed");
+	Timer timer;
+	if (!m_formatTask)
+	{
+		// inspect the image to pick the texture format, and build the rest of the mip chain on the CPU
+		// while the base level is streaming
+		Precision precision = s_precision;
+		m_formatTask = make_shared<FormatTask>([img,precision]{return chooseFormat(*img, precision);});
+		m_formatTask->compute();
+
+		m_mipChain = make_shared<MipChain>(
+			[img]
+			{
+				vector<HDRImage> levels;
+				const HDRImage * prev = img.get();
+				while (prev->width() > 1 || prev->height() > 1)
+				{
+					levels.push_back(downsampled(*prev));
+					prev = &levels.back();
+				}
+				return levels;
+			});
+		m_mipChain->compute();
+	}
+
+	if (!m_allocated)
+	{
+		if (!m_formatTask->ready())
+			return false;
+
+		m_numLevels = numMipLevels(img->width(), img->height());
+		allocateTexture(*img, m_numLevels, m_formatTask->get());
+		m_allocated = true;
+
+		// sample only from the base level until all levels are in
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, 0);
+
+		if (m_buffers.empty())
+		{
+			m_buffers.resize(NumPixelBuffers);
+			for (auto & pbo : m_buffers)
+			{
+				glGenBuffers(1, &pbo.id);
+				glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pbo.id);
+				glBufferData(GL_PIXEL_UNPACK_BUFFER, PixelBufferSize, nullptr, GL_STREAM_DRAW);
+				pbo.size = PixelBufferSize;
+			}
+		}
+	}
+	else
+		glBindTexture(GL_TEXTURE_2D, m_texture);
+
+	// the bands are tightly packed within the pixel buffers
+	glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+	glPixelStorei(GL_UNPACK_SKIP_ROWS, 0);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+
+	while (true)
+	{
+		bool busy = false, progressed = false;
+		for (auto & pbo : m_buffers)
+		{
+			// mapping failed, and we fell back to direct uploads
+			if (!m_usePBO)
+				break;
+
+			if (pbo.fill)
+			{
+				// hand bands that finished copying over to the GPU
+				if (pbo.fill->ready())
+					progressed |= flushBuffer(pbo, *img);
+				busy = true;
+			}
+			else if (m_nextLevel < m_numLevels)
+				// start copying the next band into a free buffer
+				progressed |= fillBuffer(pbo, img);
+		}
+
+		if (!m_usePBO)
+			break;
+
+		if (!busy && m_nextLevel >= m_numLevels)
+		{
+			// done
+			m_nextScanline = -1;
+			m_dirty = false;
+			break;
+		}
+
+		if (timer.elapsed() > milliseconds)
+			break;
+
+		if (!progressed)
+			this_thread::yield();
+	}
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+
+	m_uploadTime += timer.lap();
+
+	if (!m_dirty)
+	{
+		m_mipChain = nullptr;
+		m_formatTask = nullptr;
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, m_numLevels - 1);
+		spdlog::get("console")->trace("Streaming texture and {} mip levels to GPU took {} ms", m_numLevels - 1, m_uploadTime);
+	}
+
+	return !m_dirty;
+}
+
+bool LazyGLTextureLoader::flushBuffer(PixelBuffer & pbo, const HDRImage & img)
+{
+	TRACE_ZONE("LazyGLTextureLoader::flushBuffer");
+	pbo.fill = nullptr;
+
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pbo.id);
+	glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+
+	// the transfer is sourced from the buffer, so this only queues up the DMA
+	glTexSubImage2D(GL_TEXTURE_2D,
+	                pbo.level,
+	                0, pbo.y,
+	                mipSize(img.width(), pbo.level), pbo.numLines,
+	                m_format.format,
+	                m_format.type,
+	                nullptr);
+	pbo.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	return true;
+}
+
+bool LazyGLTextureLoader::fillBuffer(PixelBuffer & pbo, const shared_ptr<const HDRImage> & img)
+{
+	TRACE_ZONE("LazyGLTextureLoader::fillBuffer");
+	// the GPU may still be reading from this buffer
+	if (pbo.fence)
+	{
+		GLenum status = glClientWaitSync(pbo.fence, 0, 0);
+		if (status != GL_ALREADY_SIGNALED && status != GL_CONDITION_SATISFIED)
+			return false;
+		glDeleteSync(pbo.fence);
+		pbo.fence = nullptr;
+	}
+
+	// the coarser levels are only available once the background mip computation is done
+	if (m_nextLevel > 0 && !m_mipChain->ready())
+		return false;
+
+	const HDRImage * src = m_nextLevel == 0 ? img.get() : &m_mipChain->get()[m_nextLevel - 1];
+
+	int w = mipSize(img->width(), m_nextLevel);
+	int h = mipSize(img->height(), m_nextLevel);
+	pbo.level = m_nextLevel;
+	pbo.y = m_nextScanline;
+
+	// a band is at least one scanline, so grow the buffer in case a single one does not fit
+	GLsizeiptr rowBytes = GLsizeiptr(w) * m_format.bytesPerPixel();
+	if (rowBytes > pbo.size)
+	{
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pbo.id);
+		glBufferData(GL_PIXEL_UNPACK_BUFFER, rowBytes, nullptr, GL_STREAM_DRAW);
+		pbo.size = rowBytes;
+	}
+	pbo.numLines = int(min(pbo.size / rowBytes, GLsizeiptr(h - m_nextScanline)));
+
+	// advance to the next band
+	m_nextScanline += pbo.numLines;
+	if (m_nextScanline >= h)
+	{
+		m_nextScanline = 0;
+		++m_nextLevel;
+	}
+
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pbo.id);
+	void * dst = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, w * pbo.numLines * m_format.bytesPerPixel(),
+	                              GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT | GL_MAP_UNSYNCHRONIZED_BIT);
+	if (!dst)
+	{
+		spdlog::get("console")->error("Could not map pixel buffer, falling back to direct texture uploads.");
+		m_usePBO = false;
+		setDirty();
+		return false;
+	}
+
+	// both the source image and the mip chain are kept alive by the copy task
+	auto mips = m_mipChain;
+	int y = pbo.y, numLines = pbo.numLines;
+	Format fmt = m_format;
+	pbo.fill = make_shared<FillTask>(
+		[img,mips,src,dst,y,numLines,fmt]
+		{
+			if (src->isSingleChannel())
+			{
+				// one scanline at a time, since they need not be contiguous
+				HDRImage::IntensityMap values = src->intensity();
+				int w = src->width();
+				for (int j = 0; j < numLines; ++j)
+				{
+					const float * begin = values.data() + (y + j) * values.outerStride();
+					if (fmt.type == GL_FLOAT)
+						copy(begin, begin + w, (float *) dst + j * w);
+					else
+						transform(begin, begin + w, (::half *) dst + j * w, [](float v) {return ::half(v);});
+				}
+				return true;
+			}
+
+			const Color4 * begin = src->data() + y * src->width();
+			const Color4 * end = src->data() + (y + numLines) * src->width();
+			if (fmt.type == GL_FLOAT && fmt.channels == 4)
+				copy(begin, end, (Color4 *) dst);
+			else if (fmt.type == GL_FLOAT)
+				convertPixels(begin, end, fmt.channels, (float *) dst);
+			else
+				convertPixels(begin, end, fmt.channels, (::half *) dst);
+			return true;
+		});
+	pbo.fill->compute();
+	return true;
+}
+
+
+
+size_t VirtualTexture::s_cacheBudget = size_t(256) << 20;
+
+bool VirtualTexture::needed(const HDRImage & img)
+{
+	if (maxTextureSize() > 0 && (img.width() > maxTextureSize() || img.height() > maxTextureSize()))
+		return true;
+
+	// a texture with all its mip levels, even in half precision, would crowd out all other images
+	size_t bytes = size_t(img.width()) * img.height() * 4 * sizeof(::half) / 3 * 4;
+	return GLImage::textureBudget() && bytes > GLImage::textureBudget() / 4;
+}
+
+VirtualTexture::~VirtualTexture()
+{
+	release();
+}
+
+void VirtualTexture::setDirty()
+{
+	m_image = nullptr;
+	m_levels = nullptr;
+	m_formatTask = nullptr;
+	m_ready = false;
+	m_starved = false;
+	m_slots.clear();
+	m_resident.clear();
+	m_queue.clear();
+	++m_version;
+}
+
+void VirtualTexture::release()
+{
+	setDirty();
+	if (m_cache)
+		glDeleteTextures(1, &m_cache);
+	if (m_pageTable)
+		glDeleteTextures(1, &m_pageTable);
+	m_cache = m_pageTable = 0;
+	m_bytes = 0;
+	m_pageEntries = vector<uint8_t>();
+	m_staging = vector<char>();
+}
+
+int VirtualTexture::pagesX(int level) const
+{
+	return (mipSize(m_width, level) + TileSize - 1) / TileSize;
+}
+
+int VirtualTexture::pagesY(int level) const
+{
+	return (mipSize(m_height, level) + TileSize - 1) / TileSize;
+}
+
+const HDRImage & VirtualTexture::levelImage(int level) const
+{
+	return level == 0 ? *m_image : m_levels->get()[level - 1];
+}
+
+void VirtualTexture::start(const shared_ptr<const HDRImage> & img, LazyGLTextureLoader::Precision precision)
+{
+	m_image = img;
+	m_width = img->width();
+	m_height = img->height();
+	m_rawValues = img->isSingleChannel();
+
+	// down to the first level that fits in a single page
+	m_numLevels = 1;
+	while (max(mipSize(m_width, m_numLevels - 1), mipSize(m_height, m_numLevels - 1)) > TileSize)
+		++m_numLevels;
+
+	m_formatTask = make_shared<AsyncTask<LazyGLTextureLoader::Format>>(
+		[img,precision]{return LazyGLTextureLoader::chooseFormat(*img, precision);});
+	m_formatTask->compute();
+
+	int numLevels = m_numLevels;
+	m_levels = make_shared<AsyncTask<vector<HDRImage>>>(
+		[img,numLevels]
+		{
+			vector<HDRImage> levels;
+			const HDRImage * prev = img.get();
+			for (int l = 1; l < numLevels; ++l)
+			{
+				levels.push_back(downsampled(*prev));
+				prev = &levels.back();
+			}
+			return levels;
+		});
+	m_levels->compute();
+}
+
+void VirtualTexture::allocate(const LazyGLTextureLoader::Format & format)
+{
+	TRACE_ZONE("VirtualTexture::allocate");
+	m_format = format;
+
+	// as many slots as fit in the budget, but enough to cover a screen at two levels
+	size_t slotBytes = size_t(SlotSize) * SlotSize * format.bytesPerPixel();
+	int n = int(sqrt(double(s_cacheBudget / slotBytes)));
+	m_slotsPerSide = min(max(n, 8), min(255, int(maxTextureSize()) / SlotSize));
+	int side = m_slotsPerSide * SlotSize;
+
+	if (!m_cache)
+		glGenTextures(1, &m_cache);
+	glBindTexture(GL_TEXTURE_2D, m_cache);
+	glTexImage2D(GL_TEXTURE_2D, 0, format.internalFormat, side, side, 0, format.format, format.type, nullptr);
+
+	const GLint grayMask[] = { GL_RED, GL_RED, GL_RED, GL_ONE };
+	const GLint rgbaMask[] = { GL_RED, GL_GREEN, GL_BLUE, GL_ALPHA };
+	glTexParameteriv(GL_TEXTURE_2D, GL_TEXTURE_SWIZZLE_RGBA, format.channels == 1 ? grayMask : rgbaMask);
+
+	// the shader picks the level, so the cache itself has no mip levels, and the borders of the pages
+	// keep bilinear filtering from reaching into the neighboring slots
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, 0);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, m_rawValues ? GL_NEAREST : GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+
+	m_slots.assign(size_t(m_slotsPerSide) * m_slotsPerSide, Slot());
+	m_resident.clear();
+
+	// no page has a resident level (255) yet
+	m_levelRows.resize(m_numLevels);
+	int rows = 0;
+	for (int l = 0; l < m_numLevels; ++l)
+	{
+		m_levelRows[l] = rows;
+		rows += pagesY(l);
+	}
+	m_pageEntries.assign(size_t(pagesX(0)) * rows * 4, 0);
+	for (size_t i = 2; i < m_pageEntries.size(); i += 4)
+		m_pageEntries[i] = 255;
+
+	if (!m_pageTable)
+		glGenTextures(1, &m_pageTable);
+	glBindTexture(GL_TEXTURE_2D, m_pageTable);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8UI, pagesX(0), rows, 0, GL_RGBA_INTEGER, GL_UNSIGNED_BYTE, nullptr);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, 0);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	m_dirtyRows[0] = 0;
+	m_dirtyRows[1] = rows;
+
+	m_bytes = size_t(side) * side * format.bytesPerPixel() + m_pageEntries.size();
+}
+
+void VirtualTexture::request(const AlignedBox2i & region, int level)
+{
+	if (!m_image)
+		return;
+
+	// the first request after an update starts the requests of a new frame
+	if (m_queueFrame != m_frame)
+	{
+		m_queue.clear();
+		m_queueFrame = m_frame;
+		m_starved = false;
+	}
+
+	// a level two steps coarser takes a sixteenth of the pages, and stands in quickly while the others stream in
+	level = ::clamp(level, 0, m_numLevels - 1);
+	int coarse = min(level + 2, m_numLevels - 1);
+	requestLevel(region, coarse);
+	if (coarse != level)
+		requestLevel(region, level);
+}
+
+void VirtualTexture::requestLevel(const AlignedBox2i & region, int level)
+{
+	int x0 = max(0, (region.min().x() >> level) / TileSize),
+	    y0 = max(0, (region.min().y() >> level) / TileSize),
+	    x1 = min(pagesX(level) - 1, (max(0, region.max().x() - 1) >> level) / TileSize),
+	    y1 = min(pagesY(level) - 1, (max(0, region.max().y() - 1) >> level) / TileSize);
+
+	// the pages closest to the center of the region first
+	Vector2f center = 0.5f * Vector2f(x0 + x1 + 1, y0 + y1 + 1);
+	vector<pair<float, uint64_t>> missing;
+	for (int y = y0; y <= y1; ++y)
+		for (int x = x0; x <= x1; ++x)
+		{
+			uint64_t key = pageKey(level, x, y);
+			auto it = m_resident.find(key);
+			if (it != m_resident.end())
+				m_slots[it->second].lastRequested = m_queueFrame;
+			else if (find(m_queue.begin(), m_queue.end(), key) == m_queue.end())
+				missing.emplace_back((Vector2f(x + 0.5f, y + 0.5f) - center).squaredNorm(), key);
+		}
+
+	sort(missing.begin(), missing.end());
+	for (const auto & page : missing)
+		m_queue.push_back(page.second);
+}
+
+bool VirtualTexture::update(const shared_ptr<const HDRImage> & img, int milliseconds,
+                            LazyGLTextureLoader::Precision precision)
+{
+	TRACE_ZONE("VirtualTexture::update");
+	Timer timer;
+	if (!m_image)
+		start(img, precision);
+
+	bool becameReady = false;
+	if (!m_ready)
+	{
+		if (!m_formatTask->ready() || !m_levels->ready())
+			return false;
+		allocate(m_formatTask->get());
+		m_formatTask = nullptr;
+	}
+
+	// the requests made from now on are for the next frame
+	if (m_queueFrame == m_frame)
+		++m_frame;
+	if (m_ready && m_queue.empty())
+		return false;
+
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+	glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+	glPixelStorei(GL_UNPACK_SKIP_ROWS, 0);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+
+	if (!m_ready)
+	{
+		// the coarsest page always stays resident, so every page has something to show
+		uploadPage(m_numLevels - 1, 0, 0);
+		m_ready = becameReady = true;
+	}
+
+	// at least one page per update, so that small budgets still make progress
+	int budget = min(milliseconds, MaxPageMilliseconds);
+	for (bool first = true; !m_queue.empty() && (first || timer.elapsed() < budget); first = false)
+	{
+		uint64_t key = m_queue.front();
+		// e.g. the coarsest page, if it was requested before the texture was ready
+		if (m_resident.count(key))
+		{
+			m_queue.erase(m_queue.begin());
+			continue;
+		}
+		if (!uploadPage(int(key >> 48), int(key & 0xffffff), int((key >> 24) & 0xffffff)))
+		{
+			// the cache is full of pages requested for this frame
+			m_starved = true;
+			break;
+		}
+		m_queue.erase(m_queue.begin());
+	}
+
+	flushPageTable();
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+
+	if (becameReady)
+		spdlog::get("console")->debug("Displaying a {}x{} image through a virtual texture with {} levels and {}x{} slots",
+		                              m_width, m_height, m_numLevels, m_slotsPerSide, m_slotsPerSide);
+	return becameReady;
+}
+
+bool VirtualTexture::uploadPage(int level, int x, int y)
+{
+	TRACE_ZONE("VirtualTexture::uploadPage");
+	int slot = freeSlot();
+	if (slot < 0)
+		return false;
+
+	const HDRImage & src = levelImage(level);
+	m_staging.resize(size_t(SlotSize) * SlotSize * m_format.bytesPerPixel());
+	if (m_format.type == GL_FLOAT)
+		fillPage(src, m_rawValues, x * TileSize, y * TileSize, m_format.channels, (float *) m_staging.data());
+	else
+		fillPage(src, m_rawValues, x * TileSize, y * TileSize, m_format.channels, (::half *) m_staging.data());
+
+	glBindTexture(GL_TEXTURE_2D, m_cache);
+	glTexSubImage2D(GL_TEXTURE_2D, 0, (slot % m_slotsPerSide) * SlotSize, (slot / m_slotsPerSide) * SlotSize,
+	                SlotSize, SlotSize, m_format.format, m_format.type, m_staging.data());
+
+	Slot & s = m_slots[slot];
+	s.level = level;
+	s.x = x;
+	s.y = y;
+	s.lastRequested = m_queueFrame;
+	m_resident[pageKey(level, x, y)] = slot;
+
+	// the page now shows wherever only coarser pages did
+	setPageEntries(level, x, y, slot, level, 255);
+	return true;
+}
+
+int VirtualTexture::freeSlot()
+{
+	int victim = -1;
+	for (int i = 0; i < int(m_slots.size()); ++i)
+	{
+		const Slot & s = m_slots[i];
+		if (s.level < 0)
+			return i;
+		// keep the coarsest page, and the pages requested for this frame
+		if (s.level == m_numLevels - 1 || s.lastRequested >= m_queueFrame)
+			continue;
+		if (victim < 0 || s.lastRequested < m_slots[victim].lastRequested)
+			victim = i;
+	}
+	if (victim < 0)
+		return -1;
+
+	// the page and the finer pages that showed it fall back to its closest resident ancestor
+	Slot & s = m_slots[victim];
+	m_resident.erase(pageKey(s.level, s.x, s.y));
+	for (int a = s.level + 1; a < m_numLevels; ++a)
+	{
+		auto it = m_resident.find(pageKey(a, s.x >> (a - s.level), s.y >> (a - s.level)));
+		if (it != m_resident.end())
+		{
+			setPageEntries(s.level, s.x, s.y, it->second, s.level, s.level);
+			break;
+		}
+	}
+	s = Slot();
+	return victim;
+}
+
+/// Point page (level,x,y), and the finer pages it covers, to slot if their entries show a level in [fromLevel,toLevel]
+void VirtualTexture::setPageEntries(int level, int x, int y, int slot, int fromLevel, int toLevel)
+{
+	const uint8_t entry[4] = {uint8_t(slot % m_slotsPerSide), uint8_t(slot / m_slotsPerSide),
+	                          uint8_t(m_slots[slot].level), 1};
+	int width = pagesX(0);
+	for (int l = level; l >= 0; --l)
+	{
+		int shift = level - l;
+		int x0 = x << shift, y0 = y << shift,
+		    x1 = min((x + 1) << shift, pagesX(l)), y1 = min((y + 1) << shift, pagesY(l));
+		if (x0 >= x1 || y0 >= y1)
+			continue;
+
+		for (int py = y0; py < y1; ++py)
+		{
+			uint8_t * e = &m_pageEntries[4 * (size_t(m_levelRows[l] + py) * width + x0)];
+			for (int px = x0; px < x1; ++px, e += 4)
+				if (e[2] >= fromLevel && e[2] <= toLevel)
+					copy(entry, entry + 4, e);
+		}
+		m_dirtyRows[0] = min(m_dirtyRows[0], m_levelRows[l] + y0);
+		m_dirtyRows[1] = max(m_dirtyRows[1], m_levelRows[l] + y1);
+	}
+}
+
+void VirtualTexture::flushPageTable()
+{
+	if (m_dirtyRows[0] >= m_dirtyRows[1])
+		return;
+
+	int width = pagesX(0);
+	glBindTexture(GL_TEXTURE_2D, m_pageTable);
+	glTexSubImage2D(GL_TEXTURE_2D, 0, 0, m_dirtyRows[0], width, m_dirtyRows[1] - m_dirtyRows[0],
+	                GL_RGBA_INTEGER, GL_UNSIGNED_BYTE, &m_pageEntries[4 * size_t(m_dirtyRows[0]) * width]);
+	m_dirtyRows[0] = numeric_limits<int>::max();
+	m_dirtyRows[1] = 0;
+	++m_version;
+}
+
+
+size_t GLImage::s_memoryBudget = size_t(8192) << 20;
+size_t GLImage::s_textureBudget = size_t(4096) << 20;
+uint64_t GLImage::s_useCount = 0;
 
 
 GLImage::GLImage() :
@@ -186,7 +1325,12 @@ GLImage::GLImage() :
 
 GLImage::~GLImage()
 {
-
+	// don't keep computing results no one will look at
+	if (m_histograms)
+		m_histograms->cancel();
+	if (m_summaryTask)
+		m_summaryTask->cancel();
+	cancelModify();
 }
 
 float GLImage::progress() const
@@ -203,12 +1347,118 @@ bool GLImage::canModify() const
 	return !m_asyncCommand;
 }
 
+size_t GLImage::memoryUsage() const
+{
+	if (!m_image)
+		return 0;
+	return size_t(m_image->width()) * m_image->height() * (m_image->isSingleChannel() ? sizeof(float) : sizeof(Color4));
+}
+
+bool GLImage::canEvict() const
+{
+	return canModify() && !m_evicted && !m_spillFailed && m_image && !m_image->isNull();
+}
+
+bool GLImage::evictPixels()
+{
+	TRACE_ZONE("GLImage::evictPixels");
+	if (!canEvict())
+		return false;
+
+	if (!m_reloadable)
+	{
+		// the spill is out of date if the image has been modified since it was started
+		if (m_spill && m_spilledImage != m_image.get())
+			m_spill = nullptr;
+
+		if (!m_spill)
+		{
+			shared_ptr<const HDRImage> img = m_image;
+			string filename = m_filename;
+			m_spilledImage = img.get();
+			m_spill = make_shared<SpillTask>([img,filename](void) -> shared_ptr<FILE>
+			{
+				TRACE_ZONE("GLImage::spillPixels", filename);
+				try
+				{
+					return spillPixels(*img);
+				}
+				catch (const exception & e)
+				{
+					spdlog::get("console")->error("Cannot swap out image \"{}\": {}", filename, e.what());
+					return nullptr;
+				}
+			});
+			m_spill->compute();
+		}
+
+		// keep the pixels until they are safely on disk
+		if (!m_spill->ready())
+			return false;
+
+		m_spillFile = m_spill->get();
+		m_spill = nullptr;
+		if (!m_spillFile)
+		{
+			m_spillFailed = true;
+			return false;
+		}
+	}
+
+	spdlog::get("console")->debug("Evicting the pixels of image \"{}\"", m_filename);
+	m_evictedSize = Eigen::Vector2i(m_image->width(), m_image->height());
+	m_evicted = true;
+	m_image = make_shared<HDRImage>();
+	m_texture.release();
+	if (m_histograms)
+		m_histograms->cancel();
+	if (m_summaryTask)
+		m_summaryTask->cancel();
+	m_histograms = nullptr;
+	m_summaryTask = nullptr;
+	m_histogramDirty = true;
+	return true;
+}
+
+void GLImage::restorePixels()
+{
+	if (!m_evicted || m_restoring)
+		return;
+
+	auto file = m_spillFile;
+	string filename = m_filename;
+	m_restoring = true;
+	m_asyncCommand = make_shared<AsyncTask<ImageCommandResult>>([file,filename](void) -> ImageCommandResult
+	{
+		TRACE_ZONE("GLImage::restorePixels", filename);
+		Timer timer;
+		shared_ptr<HDRImage> ret;
+		try
+		{
+			ret = file ? unspillPixels(file.get()) : loadImage(filename);
+		}
+		catch (const exception & e)
+		{
+			spdlog::get("console")->error("Cannot swap in image \"{}\": {}", filename, e.what());
+		}
+		if (ret)
+			spdlog::get("console")->debug("Restored \"{}\" in {} seconds", filename, timer.elapsed() / 1000.f);
+		return {ret, nullptr};
+	});
+	m_asyncRetrieved = false;
+	m_asyncCommand->compute();
+}
+
 void GLImage::asyncModify(const ImageCommandWithProgress & command)
 {
 	// make sure any pending edits are done
 	waitForAsyncResult();
 
-	m_asyncCommand = make_shared<AsyncTask<ImageCommandResult>>([this,command](AtomicProgress & prog){return command(m_image, prog);});
+	m_asyncCommand = make_shared<AsyncTask<ImageCommandResult>>([this,command](AtomicProgress & prog)
+	{
+		TRACE_ZONE("GLImage::command");
+		return command(commandInput(), prog);
+	});
 	m_asyncRetrieved = false;
 	m_asyncCommand->compute();
 }
@@ -218,20 +1468,81 @@ void GLImage::asyncModify(const ImageCommand &command)
 	// make sure any pending edits are done
 	waitForAsyncResult();
 
-	m_asyncCommand = make_shared<AsyncTask<ImageCommandResult>>([this,command](void){return command(m_image);});
+	m_asyncCommand = make_shared<AsyncTask<ImageCommandResult>>([this,command](void)
+	{
+		TRACE_ZONE("GLImage::command");
+		return command(commandInput());
+	});
 	m_asyncRetrieved = false;
 	m_asyncCommand->compute();
 }
 
+void GLImage::asyncModify(const ImageCommand &command, const TaskLauncher & launch)
+{
+	// make sure any pending edits are done
+	waitForAsyncResult();
+
+	m_asyncCommand = make_shared<AsyncTask<ImageCommandResult>>([this,command](void)
+	{
+		TRACE_ZONE("GLImage::command");
+		return command(commandInput());
+	});
+	m_asyncRetrieved = false;
+	m_asyncCommand->compute(launch);
+}
+
+shared_ptr<const HDRImage> GLImage::commandInput() const
+{
+	// the image commands all work on four channels, so single-channel images are only expanded once they get edited
+	if (m_image->isSingleChannel())
+		return make_shared<const HDRImage>(m_image->expanded().oriented(m_orientation));
+	// commands work on the pixels as they are displayed
+	if (!m_orientation.isIdentity())
+		return make_shared<const HDRImage>(m_image->oriented(m_orientation));
+	return m_image;
+}
+
+void GLImage::reorient(const HDRImage::Orientation & change)
+{
+	// make sure any pending edits are done
+	waitForAsyncResult();
+
+	auto command = make_shared<OrientationUndo>(m_orientation, change);
+	command->redo(m_image);
+	m_history.addCommand(command);
+}
+
+bool GLImage::cancelModify()
+{
+	if (!m_asyncCommand || m_asyncRetrieved)
+		return false;
+
+	m_asyncCommand->cancel();
+	return true;
+}
+
 bool GLImage::undo()
 {
 	// make sure any pending edits are done
 	waitForAsyncResult();
 
+	// the command knows which regions it is about to change, while it is still in the history
+	vector<AlignedBox2i> regions;
+	const ImageCommandUndo * command = m_history.undoCommand();
+	bool partial = command && command->changedRegions(regions);
+	Vector2i oldSize = m_image ? Vector2i(m_image->width(), m_image->height()) : Vector2i(0, 0);
+
 	if (m_history.undo(m_image))
 	{
+		// e.g. an OrientationUndo
+		if (partial && regions.empty())
+			return true;
+
 		m_histogramDirty = true;
-		m_texture.setDirty();
+		if (partial && m_image && oldSize == Vector2i(m_image->width(), m_image->height()))
+			m_texture.setDirty(regions);
+		else
+			m_texture.setDirty();
 		return true;
 	}
 	return false;
@@ -242,10 +1553,22 @@ bool GLImage::redo()
 	// make sure any pending edits are done
 	waitForAsyncResult();
 
+	// the command knows which regions it is about to change, while it is still in the history
+	vector<AlignedBox2i> regions;
+	const ImageCommandUndo * command = m_history.redoCommand();
+	bool partial = command && command->changedRegions(regions);
+	Vector2i oldSize = m_image ? Vector2i(m_image->width(), m_image->height()) : Vector2i(0, 0);
+
 	if (m_history.redo(m_image))
 	{
+		if (partial && regions.empty())
+			return true;
+
 		m_histogramDirty = true;
-		m_texture.setDirty();
+		if (partial && m_image && oldSize == Vector2i(m_image->width(), m_image->height()))
+			m_texture.setDirty(regions);
+		else
+			m_texture.setDirty();
 		return true;
 	}
 	return false;
@@ -276,26 +1599,73 @@ bool GLImage::waitForAsyncResult() const
 	if (!m_asyncRetrieved)
 	{
 		// now retrieve the result and copy it out of the async task
-		auto result = m_asyncCommand->get();
+		ImageCommandResult result;
+		try
+		{
+			result = m_asyncCommand->get();
+		}
+		catch (const CanceledError &)
+		{
+			// leave the image, history and texture untouched
+			spdlog::get("console")->info("Canceled modifying image \"{}\"", m_filename);
+			m_asyncRetrieved = true;
+			m_restoring = false;
+			modifyFinished();
+			return false;
+		}
+		catch (const exception & e)
+		{
+			// a command that failed leaves everything untouched as well, and pushes nothing onto the history
+			spdlog::get("console")->error("Cannot modify image \"{}\": {}", m_filename, e.what());
+			m_asyncRetrieved = true;
+			m_restoring = false;
+			modifyFinished();
+			return false;
+		}
 
+		if (m_restoring)
+		{
+			// evicted pixels that are back in, the history still applies to them
+			m_restoring = false;
+			m_evicted = false;
+			m_spillFile = nullptr;
+			if (result.first)
+				m_image = result.first;
+			m_texture.setDirty();
+		}
 		// if there is no undo, treat this as an image load
-		if (!result.second)
+		else if (!result.second)
 		{
 			if (result.first)
 			{
 				m_history = CommandHistory();
+				m_orientation = HDRImage::Orientation();
 				m_image = result.first;
+				m_reloadable = true;
 			}
+			m_texture.setDirty();
 		}
 		else
 		{
+			// only the changed regions need to go to the GPU, if the command knows them (in the orientation the
+			// texture is stored in)
+			vector<AlignedBox2i> regions;
+			if (result.first && m_image && result.first->width() == m_image->width() && result.first->height() == m_image->height() &&
+			    m_orientation.isIdentity() && result.second->changedRegions(regions))
+				m_texture.setDirty(regions);
+			else
+				m_texture.setDirty();
+
+			// the command got the pixels in their displayed orientation, which its result now has
+			m_orientation = HDRImage::Orientation();
+
 			m_history.addCommand(result.second);
 			m_image = result.first;
+			m_reloadable = false;
 		}
 
 		m_asyncRetrieved = true;
 		m_histogramDirty = true;
-		m_texture.setDirty();
 
 		if (!result.first)
 		{
@@ -314,63 +1684,242 @@ bool GLImage::waitForAsyncResult() const
 }
 
 
-void GLImage::uploadToGPU() const
+void GLImage::uploadToGPU(int milliseconds) const
 {
-	if (m_texture.uploadToGPU(m_image))
+	if (m_texture.uploadToGPU(m_image, milliseconds))
 		// now that we grabbed the results and uploaded to GPU, destroy the task
 		modifyFinished();
 }
 
+void GLImage::prefetchTexture(int milliseconds) const
+{
+	checkAsyncResult();
+	if (!isNull())
+		uploadToGPU(milliseconds);
+}
+
+
+void GLImage::requestTexture(const AlignedBox2f & region, float texelsPerPixel) const
+{
+	checkAsyncResult();
+	VirtualTexture * texture = isNull() ? nullptr : m_texture.virtualTexture();
+	if (!texture)
+		return;
+
+	Matrix3f toStored = m_orientation.storedUV();
+	Vector2f a = (toStored * Vector3f(region.min().x(), region.min().y(), 1.f)).head<2>(),
+	         b = (toStored * Vector3f(region.max().x(), region.max().y(), 1.f)).head<2>();
+	Vector2f size = storedSize().cast<float>();
+	Vector2f lo = a.cwiseMin(b).cwiseMax(0.f).cwiseMin(1.f).cwiseProduct(size),
+	         hi = a.cwiseMax(b).cwiseMax(0.f).cwiseMin(1.f).cwiseProduct(size);
+
+	int level = texelsPerPixel > 1.f ? int(floor(log2(texelsPerPixel))) : 0;
+	texture->request(AlignedBox2i(lo.array().floor().cast<int>().matrix(), hi.array().ceil().cast<int>().matrix()), level);
+}
+
+bool GLImage::texturePending() const
+{
+	checkAsyncResult();
+	const VirtualTexture * texture = m_texture.virtualTexture();
+	return texture && !isNull() && (!texture->ready() || !texture->complete());
+}
+
+const VirtualTexture * GLImage::virtualTexture() const
+{
+	checkAsyncResult();
+	return m_texture.uploaded() ? m_texture.virtualTexture() : nullptr;
+}
 
 GLuint GLImage::glTextureId() const
 {
 	checkAsyncResult();
 	uploadToGPU();
+	if (hasPreview())
+	{
+		m_previewTexture.uploadToGPU(m_preview);
+		if (m_previewTexture.uploaded())
+			return m_previewTexture.textureID();
+	}
     return m_texture.textureID();
 }
 
+const HDRImage & GLImage::displayedImage() const
+{
+	checkAsyncResult();
+	return hasPreview() && m_previewTexture.uploaded() ? *m_preview : *m_image;
+}
+
+Eigen::Vector2i GLImage::size() const
+{
+	if (!isNull())
+		return Eigen::Vector2i(width(), height());
+	return hasPreview() ? m_orientation.size(m_previewSize) : Eigen::Vector2i(0,0);
+}
+
+HDRImage::PreviewCallback GLImage::previewCallback()
+{
+	auto slot = m_previewSlot = make_shared<PreviewSlot>();
+	return [slot](const shared_ptr<const HDRImage> & preview, int width, int height)
+	{
+		lock_guard<mutex> lock(slot->mutex);
+		slot->image = preview;
+		slot->size = Eigen::Vector2i(width, height);
+	};
+}
+
+shared_ptr<const Thumbnail> GLImage::thumbnail() const
+{
+	lock_guard<mutex> lock(m_thumbnailSlot->mutex);
+	return m_thumbnailSlot->thumbnail;
+}
+
+ThumbnailCallback GLImage::thumbnailCallback()
+{
+	auto slot = m_thumbnailSlot;
+	return [slot](const shared_ptr<const Thumbnail> & thumbnail)
+	{
+		lock_guard<mutex> lock(slot->mutex);
+		slot->thumbnail = thumbnail;
+	};
+}
+
+bool GLImage::hasPreview() const
+{
+	// the preview only stands in until the full-resolution texture is complete
+	if (m_texture.uploaded())
+	{
+		if (m_preview)
+		{
+			m_preview = nullptr;
+			m_previewTexture.release();
+		}
+		m_previewSlot = nullptr;
+		return false;
+	}
+
+	if (!m_preview && m_previewSlot)
+	{
+		lock_guard<mutex> lock(m_previewSlot->mutex);
+		m_preview = m_previewSlot->image;
+		m_previewSize = m_previewSlot->size;
+	}
+	return m_preview != nullptr;
+}
+
 
 bool GLImage::load(const std::string & filename)
 {
+	TRACE_ZONE("GLImage::load", filename);
 	// make sure any pending edits are done
 	waitForAsyncResult();
 
     m_history = CommandHistory();
+	m_orientation = HDRImage::Orientation();
     m_filename = filename;
     m_histogramDirty = true;
 	m_texture.setDirty();
-    return m_image->load(filename);
+    return (m_reloadable = m_image->load(filename));
 }
 
 bool GLImage::save(const std::string & filename,
                    float gain, float gamma,
                    bool sRGB, bool dither) const
 {
+	TRACE_ZONE("GLImage::save", filename);
 	// make sure any pending edits are done
 	waitForAsyncResult();
 
-    if (!m_image->save(filename, gain, gamma, sRGB, dither))
+	bool saved = m_orientation.isIdentity() ? m_image->save(filename, gain, gamma, sRGB, dither) :
+	             m_image->oriented(m_orientation).save(filename, gain, gamma, sRGB, dither);
+    if (!saved)
     	return false;
 
 	m_history.markSaved();
+	// the file may now hold a lossy copy, and the image list switches over to it
+	m_reloadable = false;
 //	setFilename(filename);
 
     return true;
 }
 
-void GLImage::recomputeHistograms(float exposure) const
+void GLImage::recomputeHistograms(float exposure, HistogramShader * gpu) const
 {
 	checkAsyncResult();
 
-    if ((!m_histograms || m_histogramDirty || exposure != m_cachedHistogramExposure) && !m_image->isNull())
-    {
-        m_histograms = make_shared<LazyHistogram>(
-	        [this,exposure](void)
-	        {
-		        return ImageStatistics::computeStatistics(*m_image, exposure);
-	        });
-        m_histograms->compute();
-        m_histogramDirty = false;
-        m_cachedHistogramExposure = exposure;
-    }
+	if (m_image->isNull())
+		return;
+
+	bool needSummary = !m_histograms || m_histogramDirty;
+
+	// summarizing on the GPU only takes a few milliseconds, but needs the whole texture to be resident (and to hold
+	// the displayed colors, which single-channel textures don't)
+	if (gpu && !m_image->isSingleChannel() && (needSummary || (m_summaryTask && !m_histograms->ready())) &&
+	    m_texture.uploaded() && !m_texture.virtualTexture())
+	{
+		if (auto summary = gpu->summarize(m_texture.textureID(), m_image->width(), m_image->height()))
+		{
+			if (m_histograms)
+				m_histograms->cancel();
+			if (m_summaryTask)
+				m_summaryTask->cancel();
+			m_summaryTask = nullptr;
+
+			m_histograms = make_shared<LazyHistogram>(
+				[summary,exposure](void)
+				{
+					return ImageStatistics::computeStatistics(summary, exposure);
+				});
+			m_histograms->compute();
+			m_histogramDirty = false;
+			m_cachedHistogramExposure = exposure;
+			return;
+		}
+	}
+
+	if (!needSummary && exposure == m_cachedHistogramExposure)
+		return;
+
+	if (needSummary)
+	{
+		// the pixels changed, so they need to be summarized again
+		if (m_histograms)
+			m_histograms->cancel();
+		if (m_summaryTask)
+			m_summaryTask->cancel();
+		// don't keep the image alive just for the sake of a task that has not run yet
+		weak_ptr<const HDRImage> weakImage = m_image;
+		m_histograms = m_summaryTask = make_shared<LazyHistogram>(
+			[weakImage,exposure](AtomicProgress & progress)
+			{
+				auto img = weakImage.lock();
+				if (!img)
+					throw CanceledError();
+				return ImageStatistics::computeStatistics(ImageStatistics::summarize(*img, progress), exposure);
+			});
+	}
+	else if (m_histograms->ready())
+	{
+		// only the exposure changed, so just re-bin the existing summary
+		m_summaryTask = nullptr;
+		auto summary = m_histograms->get()->summary;
+		m_histograms = make_shared<LazyHistogram>(
+			[summary,exposure](void)
+			{
+				return ImageStatistics::computeStatistics(summary, exposure);
+			});
+	}
+	else
+	{
+		// the summary is still being computed, so wait for it instead of starting over. The previous task
+		// is no longer reachable from anywhere else, so this is the only place that ever gets its result.
+		auto previous = m_histograms;
+		m_histograms = make_shared<LazyHistogram>(
+			[previous,exposure](void)
+			{
+				return ImageStatistics::computeStatistics(previous->get()->summary, exposure);
+			});
+	}
+	m_histograms->compute();
+	m_histogramDirty = false;
+	m_cachedHistogramExposure = exposure;
 }
\ No newline at end of file
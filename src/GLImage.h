@@ -6,62 +6,94 @@
 
 #pragma once
 
+#include <algorithm>           // for max
 #include <cstdint>             // for uint32_t
+#include <cstdio>              // for FILE
 #include <Eigen/Core>          // for Vector2i, Matrix4f, Vector3f
+#include <Eigen/Geometry>      // for AlignedBox2i
 #include <functional>          // for function
 #include <iosfwd>              // for string
+#include <limits>              // for numeric_limits
 #include <type_traits>         // for swap
 #include <vector>              // for vector, allocator
 #include <nanogui/opengl.h>
 #include "HDRImage.h"          // for HDRImage
+#include "ImageStatistics.h"   // for ImageStatistics
+#include "ThumbnailCache.h"    // for Thumbnail
 #include "Fwd.h"               // for HDRImage
 #include "CommandHistory.h"
 #include "Async.h"
 #include <utility>
 #include <memory>
+#include <mutex>
+#include <unordered_map>
 
-
-struct ImageStatistics
-{
-	float minimum;
-	float average;
-	float maximum;
-	float exposure;
-
-	enum AxisScale : int
-	{
-		ELinear = 0,
-		ESRGB = 1,
-		ELog = 2,
-		ENumAxisScales = 3
-	};
-
-	struct Histogram
-	{
-		Eigen::MatrixX3f values;
-		Eigen::VectorXf xTicks;
-		std::vector<std::string> xTickLabels;
-	};
-
-	Histogram histogram[ENumAxisScales];
-
-
-	static std::shared_ptr<ImageStatistics> computeStatistics(const HDRImage &img, float exposure);
-};
-
+class VirtualTexture;
 
 /*!
  * A helper class that uploads a texture to the GPU incrementally in smaller chunks.
  * To avoid stalling the main rendering thread, chunks are uploaded until a
  * timeout has been reached.
+ *
+ * By default, the pixel data is streamed through a small ring of pixel buffer objects (PBOs).
+ * Worker threads copy bands of scanlines into the mapped buffers while the render thread only
+ * issues the (asynchronous) transfers out of the filled buffers, using fences to know when a
+ * buffer can be reused. The mip chain is computed on the CPU in the background and streamed the
+ * same way, instead of calling glGenerateMipmap on the whole texture once the base level is in.
+ *
+ * When streaming, the texture format is chosen based on the image contents: gray, opaque images
+ * are stored in a single channel, and (depending on the precision setting) values that fit in
+ * half precision are stored as 16-bit floats. Worker threads convert each band while copying it.
+ * Single-channel HDRImages are uploaded as their raw values, which the shader maps to colors.
+ *
+ * Images that are too large for a single texture are displayed through a VirtualTexture instead, see
+ * virtualTexture().
  */
 class LazyGLTextureLoader
 {
 public:
+	/// Precision of the texture data on the GPU
+	enum Precision : int
+	{
+		AUTO_PRECISION = 0, ///< Use half floats unless they would lose values: ones out of half's range, tiny ones
+		                    ///< that would become subnormal, or single-channel ranges too narrow for their magnitude
+		FULL_PRECISION,     ///< Always use 32-bit floats
+		HALF_PRECISION      ///< Always use 16-bit floats
+	};
+	static const std::vector<std::string> & precisionNames();
+
+	/// User setting for the precision used by all subsequently uploaded textures
+	static Precision precision()                {return s_precision;}
+	static void setPrecision(Precision p)       {s_precision = p;}
+
+	/// Describes how the pixel data is stored in the texture
+	struct Format
+	{
+		GLint internalFormat = GL_RGBA32F;
+		GLenum format = GL_RGBA;
+		GLenum type = GL_FLOAT;
+		int channels = 4;
+
+		int bytesPerPixel() const               {return channels * (type == GL_FLOAT ? 4 : 2);}
+	};
+
+	/// Choose the most compact texture format that can represent the image at the requested precision
+	static Format chooseFormat(const HDRImage & img, Precision precision);
+
 	~LazyGLTextureLoader();
 
 	bool dirty() const {return m_dirty;}
-	void setDirty() {m_dirty = true; m_nextScanline = 0; m_uploadTime = 0;}
+	void setDirty();
+	/*!
+	 * Only the pixels [min, max) of the boxes changed, and the image kept its size. If the texture is complete,
+	 * the next uploadToGPU only uploads these regions and regenerates the mip texels they affect (on the GPU),
+	 * as long as the texture format can still hold the new pixels. Otherwise, this is the same as setDirty().
+	 */
+	void setDirty(const std::vector<Eigen::AlignedBox2i> & regions);
+
+	/// Whether to stream through pixel buffer objects (the default) or upload directly from client memory
+	bool usePBO() const             {return m_usePBO;}
+	void setUsePBO(bool b)          {m_usePBO = b; setDirty();}
 
 	/*!
 	 * Incrementally upload a portion of an image to the GPU, returning shortly after the
@@ -77,13 +109,187 @@ public:
 	                 int timeout = 100,
 	                 int chunkSize = 128 * 128);
 
-	GLuint textureID() const {return m_texture;}
+	GLuint textureID() const;
+	/// Whether the whole texture (including all mip levels) is resident on the GPU, or the virtual texture can be drawn
+	bool uploaded() const;
+	const Format & format() const {return m_format;}
+	/// The virtual texture that the image is displayed through instead, if it is too large for a single texture
+	VirtualTexture * virtualTexture() const {return m_useVirtual ? m_virtual.get() : nullptr;}
+
+	/// Amount of GPU memory allocated for the texture, including all mip levels
+	size_t bytes() const;
+	/// Scanlines of the full-resolution level that uploadToGPU still has to upload, for an image of the given height
+	int scanlinesLeft(int height) const
+	{
+		if (!m_dirty || m_nextLevel > 0 || m_useVirtual)
+			return 0;
+		return std::max(0, height - std::max(0, m_nextScanline));
+	}
+	/// Delete the texture to free up GPU memory. The next call to uploadToGPU starts over from scratch.
+	void release();
 
 private:
+	using MipChain = AsyncTask<std::vector<HDRImage>>;
+	using FormatTask = AsyncTask<Format>;
+	using FillTask = AsyncTask<bool>;
+
+	/// One slot in the ring of pixel buffers used for streaming
+	struct PixelBuffer
+	{
+		GLuint id = 0;
+		GLsync fence = nullptr;             ///< Signaled once the GPU is done reading from the buffer
+		std::shared_ptr<FillTask> fill;     ///< Copies a band into the mapped buffer on a worker thread
+		int level = 0, y = 0, numLines = 0; ///< The destination of the band within the texture
+		GLsizeiptr size = 0;                ///< In bytes, at least PixelBufferSize and one scanline
+	};
+
+	void allocateTexture(const HDRImage & img, int numLevels, const Format & format);
+	bool uploadRegions(const HDRImage & img);
+	bool canHoldRegion(const HDRImage & img, const Eigen::AlignedBox2i & region) const;
+	void updateMipRegions(const std::vector<Eigen::AlignedBox2i> & regions);
+	bool uploadDirect(const std::shared_ptr<const HDRImage> & img, int milliseconds, int chunkSize);
+	bool uploadStreamed(const std::shared_ptr<const HDRImage> & img, int milliseconds);
+	bool flushBuffer(PixelBuffer & pbo, const HDRImage & img);
+	bool fillBuffer(PixelBuffer & pbo, const std::shared_ptr<const HDRImage> & img);
+	void releaseBuffers(bool deleteBuffers);
+
 	GLuint m_texture = 0;
+	size_t m_bytes = 0;
+	int m_width = 0, m_height = 0;
+	bool m_rawValues = false;               ///< Whether the texture holds the raw values of a single-channel image
+	std::vector<Eigen::AlignedBox2i> m_dirtyRegions;    ///< If not empty, only these need to be uploaded
 	int m_nextScanline = -1;
 	bool m_dirty = false;
 	double m_uploadTime = 0.0;
+
+	bool m_usePBO = true;
+	Format m_format;
+	std::shared_ptr<FormatTask> m_formatTask;   ///< Inspects the image contents in the background
+	bool m_allocated = false;
+	int m_numLevels = 1;
+	int m_nextLevel = 0;                    ///< Level of the next band to fill
+	std::shared_ptr<MipChain> m_mipChain;   ///< Levels 1 and up, computed in the background
+	std::vector<PixelBuffer> m_buffers;
+
+	std::unique_ptr<VirtualTexture> m_virtual;
+	bool m_useVirtual = false;
+
+	static Precision s_precision;
+};
+
+/*!
+ * Displays an image that is too large for a single texture, because it is larger than GL_MAX_TEXTURE_SIZE or would
+ * take up too much of the texture budget, from a fixed-size cache of tiles.
+ *
+ * The image and its mip levels are split into pages of TileSize x TileSize texels. Each frame, the viewer requests
+ * the pages of the visible region at the mip level it is drawn at, and only those are uploaded into free slots of
+ * the cache texture, with the least recently requested pages making room for them once it is full. A page table,
+ * with one texel per page and the levels stacked on top of each other, tells the shader which slot holds each page.
+ * Pages that are not resident point to the slot of their closest resident ancestor, so the image shows up blurry
+ * rather than missing while its pages stream in. The coarsest level, a single page, always stays resident.
+ *
+ * The mip levels are computed on the CPU in the background, like the mip chain of a streamed texture.
+ */
+class VirtualTexture
+{
+public:
+	static const int TileSize = 256;                ///< Texels of a page along each side
+	static const int SlotSize = TileSize + 2;       ///< Pages are stored with a border of one texel, for filtering
+
+	/// Whether img needs to be displayed through a VirtualTexture rather than a single texture
+	static bool needed(const HDRImage & img);
+	/// User setting for the GPU memory of the tile cache of each virtual texture, in bytes
+	static size_t cacheBudget()                 {return s_cacheBudget;}
+	static void setCacheBudget(size_t bytes)    {s_cacheBudget = bytes;}
+
+	VirtualTexture() = default;
+	~VirtualTexture();
+
+	VirtualTexture(const VirtualTexture &) = delete;
+	VirtualTexture & operator=(const VirtualTexture &) = delete;
+
+	/// The image changed, start over the next time update is called
+	void setDirty();
+	/// Delete the textures and forget the mip levels
+	void release();
+
+	/*!
+	 * Ask for the pages of a region of the stored image at a mip level to be resident. The region is in pixels of
+	 * the full-resolution image. The pages of the requests since the last update are kept in the cache in favor of
+	 * all others, and some coarser pages are requested along with them to fill in while they stream in.
+	 */
+	void request(const Eigen::AlignedBox2i & region, int level);
+	/*!
+	 * Upload requested pages for about the given time, or set the texture up first after setDirty.
+	 *
+	 * @return True iff the texture just became ready to draw
+	 */
+	bool update(const std::shared_ptr<const HDRImage> & img, int milliseconds, LazyGLTextureLoader::Precision precision);
+
+	/// Whether the texture can be drawn, i.e. the coarsest level is resident
+	bool ready() const                          {return m_ready;}
+	/// Whether all requested pages are resident, or as many of them as fit in the cache
+	bool complete() const                       {return m_queue.empty() || m_starved;}
+	/// Changes whenever pages enter or leave the cache, and so what the texture shows
+	int version() const                         {return m_version;}
+
+	GLuint cacheTexture() const                 {return m_cache;}
+	GLuint pageTable() const                    {return m_pageTable;}
+	int slotsPerSide() const                    {return m_slotsPerSide;}
+	int numLevels() const                       {return m_numLevels;}
+	/// Size of the full-resolution level
+	Eigen::Vector2i size() const                {return Eigen::Vector2i(m_width, m_height);}
+	/// GPU memory of the tile cache and the page table
+	size_t bytes() const                        {return m_bytes;}
+
+private:
+	struct Slot
+	{
+		int level = -1, x = 0, y = 0;           ///< The page in the slot, level -1 if the slot is free
+		uint64_t lastRequested = 0;
+	};
+
+	int pagesX(int level) const;
+	int pagesY(int level) const;
+	const HDRImage & levelImage(int level) const;
+	void start(const std::shared_ptr<const HDRImage> & img, LazyGLTextureLoader::Precision precision);
+	void allocate(const LazyGLTextureLoader::Format & format);
+	void requestLevel(const Eigen::AlignedBox2i & region, int level);
+	bool uploadPage(int level, int x, int y);
+	int freeSlot();
+	void setPageEntries(int level, int x, int y, int slot, int fromLevel, int toLevel);
+	void flushPageTable();
+
+	static uint64_t pageKey(int level, int x, int y)
+	{
+		return (uint64_t(level) << 48) | (uint64_t(y) << 24) | uint64_t(x);
+	}
+
+	std::shared_ptr<const HDRImage> m_image;
+	std::shared_ptr<AsyncTask<std::vector<HDRImage>>> m_levels;     ///< Levels 1 and up, computed in the background
+	std::shared_ptr<AsyncTask<LazyGLTextureLoader::Format>> m_formatTask;
+	LazyGLTextureLoader::Format m_format;
+	bool m_rawValues = false;
+
+	GLuint m_cache = 0, m_pageTable = 0;
+	size_t m_bytes = 0;
+	int m_width = 0, m_height = 0, m_numLevels = 1, m_slotsPerSide = 0;
+	bool m_ready = false;
+	int m_version = 0;
+
+	std::vector<Slot> m_slots;
+	std::unordered_map<uint64_t, int> m_resident;  ///< The slots of the resident pages, by pageKey
+	std::vector<int> m_levelRows;               ///< The first row of each level in the page table
+	std::vector<uint8_t> m_pageEntries;         ///< The page table: slot x and y, source level, and 1 if valid
+	int m_dirtyRows[2] = {std::numeric_limits<int>::max(), 0};  ///< The rows of the page table changed since the last upload
+
+	std::vector<uint64_t> m_queue;              ///< The requested pages that are not resident, most important first
+	uint64_t m_frame = 1;                       ///< Counts the updates that followed a request
+	uint64_t m_queueFrame = 0;                  ///< The frame m_queue was requested in
+	bool m_starved = false;                     ///< Whether the cache is full of pages requested in this frame
+	std::vector<char> m_staging;
+
+	static size_t s_cacheBudget;
 };
 
 /*!
@@ -107,21 +313,83 @@ public:
 	float progress() const;
     void asyncModify(const ImageCommand & command);
 	void asyncModify(const ImageCommandWithProgress & command);
+	/// Like asyncModify, but leaves it up to @p launch (e.g. a LoadScheduler) when the command gets to run
+	void asyncModify(const ImageCommand & command, const TaskLauncher & launch);
+	/// Ask the pending asynchronous modification (or load) to stop, leaving the image unchanged
+	bool cancelModify();
     bool isModified() const;
     bool undo();
     bool redo();
     bool hasUndo() const;
     bool hasRedo() const;
 
+	/*!
+	 * The texture to display. While a large image is still loading or being uploaded to the GPU, this is the
+	 * texture of a lower-resolution preview that the loader delivered to previewCallback().
+	 */
 	GLuint glTextureId() const;
+	/// The image whose texture glTextureId() returns: the image itself, or its preview
+	const HDRImage & displayedImage() const;
+	/// Whether the full-resolution texture is completely uploaded, and therefore what glTextureId() returns
+	bool textureResident() const                    { checkAsyncResult(); return !isNull() && m_texture.uploaded(); }
+	/// Whether the full-resolution texture stores 32-bit floats, i.e. reading it back loses nothing
+	bool textureFullPrecision() const               { return m_texture.format().type == GL_FLOAT; }
+	/*!
+	 * The tile cache that glTextureId() is part of, if the image is too large for a single texture and is displayed
+	 * through a VirtualTexture instead, or nullptr.
+	 */
+	const VirtualTexture * virtualTexture() const;
+	/*!
+	 * Ask for the texture of a region of the displayed image, in texture coordinates [0,1]^2, to be paged in for
+	 * drawing it at @p texelsPerPixel. Only images displayed through a VirtualTexture page their texture in.
+	 */
+	void requestTexture(const Eigen::AlignedBox2f & region, float texelsPerPixel) const;
+	/// Whether pages of the texture that were asked for with requestTexture are still on their way to the GPU
+	bool texturePending() const;
+	/// Whether there is anything to display yet, i.e. the image or at least a preview of it
+	bool canDisplay() const                         { return !isNull() || hasPreview(); }
+	/// A (thread-safe) callback for the loader to hand over a preview
+	HDRImage::PreviewCallback previewCallback();
+	/// A small picture of the image for the image list, null until the loader or the ThumbnailCache provides one
+	std::shared_ptr<const Thumbnail> thumbnail() const;
+	/// A (thread-safe) callback to hand over the thumbnail
+	ThumbnailCallback thumbnailCallback();
 	void setFilename(const std::string & filename)  { m_filename = filename; }
     std::string filename() const                    { return m_filename; }
 	bool isNull() const                             { checkAsyncResult(); return !m_image || m_image->isNull(); }
     const HDRImage & image() const                  { checkAsyncResult(); return *m_image; }
-    int width() const                               { checkAsyncResult(); return m_image->width(); }
-    int height() const                              { checkAsyncResult(); return m_image->height(); }
-    Eigen::Vector2i size() const                    { return isNull() ? Eigen::Vector2i(0,0) : Eigen::Vector2i(m_image->width(), m_image->height()); }
-    bool contains(const Eigen::Vector2i& p) const   {return (p.array() >= 0).all() && (p.array() < size().array()).all();}
+	/// The pixels of image(), which stay valid for whoever holds on to them, e.g. another thread, if the image changes
+	std::shared_ptr<const HDRImage> sharedImage() const { checkAsyncResult(); return m_image; }
+	/// Width of the image as displayed, i.e. with orientation() applied, which is also what commands get to see
+    int width() const                               { return m_orientation.size(storedSize()).x(); }
+    int height() const                              { return m_orientation.size(storedSize()).y(); }
+	/// Size of the displayed image, which is also known while a preview stands in for it (see displayedImage)
+    Eigen::Vector2i size() const;
+	/// Whether p is a pixel of the loaded image, in displayed coordinates
+    bool contains(const Eigen::Vector2i& p) const   {return !isNull() && (p.array() >= 0).all() && (p.array() < Eigen::Vector2i(width(), height()).array()).all();}
+	/// The pixel of image() shown at pixel p of the displayed image
+	Eigen::Vector2i storedPixel(const Eigen::Vector2i& p) const { return m_orientation.storedPixel(p, Eigen::Vector2i(width(), height())); }
+
+	/*!
+	 * The orientation that the pixels of image() and the texture are displayed with.
+	 *
+	 * Flipping and rotating by 90 degrees only change the orientation, which is instant and needs no memory.
+	 * The pixels are only brought into the displayed orientation when they get saved, or modified by a command.
+	 */
+	const HDRImage::Orientation & orientation() const { checkAsyncResult(); return m_orientation; }
+	/// Apply @p change on top of the current orientation, as an undoable command
+	void reorient(const HDRImage::Orientation & change);
+	/// Whether the texture holds the raw values of a single-channel image, which the shader maps to colors
+	bool isSingleChannel() const                    { checkAsyncResult(); return m_image->isSingleChannel(); }
+	/*!
+	 * The minimum and extent of the raw values that the colormap is spread over (see HDRImage::singleChannelRange).
+	 * This is the range of the positive values, unless it was set to something else for display.
+	 */
+	Eigen::Vector2f singleChannelRange() const      { checkAsyncResult(); return m_hasRange ? m_range : m_image->singleChannelRange(); }
+	/// Only changes how the image is displayed, not its pixels
+	void setSingleChannelRange(const Eigen::Vector2f & range)   { m_range = range; m_hasRange = true; }
+	void resetSingleChannelRange()                  { m_hasRange = false; }
+	bool hasCustomSingleChannelRange() const        { return m_hasRange; }
 
     bool load(const std::string & filename);
     bool save(const std::string & filename,
@@ -131,7 +399,58 @@ public:
 	float histogramExposure() const             { return m_cachedHistogramExposure; }
 	bool histogramDirty() const                 { return m_histogramDirty; }
 	LazyHistogramPtr histograms() const         { return m_histograms; }
-	void recomputeHistograms(float exposure) const;
+	/*!
+	 * Start recomputing the histograms for the given exposure, if needed.
+	 *
+	 * If gpu is provided and the texture is resident, the pixels are summarized on the GPU instead of the CPU.
+	 * Calling this again while a CPU summary is still running switches over to the GPU once the texture is in.
+	 */
+	void recomputeHistograms(float exposure, HistogramShader * gpu = nullptr) const;
+
+	/*!
+	 * @name Memory management
+	 *
+	 * To stay within a memory budget, the pixels of images that are not being looked at can be evicted from RAM,
+	 * and their textures from the GPU. An evicted image is null until it is restored, but keeps its size, filename
+	 * and history. Images that are unchanged since they were loaded are simply reloaded from their file, while
+	 * all others are first spilled to a temporary file.
+	 *
+	 * The budgets are user settings shared by all images, in bytes. A budget of zero means unlimited. The memory
+	 * budget also covers the freed buffers that the BufferPool keeps for reuse.
+	 */
+	///@{
+	static size_t memoryBudget()                    {return s_memoryBudget;}
+	static void setMemoryBudget(size_t bytes)       {s_memoryBudget = bytes;}
+	static size_t textureBudget()                   {return s_textureBudget;}
+	static void setTextureBudget(size_t bytes)      {s_textureBudget = bytes;}
+
+	/// RAM taken up by the pixels. The undo history is not included.
+	size_t memoryUsage() const;
+	/// GPU memory taken up by the texture
+	size_t textureUsage() const                     {return m_texture.bytes() + m_previewTexture.bytes();}
+	/// RAM taken up by the undo history
+	size_t undoMemoryUsage() const                  {return m_history.bytes();}
+	/// Scanlines of the image that still have to be uploaded to the texture
+	int uploadBacklog() const                       {return m_texture.scanlinesLeft(storedSize().y());}
+
+	/// Mark the image as just used, for least-recently-used eviction
+	void touch() const                              {m_lastUsed = ++s_useCount;}
+	uint64_t lastUsed() const                       {return m_lastUsed;}
+
+	bool isEvicted() const                          {return m_evicted;}
+	/// Whether the pixels are being written to a temporary file, so they can be evicted soon
+	bool isSpilling() const                         {return m_spill != nullptr;}
+	/// Whether the pixels can be evicted right now (they are loaded, and not being modified)
+	bool canEvict() const;
+	/// Free the pixels, spilling them to a temporary file in the background if they cannot be reloaded
+	bool evictPixels();
+	/// Start bringing the pixels of an evicted image back in, using the same progress reporting as a load
+	void restorePixels();
+	/// Delete the texture, it is uploaded again the next time it is needed
+	void evictTexture()                             {m_texture.release();}
+	/// Upload more of the texture for about @p milliseconds ahead of drawing it, e.g. for an image likely to be shown next
+	void prefetchTexture(int milliseconds) const;
+	///@}
 
 	/// Callback executed whenever an image finishes being modified, e.g. via @ref asyncModify
 	const VoidVoidFunc & imageModifyDoneCallback() const            { return m_imageModifyDoneCallback; }
@@ -140,7 +459,10 @@ public:
 private:
 	bool checkAsyncResult() const;
 	bool waitForAsyncResult() const;
-	void uploadToGPU() const;
+	bool hasPreview() const;
+	std::shared_ptr<const HDRImage> commandInput() const;
+	Eigen::Vector2i storedSize() const  { checkAsyncResult(); return m_evicted ? m_evictedSize : Eigen::Vector2i(m_image->width(), m_image->height()); }
+	void uploadToGPU(int milliseconds = 100) const;
 	void modifyFinished() const;
 
 	mutable std::shared_ptr<HDRImage> m_image;
@@ -149,11 +471,49 @@ private:
     mutable float m_cachedHistogramExposure;
     mutable std::atomic<bool> m_histogramDirty;
 	mutable LazyHistogramPtr m_histograms;
+	mutable LazyHistogramPtr m_summaryTask;     ///< The task summarizing the pixels on the CPU, while it may be running
     mutable CommandHistory m_history;
+	mutable HDRImage::Orientation m_orientation;    ///< Changed in place by the OrientationUndos in m_history
+	Eigen::Vector2f m_range = Eigen::Vector2f::Zero();  ///< The displayed single-channel range, if m_hasRange
+	bool m_hasRange = false;
 
 	mutable ModifyingTask m_asyncCommand = nullptr;
 	mutable bool m_asyncRetrieved = false;
 
+	using SpillTask = AsyncTask<std::shared_ptr<FILE>>;
+	mutable bool m_reloadable = false;          ///< Whether the pixels are exactly what loading m_filename gives
+	mutable bool m_evicted = false;
+	mutable bool m_restoring = false;           ///< Whether m_asyncCommand restores evicted pixels
+	Eigen::Vector2i m_evictedSize = Eigen::Vector2i::Zero();
+	std::shared_ptr<SpillTask> m_spill;         ///< Writes the pixels to a temporary file before they can be evicted
+	const HDRImage * m_spilledImage = nullptr;  ///< The pixels m_spill is writing out
+	bool m_spillFailed = false;
+	mutable std::shared_ptr<FILE> m_spillFile;  ///< Holds the evicted pixels, unless they can be reloaded from m_filename
+	mutable uint64_t m_lastUsed = 0;
+
+	/// Where the loader drops off a preview
+	struct PreviewSlot
+	{
+		std::mutex mutex;
+		std::shared_ptr<const HDRImage> image;
+		Eigen::Vector2i size;                   ///< Size of the full image
+	};
+	mutable std::shared_ptr<PreviewSlot> m_previewSlot;
+	mutable std::shared_ptr<const HDRImage> m_preview;
+	mutable Eigen::Vector2i m_previewSize = Eigen::Vector2i::Zero();
+	mutable LazyGLTextureLoader m_previewTexture;
+
+	/// Where the loader or the thumbnail cache drops off a thumbnail
+	struct ThumbnailSlot
+	{
+		std::mutex mutex;
+		std::shared_ptr<const Thumbnail> thumbnail;
+	};
+	std::shared_ptr<ThumbnailSlot> m_thumbnailSlot = std::make_shared<ThumbnailSlot>();
+
+	static size_t s_memoryBudget, s_textureBudget;
+	static uint64_t s_useCount;
+
 	// various callback functions
 	VoidVoidFunc m_imageModifyDoneCallback;
 };
@@ -4,14 +4,32 @@
 // be found in the LICENSE.txt file.
 //
 
+#include <algorithm>                     // for find_if, transform
+#include <atomic>                        // for atomic
+#include <condition_variable>            // for condition_variable
+#include <csignal>                       // for signal, sig_atomic_t
 #include <ctype.h>                       // for tolower
 #include <docopt.h>                      // for docopt
 #include <Eigen/Core>                    // for Vector2f
+#include <exception>                     // for exception_ptr
+#include <fstream>                       // for ifstream, ofstream
 #include <iostream>                      // for string
+#include <map>                           // for map
+#include <memory>                        // for unique_ptr
+#include <mutex>                         // for mutex, unique_lock
 #include <random>                        // for normal_distribution, mt19937
+#include <set>                           // for set
+#include <thread>                        // for thread
+#include "BufferPool.h"                  // for BufferPool
 #include "Common.h"                      // for getBasename, getExtension
+#include "DirectoryWatcher.h"            // for DirectoryWatcher, FileStamp
 #include "HDRImage.h"                    // for HDRImage
-#include "EnvMap.h"                      // for XYZToAngularMap, XYZToCubeMap
+#include "ImageStack.h"                  // for StackAccumulator, computeStackStatistics
+#include "PixelKernels.h"                // for pixelKernelsISA
+#include "EnvMap.h"                      // for EEnvMappingUVMode
+#include "Resampler.h"                   // for envMapWarpField
+#include "ErrorMetrics.h"                // for computeErrorMetrics, writeErrorMetrics
+#include "Trace.h"                       // for trace::start, trace::write
 #include "HDRViewer.h"                   // for spdlog
 #include <spdlog/spdlog.h>
 #include <spdlog/fmt/ostr.h>
@@ -22,6 +40,7 @@ namespace spd = spdlog;
 namespace
 {
 std::mt19937 g_rand(53);
+volatile sig_atomic_t g_stopWatching = 0;
 
 HDRImage::BorderMode parseBorderMode(const string &mode)
 {
@@ -36,6 +55,225 @@ HDRImage::BorderMode parseBorderMode(const string &mode)
 
 	throw invalid_argument(fmt::format("Invalid border mode \"{}\".", mode));
 }
+
+// parse the comma-separated options following the extension in --format, e.g. "piz,float" for EXRs
+void parseFormatOptions(const string &ext, const string &options)
+{
+	const auto & names = HDRImage::exrCompressionNames();
+	size_t begin = 0;
+	while (begin <= options.size())
+	{
+		size_t end = min(options.find(',', begin), options.size());
+		string option = options.substr(begin, end - begin);
+		transform(option.begin(), option.end(), option.begin(), ::tolower);
+		begin = end + 1;
+
+		char * numberEnd = nullptr;
+		long number = strtol(option.c_str(), &numberEnd, 10);
+		bool isNumber = !option.empty() && *numberEnd == '\0';
+
+		if (ext == "exr")
+		{
+			if (option == "half" || option == "float")
+			{
+				HDRImage::setEXRHalf(option == "half");
+				continue;
+			}
+			auto it = find_if(names.begin(), names.end(), [&option](string name)
+			{
+				transform(name.begin(), name.end(), name.begin(), ::tolower);
+				return name == option;
+			});
+			if (it != names.end())
+			{
+				HDRImage::setEXRCompression(HDRImage::EXRCompression(it - names.begin()));
+				continue;
+			}
+		}
+		else if (ext == "png")
+		{
+			if (option == "8bit" || option == "16bit")
+			{
+				HDRImage::setPNG16Bit(option == "16bit");
+				continue;
+			}
+			if (isNumber && number >= 0 && number <= 9)
+			{
+				HDRImage::setPNGLevel(int(number));
+				continue;
+			}
+		}
+		else if ((ext == "jpg" || ext == "jpeg") && isNumber && number >= 1 && number <= 100)
+		{
+			HDRImage::setJPEGQuality(int(number));
+			continue;
+		}
+
+		throw invalid_argument(fmt::format("Invalid option \"{}\" for format \"{}\".", option, ext));
+	}
+}
+
+/*!
+ * A bounded queue between two stages of the --jobs pipeline.
+ *
+ * Items are tagged with their index in the list of input files and popped strictly in that order, so
+ * the next stage sees the images in the same order as without the pipeline. Pushing blocks while the item
+ * is capacity or more items ahead of the next one to pop, which bounds the number of images in memory.
+ */
+template <typename T>
+class OrderedQueue
+{
+public:
+	OrderedQueue(size_t size, size_t capacity) :
+		m_items(size), m_ready(size, false), m_capacity(max(size_t(1), capacity))
+	{
+		// empty
+	}
+
+	/// Returns false if the pipeline was aborted
+	bool push(size_t index, T item)
+	{
+		unique_lock<mutex> lock(m_mutex);
+		m_canPush.wait(lock, [&]{return m_aborted || index < m_next + m_capacity;});
+		if (m_aborted)
+			return false;
+
+		m_items[index] = move(item);
+		m_ready[index] = true;
+		m_canPop.notify_all();
+		return true;
+	}
+
+	/// Returns false once all items have been popped, or if the pipeline was aborted
+	bool pop(size_t & index, T & item)
+	{
+		unique_lock<mutex> lock(m_mutex);
+		m_canPop.wait(lock, [&]{return m_aborted || m_next == m_items.size() || m_ready[m_next];});
+		if (m_aborted || m_next == m_items.size())
+			return false;
+
+		index = m_next++;
+		item = move(m_items[index]);
+		m_canPush.notify_all();
+		m_canPop.notify_all();
+		return true;
+	}
+
+	/// Wake up and fail all pending and future pushes and pops
+	void abort()
+	{
+		lock_guard<mutex> lock(m_mutex);
+		m_aborted = true;
+		m_canPush.notify_all();
+		m_canPop.notify_all();
+	}
+
+private:
+	vector<T> m_items;
+	vector<bool> m_ready;
+	const size_t m_capacity;
+	size_t m_next = 0;
+	bool m_aborted = false;
+	mutex m_mutex;
+	condition_variable m_canPush, m_canPop;
+};
+
+/*!
+ * The images handled so far and their results, which --watch checkpoints after each batch of images.
+ *
+ * The checkpoint is a text header listing the files (with their stamps) and the error metrics, followed by
+ * the binary accumulators of the statistics. It is written to a temporary file first and then renamed, so
+ * an interrupted write leaves the previous checkpoint intact.
+ */
+struct BatchState
+{
+	vector<string> files;           ///< In the order they were first seen, which numbers them for --out
+	vector<FileStamp> stamps;       ///< The version of each file that was handled
+	vector<char> accumulated;       ///< Whether each file made it into the statistics
+	vector<string> metricNames;
+	vector<ErrorMetrics> metrics;
+
+	void write(const string & filename, const StackAccumulator * accumulator) const
+	{
+		string temporary = filename + ".tmp";
+		{
+			ofstream out(temporary, ios::binary);
+			out << "hdrbatch-checkpoint 2\n" << files.size() << "\n";
+			for (size_t i = 0; i < files.size(); ++i)
+				out << stamps[i].size << " " << stamps[i].modified << " " << int(accumulated[i]) << " " << files[i] << "\n";
+			out << metrics.size() << "\n";
+			for (size_t i = 0; i < metrics.size(); ++i)
+			{
+				const ErrorMetrics & m = metrics[i];
+				out << fmt::format("{:.17g} {:.17g} {:.17g} {:.17g} {:.17g} {:.17g} {:.17g} {}\n", m.mse, m.rmse,
+				                   m.relMSE, m.mae, m.maxError, m.psnr, m.ssim, metricNames[i]);
+			}
+			out << (accumulator ? 1 : 0) << "\n";
+			if (accumulator)
+				accumulator->write(out);
+			if (!out)
+				throw runtime_error(fmt::format("Cannot write the checkpoint \"{}\".", temporary));
+		}
+		remove(filename.c_str());
+		if (rename(temporary.c_str(), filename.c_str()) != 0)
+			throw runtime_error(fmt::format("Cannot rename the checkpoint \"{}\".", temporary));
+	}
+
+	/// Returns false if there is no checkpoint, and throws a runtime_error if it cannot be read
+	bool read(const string & filename, StackAccumulator * accumulator)
+	{
+		ifstream in(filename, ios::binary);
+		if (!in)
+			return false;
+
+		auto fail = [&filename]{return runtime_error(fmt::format("Cannot read the checkpoint \"{}\".", filename));};
+		// the rest of the current line, i.e. a filename that may contain spaces
+		auto rest = [&in]{string s; getline(in >> ws, s); return s;};
+
+		string magic;
+		int version = 0;
+		size_t n = 0;
+		if (!(in >> magic >> version >> n) || magic != "hdrbatch-checkpoint" || version != 2)
+			throw fail();
+		files.resize(n);
+		stamps.resize(n);
+		accumulated.resize(n);
+		for (size_t i = 0; i < n; ++i)
+		{
+			int a = 0;
+			in >> stamps[i].size >> stamps[i].modified >> a;
+			accumulated[i] = char(a);
+			files[i] = rest();
+		}
+
+		if (!(in >> n))
+			throw fail();
+		metrics.resize(n);
+		metricNames.resize(n);
+		for (size_t i = 0; i < n; ++i)
+		{
+			// read as strings, since psnr can be infinite
+			string v[7];
+			for (auto & value : v)
+				in >> value;
+			ErrorMetrics & m = metrics[i];
+			double * values[7] = {&m.mse, &m.rmse, &m.relMSE, &m.mae, &m.maxError, &m.psnr, &m.ssim};
+			for (int j = 0; j < 7; ++j)
+				*values[j] = strtod(v[j].c_str(), nullptr);
+			metricNames[i] = rest();
+		}
+
+		int hasStatistics = 0;
+		if (!(in >> hasStatistics) || bool(hasStatistics) != (accumulator != nullptr))
+			throw runtime_error(fmt::format("The checkpoint \"{}\" was written for other statistics.", filename));
+		if (accumulator)
+		{
+			in.ignore(1);   // the newline
+			accumulator->read(in);
+		}
+		return true;
+	}
+};
 }
 
 static const char USAGE[] =
@@ -89,18 +327,30 @@ Options:
                            If no format is given, each image is saved in it's
                            original format (if supported).
                            EXT : (bmp | exr | pfm | png | ppm | hdr | tga).
+                           EXT can be followed by comma-separated options:
+                             exr : a compression method and pixel type, e.g.
+                                   '--format exr,piz,float'. Compression :
+                                   (none | zips | zip | piz | dwaa | b44),
+                                   type : (half | float) [default: zip,half].
+                             png : a compression level from 0 (fastest) to 9
+                                   (smallest) and bit depth, e.g. 'png,1,16bit'.
+                                   Bit depth : (8bit | 16bit) [default: 6,8bit].
+                             jpg : the quality from 1 to 100 [default: 100].
   --invert, -i             Invert the image (compute 1-image).
   --filter=TYPE,PARAMS...  Process image(s) using filter TYPE with
                            filter-specific PARAMS specified after the comma.
                            TYPE : (gaussian | box | fast-gaussian | unsharp |
-                                   bilateral | median).
+                                   bilateral | fast-bilateral | median |
+                                   convolve).
                            For example: '--filter fast-gaussian,10x10' would
                            filter using a 10x10 fast Gaussian approximation.
+                           The PARAMS of convolve are the filename of an image
+                           with the kernel, e.g. '--filter convolve,psf.exr'.
+                           Large kernels are convolved using FFTs.
   -r SIZE, --resize=SIZE   Resize the image to the specified SIZE.
-                           This currently uses a box filter for resampling, but
-                           you can combine with a Gaussian blur to obtain
-                           smoother downsampled results. The blur is applied
-                           *before* downsampling.
+                           This uses the separable filter given by
+                           --resize-filter, which is widened when downsampling
+                           so that the result does not alias.
                            SIZE can be either absolute or relative.
                            Absolute: SIZE should be a string matching the
                            pattern '%dx%d', for instance: '640x480'.
@@ -108,6 +358,9 @@ Options:
                            pattern '%f%%x%f%%' e.g. '33.3%x25%' would make the
                            image a third its original width and a quarter its
                            original height.
+  --resize-filter=F        The filter to use for --resize.
+                           F : (box | tent | mitchell | lanczos)
+                           [default: mitchell]
   --remap=M,M,[S],[L]      Remap the input image from one environment map
                            format to another. M,M are the input and output
                            environment map formats respectively.
@@ -119,6 +372,13 @@ Options:
                            Specifying the same M parameter twice results in no
                            change. Combine with --resize to specify output file
                            dimensions.
+  --roi=X,Y,W,H            Only compute the W x H rectangle of pixels at X,Y,
+                           e.g. to redo one tile. --filter and --invert leave
+                           the other pixels as they are, and only read the
+                           pixels around the rectangle that the filter needs.
+                           With --remap, the rectangle is in the pixels of the
+                           output, and the others are transparent black.
+                           Cannot be combined with --resize without --remap.
   --border-mode=MODE,MODE  Specifies what x- and y-modes to use when accessing pixels
                            outside the bounds of the image.
                            MODE : (black | mirror | edge | repeat)
@@ -130,17 +390,64 @@ Options:
                            The 'TYPE' is appended to the saved filename (before
                            image sequence number).
   --reference=FILE         Specify the reference image for error computation.
+  --metrics=FILE           Compare each image against the --reference image and
+                           write the MSE, RMSE, relative MSE, MAE, maximum
+                           absolute error and PSNR (for a peak value of 1) to
+                           FILE: as JSON if FILE ends in '.json', and as CSV
+                           (one line per image) otherwise. Unlike --error, this
+                           computes no error images.
+  --ssim                   Also compute the mean SSIM of the luminances of the
+                           sRGB-encoded images for --metrics.
   -a FILE, --average=FILE  Average all loaded images and save to FILE
                            (all images must have the same dimensions).
   --variance=FILE          Compute an unbiased reference-less sample variance
                            of FILEs and save to FILE. This uses the FILEs
                            themselves to compute the mean, and uses the (n-1)
                            Bessel correction factor.
+  --min=FILE               Save the per-pixel minimum of all images to FILE.
+  --max=FILE               Save the per-pixel maximum of all images to FILE.
+  --median=FILE            Save the per-pixel median of all images to FILE.
+                           The images are streamed through in bands of
+                           scanlines that fit in --stack-memory, so the stack
+                           can be larger than memory. PFM and EXR files only
+                           decode the scanlines of each band.
+                           The statistics (--average through --median) of
+                           single-channel images are those of their raw
+                           values. Unless images are also processed and saved
+                           individually, the statistics are computed without
+                           going through the per-image steps above.
+  --double                 Accumulate the average and variance in double
+                           precision, for long stacks.
+  --stack-memory=M         Use up to M megabytes for holding the samples while
+                           computing a median [default: 2048].
   --random-noise=M,V       Generate random Gaussian noise with mean M and
                            variance V.
   -n R,G,B, --nan=R,G,B    Replace all NaNs and INFs with (R,G,B)
   --dry-run                Don't actually save any files, just report what would
                            be done.
+  --trace=FILE             Record what takes time on which thread, and write
+                           it to FILE as Chrome trace JSON, which can be
+                           viewed in chrome://tracing or ui.perfetto.dev.
+  -j N, --jobs=N           Overlap reading, processing and writing of up to N
+                           images at a time [default: 1]. Images are still
+                           processed one at a time and in order, and are saved
+                           under the same filenames as without --jobs, but
+                           reading/decoding and encoding/writing each run on up
+                           to N images in parallel. At most about 3N images are
+                           held in memory at any time.
+  --watch=DIR              After the FILEs, keep watching the directory DIR and
+                           process each image that appears or changes in it,
+                           once it has been completely written. New images are
+                           added to the running --average, --variance, --min
+                           and --max, which are saved again after each batch of
+                           images, as is --metrics. Changed images are processed
+                           and saved again, but the statistics keep their first
+                           version. Cannot be combined with --median. Stop with
+                           Ctrl+C.
+  --checkpoint=FILE        Where --watch keeps the list of handled images, their
+                           metrics and the running statistics, so that it can
+                           be restarted without reading the images again. The
+                           default is '.hdrbatch-checkpoint' within DIR.
 )";
 
 
@@ -151,12 +458,19 @@ int main(int argc, char **argv)
     string ext = "",
            avgFilename = "",
            varFilename = "",
+           minFilename = "",
+           maxFilename = "",
+           medianFilename = "",
            basename = "",
            filterType = "",
            filterParams = "",
            errorType = "",
-           referenceFile = "";
-    int verbosity = 0, absoluteWidth, absoluteHeight, samples = 1;
+           referenceFile = "",
+           metricsFile = "",
+           traceFile = "",
+           watchDir = "",
+           checkpointFile = "";
+    int verbosity = 0, jobs = 1, absoluteWidth, absoluteHeight, samples = 1;
     float gamma, exposure, relativeWidth = 100.f, relativeHeight = 100.f,
           noiseMean = 0, noiseVar = 0;
     bool dither = true,
@@ -168,17 +482,28 @@ int main(int argc, char **argv)
          relativeSize = true,
          saveFiles = false,
          makeNoise = false,
-         invert = false;
+         invert = false,
+         computeSSIM = false,
+         useROI = false;
     HDRImage::BorderMode borderModeX, borderModeY;
+    StackOptions stackOptions;
     Color3 nanColor(0.0f,0.0f,0.0f);
-    // by default use a no-op passthrough warp function
-    function<Vector2f(const Vector2f&)> warp = [](const Vector2f & uv) {return uv;};
+    // by default the remap is a passthrough
+    EEnvMappingUVMode remapFrom = LAT_LONG, remapTo = LAT_LONG;
     // use bilinear lookup by default
     HDRImage::Sampler sampler = HDRImage::BILINEAR;
+    HDRImage::ResizeFilter resizeFilter = HDRImage::MITCHELL_FILTER;
     // no filter by default
     function<HDRImage(const HDRImage &)> filter;
-
-    vector<string> inFiles;
+    // how far from each pixel the filter reads, for --roi
+    Eigen::Vector2i filterApron(0, 0);
+    HDRImage::Roi roi;
+
+    // the input files and per-image results, kept together for --watch checkpoints
+    BatchState state;
+    vector<string> & inFiles = state.files;
+    vector<string> & metricNames = state.metricNames;
+    vector<ErrorMetrics> & metrics = state.metrics;
     normal_distribution<float> normalDist(0,0);
 
     try
@@ -224,6 +549,21 @@ int main(int argc, char **argv)
         console->debug("Running with the following commands/arguments/options:");
         for (auto const& arg : docargs)
             console->debug("{:<13}: {}", arg.first, arg.second);
+        console->debug("Using {} pixel kernels.", pixelKernelsISA());
+
+        // tracing
+        if (docargs["--trace"])
+        {
+            traceFile = docargs["--trace"].asString();
+#if defined(HDRVIEW_TRACING)
+            trace::start();
+            TRACE_THREAD_NAME("main");
+            console->info("Recording a trace, which is written to \"{}\" on exit.", traceFile);
+#else
+            console->warn("Built without HDRVIEW_TRACING, ignoring --trace.");
+            traceFile.clear();
+#endif
+        }
 
         // exposure
         exposure = strtof(docargs["--exposure"].asString().c_str(), (char **)NULL);
@@ -267,7 +607,23 @@ int main(int argc, char **argv)
         if (docargs["--format"].isString())
         {
             ext = docargs["--format"].asString();
+            size_t comma = ext.find(',');
+            if (comma != string::npos)
+            {
+                string options = ext.substr(comma + 1);
+                ext = ext.substr(0, comma);
+                parseFormatOptions(ext, options);
+            }
             console->info("Converting to \"{}\".", ext);
+            if (ext == "exr")
+                console->info("Using {} compression and {} pixels for EXRs.",
+                              HDRImage::exrCompressionNames()[HDRImage::exrCompression()],
+                              HDRImage::exrHalf() ? "half" : "float");
+            else if (ext == "png")
+                console->info("Using compression level {} and {}-bit samples for PNGs.",
+                              HDRImage::pngLevel(), HDRImage::png16Bit() ? 16 : 8);
+            else if (ext == "jpg" || ext == "jpeg")
+                console->info("Using JPEG quality {}.", HDRImage::jpegQuality());
         }
         else
             console->info("Keeping original image file formats.");
@@ -278,59 +634,125 @@ int main(int argc, char **argv)
             console->info("Setting base filename to \"{}\".", basename);
         }
 
+        if (docargs["--watch"].isString())
+        {
+            watchDir = docargs["--watch"].asString();
+            checkpointFile = docargs["--checkpoint"].isString() ? docargs["--checkpoint"].asString()
+                                                                : watchDir + "/.hdrbatch-checkpoint";
+            console->info("Watching \"{}\" for new images, with the checkpoint \"{}\".", watchDir, checkpointFile);
+        }
+
         if (docargs["--average"].isString())
         {
             avgFilename = docargs["--average"].asString();
             console->info("Saving average image to \"{}\".", avgFilename);
-            if (docargs["FILE"].asStringList().size() < 2)
+            if (docargs["FILE"].asStringList().size() < 2 && watchDir.empty())
                 console->error("Computing an average from less than 2 images!");
         }
 
         if (docargs["--variance"].isString())
         {
             varFilename = docargs["--variance"].asString();
-            if (docargs["FILE"].asStringList().size() < 2)
+            if (docargs["FILE"].asStringList().size() < 2 && watchDir.empty())
                 throw invalid_argument("Computing reference-less variance requires at least 2 images.");
             console->info("Saving variance image to \"{}\".", varFilename);
         }
 
-        if (docargs["--filter"].isString())
+        if (docargs["--min"].isString())
         {
-            float filterArg1, filterArg2;
-            char type[22], params[32];
-            if (sscanf(docargs["--filter"].asString().c_str(), "%20[^','],%30s", type, params) != 2)
-                throw invalid_argument(fmt::format("Cannot parse command-line parameter: --filter:\t{}", docargs["--filter"].asString()));
+            minFilename = docargs["--min"].asString();
+            console->info("Saving minimum image to \"{}\".", minFilename);
+        }
 
-            filterParams = params;
-            if (sscanf(filterParams.c_str(), "%f,%f", &filterArg1, &filterArg2) != 2)
-                throw invalid_argument(fmt::format("Cannot parse command-line parameter: --filter:\t{}", docargs["--filter"].asString()));
+        if (docargs["--max"].isString())
+        {
+            maxFilename = docargs["--max"].asString();
+            console->info("Saving maximum image to \"{}\".", maxFilename);
+        }
 
-            filterType = type;
+        if (docargs["--median"].isString())
+        {
+            medianFilename = docargs["--median"].asString();
+            if (!watchDir.empty())
+                throw invalid_argument("The median cannot be computed incrementally with --watch.");
+            console->info("Saving median image to \"{}\".", medianFilename);
+        }
+
+        stackOptions.doublePrecision = docargs["--double"].asBool();
+        stackOptions.memoryBudget = size_t(max(1L, strtol(docargs["--stack-memory"].asString().c_str(), (char **)NULL, 10))) << 20;
+
+        if (docargs["--filter"].isString())
+        {
+            string filterArg = docargs["--filter"].asString();
+            size_t comma = filterArg.find(',');
+            if (comma == string::npos || comma == 0 || comma + 1 == filterArg.size())
+                throw invalid_argument(fmt::format("Cannot parse command-line parameter: --filter:\t{}", filterArg));
+
+            filterType = filterArg.substr(0, comma);
+            filterParams = filterArg.substr(comma + 1);
             transform(filterType.begin(), filterType.end(), filterType.begin(), ::tolower);
 
             AtomicProgress progress;
-            if (filterType == "gaussian")
+            float filterArg1 = 0.f, filterArg2 = 0.f;
+            if (filterType == "convolve")
+            {
+                // the parameter is the filename of the kernel, whose color channels are averaged
+                HDRImage kernelImage;
+                if (!kernelImage.load(filterParams))
+                    throw invalid_argument(fmt::format("Cannot read convolution kernel \"{}\".", filterParams));
+                Eigen::ArrayXXf kernel = kernelImage.expanded().unaryExpr([](const Color4 & c){return (c.r + c.g + c.b) / 3.f;});
+                filter = [kernel, progress, borderModeX, borderModeY](const HDRImage & i) {return i
+                    .convolved(kernel, progress, borderModeX, borderModeY);};
+                filterApron = HDRImage::convolutionApron(kernel);
+            }
+            else if (sscanf(filterParams.c_str(), "%f,%f", &filterArg1, &filterArg2) != 2)
+                throw invalid_argument(fmt::format("Cannot parse command-line parameter: --filter:\t{}", filterArg));
+            else if (filterType == "gaussian")
+            {
                 filter = [filterArg1, filterArg2, progress, borderModeX, borderModeY](const HDRImage & i) {return i
                     .GaussianBlurred(filterArg1, filterArg2, progress, borderModeX, borderModeY);};
+                filterApron = HDRImage::GaussianApron(filterArg1, filterArg2);
+            }
             else if (filterType == "box")
+            {
                 filter = [filterArg1, filterArg2, progress, borderModeX, borderModeY](const HDRImage & i) {return i
                     .boxBlurred(filterArg1, filterArg2, progress, borderModeX, borderModeY);};
+                filterApron = Eigen::Vector2i(int(filterArg1), int(filterArg2));
+            }
             else if (filterType == "fast-gaussian")
+            {
                 filter = [filterArg1, filterArg2, progress, borderModeX, borderModeY](const HDRImage & i) {return i
                     .fastGaussianBlurred(filterArg1, filterArg2, progress, borderModeX, borderModeY);};
+                filterApron = HDRImage::fastGaussianApron(filterArg1, filterArg2);
+            }
             else if (filterType == "median")
+            {
                 filter = [filterArg1, filterArg2, progress, borderModeX, borderModeY](const HDRImage & i) {return i
                     .medianFiltered(filterArg1, filterArg2, progress, borderModeX, borderModeY);};
+                filterApron = HDRImage::medianApron(filterArg1);
+            }
             else if (filterType == "bilateral")
+            {
                 filter = [filterArg1, filterArg2, progress, borderModeX, borderModeY](const HDRImage & i) {return i
                     .bilateralFiltered(filterArg1, filterArg2, progress, borderModeX, borderModeY);};
+                filterApron = HDRImage::bilateralApron(filterArg2);
+            }
+            else if (filterType == "fast-bilateral")
+            {
+                filter = [filterArg1, filterArg2, progress, borderModeX, borderModeY](const HDRImage & i) {return i
+                    .fastBilateralFiltered(filterArg1, filterArg2, progress, borderModeX, borderModeY);};
+                filterApron = HDRImage::bilateralApron(filterArg2, 3.f);
+            }
             else if (filterType == "unsharp")
+            {
                 filter = [filterArg1, filterArg2, progress, borderModeX, borderModeY](const HDRImage & i) {return i
                     .unsharpMasked(filterArg1, filterArg2, progress, borderModeX, borderModeY);};
+                filterApron = HDRImage::fastGaussianApron(filterArg1, filterArg1);
+            }
             else
                 throw invalid_argument(fmt::format("Unrecognized filter type: \"{}\".", filterType));
 
-            console->info("Filtering using {}({:f},{:f}).", filterType, filterArg1, filterArg2);
+            console->info("Filtering using {}({}).", filterType, filterParams);
         }
 
         if (docargs["--error"].isString())
@@ -351,6 +773,19 @@ int main(int argc, char **argv)
             console->info("Computing {} error using {} as reference.", errorType, referenceFile);
         }
 
+        if (docargs["--metrics"].isString())
+        {
+            metricsFile = docargs["--metrics"].asString();
+            if (docargs["--reference"].isString())
+                referenceFile = docargs["--reference"].asString();
+            else
+                throw invalid_argument("Need to specify a reference file for computing error metrics.");
+
+            computeSSIM = docargs["--ssim"].asBool();
+            console->info("Writing error metrics{} against {} to \"{}\".", computeSSIM ? " (including SSIM)" : "",
+                          referenceFile, metricsFile);
+        }
+
         if (docargs["--resize"].isString())
         {
             if (sscanf(docargs["--resize"].asString().c_str(), "%dx%d", &absoluteWidth, &absoluteHeight) == 2)
@@ -361,6 +796,19 @@ int main(int argc, char **argv)
                 throw invalid_argument(fmt::format("Cannot parse --resize parameters:\t{}", docargs["--resize"].asString()));
 
             resize = true;
+
+            string f = docargs["--resize-filter"].asString();
+            if (f == "box")
+                resizeFilter = HDRImage::BOX_FILTER;
+            else if (f == "tent")
+                resizeFilter = HDRImage::TENT_FILTER;
+            else if (f == "mitchell")
+                resizeFilter = HDRImage::MITCHELL_FILTER;
+            else if (f == "lanczos")
+                resizeFilter = HDRImage::LANCZOS_FILTER;
+            else
+                throw invalid_argument(fmt::format("Cannot parse --resize-filter parameter, unrecognized filter \"{}\"", f));
+
             if (relativeSize)
                 console->info("Resizing images to a relative size of {:.1f}% x {:.1f}%.", relativeWidth, relativeHeight);
             else
@@ -375,37 +823,22 @@ int main(int argc, char **argv)
 
             remap = true;
 
-            UV2XYZFn * dst2xyz;
-            XYZ2UVFn * xyz2src;
-
             string from = s1, to = s2;
-
-            if (from != to)
+            auto mapping = [](const string & name) -> EEnvMappingUVMode
             {
-                if (from == "angularmap")
-                    xyz2src = XYZToAngularMap;
-                else if (from == "mirrorball")
-                    xyz2src = XYZToMirrorBall;
-                else if (from == "latlong")
-                    xyz2src = XYZToLatLong;
-                else if (from == "cubemap")
-                    xyz2src = XYZToCubeMap;
-                else
-                    throw invalid_argument(fmt::format("Cannot parse --remap parameters, unrecognized mapping type \"{}\"", from));
-
-                if (to == "angularmap")
-                    dst2xyz = angularMapToXYZ;
-                else if (to == "mirrorball")
-                    dst2xyz = mirrorBallToXYZ;
-                else if (to == "latlong")
-                    dst2xyz = latLongToXYZ;
-                else if (to == "cubemap")
-                    dst2xyz = cubeMapToXYZ;
+                if (name == "angularmap")
+                    return ANGULAR_MAP;
+                else if (name == "mirrorball")
+                    return MIRROR_BALL;
+                else if (name == "latlong")
+                    return LAT_LONG;
+                else if (name == "cubemap")
+                    return CUBE_MAP;
                 else
-                    throw invalid_argument(fmt::format("Cannot parse --remap parameters, unrecognized mapping type \"{}\"", to));
-
-                warp = [&](const Vector2f & uv) {return xyz2src(dst2xyz(Vector2f(uv(0), uv(1))));};
-            }
+                    throw invalid_argument(fmt::format("Cannot parse --remap parameters, unrecognized mapping type \"{}\"", name));
+            };
+            remapFrom = mapping(from);
+            remapTo = mapping(to);
 
             string interp = s3;
             if (interp == "nearest")
@@ -420,6 +853,18 @@ int main(int argc, char **argv)
             console->info("Remapping from {} to {} using {} interpolation with {:d} samples.", from, to, interp, samples);
         }
 
+        if (docargs["--roi"].isString())
+        {
+            if (sscanf(docargs["--roi"].asString().c_str(), "%d,%d,%d,%d", &roi.x, &roi.y, &roi.width, &roi.height) != 4 ||
+                roi.isEmpty())
+                throw invalid_argument(fmt::format("Cannot parse --roi parameters:\t{}", docargs["--roi"].asString()));
+            if (resize && !remap)
+                throw invalid_argument("Cannot combine --roi with --resize, only with --remap.");
+
+            useROI = true;
+            console->info("Only computing the {:d}x{:d} pixels at ({:d},{:d}).", roi.width, roi.height, roi.x, roi.y);
+        }
+
         if (docargs["--random-noise"].isString())
         {
             makeNoise = true;
@@ -442,12 +887,18 @@ int main(int argc, char **argv)
         if (dryRun)
             console->info("Only testing. Will not write files.");
 
+        jobs = int(strtol(docargs["--jobs"].asString().c_str(), (char **)NULL, 10));
+        if (jobs < 1)
+            throw invalid_argument(fmt::format("Invalid number of jobs \"{}\".", docargs["--jobs"].asString()));
+        if (jobs > 1)
+            console->info("Pipelining up to {:d} images at a time.", jobs);
+
         // list of filenames
         inFiles = docargs["FILE"].asStringList();
 
 
         // now actually do stuff
-        if (!inFiles.size())
+        if (!inFiles.size() && watchDir.empty())
             throw invalid_argument("No files specified!");
 
         HDRImage referenceImage;
@@ -456,58 +907,72 @@ int main(int argc, char **argv)
             console->info("Reading reference image \"{}\"...", referenceFile);
             if (!referenceImage.load(referenceFile))
                 throw invalid_argument(fmt::format("Cannot read image \"{}\".", referenceFile));
+            if (referenceImage.isSingleChannel())
+                referenceImage = referenceImage.expanded();
             console->info("Reference image size: {:d}x{:d}", referenceImage.width(), referenceImage.height());
         }
 
-        HDRImage avgImg;
-        HDRImage varImg;
-        int varN = 0;
-
-        for (size_t i = 0; i < inFiles.size(); ++i)
+        unsigned stackStatistics = (avgFilename.empty() ? 0 : STACK_MEAN) |
+                                   (varFilename.empty() ? 0 : STACK_VARIANCE) |
+                                   (minFilename.empty() ? 0 : STACK_MINIMUM) |
+                                   (maxFilename.empty() ? 0 : STACK_MAXIMUM) |
+                                   (medianFilename.empty() ? 0 : STACK_MEDIAN);
+        stackOptions.replaceNaNs = fixNaNs || !dryRun;
+        stackOptions.nanColor = nanColor;
+
+        // the statistics only need a pass over the individual images if those are processed anyway,
+        // and the median always needs a separate (streaming) pass. --watch accumulates them as images arrive
+        bool perImage = saveFiles || !errorType.empty() || !metricsFile.empty() || !stackStatistics || !watchDir.empty();
+        unique_ptr<StackAccumulator> accumulator;
+        if (perImage && stackStatistics && !(stackStatistics & STACK_MEDIAN))
+            accumulator.reset(new StackAccumulator(stackStatistics, stackOptions));
+
+        // the three stages of handling a single image: reading, processing and saving.
+        // processImage returns false if the image should be skipped
+        auto readImage = [&](size_t i, HDRImage & image) -> bool
         {
-            HDRImage image;
             console->info("Reading image \"{}\"...", inFiles[i]);
             if (!image.load(inFiles[i]))
             {
                 console->error("Cannot read image \"{}\". Skipping...\n", inFiles[i]);
-                continue;
+                return false;
             }
             console->info("Image size: {:d}x{:d}", image.width(), image.height());
 
-            varN += 1;
-            // initialize variables for average and variance
-            if (varN == 1)
-            {
-                // set images to zeros
-                varImg = avgImg = image.unaryExpr([](const Color4 & c)
-                {
-                    return Color4(0,0,0,0);
-                });
-            }
-
-            if (fixNaNs || !dryRun)
+            if ((fixNaNs || !dryRun) && !image.isSingleChannel())
                 image = image.unaryExpr([nanColor](const Color4 & c)
                 {
                     return isfinite(c.sum()) ? c : Color4(nanColor, c[3]);
                 });
+            return true;
+        };
 
-            if (!avgFilename.empty() || !varFilename.empty())
+        auto processImage = [&](size_t i, HDRImage & image) -> bool
+        {
+            TRACE_ZONE("process image", inFiles[i]);
+            // single-channel images are accumulated from their raw values
+            if (accumulator && state.accumulated[i])
+                console->warn("The statistics keep the first version of \"{}\".", inFiles[i]);
+            else if (accumulator && !watchDir.empty() && accumulator->count() &&
+                     (image.width() != accumulator->width() || image.height() != accumulator->height()))
+                console->error("Image \"{}\" does not have the size of the others, leaving it out of the statistics.", inFiles[i]);
+            else if (accumulator)
             {
-                if (avgImg.width() != image.width() || avgImg.height() != image.height())
-                    throw invalid_argument("Images do not have the same size.");
-
-                // incremental average and variance computation
-                auto delta = image - avgImg;
-                avgImg += delta/Color4(varN,varN,varN,varN);
-                auto delta2 = image - avgImg;
-                varImg += delta * delta2;
+                accumulator->add(image);
+                state.accumulated[i] = true;
             }
 
+            // the image operations below need all four channels
+            if (image.isSingleChannel())
+                image = image.expanded();
+
             if (filter)
             {
                 console->info("Filtering image with {}({})...", filterType, filterParams);
 
-                if (!dryRun)
+                if (!dryRun && useROI)
+                    image.filterRegion(image, roi, filterApron, filter, borderModeX, borderModeY);
+                else if (!dryRun)
                     image = filter(image);
             }
 
@@ -523,15 +988,24 @@ int main(int argc, char **argv)
 
                 if (!remap)
                 {
-                    console->info("Resizing image to {:d}x{:d}...", w, h);
-                    image = image.resized(w, h);
+                    console->info("Resizing image to {:d}x{:d} with the {} filter...", w, h,
+                                  HDRImage::resizeFilterNames()[resizeFilter]);
+                    image = image.resized(w, h, resizeFilter, AtomicProgress(), borderModeX, borderModeY);
                 }
                 else
                 {
                     console->info("Remapping image to {:d}x{:d}...", w, h);
                     AtomicProgress progress;
-                    image = image.resampled(w, h, progress, warp, samples,
-                                            sampler, borderModeX, borderModeY);
+                    // the warp field is cached, so a sequence of equally-sized images only computes it once
+                    auto warp = envMapWarpField(remapTo, remapFrom, w, h, image.width(), image.height(), samples);
+                    if (useROI)
+                    {
+                        HDRImage remapped = HDRImage::Constant(w, h, Color4(0.f, 0.f, 0.f, 0.f));
+                        image.resampled(remapped, roi, *warp, progress, sampler, borderModeX, borderModeY);
+                        image = std::move(remapped);
+                    }
+                    else
+                        image = image.resampled(*warp, progress, sampler, borderModeX, borderModeY);
                 }
             }
 
@@ -545,13 +1019,34 @@ int main(int argc, char **argv)
                     }
             }
 
+            if (!metricsFile.empty())
+            {
+                if (image.width() != referenceImage.width() ||
+                    image.height() != referenceImage.height())
+                {
+                    console->error("Images must have same dimensions!");
+                    return false;
+                }
+
+                // an image that changed under --watch replaces its previous metrics
+                size_t m = find(metricNames.begin(), metricNames.end(), inFiles[i]) - metricNames.begin();
+                if (m == metricNames.size())
+                {
+                    metricNames.push_back(inFiles[i]);
+                    metrics.emplace_back();
+                }
+                metrics[m] = computeErrorMetrics(image, referenceImage, computeSSIM);
+                console->info("MSE: {:g}, relative MSE: {:g}, PSNR: {:.2f} dB.",
+                              metrics[m].mse, metrics[m].relMSE, metrics[m].psnr);
+            }
+
             if (!errorType.empty())
             {
                 if (image.width() != referenceImage.width() ||
                     image.height() != referenceImage.height())
                 {
                     console->error("Images must have same dimensions!");
-                    continue;
+                    return false;
                 }
 
                 if (errorType == "squared")
@@ -572,52 +1067,285 @@ int main(int argc, char **argv)
 
             if (invert)
             {
-                image = Color4(1.0f, 1.0f, 1.0f, 2.0f) - image;
+                auto inverted = [](const HDRImage & i) -> HDRImage {return Color4(1.0f, 1.0f, 1.0f, 2.0f) - i;};
+                if (useROI)
+                    image.filterRegion(image, roi, Eigen::Vector2i::Zero(), inverted);
+                else
+                    image = inverted(image);
             }
+            return true;
+        };
+
+        // the files saved so far, which --watch must not mistake for new images
+        vector<string> written;
+        mutex writtenMutex;
 
-            if (saveFiles)
+        auto saveImage = [&](size_t i, const HDRImage & image)
+        {
+            if (!saveFiles)
+                return;
+
+            string thisExt = ext.size() ? ext : getExtension(inFiles[i]);
+            string thisBasename = basename.size() ? basename : getBasename(inFiles[i]);
+            string filename;
+            string extra = (errorType.empty()) ? "" : fmt::format("-{}-error", errorType);
+            if ((inFiles.size() == 1 && watchDir.empty()) || !basename.size())
+                filename = fmt::format("{}{}.{}", thisBasename, extra, thisExt);
+            else
+                filename = fmt::format("{}{}{:03d}.{}", thisBasename, extra, i, thisExt);
+
+            console->info("Writing image to \"{}\"...", filename);
+
+            if (!dryRun)
             {
-                string thisExt = ext.size() ? ext : getExtension(inFiles[i]);
-                string thisBasename = basename.size() ? basename : getBasename(inFiles[i]);
-                string filename;
-                string extra = (errorType.empty()) ? "" : fmt::format("-{}-error", errorType);
-                if (inFiles.size() == 1 || !basename.size())
-                    filename = fmt::format("{}{}.{}", thisBasename, extra, thisExt);
-                else
-                    filename = fmt::format("{}{}{:03d}.{}", thisBasename, extra, i, thisExt);
+                image.save(filename, powf(2.0f, exposure), gamma, sRGB, dither);
+                lock_guard<mutex> lock(writtenMutex);
+                written.push_back(filename);
+            }
+        };
+
+        // read, process and save the images with the given indices into inFiles
+        auto processFiles = [&](const vector<size_t> & indices)
+        {
+            if (jobs <= 1)
+            {
+                for (size_t i : indices)
+                {
+                    HDRImage image;
+                    if (readImage(i, image) && processImage(i, image))
+                        saveImage(i, image);
+                }
+                return;
+            }
 
-                console->info("Writing image to \"{}\"...", filename);
+            // skipped images are passed along as null, so that every stage sees every index.
+            // The queues are indexed by the position within indices
+            using ImagePtr = unique_ptr<HDRImage>;
+            OrderedQueue<ImagePtr> loaded(indices.size(), jobs), processed(indices.size(), jobs);
 
-                if (!dryRun)
-                    image.save(filename, powf(2.0f, exposure), gamma, sRGB, dither);
+            mutex errorMutex;
+            exception_ptr error;
+            auto fail = [&](exception_ptr e)
+            {
+                {
+                    lock_guard<mutex> lock(errorMutex);
+                    if (!error)
+                        error = e;
+                }
+                loaded.abort();
+                processed.abort();
+            };
+
+            size_t numThreads = min(size_t(jobs), indices.size());
+            atomic<size_t> nextRead(0);
+            vector<thread> threads;
+
+            // read and decode several images at a time
+            for (size_t t = 0; t < numThreads; ++t)
+                threads.emplace_back([&]
+                {
+                    TRACE_THREAD_NAME("reader");
+                    try
+                    {
+                        for (size_t k = nextRead++; k < indices.size(); k = nextRead++)
+                        {
+                            ImagePtr image(new HDRImage);
+                            if (!readImage(indices[k], *image))
+                                image.reset();
+                            if (!loaded.push(k, move(image)))
+                                break;
+                        }
+                    }
+                    catch (...)
+                    {
+                        fail(current_exception());
+                    }
+                });
+
+            // encode and write several images at a time
+            for (size_t t = 0; t < numThreads; ++t)
+                threads.emplace_back([&]
+                {
+                    TRACE_THREAD_NAME("writer");
+                    try
+                    {
+                        size_t k;
+                        ImagePtr image;
+                        while (processed.pop(k, image))
+                            if (image)
+                                saveImage(indices[k], *image);
+                    }
+                    catch (...)
+                    {
+                        fail(current_exception());
+                    }
+                });
+
+            // process on this thread one image at a time and in input order: the filters are parallel
+            // themselves, and the average, variance and random noise depend on the order of the images
+            try
+            {
+                size_t k;
+                ImagePtr image;
+                while (loaded.pop(k, image))
+                {
+                    if (image && !processImage(indices[k], *image))
+                        image.reset();
+                    if (!processed.push(k, move(image)))
+                        break;
+                }
             }
-        }
+            catch (...)
+            {
+                fail(current_exception());
+            }
+
+            for (auto & t : threads)
+                t.join();
 
-        if (!avgFilename.empty())
+            if (error)
+                rethrow_exception(error);
+        };
+
+        // save the metrics and statistics of all images processed so far
+        auto saveResults = [&]()
         {
-            // avgImg *= Color4(1.0f/inFiles.size());
+            if (!metricsFile.empty())
+            {
+                console->info("Writing error metrics of {} images to \"{}\"...", metrics.size(), metricsFile);
+                if (!dryRun)
+                    writeErrorMetrics(metricsFile, metricNames, metrics, computeSSIM);
+            }
+
+            StackStatistics stack;
+            if (accumulator)
+            {
+                stack.count = accumulator->count();
+                stack.mean = accumulator->mean();
+                stack.variance = accumulator->variance();
+                stack.minimum = accumulator->minimum();
+                stack.maximum = accumulator->maximum();
+            }
+            else if (stackStatistics)
+            {
+                console->info("Computing statistics of {} images...", inFiles.size());
+                stack = computeStackStatistics(inFiles, stackStatistics, stackOptions);
+            }
+
+            if (stackStatistics && stack.count == 0)
+                console->error("None of the images could be read, not saving any statistics.");
+            else if (stackStatistics)
+            {
+                // set alpha channel to 1
+                if (!varFilename.empty())
+                    stack.variance.setAlpha(1.f);
 
-            console->info("Writing average image to \"{}\"...", avgFilename);
+                for (auto & output : {make_pair(&avgFilename, &stack.mean), make_pair(&varFilename, &stack.variance),
+                                      make_pair(&minFilename, &stack.minimum), make_pair(&maxFilename, &stack.maximum),
+                                      make_pair(&medianFilename, &stack.median)})
+                {
+                    if (output.first->empty())
+                        continue;
 
-            if (!dryRun)
-                avgImg.save(avgFilename, powf(2.0f, exposure), gamma, sRGB, dither);
-        }
+                    console->info("Writing image to \"{}\"...", *output.first);
+
+                    if (!dryRun)
+                    {
+                        output.second->save(*output.first, powf(2.0f, exposure), gamma, sRGB, dither);
+                        written.push_back(*output.first);
+                    }
+                }
+            }
+        };
 
-        if (!varFilename.empty())
+        if (watchDir.empty())
+        {
+            state.accumulated.assign(inFiles.size(), false);
+            if (perImage)
+            {
+                vector<size_t> indices(inFiles.size());
+                for (size_t i = 0; i < indices.size(); ++i)
+                    indices[i] = i;
+                processFiles(indices);
+            }
+            saveResults();
+        }
+        else
         {
-            varImg /= Color4(varN - 1, varN - 1, varN - 1, varN - 1);
+            const set<string> extensions = {"exr", "png", "jpg", "jpeg", "hdr", "pic", "pfm", "ppm", "bmp", "tga",
+                                            "psd", "dng", "npy"};
+            DirectoryWatcher watcher(watchDir, extensions);
+
+            vector<string> arguments;
+            arguments.swap(inFiles);
+            if (state.read(checkpointFile, accumulator.get()))
+                console->info("Resuming from the checkpoint, which has handled {} images.", inFiles.size());
+
+            // the watcher reports canonical paths, so key the files (including those named on the command line and
+            // those of older checkpoints) by theirs, to not handle a file twice when it is named in two ways
+            map<string, size_t> indexOf;
+            for (size_t i = 0; i < inFiles.size(); ++i)
+            {
+                inFiles[i] = canonicalPath(inFiles[i]);
+                indexOf[inFiles[i]] = i;
+                watcher.setHandled(inFiles[i], state.stamps[i]);
+            }
 
-            // set alpha channel to 1
-            varImg = varImg.unaryExpr([](const Color4 & c)
+            // process the files that are new, or changed since they were handled
+            auto handle = [&](const vector<string> & files)
             {
-                return Color4(c.r,c.g,c.b,1);
-            });
+                vector<size_t> batch;
+                for (const auto & name : files)
+                {
+                    string file = canonicalPath(name);
+                    FileStamp stamp;
+                    if (!fileStamp(file, stamp))
+                        continue;
 
-            console->info("Writing variance image to \"{}\"...", varFilename);
+                    auto it = indexOf.find(file);
+                    if (it == indexOf.end())
+                    {
+                        it = indexOf.insert(make_pair(file, inFiles.size())).first;
+                        inFiles.push_back(file);
+                        state.stamps.push_back(FileStamp());
+                        state.accumulated.push_back(false);
+                    }
+                    else if (state.stamps[it->second] == stamp)
+                        continue;
 
-            if (!dryRun)
-                varImg.save(varFilename, powf(2.0f, exposure), gamma, sRGB, dither);
+                    state.stamps[it->second] = stamp;
+                    batch.push_back(it->second);
+                }
+                if (batch.empty())
+                    return;
+
+                console->info("Processing {} new or changed images...", batch.size());
+                processFiles(batch);
+                saveResults();
+                if (!dryRun)
+                    state.write(checkpointFile, accumulator.get());
+
+                for (const auto & file : written)
+                    watcher.ignore(file);
+                written.clear();
+            };
+
+            handle(arguments);
+
+            // stop at the next opportunity, the checkpoint is always consistent between batches
+            signal(SIGINT, [](int){g_stopWatching = 1;});
+            signal(SIGTERM, [](int){g_stopWatching = 1;});
+            console->info("Watching \"{}\", press Ctrl+C to stop.", watchDir);
+            while (!g_stopWatching)
+                handle(watcher.waitForChanges(1000));
+            console->info("Stopped watching \"{}\".", watchDir);
         }
+
+        // in a steady state of the batch, the images reuse the buffers of the previous ones
+        console->debug(BufferPool::summary());
+
+        if (!traceFile.empty() && !trace::write(traceFile))
+            console->error("Cannot write the trace to \"{}\".", traceFile);
     }
     // Exceptions will only be thrown upon failed logger or sink construction (not during logging)
     catch (const spd::spdlog_ex& e)
@@ -0,0 +1,536 @@
+//
+// Copyright (C) Wojciech Jarosz <wjarosz@gmail.com>. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can
+// be found in the LICENSE.txt file.
+//
+
+#include <algorithm>                     // for sort, min, max
+#include <chrono>                        // for steady_clock
+#include <cstdint>                       // for uint32_t
+#include <cstdio>                        // for fopen, fwrite, remove
+#include <docopt.h>                      // for docopt
+#include <Eigen/Core>                    // for Vector2i, Matrix3f
+#include <functional>                    // for function
+#include <map>                           // for map
+#include <random>                        // for mt19937, uniform_real_distribution
+#include <string>                        // for string
+#include <thread>                        // for thread
+#include <vector>                        // for vector
+#include "Common.h"                      // for jsonString
+#include "EnvMap.h"                      // for EEnvMappingUVMode, convertEnvMappingUV
+#include "HDRImage.h"                    // for HDRImage, copyPixelsFromArray
+#include "ImageStatistics.h"             // for ImageStatistics
+#include "ParallelFor.h"                 // for ThreadPool
+#include "PixelKernels.h"                // for pixelKernelsISA
+#include "Resampler.h"                   // for envMapWarpField
+#include <spdlog/spdlog.h>
+
+using namespace Eigen;
+using namespace std;
+namespace spd = spdlog;
+
+namespace
+{
+
+double milliseconds(chrono::steady_clock::duration d)
+{
+	return chrono::duration<double, milli>(d).count();
+}
+
+/// Time a single call of f, in milliseconds
+template <typename F>
+double timed(F && f)
+{
+	auto start = chrono::steady_clock::now();
+	f();
+	return milliseconds(chrono::steady_clock::now() - start);
+}
+
+/*!
+ * One benchmark, run on a synthetic input image of each of the sizes.
+ *
+ * The body does whatever setup it needs (copies, temporary files) outside of the timed part, and returns the
+ * time in milliseconds of the part that is measured. It returns a negative time if it failed.
+ */
+struct Benchmark
+{
+	string name;
+	function<double(const HDRImage &)> body;
+};
+
+/// A benchmark timing f(input), without the time to free the image it returns
+Benchmark filterBenchmark(const string & name, function<HDRImage(const HDRImage &)> f)
+{
+	return {name, [f](const HDRImage & input)
+	{
+		HDRImage result;
+		return timed([&]{result = f(input);});
+	}};
+}
+
+/// A benchmark timing f on a mosaiced copy of the input, as the in-place demosaicing functions need
+Benchmark demosaicBenchmark(const string & name, function<void(HDRImage &, const Vector2i &)> f)
+{
+	return {name, [f](const HDRImage & input)
+	{
+		const Vector2i redOffset(0, 0);
+		HDRImage raw = input;
+		raw.bayerMosaic(redOffset);
+		return timed([&]{f(raw, redOffset);});
+	}};
+}
+
+/*!
+ * A smooth HDR image with some noise, so that the filters, the compressors and the statistics all see
+ * something like a photograph. The same size always gives the same image.
+ */
+HDRImage syntheticImage(int w, int h)
+{
+	HDRImage img(w, h);
+	mt19937 rng(53);
+	uniform_real_distribution<float> noise(-0.05f, 0.05f);
+	for (int y = 0; y < h; ++y)
+		for (int x = 0; x < w; ++x)
+		{
+			float u = (x + 0.5f) / w, v = (y + 0.5f) / h;
+			float base = 4.f * u * u * (1.f + std::sin(12.f * v)) + 0.01f;
+			img(x, y) = Color4(base * (1.f + noise(rng)),
+			                   base * (0.8f + 0.4f * v + noise(rng)),
+			                   base * (1.2f - 0.4f * u + noise(rng)),
+			                   1.f);
+		}
+	return img;
+}
+
+/// Write the image as a C-order height x width x 4 array of native floats, since we have no NPY writer
+bool writeNPY(const string & filename, const HDRImage & img)
+{
+	const uint32_t one = 1;
+	string dict = fmt::format("{{'descr': '{}', 'fortran_order': False, 'shape': ({}, {}, 4), }}",
+	                          *(const unsigned char *) &one ? "<f4" : ">f4", img.height(), img.width());
+	// the magic string, version and header length take 10 bytes, and the header ends with a newline
+	size_t headerSize = (10 + dict.size() + 1 + 63) / 64 * 64;
+	dict.resize(headerSize - 10 - 1, ' ');
+	dict += '\n';
+	string header = string("\x93NUMPY\x01\x00", 8);
+	header += char(dict.size() & 0xff);
+	header += char(dict.size() >> 8);
+	header += dict;
+
+	FILE * f = fopen(filename.c_str(), "wb");
+	if (!f)
+		return false;
+	size_t numFloats = size_t(img.size()) * 4;
+	bool written = fwrite(header.data(), 1, header.size(), f) == header.size() &&
+	               fwrite(img.data(), sizeof(float), numFloats, f) == numFloats;
+	return fclose(f) == 0 && written;
+}
+
+/*!
+ * Benchmarks for saving and loading the input in one file format.
+ *
+ * @param settings  Applies the HDRImage settings (compression, bit depth, ...) of this variant of the format
+ */
+void addIOBenchmarks(vector<Benchmark> & benchmarks, const string & tempDir, const string & name,
+                     const string & extension, function<void()> settings, bool rows = false)
+{
+	string filename = tempDir + "/hdrview-bench." + extension;
+	auto save = [filename,extension,settings](const HDRImage & input)
+	{
+		if (settings)
+			settings();
+		if (extension == "npy")
+			return writeNPY(filename, input);
+		return input.save(filename, 1.f, 2.2f, true, true);
+	};
+
+	if (extension != "npy")
+		benchmarks.push_back({"save " + name, [filename,save](const HDRImage & input)
+		{
+			bool saved = false;
+			double t = timed([&]{saved = save(input);});
+			remove(filename.c_str());
+			return saved ? t : -1.0;
+		}});
+
+	benchmarks.push_back({"load " + name, [filename,save](const HDRImage & input)
+	{
+		if (!save(input))
+			return -1.0;
+		HDRImage img;
+		bool loaded = false;
+		double t = timed([&]{loaded = img.load(filename);});
+		remove(filename.c_str());
+		return loaded ? t : -1.0;
+	}});
+
+	if (rows)
+		benchmarks.push_back({"load rows " + name, [filename,save](const HDRImage & input)
+		{
+			if (!save(input))
+				return -1.0;
+			HDRImage img;
+			bool loaded = false;
+			double t = timed([&]{loaded = img.loadRows(filename, input.height() / 4, input.height() / 2);});
+			remove(filename.c_str());
+			return loaded ? t : -1.0;
+		}});
+}
+
+vector<Benchmark> allBenchmarks(const string & tempDir)
+{
+	vector<Benchmark> b;
+
+	// filters
+	const ArrayXXf kernel5 = ArrayXXf::Ones(5, 5), kernel31 = ArrayXXf::Ones(31, 31);
+	const ArrayXf kernel9 = ArrayXf::Ones(9);
+	b.push_back(filterBenchmark("inverted", [](const HDRImage & i){return i.inverted();}));
+	b.push_back(filterBenchmark("scaledOffset", [](const HDRImage & i){return i.scaledOffset(Color4(2.f, 2.f, 2.f, 1.f), Color4(0.1f, 0.1f, 0.1f, 0.f));}));
+	b.push_back(filterBenchmark("brightnessContrast", [](const HDRImage & i){return i.brightnessContrast(0.2f, 0.3f, false, RGB);}));
+	b.push_back(filterBenchmark("convolved 5x5", [kernel5](const HDRImage & i){return i.convolved(kernel5, AtomicProgress());}));
+	b.push_back(filterBenchmark("fftConvolved 31x31", [kernel31](const HDRImage & i){return i.fftConvolved(kernel31, AtomicProgress());}));
+	b.push_back(filterBenchmark("convolvedX 9", [kernel9](const HDRImage & i){return i.convolvedX(kernel9, AtomicProgress());}));
+	b.push_back(filterBenchmark("convolvedY 9", [kernel9](const HDRImage & i){return i.convolvedY(kernel9, AtomicProgress());}));
+	b.push_back(filterBenchmark("GaussianBlurred 5", [](const HDRImage & i){return i.GaussianBlurred(5.f, 5.f, AtomicProgress());}));
+	b.push_back(filterBenchmark("GaussianBlurredX 5", [](const HDRImage & i){return i.GaussianBlurredX(5.f, AtomicProgress());}));
+	b.push_back(filterBenchmark("GaussianBlurredY 5", [](const HDRImage & i){return i.GaussianBlurredY(5.f, AtomicProgress());}));
+	b.push_back(filterBenchmark("fastGaussianBlurred 5", [](const HDRImage & i){return i.fastGaussianBlurred(5.f, 5.f, AtomicProgress());}));
+	b.push_back(filterBenchmark("iteratedBoxBlurred 5", [](const HDRImage & i){return i.iteratedBoxBlurred(5.f);}));
+	b.push_back(filterBenchmark("boxBlurred 5", [](const HDRImage & i){return i.boxBlurred(5, AtomicProgress());}));
+	b.push_back(filterBenchmark("boxBlurredX 5", [](const HDRImage & i){return i.boxBlurredX(5, AtomicProgress());}));
+	b.push_back(filterBenchmark("boxBlurredY 5", [](const HDRImage & i){return i.boxBlurredY(5, AtomicProgress());}));
+	b.push_back(filterBenchmark("boxBlurredX 5 x3", [](const HDRImage & i){return i.boxBlurredX(5, 5, 3, AtomicProgress());}));
+	b.push_back(filterBenchmark("boxBlurredY 5 x3", [](const HDRImage & i){return i.boxBlurredY(5, 5, 3, AtomicProgress());}));
+	b.push_back(filterBenchmark("unsharpMasked 2", [](const HDRImage & i){return i.unsharpMasked(2.f, 1.f, AtomicProgress());}));
+	b.push_back(filterBenchmark("medianFiltered 2 red", [](const HDRImage & i){return i.medianFiltered(2.f, 0, AtomicProgress());}));
+	b.push_back(filterBenchmark("medianFiltered 2", [](const HDRImage & i){return i.medianFiltered(2.f, AtomicProgress());}));
+	b.push_back(filterBenchmark("bilateralFiltered 2", [](const HDRImage & i){return i.bilateralFiltered(0.1f, 2.f, AtomicProgress());}));
+	b.push_back(filterBenchmark("fastBilateralFiltered 8", [](const HDRImage & i){return i.fastBilateralFiltered(0.1f, 8.f, AtomicProgress());}));
+
+	// transformations
+	b.push_back(filterBenchmark("flippedHorizontal", [](const HDRImage & i){return i.flippedHorizontal();}));
+	b.push_back(filterBenchmark("flippedVertical", [](const HDRImage & i){return i.flippedVertical();}));
+	b.push_back(filterBenchmark("rotated90CW", [](const HDRImage & i){return i.rotated90CW();}));
+	b.push_back(filterBenchmark("transposed", [](const HDRImage & i){return i.transposed();}));
+
+	// resampling and remapping
+	b.push_back(filterBenchmark("resizedCanvas", [](const HDRImage & i){return i.resizedCanvas(i.width() + 64, i.height() + 64, HDRImage::MIDDLE_CENTER, Color4(0.f, 0.f, 0.f, 1.f));}));
+	b.push_back(filterBenchmark("resized half", [](const HDRImage & i){return i.resized(i.width() / 2, i.height() / 2);}));
+	const auto & filterNames = HDRImage::resizeFilterNames();
+	for (int f = 0; f < int(filterNames.size()); ++f)
+	{
+		auto filter = HDRImage::ResizeFilter(f);
+		b.push_back(filterBenchmark("resized " + filterNames[f] + " down 3x", [filter](const HDRImage & i){return i.resized(max(1, i.width() / 3), max(1, i.height() / 3), filter);}));
+		b.push_back(filterBenchmark("resized " + filterNames[f] + " up 1.5x", [filter](const HDRImage & i){return i.resized(i.width() * 3 / 2, i.height() * 3 / 2, filter);}));
+	}
+	b.push_back(filterBenchmark("resized mitchell down 8x no pyramid", [](const HDRImage & i){return i.resized(max(1, i.width() / 8), max(1, i.height() / 8), HDRImage::MITCHELL_FILTER, AtomicProgress(), HDRImage::EDGE, HDRImage::EDGE, false);}));
+	const auto & samplerNames = HDRImage::samplerNames();
+	for (int s = 0; s < int(samplerNames.size()); ++s)
+	{
+		auto sampler = HDRImage::Sampler(s);
+		b.push_back(filterBenchmark("resampled " + samplerNames[s], [sampler](const HDRImage & i)
+		{
+			return i.resampled(i.width() * 3 / 4, i.height() * 3 / 4, AtomicProgress(),
+			                   [](const Vector2f & uv){return uv;}, 1, sampler);
+		}));
+	}
+	b.push_back(filterBenchmark("remap latlong to angularmap 2x2", [](const HDRImage & i)
+	{
+		return i.resampled(i.width(), i.height(), AtomicProgress(),
+		                   [](const Vector2f & uv){return convertEnvMappingUV(LAT_LONG, ANGULAR_MAP, uv);},
+		                   2, HDRImage::BILINEAR);
+	}));
+	b.push_back({"remap latlong to cubemap, warp field", [](const HDRImage & i)
+	{
+		// the fields are cached, so this measures the resampling alone after the first run
+		auto warp = envMapWarpField(CUBE_MAP, LAT_LONG, i.width(), i.height(), i.width(), i.height(), 2);
+		HDRImage result;
+		return timed([&]{result = i.resampled(*warp, AtomicProgress(), HDRImage::BILINEAR);});
+	}});
+
+	// demosaicing
+	b.push_back(demosaicBenchmark("demosaicLinear", [](HDRImage & i, const Vector2i & o){i.demosaicLinear(o);}));
+	b.push_back(demosaicBenchmark("demosaicGreenGuidedLinear", [](HDRImage & i, const Vector2i & o){i.demosaicGreenGuidedLinear(o);}));
+	b.push_back(demosaicBenchmark("demosaicMalvar", [](HDRImage & i, const Vector2i & o){i.demosaicMalvar(o);}));
+	b.push_back(demosaicBenchmark("demosaicGreenPhelippeau", [](HDRImage & i, const Vector2i & o){i.demosaicGreenPhelippeau(o);}));
+	b.push_back(demosaicBenchmark("demosaicAHD", [](HDRImage & i, const Vector2i & o){i.demosaicAHD(o, Matrix3f::Identity());}));
+	b.push_back({"medianFilterBayerArtifacts", [](const HDRImage & input)
+	{
+		HDRImage demosaiced = input, result;
+		demosaiced.bayerMosaic(Vector2i(0, 0));
+		demosaiced.demosaicLinear(Vector2i(0, 0));
+		return timed([&]{result = demosaiced.medianFilterBayerArtifacts();});
+	}});
+
+	// statistics
+	b.push_back({"summarize", [](const HDRImage & i)
+	{
+		shared_ptr<const ImageStatistics::PixelSummary> summary;
+		return timed([&]{summary = ImageStatistics::summarize(i);});
+	}});
+	b.push_back({"computeStatistics", [](const HDRImage & i)
+	{
+		shared_ptr<ImageStatistics> stats;
+		return timed([&]{stats = ImageStatistics::computeStatistics(i, 0.f);});
+	}});
+
+	// conversion from the interleaved arrays of the loaders
+	for (int n : {3, 4})
+		for (bool linearize : {false, true})
+			b.push_back({fmt::format("copyPixelsFromArray {} channels{}", n, linearize ? " sRGB" : ""),
+			             [n,linearize](const HDRImage & input)
+			{
+				int w = input.width(), h = input.height();
+				vector<float> data(size_t(w) * h * n);
+				for (int y = 0; y < h; ++y)
+					for (int x = 0; x < w; ++x)
+						for (int c = 0; c < n; ++c)
+							data[(size_t(y) * w + x) * n + c] = min(input(x, y)[c], 1.f);
+				HDRImage img(w, h);
+				return timed([&]{copyPixelsFromArray(img, data.data(), w, h, n, linearize, false);});
+			}});
+
+	// loaders and savers
+	const auto & compressionNames = HDRImage::exrCompressionNames();
+	for (int c = 0; c < int(compressionNames.size()); ++c)
+	{
+		auto compression = HDRImage::EXRCompression(c);
+		addIOBenchmarks(b, tempDir, "exr " + compressionNames[c] + " half", "exr",
+		                [compression]{HDRImage::setEXRCompression(compression); HDRImage::setEXRHalf(true);}, true);
+	}
+	addIOBenchmarks(b, tempDir, "exr zip float", "exr",
+	                []{HDRImage::setEXRCompression(HDRImage::EXR_ZIP); HDRImage::setEXRHalf(false);}, true);
+	addIOBenchmarks(b, tempDir, "pfm", "pfm", nullptr, true);
+	addIOBenchmarks(b, tempDir, "hdr", "hdr", nullptr);
+	addIOBenchmarks(b, tempDir, "npy", "npy", nullptr);
+	addIOBenchmarks(b, tempDir, "png 8bit", "png", []{HDRImage::setPNG16Bit(false);});
+	addIOBenchmarks(b, tempDir, "png 16bit", "png", []{HDRImage::setPNG16Bit(true);});
+	addIOBenchmarks(b, tempDir, "jpg", "jpg", nullptr);
+	addIOBenchmarks(b, tempDir, "bmp", "bmp", nullptr);
+	addIOBenchmarks(b, tempDir, "tga", "tga", nullptr);
+	addIOBenchmarks(b, tempDir, "ppm", "ppm", nullptr);
+
+	return b;
+}
+
+/// Parse a comma-separated list of values with parse
+template <typename T>
+vector<T> parseList(const string & list, function<T(const string &)> parse)
+{
+	vector<T> values;
+	size_t begin = 0;
+	while (begin <= list.size())
+	{
+		size_t end = min(list.find(',', begin), list.size());
+		if (end > begin)
+			values.push_back(parse(list.substr(begin, end - begin)));
+		begin = end + 1;
+	}
+	return values;
+}
+
+Vector2i parseSize(const string & s)
+{
+	int w = 0, h = 0;
+	if (sscanf(s.c_str(), "%dx%d", &w, &h) != 2 || w < 8 || h < 8)
+		throw invalid_argument(fmt::format("Invalid image size \"{}\".", s));
+	return Vector2i(w, h);
+}
+
+/// The timings of one benchmark at one size and thread count
+struct Result
+{
+	string name;
+	int width, height;
+	size_t threads;
+	vector<double> times;       ///< Sorted, in milliseconds. Empty if the benchmark failed
+};
+
+string toJSON(const vector<Result> & results)
+{
+	string json = fmt::format("{{\n  \"version\": {},\n  \"pixelKernels\": {},\n  \"hardwareThreads\": {},\n  \"results\": [\n",
+	                          jsonString(HDRVIEW_VERSION), jsonString(pixelKernelsISA()), ThreadPool::instance().numThreads());
+	for (size_t i = 0; i < results.size(); ++i)
+	{
+		const Result & r = results[i];
+		json += fmt::format("    {{\"name\": {}, \"width\": {}, \"height\": {}, \"threads\": {}",
+		                    jsonString(r.name), r.width, r.height, r.threads);
+		if (r.times.empty())
+			json += ", \"failed\": true";
+		else
+		{
+			double sum = 0.0;
+			for (double t : r.times)
+				sum += t;
+			double median = r.times[r.times.size() / 2];
+			json += fmt::format(", \"repeats\": {}, \"minMs\": {:.6g}, \"medianMs\": {:.6g}, \"meanMs\": {:.6g}, "
+			                    "\"megapixelsPerSecond\": {:.6g}",
+			                    r.times.size(), r.times.front(), median, sum / r.times.size(),
+			                    median > 0.0 ? double(r.width) * r.height / (1000.0 * median) : 0.0);
+		}
+		json += i + 1 < results.size() ? "},\n" : "}\n";
+	}
+	return json + "  ]\n}\n";
+}
+
+} // namespace
+
+
+static const char USAGE[] =
+R"(hdrview-bench. Copyright (c) Wojciech Jarosz.
+
+hdrview-bench times the image processing kernels and the image loaders and
+savers of HDRView on synthetic images, at several image sizes and thread
+counts, and writes the results as JSON. Each benchmark is run once to warm up
+and then --repeat times; the minimum, median and mean times are reported.
+
+Usage:
+  hdrview-bench [options] [FILE...]
+  hdrview-bench -h | --help | --version
+
+Options:
+  -s SIZES, --sizes=SIZES  Comma-separated list of image sizes, each matching
+                           the pattern '%dx%d' [default: 512x512,2048x2048].
+  -t N, --threads=N        Comma-separated list of the number of threads that
+                           each parallel loop may use, where 0 stands for all
+                           of them [default: 1,0]. The OpenEXR library keeps
+                           using all threads for its own decoding.
+  -r N, --repeat=N         Time each benchmark N times [default: 5].
+  -f NAMES, --filter=NAMES Only run the benchmarks whose name contains one of
+                           the comma-separated NAMES, e.g. 'blur,load exr'.
+  -l, --list               List the names of the benchmarks and exit.
+  -o FILE, --out=FILE      Write the JSON results to FILE instead of the
+                           standard output.
+  --temp=DIR               Directory for the files written by the loader and
+                           saver benchmarks [default: .].
+  -v T, --verbose=T        Set verbosity threshold with lower values meaning
+                           more verbose and higher values removing low-priority
+                           messages [default: 3]. See hdrbatch for the levels.
+  -h, --help               Display this message.
+  --version                Show the version.
+
+Any FILEs are also loaded at each thread count (with their own size), e.g. to
+time the DNG loader, which has no saver to produce a synthetic file.
+)";
+
+
+int main(int argc, char **argv)
+{
+	vector<string> argVector = { argv + 1, argv + argc };
+	map<string, docopt::value> docargs;
+
+	try
+	{
+		docargs = docopt::docopt(USAGE, argVector,
+		                         true,                                 // show help if requested
+		                         "hdrview-bench " HDRVIEW_VERSION);    // version string
+
+		// the loaders report through the console logger, so it needs to exist. It writes to stderr to keep
+		// the JSON on stdout clean
+		auto console = spd::stderr_color_mt("console");
+		spd::set_pattern("[%l] %v");
+		int verbosity = int(docargs["--verbose"].asLong());
+		if (verbosity < spd::level::trace || verbosity > spd::level::off)
+		{
+			console->error("Invalid verbosity threshold. Setting to default \"3\"");
+			verbosity = 3;
+		}
+		spd::set_level(spd::level::level_enum(verbosity));
+
+		auto sizes = parseList<Vector2i>(docargs["--sizes"].asString(), parseSize);
+		auto threads = parseList<size_t>(docargs["--threads"].asString(), [](const string & s){return size_t(stoul(s));});
+		int repeats = max(1, int(docargs["--repeat"].asLong()));
+		vector<string> filters;
+		if (docargs["--filter"])
+			filters = parseList<string>(docargs["--filter"].asString(), [](const string & s){return s;});
+
+		vector<Benchmark> benchmarks = allBenchmarks(docargs["--temp"].asString());
+		for (const auto & filename : docargs["FILE"].asStringList())
+			benchmarks.push_back({"load file " + filename, [filename](const HDRImage &)
+			{
+				HDRImage img;
+				bool loaded = false;
+				double t = timed([&]{loaded = img.load(filename);});
+				return loaded ? t : -1.0;
+			}});
+
+		if (!filters.empty())
+			benchmarks.erase(remove_if(benchmarks.begin(), benchmarks.end(), [&filters](const Benchmark & b)
+			{
+				return none_of(filters.begin(), filters.end(), [&b](const string & f)
+				{
+					return b.name.find(f) != string::npos;
+				});
+			}), benchmarks.end());
+
+		if (docargs["--list"].asBool())
+		{
+			for (const auto & b : benchmarks)
+				printf("%s\n", b.name.c_str());
+			return EXIT_SUCCESS;
+		}
+
+		vector<Result> results;
+		for (const Vector2i & size : sizes)
+		{
+			HDRImage input = syntheticImage(size.x(), size.y());
+			for (size_t t : threads)
+			{
+				ThreadPool::setMaxConcurrency(t);
+				size_t numThreads = t ? min(t, ThreadPool::instance().numThreads() + 1)
+				                      : ThreadPool::instance().numThreads() + 1;
+				for (const auto & b : benchmarks)
+				{
+					console->info("{} at {}x{} with {} threads", b.name, size.x(), size.y(), numThreads);
+					Result r{b.name, size.x(), size.y(), numThreads, {}};
+					if (b.body(input) >= 0.0)
+					{
+						for (int i = 0; i < repeats; ++i)
+						{
+							double ms = b.body(input);
+							if (ms < 0.0)
+							{
+								r.times.clear();
+								break;
+							}
+							r.times.push_back(ms);
+						}
+					}
+					if (r.times.empty())
+						console->error("Benchmark \"{}\" failed.", b.name);
+					sort(r.times.begin(), r.times.end());
+					results.push_back(r);
+				}
+			}
+		}
+		ThreadPool::setMaxConcurrency(0);
+
+		string json = toJSON(results);
+		if (docargs["--out"])
+		{
+			string filename = docargs["--out"].asString();
+			FILE * f = fopen(filename.c_str(), "wb");
+			if (!f)
+				throw runtime_error(fmt::format("Cannot open \"{}\" for writing the results.", filename));
+			bool written = fwrite(json.data(), 1, json.size(), f) == json.size();
+			if (fclose(f) != 0 || !written)
+				throw runtime_error(fmt::format("Cannot write the results to \"{}\".", filename));
+		}
+		else
+			printf("%s", json.c_str());
+	}
+	// Exceptions will only be thrown upon failed logger or sink construction (not during logging)
+	catch (const spd::spdlog_ex& e)
+	{
+		fprintf(stderr, "Log init failed: %s\n", e.what());
+		return 1;
+	}
+	catch (const std::exception &e)
+	{
+		spd::get("console")->critical("Error: {}", e.what());
+		fprintf(stderr, "%s", USAGE);
+		return -1;
+	}
+
+	return EXIT_SUCCESS;
+}
@@ -7,18 +7,28 @@
 #include "HDRImage.h"
 #include <ctype.h>               // for tolower
 #include <stdlib.h>              // for abs
-#include <algorithm>             // for nth_element, transform
+#include <algorithm>             // for nth_element, transform, sort
 #include <cmath>                 // for floor, pow, exp, ceil, round, sqrt
+#include <complex>               // for complex
 #include <exception>             // for exception
 #include <functional>            // for pointer_to_unary_function, function
-#include <stdexcept>             // for runtime_error, out_of_range
+#include <iterator>              // for back_inserter
+#include <limits>                // for numeric_limits
+#include <memory>                // for unique_ptr
+#include <stdexcept>             // for runtime_error, out_of_range, invalid_argument
 #include <string>                // for allocator, operator==, basic_string
 #include <vector>                // for vector
+#include "BufferPool.h"          // for PooledArray
 #include "Common.h"              // for lerp, mod, clamp, getExtension
 #include "Colorspace.h"
+#include "CurveLUT.h"
 #include "ParallelFor.h"
+#include "PixelKernels.h"
+#include "Resampler.h"
 #include "Timer.h"
+#include "Trace.h"
 #include <spdlog/spdlog.h>
+#include <unsupported/Eigen/FFT>
 
 
 #define STB_IMAGE_RESIZE_IMPLEMENTATION
@@ -34,6 +44,63 @@ namespace
 
 const Color4 g_blackPixel(0,0,0,0);
 
+/*!
+ * Pixel accessors for neighborhood filters. Filters are written as functors with a templated call operator
+ * taking one of these, so the same code compiles to a loop without any bounds checks for the interior of
+ * the image, and to one that applies the border modes for the apron around the edges.
+ */
+struct InteriorAccess
+{
+    const HDRImage & img;
+    const Color4 & operator()(int x, int y) const {return img(x, y);}
+};
+
+struct BorderAccess
+{
+    const HDRImage & img;
+    HDRImage::BorderMode mX, mY;
+    const Color4 & operator()(int x, int y) const {return img.pixel(x, y, mX, mY);}
+};
+
+/*!
+ * Evaluate filter at every pixel of the tile [x0,x1) x [y0,y1) of img, and pass the result to store.
+ *
+ * The filter reads the pixels within [x-left, x+right] x [y-up, y+down]. Pixels whose whole footprint lies
+ * inside the image get an InteriorAccess, and only the remaining ones pay for the border handling.
+ */
+template <typename Filter, typename Store>
+void filterTile(const HDRImage & img, int x0, int y0, int x1, int y1,
+                int left, int right, int up, int down,
+                HDRImage::BorderMode mX, HDRImage::BorderMode mY,
+                const Filter & filter, const Store & store)
+{
+    InteriorAccess interior{img};
+    BorderAccess border{img, mX, mY};
+
+    int interiorX0 = clamp(left, x0, x1);
+    int interiorX1 = clamp(img.width() - right, interiorX0, x1);
+    for (int y = y0; y < y1; ++y)
+    {
+        if (y - up < 0 || y + down >= img.height())
+        {
+            for (int x = x0; x < x1; ++x)
+                store(x, y, filter(border, x, y));
+            continue;
+        }
+
+        for (int x = x0; x < interiorX0; ++x)
+            store(x, y, filter(border, x, y));
+        for (int x = interiorX0; x < interiorX1; ++x)
+            store(x, y, filter(interior, x, y));
+        for (int x = interiorX1; x < x1; ++x)
+            store(x, y, filter(border, x, y));
+    }
+}
+
+// view the channels of a pixel as a vectorizable Eigen array
+inline Map<const Array4f> channels(const Color4 & c) {return Map<const Array4f>(&c.r);}
+inline Map<Array4f> channels(Color4 & c)             {return Map<Array4f>(&c.r);}
+
 // create a vector containing the normalized values of a 1D Gaussian filter
 ArrayXXf horizontalGaussianKernel(float sigma, float truncate);
 int wrapCoord(int p, int maxP, HDRImage::BorderMode m);
@@ -43,13 +110,18 @@ void MalvarGreen(HDRImage &raw, int c, const Vector2i & redOffset);
 void MalvarRedOrBlueAtGreen(HDRImage &raw, int c, const Vector2i &redOffset, bool horizontal);
 void MalvarRedOrBlue(HDRImage &raw, int c1, int c2, const Vector2i &redOffset);
 void bilinearRedBlue(HDRImage &raw, int c, const Vector2i & redOffset);
-void greenBasedRorB(HDRImage &raw, int c, const Vector2i &redOffset);
+void greenBasedRorB(HDRImage &raw, int c, const Vector2i &redOffset, bool serial = false);
+// AHD is done in tiles of this size, with an apron that covers the 5 pixel footprint of its steps. Both are even
+const int AHDTileSize = 256;
+const int AHDApron = 6;
+void demosaicAHDTile(HDRImage &tile, const Vector2i &redOffset, const Matrix3f &cameraToXYZ, float scale,
+                     const vector<float> &labLUT);
 inline float clamp2(float value, float mn, float mx);
 inline float clamp4(float value, float a, float b, float c, float d);
 inline float interpGreenH(const HDRImage &raw, int x, int y);
 inline float interpGreenV(const HDRImage &raw, int x, int y);
-inline float ghG(const ArrayXXf & G, int i, int j);
-inline float gvG(const ArrayXXf & G, int i, int j);
+inline float ghG(const Map<ArrayXXf> & G, int i, int j);
+inline float gvG(const Map<ArrayXXf> & G, int i, int j);
 inline int bayerColor(int x, int y);
 inline Vector3f cameraToLab(const Vector3f c, const Matrix3f & cameraToXYZ, const vector<float> & LUT);
 } // namespace
@@ -78,7 +150,149 @@ const vector<string> & HDRImage::samplerNames()
 	return names;
 }
 
-const Color4 & HDRImage::pixel(int x, int y, BorderMode mX, BorderMode mY) const
+const vector<string> & HDRImage::resizeFilterNames()
+{
+	static const vector<string> names =
+		{
+			"Box",
+			"Tent",
+			"Mitchell",
+			"Lanczos"
+		};
+	return names;
+}
+
+const vector<string> & HDRImage::colormapNames()
+{
+	static const vector<string> names =
+		{
+			"Turbo",
+			"Viridis",
+			"Gray"
+		};
+	return names;
+}
+
+const vector<Color4> & HDRImage::singleChannelColormap(Colormap colormap)
+{
+	// the "turbo" colormap, stored as sRGB with the red and blue channels swapped
+	static const float turboRGBf[256][3] = {{0.18995f,0.07176f,0.23217f},{0.19483f,0.08339f,0.26149f},{0.19956f,0.09498f,0.29024f},{0.20415f,0.10652f,0.31844f},{0.20860f,0.11802f,0.34607f},{0.21291f,0.12947f,0.37314f},{0.21708f,0.14087f,0.39964f},{0.22111f,0.15223f,0.42558f},{0.22500f,0.16354f,0.45096f},{0.22875f,0.17481f,0.47578f},{0.23236f,0.18603f,0.50004f},{0.23582f,0.19720f,0.52373f},{0.23915f,0.20833f,0.54686f},{0.24234f,0.21941f,0.56942f},{0.24539f,0.23044f,0.59142f},{0.24830f,0.24143f,0.61286f},{0.25107f,0.25237f,0.63374f},{0.25369f,0.26327f,0.65406f},{0.25618f,0.27412f,0.67381f},{0.25853f,0.28492f,0.69300f},{0.26074f,0.29568f,0.71162f},{0.26280f,0.30639f,0.72968f},{0.26473f,0.31706f,0.74718f},{0.26652f,0.32768f,0.76412f},{0.26816f,0.33825f,0.78050f},{0.26967f,0.34878f,0.79631f},{0.27103f,0.35926f,0.81156f},{0.27226f,0.36970f,0.82624f},{0.27334f,0.38008f,0.84037f},{0.27429f,0.39043f,0.85393f},{0.27509f,0.40072f,0.86692f},{0.27576f,0.41097f,0.87936f},{0.27628f,0.42118f,0.89123f},{0.27667f,0.43134f,0.90254f},{0.27691f,0.44145f,0.91328f},{0.27701f,0.45152f,0.92347f},{0.27698f,0.46153f,0.93309f},{0.27680f,0.47151f,0.94214f},{0.27648f,0.48144f,0.95064f},{0.27603f,0.49132f,0.95857f},{0.27543f,0.50115f,0.96594f},{0.27469f,0.51094f,0.97275f},{0.27381f,0.52069f,0.97899f},{0.27273f,0.53040f,0.98461f},{0.27106f,0.54015f,0.98930f},{0.26878f,0.54995f,0.99303f},{0.26592f,0.55979f,0.99583f},{0.26252f,0.56967f,0.99773f},{0.25862f,0.57958f,0.99876f},{0.25425f,0.58950f,0.99896f},{0.24946f,0.59943f,0.99835f},{0.24427f,0.60937f,0.99697f},{0.23874f,0.61931f,0.99485f},{0.23288f,0.62923f,0.99202f},{0.22676f,0.63913f,0.98851f},{0.22039f,0.64901f,0.98436f},{0.21382f,0.65886f,0.97959f},{0.20708f,0.66866f,0.97423f},{0.20021f,0.67842f,0.96833f},{0.19326f,0.68812f,0.96190f},{0.18625f,0.69775f,0.95498f},{0.17923f,0.70732f,0.94761f},{0.17223f,0.71680f,0.93981f},{0.16529f,0.72620f,0.93161f},{0.15844f,0.73551f,0.92305f},{0.15173f,0.74472f,0.91416f},{0.14519f,0.75381f,0.90496f},{0.13886f,0.76279f,0.89550f},{0.13278f,0.77165f,0.88580f},{0.12698f,0.78037f,0.87590f},{0.12151f,0.78896f,0.86581f},{0.11639f,0.79740f,0.85559f},{0.11167f,0.80569f,0.84525f},{0.10738f,0.81381f,0.83484f},{0.10357f,0.82177f,0.82437f},{0.10026f,0.82955f,0.81389f},{0.09750f,0.83714f,0.80342f},{0.09532f,0.84455f,0.79299f},{0.09377f,0.85175f,0.78264f},{0.09287f,0.85875f,0.77240f},{0.09267f,0.86554f,0.76230f},{0.09320f,0.87211f,0.75237f},{0.09451f,0.87844f,0.74265f},{0.09662f,0.88454f,0.73316f},{0.09958f,0.89040f,0.72393f},{0.10342f,0.89600f,0.71500f},{0.10815f,0.90142f,0.70599f},{0.11374f,0.90673f,0.69651f},{0.12014f,0.91193f,0.68660f},{0.12733f,0.91701f,0.67627f},{0.13526f,0.92197f,0.66556f},{0.14391f,0.92680f,0.65448f},{0.15323f,0.93151f,0.64308f},{0.16319f,0.93609f,0.63137f},{0.17377f,0.94053f,0.61938f},{0.18491f,0.94484f,0.60713f},{0.19659f,0.94901f,0.59466f},{0.20877f,0.95304f,0.58199f},{0.22142f,0.95692f,0.56914f},{0.23449f,0.96065f,0.55614f},{0.24797f,0.96423f,0.54303f},{0.26180f,0.96765f,0.52981f},{0.27597f,0.97092f,0.51653f},{0.29042f,0.97403f,0.50321f},{0.30513f,0.97697f,0.48987f},{0.32006f,0.97974f,0.47654f},{0.33517f,0.98234f,0.46325f},{0.35043f,0.98477f,0.45002f},{0.36581f,0.98702f,0.43688f},{0.38127f,0.98909f,0.42386f},{0.39678f,0.99098f,0.41098f},{0.41229f,0.99268f,0.39826f},{0.42778f,0.99419f,0.38575f},{0.44321f,0.99551f,0.37345f},{0.45854f,0.99663f,0.36140f},{0.47375f,0.99755f,0.34963f},{0.48879f,0.99828f,0.33816f},{0.50362f,0.99879f,0.32701f},{0.51822f,0.99910f,0.31622f},{0.53255f,0.99919f,0.30581f},{0.54658f,0.99907f,0.29581f},{0.56026f,0.99873f,0.28623f},{0.57357f,0.99817f,0.27712f},{0.58646f,0.99739f,0.26849f},{0.59891f,0.99638f,0.26038f},{0.61088f,0.99514f,0.25280f},{0.62233f,0.99366f,0.24579f},{0.63323f,0.99195f,0.23937f},{0.64362f,0.98999f,0.23356f},{0.65394f,0.98775f,0.22835f},{0.66428f,0.98524f,0.22370f},{0.67462f,0.98246f,0.21960f},{0.68494f,0.97941f,0.21602f},{0.69525f,0.97610f,0.21294f},{0.70553f,0.97255f,0.21032f},{0.71577f,0.96875f,0.20815f},{0.72596f,0.96470f,0.20640f},{0.73610f,0.96043f,0.20504f},{0.74617f,0.95593f,0.20406f},{0.75617f,0.95121f,0.20343f},{0.76608f,0.94627f,0.20311f},{0.77591f,0.94113f,0.20310f},{0.78563f,0.93579f,0.20336f},{0.79524f,0.93025f,0.20386f},{0.80473f,0.92452f,0.20459f},{0.81410f,0.91861f,0.20552f},{0.82333f,0.91253f,0.20663f},{0.83241f,0.90627f,0.20788f},{0.84133f,0.89986f,0.20926f},{0.85010f,0.89328f,0.21074f},{0.85868f,0.88655f,0.21230f},{0.86709f,0.87968f,0.21391f},{0.87530f,0.87267f,0.21555f},{0.88331f,0.86553f,0.21719f},{0.89112f,0.85826f,0.21880f},{0.89870f,0.85087f,0.22038f},{0.90605f,0.84337f,0.22188f},{0.91317f,0.83576f,0.22328f},{0.92004f,0.82806f,0.22456f},{0.92666f,0.82025f,0.22570f},{0.93301f,0.81236f,0.22667f},{0.93909f,0.80439f,0.22744f},{0.94489f,0.79634f,0.22800f},{0.95039f,0.78823f,0.22831f},{0.95560f,0.78005f,0.22836f},{0.96049f,0.77181f,0.22811f},{0.96507f,0.76352f,0.22754f},{0.96931f,0.75519f,0.22663f},{0.97323f,0.74682f,0.22536f},{0.97679f,0.73842f,0.22369f},{0.98000f,0.73000f,0.22161f},{0.98289f,0.72140f,0.21918f},{0.98549f,0.71250f,0.21650f},{0.98781f,0.70330f,0.21358f},{0.98986f,0.69382f,0.21043f},{0.99163f,0.68408f,0.20706f},{0.99314f,0.67408f,0.20348f},{0.99438f,0.66386f,0.19971f},{0.99535f,0.65341f,0.19577f},{0.99607f,0.64277f,0.19165f},{0.99654f,0.63193f,0.18738f},{0.99675f,0.62093f,0.18297f},{0.99672f,0.60977f,0.17842f},{0.99644f,0.59846f,0.17376f},{0.99593f,0.58703f,0.16899f},{0.99517f,0.57549f,0.16412f},{0.99419f,0.56386f,0.15918f},{0.99297f,0.55214f,0.15417f},{0.99153f,0.54036f,0.14910f},{0.98987f,0.52854f,0.14398f},{0.98799f,0.51667f,0.13883f},{0.98590f,0.50479f,0.13367f},{0.98360f,0.49291f,0.12849f},{0.98108f,0.48104f,0.12332f},{0.97837f,0.46920f,0.11817f},{0.97545f,0.45740f,0.11305f},{0.97234f,0.44565f,0.10797f},{0.96904f,0.43399f,0.10294f},{0.96555f,0.42241f,0.09798f},{0.96187f,0.41093f,0.09310f},{0.95801f,0.39958f,0.08831f},{0.95398f,0.38836f,0.08362f},{0.94977f,0.37729f,0.07905f},{0.94538f,0.36638f,0.07461f},{0.94084f,0.35566f,0.07031f},{0.93612f,0.34513f,0.06616f},{0.93125f,0.33482f,0.06218f},{0.92623f,0.32473f,0.05837f},{0.92105f,0.31489f,0.05475f},{0.91572f,0.30530f,0.05134f},{0.91024f,0.29599f,0.04814f},{0.90463f,0.28696f,0.04516f},{0.89888f,0.27824f,0.04243f},{0.89298f,0.26981f,0.03993f},{0.88691f,0.26152f,0.03753f},{0.88066f,0.25334f,0.03521f},{0.87422f,0.24526f,0.03297f},{0.86760f,0.23730f,0.03082f},{0.86079f,0.22945f,0.02875f},{0.85380f,0.22170f,0.02677f},{0.84662f,0.21407f,0.02487f},{0.83926f,0.20654f,0.02305f},{0.83172f,0.19912f,0.02131f},{0.82399f,0.19182f,0.01966f},{0.81608f,0.18462f,0.01809f},{0.80799f,0.17753f,0.01660f},{0.79971f,0.17055f,0.01520f},{0.79125f,0.16368f,0.01387f},{0.78260f,0.15693f,0.01264f},{0.77377f,0.15028f,0.01148f},{0.76476f,0.14374f,0.01041f},{0.75556f,0.13731f,0.00942f},{0.74617f,0.13098f,0.00851f},{0.73661f,0.12477f,0.00769f},{0.72686f,0.11867f,0.00695f},{0.71692f,0.11268f,0.00629f},{0.70680f,0.10680f,0.00571f},{0.69650f,0.10102f,0.00522f},{0.68602f,0.09536f,0.00481f},{0.67535f,0.08980f,0.00449f},{0.66449f,0.08436f,0.00424f},{0.65345f,0.07902f,0.00408f},{0.64223f,0.07380f,0.00401f},{0.63082f,0.06868f,0.00401f},{0.61923f,0.06367f,0.00410f},{0.60746f,0.05878f,0.00427f},{0.59550f,0.05399f,0.00453f},{0.58336f,0.04931f,0.00486f},{0.57103f,0.04474f,0.00529f},{0.55852f,0.04028f,0.00579f},{0.54583f,0.03593f,0.00638f},{0.53295f,0.03169f,0.00705f},{0.51989f,0.02756f,0.00780f},{0.50664f,0.02354f,0.00863f},{0.49321f,0.01963f,0.00955f},{0.47960f,0.01583f,0.01055f}};
+	// a polynomial fit of the sRGB values of the "viridis" colormap, by Matt Zucker (CC0)
+	static const float viridisCoeffs[7][3] = {{0.2777273272234177f, 0.005407344544966578f, 0.3340998053353061f},
+	                                          {0.1050930431085774f, 1.404613529898575f, 1.384590162594685f},
+	                                          {-0.3308618287255563f, 0.214847559468213f, 0.09509516302823659f},
+	                                          {-4.634230498983486f, -5.799100973351585f, -19.33244095627987f},
+	                                          {6.228269936347081f, 14.17993336680509f, 56.69055260068105f},
+	                                          {4.776384997670288f, -13.74514537774601f, -65.35303263337234f},
+	                                          {-5.435455855934631f, 4.645852612178535f, 26.3124352495832f}};
+	static const vector<vector<Color4>> colormaps = []
+	{
+		vector<vector<Color4>> maps(NUM_COLORMAPS, vector<Color4>(256));
+		for (int i = 0; i < 256; ++i)
+		{
+			float t = i / 255.f;
+			Color4 viridis(0.f, 0.f, 0.f, 1.f);
+			for (int k = 6; k >= 0; --k)
+				for (int c = 0; c < 3; ++c)
+					viridis[c] = viridis[c] * t + viridisCoeffs[k][c];
+
+			maps[TURBO_COLORMAP][i] = SRGBToLinear(Color4(turboRGBf[i][2], turboRGBf[i][1], turboRGBf[i][0], 1.f));
+			maps[VIRIDIS_COLORMAP][i] = SRGBToLinear(viridis);
+			maps[GRAY_COLORMAP][i] = SRGBToLinear(Color4(t, t, t, 1.f));
+		}
+		return maps;
+	}();
+	return colormaps[colormap];
+}
+
+void HDRImage::setSingleChannel(Intensity values)
+{
+	auto owner = make_shared<const Intensity>(std::move(values));
+	setSingleChannel(owner, owner->data(), int(owner->rows()), int(owner->cols()), owner->rows());
+}
+
+void HDRImage::setSingleChannel(shared_ptr<const void> owner, const float * data, int w, int h, Eigen::Index stride)
+{
+	Base::resize(0, 0);
+	releaseIntensity();
+	if (w <= 0 || h <= 0)
+		return;
+	if (stride < w)
+		throw invalid_argument("setSingleChannel: The stride has to be at least the width.");
+
+	m_intensityOwner = std::move(owner);
+	m_intensityData = data;
+	m_intensityWidth = w;
+	m_intensityHeight = h;
+	m_intensityStride = stride;
+
+	// the range of the positive values, which the false-color mapping spreads over the colormap
+	vector<Vector2f> ranges(ThreadPool::instance().numThreads() + 1,
+	                        Vector2f(numeric_limits<float>::max(), -numeric_limits<float>::max()));
+	IntensityMap values = intensity();
+	parallel_for(BlockedRange(0, h), [&values,&ranges](int y0, int y1)
+	{
+		Vector2f & range = ranges[ThreadPool::threadIndex()];
+		for (int y = y0; y < y1; ++y)
+			for (int x = 0; x < values.rows(); ++x)
+			{
+				float p = values(x, y);
+				if (p <= 0)
+					continue;
+				range[0] = std::min(range[0], p);
+				range[1] = std::max(range[1], p);
+			}
+	});
+	float minVal = numeric_limits<float>::max(), maxVal = -numeric_limits<float>::max();
+	for (const Vector2f & range : ranges)
+	{
+		minVal = std::min(minVal, range[0]);
+		maxVal = std::max(maxVal, range[1]);
+	}
+	m_intensityMin = minVal <= maxVal ? minVal : 0.f;
+	m_intensityDelta = minVal <= maxVal ? maxVal - minVal : 0.f;
+}
+
+void HDRImage::releaseIntensity()
+{
+	m_intensityOwner = nullptr;
+	m_intensityData = nullptr;
+	m_intensityWidth = m_intensityHeight = 0;
+	m_intensityStride = 0;
+	m_intensityMin = m_intensityDelta = 0.f;
+}
+
+HDRImage HDRImage::oriented(const Orientation & o) const
+{
+    TRACE_ZONE("HDRImage::oriented");
+	if (o.isIdentity())
+		return *this;
+
+	HDRImage img = o.transposed ? transposed() : *this;
+	if (o.flipX)
+		img = img.flippedHorizontal();
+	if (o.flipY)
+		img = img.flippedVertical();
+	return img;
+}
+
+HDRImage HDRImage::expanded() const
+{
+    TRACE_ZONE("HDRImage::expanded");
+	if (!isSingleChannel())
+		return *this;
+
+	HDRImage result(width(), height());
+	parallel_for(BlockedRange(0, height()), [this,&result](int y0, int y1)
+	{
+		for (int y = y0; y < y1; ++y)
+			for (int x = 0; x < width(); ++x)
+				result(x, y) = color(x, y);
+	});
+	return result;
+}
+
+const Color4 & HDRImage::borderPixel(int x, int y, BorderMode mX, BorderMode mY) const
 {
 	x = wrapCoord(x, width(), mX);
 	y = wrapCoord(y, height(), mY);
@@ -88,7 +302,7 @@ const Color4 & HDRImage::pixel(int x, int y, BorderMode mX, BorderMode mY) const
 	return (*this)(x, y);
 }
 
-Color4 & HDRImage::pixel(int x, int y, BorderMode mX, BorderMode mY)
+Color4 & HDRImage::borderPixel(int x, int y, BorderMode mX, BorderMode mY)
 {
 	x = wrapCoord(x, width(), mX);
 	y = wrapCoord(y, height(), mY);
@@ -172,83 +386,1140 @@ HDRImage HDRImage::resampled(int w, int h,
                              function<Vector2f(const Vector2f &)> warpFn,
                              int superSample, Sampler sampler, BorderMode mX, BorderMode mY) const
 {
+    TRACE_ZONE("HDRImage::resampled");
     HDRImage result(w, h);
 
     Timer timer;
-    progress.setNumSteps(result.height());
-    // for every pixel in the image
-    parallel_for(0, result.height(), [this,w,h,&progress,&warpFn,&result,superSample,sampler,mX,mY](int y)
+    resampler::WarpFnCoords coords{warpFn, w, h, superSample, Array2f(width(), height())};
+    resampler::resample(*this, result, superSample, coords, sampler, mX, mY, progress);
+    spdlog::get("console")->trace("Resampling took: {} seconds.", (timer.elapsed()/1000.f));
+    return result;
+}
+
+HDRImage HDRImage::resampled(const WarpField & warp, AtomicProgress progress,
+                             Sampler sampler, BorderMode mX, BorderMode mY) const
+{
+    TRACE_ZONE("HDRImage::resampled");
+    if (warp.sourceWidth() != width() || warp.sourceHeight() != height())
+        throw invalid_argument("The warp field was computed for an image of a different size");
+
+    HDRImage result(warp.width(), warp.height());
+
+    Timer timer;
+    resampler::resample(*this, result, warp.superSample(), resampler::WarpFieldCoords{warp}, sampler, mX, mY, progress);
+    spdlog::get("console")->trace("Resampling with a precomputed warp took: {} seconds.", (timer.elapsed()/1000.f));
+    return result;
+}
+
+void HDRImage::resampled(HDRImage & dst, const Roi & roi,
+                         AtomicProgress progress,
+                         function<Vector2f(const Vector2f &)> warpFn,
+                         int superSample, Sampler sampler, BorderMode mX, BorderMode mY) const
+{
+    TRACE_ZONE("HDRImage::resampled");
+    Roi r = roi.intersected(dst.bounds());
+    if (r.isEmpty())
+        return;
+
+    HDRImage region(r.width, r.height);
+    resampler::WarpFnCoords coords{warpFn, dst.width(), dst.height(), superSample, Array2f(width(), height())};
+    resampler::resample(*this, region, superSample, resampler::OffsetCoords<resampler::WarpFnCoords>{coords, r.x, r.y},
+                        sampler, mX, mY, progress);
+    dst.block(r.x, r.y, r.width, r.height) = region;
+}
+
+void HDRImage::resampled(HDRImage & dst, const Roi & roi, const WarpField & warp, AtomicProgress progress,
+                         Sampler sampler, BorderMode mX, BorderMode mY) const
+{
+    TRACE_ZONE("HDRImage::resampled");
+    if (warp.sourceWidth() != width() || warp.sourceHeight() != height())
+        throw invalid_argument("The warp field was computed for an image of a different size");
+    if (dst.width() != warp.width() || dst.height() != warp.height())
+        throw invalid_argument("The destination does not have the size of the warp field");
+
+    Roi r = roi.intersected(dst.bounds());
+    if (r.isEmpty())
+        return;
+
+    HDRImage region(r.width, r.height);
+    resampler::WarpFieldCoords coords{warp};
+    resampler::resample(*this, region, warp.superSample(), resampler::OffsetCoords<resampler::WarpFieldCoords>{coords, r.x, r.y},
+                        sampler, mX, mY, progress);
+    dst.block(r.x, r.y, r.width, r.height) = region;
+}
+
+namespace
+{
+
+/*!
+ * Box blur numLines parallel lines of n pixels each, with the window [i-left, i+right] around each pixel i.
+ *
+ * Pixel i of line l is at in[i*inElemStride + l*inLineStride] (and likewise for out). The lines are processed
+ * together, pixel by pixel, so lines that are adjacent in memory are read and written contiguously. The
+ * running sums (one per line) are kept in sums, and the normalization is folded into the stores.
+ *
+ * When passes > 1, the blur is repeated, ping-ponging between two buffers in scratch that are only as large
+ * as the lines themselves, so intermediate results never go through a full-size image.
+ */
+void boxBlurLines(const Color4 * in, int inElemStride, int inLineStride,
+                  Color4 * out, int outElemStride, int outLineStride,
+                  int numLines, int n, int left, int right, HDRImage::BorderMode m,
+                  int passes, Array4f * sums, vector<Color4> & scratch)
+{
+    if (passes > 1)
+    {
+        // the scratch buffers store the lines interleaved, pixel by pixel
+        scratch.resize(2 * size_t(numLines) * n);
+        Color4 * buffers[2] = {scratch.data(), scratch.data() + size_t(numLines) * n};
+        boxBlurLines(in, inElemStride, inLineStride, buffers[0], numLines, 1,
+                     numLines, n, left, right, m, 1, sums, scratch);
+        for (int p = 1; p < passes - 1; ++p)
+            boxBlurLines(buffers[(p-1) % 2], numLines, 1, buffers[p % 2], numLines, 1,
+                         numLines, n, left, right, m, 1, sums, scratch);
+        boxBlurLines(buffers[(passes-2) % 2], numLines, 1, out, outElemStride, outLineStride,
+                     numLines, n, left, right, m, 1, sums, scratch);
+        return;
+    }
+
+    Array4f scale = Array4f::Constant(1.f / (left + right + 1));
+    auto border = [in,inElemStride,inLineStride,n,m](int i, int l) -> Array4f
+    {
+        int ii = wrapCoord(i, n, m);
+        return ii < 0 ? Array4f::Zero() : Array4f(channels(in[size_t(ii) * inElemStride + l * inLineStride]));
+    };
+
+    // fill up the accumulators
+    for (int l = 0; l < numLines; ++l)
+    {
+        sums[l].setZero();
+        for (int d = -left; d <= right; ++d)
+            sums[l] += border(d, l);
+        channels(out[l * outLineStride]) = sums[l] * scale;
+    }
+
+    // only the pixels in [interior0, interior1) slide the window without touching the border
+    int interior0 = clamp(left + 1, 1, n);
+    int interior1 = clamp(n - right, interior0, n);
+    for (int i = 1; i < n; ++i)
+    {
+        Color4 * o = out + size_t(i) * outElemStride;
+        if (i >= interior0 && i < interior1)
+        {
+            const Color4 * removed = in + size_t(i-1-left) * inElemStride;
+            const Color4 * added = in + size_t(i+right) * inElemStride;
+            for (int l = 0; l < numLines; ++l)
+            {
+                sums[l] += channels(added[l * inLineStride]) - channels(removed[l * inLineStride]);
+                channels(o[l * outLineStride]) = sums[l] * scale;
+            }
+            continue;
+        }
+
+        for (int l = 0; l < numLines; ++l)
+        {
+            sums[l] += border(i+right, l) - border(i-1-left, l);
+            channels(o[l * outLineStride]) = sums[l] * scale;
+        }
+    }
+}
+
+// smallest size >= n without prime factors other than 2, 3 and 5, for which the FFT is fast
+int nextFastFFTSize(int n)
+{
+    for (;; ++n)
+    {
+        int m = n;
+        for (int p : {2, 3, 5})
+            while (m % p == 0)
+                m /= p;
+        if (m == 1)
+            return n;
+    }
+}
+
+/*!
+ * In-place 2D FFTs of an nx x ny complex array stored with x varying fastest.
+ *
+ * Eigen::FFT caches its twiddle factors and is therefore not thread safe, so each thread needs its own.
+ */
+class FFT2D
+{
+public:
+    using Complex = complex<float>;
+
+    FFT2D(int nx, int ny) : m_nx(nx), m_ny(ny), m_in(std::max(nx, ny)), m_out(std::max(nx, ny)) {}
+
+    void forward(Complex * data) {transform(data, false);}
+    /// The inverse is scaled, so that inverse(forward(x)) = x
+    void inverse(Complex * data) {transform(data, true);}
+
+private:
+    void transform(Complex * data, bool inverse)
+    {
+        for (int y = 0; y < m_ny; ++y)
+            transformLine(data + size_t(y) * m_nx, 1, m_nx, inverse);
+        for (int x = 0; x < m_nx; ++x)
+            transformLine(data + x, m_nx, m_ny, inverse);
+    }
+
+    void transformLine(Complex * line, int stride, int n, bool inverse)
+    {
+        for (int i = 0; i < n; ++i)
+            m_in[i] = line[size_t(i) * stride];
+        if (inverse)
+            m_fft.inv(m_out.data(), m_in.data(), n);
+        else
+            m_fft.fwd(m_out.data(), m_in.data(), n);
+        for (int i = 0; i < n; ++i)
+            line[size_t(i) * stride] = m_out[i];
+    }
+
+    int m_nx, m_ny;
+    Eigen::FFT<float> m_fft;
+    vector<Complex> m_in, m_out;
+};
+
+/*!
+ * Convolve img with kernel using FFTs, producing the same result as the direct ConvolutionFilter.
+ *
+ * The image is processed in tiles using overlap-save: each tile is read together with an apron of the kernel
+ * size (through the border modes), transformed, multiplied by the spectrum of the kernel, and transformed back,
+ * keeping only the part that is unaffected by the circular wrap-around. The FFT size is a few times the
+ * kernel size, so the memory needed is bounded regardless of the image size. Since the kernel is real, two
+ * channels are packed into the real and imaginary parts of each transform. The (tile, channel pair) tasks
+ * run in parallel.
+ */
+HDRImage fftConvolve(const HDRImage & img, const ArrayXXf & kernel, AtomicProgress & progress,
+                     HDRImage::BorderMode mX, HDRImage::BorderMode mY)
+{
+    using Complex = FFT2D::Complex;
+
+    int w = img.width(), h = img.height();
+    int kw = int(kernel.rows()), kh = int(kernel.cols());
+    int centerX = (kw - 1) / 2, centerY = (kh - 1) / 2;
+
+    // aim for tiles of at least 256 output pixels (or the kernel size) on a side
+    int nx = nextFastFFTSize(std::min(w, std::max(256, kw)) + kw - 1);
+    int ny = nextFastFFTSize(std::min(h, std::max(256, kh)) + kh - 1);
+    int tileW = nx - kw + 1, tileH = ny - kh + 1;
+    int numTilesX = (w + tileW - 1) / tileW, numTilesY = (h + tileH - 1) / tileH;
+
+    progress.setNumSteps(2 * numTilesX * numTilesY + 1);
+
+    // the spectrum of the normalized kernel
+    vector<Complex> kernelSpectrum(size_t(nx) * ny, Complex(0.f));
+    float invWeightSum = 1.f / kernel.sum();
+    for (int j = 0; j < kh; ++j)
+        for (int i = 0; i < kw; ++i)
+            kernelSpectrum[i + size_t(j) * nx] = kernel(i, j) * invWeightSum;
+    FFT2D(nx, ny).forward(kernelSpectrum.data());
+    ++progress;
+
+    struct Workspace
+    {
+        Workspace(int nx, int ny) : fft(nx, ny), data(size_t(nx) * ny) {}
+        FFT2D fft;
+        vector<Complex> data;
+    };
+    vector<unique_ptr<Workspace>> workspaces(ThreadPool::instance().numThreads() + 1);
+
+    HDRImage result(w, h);
+    parallel_for(0, 2 * numTilesX * numTilesY, [&](int task, size_t thread)
+    {
+        progress.checkCanceled();
+
+        if (!workspaces[thread])
+            workspaces[thread].reset(new Workspace(nx, ny));
+        Workspace & ws = *workspaces[thread];
+
+        int channel = 2 * (task % 2);
+        int tile = task / 2;
+        int x0 = (tile % numTilesX) * tileW, y0 = (tile / numTilesX) * tileH;
+        int x1 = std::min(w, x0 + tileW), y1 = std::min(h, y0 + tileH);
+
+        // output pixel (x,y) ends up at (x - x0 + kw - 1, y - y0 + kh - 1) in the tile
+        int baseX = x0 + centerX - (kw - 1), baseY = y0 + centerY - (kh - 1);
+        for (int v = 0; v < ny; ++v)
+            for (int u = 0; u < nx; ++u)
+            {
+                const Color4 & p = img.pixel(baseX + u, baseY + v, mX, mY);
+                ws.data[u + size_t(v) * nx] = Complex(p[channel], p[channel + 1]);
+            }
+
+        ws.fft.forward(ws.data.data());
+        for (size_t i = 0; i < ws.data.size(); ++i)
+            ws.data[i] *= kernelSpectrum[i];
+        ws.fft.inverse(ws.data.data());
+
+        for (int y = y0; y < y1; ++y)
+            for (int x = x0; x < x1; ++x)
+            {
+                const Complex & c = ws.data[(x - x0 + kw - 1) + size_t(y - y0 + kh - 1) * nx];
+                result(x, y)[channel] = c.real();
+                result(x, y)[channel + 1] = c.imag();
+            }
+
+        ++progress;
+    });
+
+    return result;
+}
+
+struct ConvolutionFilter
+{
+    const ArrayXXf & kernel;
+    int centerX, centerY;
+    float invWeightSum;
+
+    template <typename Access>
+    Color4 operator()(const Access & src, int x, int y) const
+    {
+        Color4 accum(0.0f, 0.0f, 0.0f, 0.0f);
+        // for every pixel in the kernel
+        for (int yFilter = 0; yFilter < kernel.cols(); yFilter++)
+        {
+            int yy = y-yFilter+centerY;
+            for (int xFilter = 0; xFilter < kernel.rows(); xFilter++)
+                accum += kernel(xFilter, yFilter) * src(x-xFilter+centerX, yy);
+        }
+        return accum * invWeightSum;
+    }
+};
+
+/*!
+ * Maps the float values of one channel to a small number of ordered bins, so that the median filter can
+ * work with histograms instead of sorting the neighborhood of every pixel.
+ *
+ * The bin boundaries are the quantiles of a (strided) sample of the channel, so every bin holds roughly the
+ * same number of pixels regardless of the dynamic range of the image. A median that falls into a bin returns
+ * the median of the sampled values within it. If every pixel is sampled (images of at most 2^20 pixels) and the
+ * channel has at most NumBins distinct values (e.g. images loaded from 8-bit files), each value gets its own bin,
+ * which makes the result exact. Larger images are only sampled, so values that were missed share a bin.
+ *
+ * NaNs have no place in the ordering, so they go into the separate NaNBin, which the median filter leaves out.
+ */
+struct MedianQuantizer
+{
+    static const int NumFine = 64;                      ///< Bins per coarse bucket of the two-level histograms
+    static const int NumCoarse = 64;
+    static const int NumBins = NumCoarse * NumFine;
+    static const int NaNBin = NumBins;                  ///< Not part of the histograms
+
+    vector<float> lower;                                ///< Smallest value of each bin, in increasing order
+    vector<float> value;                                ///< The value returned for a median in each bin
+
+    MedianQuantizer(const HDRImage & img, int channel)
+    {
+        const size_t maxSamples = 1 << 20;
+        size_t n = img.size();
+        size_t stride = std::max(size_t(1), n / maxSamples);
+
+        vector<float> sample;
+        sample.reserve(n / stride + 2);
+        for (size_t i = 0; i < n; i += stride)
+            if (!std::isnan(img(i)[channel]))
+                sample.push_back(img(i)[channel]);
+        // black pixels outside the image (BorderMode BLACK) need an exact bin too
+        sample.push_back(0.f);
+        sort(sample.begin(), sample.end());
+
+        unique_copy(sample.begin(), sample.end(), back_inserter(lower));
+        if (lower.size() <= size_t(NumBins))
+        {
+            value = lower;
+            return;
+        }
+
+        lower.resize(NumBins);
+        for (int b = 0; b < NumBins; ++b)
+            lower[b] = sample[size_t(b) * sample.size() / NumBins];
+        lower.erase(unique(lower.begin(), lower.end()), lower.end());
+
+        value.resize(lower.size());
+        for (size_t b = 0; b < lower.size(); ++b)
+        {
+            auto first = lower_bound(sample.begin(), sample.end(), lower[b]);
+            auto last = b + 1 < lower.size() ? lower_bound(first, sample.end(), lower[b+1]) : sample.end();
+            value[b] = *(first + (last - first - 1) / 2);
+        }
+    }
+
+    uint16_t bin(float v) const
     {
-        for (int x = 0; x < result.width(); ++x)
+        if (std::isnan(v))
+            return NaNBin;
+        // the last bin whose lower bound is <= v
+        auto it = upper_bound(lower.begin(), lower.end(), v);
+        return uint16_t(std::max(0, int(it - lower.begin()) - 1));
+    }
+};
+
+/*!
+ * Sliding-histogram median filter, following Perreault and Hebert, "Median Filtering in Constant Time", 2007.
+ *
+ * The quantized channel is processed in vertical strips. Every column overlapping the strip keeps a histogram
+ * of the 2r+1 pixels around the current row, which costs one insertion and one removal per column when moving
+ * down a row. The square kernel histogram is then the sum of 2r+1 column histograms, and moves right by adding
+ * one column and subtracting another. The histograms have two levels: the coarse one is kept current, while the
+ * buckets of the fine level are only brought up to date when the median falls into them. This makes the cost
+ * per pixel independent of the radius.
+ *
+ * Round kernels cannot be assembled from columns, so they fall back to Huang's algorithm instead: the kernel
+ * histogram moves right by updating the ends of each of its rows, which costs O(r) per pixel.
+ *
+ * Pixels in the NaNBin are only counted, and the median is that of the other pixels in the kernel (or the
+ * NaNBin if there are none).
+ */
+class MedianStrip
+{
+public:
+    static const int NumFine = MedianQuantizer::NumFine;
+    static const int NumCoarse = MedianQuantizer::NumCoarse;
+    static const int NumBins = MedianQuantizer::NumBins;
+    static const int NaNBin = MedianQuantizer::NaNBin;
+
+    MedianStrip(const vector<uint16_t> & bins, uint16_t blackBin, int width, int height,
+                HDRImage::BorderMode mX, HDRImage::BorderMode mY) :
+        m_bins(bins), m_blackBin(blackBin), m_width(width), m_height(height), m_mX(mX), m_mY(mY)
+    {
+        // empty
+    }
+
+    /// Call store(x, y, bin) with the bin of the median in a square kernel of the given radius
+    template <typename Store>
+    void square(int x0, int x1, int radius, const Store & store, AtomicProgress & progress);
+
+    /// Call store(x, y, bin) with the bin of the median in a round kernel
+    template <typename Store>
+    void round(int x0, int x1, float radius, const Store & store, AtomicProgress & progress);
+
+private:
+    uint16_t binAt(int x, int y) const
+    {
+        // x has already been wrapped
+        int yy = wrapCoord(y, m_height, m_mY);
+        return (x < 0 || yy < 0) ? m_blackBin : m_bins[x + size_t(yy) * m_width];
+    }
+
+    // find the bin holding the median of the count values in the kernel that are not NaN, given the coarse
+    // level and a function providing the up-to-date fine level of a coarse bucket
+    template <typename FineBucket>
+    static int select(const uint32_t * coarse, uint32_t count, const FineBucket & fineBucket)
+    {
+        if (count == 0)
+            return NaNBin;
+
+        uint32_t k = (count - 1) / 2;
+        int c = 0;
+        while (c < NumCoarse - 1 && k >= coarse[c])
+            k -= coarse[c++];
+
+        const uint32_t * fine = fineBucket(c);
+        int f = 0;
+        while (f < NumFine - 1 && k >= fine[f])
+            k -= fine[f++];
+
+        return c * NumFine + f;
+    }
+
+    const vector<uint16_t> & m_bins;
+    uint16_t m_blackBin;
+    int m_width, m_height;
+    HDRImage::BorderMode m_mX, m_mY;
+};
+
+template <typename Store>
+void MedianStrip::square(int x0, int x1, int r, const Store & store, AtomicProgress & progress)
+{
+    const int numCols = x1 - x0 + 2 * r;
+    const int diameter = 2 * r + 1;
+    const uint32_t area = uint32_t(diameter * diameter);
+
+    vector<int> colX(numCols);
+    for (int l = 0; l < numCols; ++l)
+        colX[l] = wrapCoord(x0 - r + l, m_width, m_mX);
+
+    // column histograms for the rows [y-r, y+r]
+    vector<uint16_t> colCoarse(size_t(numCols) * NumCoarse, 0);
+    vector<uint16_t> colFine(size_t(numCols) * NumBins, 0);
+    vector<uint16_t> colNaNs(numCols, 0);
+    auto addToColumn = [&colCoarse,&colFine,&colNaNs](int l, int b, int d)
+    {
+        if (b == NaNBin)
         {
-            Color4 sum(0, 0, 0, 0);
-            for (int yy = 0; yy < superSample; ++yy)
+            colNaNs[l] += d;
+            return;
+        }
+        colCoarse[size_t(l) * NumCoarse + b / NumFine] += d;
+        colFine[size_t(l) * NumBins + b] += d;
+    };
+
+    for (int l = 0; l < numCols; ++l)
+        for (int dy = -r; dy <= r; ++dy)
+            addToColumn(l, binAt(colX[l], dy), 1);
+
+    uint32_t coarse[NumCoarse];
+    uint32_t fine[NumBins];
+    int fineCol[NumCoarse];     ///< left-most column of the kernel when each fine bucket was last updated
+
+    // bring the fine bucket c up to date for the kernel starting at column l
+    auto fineBucket = [&](int l, int c) -> const uint32_t *
+    {
+        uint32_t * bucket = fine + c * NumFine;
+        if (fineCol[c] < l - diameter)
+        {
+            // cheaper to start over
+            fill(bucket, bucket + NumFine, 0);
+            for (int i = l; i < l + diameter; ++i)
+            {
+                const uint16_t * col = &colFine[size_t(i) * NumBins + c * NumFine];
+                for (int f = 0; f < NumFine; ++f)
+                    bucket[f] += col[f];
+            }
+        }
+        else
+        {
+            for (int i = fineCol[c] + 1; i <= l; ++i)
+            {
+                const uint16_t * added = &colFine[size_t(i + 2*r) * NumBins + c * NumFine];
+                const uint16_t * removed = &colFine[size_t(i - 1) * NumBins + c * NumFine];
+                for (int f = 0; f < NumFine; ++f)
+                    bucket[f] += added[f] - removed[f];
+            }
+        }
+        fineCol[c] = l;
+        return bucket;
+    };
+
+    for (int y = 0; y < m_height; ++y)
+    {
+        progress.checkCanceled();
+
+        if (y > 0)
+            for (int l = 0; l < numCols; ++l)
+            {
+                addToColumn(l, binAt(colX[l], y - r - 1), -1);
+                addToColumn(l, binAt(colX[l], y + r), 1);
+            }
+
+        fill(coarse, coarse + NumCoarse, 0);
+        uint32_t nans = 0;
+        for (int l = 0; l < diameter; ++l)
+        {
+            for (int c = 0; c < NumCoarse; ++c)
+                coarse[c] += colCoarse[size_t(l) * NumCoarse + c];
+            nans += colNaNs[l];
+        }
+        fill(fineCol, fineCol + NumCoarse, -2 * diameter);
+
+        for (int x = x0; x < x1; ++x)
+        {
+            int l = x - x0;
+            if (l > 0)
             {
-                float j = (yy + 0.5f) / superSample;
-                for (int xx = 0; xx < superSample; ++xx)
+                const uint16_t * added = &colCoarse[size_t(l + 2*r) * NumCoarse];
+                const uint16_t * removed = &colCoarse[size_t(l - 1) * NumCoarse];
+                for (int c = 0; c < NumCoarse; ++c)
+                    coarse[c] += added[c] - removed[c];
+                nans += colNaNs[l + 2*r] - colNaNs[l - 1];
+            }
+
+            store(x, y, select(coarse, area - nans, [&fineBucket,l](int c){return fineBucket(l, c);}));
+        }
+
+        ++progress;
+    }
+}
+
+template <typename Store>
+void MedianStrip::round(int x0, int x1, float radius, const Store & store, AtomicProgress & progress)
+{
+    int r = int(std::ceil(radius));
+
+    // half width of each row of the kernel, or -1 if the row is empty
+    vector<int> halfWidth(2*r+1, -1);
+    uint32_t count = 0;
+    for (int j = -r; j <= r; ++j)
+    {
+        for (int i = 0; i <= r && i*i + j*j <= radius*radius; ++i)
+            halfWidth[j + r] = i;
+        if (halfWidth[j + r] >= 0)
+            count += 2 * halfWidth[j + r] + 1;
+    }
+
+    uint32_t coarse[NumCoarse];
+    uint32_t fine[NumBins];
+    uint32_t nans = 0;
+    auto add = [&coarse,&fine,&nans](int b, int d)
+    {
+        if (b == NaNBin)
+        {
+            nans += d;
+            return;
+        }
+        coarse[b / NumFine] += d;
+        fine[b] += d;
+    };
+    auto fineBucket = [&fine](int c) -> const uint32_t * {return fine + c * NumFine;};
+
+    for (int y = 0; y < m_height; ++y)
+    {
+        progress.checkCanceled();
+
+        fill(coarse, coarse + NumCoarse, 0);
+        fill(fine, fine + NumBins, 0);
+        nans = 0;
+        for (int j = -r; j <= r; ++j)
+            for (int i = -halfWidth[j + r]; i <= halfWidth[j + r]; ++i)
+                add(binAt(wrapCoord(x0 + i, m_width, m_mX), y + j), 1);
+
+        for (int x = x0; x < x1; ++x)
+        {
+            if (x > x0)
+                for (int j = -r; j <= r; ++j)
                 {
-                    float i = (xx + 0.5f) / superSample;
-                    Vector2f srcUV = warpFn(Vector2f((x + i) / w, (y + j) / h)).array() * Array2f(width(), height());
-                    sum += sample(srcUV(0), srcUV(1), sampler, mX, mY);
+                    int w = halfWidth[j + r];
+                    if (w < 0)
+                        continue;
+                    add(binAt(wrapCoord(x - 1 - w, m_width, m_mX), y + j), -1);
+                    add(binAt(wrapCoord(x + w, m_width, m_mX), y + j), 1);
                 }
-            }
-            result(x, y) = sum / (superSample * superSample);
+
+            store(x, y, select(coarse, count - nans, fineBucket));
         }
+
         ++progress;
+    }
+}
+
+/*!
+ * Median filter the listed channels of img in a single parallel pass, leaving the other channels untouched.
+ */
+HDRImage medianFilterChannels(const HDRImage & img, const vector<int> & chans, float radius,
+                              AtomicProgress progress, HDRImage::BorderMode mX, HDRImage::BorderMode mY, bool round)
+{
+    Timer timer;
+    HDRImage result = img;
+    int w = img.width(), h = img.height();
+    if (img.isNull() || chans.empty())
+        return result;
+
+    // quantize all the channels at once
+    vector<MedianQuantizer> quantizers;
+    for (int c : chans)
+        quantizers.emplace_back(img, c);
+
+    vector<vector<uint16_t>> bins(chans.size(), vector<uint16_t>(img.size()));
+    parallel_for(BlockedRange(0, int(img.size()), 1 << 16), [&img,&chans,&quantizers,&bins](int begin, int end)
+    {
+        for (size_t c = 0; c < chans.size(); ++c)
+            for (int i = begin; i < end; ++i)
+                bins[c][i] = quantizers[c].bin(img(i)[chans[c]]);
     });
-    spdlog::get("console")->trace("Resampling took: {} seconds.", (timer.elapsed()/1000.f));
+
+    const int stripWidth = 256;
+    int numStrips = (w + stripWidth - 1) / stripWidth;
+    progress.setNumSteps(numStrips * int(chans.size()) * h);
+    parallel_for(BlockedRange(0, w, stripWidth),
+                 [&result,&chans,&quantizers,&bins,&progress,w,h,radius,mX,mY,round](int x0, int x1)
+    {
+        for (size_t c = 0; c < chans.size(); ++c)
+        {
+            int channel = chans[c];
+            const vector<float> & value = quantizers[c].value;
+            auto store = [&result,&value,channel](int x, int y, int b)
+            {
+                result(x,y)[channel] = b == MedianQuantizer::NaNBin ? numeric_limits<float>::quiet_NaN() : value[b];
+            };
+
+            MedianStrip strip(bins[c], quantizers[c].bin(0.f), w, h, mX, mY);
+            if (round)
+                strip.round(x0, x1, radius, store, progress);
+            else
+                strip.square(x0, x1, int(std::ceil(radius)), store, progress);
+        }
+    });
+
+    spdlog::get("console")->trace("Median filter took: {} seconds.", (timer.elapsed()/1000.f));
     return result;
 }
 
+/*!
+ * Tabulated exp(-d2 / (2 sigma^2)), linearly interpolated. Weights below exp(-MaxExponent) are returned as zero.
+ */
+struct GaussianLUT
+{
+    static const int SamplesPerUnit = 256;
+    static const int MaxExponent = 16;
+
+    explicit GaussianLUT(float sigma) :
+        values(SamplesPerUnit * MaxExponent + 2),
+        scale(SamplesPerUnit / (2.f * sigma * sigma))
+    {
+        for (size_t i = 0; i < values.size(); ++i)
+            values[i] = std::exp(-float(i) / SamplesPerUnit);
+    }
+
+    float operator()(float d2) const
+    {
+        float t = d2 * scale;
+        if (!(t < SamplesPerUnit * MaxExponent))
+            // also catches 0/0 for a zero sigma
+            return d2 > 0.f ? 0.f : 1.f;
+        int i = int(t);
+        return lerp(values[i], values[i+1], t - i);
+    }
+
+    vector<float> values;
+    float scale;
+};
+
+struct BilateralFilter
+{
+    int radius;
+    const vector<float> & domainWeights;    ///< (2*radius+1)^2 weights, x varying fastest
+    const GaussianLUT & rangeWeight;
+
+    template <typename Access>
+    Color4 operator()(const Access & src, int x, int y) const
+    {
+        // initilize normalizer and sum value to 0 for every pixel location
+        float weightSum = 0.0f;
+        Array4f accum = Array4f::Zero();
+        Array4f center = channels(src(x, y));
+
+        const float * domainWeight = domainWeights.data();
+        for (int yFilter = -radius; yFilter <= radius; yFilter++)
+        {
+            int yy = y+yFilter;
+            for (int xFilter = -radius; xFilter <= radius; xFilter++, domainWeight++)
+            {
+                auto p = channels(src(x+xFilter, yy));
+                // weight by the squared distance between the 2 pixels in the domain and in range
+                float weight = *domainWeight * rangeWeight((p - center).square().sum());
+                weightSum += weight;
+                accum += weight * p;
+            }
+        }
+
+        // weighted sum of values in the filter region
+        accum /= weightSum;
+        return Color4(accum[0], accum[1], accum[2], accum[3]);
+    }
+};
+
+/*!
+ * The permutohedral lattice of Adams et al., "Fast High-Dimensional Filtering Using the Permutohedral
+ * Lattice", 2010, specialized to Gaussian filtering of Color4 values in a 6D space of position and color.
+ *
+ * Every pixel is splatted with barycentric weights onto the vertices of the enclosing simplex of the
+ * lattice, the lattice is blurred with a [1 2 1] kernel along each of its d+1 axes, and the result is
+ * sliced back out at each pixel. Only the occupied vertices are stored, in a hash table, so the cost is
+ * linear in the number of pixels and independent of the filter size.
+ */
+class PermutohedralLattice
+{
+public:
+    static const int D = 6;                 ///< Dimension of the position vectors
+    static const int VD = 5;                ///< Values (the 4 channels) plus a homogeneous weight
+
+    PermutohedralLattice(size_t expectedSize)
+    {
+        for (int i = 0; i < D; ++i)
+            // the lattice blur is a Gaussian with this standard deviation
+            m_scaleFactor[i] = (D + 1) * std::sqrt(2.f / 3.f) / std::sqrt(float((i + 1) * (i + 2)));
+
+        resize(std::max(size_t(1) << 10, expectedSize));
+    }
+
+    /// The vertices of the simplex enclosing the position, and the barycentric weights of the position within it
+    struct Simplex
+    {
+        int rem0[D+1], rank[D+1];
+        float barycentric[D+2];
+
+        void key(int remainder, int * key) const
+        {
+            for (int i = 0; i < D; ++i)
+                key[i] = rem0[i] + (rank[i] <= D - remainder ? remainder : remainder - (D + 1));
+        }
+    };
+
+    Simplex enclose(const float * position) const
+    {
+        Simplex s;
+
+        // elevate the position onto the hyperplane of the lattice
+        float elevated[D+1];
+        float sm = 0;
+        for (int i = D; i > 0; --i)
+        {
+            float cf = position[i-1] * m_scaleFactor[i-1];
+            elevated[i] = sm - i * cf;
+            sm += cf;
+        }
+        elevated[0] = sm;
+
+        // find the closest remainder-0 point and sort the differences to it
+        int sum = 0;
+        for (int i = 0; i <= D; ++i)
+        {
+            float v = elevated[i] * (1.f / (D + 1));
+            int up = int(std::ceil(v)) * (D + 1);
+            int down = int(std::floor(v)) * (D + 1);
+            s.rem0[i] = (up - elevated[i] < elevated[i] - down) ? up : down;
+            sum += s.rem0[i];
+            s.rank[i] = 0;
+        }
+        sum /= D + 1;
+
+        for (int i = 0; i < D; ++i)
+        {
+            float di = elevated[i] - s.rem0[i];
+            for (int j = i + 1; j <= D; ++j)
+                if (di < elevated[j] - s.rem0[j])
+                    s.rank[i]++;
+                else
+                    s.rank[j]++;
+        }
+
+        // if the point doesn't lie on the plane, walk it back onto it
+        for (int i = 0; i <= D; ++i)
+        {
+            if (sum > 0 && s.rank[i] >= D + 1 - sum)
+            {
+                s.rank[i] -= D + 1 - sum;
+                s.rem0[i] -= D + 1;
+            }
+            else if (sum < 0 && s.rank[i] < -sum)
+            {
+                s.rank[i] += D + 1 + sum;
+                s.rem0[i] += D + 1;
+            }
+            else
+                s.rank[i] += sum;
+        }
+
+        fill(s.barycentric, s.barycentric + D + 2, 0.f);
+        for (int i = 0; i <= D; ++i)
+        {
+            float delta = (elevated[i] - s.rem0[i]) * (1.f / (D + 1));
+            s.barycentric[D - s.rank[i]] += delta;
+            s.barycentric[D + 1 - s.rank[i]] -= delta;
+        }
+        s.barycentric[0] += 1.f + s.barycentric[D + 1];
+
+        return s;
+    }
+
+    /// Add the color with unit weight at the given position. Not thread safe.
+    void splat(const float * position, const Color4 & c)
+    {
+        Simplex s = enclose(position);
+        int key[D];
+        for (int r = 0; r <= D; ++r)
+        {
+            s.key(r, key);
+            float * v = &m_values[size_t(findOrInsert(key)) * VD];
+            float w = s.barycentric[r];
+            for (int i = 0; i < 4; ++i)
+                v[i] += w * c[i];
+            v[4] += w;
+        }
+    }
+
+    /// Blur the lattice along each of its axes, optionally in parallel
+    void blur(AtomicProgress & progress)
+    {
+        vector<float> blurred(m_values.size());
+        for (int axis = 0; axis <= D; ++axis)
+        {
+            progress.checkCanceled();
+            parallel_for(BlockedRange(0, int(m_numPoints)), [this,&blurred,axis](int begin, int end)
+            {
+                int n1[D], n2[D];
+                const float zero[VD] = {0.f};
+                for (int p = begin; p < end; ++p)
+                {
+                    const int * key = &m_keys[size_t(p) * D];
+                    for (int i = 0; i < D; ++i)
+                    {
+                        n1[i] = key[i] + 1;
+                        n2[i] = key[i] - 1;
+                    }
+                    if (axis < D)
+                    {
+                        n1[axis] = key[axis] - D;
+                        n2[axis] = key[axis] + D;
+                    }
+
+                    int i1 = find(n1), i2 = find(n2);
+                    const float * v1 = i1 >= 0 ? &m_values[size_t(i1) * VD] : zero;
+                    const float * v2 = i2 >= 0 ? &m_values[size_t(i2) * VD] : zero;
+                    const float * v = &m_values[size_t(p) * VD];
+                    float * out = &blurred[size_t(p) * VD];
+                    for (int i = 0; i < VD; ++i)
+                        out[i] = 0.25f * v1[i] + 0.5f * v[i] + 0.25f * v2[i];
+                }
+            });
+            m_values.swap(blurred);
+            ++progress;
+        }
+    }
+
+    /// The normalized, blurred color at the given position. Thread safe once splatting is done.
+    Color4 slice(const float * position) const
+    {
+        Simplex s = enclose(position);
+        int key[D];
+        float accum[VD] = {0.f};
+        for (int r = 0; r <= D; ++r)
+        {
+            s.key(r, key);
+            int p = find(key);
+            if (p < 0)
+                continue;
+            const float * v = &m_values[size_t(p) * VD];
+            for (int i = 0; i < VD; ++i)
+                accum[i] += s.barycentric[r] * v[i];
+        }
+        float norm = accum[4] > 0.f ? 1.f / accum[4] : 0.f;
+        return Color4(accum[0] * norm, accum[1] * norm, accum[2] * norm, accum[3] * norm);
+    }
+
+private:
+    static size_t hash(const int * key)
+    {
+        size_t k = 0;
+        for (int i = 0; i < D; ++i)
+            k = (k + uint32_t(key[i])) * 2531011;
+        // the low bits are used to index the table, so mix in the high ones
+        return k ^ (k >> 29);
+    }
+
+    // index of the point with the given key, or -1
+    int find(const int * key) const
+    {
+        size_t mask = m_table.size() - 1;
+        for (size_t h = hash(key) & mask; ; h = (h + 1) & mask)
+        {
+            const Slot & slot = m_table[h];
+            if (slot.point < 0 || equal(key, key + D, slot.key))
+                return slot.point;
+        }
+    }
+
+    int findOrInsert(const int * key)
+    {
+        int p = find(key);
+        if (p >= 0)
+            return p;
+
+        if (2 * (m_numPoints + 1) > m_table.size())
+            resize(2 * m_table.size());
+
+        p = int(m_numPoints++);
+        m_keys.insert(m_keys.end(), key, key + D);
+        m_values.resize(m_values.size() + VD, 0.f);
+        insert(p);
+        return p;
+    }
+
+    void insert(int p)
+    {
+        const int * key = &m_keys[size_t(p) * D];
+        size_t mask = m_table.size() - 1;
+        size_t h = hash(key) & mask;
+        while (m_table[h].point >= 0)
+            h = (h + 1) & mask;
+
+        m_table[h].point = p;
+        copy(key, key + D, m_table[h].key);
+    }
+
+    // rebuild the hash table with at least the given number of slots
+    void resize(size_t minSlots)
+    {
+        size_t numSlots = 1;
+        while (numSlots < minSlots)
+            numSlots *= 2;
+
+        m_table.assign(numSlots, Slot());
+        for (size_t p = 0; p < m_numPoints; ++p)
+            insert(int(p));
+    }
+
+    // the keys are duplicated in the table to avoid a second cache miss per lookup
+    struct Slot
+    {
+        int point = -1;
+        int key[D];
+    };
+
+    float m_scaleFactor[D];
+    size_t m_numPoints = 0;
+    vector<Slot> m_table;                   ///< Open addressing hash table of the points
+    vector<int> m_keys;                     ///< D coordinates for each point
+    vector<float> m_values;                 ///< VD values for each point
+};
+
+} // namespace
 
 HDRImage HDRImage::convolved(const ArrayXXf &kernel, AtomicProgress progress,
                              BorderMode mX, BorderMode mY) const
 {
+    TRACE_ZONE("HDRImage::convolved");
+    // the cost of the direct convolution grows with the kernel area, while the FFT's barely depends
+    // on it. They break even at about 8x8
+    if (kernel.size() > 64)
+        return fftConvolved(kernel, progress, mX, mY);
+
     HDRImage result(width(), height());
 
     int centerX = int((kernel.rows()-1.0)/2.0);
     int centerY = int((kernel.cols()-1.0)/2.0);
 
+    ConvolutionFilter filter{kernel, centerX, centerY, 1.f / kernel.sum()};
+
     Timer timer;
-	progress.setNumSteps(result.width());
-    // for every pixel in the image
-    parallel_for(0, result.width(), [this,&progress,kernel,mX,mY,&result,centerX,centerY](int x)
+    // for every pixel in the image, one cache-sized tile at a time
+    BlockedRange2D tiles(0, 0, result.width(), result.height());
+	progress.setNumSteps(tiles.numTiles());
+    parallel_for(tiles, [this,&progress,&filter,&kernel,mX,mY,&result,centerX,centerY](int x0, int y0, int x1, int y1)
+    {
+        progress.checkCanceled();
+        filterTile(*this, x0, y0, x1, y1,
+                   int(kernel.rows()) - 1 - centerX, centerX, int(kernel.cols()) - 1 - centerY, centerY,
+                   mX, mY, filter,
+                   [&result](int x, int y, const Color4 & v){result(x, y) = v;});
+        ++progress;
+    });
+    spdlog::get("console")->trace("Convolution took: {} seconds.", (timer.elapsed()/1000.f));
+
+    return result;
+}
+
+HDRImage HDRImage::fftConvolved(const ArrayXXf &kernel, AtomicProgress progress,
+                                BorderMode mX, BorderMode mY) const
+{
+    TRACE_ZONE("HDRImage::fftConvolved");
+    if (isNull() || kernel.size() == 0)
+        return *this;
+
+    Timer timer;
+    HDRImage result = fftConvolve(*this, kernel, progress, mX, mY);
+    spdlog::get("console")->trace("FFT convolution took: {} seconds.", (timer.elapsed()/1000.f));
+
+    return result;
+}
+
+HDRImage HDRImage::convolvedX(const ArrayXf &kernel, AtomicProgress progress, BorderMode mX) const
+{
+    TRACE_ZONE("HDRImage::convolvedX");
+    HDRImage result(width(), height());
+
+    // normalize once, and flip the kernel so that tap i reads the pixel at offset first + i
+    int n = int(kernel.size());
+    int center = (n - 1) / 2;
+    int first = center - (n - 1);
+    ArrayXf weights = kernel.reverse() / kernel.sum();
+
+    // the pixels in [interiorBegin, interiorEnd) don't need any border handling
+    int interiorBegin = std::min(width(), -first);
+    int interiorEnd = std::max(interiorBegin, width() - center);
+
+    Timer timer;
+    progress.setNumSteps(height());
+    parallel_for(BlockedRange(0, height()), [this,&progress,&weights,&result,mX,n,first,interiorBegin,interiorEnd](int y0, int y1)
     {
-        for (int y = 0; y < result.height(); y++)
+        progress.checkCanceled();
+        for (int y = y0; y < y1; ++y)
         {
-            Color4 accum(0.0f, 0.0f, 0.0f, 0.0f);
-            float weightSum = 0.0f;
-            // for every pixel in the kernel
-            for (int xFilter = 0; xFilter < kernel.rows(); xFilter++)
+            auto border = [this,&weights,&result,mX,n,first,y](int x)
             {
-                int xx = x-xFilter+centerX;
-
-                for (int yFilter = 0; yFilter < kernel.cols(); yFilter++)
-                {
-                    int yy = y-yFilter+centerY;
-                    accum += kernel(xFilter, yFilter) * pixel(xx, yy, mX, mY);
-                    weightSum += kernel(xFilter, yFilter);
-                }
+                Array4f accum = Array4f::Zero();
+                for (int i = 0; i < n; ++i)
+                    accum += weights[i] * channels(pixel(x + first + i, y, mX, mX));
+                channels(result(x, y)) = accum;
+            };
+
+            for (int x = 0; x < interiorBegin; ++x)
+                border(x);
+
+            // the pixels within a row are contiguous
+            const Color4 * src = &(*this)(0, y) + first;
+            for (int x = interiorBegin; x < interiorEnd; ++x)
+            {
+                Array4f accum = Array4f::Zero();
+                for (int i = 0; i < n; ++i)
+                    accum += weights[i] * channels(src[x + i]);
+                channels(result(x, y)) = accum;
             }
 
-            // assign the pixel the value from convolution
-            result(x,y) = accum / weightSum;
+            for (int x = interiorEnd; x < width(); ++x)
+                border(x);
+        }
+        progress += y1 - y0;
+    });
+    spdlog::get("console")->trace("convolvedX took: {} seconds.", (timer.elapsed()/1000.f));
+
+    return result;
+}
+
+HDRImage HDRImage::convolvedY(const ArrayXf &kernel, AtomicProgress progress, BorderMode mY) const
+{
+    TRACE_ZONE("HDRImage::convolvedY");
+    HDRImage result = HDRImage::Constant(width(), height(), Color4(0.f, 0.f, 0.f, 0.f));
+
+    // normalize once, and flip the kernel so that tap i reads the row at offset first + i
+    int n = int(kernel.size());
+    int center = (n - 1) / 2;
+    int first = center - (n - 1);
+    ArrayXf weights = kernel.reverse() / kernel.sum();
+
+    Timer timer;
+    // work on strips of columns, so that the kernel's worth of source row segments that each output row
+    // needs stays in cache while sliding down, instead of streaming whole rows of a wide image for every tap
+    BlockedRange2D tiles(0, 0, width(), height(), 64, 256);
+    progress.setNumSteps(tiles.numTiles());
+    parallel_for(tiles, [this,&progress,&weights,&result,mY,n,first](int x0, int y0, int x1, int y1)
+    {
+        progress.checkCanceled();
+        int numFloats = 4 * (x1 - x0);
+        for (int y = y0; y < y1; ++y)
+        {
+            // accumulate whole weighted source row segments into the destination, so the border handling only
+            // needs to happen once per row instead of once per pixel
+            float * dst = &result(x0, y).r;
+            for (int i = 0; i < n; ++i)
+            {
+                int yy = wrapCoord(y + first + i, height(), mY);
+                if (yy < 0)
+                    continue;
+
+                const float * src = &(*this)(x0, yy).r;
+                float w = weights[i];
+                for (int k = 0; k < numFloats; ++k)
+                    dst[k] += w * src[k];
+            }
         }
         ++progress;
     });
-    spdlog::get("console")->trace("Convolution took: {} seconds.", (timer.elapsed()/1000.f));
+    spdlog::get("console")->trace("convolvedY took: {} seconds.", (timer.elapsed()/1000.f));
 
     return result;
 }
 
 HDRImage HDRImage::GaussianBlurredX(float sigmaX, AtomicProgress progress, BorderMode mX, float truncateX) const
 {
-    return convolved(horizontalGaussianKernel(sigmaX, truncateX), progress, mX, mX);
+    TRACE_ZONE("HDRImage::GaussianBlurredX");
+    return convolvedX(horizontalGaussianKernel(sigmaX, truncateX), progress, mX);
 }
 
 HDRImage HDRImage::GaussianBlurredY(float sigmaY, AtomicProgress progress, BorderMode mY, float truncateY) const
 {
-    return convolved(horizontalGaussianKernel(sigmaY, truncateY).transpose(), progress, mY, mY);
+    TRACE_ZONE("HDRImage::GaussianBlurredY");
+    return convolvedY(horizontalGaussianKernel(sigmaY, truncateY), progress, mY);
 }
 
 // Use principles of separability to blur an image using 2 1D Gaussian Filters
@@ -256,6 +1527,7 @@ HDRImage HDRImage::GaussianBlurred(float sigmaX, float sigmaY, AtomicProgress pr
                                    BorderMode mX, BorderMode mY,
                                    float truncateX, float truncateY) const
 {
+    TRACE_ZONE("HDRImage::GaussianBlurred");
     // blur using 2, 1D filters in the x and y directions
     return GaussianBlurredX(sigmaX, AtomicProgress(progress, .5f), mX, truncateX).GaussianBlurredY(sigmaY, AtomicProgress(progress, .5f), mY, truncateY);
 }
@@ -264,7 +1536,11 @@ HDRImage HDRImage::GaussianBlurred(float sigmaX, float sigmaY, AtomicProgress pr
 // sharpen an image
 HDRImage HDRImage::unsharpMasked(float sigma, float strength, AtomicProgress progress, BorderMode mX, BorderMode mY) const
 {
-    return *this + Color4(strength) * (*this - fastGaussianBlurred(sigma, sigma, progress, mX, mY));
+    TRACE_ZONE("HDRImage::unsharpMasked");
+    // reuse the blurred image for the result
+    HDRImage result = fastGaussianBlurred(sigma, sigma, progress, mX, mY);
+    result = *this + Color4(strength) * (*this - result);
+    return result;
 }
 
 
@@ -272,48 +1548,15 @@ HDRImage HDRImage::unsharpMasked(float sigma, float strength, AtomicProgress pro
 HDRImage HDRImage::medianFiltered(float radius, int channel, AtomicProgress progress,
                                   BorderMode mX, BorderMode mY, bool round) const
 {
-    int radiusi = int(std::ceil(radius));
-    HDRImage tempBuffer = *this;
-
-    Timer timer;
-    progress.setNumSteps(height());
-    // for every pixel in the image
-    parallel_for(0, height(), [this,&tempBuffer,&progress,radius,radiusi,channel,mX,mY,round](int y)
-    {
-        vector<float> mBuffer;
-        mBuffer.reserve((2*radiusi)*(2*radiusi));
-        for (int x = 0; x < tempBuffer.width(); x++)
-        {
-            mBuffer.clear();
-
-            int xCoord, yCoord;
-            // over all pixels in the neighborhood kernel
-            for (int i = -radiusi; i <= radiusi; i++)
-            {
-                xCoord = x + i;
-                for (int j = -radiusi; j <= radiusi; j++)
-                {
-                    if (round && i*i + j*j > radius*radius)
-                        continue;
-
-                    yCoord = y + j;
-                    mBuffer.push_back(pixel(xCoord, yCoord, mX, mY)[channel]);
-                }
-            }
-
-            int num = mBuffer.size();
-            int med = (num-1)/2;
-
-            nth_element(mBuffer.begin() + 0,
-                        mBuffer.begin() + med,
-                        mBuffer.begin() + mBuffer.size());
-            tempBuffer(x,y)[channel] = mBuffer[med];
-        }
-        ++progress;
-    });
-    spdlog::get("console")->trace("Median filter took: {} seconds.", (timer.elapsed()/1000.f));
+    TRACE_ZONE("HDRImage::medianFiltered");
+    return medianFilterChannels(*this, {channel}, radius, progress, mX, mY, round);
+}
 
-    return tempBuffer;
+HDRImage HDRImage::medianFiltered(float radius, AtomicProgress progress,
+                                  BorderMode mX, BorderMode mY, bool round) const
+{
+    TRACE_ZONE("HDRImage::medianFiltered");
+    return medianFilterChannels(*this, {0, 1, 2, 3}, radius, progress, mX, mY, round);
 }
 
 
@@ -321,46 +1564,98 @@ HDRImage HDRImage::bilateralFiltered(float sigmaRange, float sigmaDomain,
                                      AtomicProgress progress,
                                      BorderMode mX, BorderMode mY, float truncateDomain) const
 {
+    TRACE_ZONE("HDRImage::bilateralFiltered");
     HDRImage filtered(width(), height());
 
     // calculate the filter size
     int radius = int(std::ceil(truncateDomain * sigmaDomain));
 
+    // the weights only depend on the (squared) distances, so tabulate them
+    vector<float> domainWeights;
+    domainWeights.reserve((2*radius+1)*(2*radius+1));
+    for (int yFilter = -radius; yFilter <= radius; yFilter++)
+        for (int xFilter = -radius; xFilter <= radius; xFilter++)
+            domainWeights.push_back(std::exp(-(xFilter*xFilter + yFilter*yFilter) / (2.0 * std::pow(sigmaDomain,2))));
+    GaussianLUT rangeWeight(sigmaRange);
+
     Timer timer;
     progress.setNumSteps(height());
     // for every pixel in the image
-    parallel_for(0, filtered.height(), [this,&filtered,&progress,radius,sigmaRange,sigmaDomain,mX,mY](int y)
+    parallel_for(BlockedRange(0, filtered.height()),
+                 [this,&filtered,&progress,&domainWeights,&rangeWeight,radius,mX,mY](int y0, int y1)
+    {
+        progress.checkCanceled();
+        BilateralFilter filter{radius, domainWeights, rangeWeight};
+        filterTile(*this, 0, y0, width(), y1, radius, radius, radius, radius, mX, mY, filter,
+                   [&filtered](int x, int y, const Color4 & v){filtered(x,y) = v;});
+        progress += y1 - y0;
+    });
+    spdlog::get("console")->trace("Bilateral filter took: {} seconds.", (timer.elapsed()/1000.f));
+
+    return filtered;
+}
+
+HDRImage HDRImage::fastBilateralFiltered(float sigmaRange, float sigmaDomain, AtomicProgress progress,
+                                         BorderMode mX, BorderMode mY) const
+{
+    TRACE_ZONE("HDRImage::fastBilateralFiltered");
+    if (!(sigmaRange > 0.f && sigmaDomain > 0.f) || isNull())
+        return *this;
+
+    // the lattice has a few vertices per pixel for small domain sigmas, and then the
+    // brute force filter, truncated at 3 sigma, is faster
+    if (sigmaDomain <= 4.f)
+        return bilateralFiltered(sigmaRange, sigmaDomain, progress, mX, mY, 3.f);
+
+    Timer timer;
+    HDRImage filtered(width(), height());
+
+    // positions are scaled so that the filter has unit standard deviation in each dimension
+    auto position = [sigmaRange,sigmaDomain](int x, int y, const Color4 & c, float * pos)
+    {
+        pos[0] = x / sigmaDomain;
+        pos[1] = y / sigmaDomain;
+        for (int i = 0; i < 4; ++i)
+            pos[2 + i] = c[i] / sigmaRange;
+    };
+
+    // the border pixels within the same 3 sigma as the exact filter are splatted too, so that
+    // the result near the edges follows the border modes instead of just renormalizing there
+    int apron = int(std::ceil(3.f * sigmaDomain));
+    int xBegin = -apron, xEnd = width() + apron, yBegin = -apron, yEnd = height() + apron;
+
+    progress.setNumSteps((yEnd - yBegin) + height() + PermutohedralLattice::D + 1);
+
+    // splatting inserts into the hash table, so it has to be serial
+    PermutohedralLattice lattice(size_t(xEnd - xBegin) * size_t(yEnd - yBegin) / 4);
+    float pos[PermutohedralLattice::D];
+    for (int y = yBegin; y < yEnd; ++y)
     {
-        for (int x = 0; x < filtered.width(); x++)
+        progress.checkCanceled();
+        for (int x = xBegin; x < xEnd; ++x)
         {
-            // initilize normalizer and sum value to 0 for every pixel location
-            float weightSum = 0.0f;
-            Color4 accum(0.0f, 0.0f, 0.0f, 0.0f);
+            const Color4 & c = pixel(x, y, mX, mY);
+            position(x, y, c, pos);
+            lattice.splat(pos, c);
+        }
+        ++progress;
+    }
+
+    lattice.blur(progress);
 
-            for (int yFilter = -radius; yFilter <= radius; yFilter++)
+    parallel_for(BlockedRange(0, height()), [&filtered,&lattice,&progress,&position,this](int y0, int y1)
+    {
+        progress.checkCanceled();
+        float pos[PermutohedralLattice::D];
+        for (int y = y0; y < y1; ++y)
+            for (int x = 0; x < width(); ++x)
             {
-                int yy = y+yFilter;
-                for (int xFilter = -radius; xFilter <= radius; xFilter++)
-                {
-                    int xx = x+xFilter;
-                    // calculate the squared distance between the 2 pixels (in range)
-                    float rangeExp = ::pow(pixel(xx,yy,mX,mY) - (*this)(x,y), 2).sum();
-                    float domainExp = std::pow(xFilter,2) + std::pow(yFilter,2);
-
-                    // calculate the exponentiated weighting factor from the domain and range
-                    float factorDomain = std::exp(-domainExp / (2.0 * std::pow(sigmaDomain,2)));
-                    float factorRange = std::exp(-rangeExp / (2.0 * std::pow(sigmaRange,2)));
-                    weightSum += factorDomain * factorRange;
-                    accum += factorDomain * factorRange * pixel(xx,yy,mX,mY);
-                }
+                position(x, y, (*this)(x,y), pos);
+                filtered(x,y) = lattice.slice(pos);
             }
-
-            // set pixel in filtered image to weighted sum of values in the filter region
-            filtered(x,y) = accum/weightSum;
-        }
-        ++progress;
+        progress += y1 - y0;
     });
-    spdlog::get("console")->trace("Bilateral filter took: {} seconds.", (timer.elapsed()/1000.f));
+    spdlog::get("console")->trace("Fast bilateral filter took: {} seconds.", (timer.elapsed()/1000.f));
 
     return filtered;
 }
@@ -371,9 +1666,25 @@ static int nextOddInt(int i)
   return (i % 2 == 0) ? i+1 : i;
 }
 
+// the half width of each of the box blurs of iteratedBoxBlurred
+static int iteratedBoxHalfWidth(float sigma, int iterations)
+{
+    // See comments in HDRImage::iteratedBoxBlurred for the derivation
+    int w = nextOddInt(std::round(std::sqrt(12.f/iterations) * sigma));
+    return (w-1)/2;
+}
+
+// the half width of the six box blurs that fastGaussianBlurred uses along an axis, which uses a Gaussian below 3
+static int fastGaussianHalfWidth(float sigma)
+{
+    // See comments in HDRImage::iteratedBoxBlurred for derivation of width
+    return std::round((std::sqrt(12.f/6) * sigma - 1)/2.f);
+}
+
 
 HDRImage HDRImage::iteratedBoxBlurred(float sigma, int iterations, AtomicProgress progress, BorderMode mX, BorderMode mY) const
 {
+    TRACE_ZONE("HDRImage::iteratedBoxBlurred");
     // Compute box blur size for desired sigma and number of iterations:
     // The kernel resulting from repeated box blurs of the same width is the
     // Irwin–Hall distribution
@@ -397,29 +1708,25 @@ HDRImage HDRImage::iteratedBoxBlurred(float sigma, int iterations, AtomicProgres
     //      w = sqrt(12/n)*sigma
     //
 
-    int w = nextOddInt(std::round(std::sqrt(12.f/iterations) * sigma));
-
     // Now, if width is odd, then we can use a centered box and are good to go.
     // If width is even, then we can't use centered boxes, but must instead
     // use a symmetric pairs of off-centered boxes. For now, just always round
     // up to next odd width
-    int hw = (w-1)/2;
-
-    HDRImage result = *this;
-    for (int i = 0; i < iterations; i++)
-        result = result.boxBlurred(hw, AtomicProgress(progress, 1.f/iterations), mX, mY);
+    int hw = iteratedBoxHalfWidth(sigma, iterations);
 
-    return result;
+    // the x and y blurs commute, so all x passes can be done in one sweep, followed by all y passes
+    return boxBlurredX(hw, hw, iterations, AtomicProgress(progress, 0.5f), mX)
+          .boxBlurredY(hw, hw, iterations, AtomicProgress(progress, 0.5f), mY);
 }
 
 HDRImage HDRImage::fastGaussianBlurred(float sigmaX, float sigmaY,
                                        AtomicProgress progress,
                                        BorderMode mX, BorderMode mY) const
 {
+    TRACE_ZONE("HDRImage::fastGaussianBlurred");
     Timer timer;
-    // See comments in HDRImage::iteratedBoxBlurred for derivation of width
-    int hw = std::round((std::sqrt(12.f/6) * sigmaX - 1)/2.f);
-    int hh = std::round((std::sqrt(12.f/6) * sigmaY - 1)/2.f);
+    int hw = fastGaussianHalfWidth(sigmaX);
+    int hh = fastGaussianHalfWidth(sigmaY);
 
     HDRImage im;
     // do horizontal blurs
@@ -428,12 +1735,7 @@ HDRImage HDRImage::fastGaussianBlurred(float sigmaX, float sigmaY,
         im = GaussianBlurredX(sigmaX, AtomicProgress(progress, 0.5f), mX);
     else
         // for large blurs, approximate Gaussian with 6 box blurs
-        im = boxBlurredX(hw, AtomicProgress(progress, .5f/6.f), mX)
-	        .boxBlurredX(hw, AtomicProgress(progress, .5f/6.f), mX)
-	        .boxBlurredX(hw, AtomicProgress(progress, .5f/6.f), mX)
-	        .boxBlurredX(hw, AtomicProgress(progress, .5f/6.f), mX)
-	        .boxBlurredX(hw, AtomicProgress(progress, .5f/6.f), mX)
-	        .boxBlurredX(hw, AtomicProgress(progress, .5f/6.f), mX);
+        im = boxBlurredX(hw, hw, 6, AtomicProgress(progress, 0.5f), mX);
 
     // now do vertical blurs
     if (hh < 3)
@@ -441,12 +1743,7 @@ HDRImage HDRImage::fastGaussianBlurred(float sigmaX, float sigmaY,
         im = im.GaussianBlurredY(sigmaY, AtomicProgress(progress, 0.5f), mY);
     else
         // for large blurs, approximate Gaussian with 6 box blurs
-        im = im.boxBlurredY(hh, AtomicProgress(progress, .5f/6.f), mY)
-               .boxBlurredY(hh, AtomicProgress(progress, .5f/6.f), mY)
-               .boxBlurredY(hh, AtomicProgress(progress, .5f/6.f), mY)
-               .boxBlurredY(hh, AtomicProgress(progress, .5f/6.f), mY)
-               .boxBlurredY(hh, AtomicProgress(progress, .5f/6.f), mY)
-               .boxBlurredY(hh, AtomicProgress(progress, .5f/6.f), mY);
+        im = im.boxBlurredY(hh, hh, 6, AtomicProgress(progress, 0.5f), mY);
 
     spdlog::get("console")->trace("fastGaussianBlurred filter took: {} seconds.", (timer.elapsed()/1000.f));
     return im;
@@ -455,57 +1752,74 @@ HDRImage HDRImage::fastGaussianBlurred(float sigmaX, float sigmaY,
 
 HDRImage HDRImage::boxBlurredX(int leftSize, int rightSize, AtomicProgress progress, BorderMode mX) const
 {
+    return boxBlurredX(leftSize, rightSize, 1, progress, mX);
+}
+
+HDRImage HDRImage::boxBlurredX(int leftSize, int rightSize, int passes, AtomicProgress progress, BorderMode mX) const
+{
+    TRACE_ZONE("HDRImage::boxBlurredX");
+    if (passes < 1)
+        return *this;
+
     HDRImage filtered(width(), height());
 
     Timer timer;
-	progress.setNumSteps(filtered.height());
-    // for every pixel in the image
-    parallel_for(0, filtered.height(), [this,&filtered,&progress,leftSize,rightSize,mX](int y)
-    {
-        // fill up the accumulator
-        filtered(0, y) = 0;
-        for (int dx = -leftSize; dx <= rightSize; ++dx)
-            filtered(0, y) += pixel(dx, y, mX, mX);
-
-        for (int x = 1; x < width(); ++x)
-            filtered(x, y) = filtered(x-1, y) -
-                             pixel(x-1-leftSize, y, mX, mX) +
-                             pixel(x+rightSize, y, mX, mX);
-	    ++progress;
+    progress.setNumSteps(filtered.height());
+    // for every row in the image, run all the passes while the row is in cache
+    parallel_for(BlockedRange(0, filtered.height()), [this,&filtered,&progress,leftSize,rightSize,passes,mX](int y0, int y1)
+    {
+        progress.checkCanceled();
+        vector<Color4> scratch;
+        Array4f sum;
+        for (int y = y0; y < y1; ++y)
+        {
+            boxBlurLines(&(*this)(0, y), 1, 0, &filtered(0, y), 1, 0, 1, width(),
+                         leftSize, rightSize, mX, passes, &sum, scratch);
+        }
+        progress += y1 - y0;
     });
     spdlog::get("console")->trace("boxBlurredX filter took: {} seconds.", (timer.elapsed()/1000.f));
 
-    return filtered * Color4(1.f/(leftSize + rightSize + 1));
+    return filtered;
 }
 
 
 HDRImage HDRImage::boxBlurredY(int leftSize, int rightSize, AtomicProgress progress, BorderMode mY) const
 {
+    return boxBlurredY(leftSize, rightSize, 1, progress, mY);
+}
+
+HDRImage HDRImage::boxBlurredY(int leftSize, int rightSize, int passes, AtomicProgress progress, BorderMode mY) const
+{
+    TRACE_ZONE("HDRImage::boxBlurredY");
+    if (passes < 1)
+        return *this;
+
     HDRImage filtered(width(), height());
 
     Timer timer;
-	progress.setNumSteps(filtered.width());
-    // for every pixel in the image
-    parallel_for(0, filtered.width(), [this,&filtered,&progress,leftSize,rightSize,mY](int x)
-    {
-        // fill up the accumulator
-        filtered(x, 0) = 0;
-        for (int dy = -leftSize; dy <= rightSize; ++dy)
-            filtered(x, 0) += pixel(x, dy, mY, mY);
-
-        for (int y = 1; y < height(); ++y)
-            filtered(x, y) = filtered(x, y-1) -
-                             pixel(x, y-1-leftSize, mY, mY) +
-                             pixel(x, y+rightSize, mY, mY);
-	    ++progress;
+    progress.setNumSteps(filtered.width());
+    // process a strip of neighboring columns at a time, sweeping down all of them together
+    // so that each scanline of the strip is read contiguously. All the passes are run on
+    // one strip before moving on to the next
+    const int stripWidth = 64;
+    parallel_for(BlockedRange(0, filtered.width(), stripWidth), [this,&filtered,&progress,leftSize,rightSize,passes,mY](int x0, int x1)
+    {
+        progress.checkCanceled();
+        vector<Color4> scratch;
+        Array4f sums[stripWidth];
+        boxBlurLines(&(*this)(x0, 0), width(), 1, &filtered(x0, 0), width(), 1, x1 - x0, height(),
+                     leftSize, rightSize, mY, passes, sums, scratch);
+        progress += x1 - x0;
     });
-    spdlog::get("console")->trace("boxBlurredX filter took: {} seconds.", (timer.elapsed()/1000.f));
+    spdlog::get("console")->trace("boxBlurredY filter took: {} seconds.", (timer.elapsed()/1000.f));
 
-    return filtered * Color4(1.f/(leftSize + rightSize + 1));
+    return filtered;
 }
 
 HDRImage HDRImage::resizedCanvas(int newW, int newH, CanvasAnchor anchor, const Color4 & bgColor) const
 {
+    TRACE_ZONE("HDRImage::resizedCanvas");
     int oldW = width();
     int oldH = height();
 
@@ -580,18 +1894,52 @@ HDRImage HDRImage::resizedCanvas(int newW, int newH, CanvasAnchor anchor, const
 
 HDRImage HDRImage::resized(int w, int h) const
 {
+    TRACE_ZONE("HDRImage::resized");
+    if (isSingleChannel())
+    {
+        // stb needs contiguous, top-down scanlines
+        Intensity src = intensity();
+        Intensity values(w, h);
+        if (!stbir_resize_float(src.data(), width(), height(), 0, values.data(), w, h, 0, 1))
+            throw runtime_error("Failed to resize image.");
+        HDRImage newImage;
+        newImage.setSingleChannel(std::move(values));
+        return newImage;
+    }
+
     HDRImage newImage(w, h);
 
     if (!stbir_resize_float((const float *)data(), width(), height(), 0,
                             (float *) newImage.data(), w, h, 0, 4))
         throw runtime_error("Failed to resize image.");
-    if (intensity().size() && !stbir_resize_float((const float *)intensity().data(), width(),
-                            height(), 0, (float *) newImage.intensity().data(), w, h, 0, 1))
-        throw runtime_error("Failed to resize image.");
 
     return newImage;
 }
 
+HDRImage HDRImage::resized(int w, int h, ResizeFilter filter, AtomicProgress progress,
+                           BorderMode mX, BorderMode mY, bool usePyramid) const
+{
+    TRACE_ZONE("HDRImage::resized");
+    Timer timer;
+    HDRImage newImage;
+    if (isSingleChannel())
+    {
+        IntensityMap src = intensity();
+        Intensity values(w, h);
+        resampler::polyphaseResize(src.data(), src.outerStride(), width(), height(), values.data(), w, h,
+                                   filter, mX, mY, usePyramid, progress);
+        newImage.setSingleChannel(std::move(values));
+    }
+    else
+    {
+        newImage.resize(w, h);
+        resampler::polyphaseResize(data(), outerStride(), width(), height(), newImage.data(), w, h,
+                                   filter, mX, mY, usePyramid, progress);
+    }
+    spdlog::get("console")->trace("Resizing with the {} filter took: {} seconds.", resizeFilterNames()[filter], (timer.elapsed()/1000.f));
+    return newImage;
+}
+
 /*!
  * \brief Multiplies a raw image by the Bayer mosaic pattern so that only a single
  * R, G, or B channel is non-zero for each pixel.
@@ -613,6 +1961,7 @@ HDRImage HDRImage::resized(int w, int h) const
  */
 void HDRImage::bayerMosaic(const Vector2i &redOffset)
 {
+    TRACE_ZONE("HDRImage::bayerMosaic");
     Color4 mosaic[2][2] = {{Color4(1.f, 0.f, 0.f, 1.f), Color4(0.f, 1.f, 0.f, 1.f)},
                            {Color4(0.f, 1.f, 0.f, 1.f), Color4(0.f, 0.f, 1.f, 1.f)}};
     for (int y = 0; y < height(); ++y)
@@ -635,6 +1984,7 @@ void HDRImage::bayerMosaic(const Vector2i &redOffset)
  */
 void HDRImage::demosaicGreenLinear(const Vector2i &redOffset)
 {
+    TRACE_ZONE("HDRImage::demosaicGreenLinear");
     bilinearGreen(*this, redOffset.x(), redOffset.y());
 }
 
@@ -646,6 +1996,7 @@ void HDRImage::demosaicGreenLinear(const Vector2i &redOffset)
  */
 void HDRImage::demosaicGreenHorizontal(const HDRImage &raw, const Vector2i &redOffset)
 {
+    TRACE_ZONE("HDRImage::demosaicGreenHorizontal");
     parallel_for(redOffset.y(), height(), 2, [this,&raw,&redOffset](int y)
     {
         for (int x = 2+redOffset.x(); x < width()-2; x += 2)
@@ -665,6 +2016,7 @@ void HDRImage::demosaicGreenHorizontal(const HDRImage &raw, const Vector2i &redO
  */
 void HDRImage::demosaicGreenVertical(const HDRImage &raw, const Vector2i &redOffset)
 {
+    TRACE_ZONE("HDRImage::demosaicGreenVertical");
     parallel_for(2+redOffset.y(), height()-2, 2, [this,&raw,&redOffset](int y)
     {
         for (int x = redOffset.x(); x < width(); x += 2)
@@ -686,6 +2038,7 @@ void HDRImage::demosaicGreenVertical(const HDRImage &raw, const Vector2i &redOff
  */
 void HDRImage::demosaicGreenMalvar(const Vector2i &redOffset)
 {
+    TRACE_ZONE("HDRImage::demosaicGreenMalvar");
     // fill in missing green at red pixels
     MalvarGreen(*this, 0, redOffset);
     // fill in missing green at blue pixels
@@ -699,6 +2052,7 @@ void HDRImage::demosaicGreenMalvar(const Vector2i &redOffset)
  */
 void HDRImage::demosaicGreenPhelippeau(const Vector2i &redOffset)
 {
+    TRACE_ZONE("HDRImage::demosaicGreenPhelippeau");
     PhelippeauGreen(*this, redOffset);
 }
 
@@ -709,6 +2063,7 @@ void HDRImage::demosaicGreenPhelippeau(const Vector2i &redOffset)
  */
 void HDRImage::demosaicRedBlueLinear(const Vector2i &redOffset)
 {
+    TRACE_ZONE("HDRImage::demosaicRedBlueLinear");
     bilinearRedBlue(*this, 0, redOffset);
     bilinearRedBlue(*this, 2, Vector2i((redOffset.x() + 1) % 2, (redOffset.y() + 1) % 2));
 }
@@ -726,6 +2081,7 @@ void HDRImage::demosaicRedBlueLinear(const Vector2i &redOffset)
  */
 void HDRImage::demosaicRedBlueGreenGuidedLinear(const Vector2i &redOffset)
 {
+    TRACE_ZONE("HDRImage::demosaicRedBlueGreenGuidedLinear");
     greenBasedRorB(*this, 0, redOffset);
     greenBasedRorB(*this, 2, Vector2i((redOffset.x() + 1) % 2, (redOffset.y() + 1) % 2));
 }
@@ -742,6 +2098,7 @@ void HDRImage::demosaicRedBlueGreenGuidedLinear(const Vector2i &redOffset)
  */
 void HDRImage::demosaicRedBlueMalvar(const Vector2i &redOffset)
 {
+    TRACE_ZONE("HDRImage::demosaicRedBlueMalvar");
     // fill in missing red horizontally
     MalvarRedOrBlueAtGreen(*this, 0, Vector2i((redOffset.x() + 1) % 2, redOffset.y()), true);
     // fill in missing red vertically
@@ -764,10 +2121,10 @@ void HDRImage::demosaicRedBlueMalvar(const Vector2i &redOffset)
  */
 HDRImage HDRImage::medianFilterBayerArtifacts() const
 {
+    TRACE_ZONE("HDRImage::medianFilterBayerArtifacts");
     AtomicProgress progress;
     HDRImage colorDiff = unaryExpr([](const Color4 & c){return Color4(c.r-c.g,c.g,c.b-c.g,c.a);});
-    colorDiff = colorDiff.medianFiltered(1.f, 0, AtomicProgress(progress, .5f))
-                         .medianFiltered(1.f, 2, AtomicProgress(progress, .5f));
+    colorDiff = medianFilterChannels(colorDiff, {0, 2}, 1.f, progress, EDGE, EDGE, false);
     return binaryExpr(colorDiff, [](const Color4 & i, const Color4 & med){return Color4(med.r + i.g, i.g, med.b + i.g, i.a);}).eval();
 }
 
@@ -796,121 +2153,45 @@ HDRImage HDRImage::medianFilterBayerArtifacts() const
  * @param redOffset     The x,y offset to the first red pixel in the Bayer pattern.
  * @param cameraToXYZ   The matrix that transforms from sensor values to XYZ with
  *                      D65 white point.
+ * @param progress      Checked between (and within) the passes to allow canceling.
  */
-void HDRImage::demosaicAHD(const Vector2i &redOffset, const Matrix3f &cameraToXYZ)
+void HDRImage::demosaicAHD(const Vector2i &redOffset, const Matrix3f &cameraToXYZ, AtomicProgress progress)
 {
-    using Image3f = Array<Vector3f,Dynamic,Dynamic>;
-    using HomoMap = Array<uint8_t,Dynamic,Dynamic>;
-    HDRImage rgbH = *this;
-    HDRImage rgbV = *this;
-    Image3f labH(width(), height());
-    Image3f labV(width(), height());
-    HomoMap homoH = HomoMap::Zero(width(), height());
-    HomoMap homoV = HomoMap::Zero(width(), height());
-
-    // interpolate green channel both horizontally and vertically
-    rgbH.demosaicGreenHorizontal(*this, redOffset);
-    rgbV.demosaicGreenVertical(*this, redOffset);
-
-    // interpolate the red and blue using the green as a guide
-    rgbH.demosaicRedBlueGreenGuidedLinear(redOffset);
-    rgbV.demosaicRedBlueGreenGuidedLinear(redOffset);
-
+    TRACE_ZONE("HDRImage::demosaicAHD");
     // Scale factor to push XYZ values to [0,1] range
     float scale = 1.0 / (maxCoeff().max() * cameraToXYZ.maxCoeff());
 
     // Precompute a table for the nonlinear part of the CIELab conversion
-    vector<float> labLUT;
-    labLUT.reserve(0xFFFF);
-    parallel_for(0, labLUT.size(), [&labLUT](int i)
+    vector<float> labLUT(0x10000);
+    parallel_for(0, int(labLUT.size()), [&labLUT](int i)
     {
         float r = i * 1.0f / (labLUT.size()-1);
         labLUT[i] = r > 0.008856 ? std::pow(r, 1.0f / 3.0f) : 7.787f*r + 4.0f/29.0f;
     });
 
-    // convert both interpolated images to CIE L*a*b* so we can compute perceptual differences
-    parallel_for(0, height(), [&rgbH,&labH,&cameraToXYZ,&labLUT,scale](int y)
-    {
-        for (int x = 0; x < rgbH.width(); ++x)
-            labH(x,y) = cameraToLab(Vector3f(rgbH(x,y)[0], rgbH(x,y)[1], rgbH(x,y)[2])*scale, cameraToXYZ, labLUT);
-    });
-    parallel_for(0, height(), [&rgbV,&labV,&cameraToXYZ,&labLUT,scale](int y)
-    {
-        for (int x = 0; x < rgbV.width(); ++x)
-            labV(x,y) = cameraToLab(Vector3f(rgbV(x,y)[0], rgbV(x,y)[1], rgbV(x,y)[2])*scale, cameraToXYZ, labLUT);
-    });
-
-    // Build homogeneity maps from the CIELab images which count, for each pixel,
-    // the number of visually similar neighboring pixels
-    static const int neighbor[4][2] = { {-1, 0}, {1, 0}, {0, -1}, {0, 1} };
-    parallel_for(1, height()-1, [&homoH,&homoV,&labH,&labV](int y)
+    // Each tile is demosaiced from its raw pixels plus an apron that holds everything the tile depends on,
+    // so the tiles are independent and only a few tile-sized buffers are alive per thread. The tiles start at
+    // even pixels, so they keep the Bayer pattern of the image
+    HDRImage result(width(), height());
+    int tilesX = (width() + AHDTileSize - 1) / AHDTileSize, tilesY = (height() + AHDTileSize - 1) / AHDTileSize;
+    progress.setNumSteps(tilesX * tilesY);
+    parallel_for(0, tilesX * tilesY, [&](int t)
     {
-        for (int x = 1; x < labH.rows()-1; ++x)
-        {
-            float ldiffH[4], ldiffV[4], abdiffH[4], abdiffV[4];
-
-            for (int i = 0; i < 4; i++)
-            {
-                int dx = neighbor[i][0];
-                int dy = neighbor[i][1];
-
-                // Local luminance and chromaticity differences to the 4 neighbors for both interpolations directions
-                ldiffH[i] = std::abs(labH(x,y)[0] - labH(x+dx,y+dy)[0]);
-                ldiffV[i] = std::abs(labV(x,y)[0] - labV(x+dx,y+dy)[0]);
-                abdiffH[i] = ::square(labH(x,y)[1] - labH(x+dx,y+dy)[1]) +
-                             ::square(labH(x,y)[2] - labH(x+dx,y+dy)[2]);
-                abdiffV[i] = ::square(labV(x,y)[1] - labV(x+dx,y+dy)[1]) +
-                             ::square(labV(x,y)[2] - labV(x+dx,y+dy)[2]);
-            }
-
-            float leps = std::min(std::max(ldiffH[0], ldiffH[1]),
-                                  std::max(ldiffV[2], ldiffV[3]));
-            float abeps = std::min(std::max(abdiffH[0], abdiffH[1]),
-                                   std::max(abdiffV[2], abdiffV[3]));
-
-            // Count number of neighboring pixels that are visually similar
-            for (int i = 0; i < 4; i++)
-            {
-                if (ldiffH[i] <= leps && abdiffH[i] <= abeps)
-                    homoH(x,y)++;
-                if (ldiffV[i] <= leps && abdiffV[i] <= abeps)
-                    homoV(x,y)++;
-            }
-        }
+        progress.checkCanceled();
+        Vector2i origin(t % tilesX * AHDTileSize, t / tilesX * AHDTileSize);
+        Vector2i size = Vector2i(AHDTileSize, AHDTileSize).cwiseMin(Vector2i(width(), height()) - origin);
+        Vector2i lo = (origin.array() - AHDApron).max(0).matrix();
+        Vector2i hi = (origin + size).array().min(Array2i(width(), height())).matrix();
+        hi = (hi.array() + AHDApron).min(Array2i(width(), height())).matrix();
+
+        HDRImage tile = block(lo.x(), lo.y(), hi.x() - lo.x(), hi.y() - lo.y());
+        demosaicAHDTile(tile, redOffset, cameraToXYZ, scale, labLUT);
+        result.block(origin.x(), origin.y(), size.x(), size.y()) =
+            tile.block(origin.x() - lo.x(), origin.y() - lo.y(), size.x(), size.y());
+        ++progress;
     });
 
-    // Combine the most homogenous pixels for the final result
-    parallel_for(1, height()-1, [this,&homoH,&homoV,&rgbH,&rgbV](int y)
-    {
-        for (int x = 1; x < this->width()-1; ++x)
-        {
-            // Sum up the homogeneity of both images in a 3x3 window
-            int hmH = 0, hmV = 0;
-            for (int j = y-1; j <= y+1; j++)
-                for (int i = x-1; i <= x+1; i++)
-                {
-                    hmH += homoH(i, j);
-                    hmV += homoV(i, j);
-                }
-
-            if (hmH > hmV)
-            {
-                // horizontal interpolation is more homogeneous
-                (*this)(x,y) = rgbH(x,y);
-            }
-            else if (hmV > hmH)
-            {
-                // vertical interpolation is more homogeneous
-                (*this)(x,y) = rgbV(x,y);
-            }
-            else
-            {
-                // No clear winner, blend
-                Color4 blend = (rgbH(x,y) + rgbV(x,y)) * 0.5f;
-                (*this)(x,y) = blend;
-            }
-        }
-    });
+    *this = std::move(result);
 
     // Now handle the boundary pixels
     demosaicBorder(3);
@@ -927,6 +2208,7 @@ void HDRImage::demosaicAHD(const Vector2i &redOffset, const Matrix3f &cameraToXY
  */
 void HDRImage::demosaicBorder(size_t border)
 {
+    TRACE_ZONE("HDRImage::demosaicBorder");
     parallel_for(0, height(), [&](size_t y)
     {
         for (size_t x = 0; x < (size_t)width(); ++x)
@@ -984,6 +2266,7 @@ void HDRImage::demosaicBorder(size_t border)
  */
 HDRImage HDRImage::brightnessContrast(float b, float c, bool linear, EChannel channel) const
 {
+    TRACE_ZONE("HDRImage::brightnessContrast");
     float slope = float(std::tan(lerp(0.0, M_PI_2, c/2.0 + 0.5)));
     // Perlin's version
     //float slope = c >= 0 ? -log2(1.f - c) + 1.f : 1.f / (-log2(1.f + c) + 1.f);
@@ -992,14 +2275,10 @@ HDRImage HDRImage::brightnessContrast(float b, float c, bool linear, EChannel ch
     {
         float midpoint = (1.f-b)/2.f;
 
+        // brightnessContrastL is affine, so the RGB case can use the vectorized kernel
         if (channel == RGB)
-            return unaryExpr(
-                [slope,midpoint](const Color4 &c)
-                {
-                    return Color4(brightnessContrastL(c.r, slope, midpoint),
-                                  brightnessContrastL(c.g, slope, midpoint),
-                                  brightnessContrastL(c.b, slope, midpoint), c.a);
-                });
+            return scaledOffset(Color4(slope, slope, slope, 1.f),
+                                Color4(Color3(0.5f - midpoint * slope), 0.f));
         else if (channel == LUMINANCE || channel == CIE_L)
             return unaryExpr(
                 [slope,midpoint](const Color4 &c)
@@ -1059,7 +2338,106 @@ HDRImage HDRImage::brightnessContrast(float b, float c, bool linear, EChannel ch
 
 HDRImage HDRImage::inverted() const
 {
-	return unaryExpr([](const Color4 &c) { return Color4(1.f - c.r, 1.f - c.g, 1.f - c.b, c.a); });
+    TRACE_ZONE("HDRImage::inverted");
+    return scaledOffset(Color4(-1.f, -1.f, -1.f, 1.f), Color4(1.f, 1.f, 1.f, 0.f));
+}
+
+HDRImage HDRImage::scaledOffset(const Color4 & scale, const Color4 & offset) const
+{
+    TRACE_ZONE("HDRImage::scaledOffset");
+    HDRImage result(width(), height());
+    parallel_for(BlockedRange(0, int(size()), 1 << 16), [this,&result,&scale,&offset](int begin, int end)
+    {
+        scaleOffsetPixels(result.data() + begin, data() + begin, size_t(end - begin), scale, offset);
+    });
+    return result;
+}
+
+HDRImage HDRImage::curveMapped(const CurveLUT & curve) const
+{
+    TRACE_ZONE("HDRImage::curveMapped");
+    HDRImage result(width(), height());
+    parallel_for(BlockedRange(0, int(size()), 1 << 16), [this,&result,&curve](int begin, int end)
+    {
+        for (int i = begin; i < end; ++i)
+            result.data()[i] = curve.lookup(data()[i]);
+    });
+    return result;
+}
+
+HDRImage HDRImage::cropped(const Roi & roi, BorderMode mX, BorderMode mY) const
+{
+    TRACE_ZONE("HDRImage::cropped");
+    HDRImage result(std::max(roi.width, 0), std::max(roi.height, 0));
+    if (isNull())
+        return result;
+
+    parallel_for(BlockedRange(0, result.height()), [this,&result,&roi,mX,mY](int y0, int y1)
+    {
+        for (int y = y0; y < y1; ++y)
+            for (int x = 0; x < result.width(); ++x)
+                result(x, y) = pixel(roi.x + x, roi.y + y, mX, mY);
+    });
+    return result;
+}
+
+void HDRImage::filterRegion(HDRImage & dst, const Roi & roi, const Vector2i & apron, const RegionFilter & filter,
+                            BorderMode mX, BorderMode mY) const
+{
+    if (dst.width() != width() || dst.height() != height())
+        throw invalid_argument("The destination of a region does not have the size of the image");
+
+    Roi r = roi.intersected(bounds());
+    if (r.isEmpty())
+        return;
+    // dst may be this image, so read the region before writing it
+    HDRImage region = regionFiltered(r, apron, filter, mX, mY);
+    dst.block(r.x, r.y, r.width, r.height) = region;
+}
+
+HDRImage HDRImage::regionFiltered(const Roi & roi, const Vector2i & apron, const RegionFilter & filter,
+                                  BorderMode mX, BorderMode mY) const
+{
+    TRACE_ZONE("HDRImage::regionFiltered");
+    Roi r = roi.intersected(bounds());
+    if (r.isEmpty())
+        return HDRImage();
+
+    // don't fill in the apron past the edges of the image: a filter with several passes would apply the
+    // border modes to those pixels again, so leave the real edges for the filter itself to handle
+    Roi g = r.grown(apron.x(), apron.y()).intersected(bounds());
+    // wrapping (and mirroring, see wrapCoord) around an edge can read the opposite side, so then the filter
+    // needs all of that axis
+    if ((mX == REPEAT || mX == MIRROR) && g.width < r.width + 2 * apron.x())
+    {
+        g.x = 0;
+        g.width = width();
+    }
+    if ((mY == REPEAT || mY == MIRROR) && g.height < r.height + 2 * apron.y())
+    {
+        g.y = 0;
+        g.height = height();
+    }
+
+    HDRImage filtered = filter(cropped(g));
+    if (filtered.width() != g.width || filtered.height() != g.height)
+        throw invalid_argument("A region filter cannot change the size of the image");
+    return filtered.block(r.x - g.x, r.y - g.y, r.width, r.height);
+}
+
+Vector2i HDRImage::iteratedBoxApron(float sigma, int iterations)
+{
+    return Vector2i::Constant(iterations * iteratedBoxHalfWidth(sigma, iterations));
+}
+
+Vector2i HDRImage::fastGaussianApron(float sigmaX, float sigmaY)
+{
+    auto apron = [](float sigma)
+    {
+        int hw = fastGaussianHalfWidth(sigma);
+        return hw < 3 ? GaussianApron(sigma, sigma).x() : 6 * hw;
+    };
+    return Vector2i(apron(sigmaX), apron(sigmaY));
 }
 
 
@@ -1160,12 +2538,12 @@ inline float interpGreenV(const HDRImage &raw, int x, int y)
     return clamp2(v, raw(x, y - 1).g, raw(x, y + 1).g);
 }
 
-inline float ghG(const ArrayXXf & G, int i, int j)
+inline float ghG(const Map<ArrayXXf> & G, int i, int j)
 {
     return fabs(G(i-1,j) - G(i,j)) + fabs(G(i+1,j) - G(i,j));
 }
 
-inline float gvG(const ArrayXXf & G, int i, int j)
+inline float gvG(const Map<ArrayXXf> & G, int i, int j)
 {
     return fabs(G(i,j-1) - G(i,j)) + fabs(G(i,j+1) - G(i,j));
 }
@@ -1195,8 +2573,10 @@ void bilinearGreen(HDRImage &raw, int offsetX, int offsetY)
 
 void PhelippeauGreen(HDRImage &raw, const Vector2i & redOffset)
 {
-    ArrayXXf Gh(raw.width(), raw.height());
-    ArrayXXf Gv(raw.width(), raw.height());
+    // the two interpolations are image-sized scratch buffers, so take them from the pool
+    PooledArray<float> GhData(size_t(raw.width()) * raw.height()), GvData(size_t(raw.width()) * raw.height());
+    Map<ArrayXXf> Gh(GhData.data(), raw.width(), raw.height());
+    Map<ArrayXXf> Gv(GvData.data(), raw.width(), raw.height());
 
     // populate horizontally interpolated green
     parallel_for(redOffset.y(), raw.height(), 2, [&raw,&Gh,&redOffset](int y)
@@ -1325,7 +2705,7 @@ void bilinearRedBlue(HDRImage &raw, int c, const Vector2i & redOffset)
 
 // takes as input a raw image and returns a single-channel
 // 2D image corresponding to the red or blue channel using green based interpolation
-void greenBasedRorB(HDRImage &raw, int c, const Vector2i &redOffset)
+void greenBasedRorB(HDRImage &raw, int c, const Vector2i &redOffset, bool serial)
 {
     // horizontal interpolation
     parallel_for(redOffset.y(), raw.height(), 2, [&raw,c,&redOffset](int y)
@@ -1333,7 +2713,7 @@ void greenBasedRorB(HDRImage &raw, int c, const Vector2i &redOffset)
         for (int x = redOffset.x() + 1; x < raw.width() - 1; x += 2)
             raw(x, y)[c] = std::max(0.f, 0.5f * (raw(x - 1, y)[c] + raw(x + 1, y)[c] -
                                                  raw(x - 1, y)[1] - raw(x + 1, y)[1]) + raw(x, y)[1]);
-    });
+    }, serial);
 
     // vertical interpolation
     parallel_for(redOffset.y() + 1, raw.height() - 1, 2, [&raw,c,&redOffset](int y)
@@ -1341,7 +2721,7 @@ void greenBasedRorB(HDRImage &raw, int c, const Vector2i &redOffset)
         for (int x = redOffset.x(); x < raw.width(); x += 2)
             raw(x, y)[c] = std::max(0.f, 0.5f * (raw(x, y - 1)[c] + raw(x, y + 1)[c] -
                                                  raw(x, y - 1)[1] - raw(x, y + 1)[1]) + raw(x, y)[1]);
-    });
+    }, serial);
 
     // diagonal interpolation
     parallel_for(redOffset.y() + 1, raw.height() - 1, 2, [&raw,c,&redOffset](int y)
@@ -1351,7 +2731,121 @@ void greenBasedRorB(HDRImage &raw, int c, const Vector2i &redOffset)
                                                   raw(x - 1, y + 1)[c] + raw(x + 1, y + 1)[c] -
                                                   raw(x - 1, y - 1)[1] - raw(x + 1, y - 1)[1] -
                                                   raw(x - 1, y + 1)[1] - raw(x + 1, y + 1)[1]) + raw(x, y)[1]);
-    });
+    }, serial);
+}
+
+/*!
+ * AHD demosaicing of one tile, in place and serially (the tiles are processed in parallel).
+ *
+ * The steps, and where they stop short of the border of the tile, are exactly those of the whole-image
+ * algorithm, so every pixel that is at least AHDApron pixels from a border of the tile that is not also a border
+ * of the image gets the same value as it would have if the whole image were processed at once.
+ */
+void demosaicAHDTile(HDRImage &tile, const Vector2i &redOffset, const Matrix3f &cameraToXYZ, float scale,
+                     const vector<float> &labLUT)
+{
+    using Image3f = Array<Vector3f,Dynamic,Dynamic>;
+    using HomoMap = Array<uint8_t,Dynamic,Dynamic>;
+    int w = tile.width(), h = tile.height();
+    HDRImage rgbH = tile;
+    HDRImage rgbV = tile;
+
+    // interpolate green channel both horizontally and vertically
+    for (int y = redOffset.y(); y < h; y += 2)
+        for (int x = 2+redOffset.x(); x < w-2; x += 2)
+        {
+            rgbH(x, y).g = interpGreenH(tile, x, y);
+            // the original loop bounds let the second pixel run past the tile, it is in the border anyway
+            if (x+1 < w-2 && y+1 < h)
+                rgbH(x+1, y+1).g = interpGreenH(tile, x + 1, y + 1);
+        }
+    for (int y = 2+redOffset.y(); y < h-2; y += 2)
+        for (int x = redOffset.x(); x < w; x += 2)
+        {
+            rgbV(x, y).g = interpGreenV(tile, x, y);
+            if (x+1 < w && y+1 < h-2)
+                rgbV(x+1, y+1).g = interpGreenV(tile, x + 1, y + 1);
+        }
+
+    // interpolate the red and blue using the green as a guide
+    Vector2i blueOffset((redOffset.x() + 1) % 2, (redOffset.y() + 1) % 2);
+    for (HDRImage * rgb : {&rgbH, &rgbV})
+    {
+        greenBasedRorB(*rgb, 0, redOffset, true);
+        greenBasedRorB(*rgb, 2, blueOffset, true);
+    }
+
+    // convert both interpolated images to CIE L*a*b* so we can compute perceptual differences
+    Image3f labH(w, h), labV(w, h);
+    for (int y = 0; y < h; ++y)
+        for (int x = 0; x < w; ++x)
+        {
+            labH(x,y) = cameraToLab(Vector3f(rgbH(x,y)[0], rgbH(x,y)[1], rgbH(x,y)[2])*scale, cameraToXYZ, labLUT);
+            labV(x,y) = cameraToLab(Vector3f(rgbV(x,y)[0], rgbV(x,y)[1], rgbV(x,y)[2])*scale, cameraToXYZ, labLUT);
+        }
+
+    // Build homogeneity maps from the CIELab images which count, for each pixel,
+    // the number of visually similar neighboring pixels
+    static const int neighbor[4][2] = { {-1, 0}, {1, 0}, {0, -1}, {0, 1} };
+    HomoMap homoH = HomoMap::Zero(w, h);
+    HomoMap homoV = HomoMap::Zero(w, h);
+    for (int y = 1; y < h-1; ++y)
+        for (int x = 1; x < w-1; ++x)
+        {
+            float ldiffH[4], ldiffV[4], abdiffH[4], abdiffV[4];
+
+            for (int i = 0; i < 4; i++)
+            {
+                int dx = neighbor[i][0];
+                int dy = neighbor[i][1];
+
+                // Local luminance and chromaticity differences to the 4 neighbors for both interpolations directions
+                ldiffH[i] = std::abs(labH(x,y)[0] - labH(x+dx,y+dy)[0]);
+                ldiffV[i] = std::abs(labV(x,y)[0] - labV(x+dx,y+dy)[0]);
+                abdiffH[i] = ::square(labH(x,y)[1] - labH(x+dx,y+dy)[1]) +
+                             ::square(labH(x,y)[2] - labH(x+dx,y+dy)[2]);
+                abdiffV[i] = ::square(labV(x,y)[1] - labV(x+dx,y+dy)[1]) +
+                             ::square(labV(x,y)[2] - labV(x+dx,y+dy)[2]);
+            }
+
+            float leps = std::min(std::max(ldiffH[0], ldiffH[1]),
+                                  std::max(ldiffV[2], ldiffV[3]));
+            float abeps = std::min(std::max(abdiffH[0], abdiffH[1]),
+                                   std::max(abdiffV[2], abdiffV[3]));
+
+            // Count number of neighboring pixels that are visually similar
+            for (int i = 0; i < 4; i++)
+            {
+                if (ldiffH[i] <= leps && abdiffH[i] <= abeps)
+                    homoH(x,y)++;
+                if (ldiffV[i] <= leps && abdiffV[i] <= abeps)
+                    homoV(x,y)++;
+            }
+        }
+
+    // Combine the most homogenous pixels for the final result
+    for (int y = 1; y < h-1; ++y)
+        for (int x = 1; x < w-1; ++x)
+        {
+            // Sum up the homogeneity of both images in a 3x3 window
+            int hmH = 0, hmV = 0;
+            for (int j = y-1; j <= y+1; j++)
+                for (int i = x-1; i <= x+1; i++)
+                {
+                    hmH += homoH(i, j);
+                    hmV += homoV(i, j);
+                }
+
+            if (hmH > hmV)
+                // horizontal interpolation is more homogeneous
+                tile(x,y) = rgbH(x,y);
+            else if (hmV > hmH)
+                // vertical interpolation is more homogeneous
+                tile(x,y) = rgbV(x,y);
+            else
+                // No clear winner, blend
+                tile(x,y) = (rgbH(x,y) + rgbV(x,y)) * 0.5f;
+        }
 }
 
 } // namespace
\ No newline at end of file
@@ -7,11 +7,14 @@
 #pragma once
 
 #include <Eigen/Core>            // for Array, CwiseUnaryOp, Dynamic, DenseC...
+#include <algorithm>             // for min, max
 #include <functional>            // for function
+#include <memory>                // for shared_ptr
 #include <vector>                // for vector
 #include <string>                // for string
 #include "Color.h"               // for Color4, max, min
 #include "Progress.h"
+#include "Fwd.h"                 // for WarpField
 
 
 //! Floating point image
@@ -20,6 +23,9 @@ class HDRImage : public Eigen::Array<Color4,Eigen::Dynamic,Eigen::Dynamic>
 using Base = Eigen::Array<Color4,Eigen::Dynamic,Eigen::Dynamic>;
 public:
     using Intensity = Eigen::Array<float,Eigen::Dynamic,Eigen::Dynamic>;
+    /// Read-only view of the raw values of a single-channel image, whose scanlines may be stored anywhere,
+    /// e.g. padded in a memory-mapped file
+    using IntensityMap = Eigen::Map<const Intensity, Eigen::Unaligned, Eigen::OuterStride<>>;
 
 public:
     //-----------------------------------------------------------------------
@@ -38,16 +44,80 @@ public:
     HDRImage& operator=(const Eigen::ArrayBase <OtherDerived>& other)
     {
         this->Base::operator=(other);
+        releaseIntensity();
         return *this;
     }
     //@}
 
-    int width() const       { return (int)rows(); }
-    int height() const      { return (int)cols(); }
-    bool isNull() const     { return rows() == 0 || cols() == 0; }
+    int width() const       { return isSingleChannel() ? m_intensityWidth : (int)rows(); }
+    int height() const      { return isSingleChannel() ? m_intensityHeight : (int)cols(); }
+    bool isNull() const     { return width() == 0 || height() == 0; }
 
-    const Intensity & intensity() const  { return m_intensity; }
-    Intensity & intensity()              { return m_intensity; }
+    //-----------------------------------------------------------------------
+    //@{ \name Single-channel images.
+    //
+    // Single-channel images (e.g. depth maps) only store their raw values
+    // in intensity() and leave the Color4 pixels empty, which takes a fifth
+    // of the memory. Their colors, a false-color mapping of the raw values,
+    // are computed where they are needed: by the shader for display, and by
+    // color() or expanded() otherwise. All other image operations expect
+    // four-channel images, so call expanded() first.
+    //
+    // The raw values are never modified in place, so copies of an image
+    // share them, and they can also live in memory owned by someone else.
+    //-----------------------------------------------------------------------
+    bool isSingleChannel() const            { return Base::size() == 0 && m_intensityData != nullptr; }
+    IntensityMap intensity() const
+    {
+        return IntensityMap(m_intensityData, m_intensityWidth, m_intensityHeight, Eigen::OuterStride<>(m_intensityStride));
+    }
+    /// Turn this into a single-channel image with the given raw values
+    void setSingleChannel(Intensity values);
+    /*!
+     * Turn this into a single-channel image viewing the raw values stored elsewhere, without copying them.
+     *
+     * @param owner     Keeps the memory holding the values alive (e.g. a memory-mapped file)
+     * @param data      The value of pixel (0,0)
+     * @param stride    The distance from one scanline to the next, in floats. Eigen doesn't support negative
+     *                  strides, so bottom-up scanlines have to be copied instead, and this throws if stride < w
+     */
+    void setSingleChannel(std::shared_ptr<const void> owner, const float * data, int w, int h, Eigen::Index stride);
+    /// Minimum and extent of the positive raw values, which the false-color mapping spreads over the colormap
+    Eigen::Vector2f singleChannelRange() const {return Eigen::Vector2f(m_intensityMin, m_intensityDelta);}
+    /// A four-channel copy of the image, with the colors of a single-channel image filled in
+    HDRImage expanded() const;
+    /// The color of pixel (x,y), for both single- and four-channel images
+    Color4 color(int x, int y) const
+    {
+        return isSingleChannel() ? singleChannelColor(m_intensityData[x + y * m_intensityStride], m_intensityMin, m_intensityDelta)
+                                 : (*this)(x, y);
+    }
+
+    /// The colormaps of the false-color mapping, which the viewer lets the user choose from
+    enum Colormap : int
+    {
+        TURBO_COLORMAP = 0,
+        VIRIDIS_COLORMAP,
+        GRAY_COLORMAP,
+        NUM_COLORMAPS
+    };
+    static const std::vector<std::string> & colormapNames();
+    /// The 256 (linear, opaque) colors of a colormap for single-channel images
+    static const std::vector<Color4> & singleChannelColormap(Colormap colormap = TURBO_COLORMAP);
+    /*!
+     * Maps a raw value to a color: the range [minimum, minimum + delta] is spread over the colormap, and larger
+     * values get its last color. Values below the range (with the automatic range of the positive values:
+     * zero and negative ones) and NaNs are transparent black.
+     */
+    static Color4 singleChannelColor(float v, float minimum, float delta, Colormap colormap = TURBO_COLORMAP)
+    {
+        if (std::isnan(v) || v < minimum)
+            return Color4(0.f, 0.f, 0.f, 0.f);
+        // clamp before converting, since infinite values don't fit in an int
+        float t = delta > 0.f ? std::min(255.f * (v - minimum) / delta, 255.f) : 0.f;
+        return singleChannelColormap(colormap)[int(std::round(t))];
+    }
+    //@}
 
     void setAlpha(float a)
     {
@@ -61,19 +131,19 @@ public:
 
     Color4 min() const
     {
-        Color4 m = (*this)(0,0);
+        Color4 m = color(0,0);
         for (int y = 0; y < height(); ++y)
             for (int x = 0; x < width(); ++x)
-                m = ::min(m, (*this)(x,y));
+                m = ::min(m, color(x,y));
         return m;
     }
 
     Color4 max() const
     {
-        Color4 m = (*this)(0,0);
+        Color4 m = color(0,0);
         for (int y = 0; y < height(); ++y)
             for (int x = 0; x < width(); ++x)
-                m = ::max(m, (*this)(x,y));
+                m = ::max(m, color(x,y));
         return m;
     }
 
@@ -88,8 +158,22 @@ public:
         MIRROR
     };
     static const std::vector<std::string> & borderModeNames();
-    Color4 & pixel(int x, int y, BorderMode mX = EDGE, BorderMode mY = EDGE);
-    const Color4 & pixel(int x, int y, BorderMode mX = EDGE, BorderMode mY = EDGE) const;
+    Color4 & pixel(int x, int y, BorderMode mX = EDGE, BorderMode mY = EDGE)
+    {
+        // most lookups are in bounds, so only pay for the border handling when needed
+        return inBounds(x, y) ? (*this)(x, y) : borderPixel(x, y, mX, mY);
+    }
+    const Color4 & pixel(int x, int y, BorderMode mX = EDGE, BorderMode mY = EDGE) const
+    {
+        return inBounds(x, y) ? (*this)(x, y) : borderPixel(x, y, mX, mY);
+    }
+    bool inBounds(int x, int y) const
+    {
+        return unsigned(x) < unsigned(width()) && unsigned(y) < unsigned(height());
+    }
+    /// The slow path of pixel(), applying the border modes to a (possibly) out-of-bounds pixel
+    Color4 & borderPixel(int x, int y, BorderMode mX, BorderMode mY);
+    const Color4 & borderPixel(int x, int y, BorderMode mX, BorderMode mY) const;
     //@}
 
     //-----------------------------------------------------------------------
@@ -127,21 +211,98 @@ public:
     };
     HDRImage resizedCanvas(int width, int height, CanvasAnchor anchor, const Color4 & bgColor) const;
     HDRImage resized(int width, int height) const;
+    enum ResizeFilter : int
+    {
+        BOX_FILTER = 0,
+        TENT_FILTER,
+        MITCHELL_FILTER,
+        LANCZOS_FILTER
+    };
+    static const std::vector<std::string> & resizeFilterNames();
+    /*!
+     * Resize with a separable polyphase filter, see resampler::polyphaseResize.
+     *
+     * @param usePyramid    For large reductions, first average down by a power of two with a box filter, which
+     *                      is much faster and hardly changes the result
+     */
+    HDRImage resized(int width, int height, ResizeFilter filter, AtomicProgress progress = AtomicProgress(),
+                     BorderMode mX = EDGE, BorderMode mY = EDGE, bool usePyramid = true) const;
     HDRImage resampled(int width, int height,
                        AtomicProgress progress = AtomicProgress(),
                        std::function<Eigen::Vector2f(const Eigen::Vector2f &)> warpFn =
                        [](const Eigen::Vector2f &uv) { return uv; },
                        int superSample = 1, Sampler s = NEAREST, BorderMode mX = REPEAT, BorderMode mY = REPEAT) const;
+    /// Resample to the size of a precomputed warp field (see Resampler.h), which must be for an image of this size
+    HDRImage resampled(const WarpField & warp, AtomicProgress progress = AtomicProgress(),
+                       Sampler s = NEAREST, BorderMode mX = REPEAT, BorderMode mY = REPEAT) const;
     //@}
 
 
     //-----------------------------------------------------------------------
     //@{ \name Transformations.
     //-----------------------------------------------------------------------
-    HDRImage flippedVertical() const    {HDRImage img = rowwise().reverse().eval();             img.intensity() = intensity().rowwise().reverse().eval(); return img;}
-    HDRImage flippedHorizontal() const  {HDRImage img = colwise().reverse().eval();             img.intensity() = intensity().colwise().reverse().eval(); return img;}
-    HDRImage rotated90CW() const        {HDRImage img = transpose().colwise().reverse().eval(); img.intensity() = intensity().transpose().colwise().reverse().eval(); return img;}
-    HDRImage rotated90CCW() const       {HDRImage img = transpose().rowwise().reverse().eval(); img.intensity() = intensity().transpose().rowwise().reverse().eval(); return img;}
+    HDRImage flippedVertical() const    {if (isSingleChannel()) return singleChannel(intensity().rowwise().reverse());             return rowwise().reverse().eval();}
+    HDRImage flippedHorizontal() const  {if (isSingleChannel()) return singleChannel(intensity().colwise().reverse());             return colwise().reverse().eval();}
+    HDRImage rotated90CW() const        {if (isSingleChannel()) return singleChannel(intensity().transpose().colwise().reverse()); return transpose().colwise().reverse().eval();}
+    HDRImage rotated90CCW() const       {if (isSingleChannel()) return singleChannel(intensity().transpose().rowwise().reverse()); return transpose().rowwise().reverse().eval();}
+    HDRImage transposed() const         {if (isSingleChannel()) return singleChannel(intensity().transpose());                     return transpose().eval();}
+
+    /*!
+     * One of the eight combinations of flips and 90 degree rotations, which maps the stored pixels to the
+     * displayed ones: the axes are swapped first if transposed is set, then each displayed axis is mirrored
+     * if its flip is set.
+     */
+    struct Orientation
+    {
+        bool transposed = false, flipX = false, flipY = false;
+
+        Orientation() = default;
+        Orientation(bool t, bool fx, bool fy) : transposed(t), flipX(fx), flipY(fy) {}
+
+        static Orientation flipHorizontal()     {return {false, true, false};}
+        static Orientation flipVertical()       {return {false, false, true};}
+        static Orientation rotate90CW()         {return {true, true, false};}
+        static Orientation rotate90CCW()        {return {true, false, true};}
+
+        bool isIdentity() const                 {return !transposed && !flipX && !flipY;}
+        bool operator==(const Orientation & o) const
+        {
+            return transposed == o.transposed && flipX == o.flipX && flipY == o.flipY;
+        }
+
+        /// The orientation that applies o after this one
+        Orientation then(const Orientation & o) const
+        {
+            // moving the flips of this across the transposition of o swaps their axes
+            bool fx = o.transposed ? flipY : flipX, fy = o.transposed ? flipX : flipY;
+            return {transposed != o.transposed, fx != o.flipX, fy != o.flipY};
+        }
+        Orientation inverse() const             {return transposed ? Orientation(true, flipY, flipX) : *this;}
+
+        /// Size of the displayed image, given the stored size
+        Eigen::Vector2i size(const Eigen::Vector2i & stored) const   {return transposed ? Eigen::Vector2i(stored.y(), stored.x()) : stored;}
+        /// The stored pixel shown at pixel p of a displayed image of the given size
+        Eigen::Vector2i storedPixel(const Eigen::Vector2i & p, const Eigen::Vector2i & displayed) const
+        {
+            Eigen::Vector2i q(flipX ? displayed.x() - 1 - p.x() : p.x(), flipY ? displayed.y() - 1 - p.y() : p.y());
+            return transposed ? Eigen::Vector2i(q.y(), q.x()) : q;
+        }
+        /// Maps the homogeneous texture coordinates [0,1]^2 of the displayed image to those of the stored one
+        Eigen::Matrix3f storedUV() const
+        {
+            Eigen::Matrix3f flip;
+            flip << (flipX ? -1.f : 1.f), 0.f, (flipX ? 1.f : 0.f),
+                    0.f, (flipY ? -1.f : 1.f), (flipY ? 1.f : 0.f),
+                    0.f, 0.f, 1.f;
+            Eigen::Matrix3f swap;
+            swap << 0.f, 1.f, 0.f,
+                    1.f, 0.f, 0.f,
+                    0.f, 0.f, 1.f;
+            return transposed ? (swap * flip).eval() : flip;
+        }
+    };
+    /// The pixels as displayed with orientation o
+    HDRImage oriented(const Orientation & o) const;
     //@}
 
 
@@ -165,7 +326,8 @@ public:
         demosaicGreenMalvar(redOffset);
         demosaicRedBlueMalvar(redOffset);
     }
-    void demosaicAHD(const Eigen::Vector2i &redOffset, const Eigen::Matrix3f &cameraToXYZ);
+    void demosaicAHD(const Eigen::Vector2i &redOffset, const Eigen::Matrix3f &cameraToXYZ,
+                     AtomicProgress progress = AtomicProgress());
 
     // green channel
     void demosaicGreenLinear(const Eigen::Vector2i &redOffset);
@@ -189,10 +351,27 @@ public:
     //@{ \name Image filters.
     //-----------------------------------------------------------------------
     HDRImage inverted() const;
+    /// Scale and offset every pixel channel by channel, pixel * scale + offset, with the vectorized pixel kernels
+    HDRImage scaledOffset(const Color4 & scale, const Color4 & offset) const;
+    /// Map the color channels of every pixel through the curve, leaving alpha as is
+    HDRImage curveMapped(const CurveLUT & curve) const;
 	HDRImage brightnessContrast(float brightness, float contrast, bool linear, EChannel c) const;
+    /// Convolve with the 2D kernel, which is normalized to sum to one. Large kernels use fftConvolved
     HDRImage convolved(const Eigen::ArrayXXf &kernel,
                        AtomicProgress progress,
                        BorderMode mX = EDGE, BorderMode mY = EDGE) const;
+    /// Convolve with the 2D kernel using tiled FFTs, whose cost hardly depends on the size of the kernel
+    HDRImage fftConvolved(const Eigen::ArrayXXf &kernel,
+                          AtomicProgress progress,
+                          BorderMode mX = EDGE, BorderMode mY = EDGE) const;
+    /// Convolve each row with the 1D kernel, which is normalized to sum to one
+    HDRImage convolvedX(const Eigen::ArrayXf &kernel,
+                        AtomicProgress progress,
+                        BorderMode mX = EDGE) const;
+    /// Convolve each column with the 1D kernel, which is normalized to sum to one
+    HDRImage convolvedY(const Eigen::ArrayXf &kernel,
+                        AtomicProgress progress,
+                        BorderMode mY = EDGE) const;
     HDRImage GaussianBlurred(float sigmaX, float sigmaY,
                              AtomicProgress progress,
                              BorderMode mX = EDGE, BorderMode mY = EDGE,
@@ -220,30 +399,208 @@ public:
     HDRImage boxBlurredX(int leftSize, int rightSize, AtomicProgress progress, BorderMode mode = EDGE) const;
     HDRImage boxBlurredX(int halfSize, AtomicProgress progress,
                          BorderMode mode = EDGE) const {return boxBlurredX(halfSize, halfSize, progress, mode);}
+    /// Apply the same horizontal box blur several times, without allocating an image for each pass
+    HDRImage boxBlurredX(int leftSize, int rightSize, int passes, AtomicProgress progress, BorderMode mode = EDGE) const;
     HDRImage boxBlurredY(int upSize, int downSize, AtomicProgress progress, BorderMode mode = EDGE) const;
     HDRImage boxBlurredY(int halfSize, AtomicProgress progress,
                          BorderMode mode = EDGE) const {return boxBlurredY(halfSize, halfSize, progress, mode);}
+    /// Apply the same vertical box blur several times, without allocating an image for each pass
+    HDRImage boxBlurredY(int upSize, int downSize, int passes, AtomicProgress progress, BorderMode mode = EDGE) const;
     HDRImage unsharpMasked(float sigma, float strength, AtomicProgress progress, BorderMode mX = EDGE, BorderMode mY = EDGE) const;
     HDRImage medianFiltered(float radius, int channel, AtomicProgress progress, BorderMode mX = EDGE, BorderMode mY = EDGE, bool round = false) const;
-    HDRImage medianFiltered(float r, AtomicProgress progress, BorderMode mX = EDGE, BorderMode mY = EDGE, bool round = false) const
-    {
-        return medianFiltered(r, 0, AtomicProgress(progress, 0.25f), mX, mY, round)
-            .medianFiltered(r, 1, AtomicProgress(progress, 0.25f), mX, mY, round)
-            .medianFiltered(r, 2, AtomicProgress(progress, 0.25f), mX, mY, round)
-            .medianFiltered(r, 3, AtomicProgress(progress, 0.25f), mX, mY, round);
-    }
+    /// Median filter all four channels in a single pass. NaNs are left out of the medians
+    HDRImage medianFiltered(float r, AtomicProgress progress, BorderMode mX = EDGE, BorderMode mY = EDGE, bool round = false) const;
     HDRImage bilateralFiltered(float sigmaRange/* = 0.1f*/,
                                float sigmaDomain/* = 1.0f*/,
                                AtomicProgress progress,
                                BorderMode mX = EDGE, BorderMode mY = EDGE,
                                float truncateDomain = 6.0f) const;
+    /*!
+     * An approximate bilateral filter using the permutohedral lattice, whose cost does not depend on sigmaDomain.
+     * The pixels within 3 sigmaDomain beyond the edges are splatted according to the border modes, like the exact
+     * version truncated there. Small domain sigmas, for which the exact filter is cheaper, fall back to it.
+     */
+    HDRImage fastBilateralFiltered(float sigmaRange, float sigmaDomain, AtomicProgress progress,
+                                   BorderMode mX = EDGE, BorderMode mY = EDGE) const;
     //@}
 
-    bool load(const std::string & filename);
+
+    //-----------------------------------------------------------------------
+    //@{ \name Regions of interest.
+    //
+    // Any of the filters above can compute just a rectangle of its result,
+    // e.g. to redo one bad tile or to preview a crop. filterRegion() runs
+    // the filter on the rectangle grown by the filter's apron, the distance
+    // to the farthest pixel it reads, and writes only the rectangle into
+    // the destination. The aprons of the filters are given below (the box
+    // blurs read their half sizes, and point operations need none).
+    //-----------------------------------------------------------------------
+    /// A rectangle of pixels, [x, x + width) x [y, y + height)
+    struct Roi
+    {
+        int x = 0, y = 0, width = 0, height = 0;
+
+        Roi() = default;
+        Roi(int x_, int y_, int w, int h) : x(x_), y(y_), width(w), height(h) {}
+
+        bool isEmpty() const                    {return width <= 0 || height <= 0;}
+        Roi grown(int ax, int ay) const         {return Roi(x - ax, y - ay, width + 2 * ax, height + 2 * ay);}
+        Roi intersected(const Roi & o) const
+        {
+            int x0 = std::max(x, o.x), y0 = std::max(y, o.y);
+            int x1 = std::min(x + width, o.x + o.width), y1 = std::min(y + height, o.y + o.height);
+            return Roi(x0, y0, std::max(x1 - x0, 0), std::max(y1 - y0, 0));
+        }
+    };
+    Roi bounds() const      {return Roi(0, 0, width(), height());}
+
+    /// The pixels in roi, which may extend past the image: the pixels outside of it are given by the border modes
+    HDRImage cropped(const Roi & roi, BorderMode mX = EDGE, BorderMode mY = EDGE) const;
+
+    /// One of the filters above, e.g. [&](const HDRImage & src){return src.GaussianBlurred(...);}
+    using RegionFilter = std::function<HDRImage(const HDRImage & src)>;
+    /*!
+     * @brief           Compute only the pixels in roi of filter(*this), and write them into dst.
+     *
+     * Only roi grown by apron pixels on each side (and within the image) is read, and the filter handles the
+     * edges of the image it reaches with its own border modes, also in each of its passes. With the REPEAT
+     * and MIRROR border modes, which can read the opposite side, reaching an edge reads the whole width (or
+     * height) of the image instead. So the result
+     * matches filtering the whole image, as long as the filter reads no farther than apron and uses the border
+     * modes mX and mY. Filters that adapt to the values of the whole image (the median's quantization, the
+     * lattice of the fast bilateral filter) are close but not exact.
+     *
+     * @param dst       Has the size of this image, and keeps its pixels outside roi. May be this image itself.
+     * @param roi       Clipped to the image
+     */
+    void filterRegion(HDRImage & dst, const Roi & roi, const Eigen::Vector2i & apron, const RegionFilter & filter,
+                      BorderMode mX = EDGE, BorderMode mY = EDGE) const;
+    /// The pixels in roi of filter(*this) as an image of the size of roi (clipped to the image), see filterRegion
+    HDRImage regionFiltered(const Roi & roi, const Eigen::Vector2i & apron, const RegionFilter & filter,
+                            BorderMode mX = EDGE, BorderMode mY = EDGE) const;
+
+    static Eigen::Vector2i convolutionApron(const Eigen::ArrayXXf & kernel)
+    {
+        return Eigen::Vector2i(int(kernel.rows()) / 2, int(kernel.cols()) / 2);
+    }
+    static Eigen::Vector2i GaussianApron(float sigmaX, float sigmaY, float truncateX = 6.0f, float truncateY = 6.0f)
+    {
+        return Eigen::Vector2i(int(std::ceil(truncateX * sigmaX)), int(std::ceil(truncateY * sigmaY)));
+    }
+    static Eigen::Vector2i iteratedBoxApron(float sigma, int iterations = 6);
+    /// Also the apron of unsharpMasked
+    static Eigen::Vector2i fastGaussianApron(float sigmaX, float sigmaY);
+    static Eigen::Vector2i medianApron(float radius)
+    {
+        return Eigen::Vector2i::Constant(int(std::ceil(radius)));
+    }
+    static Eigen::Vector2i bilateralApron(float sigmaDomain, float truncateDomain = 6.0f)
+    {
+        return Eigen::Vector2i::Constant(int(std::ceil(truncateDomain * sigmaDomain)));
+    }
+
+    /*!
+     * Resample only the pixels in roi of the result, and write them into dst, whose size is that of the result.
+     * Since the warp can map them anywhere, the whole source image may be read.
+     */
+    void resampled(HDRImage & dst, const Roi & roi,
+                   AtomicProgress progress,
+                   std::function<Eigen::Vector2f(const Eigen::Vector2f &)> warpFn,
+                   int superSample = 1, Sampler s = NEAREST, BorderMode mX = REPEAT, BorderMode mY = REPEAT) const;
+    void resampled(HDRImage & dst, const Roi & roi, const WarpField & warp, AtomicProgress progress = AtomicProgress(),
+                   Sampler s = NEAREST, BorderMode mX = REPEAT, BorderMode mY = REPEAT) const;
+    //@}
+
+    //-----------------------------------------------------------------------
+    //@{ \name Loading and saving.
+    //-----------------------------------------------------------------------
+    /// Compression methods for saving EXR files
+    enum EXRCompression : int
+    {
+        EXR_NONE = 0,
+        EXR_ZIPS,
+        EXR_ZIP,
+        EXR_PIZ,
+        EXR_DWAA,
+        EXR_B44
+    };
+    static const std::vector<std::string> & exrCompressionNames();
+
+    /// Settings used by all subsequently saved EXR files (ZIP compressed halfs by default)
+    static EXRCompression exrCompression()          {return s_exrCompression;}
+    static void setEXRCompression(EXRCompression c) {s_exrCompression = c;}
+    static bool exrHalf()                           {return s_exrHalf;}
+    static void setEXRHalf(bool half)               {s_exrHalf = half;}
+
+    /// Settings used by all subsequently saved PNG and JPEG files
+    static int pngLevel()                           {return s_pngLevel;}
+    static void setPNGLevel(int level)              {s_pngLevel = level;}     ///< zlib level, 0 (fastest) to 9 (smallest)
+    static bool png16Bit()                          {return s_png16Bit;}
+    static void setPNG16Bit(bool b)                 {s_png16Bit = b;}
+    static int jpegQuality()                        {return s_jpegQuality;}
+    static void setJPEGQuality(int quality)         {s_jpegQuality = quality;} ///< from 1 to 100
+
+    /// How raw (DNG) files are developed
+    enum DNGDevelop : int
+    {
+        DNG_FULL = 0,   ///< AHD demosaicing at full resolution
+        DNG_PREVIEW     ///< Much faster: each 2x2 Bayer quad becomes one pixel of a half-resolution image
+    };
+    static const std::vector<std::string> & dngDevelopNames();
+
+    /// Setting used by all subsequently loaded DNG files (full development by default)
+    static DNGDevelop dngDevelop()                  {return s_dngDevelop;}
+    static void setDNGDevelop(DNGDevelop d)         {s_dngDevelop = d;}
+
+    /*!
+     * Receives a downsampled preview of an image while it is being loaded, along with the size of the full image.
+     * Called from the loading thread.
+     */
+    using PreviewCallback = std::function<void(const std::shared_ptr<const HDRImage> & preview, int width, int height)>;
+
+    /*!
+     * @brief           Load an image from disk.
+     *
+     * @param filename  The file to load
+     * @param preview   If set, large images first deliver a preview (from a coarse level or thumbnail stored in
+     *                  the file where available) to this callback, so it can be displayed as soon as possible.
+     *                  The preview is computed from the full image when the file has none.
+     * @return          True if loading was successful
+     */
+    bool load(const std::string & filename, const PreviewCallback & preview = PreviewCallback());
+    /*!
+     * @brief           Load only the scanlines [top,bottom) of an image, as a width x (bottom - top) image.
+     *
+     * PFM and EXR files only read and decode (about) those scanlines, other formats are loaded whole and
+     * cropped. Unlike load(), gray EXRs keep their color channels, and the false-color range of single-channel
+     * images only covers the loaded scanlines.
+     *
+     * @return          True if loading was successful, false if it failed or the image has fewer scanlines
+     */
+    bool loadRows(const std::string & filename, int top, int bottom);
+    /*!
+     * @brief           Find out the size of an image, without decoding its pixels where possible.
+     *
+     * Only the header is read for the stb formats, PFM and EXR files; other formats are loaded whole.
+     *
+     * @return          True if the size could be determined
+     */
+    static bool readSize(const std::string & filename, int & width, int & height);
+    /*!
+     * @brief           Load a DNG file with the full development, regardless of dngDevelop().
+     *
+     * This turns a raw loaded with DNG_PREVIEW into the full-quality image after the fact.
+     *
+     * @return          True if loading was successful
+     */
+    bool developDNG(const std::string & filename);
     /*!
      * @brief           Write the file to disk.
      *
-     * The output image format is deduced from the filename extension.
+     * The output image format is deduced from the filename extension. EXR files are written with the
+     * compression and precision set by setEXRCompression() and setEXRHalf(), and PNG and JPEG files with the
+     * settings above. Single-channel images are saved as their raw values to PFM files, and with their false
+     * colors to all other formats.
      *
      * @param filename  Filename to save to on disk
      * @param gain      Multiply all pixel values by gain before saving
@@ -255,13 +612,37 @@ public:
     bool save(const std::string & filename,
               float gain, float gamma,
               bool sRGB, bool dither) const;
+    //@}
 
 public:
     EIGEN_MAKE_ALIGNED_OPERATOR_NEW
 
 private:
-    Intensity m_intensity;
+    static HDRImage singleChannel(Intensity values) {HDRImage img; img.setSingleChannel(std::move(values)); return img;}
+    bool saveEXR(const std::string & filename, float gain) const;
+    bool loadFile(const std::string & filename, const PreviewCallback & preview);
+    void loadDNG(const std::string & filename, DNGDevelop mode, const PreviewCallback & preview);
+    void releaseIntensity();
+
+    // the raw values of single-channel images
+    std::shared_ptr<const void> m_intensityOwner;
+    const float * m_intensityData = nullptr;
+    int m_intensityWidth = 0, m_intensityHeight = 0;
+    Eigen::Index m_intensityStride = 0;
+    float m_intensityMin = 0.f, m_intensityDelta = 0.f;
+
+    static EXRCompression s_exrCompression;
+    static bool s_exrHalf;
+    static int s_pngLevel;
+    static bool s_png16Bit;
+    static int s_jpegQuality;
+    static DNGDevelop s_dngDevelop;
 };
 
 
-std::shared_ptr<HDRImage> loadImage(const std::string & filename);
+std::shared_ptr<HDRImage> loadImage(const std::string & filename,
+                                    const HDRImage::PreviewCallback & preview = HDRImage::PreviewCallback());
+/// A quick downsampled copy of img that fits in size x size pixels, e.g. a preview or thumbnail
+std::shared_ptr<HDRImage> downsampledPreview(const HDRImage & img, int size);
+/// Copy the w x h interleaved 3- or 4-channel pixels at data into img (which must already have that size)
+void copyPixelsFromArray(HDRImage & img, const float * data, int w, int h, int n, bool convertToLinear, bool flip);
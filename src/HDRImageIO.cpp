@@ -7,9 +7,20 @@
 #include "HDRImage.h"
 #include "DitherMatrix256.h"    // for dither_matrix256
 #include <ImfArray.h>            // for Array2D
+#include <ImfChannelList.h>      // for ChannelList, Channel
+#include <ImfCompression.h>      // for Compression
+#include <ImfFrameBuffer.h>      // for FrameBuffer, Slice
+#include <ImfHeader.h>           // for Header
+#include <ImfInputPart.h>        // for InputPart
+#include <ImfMultiPartInputFile.h> // for MultiPartInputFile
+#include <ImfOutputFile.h>       // for OutputFile
+#include <ImfPartType.h>         // for isDeepData
+#include <ImfPreviewImage.h>     // for PreviewImage
 #include <ImfRgbaFile.h>         // for RgbaInputFile, RgbaOutputFile
 #include <ImathBox.h>            // for Box2i
 #include <ImfTestFile.h>         // for isOpenExrFile
+#include <ImfTileDescription.h>  // for TileDescription, LevelMode
+#include <ImfTiledInputPart.h>   // for TiledInputPart
 #include <ImathVec.h>            // for Vec2
 #include <ImfRgba.h>             // for Rgba, RgbaChannels::WRITE_RGBA
 #include <ctype.h>               // for tolower
@@ -17,14 +28,20 @@
 #include <stdlib.h>              // for abs
 #include <algorithm>             // for nth_element, transform
 #include <cmath>                 // for floor, pow, exp, ceil, round, sqrt
+#include <cstddef>               // for ptrdiff_t
+#include <cstdint>               // for uint16_t
+#include <cstring>               // for memcpy
 #include <exception>             // for exception
 #include <functional>            // for pointer_to_unary_function, function
+#include <limits>                // for numeric_limits
+#include <set>                   // for set
 #include <stdexcept>             // for runtime_error, out_of_range
 #include <string>                // for allocator, operator==, basic_string
 #include <vector>                // for vector
 #include "Common.h"              // for lerp, mod, clamp, getExtension
 #include "Colorspace.h"
 #include "ParallelFor.h"
+#include "PixelKernels.h"
 #include "Timer.h"
 #include <Eigen/Dense>
 #include <spdlog/spdlog.h>
@@ -61,8 +78,12 @@
 #define STB_IMAGE_WRITE_IMPLEMENTATION
 #include "stb_image_write.h"     // for stbi_write_bmp, stbi_write_hdr, stbi...
 
+#include "MappedFile.h"
+#include "NPY.h"
 #include "PFM.h"
+#include "PNG.h"
 #include "PPM.h"
+#include "Trace.h"
 
 
 using namespace Eigen;
@@ -80,71 +101,583 @@ void printImageInfo(const tinydng::DNGImage & image);
 HDRImage develop(vector<float> & raw,
                  const tinydng::DNGImage & param1,
                  const tinydng::DNGImage & param2);
-void copyPixelsFromArray(HDRImage & img, float * data, int w, int h, int n, bool convertToLinear, bool flip)
+HDRImage developPreview(const vector<float> & raw,
+                        const tinydng::DNGImage & param1,
+                        const tinydng::DNGImage & param2);
+HDRImage orientedDNG(const HDRImage & img, int orientation);
+
+enum Orientations
+{
+	ORIENTATION_TOPLEFT = 1,
+	ORIENTATION_TOPRIGHT = 2,
+	ORIENTATION_BOTRIGHT = 3,
+	ORIENTATION_BOTLEFT = 4,
+	ORIENTATION_LEFTTOP = 5,
+	ORIENTATION_RIGHTTOP = 6,
+	ORIENTATION_RIGHTBOT = 7,
+	ORIENTATION_LEFTBOT = 8
+};
+
+/*!
+ * Linearize 8- or 16-bit samples, with n channels (gray, gray+alpha, RGB or RGBA), through the lookup table
+ * toLinear into the image.
+ */
+template <typename T>
+void copyIntegerPixels(HDRImage & img, const T * data, int w, int h, int n, const vector<float> & toLinear)
 {
+	const float * lut = toLinear.data();
+	const float alphaScale = 1.f / numeric_limits<T>::max();
+	img.resize(w, h);
+	parallel_for(BlockedRange(0, h), [&img,data,w,n,lut,alphaScale](int y0, int y1)
+	{
+		for (int y = y0; y < y1; ++y)
+		for (int x = 0; x < w; ++x)
+		{
+			const T * p = data + size_t(n) * (x + size_t(y) * w);
+			if (n <= 2)
+				img(x, y) = Color4(lut[p[0]], lut[p[0]], lut[p[0]], n == 2 ? p[1] * alphaScale : 1.f);
+			else
+				img(x, y) = Color4(lut[p[0]], lut[p[1]], lut[p[2]], n == 4 ? p[3] * alphaScale : 1.f);
+		}
+	});
+}
+
+/*!
+ * Load an 8- or 16-bit image with stb. The file is decoded only once, into its native sample type, and the
+ * samples are then linearized through a lookup table straight into the image.
+ *
+ * 16-bit, single-channel PNGs are taken to be depth maps in millimeters, and are loaded as single-channel images
+ * in meters, with depths beyond 5 meters set to zero.
+ */
+void loadSTBIntegerImage(HDRImage & img, const string & filename, bool isPNG)
+{
+	TRACE_ZONE("loadSTBIntegerImage");
+	FILE * f = stbi__fopen(filename.c_str(), "rb");
+	if (!f)
+		throw runtime_error("Unable to open file.");
+	stbi__context s;
+	stbi__start_file(&s, f);
+	stbi__result_info ri;
+	int w, h, n;
+	void * data = stbi__load_main(&s, &w, &h, &n, 0, &ri, 16);
+	fclose(f);
+	if (!data)
+		throw runtime_error(stbi_failure_reason());
+	unique_ptr<void, void (*)(void *)> owner(data, stbi_image_free);
+
+	if (ri.bits_per_channel != 16)
+		copyIntegerPixels(img, (const uint8_t *) data, w, h, n, SRGBToLinearLUT8());
+	else if (n != 1 || !isPNG)
+		copyIntegerPixels(img, (const uint16_t *) data, w, h, n, SRGBToLinearLUT16());
+	else
+	{
+		const uint16_t * data16 = (const uint16_t *) data;
+		HDRImage::Intensity depth(w, h);
+		parallel_for(BlockedRange(0, h), [&depth,data16,w](int y0, int y1)
+		{
+			for (int y = y0; y < y1; ++y)
+				for (int x = 0; x < w; ++x)
+				{
+					float v = data16[y * w + x] / 1000.f;
+					depth(x, y) = v > 5.f ? 0.f : v;
+				}
+		});
+		img.setSingleChannel(std::move(depth));
+	}
+}
+
+/*!
+ * Load a PFM file through a memory mapping. The pixels are byte-swapped, scaled, flipped and expanded into the
+ * image in a single parallel pass. Single-channel images can't be viewed in place, since their scanlines are
+ * stored bottom-up and Eigen doesn't support negative strides.
+ *
+ * @param top, bottom   Only load the scanlines [top,bottom), or all of them if bottom is negative
+ * @return False if the file is not a PFM file
+ */
+bool loadMappedPFM(HDRImage & img, const string & filename, int top = 0, int bottom = -1)
+{
+	TRACE_ZONE("loadMappedPFM");
+	auto file = make_shared<const MappedFile>(filename);
+	if (!hasPFMSignature(file->data(), file->size()))
+		return false;
+	PFMHeader header = parsePFMHeader(file->data(), file->size());
+	int w = header.width, n = header.numChannels;
+	if (bottom < 0)
+		bottom = header.height;
+	if (top < 0 || top >= bottom || bottom > header.height)
+		throw runtime_error("Scanlines out of range.");
+
+	// the scanlines are stored bottom-up, so start at the one that ends up on top
+	int h = bottom - top;
+	size_t lineSize = size_t(w) * n * sizeof(float);
+	const unsigned char * pixels = file->data() + header.dataOffset + (header.height - 1 - top) * lineSize;
+
+	if (n == 1)
+	{
+		HDRImage::Intensity values(w, h);
+		parallel_for(BlockedRange(0, h), [&header,&values,pixels,lineSize,w](int y0, int y1)
+		{
+			for (int y = y0; y < y1; ++y)
+				decodePFMValues(header, pixels - y * lineSize, w, &values(0, y));
+		});
+		img.setSingleChannel(std::move(values));
+	}
+	else
+	{
+		img.resize(w, h);
+		parallel_for(BlockedRange(0, h), [&header,&img,pixels,lineSize,w](int y0, int y1)
+		{
+			for (int y = y0; y < y1; ++y)
+				decodePFMPixels(header, pixels - y * lineSize, w, (float *) &img(0, y));
+		});
+	}
+	return true;
+}
+
+/*!
+ * Load a C-order float32 NPY file through a memory mapping, viewing single-channel images in place.
+ *
+ * @return False if the array is of a type this doesn't handle, and should be loaded with TinyNPY instead
+ */
+bool loadMappedNPY(HDRImage & img, const string & filename)
+{
+	TRACE_ZONE("loadMappedNPY");
+	auto file = make_shared<const MappedFile>(filename);
+	NPYHeader header = parseNPYHeader(file->data(), file->size());
+	if (header.shape.size() < 2 || header.shape.size() > 3)
+		throw runtime_error("NPY not an image.");
+
+	const uint32_t one = 1;
+	const char * nativeFloat = *(const unsigned char *) &one ? "<f4" : ">f4";
+	if (header.descr != nativeFloat || header.fortranOrder)
+		return false;
+
+	int w = int(header.shape[1]), h = int(header.shape[0]);
+	int n = header.shape.size() == 2 ? 1 : int(header.shape[2]);
 	if (n != 1 && n != 3 && n != 4)
-		throw runtime_error("Only 1- 3- and 4-channel images are supported.");
+		throw runtime_error("Only 1- 3- 4-channel float NPYs are currently supported.");
 
-	// for every pixel in the image
-	if (n == 1) {
-		#if 1
-		static const float turboRGBf[256][3] = {{0.18995f,0.07176f,0.23217f},{0.19483f,0.08339f,0.26149f},{0.19956f,0.09498f,0.29024f},{0.20415f,0.10652f,0.31844f},{0.20860f,0.11802f,0.34607f},{0.21291f,0.12947f,0.37314f},{0.21708f,0.14087f,0.39964f},{0.22111f,0.15223f,0.42558f},{0.22500f,0.16354f,0.45096f},{0.22875f,0.17481f,0.47578f},{0.23236f,0.18603f,0.50004f},{0.23582f,0.19720f,0.52373f},{0.23915f,0.20833f,0.54686f},{0.24234f,0.21941f,0.56942f},{0.24539f,0.23044f,0.59142f},{0.24830f,0.24143f,0.61286f},{0.25107f,0.25237f,0.63374f},{0.25369f,0.26327f,0.65406f},{0.25618f,0.27412f,0.67381f},{0.25853f,0.28492f,0.69300f},{0.26074f,0.29568f,0.71162f},{0.26280f,0.30639f,0.72968f},{0.26473f,0.31706f,0.74718f},{0.26652f,0.32768f,0.76412f},{0.26816f,0.33825f,0.78050f},{0.26967f,0.34878f,0.79631f},{0.27103f,0.35926f,0.81156f},{0.27226f,0.36970f,0.82624f},{0.27334f,0.38008f,0.84037f},{0.27429f,0.39043f,0.85393f},{0.27509f,0.40072f,0.86692f},{0.27576f,0.41097f,0.87936f},{0.27628f,0.42118f,0.89123f},{0.27667f,0.43134f,0.90254f},{0.27691f,0.44145f,0.91328f},{0.27701f,0.45152f,0.92347f},{0.27698f,0.46153f,0.93309f},{0.27680f,0.47151f,0.94214f},{0.27648f,0.48144f,0.95064f},{0.27603f,0.49132f,0.95857f},{0.27543f,0.50115f,0.96594f},{0.27469f,0.51094f,0.97275f},{0.27381f,0.52069f,0.97899f},{0.27273f,0.53040f,0.98461f},{0.27106f,0.54015f,0.98930f},{0.26878f,0.54995f,0.99303f},{0.26592f,0.55979f,0.99583f},{0.26252f,0.56967f,0.99773f},{0.25862f,0.57958f,0.99876f},{0.25425f,0.58950f,0.99896f},{0.24946f,0.59943f,0.99835f},{0.24427f,0.60937f,0.99697f},{0.23874f,0.61931f,0.99485f},{0.23288f,0.62923f,0.99202f},{0.22676f,0.63913f,0.98851f},{0.22039f,0.64901f,0.98436f},{0.21382f,0.65886f,0.97959f},{0.20708f,0.66866f,0.97423f},{0.20021f,0.67842f,0.96833f},{0.19326f,0.68812f,0.96190f},{0.18625f,0.69775f,0.95498f},{0.17923f,0.70732f,0.94761f},{0.17223f,0.71680f,0.93981f},{0.16529f,0.72620f,0.93161f},{0.15844f,0.73551f,0.92305f},{0.15173f,0.74472f,0.91416f},{0.14519f,0.75381f,0.90496f},{0.13886f,0.76279f,0.89550f},{0.13278f,0.77165f,0.88580f},{0.12698f,0.78037f,0.87590f},{0.12151f,0.78896f,0.86581f},{0.11639f,0.79740f,0.85559f},{0.11167f,0.80569f,0.84525f},{0.10738f,0.81381f,0.83484f},{0.10357f,0.82177f,0.82437f},{0.10026f,0.82955f,0.81389f},{0.09750f,0.83714f,0.80342f},{0.09532f,0.84455f,0.79299f},{0.09377f,0.85175f,0.78264f},{0.09287f,0.85875f,0.77240f},{0.09267f,0.86554f,0.76230f},{0.09320f,0.87211f,0.75237f},{0.09451f,0.87844f,0.74265f},{0.09662f,0.88454f,0.73316f},{0.09958f,0.89040f,0.72393f},{0.10342f,0.89600f,0.71500f},{0.10815f,0.90142f,0.70599f},{0.11374f,0.90673f,0.69651f},{0.12014f,0.91193f,0.68660f},{0.12733f,0.91701f,0.67627f},{0.13526f,0.92197f,0.66556f},{0.14391f,0.92680f,0.65448f},{0.15323f,0.93151f,0.64308f},{0.16319f,0.93609f,0.63137f},{0.17377f,0.94053f,0.61938f},{0.18491f,0.94484f,0.60713f},{0.19659f,0.94901f,0.59466f},{0.20877f,0.95304f,0.58199f},{0.22142f,0.95692f,0.56914f},{0.23449f,0.96065f,0.55614f},{0.24797f,0.96423f,0.54303f},{0.26180f,0.96765f,0.52981f},{0.27597f,0.97092f,0.51653f},{0.29042f,0.97403f,0.50321f},{0.30513f,0.97697f,0.48987f},{0.32006f,0.97974f,0.47654f},{0.33517f,0.98234f,0.46325f},{0.35043f,0.98477f,0.45002f},{0.36581f,0.98702f,0.43688f},{0.38127f,0.98909f,0.42386f},{0.39678f,0.99098f,0.41098f},{0.41229f,0.99268f,0.39826f},{0.42778f,0.99419f,0.38575f},{0.44321f,0.99551f,0.37345f},{0.45854f,0.99663f,0.36140f},{0.47375f,0.99755f,0.34963f},{0.48879f,0.99828f,0.33816f},{0.50362f,0.99879f,0.32701f},{0.51822f,0.99910f,0.31622f},{0.53255f,0.99919f,0.30581f},{0.54658f,0.99907f,0.29581f},{0.56026f,0.99873f,0.28623f},{0.57357f,0.99817f,0.27712f},{0.58646f,0.99739f,0.26849f},{0.59891f,0.99638f,0.26038f},{0.61088f,0.99514f,0.25280f},{0.62233f,0.99366f,0.24579f},{0.63323f,0.99195f,0.23937f},{0.64362f,0.98999f,0.23356f},{0.65394f,0.98775f,0.22835f},{0.66428f,0.98524f,0.22370f},{0.67462f,0.98246f,0.21960f},{0.68494f,0.97941f,0.21602f},{0.69525f,0.97610f,0.21294f},{0.70553f,0.97255f,0.21032f},{0.71577f,0.96875f,0.20815f},{0.72596f,0.96470f,0.20640f},{0.73610f,0.96043f,0.20504f},{0.74617f,0.95593f,0.20406f},{0.75617f,0.95121f,0.20343f},{0.76608f,0.94627f,0.20311f},{0.77591f,0.94113f,0.20310f},{0.78563f,0.93579f,0.20336f},{0.79524f,0.93025f,0.20386f},{0.80473f,0.92452f,0.20459f},{0.81410f,0.91861f,0.20552f},{0.82333f,0.91253f,0.20663f},{0.83241f,0.90627f,0.20788f},{0.84133f,0.89986f,0.20926f},{0.85010f,0.89328f,0.21074f},{0.85868f,0.88655f,0.21230f},{0.86709f,0.87968f,0.21391f},{0.87530f,0.87267f,0.21555f},{0.88331f,0.86553f,0.21719f},{0.89112f,0.85826f,0.21880f},{0.89870f,0.85087f,0.22038f},{0.90605f,0.84337f,0.22188f},{0.91317f,0.83576f,0.22328f},{0.92004f,0.82806f,0.22456f},{0.92666f,0.82025f,0.22570f},{0.93301f,0.81236f,0.22667f},{0.93909f,0.80439f,0.22744f},{0.94489f,0.79634f,0.22800f},{0.95039f,0.78823f,0.22831f},{0.95560f,0.78005f,0.22836f},{0.96049f,0.77181f,0.22811f},{0.96507f,0.76352f,0.22754f},{0.96931f,0.75519f,0.22663f},{0.97323f,0.74682f,0.22536f},{0.97679f,0.73842f,0.22369f},{0.98000f,0.73000f,0.22161f},{0.98289f,0.72140f,0.21918f},{0.98549f,0.71250f,0.21650f},{0.98781f,0.70330f,0.21358f},{0.98986f,0.69382f,0.21043f},{0.99163f,0.68408f,0.20706f},{0.99314f,0.67408f,0.20348f},{0.99438f,0.66386f,0.19971f},{0.99535f,0.65341f,0.19577f},{0.99607f,0.64277f,0.19165f},{0.99654f,0.63193f,0.18738f},{0.99675f,0.62093f,0.18297f},{0.99672f,0.60977f,0.17842f},{0.99644f,0.59846f,0.17376f},{0.99593f,0.58703f,0.16899f},{0.99517f,0.57549f,0.16412f},{0.99419f,0.56386f,0.15918f},{0.99297f,0.55214f,0.15417f},{0.99153f,0.54036f,0.14910f},{0.98987f,0.52854f,0.14398f},{0.98799f,0.51667f,0.13883f},{0.98590f,0.50479f,0.13367f},{0.98360f,0.49291f,0.12849f},{0.98108f,0.48104f,0.12332f},{0.97837f,0.46920f,0.11817f},{0.97545f,0.45740f,0.11305f},{0.97234f,0.44565f,0.10797f},{0.96904f,0.43399f,0.10294f},{0.96555f,0.42241f,0.09798f},{0.96187f,0.41093f,0.09310f},{0.95801f,0.39958f,0.08831f},{0.95398f,0.38836f,0.08362f},{0.94977f,0.37729f,0.07905f},{0.94538f,0.36638f,0.07461f},{0.94084f,0.35566f,0.07031f},{0.93612f,0.34513f,0.06616f},{0.93125f,0.33482f,0.06218f},{0.92623f,0.32473f,0.05837f},{0.92105f,0.31489f,0.05475f},{0.91572f,0.30530f,0.05134f},{0.91024f,0.29599f,0.04814f},{0.90463f,0.28696f,0.04516f},{0.89888f,0.27824f,0.04243f},{0.89298f,0.26981f,0.03993f},{0.88691f,0.26152f,0.03753f},{0.88066f,0.25334f,0.03521f},{0.87422f,0.24526f,0.03297f},{0.86760f,0.23730f,0.03082f},{0.86079f,0.22945f,0.02875f},{0.85380f,0.22170f,0.02677f},{0.84662f,0.21407f,0.02487f},{0.83926f,0.20654f,0.02305f},{0.83172f,0.19912f,0.02131f},{0.82399f,0.19182f,0.01966f},{0.81608f,0.18462f,0.01809f},{0.80799f,0.17753f,0.01660f},{0.79971f,0.17055f,0.01520f},{0.79125f,0.16368f,0.01387f},{0.78260f,0.15693f,0.01264f},{0.77377f,0.15028f,0.01148f},{0.76476f,0.14374f,0.01041f},{0.75556f,0.13731f,0.00942f},{0.74617f,0.13098f,0.00851f},{0.73661f,0.12477f,0.00769f},{0.72686f,0.11867f,0.00695f},{0.71692f,0.11268f,0.00629f},{0.70680f,0.10680f,0.00571f},{0.69650f,0.10102f,0.00522f},{0.68602f,0.09536f,0.00481f},{0.67535f,0.08980f,0.00449f},{0.66449f,0.08436f,0.00424f},{0.65345f,0.07902f,0.00408f},{0.64223f,0.07380f,0.00401f},{0.63082f,0.06868f,0.00401f},{0.61923f,0.06367f,0.00410f},{0.60746f,0.05878f,0.00427f},{0.59550f,0.05399f,0.00453f},{0.58336f,0.04931f,0.00486f},{0.57103f,0.04474f,0.00529f},{0.55852f,0.04028f,0.00579f},{0.54583f,0.03593f,0.00638f},{0.53295f,0.03169f,0.00705f},{0.51989f,0.02756f,0.00780f},{0.50664f,0.02354f,0.00863f},{0.49321f,0.01963f,0.00955f},{0.47960f,0.01583f,0.01055f}};
-		float minVal(FLT_MAX), maxVal(-FLT_MAX);
-		for (int y = 0; y < h; ++y)
-		for (int x = 0; x < w; ++x)
+	// NPY pads its header for alignment, but better be safe than crash on strict platforms
+	const unsigned char * pixels = file->data() + header.dataOffset;
+	vector<float> aligned;
+	if (header.dataOffset % sizeof(float) != 0)
+	{
+		aligned.resize(size_t(w) * h * n);
+		memcpy(aligned.data(), pixels, aligned.size() * sizeof(float));
+		pixels = (const unsigned char *) aligned.data();
+	}
+
+	// rows of C-order arrays are contiguous, which is exactly our column-major layout
+	if (n == 1 && aligned.empty())
+		img.setSingleChannel(file, (const float *) pixels, w, h, w);
+	else if (n == 1)
+		img.setSingleChannel(Eigen::Map<const HDRImage::Intensity>((const float *) pixels, w, h));
+	else
+	{
+		img.resize(w, h);
+		copyPixelsFromArray(img, (const float *) pixels, w, h, n, false, false);
+	}
+	return true;
+}
+
+/*!
+ * Find the channels to load from one part of an EXR file.
+ *
+ * Prefers R,G,B(,A) and then Y(,A) of the default layer, followed by the same of the first named layer that has
+ * them. Files with none of those (e.g. depth or other AOVs) load their first channel as a single-channel image,
+ * or their first three (or four) channels as RGB(A).
+ *
+ * @return The channel names for red, green, blue and alpha, only the first of which is set for single-channel
+ *         images. Empty if the part has no channels. Alpha need not exist in the file, in which case OpenEXR
+ *         fills it in; it is left empty only if RGB was made up of arbitrary channels.
+ */
+vector<string> chooseEXRChannels(const Imf::ChannelList & channels)
+{
+	set<string> layers;
+	channels.layers(layers);
+	vector<string> prefixes(1, "");
+	for (auto & layer : layers)
+		prefixes.push_back(layer + ".");
+
+	auto has = [&channels](const string & name) {return channels.findChannel(name.c_str()) != nullptr;};
+	for (auto & prefix : prefixes)
+	{
+		if (has(prefix + "R") && has(prefix + "G") && has(prefix + "B"))
+			return {prefix + "R", prefix + "G", prefix + "B", prefix + "A"};
+		if (has(prefix + "Y"))
+			return {prefix + "Y", "", "", ""};
+	}
+
+	vector<string> names;
+	for (auto c = channels.begin(); c != channels.end() && names.size() < 4; ++c)
+		names.push_back(c.name());
+	if (names.size() < 3)
+		names.resize(1);
+	names.resize(4);
+	return names;
+}
+
+// images larger than twice this in either dimension get a preview of about this size while they load
+const int PREVIEW_SIZE = 1024;
+
+bool needsPreview(int w, int h)
+{
+	return max(w, h) > 2 * PREVIEW_SIZE;
+}
+
+
+/*!
+ * Point the slices of the channels at the pixel data as it is laid out in the HDRImage (or in values, for single-
+ * channel images), offset by the data window origin. The image or the values are resized to the data window.
+ */
+Imf::FrameBuffer exrFrameBuffer(const vector<string> & names, const Imath::Box2i & dw,
+                                HDRImage & img, HDRImage::Intensity & values)
+{
+	int w = dw.max.x - dw.min.x + 1;
+	int h = dw.max.y - dw.min.y + 1;
+
+	Imf::FrameBuffer frameBuffer;
+	if (names[1].empty())
+	{
+		values.resize(w, h);
+		size_t xStride = sizeof(float), yStride = xStride * w;
+		char * base = (char *) values.data() - dw.min.x * xStride - dw.min.y * yStride;
+		frameBuffer.insert(names[0].c_str(), Imf::Slice(Imf::FLOAT, base, xStride, yStride));
+	}
+	else
+	{
+		img.resize(w, h);
+		if (names[3].empty())
+			img.setConstant(Color4(0.f, 0.f, 0.f, 1.f));
+		size_t xStride = sizeof(Color4), yStride = xStride * w;
+		char * base = (char *) img.data() - dw.min.x * xStride - dw.min.y * yStride;
+		for (int i = 0; i < 4; ++i)
+			// slices of channels missing from the file are set to the fill value (an opaque alpha)
+			if (!names[i].empty())
+				frameBuffer.insert(names[i].c_str(),
+				                   Imf::Slice(Imf::FLOAT, base + i * sizeof(float), xStride, yStride, 1, 1, 1.0));
+	}
+	return frameBuffer;
+}
+
+/*!
+ * A preview of one part of an EXR file, if the file makes it cheap to get one: the finest mip (or rip) level
+ * of a tiled part that is no larger than the preview size, or otherwise the preview image stored in the header.
+ *
+ * @return nullptr if the part has neither
+ */
+shared_ptr<HDRImage> readEXRPreview(Imf::MultiPartInputFile & file, int part, const vector<string> & names)
+{
+	TRACE_ZONE("readEXRPreview");
+	const Imf::Header & header = file.header(part);
+	if (header.hasTileDescription() && header.tileDescription().mode != Imf::ONE_LEVEL)
+	{
+		Imf::TiledInputPart input(file, part);
+		int numLevels = min(input.numXLevels(), input.numYLevels());
+		int level = 0;
+		while (level + 1 < numLevels && max(input.levelWidth(level), input.levelHeight(level)) > PREVIEW_SIZE)
+			++level;
+
+		if (level > 0)
 		{
-			const float p(data[x + y * w]);
-			if (p <= 0)
-				continue;
-			if (minVal > p)
-				minVal = p;
-			if (maxVal < p)
-				maxVal = p;
+			auto preview = make_shared<HDRImage>();
+			HDRImage::Intensity values;
+			input.setFrameBuffer(exrFrameBuffer(names, input.dataWindowForLevel(level, level), *preview, values));
+			input.readTiles(0, input.numXTiles(level) - 1, 0, input.numYTiles(level) - 1, level, level);
+			if (names[1].empty())
+				preview->setSingleChannel(move(values));
+			return preview;
 		}
-		const float delta(maxVal-minVal);
-		parallel_for(0, h, [&img,w,h,n,data,convertToLinear,flip,minVal,delta](int y)
+	}
+
+	if (header.hasPreviewImage())
+	{
+		// exrmakepreview exposes the values by 2^2.47393, compresses those above 1 with a knee (log(f x + 1) / f
+		// with f = 0.184874), and stores v = 84.66 x^0.4545 in 8 bits. Undo each of these steps
+		auto decode = [](unsigned char v)
+		{
+			const float f = 0.184874f;
+			float x = pow(v / 84.66f, 1.f / 0.4545f);
+			if (x > 1.f)
+				x = 1.f + (exp(f * (x - 1.f)) - 1.f) / f;
+			return x / pow(2.f, 2.47393f);
+		};
+		const Imf::PreviewImage & thumbnail = header.previewImage();
+		int w = int(thumbnail.width()), h = int(thumbnail.height());
+		const Imf::PreviewRgba * pixels = thumbnail.pixels();
+		auto preview = make_shared<HDRImage>(w, h);
+		parallel_for(0, h, [&](int y)
 		{
 			for (int x = 0; x < w; ++x)
 			{
-				const float p(data[x + y * w]);
-				if (p <= 0) {
-					img(x, flip?h-y-1:y) = Color4(0,0,0,0);
-					continue;
-				}
-				const float* const t(turboRGBf[(int)std::round(255.f*(p-minVal)/delta)]);
-				Color4 c(t[2],
-						 t[1],
-						 t[0],
-						 1.f);
-				img(x, flip?h-y-1:y) = SRGBToLinear(c);
+				const Imf::PreviewRgba & p = pixels[x + y * w];
+				(*preview)(x, y) = Color4(decode(p.r), decode(p.g), decode(p.b), p.a / 255.f);
 			}
 		});
-		#else
-		parallel_for(0, h, [&img,w,data,convertToLinear](int y)
+		return preview;
+	}
+
+	return nullptr;
+}
+
+/*!
+ * Find the first part of an EXR file that is neither deep nor empty, and the channels to load from it.
+ *
+ * @return The index of the part, or -1 if it uses luminance/chroma or subsampled channels, which need to go
+ *         through RgbaInputFile
+ */
+int chooseEXRPart(const Imf::MultiPartInputFile & file, vector<string> & names)
+{
+	int part = 0;
+	for (; part < file.parts(); ++part)
+	{
+		const Imf::Header & header = file.header(part);
+		if (header.hasType() && Imf::isDeepData(header.type()))
+			continue;
+		names = chooseEXRChannels(header.channels());
+		if (!names.empty() && !names[0].empty())
+			break;
+	}
+	if (part == file.parts())
+		throw runtime_error("EXR file contains no flat image data.");
+
+	const Imf::ChannelList & channels = file.header(part).channels();
+	if (channels.findChannel("RY") || channels.findChannel("BY"))
+		return -1;
+	for (auto & name : names)
+	{
+		const Imf::Channel * c = name.empty() ? nullptr : channels.findChannel(name.c_str());
+		if (c && (c->xSampling != 1 || c->ySampling != 1))
+			return -1;
+	}
+	return part;
+}
+
+/*!
+ * Load an EXR file by decoding the float data of its channels directly into the image buffer.
+ *
+ * Half and uint channels are converted to float by OpenEXR while decoding, so there is no intermediate copy.
+ * Loads the first part of multi-part files that is neither deep nor empty.
+ *
+ * @return False if the file uses luminance/chroma or subsampled channels, which need to go through RgbaInputFile
+ */
+bool loadEXRChannels(HDRImage & img, const string & filename, const HDRImage::PreviewCallback & preview)
+{
+	TRACE_ZONE("loadEXRChannels", filename);
+	auto console = spdlog::get("console");
+	Imf::MultiPartInputFile file(filename.c_str());
+
+	vector<string> names;
+	int part = chooseEXRPart(file, names);
+	if (part < 0)
+		return false;
+
+	const Imf::Header & header = file.header(part);
+	if (file.parts() > 1)
+		console->debug("Loading part {} of {} EXR parts.", part, file.parts());
+	console->debug("Loading EXR channels: {} {} {} {}.", names[0], names[1], names[2], names[3]);
+
+	Imath::Box2i dw = header.dataWindow();
+	int w = dw.max.x - dw.min.x + 1;
+	int h = dw.max.y - dw.min.y + 1;
+
+	if (preview && needsPreview(w, h))
+	{
+		try
+		{
+			if (auto p = readEXRPreview(file, part, names))
+				preview(p, w, h);
+		}
+		catch (const exception & e)
+		{
+			console->debug("Cannot read EXR preview: {}", e.what());
+		}
+	}
+
+	HDRImage::Intensity values;
+	bool singleChannel = names[1].empty();
+	Imf::InputPart input(file, part);
+	input.setFrameBuffer(exrFrameBuffer(names, dw, img, values));
+	input.readPixels(dw.min.y, dw.max.y);
+
+	if (singleChannel)
+	{
+		img.setSingleChannel(std::move(values));
+		return true;
+	}
+
+	// keep gray, opaque images as a single channel
+	for (int y = 0; y < h; ++y)
+		for (int x = 0; x < w; ++x)
+		{
+			const Color4 & p = img(x, y);
+			if (p.r != p.g || p.g != p.b || p.a != 1.f)
+				return true;
+		}
+
+	values.resize(w, h);
+	parallel_for(0, h, [&img,&values,w](int y)
+	{
+		for (int x = 0; x < w; ++x)
+			values(x, y) = img(x, y).r;
+	});
+	img.setSingleChannel(std::move(values));
+	return true;
+}
+
+/*!
+ * Decode only the scanlines [top,bottom) of an EXR file, like loadEXRChannels but without turning gray images
+ * into single-channel ones. For tiled files, only the rows of tiles covering the scanlines are decoded.
+ *
+ * @return False if the file needs to go through RgbaInputFile
+ */
+bool loadEXRRows(HDRImage & img, const string & filename, int top, int bottom)
+{
+	TRACE_ZONE("loadEXRRows");
+	Imf::MultiPartInputFile file(filename.c_str());
+
+	vector<string> names;
+	int part = chooseEXRPart(file, names);
+	if (part < 0)
+		return false;
+
+	Imath::Box2i dw = file.header(part).dataWindow();
+	if (top < 0 || top >= bottom || bottom > dw.max.y - dw.min.y + 1)
+		throw runtime_error("Scanlines out of range.");
+
+	Imath::Box2i rows(Imath::V2i(dw.min.x, dw.min.y + top), Imath::V2i(dw.max.x, dw.min.y + bottom - 1));
+	HDRImage::Intensity values;
+	Imf::InputPart input(file, part);
+	input.setFrameBuffer(exrFrameBuffer(names, rows, img, values));
+	input.readPixels(rows.min.y, rows.max.y);
+
+	if (names[1].empty())
+		img.setSingleChannel(std::move(values));
+	return true;
+}
+
+/*!
+ * Load an EXR file through the RGBA interface, which converts luminance/chroma images and subsampled
+ * channels to full-resolution RGBA halfs.
+ */
+void loadEXRRgba(HDRImage & img, const string & filename)
+{
+	TRACE_ZONE("loadEXRRgba");
+	Imf::RgbaInputFile file(filename.c_str());
+	Imath::Box2i dw = file.dataWindow();
+
+	int w = dw.max.x - dw.min.x + 1;
+	int h = dw.max.y - dw.min.y + 1;
+
+	Imf::Array2D<Imf::Rgba> pixels(h, w);
+
+	file.setFrameBuffer(&pixels[0][0] - dw.min.x - dw.min.y * w, 1, w);
+	file.readPixels(dw.min.y, dw.max.y);
+
+	if (file.channels() & Imf::WRITE_C)
+	{
+		img.resize(w, h);
+		parallel_for(0, h, [&img,w,&pixels](int y)
 		{
 			for (int x = 0; x < w; ++x)
 			{
-				const float v(data[x + y * w]);
-				const Color4 c(v,v,v,1.f);
-				img(x, y) = convertToLinear ? SRGBToLinear(c) : c;
+				const Imf::Rgba &p = pixels[y][x];
+				img(x, y) = Color4(p.r, p.g, p.b, p.a);
 			}
 		});
-		#endif
-	} else {
-		parallel_for(0, h, [&img,w,h,n,data,convertToLinear,flip](int y)
+	}
+	else
+	{
+		// keep the luminance as a single-channel image
+		HDRImage::Intensity data(w, h);
+		parallel_for(0, h, [&data,w,&pixels](int y)
 		{
 			for (int x = 0; x < w; ++x)
-			{
-				Color4 c(data[n * (x + y * w) + 0],
-						 data[n * (x + y * w) + 1],
-						 data[n * (x + y * w) + 2],
-						 (n == 3) ? 1.f : data[4 * (x + y * w) + 3]);
-				img(x, flip?h-y-1:y) = convertToLinear ? SRGBToLinear(c) : c;
-			}
+				data(x, y) = float(pixels[y][x].r);
 		});
+		img.setSingleChannel(std::move(data));
 	}
 }
 
+/*!
+ * A tonemapping curve on [0,1], tabulated for fast evaluation.
+ *
+ * The table is indexed by the exponent and the top mantissa bits of the input, so it is just as accurate for the
+ * dark values, where gamma curves are steep, as for the bright ones. Linear interpolation within each of the
+ * 256 segments per octave keeps the relative error well below that of 16-bit output. Values above one, which
+ * dithering must not pull back below white, are passed to the curve itself.
+ */
+class ToneCurve
+{
+public:
+    explicit ToneCurve(const function<float(float)> & f) : m_f(f), m_table(NUM_OCTAVES * SEGMENTS + 1)
+    {
+        for (int i = 0; i < NUM_OCTAVES * SEGMENTS; ++i)
+            m_table[i] = f(ldexp(1.f + float(i % SEGMENTS) / SEGMENTS, i / SEGMENTS - NUM_OCTAVES));
+        m_table.back() = f(1.f);
+    }
+
+    float operator()(float x) const
+    {
+        // also maps NaNs to zero
+        if (!(x > MIN_VALUE))
+            return x > 0.f ? x * (m_table[0] / MIN_VALUE) : 0.f;
+        if (x >= 1.f)
+            return m_f(x);
+
+        uint32_t bits;
+        memcpy(&bits, &x, sizeof(float));
+        int octave = int(bits >> 23) - 127 + NUM_OCTAVES;
+        int i = octave * SEGMENTS + int((bits >> (23 - SEGMENT_BITS)) & (SEGMENTS - 1));
+        float t = float(bits & ((1 << (23 - SEGMENT_BITS)) - 1)) * (1.f / (1 << (23 - SEGMENT_BITS)));
+        return m_table[i] + t * (m_table[i + 1] - m_table[i]);
+    }
+
+private:
+    static const int NUM_OCTAVES = 32, SEGMENT_BITS = 8, SEGMENTS = 1 << SEGMENT_BITS;
+    static constexpr float MIN_VALUE = 1.f / 4294967296.f; // 2^-NUM_OCTAVES
+    function<float(float)> m_f;
+    vector<float> m_table;
+};
+
+constexpr float ToneCurve::MIN_VALUE;
+
+/*!
+ * Apply the gain and tonemapping curve (if any), dither with one step of T's range, and quantize to the
+ * integer type T, all in a single pass over the pixels. Writes row-major RGB.
+ */
+template <typename T>
+void tonemapAndQuantize(const HDRImage & img, T * data, float gain, const ToneCurve * curve, bool dither)
+{
+    TRACE_ZONE("tonemapAndQuantize");
+    const float maxValue = float(numeric_limits<T>::max());
+    int w = img.width();
+    parallel_for(BlockedRange(0, img.height()), [&img,data,gain,curve,dither,maxValue,w](int y0, int y1)
+    {
+        for (int y = y0; y < y1; ++y)
+        {
+            T * out = data + 3 * size_t(y) * w;
+            for (int x = 0; x < w; ++x)
+            {
+                Color4 c = img.color(x, y);
+                float ditherValue = 0.f;
+                if (dither)
+                    ditherValue = (dither_matrix256[x % 256 + (y % 256) * 256] / 65536.0f - 0.5f) / maxValue;
+
+                for (int i = 0; i < 3; ++i)
+                {
+                    float v = c[i] * gain;
+                    if (curve)
+                        v = (*curve)(v);
+                    // convert to [0-maxValue] range
+                    v = (v + ditherValue) * maxValue;
+                    out[3 * x + i] = (T) (v > 0.f ? (v < maxValue ? v : maxValue) : 0.f);
+                }
+            }
+        }
+    });
+}
+
 bool isSTBImage(const string & filename)
 {
 	FILE *f = stbi__fopen(filename.c_str(), "rb");
@@ -176,8 +709,187 @@ bool isSTBImage(const string & filename)
 } // namespace
 
 
-bool HDRImage::load(const string & filename)
+/*!
+ * A quick preview of a large image, which fits in size x size pixels when downsampled by an integer factor.
+ *
+ * Each preview pixel averages a 4x4 grid of samples from the block of pixels it covers, instead of all of them,
+ * so this takes a small fraction of the time of a pass over the whole image. The raw values of single-channel
+ * images are point sampled, since blending them (e.g. depths or ids) would make up values.
+ */
+shared_ptr<HDRImage> downsampledPreview(const HDRImage & img, int size)
 {
+	TRACE_ZONE("downsampledPreview");
+	const int S = 4;
+	int w = img.width(), h = img.height();
+	int step = (max(w, h) + size - 1) / size;
+	int pw = max(1, w / step), ph = max(1, h / step);
+
+	auto preview = make_shared<HDRImage>();
+	if (img.isSingleChannel())
+	{
+		auto values = img.intensity();
+		HDRImage::Intensity sampled(pw, ph);
+		parallel_for(0, ph, [&](int y)
+		{
+			for (int x = 0; x < pw; ++x)
+				sampled(x, y) = values(min(w - 1, x * step + step / 2), min(h - 1, y * step + step / 2));
+		});
+		preview->setSingleChannel(move(sampled));
+		return preview;
+	}
+
+	preview->resize(pw, ph);
+	parallel_for(0, ph, [&](int y)
+	{
+		for (int x = 0; x < pw; ++x)
+		{
+			Color4 sum(0.f);
+			for (int j = 0; j < S; ++j)
+				for (int i = 0; i < S; ++i)
+					sum += img(min(w - 1, x * step + (2 * i + 1) * step / (2 * S)),
+					           min(h - 1, y * step + (2 * j + 1) * step / (2 * S)));
+			(*preview)(x, y) = sum / float(S * S);
+		}
+	});
+	return preview;
+}
+
+
+void copyPixelsFromArray(HDRImage & img, const float * data, int w, int h, int n, bool convertToLinear, bool flip)
+{
+	TRACE_ZONE("copyPixelsFromArray");
+	if (n != 3 && n != 4)
+		throw runtime_error("Only 3- and 4-channel images are supported.");
+
+	// for every pixel in the image
+	parallel_for(BlockedRange(0, h), [&img,w,h,n,data,convertToLinear,flip](int y0, int y1)
+	{
+		vector<float> linear(convertToLinear ? size_t(n) * w : 0);
+		for (int y = y0; y < y1; ++y)
+		{
+			// linearize whole scanlines at once (including alpha, which we then ignore)
+			const float * row = data + size_t(n) * w * y;
+			if (convertToLinear)
+				SRGBToLinear(row, linear.data(), linear.size());
+			const float * rgb = convertToLinear ? linear.data() : row;
+
+			for (int x = 0; x < w; ++x)
+				img(x, flip?h-y-1:y) = Color4(rgb[n * x + 0],
+				                              rgb[n * x + 1],
+				                              rgb[n * x + 2],
+				                              (n == 3) ? 1.f : row[4 * x + 3]);
+		}
+	});
+}
+
+
+bool HDRImage::load(const string & filename, const PreviewCallback & preview)
+{
+	TRACE_ZONE("HDRImage::load", filename);
+	// remember whether the file provided a preview, otherwise compute one before handing back the full image
+	bool previewed = false;
+	PreviewCallback filePreview;
+	if (preview)
+		filePreview = [&previewed,&preview](const shared_ptr<const HDRImage> & p, int w, int h)
+		{
+			previewed = true;
+			preview(p, w, h);
+		};
+
+	if (!loadFile(filename, filePreview))
+		return false;
+
+	if (preview && !previewed && needsPreview(width(), height()))
+		preview(downsampledPreview(*this, PREVIEW_SIZE), width(), height());
+	return true;
+}
+
+bool HDRImage::loadRows(const string & filename, int top, int bottom)
+{
+	TRACE_ZONE("HDRImage::loadRows", filename);
+	auto console = spdlog::get("console");
+	setSingleChannel(Intensity());
+
+	try
+	{
+		if (loadMappedPFM(*this, filename, top, bottom))
+			return true;
+		if (Imf::isOpenExrFile(filename.c_str()))
+		{
+			Imf::setGlobalThreadCount(ThreadPool::instance().numThreads());
+			if (loadEXRRows(*this, filename, top, bottom))
+				return true;
+		}
+	}
+	catch (const exception &e)
+	{
+		setSingleChannel(Intensity());
+		console->debug("Cannot read scanlines [{},{}) of \"{}\" directly: {}", top, bottom, filename, e.what());
+	}
+
+	// otherwise load the whole image and crop it
+	HDRImage full;
+	if (!full.loadFile(filename, PreviewCallback()))
+		return false;
+	if (top < 0 || top >= bottom || bottom > full.height())
+	{
+		console->error("Image \"{}\" has no scanlines [{},{}).", filename, top, bottom);
+		return false;
+	}
+
+	if (full.isSingleChannel())
+		setSingleChannel(Intensity(full.intensity().middleCols(top, bottom - top)));
+	else
+		*this = full.middleCols(top, bottom - top);
+	return true;
+}
+
+bool HDRImage::readSize(const string & filename, int & width, int & height)
+{
+	TRACE_ZONE("HDRImage::readSize", filename);
+	try
+	{
+		int n;
+		if (isSTBImage(filename) && stbi_info(filename.c_str(), &width, &height, &n))
+			return true;
+
+		MappedFile file(filename);
+		if (hasPFMSignature(file.data(), file.size()))
+		{
+			PFMHeader header = parsePFMHeader(file.data(), file.size());
+			width = header.width;
+			height = header.height;
+			return true;
+		}
+
+		if (Imf::isOpenExrFile(filename.c_str()))
+		{
+			Imf::MultiPartInputFile exr(filename.c_str());
+			vector<string> names;
+			int part = max(0, chooseEXRPart(exr, names));
+			Imath::Box2i dw = exr.header(part).dataWindow();
+			width = dw.max.x - dw.min.x + 1;
+			height = dw.max.y - dw.min.y + 1;
+			return true;
+		}
+	}
+	catch (const exception &e)
+	{
+		spdlog::get("console")->debug("Cannot read the size of \"{}\" from its header: {}", filename, e.what());
+	}
+
+	// otherwise load the whole image
+	HDRImage full;
+	if (!full.loadFile(filename, PreviewCallback()))
+		return false;
+	width = full.width();
+	height = full.height();
+	return true;
+}
+
+bool HDRImage::loadFile(const string & filename, const PreviewCallback & preview)
+{
+	TRACE_ZONE("HDRImage::loadFile");
 	auto console = spdlog::get("console");
     string errors;
 	string extension = getExtension(filename);
@@ -188,100 +900,52 @@ bool HDRImage::load(const string & filename)
 
     int n, w, h;
 
+	// drop the raw values of a previously loaded single-channel image
+	setSingleChannel(Intensity());
+
 	// try stb library first
 	if (isSTBImage(filename))
 	{
-		// stbi doesn't do proper srgb, but uses gamma=2.2 instead, so override it.
-		// we'll do our own srgb correction
-		stbi_ldr_to_hdr_scale(1.0f);
-		stbi_ldr_to_hdr_gamma(1.0f);
-
-		float * float_data = stbi_loadf(filename.c_str(), &w, &h, &n, 4);
-		if (n == 1 && filename.size()>5 && filename.substr(filename.size()-4)==".png") {
-			FILE *f = stbi__fopen(filename.c_str(), "rb");
-			stbi__context s;
-			stbi__start_file(&s,f);
-			stbi__result_info ri;
-			void *result = stbi__load_main(&s, &w, &h, &n, 1, &ri, 8);
-			fclose(f);
-			if (ri.bits_per_channel == 16) {
-				stbi_image_free(float_data);
-				resize(w, h);
-
-				Timer timer;
-				// convert 1-channel PNG data to 4-channel internal representation
-				const uint16_t* data16 = (const uint16_t*)result;
-				Intensity& data = intensity();
-				data.resize(w, h);
-				for (int y=0; y<h; ++y)
-					for (int x=0; x<w; ++x)
-						if ((data(x,y) = ((float)data16[y*w+x]) / 1000.f) > 5.f)
-							data(x,y) = 0.f;
-				copyPixelsFromArray(*this, data.data(), w, h, n, false, false);
-				console->debug("Copying image data took: {} seconds.", (timer.elapsed() / 1000.f));
-
-				return true;
-			}
-		}
-		if (float_data)
+		try
 		{
-			resize(w, h);
-			bool convertToLinear = !stbi_is_hdr(filename.c_str());
 			Timer timer;
-			copyPixelsFromArray(*this, float_data, w, h, 4, convertToLinear, false);
-			console->debug("Copying image data took: {} seconds.", (timer.elapsed()/1000.f));
-
-			stbi_image_free(float_data);
+			if (stbi_is_hdr(filename.c_str()))
+			{
+				float * float_data = stbi_loadf(filename.c_str(), &w, &h, &n, 4);
+				if (!float_data)
+					throw runtime_error(stbi_failure_reason());
+				resize(w, h);
+				copyPixelsFromArray(*this, float_data, w, h, 4, false, false);
+				stbi_image_free(float_data);
+			}
+			else
+				loadSTBIntegerImage(*this, filename, extension == "png");
+			console->debug("Loading image data took: {} seconds.", (timer.elapsed()/1000.f));
 			return true;
 		}
-		else
+		catch (const exception &e)
 		{
-			errors += string("\t") + stbi_failure_reason() + "\n";
+			setSingleChannel(Intensity());
+			errors += string("\t") + e.what() + "\n";
 		}
 	}
 
 
-    // then try pfm
-	if (isPFMImage(filename.c_str()))
+    // then try pfm, whose header is only parsed once, from the mapped file
+    try
     {
-	    float * float_data = 0;
-	    try
+	    Timer timer;
+	    if (loadMappedPFM(*this, filename))
 	    {
-		    w = 0;
-		    h = 0;
-
-		    if ((float_data = loadPFMImage(filename.c_str(), &w, &h, &n)))
-		    {
-			    if (n == 3 || n == 1)
-			    {
-				    resize(w, h);
-
-				    Timer timer;
-					if (n == 1)
-					{
-						Intensity& data = intensity();
-						data.resize(w, h);
-						data = Eigen::Map<const Intensity>(float_data, w,h).rowwise().reverse();
-					}
-					// convert 1- 3-channel pfm data to 4-channel internal representation
-				    copyPixelsFromArray(*this, float_data, w, h, n, false, true);
-				    console->debug("Copying image data took: {} seconds.", (timer.elapsed() / 1000.f));
-			    }
-			    else
-				    throw runtime_error("Only 3-channel or 1-channel PFMs are currently supported.");
-				delete [] float_data;
-			    return true;
-		    }
-		    else
-			    throw runtime_error("Could not load PFM image.");
-	    }
-	    catch (const exception &e)
-	    {
-		    delete [] float_data;
-		    resize(0, 0);
-		    errors += string("\t") + e.what() + "\n";
+		    console->debug("Copying image data took: {} seconds.", (timer.elapsed() / 1000.f));
+		    return true;
 	    }
     }
+    catch (const exception &e)
+    {
+	    setSingleChannel(Intensity());
+	    errors += string("\t") + e.what() + "\n";
+    }
 
 
     // then try npy
@@ -289,6 +953,13 @@ bool HDRImage::load(const string & filename)
     {
 		try
 	    {
+			Timer timer;
+			if (loadMappedNPY(*this, filename))
+			{
+				console->debug("Copying image data took: {} seconds.", (timer.elapsed() / 1000.f));
+				return true;
+			}
+
 			NpyArray arr;
 			if (arr.LoadNPY(filename.c_str()) != NULL)
 				throw runtime_error("Could not load NPY image.");
@@ -299,17 +970,14 @@ bool HDRImage::load(const string & filename)
 			n = arr.Shape().size() == 2 ? 1 : arr.Shape()[2];
 			if ((n == 3 || n == 4 || n == 1) && arr.ValueType() == typeid(float))
 			{
-				resize(w, h);
-
-				Timer timer;
-				if (n == 1 && arr.ValueType() == typeid(float))
+				if (n == 1)
+					setSingleChannel(Eigen::Map<const Intensity>((float*)arr.Data(), w,h));
+				else
 				{
-					Intensity& data = intensity();
-					data.resize(w, h);
-					data = Eigen::Map<const Intensity>((float*)arr.Data(), w,h);
+					// convert 3- 4-channel NPY data to 4-channel internal representation
+					resize(w, h);
+					copyPixelsFromArray(*this, (float*)arr.Data(), w, h, n, false, false);
 				}
-				// convert 1- 3-channel NPY data to 4-channel internal representation
-				copyPixelsFromArray(*this, (float*)arr.Data(), w, h, n, false, false);
 				console->debug("Copying image data took: {} seconds.", (timer.elapsed() / 1000.f));
 
 				return true;
@@ -321,7 +989,7 @@ bool HDRImage::load(const string & filename)
 	    }
 	    catch (const exception &e)
 	    {
-		    resize(0, 0);
+		    setSingleChannel(Intensity());
 		    errors += string("\t") + e.what() + "\n";
 	    }
     }
@@ -333,243 +1001,229 @@ bool HDRImage::load(const string & filename)
 	    {
 		    // FIXME: the threading below seems to cause issues, but shouldn't.
 		    // turning off for now
-		    Imf::setGlobalThreadCount(thread::hardware_concurrency());
+		    Imf::setGlobalThreadCount(ThreadPool::instance().numThreads());
 		    Timer timer;
 
-		    Imf::RgbaInputFile file(filename.c_str());
-		    Imath::Box2i dw = file.dataWindow();
+		    if (!loadEXRChannels(*this, filename, preview))
+			    loadEXRRgba(*this, filename);
+
+		    console->debug("Reading EXR image took: {} seconds.", (timer.elapsed() / 1000.f));
+		    return true;
+	    }
+	    catch (const exception &e)
+	    {
+		    setSingleChannel(Intensity());
+		    errors += string("\t") + e.what() + "\n";
+	    }
+    }
+
+	try
+	{
+		loadDNG(filename, s_dngDevelop, preview);
+		return true;
+	}
+	catch (const exception &e)
+	{
+		resize(0,0);
+		// only report errors to the user if the extension was actually dng
+		if (extension == "dng")
+			errors += string("\t") + e.what() + "\n";
+	}
 
-		    w = dw.max.x - dw.min.x + 1;
-		    h = dw.max.y - dw.min.y + 1;
+    console->error("ERROR: Unable to read image file \"{}\":\n{}", filename, errors);
 
-		    Imf::Array2D<Imf::Rgba> pixels(h, w);
+    return false;
+}
 
-		    file.setFrameBuffer(&pixels[0][0] - dw.min.x - dw.min.y * w, 1, w);
-		    file.readPixels(dw.min.y, dw.max.y);
 
-		    console->debug("Reading EXR image took: {} seconds.", (timer.lap() / 1000.f));
+bool HDRImage::developDNG(const string & filename)
+{
+	TRACE_ZONE("HDRImage::developDNG", filename);
+	try
+	{
+		loadDNG(filename, DNG_FULL, PreviewCallback());
+		return true;
+	}
+	catch (const exception &e)
+	{
+		resize(0,0);
+		spdlog::get("console")->error("ERROR: Unable to develop DNG file \"{}\":\n\t{}", filename, e.what());
+		return false;
+	}
+}
 
-		    resize(w, h);
+void HDRImage::loadDNG(const string & filename, DNGDevelop mode, const PreviewCallback & preview)
+{
+	TRACE_ZONE("HDRImage::loadDNG");
+	auto console = spdlog::get("console");
+	setSingleChannel(Intensity());
 
-			if (file.channels() == Imf::WRITE_Y) {
-				// convert intensity to RGB pixels over to the Image
-				Intensity& data = intensity();
-				data.resize(w, h);
-				parallel_for(0, h, [&data, w, &pixels](int y)
-				{
-					for (int x = 0; x < w; ++x)
-					{
-						const Imf::Rgba &p = pixels[y][x];
-						data(x,y) = float(p.r);
-					}
-				});
-				copyPixelsFromArray(*this, data.data(), w, h, 1, false, false);
-			} else {
-				for (int y = 0; y < h; ++y)
-					for (int x = 0; x < w; ++x)
-					{
-						const Imf::Rgba &p = pixels[y][x];
-						if (p.r != p.g || p.g != p.b)
-							goto ProcessRGB;
-					}
-				ProcessIntensity:
-				// copy intensity image
-				{
-					Intensity& data = intensity();
-					data.resize(w, h);
-					for (int y = 0; y < h; ++y)
-						for (int x = 0; x < w; ++x)
-						{
-							const Imf::Rgba &p = pixels[y][x];
-							const float v(p.r);
-							data(x,y) = v;
-						}
-					// convert 1- exr data to 4-channel internal representation
-					copyPixelsFromArray(*this, data.data(), w, h, 1, false, false);
-					goto ProcessEnd;
-				}
-				ProcessRGB:
-				// copy pixels over to the Image
-				parallel_for(0, h, [this, w, &pixels](int y)
-				{
-					for (int x = 0; x < w; ++x)
-					{
-						const Imf::Rgba &p = pixels[y][x];
-						(*this)(x, y) = Color4(p.r, p.g, p.b, p.a);
-					}
-				});
-				ProcessEnd:;
-			}
+	vector<tinydng::DNGImage> images;
+	{
+		std::string err;
+		vector<tinydng::FieldInfo> customFields;
+		bool ret = tinydng::LoadDNG(filename.c_str(), customFields, &images, &err);
 
-		    console->debug("Copying EXR image data took: {} seconds.", (timer.lap() / 1000.f));
-		    return true;
-	    }
-	    catch (const exception &e)
-	    {
-		    resize(0, 0);
-		    errors += string("\t") + e.what() + "\n";
-	    }
-    }
+		if (ret == false)
+			throw runtime_error("Failed to load DNG. " + err);
+	}
 
-	try
+	// DNG files sometimes only store the orientation in one of the images,
+	// instead of all of them. find any set value and save it
+	int orientation = 0;
+	for (size_t i = 0; i < images.size(); i++)
 	{
-		vector<tinydng::DNGImage> images;
-		{
-			std::string err;
-			vector<tinydng::FieldInfo> customFields;
-			bool ret = tinydng::LoadDNG(filename.c_str(), customFields, &images, &err);
-
-			if (ret == false)
-				throw runtime_error("Failed to load DNG. " + err);
-		}
+		console->debug("Image [{}] size = {} x {}.", i, images[i].width, images[i].height);
+		console->debug("Image [{}] orientation = {}", i, images[i].orientation);
+		if (images[i].orientation != 0)
+			orientation = images[i].orientation;
+	}
 
-		// DNG files sometimes only store the orientation in one of the images,
-		// instead of all of them. find any set value and save it
-		int orientation = 0;
+	// Find largest image based on width.
+	size_t imageIndex = size_t(-1);
+	{
+		size_t largest = 0;
+		int largestWidth = images[0].width;
 		for (size_t i = 0; i < images.size(); i++)
 		{
-			console->debug("Image [{}] size = {} x {}.", i, images[i].width, images[i].height);
-			console->debug("Image [{}] orientation = {}", i, images[i].orientation);
-			if (images[i].orientation != 0)
-				orientation = images[i].orientation;
-		}
-
-		// Find largest image based on width.
-		size_t imageIndex = size_t(-1);
-		{
-			size_t largest = 0;
-			int largestWidth = images[0].width;
-			for (size_t i = 0; i < images.size(); i++)
+			if (largestWidth < images[i].width)
 			{
-				if (largestWidth < images[i].width)
-				{
-					largest = i;
-					largestWidth = images[i].width;
-				}
+				largest = i;
+				largestWidth = images[i].width;
 			}
-
-			imageIndex = largest;
 		}
-		tinydng::DNGImage & image = images[imageIndex];
 
+		imageIndex = largest;
+	}
+	tinydng::DNGImage & image = images[imageIndex];
 
-		console->debug("\nLargest image within DNG:");
-		printImageInfo(image);
-		console->debug("\nLast image within DNG:");
-		printImageInfo(images.back());
 
-		console->debug("Loading image [{}].", imageIndex);
+	console->debug("\nLargest image within DNG:");
+	printImageInfo(image);
+	console->debug("\nLast image within DNG:");
+	printImageInfo(images.back());
 
-		w = image.width;
-		h = image.height;
+	console->debug("Loading image [{}].", imageIndex);
 
-		// Convert to float.
-		vector<float> hdr;
-		bool endianSwap = false;        // TODO
+	int w = image.width;
+	int h = image.height;
 
-		int spp = image.samples_per_pixel;
-		if (image.bits_per_sample == 12)
-			decode12BitToFloat(hdr, &(image.data.at(0)), w, h * spp, endianSwap);
-		else if (image.bits_per_sample == 14)
-			decode14BitToFloat(hdr, &(image.data.at(0)), w, h * spp, endianSwap);
-		else if (image.bits_per_sample == 16)
-			decode16BitToFloat(hdr, &(image.data.at(0)), w, h * spp, endianSwap);
-		else
-			throw runtime_error("Error loading DNG: Unsupported bits_per_sample : " + to_string(spp));
+	// Convert to float.
+	vector<float> hdr;
+	bool endianSwap = false;        // TODO
+
+	int spp = image.samples_per_pixel;
+	if (image.bits_per_sample == 12)
+		decode12BitToFloat(hdr, &(image.data.at(0)), w, h * spp, endianSwap);
+	else if (image.bits_per_sample == 14)
+		decode14BitToFloat(hdr, &(image.data.at(0)), w, h * spp, endianSwap);
+	else if (image.bits_per_sample == 16)
+		decode16BitToFloat(hdr, &(image.data.at(0)), w, h * spp, endianSwap);
+	else
+		throw runtime_error("Error loading DNG: Unsupported bits_per_sample : " + to_string(spp));
 
-		float invScale = 1.0f / static_cast<float>((1 << image.bits_per_sample));
-		if (spp == 3)
+	int startRow = clamp(image.active_area[1], 0, w);
+	int endRow = clamp(image.active_area[3], 0, w);
+	int startCol = clamp(image.active_area[0], 0, h);
+	int endCol = clamp(image.active_area[2], 0, h);
+
+	float invScale = 1.0f / static_cast<float>((1 << image.bits_per_sample));
+	if (spp == 3)
+	{
+		console->debug("Decoding a 3 sample-per-pixel DNG image.");
+		// normalize
+		parallel_for(0, hdr.size(), [&hdr,invScale](int i)
 		{
-			console->debug("Decoding a 3 sample-per-pixel DNG image.");
-			// normalize
-			parallel_for(0, hdr.size(), [&hdr,invScale](int i)
-			{
-				hdr[i] *= invScale;
-			});
+			hdr[i] *= invScale;
+		});
 
-			// Create color image & normalize intensity.
-			resize(w, h);
+		// Create color image & normalize intensity.
+		resize(w, h);
 
-			Timer timer;
-			// normalize
-			parallel_for(0, h, [this,w,invScale,&hdr](int y)
+		Timer timer;
+		// normalize
+		parallel_for(0, h, [this,w,invScale,&hdr](int y)
+		{
+			for (int x = 0; x < w; ++x)
 			{
-				for (int x = 0; x < w; ++x)
-				{
-					int index = 3 * y * w + x;
-					(*this)(x, y) = Color4(hdr[index] * invScale + 0,
-					                       hdr[index] * invScale + 1,
-					                       hdr[index] * invScale + 2, 1.0f);
-				}
-			});
-			console->debug("Copying image data took: {} seconds.", (timer.elapsed()/1000.f));
-		}
-		else if (spp == 1)
+				int index = 3 * y * w + x;
+				(*this)(x, y) = Color4(hdr[index] * invScale + 0,
+				                       hdr[index] * invScale + 1,
+				                       hdr[index] * invScale + 2, 1.0f);
+			}
+		});
+		console->debug("Copying image data took: {} seconds.", (timer.elapsed()/1000.f));
+	}
+	else if (spp == 1)
+	{
+		// Create grayscale image & normalize intensity.
+		console->debug("Decoding a 1 sample-per-pixel DNG image.");
+
+		// the binned image is the result in preview mode, and otherwise something to show during the demosaicing
+		bool previewFirst = preview && needsPreview(endRow - startRow, endCol - startCol);
+		if (mode == DNG_PREVIEW || previewFirst)
 		{
-			// Create grayscale image & normalize intensity.
-			console->debug("Decoding a 1 sample-per-pixel DNG image.");
-			Timer timer;
-			*this = develop(hdr, image, images.back());
-			console->debug("Copying image data took: {} seconds.", (timer.elapsed()/1000.f));
+			HDRImage binned = orientedDNG(developPreview(hdr, image, images.back()), orientation);
+			if (mode == DNG_PREVIEW)
+			{
+				*this = std::move(binned);
+				return;
+			}
+			bool swapped = orientation >= ORIENTATION_LEFTTOP && orientation <= ORIENTATION_LEFTBOT;
+			preview(downsampledPreview(binned, PREVIEW_SIZE),
+			        swapped ? endCol - startCol : endRow - startRow,
+			        swapped ? endRow - startRow : endCol - startCol);
 		}
-		else
-			throw runtime_error("Error loading DNG: Unsupported samples per pixel: " + to_string(spp));
 
+		Timer timer;
+		*this = develop(hdr, image, images.back());
+		console->debug("Copying image data took: {} seconds.", (timer.elapsed()/1000.f));
+	}
+	else
+		throw runtime_error("Error loading DNG: Unsupported samples per pixel: " + to_string(spp));
+
+	*this = orientedDNG(block(startRow, startCol,
+	                          endRow-startRow,
+	                          endCol-startCol).eval(), orientation);
+}
 
-		int startRow = clamp(image.active_area[1], 0, w);
-		int endRow = clamp(image.active_area[3], 0, w);
-		int startCol = clamp(image.active_area[0], 0, h);
-		int endCol = clamp(image.active_area[2], 0, h);
 
-		*this = block(startRow, startCol,
-		              endRow-startRow,
-		              endCol-startCol).eval();
+HDRImage::EXRCompression HDRImage::s_exrCompression = HDRImage::EXR_ZIP;
+bool HDRImage::s_exrHalf = true;
+int HDRImage::s_pngLevel = 6;
+bool HDRImage::s_png16Bit = false;
+int HDRImage::s_jpegQuality = 100;
+HDRImage::DNGDevelop HDRImage::s_dngDevelop = HDRImage::DNG_FULL;
 
-		enum Orientations
+const vector<string> & HDRImage::exrCompressionNames()
+{
+	static const vector<string> names =
 		{
-			ORIENTATION_TOPLEFT = 1,
-			ORIENTATION_TOPRIGHT = 2,
-			ORIENTATION_BOTRIGHT = 3,
-			ORIENTATION_BOTLEFT = 4,
-			ORIENTATION_LEFTTOP = 5,
-			ORIENTATION_RIGHTTOP = 6,
-			ORIENTATION_RIGHTBOT = 7,
-			ORIENTATION_LEFTBOT = 8
+			"None",
+			"ZIPS",
+			"ZIP",
+			"PIZ",
+			"DWAA",
+			"B44"
 		};
+	return names;
+}
 
-		// now rotate image based on stored orientation
-		switch (orientation)
+const vector<string> & HDRImage::dngDevelopNames()
+{
+	static const vector<string> names =
 		{
-			case ORIENTATION_TOPRIGHT: *this = flippedHorizontal(); break;
-			case ORIENTATION_BOTRIGHT: *this = flippedVertical().flippedHorizontal(); break;
-			case ORIENTATION_BOTLEFT : *this = flippedVertical(); break;
-			case ORIENTATION_LEFTTOP : *this = rotated90CCW().flippedVertical(); break;
-			case ORIENTATION_RIGHTTOP: *this = rotated90CW(); break;
-			case ORIENTATION_RIGHTBOT: *this = rotated90CW().flippedVertical(); break;
-			case ORIENTATION_LEFTBOT : *this = rotated90CCW(); break;
-			default: break;// none (0), or ORIENTATION_TOPLEFT
-		}
-
-		return true;
-	}
-	catch (const exception &e)
-	{
-		resize(0,0);
-		// only report errors to the user if the extension was actually dng
-		if (extension == "dng")
-			errors += string("\t") + e.what() + "\n";
-	}
-
-    console->error("ERROR: Unable to read image file \"{}\":\n{}", filename, errors);
-
-    return false;
+			"full",
+			"preview"
+		};
+	return names;
 }
 
 
-shared_ptr<HDRImage> loadImage(const string & filename)
+shared_ptr<HDRImage> loadImage(const string & filename, const HDRImage::PreviewCallback & preview)
 {
 	shared_ptr<HDRImage> ret = make_shared<HDRImage>();
-	if (ret->load(filename))
+	if (ret->load(filename, preview))
 		return ret;
 	return nullptr;
 }
@@ -579,6 +1233,7 @@ bool HDRImage::save(const string & filename,
                     float gain, float gamma,
                     bool sRGB, bool dither) const
 {
+	TRACE_ZONE("HDRImage::save", filename);
 	auto console = spdlog::get("console");
     string extension = getExtension(filename);
 
@@ -587,120 +1242,155 @@ bool HDRImage::save(const string & filename,
               extension.begin(),
               ::tolower);
 
-    auto img = this;
-    HDRImage imgCopy;
-
     bool hdrFormat = (extension == "hdr") || (extension == "pfm") || (extension == "exr");
 
-    // if we need to tonemap, then modify a copy of the image data
-    if (gain != 1.0f || sRGB || gamma != 1.0f)
+    // single-channel PFMs keep the raw values, other formats get the false colors
+    if (extension == "pfm" && isSingleChannel())
     {
-        Color4 gainC = Color4(gain, gain, gain, 1.0f);
-        Color4 gammaC = Color4(1.0f / gamma, 1.0f / gamma, 1.0f / gamma, 1.0f);
-
-        imgCopy = *this;
-        img = &imgCopy;
-
-        if (gain != 1.0f)
-            imgCopy *= gainC;
-
-        // only do gamma or sRGB tonemapping if we are saving to an LDR format
-        if (!hdrFormat)
-        {
-            if (sRGB)
-                imgCopy = imgCopy.unaryExpr(ptr_fun((Color4 (*)(const Color4 &)) LinearToSRGB));
-            else if (gamma != 1.0f)
-                imgCopy = imgCopy.pow(gammaC);
-        }
+        auto values = intensity();
+        if (values.outerStride() == width())
+            return writePFMImage(filename.c_str(), width(), height(), 1, values.data(), gain);
+        Intensity contiguous = values;
+        return writePFMImage(filename.c_str(), width(), height(), 1, contiguous.data(), gain);
     }
+    if (hdrFormat && isSingleChannel())
+        return expanded().save(filename, gain, gamma, sRGB, dither);
 
-    if (extension == "hdr")
-        return stbi_write_hdr(filename.c_str(), width(), height(), 4, (const float *) img->data()) != 0;
-    else if (extension == "pfm")
-        return writePFMImage(filename.c_str(), width(), height(), 4, (const float *) img->data()) != 0;
-    else if (extension == "exr")
-    {
-        try
-        {
-            Imf::setGlobalThreadCount(thread::hardware_concurrency());
-            Imf::RgbaOutputFile file(filename.c_str(), width(), height(), Imf::WRITE_RGBA);
-            Imf::Array2D<Imf::Rgba> pixels(height(), width());
+    // EXRs apply the gain while writing, so don't need a copy
+    if (extension == "exr")
+        return saveEXR(filename, gain);
 
-            Timer timer;
-            // copy image data over to Rgba pixels
-            parallel_for(0, height(), [this,img,&pixels](int y)
-            {
-                for (int x = 0; x < width(); ++x)
-                {
-                    Imf::Rgba &p = pixels[y][x];
-                    Color4 c = (*img)(x, y);
-                    p.r = c[0];
-                    p.g = c[1];
-                    p.b = c[2];
-                    p.a = c[3];
-                }
-            });
-            console->debug("Copying pixel data took: {} seconds.", (timer.lap()/1000.f));
+    // PFMs apply the gain while converting the pixels for writing
+    if (extension == "pfm")
+        return writePFMImage(filename.c_str(), width(), height(), 4, (const float *) data(), gain);
 
-            file.setFrameBuffer(&pixels[0][0], 1, width());
-            file.writePixels(height());
+    if (hdrFormat)
+    {
+        // apply the gain while copying
+        HDRImage imgCopy;
+        if (gain != 1.0f)
+            imgCopy = scaledOffset(Color4(gain, gain, gain, 1.0f), Color4(0.f, 0.f, 0.f, 0.f));
+        const HDRImage & img = gain != 1.0f ? imgCopy : *this;
 
-            console->debug("Writing EXR image took: {} seconds.", (timer.lap()/1000.f));
-			return true;
-        }
-        catch (const exception &e)
-        {
-            console->error("ERROR: Unable to write image file \"{}\": {}", filename, e.what());
-            return false;
-        }
+        return stbi_write_hdr(filename.c_str(), width(), height(), 4, (const float *) img.data()) != 0;
     }
     else
     {
-        // convert floating-point image to 8-bit per channel with dithering
-        vector<unsigned char> data(size()*3, 0);
+        // for LDR formats, tonemap straight into the buffer handed to the encoder
+        unique_ptr<ToneCurve> curve;
+        if (sRGB)
+            curve.reset(new ToneCurve([](float v) {return LinearToSRGB(v);}));
+        else if (gamma != 1.0f)
+            curve.reset(new ToneCurve([gamma](float v) {return pow(v, 1.0f / gamma);}));
 
         Timer timer;
-        // convert 3-channel pfm data to 4-channel internal representation
-        parallel_for(0, height(), [this,img,&data,dither](int y)
+        if (extension == "png" && s_png16Bit)
         {
-            for (int x = 0; x < width(); ++x)
-            {
-                Color4 c = (*img)(x, y);
-                if (dither)
-                {
-                    int xmod = x % 256;
-                    int ymod = y % 256;
-                    float ditherValue = (dither_matrix256[xmod + ymod * 256] / 65536.0f - 0.5f) / 255.0f;
-                    c += Color4(Color3(ditherValue), 0.0f);
-                }
-
-                // convert to [0-255] range
-                c = (c * 255.0f).max(0.0f).min(255.0f);
+            vector<uint16_t> data(size_t(width()) * height() * 3);
+            tonemapAndQuantize(*this, data.data(), gain, curve.get(), dither);
+            console->debug("Tonemapping to 16bit took: {} seconds.", (timer.lap() / 1000.f));
+            writePNGImage(filename.c_str(), width(), height(), 3, 16, data.data(), s_pngLevel);
+            console->debug("Writing PNG image took: {} seconds.", (timer.lap() / 1000.f));
+            return true;
+        }
 
-                data[3 * x + 3 * y * width() + 0] = (unsigned char) c[0];
-                data[3 * x + 3 * y * width() + 1] = (unsigned char) c[1];
-                data[3 * x + 3 * y * width() + 2] = (unsigned char) c[2];
-            }
-        });
-        console->debug("Tonemapping to 8bit took: {} seconds.", (timer.elapsed()/1000.f));
+        // convert floating-point image to 8-bit per channel with dithering
+        vector<unsigned char> data(size_t(width()) * height() * 3);
+        tonemapAndQuantize(*this, data.data(), gain, curve.get(), dither);
+        console->debug("Tonemapping to 8bit took: {} seconds.", (timer.lap() / 1000.f));
 
         if (extension == "ppm")
             return writePPMImage(filename.c_str(), width(), height(), 3, &data[0]);
         else if (extension == "png")
-            return stbi_write_png(filename.c_str(), width(), height(),
-                                  3, &data[0], sizeof(unsigned char)*width()*3) != 0;
+        {
+            writePNGImage(filename.c_str(), width(), height(), 3, 8, data.data(), s_pngLevel);
+            console->debug("Writing PNG image took: {} seconds.", (timer.lap() / 1000.f));
+            return true;
+        }
         else if (extension == "bmp")
             return stbi_write_bmp(filename.c_str(), width(), height(), 3, &data[0]) != 0;
         else if (extension == "tga")
             return stbi_write_tga(filename.c_str(), width(), height(), 3, &data[0]) != 0;
         else if (extension == "jpg" || extension == "jpeg")
-            return stbi_write_jpg(filename.c_str(), width(), height(), 3, &data[0], 100) != 0;
+            return stbi_write_jpg(filename.c_str(), width(), height(), 3, &data[0],
+                                  std::max(1, std::min(100, s_jpegQuality))) != 0;
         else
             throw invalid_argument("Could not determine desired file type from extension.");
     }
 }
 
 
+bool HDRImage::saveEXR(const string & filename, float gain) const
+{
+	TRACE_ZONE("HDRImage::saveEXR");
+	auto console = spdlog::get("console");
+	try
+	{
+		static const Imf::Compression compressions[] =
+			{Imf::NO_COMPRESSION, Imf::ZIPS_COMPRESSION, Imf::ZIP_COMPRESSION,
+			 Imf::PIZ_COMPRESSION, Imf::DWAA_COMPRESSION, Imf::B44_COMPRESSION};
+
+		Imf::setGlobalThreadCount(ThreadPool::instance().numThreads());
+		Timer timer;
+
+		int w = width(), h = height();
+		Imf::Header header(w, h);
+		header.compression() = compressions[s_exrCompression];
+		Imf::PixelType type = s_exrHalf ? Imf::HALF : Imf::FLOAT;
+		const char * names[] = {"R", "G", "B", "A"};
+		for (auto name : names)
+			header.channels().insert(name, Imf::Channel(type));
+
+		Imf::OutputFile file(filename.c_str(), header);
+
+		// OpenEXR converts to half while compressing, reading the floats of each scanline (at y * yStride) from base
+		auto setFrameBuffer = [&file,&names](const Color4 * base, size_t yStride)
+		{
+			Imf::FrameBuffer frameBuffer;
+			for (int i = 0; i < 4; ++i)
+				frameBuffer.insert(names[i], Imf::Slice(Imf::FLOAT, (char *) base + i * sizeof(float),
+				                                        sizeof(Color4), yStride));
+			file.setFrameBuffer(frameBuffer);
+		};
+
+		if (gain == 1.f)
+		{
+			// write straight from the pixels
+			setFrameBuffer(data(), sizeof(Color4) * w);
+			file.writePixels(h);
+		}
+		else
+		{
+			// apply the gain to bands of scanlines, each compressed in parallel by OpenEXR
+			int bandLines = 32 * std::max(1, int(ThreadPool::instance().numThreads()));
+			vector<Color4> band(size_t(w) * std::min(bandLines, h));
+			Color4 gainC(gain, gain, gain, 1.f), offset(0.f, 0.f, 0.f, 0.f);
+			for (int y0 = 0; y0 < h; y0 += bandLines)
+			{
+				int numLines = std::min(bandLines, h - y0);
+				parallel_for(BlockedRange(0, numLines), [this,&band,&gainC,&offset,w,y0](int l0, int l1)
+				{
+					scaleOffsetPixels(band.data() + size_t(l0) * w, &(*this)(0, y0 + l0), size_t(l1 - l0) * w,
+					                  gainC, offset);
+				});
+				// the frame buffer is addressed by absolute scanline, so shift the band up to line y0
+				setFrameBuffer(band.data() - ptrdiff_t(y0) * w, sizeof(Color4) * w);
+				file.writePixels(numLines);
+			}
+		}
+
+		console->debug("Writing {} EXR image took: {} seconds.", exrCompressionNames()[s_exrCompression],
+		               (timer.elapsed() / 1000.f));
+		return true;
+	}
+	catch (const exception &e)
+	{
+		console->error("ERROR: Unable to write image file \"{}\": {}", filename, e.what());
+		return false;
+	}
+}
+
+
 // local functions
 namespace
 {
@@ -776,6 +1466,7 @@ HDRImage develop(vector<float> & raw,
                  const tinydng::DNGImage & param1,
                  const tinydng::DNGImage & param2)
 {
+	TRACE_ZONE("develop");
 	Timer timer;
 
 	int width = param1.width;
@@ -831,6 +1522,62 @@ HDRImage develop(vector<float> & raw,
 }
 
 
+HDRImage developPreview(const vector<float> & raw,
+                        const tinydng::DNGImage & param1,
+                        const tinydng::DNGImage & param2)
+{
+	TRACE_ZONE("developPreview");
+	Timer timer;
+
+	int width = param1.width;
+	int blackLevel = param1.black_level[0];
+	int whiteLevel = param1.white_level[0];
+	int startRow = clamp(param1.active_area[1], 0, width);
+	int endRow = clamp(param1.active_area[3], 0, width);
+	int startCol = clamp(param1.active_area[0], 0, param1.height);
+	int endCol = clamp(param1.active_area[2], 0, param1.height);
+
+	// quads start at the corner of the active area, where develop() expects the red sample
+	HDRImage developed((endRow - startRow) / 2, (endCol - startCol) / 2);
+
+	// the white balance that develop() applies before demosaicing cancels out here
+	Matrix3f CameraTosRGB = XYZD50TosRGB * computeCameraToXYZD50(param2);
+
+	const float invScale = 1.0f / (whiteLevel - blackLevel);
+	parallel_for(0, developed.height(), [&developed,&raw,width,startRow,startCol,blackLevel,invScale,&CameraTosRGB](int y)
+	{
+		const float * row0 = raw.data() + size_t(startCol + 2 * y) * width + startRow;
+		const float * row1 = row0 + width;
+		for (int x = 0; x < developed.width(); x++)
+		{
+			Vector3f rgb(row0[2 * x], 0.5f * (row0[2 * x + 1] + row1[2 * x]), row1[2 * x + 1]);
+			rgb = ((rgb.array() - float(blackLevel)) * invScale).max(0.f).min(1.f).matrix();
+			Vector3f sRGB = CameraTosRGB * rgb;
+			developed(x,y) = Color4(sRGB.x(),sRGB.y(),sRGB.z(),1.f);
+		}
+	});
+
+	spdlog::get("console")->debug("Developing the DNG preview took {} seconds.", (timer.elapsed()/1000.f));
+	return developed;
+}
+
+
+HDRImage orientedDNG(const HDRImage & img, int orientation)
+{
+	switch (orientation)
+	{
+		case ORIENTATION_TOPRIGHT: return img.flippedHorizontal();
+		case ORIENTATION_BOTRIGHT: return img.flippedVertical().flippedHorizontal();
+		case ORIENTATION_BOTLEFT : return img.flippedVertical();
+		case ORIENTATION_LEFTTOP : return img.rotated90CCW().flippedVertical();
+		case ORIENTATION_RIGHTTOP: return img.rotated90CW();
+		case ORIENTATION_RIGHTBOT: return img.rotated90CW().flippedVertical();
+		case ORIENTATION_LEFTBOT : return img.rotated90CCW();
+		default: return img;// none (0), or ORIENTATION_TOPLEFT
+	}
+}
+
+
 inline unsigned short endianSwap(unsigned short val)
 {
 	unsigned short ret;
@@ -846,74 +1593,151 @@ inline unsigned short endianSwap(unsigned short val)
 
 
 // The decode functions below are adapted from syoyo's dng2exr, in the tinydng library within the
-// ext subfolder
+// ext subfolder. Without endian swapping, whole groups of pixels that share bytes (2 pixels in 3 bytes for 12 bit,
+// 4 pixels in 7 bytes for 14 bit) are unpacked at once, without any per-pixel address arithmetic or branches, so
+// that the compiler can vectorize the inner loops. The per-pixel versions handle the rest.
+
+//
+// Decode the n-th pixel of a 12bit integer image
+//
+unsigned int decode12BitPixel(const unsigned char *data, size_t n, bool swapEndian)
+{
+	static const int offsets[2][2] = {{0, 1}, {1, 2}};
+	static const int bitShifts[2] = {4, 0};
+
+	unsigned char buf[3];
+
+	// 24 = 12bit * 2 pixel, 8bit * 3 pixel
+	size_t n2 = n % 2;           // used for offset & bitshifts
+	size_t addr3 = (n / 2) * 3;  // 8bit pixel pos
+	size_t odd = (addr3 % 2);
+
+	int bit_shift;
+	bit_shift = bitShifts[n2];
+
+	int offset[2];
+	offset[0] = offsets[n2][0];
+	offset[1] = offsets[n2][1];
+
+	if (swapEndian)
+	{
+		// load with short byte swap
+		if (odd)
+		{
+			buf[0] = data[addr3 - 1];
+			buf[1] = data[addr3 + 2];
+			buf[2] = data[addr3 + 1];
+		}
+		else
+		{
+			buf[0] = data[addr3 + 1];
+			buf[1] = data[addr3 + 0];
+			buf[2] = data[addr3 + 3];
+		}
+	}
+	else
+	{
+		buf[0] = data[addr3 + 0];
+		buf[1] = data[addr3 + 1];
+		buf[2] = data[addr3 + 2];
+	}
+	unsigned int b0 = static_cast<unsigned int>(buf[offset[0]] & 0xff);
+	unsigned int b1 = static_cast<unsigned int>(buf[offset[1]] & 0xff);
+
+	unsigned int val = (b0 << 8) | b1;
+	return 0xfff & (val >> bit_shift);
+}
 
 //
 // Decode 12bit integer image into floating point HDR image
 //
 void decode12BitToFloat(vector<float> &image, unsigned char *data, int width, int height, bool swapEndian)
 {
+	TRACE_ZONE("decode12BitToFloat");
 	Timer timer;
 
-	int offsets[2][2] = {{0, 1}, {1, 2}};
-	int bitShifts[2] = {4, 0};
-
-	image.resize(static_cast<size_t>(width * height));
+	size_t numPixels = size_t(width) * height;
+	image.resize(numPixels);
+	float * out = image.data();
 
-	parallel_for(0, height, [&image,width,&offsets,&bitShifts,data,swapEndian](int y)
+	int numGroups = swapEndian ? 0 : int(numPixels / 2);
+	parallel_for(BlockedRange(0, numGroups), [out,data](int begin, int end)
 	{
-		for (int x = 0; x < width; x++)
+		for (int g = begin; g < end; ++g)
 		{
-			unsigned char buf[3];
+			const unsigned char * b = data + 3 * size_t(g);
+			out[2 * size_t(g) + 0] = static_cast<float>((b[0] << 4) | (b[1] >> 4));
+			out[2 * size_t(g) + 1] = static_cast<float>(((b[1] & 0xf) << 8) | b[2]);
+		}
+	});
+
+	size_t first = 2 * size_t(numGroups);
+	parallel_for(BlockedRange(0, int(numPixels - first)), [out,data,first,swapEndian](int begin, int end)
+	{
+		for (size_t n = first + begin; n < first + end; ++n)
+			out[n] = static_cast<float>(decode12BitPixel(data, n, swapEndian));
+	});
 
-			// Calculate load address for 12bit pixel(three 8 bit pixels)
-			int n = int(y * width + x);
+	spdlog::get("console")->debug("decode12BitToFloat took: {} seconds.", (timer.lap() / 1000.f));
+}
 
-			// 24 = 12bit * 2 pixel, 8bit * 3 pixel
-			int n2 = n % 2;           // used for offset & bitshifts
-			int addr3 = (n / 2) * 3;  // 8bit pixel pos
-			int odd = (addr3 % 2);
+//
+// Decode the n-th pixel of a 14bit integer image
+//
+unsigned int decode14BitPixel(const unsigned char *data, size_t n, bool swapEndian)
+{
+	static const int offsets[4][3] = {{0, 0, 1}, {1, 2, 3}, {3, 4, 5}, {5, 5, 6}};
+	static const int bitShifts[4] = {2, 4, 6, 0};
 
-			int bit_shift;
-			bit_shift = bitShifts[n2];
+	unsigned char buf[7];
 
-			int offset[2];
-			offset[0] = offsets[n2][0];
-			offset[1] = offsets[n2][1];
+	// 56 = 14bit * 4 pixel, 8bit * 7 pixel
+	size_t n4 = n % 4;           // used for offset & bitshifts
+	size_t addr7 = (n / 4) * 7;  // 8bit pixel pos
+	size_t odd = (addr7 % 2);
 
-			if (swapEndian)
-			{
-				// load with short byte swap
-				if (odd)
-				{
-					buf[0] = data[addr3 - 1];
-					buf[1] = data[addr3 + 2];
-					buf[2] = data[addr3 + 1];
-				}
-				else
-				{
-					buf[0] = data[addr3 + 1];
-					buf[1] = data[addr3 + 0];
-					buf[2] = data[addr3 + 3];
-				}
-			}
-			else
-			{
-				buf[0] = data[addr3 + 0];
-				buf[1] = data[addr3 + 1];
-				buf[2] = data[addr3 + 2];
-			}
-			unsigned int b0 = static_cast<unsigned int>(buf[offset[0]] & 0xff);
-			unsigned int b1 = static_cast<unsigned int>(buf[offset[1]] & 0xff);
+	int offset[3];
+	offset[0] = offsets[n4][0];
+	offset[1] = offsets[n4][1];
+	offset[2] = offsets[n4][2];
 
-			unsigned int val = (b0 << 8) | b1;
-			val = 0xfff & (val >> bit_shift);
+	int bit_shift;
+	bit_shift = bitShifts[n4];
 
-			image[static_cast<size_t>(y * width + x)] = static_cast<float>(val);
+	if (swapEndian)
+	{
+		// load with short byte swap
+		if (odd)
+		{
+			buf[0] = data[addr7 - 1];
+			buf[1] = data[addr7 + 2];
+			buf[2] = data[addr7 + 1];
+			buf[3] = data[addr7 + 4];
+			buf[4] = data[addr7 + 3];
+			buf[5] = data[addr7 + 6];
+			buf[6] = data[addr7 + 5];
 		}
-	});
+		else
+		{
+			buf[0] = data[addr7 + 1];
+			buf[1] = data[addr7 + 0];
+			buf[2] = data[addr7 + 3];
+			buf[3] = data[addr7 + 2];
+			buf[4] = data[addr7 + 5];
+			buf[5] = data[addr7 + 4];
+			buf[6] = data[addr7 + 7];
+		}
+	}
+	else
+	{
+		memcpy(buf, &data[addr7], 7);
+	}
+	unsigned int b0 = static_cast<unsigned int>(buf[offset[0]] & 0xff);
+	unsigned int b1 = static_cast<unsigned int>(buf[offset[1]] & 0xff);
+	unsigned int b2 = static_cast<unsigned int>(buf[offset[2]] & 0xff);
 
-	spdlog::get("console")->debug("decode12BitToFloat took: {} seconds.", (timer.lap() / 1000.f));
+	unsigned int val = (b0 << 16) | (b1 << 8) | b2;
+	return 0x3fff & (val >> bit_shift);
 }
 
 //
@@ -921,77 +1745,34 @@ void decode12BitToFloat(vector<float> &image, unsigned char *data, int width, in
 //
 void decode14BitToFloat(vector<float> &image, unsigned char *data, int width, int height, bool swapEndian)
 {
+	TRACE_ZONE("decode14BitToFloat");
 	Timer timer;
 
-	int offsets[4][3] = {{0, 0, 1}, {1, 2, 3}, {3, 4, 5}, {5, 5, 6}};
-	int bitShifts[4] = {2, 4, 6, 0};
-
-	image.resize(static_cast<size_t>(width * height));
+	size_t numPixels = size_t(width) * height;
+	image.resize(numPixels);
+	float * out = image.data();
 
-	parallel_for(0, height, [&image,width,&offsets,&bitShifts,data,swapEndian](int y)
+	int numGroups = swapEndian ? 0 : int(numPixels / 4);
+	parallel_for(BlockedRange(0, numGroups), [out,data](int begin, int end)
 	{
-		for (int x = 0; x < width; x++)
+		for (int g = begin; g < end; ++g)
 		{
-			unsigned char buf[7];
-
-			// Calculate load address for 14bit pixel(three 8 bit pixels)
-			int n = int(y * width + x);
-
-			// 56 = 14bit * 4 pixel, 8bit * 7 pixel
-			int n4 = n % 4;           // used for offset & bitshifts
-			int addr7 = (n / 4) * 7;  // 8bit pixel pos
-			int odd = (addr7 % 2);
-
-			int offset[3];
-			offset[0] = offsets[n4][0];
-			offset[1] = offsets[n4][1];
-			offset[2] = offsets[n4][2];
-
-			int bit_shift;
-			bit_shift = bitShifts[n4];
-
-			if (swapEndian)
-			{
-				// load with short byte swap
-				if (odd)
-				{
-					buf[0] = data[addr7 - 1];
-					buf[1] = data[addr7 + 2];
-					buf[2] = data[addr7 + 1];
-					buf[3] = data[addr7 + 4];
-					buf[4] = data[addr7 + 3];
-					buf[5] = data[addr7 + 6];
-					buf[6] = data[addr7 + 5];
-				}
-				else
-				{
-					buf[0] = data[addr7 + 1];
-					buf[1] = data[addr7 + 0];
-					buf[2] = data[addr7 + 3];
-					buf[3] = data[addr7 + 2];
-					buf[4] = data[addr7 + 5];
-					buf[5] = data[addr7 + 4];
-					buf[6] = data[addr7 + 7];
-				}
-			}
-			else
-			{
-				memcpy(buf, &data[addr7], 7);
-			}
-			unsigned int b0 = static_cast<unsigned int>(buf[offset[0]] & 0xff);
-			unsigned int b1 = static_cast<unsigned int>(buf[offset[1]] & 0xff);
-			unsigned int b2 = static_cast<unsigned int>(buf[offset[2]] & 0xff);
-
-			// unsigned int val = (b0 << 16) | (b1 << 8) | b2;
-			// unsigned int val = (b2 << 16) | (b0 << 8) | b0;
-			unsigned int val = (b0 << 16) | (b1 << 8) | b2;
-			// unsigned int val = b2;
-			val = 0x3fff & (val >> bit_shift);
-
-			image[static_cast<size_t>(y * width + x)] = static_cast<float>(val);
+			const unsigned char * b = data + 7 * size_t(g);
+			float * o = out + 4 * size_t(g);
+			o[0] = static_cast<float>((b[0] << 6) | (b[1] >> 2));
+			o[1] = static_cast<float>(((b[1] & 0x3) << 12) | (b[2] << 4) | (b[3] >> 4));
+			o[2] = static_cast<float>(((b[3] & 0xf) << 10) | (b[4] << 2) | (b[5] >> 6));
+			o[3] = static_cast<float>(((b[5] & 0x3f) << 8) | b[6]);
 		}
 	});
 
+	size_t first = 4 * size_t(numGroups);
+	parallel_for(BlockedRange(0, int(numPixels - first)), [out,data,first,swapEndian](int begin, int end)
+	{
+		for (size_t n = first + begin; n < first + end; ++n)
+			out[n] = static_cast<float>(decode14BitPixel(data, n, swapEndian));
+	});
+
 	spdlog::get("console")->debug("decode14BitToFloat took: {} seconds.", (timer.lap() / 1000.f));
 }
 
@@ -1000,22 +1781,23 @@ void decode14BitToFloat(vector<float> &image, unsigned char *data, int width, in
 //
 void decode16BitToFloat(vector<float> &image, unsigned char *data, int width, int height, bool swapEndian)
 {
+	TRACE_ZONE("decode16BitToFloat");
 	Timer timer;
 
-	image.resize(static_cast<size_t>(width * height));
-	unsigned short *ptr = reinterpret_cast<unsigned short *>(data);
+	size_t numPixels = size_t(width) * height;
+	image.resize(numPixels);
+	float * out = image.data();
+	const unsigned short *ptr = reinterpret_cast<const unsigned short *>(data);
 
-	parallel_for(0, height, [&image,width,ptr,swapEndian](int y)
+	// range will be [0, 65535]
+	parallel_for(BlockedRange(0, int(numPixels)), [out,ptr,swapEndian](int begin, int end)
 	{
-		for (int x = 0; x < width; x++)
-		{
-			unsigned short val = ptr[y * width + x];
-			if (swapEndian)
-				val = endianSwap(val);
-
-			// range will be [0, 65535]
-			image[static_cast<size_t>(y * width + x)] = static_cast<float>(val);
-		}
+		if (swapEndian)
+			for (int i = begin; i < end; ++i)
+				out[i] = static_cast<float>(endianSwap(ptr[i]));
+		else
+			for (int i = begin; i < end; ++i)
+				out[i] = static_cast<float>(ptr[i]);
 	});
 
 	spdlog::get("console")->debug("decode16BitToFloat took: {} seconds.", (timer.lap() / 1000.f));
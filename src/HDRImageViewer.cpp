@@ -5,8 +5,11 @@
 //
 
 #include "HDRImageViewer.h"
+#include "CurveLUT.h"
 #include "HDRViewer.h"
+#include <spdlog/spdlog.h>
 #include <tinydir.h>
+#include <algorithm>
 #include <utility>
 using namespace std;
 
@@ -15,6 +18,25 @@ namespace
 const float MIN_ZOOM = 0.01f;
 
 const float MAX_ZOOM = 512.f;
+
+/// The texture of an image, along with how the shader should map its values to colors
+ImageShader::Texture shaderTexture(const ConstImagePtr & img, HDRImage::Colormap colormap)
+{
+	GLuint id = img->glTextureId();
+	const HDRImage & shown = img->displayedImage();
+	// a preview has a range of its own, unless the range was set explicitly
+	Vector2f range = img->hasCustomSingleChannelRange() ? img->singleChannelRange() : shown.singleChannelRange();
+	ImageShader::Texture texture(id, shown.isSingleChannel(), range, img->orientation().storedUV());
+	texture.colormap = colormap;
+	if (const VirtualTexture * pages = img->virtualTexture())
+	{
+		texture.pageTable = pages->pageTable();
+		texture.virtualSize = pages->size();
+		texture.numLevels = pages->numLevels();
+		texture.cacheSlots = pages->slotsPerSide();
+	}
+	return texture;
+}
 }
 
 HDRImageViewer::HDRImageViewer(Widget* parent, HDRViewScreen* screen)
@@ -26,6 +48,182 @@ HDRImageViewer::HDRImageViewer(Widget* parent, HDRViewScreen* screen)
 
 }
 
+HDRImageViewer::~HDRImageViewer()
+{
+	if (m_cacheFramebuffer)
+		glDeleteFramebuffers(1, &m_cacheFramebuffer);
+	if (m_cacheTexture)
+		glDeleteTextures(1, &m_cacheTexture);
+	if (m_adjustmentTexture)
+		glDeleteTextures(1, &m_adjustmentTexture);
+	if (m_filterPreview.texture)
+		glDeleteTextures(1, &m_filterPreview.texture);
+}
+
+void HDRImageViewer::setAdjustmentPreview(const CurveLUT * curve, const Vector3f & hsl)
+{
+	ImageShader::Adjustment adjustment;
+	adjustment.hsl = hsl;
+	if (curve)
+	{
+		if (!m_adjustmentTexture)
+		{
+			glGenTextures(1, &m_adjustmentTexture);
+			glBindTexture(GL_TEXTURE_2D, m_adjustmentTexture);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+		}
+		glBindTexture(GL_TEXTURE_2D, m_adjustmentTexture);
+		glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_R32F, CurveLUT::Size, 1,
+		             0, GL_RED, GL_FLOAT, (const GLvoid *) curve->values().data());
+		adjustment.curve = m_adjustmentTexture;
+	}
+	m_shader.setAdjustment(adjustment);
+	++m_adjustmentVersion;
+}
+
+void HDRImageViewer::setFilterPreview(const PreviewFilter & filter, float apron)
+{
+	m_filterPreview.filter = filter;
+	m_filterPreview.apron = apron;
+	++m_filterPreview.version;
+}
+
+void HDRImageViewer::clearFilterPreview()
+{
+	FilterPreview & fp = m_filterPreview;
+	fp.filter = nullptr;
+	if (fp.task)
+	{
+		fp.task->cancel();
+		fp.canceled.push_back(fp.task);
+		fp.task.reset();
+	}
+	fp.requested = fp.shown = FilterPreview::Region();
+	if (fp.texture)
+		glDeleteTextures(1, &fp.texture);
+	fp.texture = 0;
+	++fp.uploads;
+}
+
+/// Upload the proxy of the filter preview once it is done, and start computing a new one if the view changed
+void HDRImageViewer::updateFilterPreview()
+{
+	FilterPreview & fp = m_filterPreview;
+	fp.canceled.erase(remove_if(fp.canceled.begin(), fp.canceled.end(),
+	                            [](const shared_ptr<FilterPreview::Task> & t){return t->ready();}),
+	                  fp.canceled.end());
+
+	if (fp.task && fp.task->ready())
+	{
+		try
+		{
+			const HDRImage & proxy = *fp.task->get();
+			if (!fp.texture)
+			{
+				glGenTextures(1, &fp.texture);
+				glBindTexture(GL_TEXTURE_2D, fp.texture);
+				glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+				glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+				glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+				glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+			}
+			glBindTexture(GL_TEXTURE_2D, fp.texture);
+			glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+			glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F, proxy.width(), proxy.height(),
+			             0, GL_RGBA, GL_FLOAT, (const GLvoid *) proxy.data());
+			fp.shown = fp.requested;
+			++fp.uploads;
+		}
+		catch (const exception & e)
+		{
+			spdlog::get("console")->error("Could not preview the filter: {}", e.what());
+		}
+		fp.task.reset();
+	}
+
+	// single-channel images are only expanded to colors once they get modified, so don't bother previewing them
+	if (!fp.filter || !m_currentImage || m_currentImage->isNull() || m_currentImage->isSingleChannel())
+		return;
+
+	FilterPreview::Region r;
+	Vector2i size = m_currentImage->size();
+	r.visibleMin = clampedImageCoordinateAt(Vector2f::Zero()).array().floor().cast<int>().matrix();
+	r.visibleMax = clampedImageCoordinateAt(sizeF()).array().ceil().cast<int>().matrix();
+	if ((r.visibleMax.array() <= r.visibleMin.array()).any())
+		return;
+	int apron = int(std::ceil(fp.apron));
+	r.min = (r.visibleMin.array() - apron).max(0).matrix();
+	r.max = (r.visibleMax.array() + apron).min(size.array()).matrix();
+	r.scale = std::min(1.f, m_zoom * m_screen->pixelRatio());
+	r.image = &m_currentImage->image();
+	r.version = fp.version;
+	if (r == fp.requested)
+		return;
+
+	if (fp.task)
+	{
+		fp.task->cancel();
+		fp.canceled.push_back(fp.task);
+	}
+	fp.requested = r;
+
+	auto image = m_currentImage->sharedImage();
+	auto orientation = m_currentImage->orientation();
+	auto filter = fp.filter;
+	fp.task = make_shared<FilterPreview::Task>(
+		[image,orientation,size,r,filter](AtomicProgress & progress)
+		{
+			// crop the stored pixels of the region, and bring them into the orientation they are displayed in
+			Vector2i a = orientation.storedPixel(r.min, size),
+			         b = orientation.storedPixel(r.max - Vector2i::Ones(), size);
+			Vector2i start = a.cwiseMin(b), extent = a.cwiseMax(b) - start + Vector2i::Ones();
+			HDRImage proxy = HDRImage(image->block(start.x(), start.y(), extent.x(), extent.y())).oriented(orientation);
+			progress.checkCanceled();
+
+			if (r.scale < 1.f)
+			{
+				Vector2i scaled = ((r.max - r.min).cast<float>() * r.scale).array().ceil().cast<int>().max(1).matrix();
+				proxy = proxy.resized(scaled.x(), scaled.y(), HDRImage::BOX_FILTER);
+				progress.checkCanceled();
+			}
+			return make_shared<HDRImage>(filter(proxy, r.scale, progress));
+		});
+	fp.task->compute();
+}
+
+/// Draw the proxy of the filter preview over the pixels it was computed for, using render for the current image
+void HDRImageViewer::drawFilterPreview(const function<void(const ImageShader::Texture &, const Vector2f &, const Vector2f &)> & render)
+{
+	const FilterPreview & fp = m_filterPreview;
+	if (!fp.filter || !fp.texture || m_currentImage->isNull() || fp.shown.image != &m_currentImage->image())
+		return;
+
+	// the proxy covers all cropped pixels, but only the visible ones had all their neighbors
+	Vector2f screenSize = screenSizeF();
+	Vector2f origin = absolutePosition().cast<float>() + m_offset + centerOffset(m_currentImage);
+	Vector2f position = (origin + m_zoom * fp.shown.min.cast<float>()).cwiseQuotient(screenSize);
+	Vector2f scale = (m_zoom * (fp.shown.max - fp.shown.min).cast<float>()).cwiseQuotient(screenSize);
+	Vector2f lo = origin + m_zoom * fp.shown.visibleMin.cast<float>(),
+	         hi = origin + m_zoom * fp.shown.visibleMax.cast<float>();
+
+	// restrict drawing to the visible pixels, in framebuffer coordinates (counted from the bottom)
+	GLint scissor[4];
+	glGetIntegerv(GL_SCISSOR_BOX, scissor);
+	float ratio = m_screen->pixelRatio();
+	int x0 = std::max(scissor[0], int(std::round(lo.x() * ratio))),
+	    x1 = std::min(scissor[0] + scissor[2], int(std::round(hi.x() * ratio))),
+	    y0 = std::max(scissor[1], int(std::round((screenSize.y() - hi.y()) * ratio))),
+	    y1 = std::min(scissor[1] + scissor[3], int(std::round((screenSize.y() - lo.y()) * ratio)));
+	if (x1 <= x0 || y1 <= y0)
+		return;
+
+	glScissor(x0, y0, x1 - x0, y1 - y0);
+	render(ImageShader::Texture(fp.texture), scale, position);
+	glScissor(scissor[0], scissor[1], scissor[2], scissor[3]);
+}
+
 Vector2f HDRImageViewer::screenSizeF() const
 {
 	return m_screen->size().cast<float>();
@@ -165,7 +363,8 @@ bool HDRImageViewer::mouseMotionEvent(const Vector2i& p, const Vector2i& rel, in
 	Color4 iPixelVal(0.f);
 	if (m_currentImage->contains(pixel))
 	{
-		pixelVal = m_currentImage->image()(pixel.x(), pixel.y());
+		Vector2i stored = m_currentImage->storedPixel(pixel);
+		pixelVal = m_currentImage->image().color(stored.x(), stored.y());
 		iPixelVal = (pixelVal * pow(2.f, m_exposure) * 255).min(255.f).max(0.f);
 	}
 
@@ -226,6 +425,11 @@ Vector2f HDRImageViewer::centerOffset(ConstImagePtr img) const
 
 void HDRImageViewer::draw(NVGcontext* ctx)
 {
+	double frameStart = glfwGetTime();
+	if (m_lastFrameStart > 0.0)
+		m_frameTime = lerp(m_frameTime, 1000.0 * (frameStart - m_lastFrameStart), m_frameTime > 0.0 ? 0.1 : 1.0);
+	m_lastFrameStart = frameStart;
+
 	Widget::draw(ctx);
 	nvgEndFrame(ctx); // Flush the NanoVG draw stack, not necessary to call nvgBeginFrame afterwards.
 
@@ -240,36 +444,146 @@ void HDRImageViewer::draw(NVGcontext* ctx)
 	glClearColor(0.15f, 0.15f, 0.15f, 1.0f);
 	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT | GL_STENCIL_BUFFER_BIT);
 
-	if (m_currentImage && !m_currentImage->isNull())
+	if (m_currentImage && m_currentImage->canDisplay())
 	{
-		Vector2f pCurrent, sCurrent;
-		imagePositionAndScale(pCurrent, sCurrent, m_currentImage);
-
-		if (m_referenceImage)
-		{
-			Vector2f pReference, sReference;
-			imagePositionAndScale(pReference, sReference, m_referenceImage);
-			m_shader
-				.draw(m_currentImage->glTextureId(), m_referenceImage->glTextureId(), sCurrent, pCurrent, sReference,
-					  pReference, powf(2.0f, m_exposure), m_gamma, m_sRGB, m_dither, m_channel, m_blendMode);
-		}
-		else
-		{
-			m_shader.draw(m_currentImage->glTextureId(), sCurrent, pCurrent, powf(2.0f, m_exposure), m_gamma, m_sRGB,
-						  m_dither, m_channel, m_blendMode);
-		}
+		drawImages();
 
 		drawImageBorder(ctx);
 
-		if (helpersVisible())
+		// the pixel grid and values need the actual pixels, not a preview
+		if (helpersVisible() && !m_currentImage->isNull())
 			drawHelpers(ctx);
 	}
 
 	glDisable(GL_SCISSOR_TEST);
 
+	m_drawTime = lerp(m_drawTime, 1000.0 * (glfwGetTime() - frameStart), m_drawTime > 0.0 ? 0.1 : 1.0);
+	if (m_hudVisible)
+		drawHUD(ctx);
+
 	drawWidgetBorder(ctx);
 }
 
+/*!
+ * Draw the tonemapped current and reference images, from the cache if nothing changed since they were rendered.
+ * Images whose textures are incomplete or just changed (which keeps their texture id) are never cached.
+ */
+void HDRImageViewer::drawImages()
+{
+	updateFilterPreview();
+
+	bool resident = m_currentImage->textureResident() && (!m_referenceImage || m_referenceImage->textureResident());
+
+	// images displayed through a virtual texture only page in what is visible, at the resolution it is drawn at
+	float texelsPerPixel = 1.f / (m_zoom * m_screen->pixelRatio());
+	for (const auto & img : {m_currentImage, m_referenceImage})
+		if (img && !img->isNull())
+		{
+			Vector2f origin = m_offset + centerOffset(img);
+			img->requestTexture(AlignedBox2f((-origin / m_zoom).cwiseQuotient(imageSizeF(img)),
+			                                 ((sizeF() - origin) / m_zoom).cwiseQuotient(imageSizeF(img))),
+			                    texelsPerPixel);
+		}
+
+	Vector2f pCurrent, sCurrent, pReference, sReference;
+	imagePositionAndScale(pCurrent, sCurrent, m_currentImage);
+	ImageShader::Texture current = shaderTexture(m_currentImage, m_colormap), reference;
+	if (m_referenceImage)
+	{
+		imagePositionAndScale(pReference, sReference, m_referenceImage);
+		reference = shaderTexture(m_referenceImage, m_colormap);
+	}
+
+	auto renderImage = [&](const ImageShader::Texture & image, const Vector2f & scale, const Vector2f & position)
+	{
+		if (m_referenceImage)
+			m_shader.draw(image, reference, scale, position, sReference, pReference,
+			              powf(2.0f, m_exposure), m_gamma, m_sRGB, m_dither, m_channel, m_blendMode);
+		else
+			m_shader.draw(image, scale, position, powf(2.0f, m_exposure), m_gamma, m_sRGB,
+			              m_dither, m_channel, m_blendMode);
+	};
+	auto render = [&]
+	{
+		renderImage(current, sCurrent, pCurrent);
+		drawFilterPreview(renderImage);
+	};
+
+	Vector2i fbSize;
+	glfwGetFramebufferSize(m_screen->glfwWindow(), &fbSize.x(), &fbSize.y());
+	// the pixel values may have changed as well
+	if (!resident)
+		m_pixelInfoKey = PixelInfoKey();
+
+	if (!resident || !prepareCache(fbSize))
+	{
+		m_cacheKey.clear();
+		render();
+		return;
+	}
+
+	GLint scissor[4];
+	glGetIntegerv(GL_SCISSOR_BOX, scissor);
+
+	vector<float> key = {float(scissor[0]), float(scissor[1]), float(scissor[2]), float(scissor[3]),
+	                     m_exposure, m_gamma, float(m_sRGB), float(m_dither), float(m_channel), float(m_blendMode),
+	                     float(m_adjustmentVersion), float(m_filterPreview.uploads)};
+	for (const auto & t : {make_pair(&current, &sCurrent), make_pair(&reference, &sReference)})
+	{
+		const ImageShader::Texture & texture = *t.first;
+		key.insert(key.end(), {float(texture.id), float(texture.singleChannel), texture.range.x(), texture.range.y(),
+		                       float(texture.colormap), float(texture.pageTable)});
+		key.insert(key.end(), texture.orientation.data(), texture.orientation.data() + texture.orientation.size());
+		key.insert(key.end(), t.second->data(), t.second->data() + 2);
+	}
+	key.insert(key.end(), {pCurrent.x(), pCurrent.y(), pReference.x(), pReference.y()});
+	// virtual textures keep their ids while their pages come and go
+	for (const auto & img : {m_currentImage, m_referenceImage})
+		if (const VirtualTexture * pages = img ? img->virtualTexture() : nullptr)
+			key.push_back(float(pages->version()));
+
+	if (key != m_cacheKey)
+	{
+		glBindFramebuffer(GL_FRAMEBUFFER, m_cacheFramebuffer);
+		render();
+		m_cacheKey = key;
+	}
+
+	glBindFramebuffer(GL_READ_FRAMEBUFFER, m_cacheFramebuffer);
+	glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
+	glBlitFramebuffer(scissor[0], scissor[1], scissor[0] + scissor[2], scissor[1] + scissor[3],
+	                  scissor[0], scissor[1], scissor[0] + scissor[2], scissor[1] + scissor[3],
+	                  GL_COLOR_BUFFER_BIT, GL_NEAREST);
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+}
+
+/// (Re)allocate the cache for a screen of the given size in pixels, returns false if that is not possible
+bool HDRImageViewer::prepareCache(const Vector2i & size)
+{
+	if (m_cacheFramebuffer && m_cacheSize == size)
+		return true;
+
+	if (!m_cacheFramebuffer)
+	{
+		glGenFramebuffers(1, &m_cacheFramebuffer);
+		glGenTextures(1, &m_cacheTexture);
+	}
+
+	glBindTexture(GL_TEXTURE_2D, m_cacheTexture);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, size.x(), size.y(), 0, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+
+	glBindFramebuffer(GL_FRAMEBUFFER, m_cacheFramebuffer);
+	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, m_cacheTexture, 0);
+	bool complete = glCheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE;
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+	m_cacheSize = complete ? size : Vector2i::Zero();
+	m_cacheKey.clear();
+	return complete;
+}
+
 void HDRImageViewer::imagePositionAndScale(Vector2f& position, Vector2f& scale, shared_ptr<const GLImage> image)
 {
 	scale = scaledImageSizeF(image).cwiseQuotient(screenSizeF());
@@ -389,20 +703,86 @@ void HDRImageViewer::drawPixelInfo(NVGcontext* ctx) const
 	float factor = clamp01((m_zoom - m_pixelInfoThreshold)/(2*m_pixelInfoThreshold));
 	float alpha = lerp(0.0f, 0.5f, smoothStep(0.0f, 1.0f, factor));
 
-	for (int j = minJ; j <= maxJ; ++j)
+	PixelInfoKey key;
+	key.image = &m_currentImage->image();
+	key.orientation = m_currentImage->orientation();
+	key.min = Vector2i(minI, minJ);
+	key.max = Vector2i(maxI, maxJ);
+	key.exposure = m_exposure;
+	if (!(key == m_pixelInfoKey))
+	{
+		m_pixelInfoKey = key;
+		for (auto & infos : m_pixelInfo)
+			infos.clear();
+
+		float gain = pow(2.0f, m_exposure);
+		for (int j = minJ; j <= maxJ; ++j)
+		{
+			for (int i = minI; i <= maxI; ++i)
+			{
+				Vector2i stored = m_currentImage->storedPixel(Vector2i(i, j));
+				Color4 pixel = key.image->color(stored.x(), stored.y());
+				PixelInfo info;
+				info.pixel = Vector2i(i, j);
+				for (int c = 0; c < 3; ++c)
+					info.lines[c] = fmt::format("{:1.3f}", pixel[c]);
+				m_pixelInfo[pixel.luminance() * gain > 0.5f].push_back(move(info));
+			}
+		}
+	}
+
+	// the font settings and colors are the same for all pixels, so the text is drawn line by line in two batches
+	nvgFontFace(ctx, "sans");
+	nvgFontSize(ctx, m_zoom / 31.0f * 10);
+	nvgTextAlign(ctx, NVG_ALIGN_CENTER | NVG_ALIGN_TOP);
+	float lineHeight;
+	nvgTextMetrics(ctx, nullptr, nullptr, &lineHeight);
+
+	for (int dark = 0; dark < 2; ++dark)
 	{
-		for (int i = minI; i <= maxI; ++i)
+		nvgFillColor(ctx, dark ? Color(0.0f, 0.0f, 0.0f, alpha) : Color(1.0f, 1.0f, 1.0f, alpha));
+		for (const auto & info : m_pixelInfo[dark])
 		{
-			Color4 pixel = m_currentImage->image()(i, j);
-			float luminance = pixel.luminance() * pow(2.0f, m_exposure);
-			string text = fmt::format("{:1.3f}\n{:1.3f}\n{:1.3f}", pixel[0], pixel[1], pixel[2]);
-
-			auto pos = screenPositionForCoordinate(Vector2f(i, j));
-			nvgFontFace(ctx, "sans");
-			nvgFontSize(ctx, m_zoom / 31.0f * 10);
-			nvgFillColor(ctx, luminance > 0.5f ? Color(0.0f, 0.0f, 0.0f, alpha) : Color(1.0f, 1.0f, 1.0f, alpha));
-			nvgTextAlign(ctx, NVG_ALIGN_CENTER | NVG_ALIGN_TOP);
-			nvgTextBox(ctx, pos.x(), pos.y(), m_zoom, text.c_str(), nullptr);
+			auto pos = screenPositionForCoordinate(info.pixel.cast<float>());
+			for (int c = 0; c < 3; ++c)
+				nvgText(ctx, pos.x() + 0.5f * m_zoom, pos.y() + c * lineHeight, info.lines[c].c_str(), nullptr);
 		}
 	}
-}
\ No newline at end of file
+}
+
+void HDRImageViewer::drawHUD(NVGcontext* ctx) const
+{
+	vector<string> lines;
+	lines.push_back(fmt::format("Frame: {:.1f} ms ({:.0f} fps), image draw calls: {:.2f} ms",
+	                            m_frameTime, m_frameTime > 0.0 ? 1000.0 / m_frameTime : 0.0, m_drawTime));
+	if (m_hudCallback)
+	{
+		auto more = m_hudCallback();
+		lines.insert(lines.end(), more.begin(), more.end());
+	}
+
+	const float fontSize = 14.f, margin = 6.f;
+	nvgSave(ctx);
+	nvgScissor(ctx, mPos.x(), mPos.y(), mSize.x(), mSize.y());
+	nvgFontFace(ctx, "sans");
+	nvgFontSize(ctx, fontSize);
+	nvgTextAlign(ctx, NVG_ALIGN_LEFT | NVG_ALIGN_TOP);
+
+	float width = 0.f;
+	for (const auto & line : lines)
+		width = max(width, nvgTextBounds(ctx, 0.f, 0.f, line.c_str(), nullptr, nullptr));
+
+	float x = mPos.x() + 2 * margin, y = mPos.y() + 2 * margin;
+	nvgBeginPath(ctx);
+	nvgRoundedRect(ctx, x - margin, y - margin, width + 2 * margin, lines.size() * fontSize + 2 * margin, 3.f);
+	nvgFillColor(ctx, Color(0.f, 0.f, 0.f, 0.6f));
+	nvgFill(ctx);
+
+	nvgFillColor(ctx, Color(1.f, 1.f, 1.f, 0.9f));
+	for (const auto & line : lines)
+	{
+		nvgText(ctx, x, y, line.c_str(), nullptr);
+		y += fontSize;
+	}
+	nvgRestore(ctx);
+}
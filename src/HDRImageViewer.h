@@ -26,6 +26,7 @@ class HDRImageViewer : public Widget
 {
 public:
 	HDRImageViewer(Widget * parent, HDRViewScreen * screen);
+	~HDRImageViewer() override;
 
 	void setCurrentImage(ConstImagePtr cur)    {m_currentImage = std::move(cur);}
 	void setReferenceImage(ConstImagePtr ref)  {m_referenceImage = std::move(ref);}
@@ -119,6 +120,10 @@ public:
 	EBlendMode blendMode()      {return m_blendMode;}
 	void setBlendMode(EBlendMode b) {m_blendMode = b;}
 
+	/// The colormap of single-channel images
+	HDRImage::Colormap colormap() const         {return m_colormap;}
+	void setColormap(HDRImage::Colormap c)      {m_colormap = c;}
+
 	float gamma() const         {return m_gamma;}
 	void setGamma(float g)      {if (m_gamma != g) {m_gamma = g; m_gammaCallback(g);}}
 
@@ -137,6 +142,37 @@ public:
 	bool drawValuesOn() const   {return m_drawValues;}
 	void setDrawValues(bool b)  {m_drawValues = b;}
 
+	/*!
+	 * Preview a point-wise adjustment of the current image on the GPU, instead of its actual values, until it
+	 * is cleared again. Applying the same adjustment to the pixels (see HDRImage::curveMapped and
+	 * Color4::HSLAdjust) gives the same result.
+	 *
+	 * @param curve  The curve to apply to each color channel, or nullptr for none
+	 * @param hsl    The hue shift, saturation scale and lightness, see ImageShader::Adjustment
+	 */
+	void setAdjustmentPreview(const CurveLUT * curve, const Vector3f & hsl = Vector3f(0.f, 1.f, 0.f));
+	void clearAdjustmentPreview()  {setAdjustmentPreview(nullptr);}
+
+	/// Filters a proxy of part of the current image for a preview, see setFilterPreview
+	using PreviewFilter = std::function<HDRImage(const HDRImage & proxy, float scale, AtomicProgress & progress)>;
+
+	/*!
+	 * Preview a neighborhood filter on the part of the current image that is visible, at screen resolution.
+	 *
+	 * The visible pixels, along with an apron of their neighbors that the filter may need, are cropped from the
+	 * current image (as displayed), resampled by scale (at most 1, so the filter has to scale any distances by
+	 * it as well) and filtered on a background thread. The result is drawn over the visible part of the image.
+	 * The proxy is computed again whenever the view changes, and calling this again (e.g. because a parameter
+	 * changed) cancels the proxy that is still being computed. The old one is shown until the new one is done.
+	 *
+	 * @param filter    Computes the preview of the filter for a proxy
+	 * @param apron     How far (in pixels of the image) the filter reaches out to neighboring pixels
+	 */
+	void setFilterPreview(const PreviewFilter & filter, float apron);
+	void clearFilterPreview();
+	/// Whether a proxy for the filter preview is being computed
+	bool filterPreviewPending() const          {return m_filterPreview.task != nullptr;}
+
 	// Callback functions
 
 	/// Callback executed whenever the gamma value has been changed, e.g. via @ref setGamma
@@ -147,6 +183,12 @@ public:
 	const std::function<void(float)>& exposureCallback() const { return m_exposureCallback; }
 	void setExposureCallback(const std::function<void(float)> &callback) { m_exposureCallback = callback; }
 
+	/// Whether the performance HUD is drawn over the image
+	bool hudVisible() const                                 { return m_hudVisible; }
+	void setHUDVisible(bool b)                              { m_hudVisible = b; }
+	/// Supplies the lines of the performance HUD that follow the frame times, which the viewer measures itself
+	void setHUDCallback(const std::function<std::vector<std::string>()> &callback) { m_hudCallback = callback; }
+
 	/// Callback executed whenever the sRGB setting has been changed, e.g. via @ref setSRGB
 	const std::function<void(bool)>& sRGBCallback() const { return m_sRGBCallback; }
 	void setSRGBCallback(const std::function<void(bool)> &callback) { m_sRGBCallback = callback; }
@@ -174,6 +216,11 @@ private:
 	void drawHelpers(NVGcontext* ctx) const;
 	void drawPixelGrid(NVGcontext* ctx) const;
 	void drawPixelInfo(NVGcontext *ctx) const;
+	void drawHUD(NVGcontext *ctx) const;
+	void drawImages();
+	void updateFilterPreview();
+	void drawFilterPreview(const std::function<void(const ImageShader::Texture &, const Vector2f &, const Vector2f &)> & render);
+	bool prepareCache(const Vector2i & size);
 	void imagePositionAndScale(Vector2f & position, Vector2f & scale,
 	                           ConstImagePtr image);
 
@@ -181,6 +228,71 @@ private:
 
 	ImageShader m_shader;
 
+	// The tonemapped images are rendered into an offscreen framebuffer of the size of the screen, and only
+	// rendered again when anything they depend on changes. Other redraws just copy them to the screen.
+	GLuint m_cacheFramebuffer = 0, m_cacheTexture = 0;
+	Vector2i m_cacheSize = Vector2i::Zero();
+	std::vector<float> m_cacheKey;          ///< The inputs of the cached rendering, empty if there is none
+
+	GLuint m_adjustmentTexture = 0;         ///< The curve of the adjustment preview
+	int m_adjustmentVersion = 0;            ///< Changes with every adjustment preview, for the cache key
+
+	// The preview of a neighborhood filter, see setFilterPreview
+	struct FilterPreview
+	{
+		/// What a proxy is computed for: the image, the region (in displayed pixels) and parameters
+		struct Region
+		{
+			const HDRImage * image = nullptr;
+			Vector2i min = Vector2i::Zero(), max = Vector2i::Zero();    ///< The cropped pixels [min, max), with the apron
+			Vector2i visibleMin = Vector2i::Zero(), visibleMax = Vector2i::Zero();  ///< The visible ones among them
+			float scale = 1.f;
+			int version = 0;
+
+			bool operator==(const Region & o) const
+			{
+				return image == o.image && min == o.min && max == o.max && visibleMin == o.visibleMin &&
+				       visibleMax == o.visibleMax && scale == o.scale && version == o.version;
+			}
+			bool operator!=(const Region & o) const {return !(*this == o);}
+		};
+		using Task = AsyncTask<std::shared_ptr<HDRImage>>;
+
+		PreviewFilter filter;
+		float apron = 0.f;
+		int version = 0;                    ///< Changes with every filter
+		Region requested;                   ///< What the task computes, or the shown proxy was computed for
+		Region shown;
+		std::shared_ptr<Task> task;
+		/// Canceled tasks that may still be running, which are kept around since deleting them waits for them
+		std::vector<std::shared_ptr<Task>> canceled;
+		GLuint texture = 0;                 ///< The shown proxy, if any
+		int uploads = 0;                    ///< Changes whenever the texture does, for the cache key
+	};
+	FilterPreview m_filterPreview;
+
+	// The text of the pixel values, which is only formatted again when the visible pixels or their values change
+	struct PixelInfoKey
+	{
+		const HDRImage * image = nullptr;
+		HDRImage::Orientation orientation;
+		Vector2i min = Vector2i::Zero(), max = Vector2i::Zero();    ///< The visible pixels [min, max]
+		float exposure = 0.f;
+
+		bool operator==(const PixelInfoKey & o) const
+		{
+			return image == o.image && orientation == o.orientation && min == o.min && max == o.max &&
+			       exposure == o.exposure;
+		}
+	};
+	struct PixelInfo
+	{
+		Vector2i pixel;
+		std::string lines[3];
+	};
+	mutable PixelInfoKey m_pixelInfoKey;
+	mutable std::vector<PixelInfo> m_pixelInfo[2];  ///< Shown in light and dark text
+
 	HDRViewScreen * m_screen = nullptr;
 	ConstImagePtr m_currentImage = nullptr;
 	ConstImagePtr m_referenceImage = nullptr;
@@ -189,7 +301,13 @@ private:
 	bool m_sRGB = true,
 		 m_dither = true,
 		 m_drawGrid = true,
-		 m_drawValues = true;
+		 m_drawValues = true,
+		 m_hudVisible = false;
+
+	// Frame timing for the HUD, smoothed over a few frames
+	double m_lastFrameStart = 0.0;          ///< In seconds, as returned by glfwGetTime
+	double m_frameTime = 0.0;               ///< Milliseconds from one frame to the next
+	double m_drawTime = 0.0;                ///< Milliseconds spent issuing the draw calls of the images
 
 
 	// Image display parameters.
@@ -198,6 +316,7 @@ private:
 	Vector2f m_offset;                      ///< The panning offset of the
 	EChannel m_channel = EChannel::RGB;     ///< Which channel to display
 	EBlendMode m_blendMode = EBlendMode::NORMAL_BLEND;     ///< How to blend the current and reference images
+	HDRImage::Colormap m_colormap = HDRImage::TURBO_COLORMAP;  ///< How to false-color single-channel images
 
 	// Fine-tuning parameters.
 	float m_zoomSensitivity = 1.0717734625f;
@@ -212,6 +331,7 @@ private:
 	std::function<void(bool)> m_sRGBCallback;
 	std::function<void(float)> m_zoomCallback;
 	std::function<void(const Vector2i &, const Color4 &, const Color4 &)> m_pixelHoverCallback;
+	std::function<std::vector<std::string>()> m_hudCallback;
 
 public:
 	EIGEN_MAKE_ALIGNED_OPERATOR_NEW
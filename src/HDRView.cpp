@@ -8,6 +8,12 @@
 #include <iostream>
 #include <docopt.h>
 #include "HDRViewer.h"
+#include "GLImage.h"
+#include "HDRImage.h"
+#include "ImageListPanel.h"
+#include "ThumbnailCache.h"
+#include "Trace.h"
+#include <algorithm>
 #include <spdlog/spdlog.h>
 #include <spdlog/fmt/ostr.h>
 
@@ -34,6 +40,51 @@ Options:
   -g G, --gamma=G          Desired gamma value for exposure+gamma tonemapping.
                            An sRGB curve is used if gamma is not specified.
   -d, --no-dither          Disable dithering.
+  -p P, --precision=P      Precision of the image data on the GPU.
+                           P : (auto | float | half) [default: auto].
+                           With auto, half floats are used unless the image
+                           contains values too large or too small (below
+                           6.1e-5) to represent in half precision, or is a
+                           single-channel image whose range is narrow for
+                           its magnitude.
+  --dng=D                  How raw DNG files are developed while loading.
+                           D : (full | preview) [default: full].
+                           Preview skips demosaicing and bins each 2x2 Bayer
+                           quad into one pixel of a half-resolution image,
+                           which is much faster. "Develop DNG" in the edit
+                           panel applies the full development afterwards.
+  -m M, --memory=M         Budget in MB for the pixels of the open images in
+                           RAM, including freed buffers kept for reuse. Beyond
+                           it, those buffers are released first, and then the
+                           least recently viewed images are reloaded from their
+                           files (or swapped to temporary files if modified)
+                           when they are needed again. Use 0 for no limit
+                           [default: 8192].
+  --gpu-memory=M           Budget in MB for the textures of the open images
+                           on the GPU. Use 0 for no limit [default: 4096].
+  --tile-cache=M           Size in MB of the texture tile cache of each image
+                           too large to upload as a whole, i.e. larger than
+                           the GPU supports or a quarter of the GPU memory
+                           budget. Only the visible tiles of such images are
+                           uploaded, at the resolution they are shown at
+                           [default: 256].
+  --undo-memory=M          Budget in MB for the undo history of each image
+                           in RAM. Beyond it, the oldest states are swapped to
+                           temporary files, or dropped if that fails. Use 0
+                           for no limit [default: 1024].
+  --prefetch=N             Number of images on each side of the current one
+                           to keep loaded and uploaded to the GPU ahead of
+                           time, for flipping through them without delay.
+                           Limited to half of the memory budgets. Use 0 to
+                           disable [default: 2].
+  --thumbnail-cache=DIR    Directory to store the thumbnails of opened images
+                           in, so they show up right away when the images are
+                           opened again. Use "none" to not store them, or
+                           "auto" for the user cache directory of the system
+                           [default: auto].
+  --trace=FILE             Record what takes time on which thread, and write
+                           it to FILE as Chrome trace JSON, which can be
+                           viewed in chrome://tracing or ui.perfetto.dev.
   -v T, --verbose=T        Set verbosity threshold with lower values meaning
                            more verbose and higher values removing low-priority
                            messages.
@@ -59,6 +110,7 @@ int main(int argc, char **argv)
     int verbosity = 0;
     float gamma = 2.2f, exposure = 0.f;
     bool dither = true, sRGB = true;
+    string traceFile;
 
     vector<string> inFiles;
 
@@ -125,6 +177,82 @@ int main(int argc, char **argv)
         // dithering
         dither = !docargs["--no-dither"].asBool();
 
+        // texture precision
+        {
+            const auto & names = LazyGLTextureLoader::precisionNames();
+            string precision = docargs["--precision"].asString();
+            auto it = find(names.begin(), names.end(), precision);
+            if (it == names.end())
+                console->error("Invalid texture precision \"{}\". Using \"auto\".", precision);
+            else
+            {
+                LazyGLTextureLoader::setPrecision(LazyGLTextureLoader::Precision(it - names.begin()));
+                console->info("Using {} texture precision.", precision);
+            }
+        }
+
+        // DNG development
+        {
+            const auto & names = HDRImage::dngDevelopNames();
+            string develop = docargs["--dng"].asString();
+            auto it = find(names.begin(), names.end(), develop);
+            if (it == names.end())
+                console->error("Invalid DNG development \"{}\". Using \"full\".", develop);
+            else
+            {
+                HDRImage::setDNGDevelop(HDRImage::DNGDevelop(it - names.begin()));
+                console->info("Using {} DNG development.", develop);
+            }
+        }
+
+        // memory budgets
+        {
+            long memory = docargs["--memory"].asLong(), gpuMemory = docargs["--gpu-memory"].asLong();
+            GLImage::setMemoryBudget(size_t(max(0l, memory)) << 20);
+            GLImage::setTextureBudget(size_t(max(0l, gpuMemory)) << 20);
+            console->info("Using a memory budget of {} MB in RAM and {} MB on the GPU.", memory, gpuMemory);
+
+            long tileCache = docargs["--tile-cache"].asLong();
+            VirtualTexture::setCacheBudget(size_t(max(1l, tileCache)) << 20);
+            console->info("Using a tile cache of {} MB for images too large for a single texture.", max(1l, tileCache));
+
+            long undoMemory = docargs["--undo-memory"].asLong();
+            CommandHistory::setMemoryBudget(size_t(max(0l, undoMemory)) << 20);
+            console->info("Using a memory budget of {} MB for the undo history of each image.", undoMemory);
+
+            long prefetch = docargs["--prefetch"].asLong();
+            ImageListPanel::setPrefetchCount(int(max(0l, prefetch)));
+            console->info("Prefetching up to {} images on each side of the current one.", prefetch);
+        }
+
+        // thumbnail cache
+        {
+            string directory = docargs["--thumbnail-cache"].asString();
+            if (directory == "none")
+                ThumbnailCache::setDirectory("");
+            else if (directory != "auto")
+                ThumbnailCache::setDirectory(directory);
+
+            if (ThumbnailCache::directory().empty())
+                console->info("Not storing thumbnails.");
+            else
+                console->info("Storing thumbnails in \"{}\".", ThumbnailCache::directory());
+        }
+
+        // tracing
+        if (docargs["--trace"])
+        {
+            traceFile = docargs["--trace"].asString();
+#if defined(HDRVIEW_TRACING)
+            trace::start();
+            TRACE_THREAD_NAME("main");
+            console->info("Recording a trace, which is written to \"{}\" on exit.", traceFile);
+#else
+            console->warn("Built without HDRVIEW_TRACING, ignoring --trace.");
+            traceFile.clear();
+#endif
+        }
+
 	    // list of filenames
 	    inFiles = docargs["FILE"].asStringList();
 		#endif
@@ -144,6 +272,9 @@ int main(int argc, char **argv)
         }
 
         nanogui::shutdown();
+
+        if (!traceFile.empty() && !trace::write(traceFile))
+            console->error("Cannot write the trace to \"{}\".", traceFile);
     }
     // Exceptions will only be thrown upon failed logger or sink construction (not during logging)
     catch (const spd::spdlog_ex& e)
@@ -7,7 +7,9 @@
 #include "HDRViewer.h"
 #include "GLImage.h"
 #include "EditImagePanel.h"
+#include "HDRImage.h"
 #include "ImageListPanel.h"
+#include <algorithm>
 #include <iostream>
 #include "Common.h"
 #include "CommandHistory.h"
@@ -102,6 +104,7 @@ HDRViewScreen::HDRViewScreen(float exposure, float gamma, bool sRGB, bool dither
 	btn->setFontSize(18);
 	btn->setIconPosition(Button::IconPosition::Right);
     m_imagesPanel = new ImageListPanel(m_sidePanelContents, this, m_imageView);
+	m_imageView->setHUDCallback([this]{return m_imagesPanel->performanceSummary();});
 
 	btn->setChangeCallback([this,btn](bool value)
                          {
@@ -268,7 +271,7 @@ HDRViewScreen::HDRViewScreen(float exposure, float gamma, bool sRGB, bool dither
 			                            string s = fmt::format(
 				                            "({: 4d},{: 4d}) = {}({: 6.3f}, {: 6.3f}, {: 6.3f}, {: 6.3f}) / ({: 3d}, {: 3d}, {: 3d}, {: 3d})",
 				                            pixelCoord.x(), pixelCoord.y(),
-											img->image().intensity().size() ? fmt::format("{: 6.3f} / ", img->image().intensity()(pixelCoord.x(), pixelCoord.y())).c_str() : "",
+											img->image().intensity().size() ? fmt::format("{: 6.3f} / ", img->image().intensity()(img->storedPixel(pixelCoord).x(), img->storedPixel(pixelCoord).y())).c_str() : "",
 				                            pixelVal[0], pixelVal[1], pixelVal[2], pixelVal[3],
 				                            (int) round(iPixelVal[0]), (int) round(iPixelVal[1]),
 				                            (int) round(iPixelVal[2]), (int) round(iPixelVal[3]));
@@ -317,6 +320,7 @@ HDRViewScreen::HDRViewScreen(float exposure, float gamma, bool sRGB, bool dither
 	setResizeCallback([&](Vector2i)
 	                  {
 		                  updateLayout();
+		                  m_redrawRequested = true;
 		                  drawAll();
 	                  });
 
@@ -480,9 +484,80 @@ void HDRViewScreen::saveImage()
 		// re-gain focus
 		glfwFocusWindow(mGLFWWindow);
 
-		if (!filename.empty())
+		if (filename.empty())
+			return;
+
+		string extension = getExtension(filename);
+		transform(extension.begin(), extension.end(), extension.begin(), ::tolower);
+		bool jpeg = extension == "jpg" || extension == "jpeg";
+		if (extension != "exr" && extension != "png" && !jpeg)
+		{
 			m_imagesPanel->saveImage(filename, m_imageView->exposure(), m_imageView->gamma(),
-			                      m_imageView->sRGB(), m_imageView->ditheringOn());
+			                         m_imageView->sRGB(), m_imageView->ditheringOn());
+			return;
+		}
+
+		// let the user pick the encoder settings before saving
+		static HDRImage::EXRCompression compression = HDRImage::exrCompression();
+		static bool half = HDRImage::exrHalf();
+		static int pngLevel = HDRImage::pngLevel();
+		static bool png16Bit = HDRImage::png16Bit();
+		static int jpegQuality = HDRImage::jpegQuality();
+
+		FormHelper *gui = new FormHelper(this);
+		gui->setFixedSize(Vector2i(125, 20));
+
+		auto window = gui->addWindow(Eigen::Vector2i(10, 10), "Save " + extension + " image");
+		if (extension == "exr")
+		{
+			gui->addVariable("Compression:", compression, true)
+			   ->setItems(HDRImage::exrCompressionNames());
+			gui->addVariable("Half floats:", half, true);
+		}
+		else if (extension == "png")
+		{
+			auto level = gui->addVariable("Compression level:", pngLevel);
+			level->setSpinnable(true);
+			level->setMinMaxValues(0, 9);
+			level->setTooltip("0 is fastest, 9 gives the smallest files.");
+			gui->addVariable("16-bit:", png16Bit, true);
+		}
+		else
+		{
+			auto quality = gui->addVariable("Quality:", jpegQuality);
+			quality->setSpinnable(true);
+			quality->setMinMaxValues(1, 100);
+		}
+
+		auto w = new Widget(window);
+		w->setLayout(new GridLayout(Orientation::Horizontal, 2, Alignment::Fill, 0, 5));
+		auto b = new Button(w, "Cancel", ENTYPO_ICON_CIRCLE_WITH_CROSS);
+		b->setCallback([window]() { window->dispose(); });
+		b = new Button(w, "Save", ENTYPO_ICON_CHECK);
+		b->setCallback(
+			[this,window,filename]()
+			{
+				HDRImage::setEXRCompression(compression);
+				HDRImage::setEXRHalf(half);
+				HDRImage::setPNGLevel(pngLevel);
+				HDRImage::setPNG16Bit(png16Bit);
+				HDRImage::setJPEGQuality(jpegQuality);
+				window->dispose();
+				try
+				{
+					m_imagesPanel->saveImage(filename, m_imageView->exposure(), m_imageView->gamma(),
+					                         m_imageView->sRGB(), m_imageView->ditheringOn());
+				}
+				catch (const exception &e)
+				{
+					new MessageDialog(this, MessageDialog::Type::Warning, "Error",
+					                  string("Could not save image due to an error:\n") + e.what());
+				}
+			});
+		gui->addWidget("", w);
+
+		window->center();
+		window->requestFocus();
 	}
 	catch (const exception &e)
 	{
@@ -494,20 +569,7 @@ void HDRViewScreen::saveImage()
 
 void HDRViewScreen::flipImage(bool h)
 {
-    if (h)
-		m_imagesPanel->modifyImage(
-		    [](const shared_ptr<const HDRImage> & img) -> ImageCommandResult
-		    {
-			    return {make_shared<HDRImage>(img->flippedHorizontal()),
-			            make_shared<LambdaUndo>([](shared_ptr<HDRImage> & img2) { *img2 = img2->flippedHorizontal(); })};
-		    });
-    else
-		m_imagesPanel->modifyImage(
-		    [](const shared_ptr<const HDRImage> & img) -> ImageCommandResult
-		    {
-			    return {make_shared<HDRImage>(img->flippedVertical()),
-			            make_shared<LambdaUndo>([](shared_ptr<HDRImage> & img2) { *img2 = img2->flippedVertical(); })};
-		    });
+	m_imagesPanel->reorientImage(h ? HDRImage::Orientation::flipHorizontal() : HDRImage::Orientation::flipVertical());
 }
 
 
@@ -523,6 +585,11 @@ bool HDRViewScreen::keyboardEvent(int key, int scancode, int action, int modifie
     {
         case GLFW_KEY_ESCAPE:
         {
+            // first press cancels any running edit and pending loads, only then offer to quit
+            bool canceledModify = m_imagesPanel->cancelModify();
+            if (m_imagesPanel->cancelLoads() || canceledModify)
+                return true;
+
             if (!m_okToQuitDialog)
             {
                 m_okToQuitDialog = new MessageDialog(this,
@@ -636,6 +703,10 @@ bool HDRViewScreen::keyboardEvent(int key, int scancode, int action, int modifie
 		    toggleHelpWindow();
             return true;
 
+        case 'P':
+		    m_imageView->setHUDVisible(!m_imageView->hudVisible());
+            return true;
+
         case GLFW_KEY_TAB:
 	        if (modifiers & GLFW_MOD_SHIFT)
 	        {
@@ -852,8 +923,30 @@ void HDRViewScreen::updateLayout()
 	performLayout();
 }
 
-void HDRViewScreen::drawContents()
+/*!
+ * The main loop calls this after every event, and at least every 50 ms. Redrawing an unchanged window would
+ * keep the GPU busy for nothing, so this only draws while there is recent input (which also covers hover effects
+ * and tooltips), a running animation or work in progress, and once more after that. A slow heartbeat repaints
+ * the window in case the window system lost its contents.
+ */
+void HDRViewScreen::drawAll()
 {
+	// these can change what is shown, and are requested from other threads
 	m_imagesPanel->runRequestedCallbacks();
+
+	double now = glfwGetTime();
+	bool busy = m_guiTimerRunning || m_imagesPanel->needsRedraw() || m_imageView->hudVisible() ||
+	            m_imageView->filterPreviewPending();
+	if (!busy && !m_wasBusy && !m_redrawRequested && now - mLastInteraction > 1.0 && now - m_lastDraw < 1.0)
+		return;
+
+	m_wasBusy = busy;
+	m_redrawRequested = false;
+	m_lastDraw = now;
+	Screen::drawAll();
+}
+
+void HDRViewScreen::drawContents()
+{
 	updateLayout();
 }
@@ -23,6 +23,7 @@ public:
     ~HDRViewScreen() override;
 
 	// overridden virtual functions from Screen
+    void drawAll() override;
     void drawContents() override;
     bool dropEvent(const std::vector<std::string> &filenames) override;
 	bool mouseButtonEvent(const Eigen::Vector2i &p, int button, bool down, int modifiers) override;
@@ -37,6 +38,7 @@ public:
 	void clearFocusPath() {mFocusPath.clear();}
 
 	int modifiers() const {return mModifiers;}
+	HDRImageViewer * imageViewer() const {return m_imageView;}
 
 	void updateCaption();
 
@@ -76,5 +78,10 @@ private:
 
 	bool m_draggingSidePanel = false;
 
+	// render on demand: drawAll only draws if something may have changed
+	bool m_redrawRequested = true;
+	bool m_wasBusy = false;         ///< So the frame after the end of some work still gets drawn
+	double m_lastDraw = 0.0;
+
     std::shared_ptr<spdlog::logger> console;
 };
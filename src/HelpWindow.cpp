@@ -111,6 +111,7 @@ HelpWindow::HelpWindow(Widget *parent, function<void()> closeCallback)
 	addRow(edits, "F", "Flip image about horizontal axis");
 	addRow(edits, "M", "Mirror image about vertical axis");
 	addRow(edits, COMMAND + "+Z / " + COMMAND + "+Shift+Z", "Undo/Redo");
+	addRow(edits, "Esc", "Cancel the running edit and pending image loads");
 
 	new Label(column, "Panning/Zooming", "sans-bold", 16);
 	auto panningZooming = new Widget(column);
@@ -128,6 +129,7 @@ HelpWindow::HelpWindow(Widget *parent, function<void()> closeCallback)
 
 	addRow(interface, "H", "Show/Hide Help (this Window)");
 	addRow(interface, "T", "Show/Hide the Top Toolbar");
+	addRow(interface, "P", "Show/Hide the Performance Overlay");
 	addRow(interface, "Tab", "Show/Hide the Side Panel");
 	addRow(interface, "Shift+Tab", "Show/Hide All Panels");
 	addRow(interface, COMMAND + "+Q or Esc", "Quit");
@@ -0,0 +1,292 @@
+//
+// Copyright (C) Wojciech Jarosz <wjarosz@gmail.com>. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can
+// be found in the LICENSE.txt file.
+//
+
+#include "HistogramShader.h"
+#include "Common.h"
+#include "Timer.h"
+#include <algorithm>
+#include <climits>
+#include <limits>
+#include <spdlog/spdlog.h>
+
+using namespace nanogui;
+using namespace std;
+
+namespace
+{
+using PixelSummary = ImageStatistics::PixelSummary;
+
+// The render targets are laid out in rows of Columns texels. Each channel's histogram is stored as Copies
+// separate histograms (pixel p goes into copy p % Copies) of BinRows rows, followed by SumRows rows of partial sums.
+const int Columns = 1024;
+const int BinRows = (PixelSummary::NumBins + Columns - 1) / Columns;
+const int Copies = 16;
+const int SumRows = 16;
+const int SumCells = SumRows * Columns;
+const int SumRow = 3 * Copies * BinRows;
+const int BinTargetHeight = SumRow + SumRows;
+
+// The largest count of a single float texel that is still exact
+const int MaxExactCount = 1 << 24;
+// Number of points to draw per call, to avoid stalling the GPU for too long at once
+const int BatchSize = 1 << 22;
+
+// Vertex shader for the histogram and sum pass: four points per pixel, one per channel's bin and one for the sum
+constexpr char const *const binVertexShader =
+R"(#version 330
+
+    uniform sampler2D image;
+    uniform int width;
+
+    flat out float weight;
+
+    void main()
+    {
+        int p = gl_VertexID / 4;
+        int c = gl_VertexID - 4 * p;
+        vec4 v = texelFetch(image, ivec2(p % width, p / width), 0);
+
+        ivec2 cell;
+        if (c < 3)
+        {
+            // same binning as ImageStatistics::PixelSummary::bin
+            uint bits = floatBitsToUint(v[c]);
+            int bin = (bits == 0u || bits > 0x7f800000u) ? NON_POSITIVE_BIN : int(bits >> 17);
+            cell = ivec2(bin % COLUMNS, (c * COPIES + p % COPIES) * BIN_ROWS + bin / COLUMNS);
+            weight = 1.0;
+        }
+        else
+        {
+            int i = p % SUM_CELLS;
+            cell = ivec2(i % COLUMNS, SUM_ROW + i / COLUMNS);
+            weight = v.r + v.g + v.b;
+        }
+
+        gl_Position = vec4((vec2(cell) + 0.5) / vec2(COLUMNS, TARGET_HEIGHT) * 2.0 - 1.0, 0.0, 1.0);
+    }
+)";
+
+constexpr char const *const binFragmentShader =
+R"(#version 330
+
+    flat in float weight;
+    out vec4 out_color;
+
+    void main()
+    {
+        out_color = vec4(weight);
+    }
+)";
+
+// Vertex shader for the minimum/maximum pass: one point per pixel
+constexpr char const *const rangeVertexShader =
+R"(#version 330
+
+    uniform sampler2D image;
+    uniform int width;
+
+    flat out vec3 value;
+
+    void main()
+    {
+        int p = gl_VertexID;
+        value = texelFetch(image, ivec2(p % width, p / width), 0).rgb;
+
+        int i = p % SUM_CELLS;
+        vec2 cell = vec2(i % COLUMNS, i / COLUMNS);
+        gl_Position = vec4((cell + 0.5) / vec2(COLUMNS, SUM_ROWS) * 2.0 - 1.0, 0.0, 1.0);
+    }
+)";
+
+// with GL_MAX blending, the second target accumulates the negated minimum
+constexpr char const *const rangeFragmentShader =
+R"(#version 330
+
+    flat in vec3 value;
+    layout(location = 0) out vec4 max_color;
+    layout(location = 1) out vec4 min_color;
+
+    void main()
+    {
+        max_color = vec4(value, 0.0);
+        min_color = vec4(-value, 0.0);
+    }
+)";
+
+GLuint createTarget(GLint internalFormat, GLenum format, int width, int height)
+{
+	GLuint id;
+	glGenTextures(1, &id);
+	glBindTexture(GL_TEXTURE_2D, id);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTexImage2D(GL_TEXTURE_2D, 0, internalFormat, width, height, 0, format, GL_FLOAT, nullptr);
+	return id;
+}
+
+void drawPoints(GLShader & shader, GLuint textureId, int width, int numPoints)
+{
+	shader.bind();
+	glActiveTexture(GL_TEXTURE0);
+	glBindTexture(GL_TEXTURE_2D, textureId);
+	shader.setUniform("image", 0);
+	shader.setUniform("width", width);
+
+	for (int first = 0; first < numPoints; first += BatchSize)
+		shader.drawArray(GL_POINTS, first, min(BatchSize, numPoints - first));
+}
+
+} // namespace
+
+HistogramShader::HistogramShader()
+{
+	// share the layout of the render targets with the shaders
+	for (auto shader : {&m_binShader, &m_rangeShader})
+	{
+		shader->define("NON_POSITIVE_BIN", to_string(PixelSummary::NonPositiveBin));
+		shader->define("COLUMNS", to_string(Columns));
+		shader->define("BIN_ROWS", to_string(BinRows));
+		shader->define("COPIES", to_string(Copies));
+		shader->define("SUM_ROW", to_string(SumRow));
+		shader->define("SUM_ROWS", to_string(SumRows));
+		shader->define("SUM_CELLS", to_string(SumCells));
+		shader->define("TARGET_HEIGHT", to_string(BinTargetHeight));
+	}
+
+	if (!m_binShader.init("Histogram", binVertexShader, binFragmentShader) ||
+	    !m_rangeShader.init("Histogram range", rangeVertexShader, rangeFragmentShader))
+	{
+		spdlog::get("console")->warn("Could not compile the histogram shaders. Falling back to computing histograms on the CPU.");
+		return;
+	}
+
+	// the histogram and sum target
+	m_binTexture = createTarget(GL_R32F, GL_RED, Columns, BinTargetHeight);
+	// the maximum and (negated) minimum targets
+	m_rangeTextures[0] = createTarget(GL_RGBA32F, GL_RGBA, Columns, SumRows);
+	m_rangeTextures[1] = createTarget(GL_RGBA32F, GL_RGBA, Columns, SumRows);
+	glBindTexture(GL_TEXTURE_2D, 0);
+
+	GLint previousFramebuffer;
+	glGetIntegerv(GL_FRAMEBUFFER_BINDING, &previousFramebuffer);
+
+	glGenFramebuffers(2, m_framebuffers);
+	glBindFramebuffer(GL_FRAMEBUFFER, m_framebuffers[0]);
+	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, m_binTexture, 0);
+	bool complete = glCheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE;
+
+	glBindFramebuffer(GL_FRAMEBUFFER, m_framebuffers[1]);
+	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, m_rangeTextures[0], 0);
+	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT1, GL_TEXTURE_2D, m_rangeTextures[1], 0);
+	const GLenum drawBuffers[] = {GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1};
+	glDrawBuffers(2, drawBuffers);
+	complete = complete && glCheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE;
+
+	glBindFramebuffer(GL_FRAMEBUFFER, previousFramebuffer);
+
+	if (!complete)
+		spdlog::get("console")->warn("Floating-point render targets are not supported. Falling back to computing histograms on the CPU.");
+	m_valid = complete;
+}
+
+HistogramShader::~HistogramShader()
+{
+	m_binShader.free();
+	m_rangeShader.free();
+	glDeleteFramebuffers(2, m_framebuffers);
+	glDeleteTextures(1, &m_binTexture);
+	glDeleteTextures(2, m_rangeTextures);
+}
+
+shared_ptr<const PixelSummary> HistogramShader::summarize(GLuint textureId, int width, int height)
+{
+	if (!m_valid || !textureId || width <= 0 || height <= 0)
+		return nullptr;
+
+	// the vertex ids need to fit in an int, and the counts of a single texel need to stay exact
+	long long numPixels = (long long) width * height;
+	if (numPixels > INT_MAX / 4 || (numPixels + Copies - 1) / Copies > MaxExactCount)
+		return nullptr;
+
+	Timer timer;
+
+	// save the state we are about to change
+	GLint previousFramebuffer, viewport[4];
+	glGetIntegerv(GL_FRAMEBUFFER_BINDING, &previousFramebuffer);
+	glGetIntegerv(GL_VIEWPORT, viewport);
+	GLboolean blend = glIsEnabled(GL_BLEND);
+	GLboolean scissor = glIsEnabled(GL_SCISSOR_TEST);
+	GLboolean depth = glIsEnabled(GL_DEPTH_TEST);
+
+	glDisable(GL_SCISSOR_TEST);
+	glDisable(GL_DEPTH_TEST);
+	glEnable(GL_BLEND);
+	glBlendFunc(GL_ONE, GL_ONE);
+
+	// accumulate the histograms and sums
+	const GLfloat zero[] = {0.f, 0.f, 0.f, 0.f};
+	glBindFramebuffer(GL_FRAMEBUFFER, m_framebuffers[0]);
+	glViewport(0, 0, Columns, BinTargetHeight);
+	glClearBufferfv(GL_COLOR, 0, zero);
+	glBlendEquation(GL_FUNC_ADD);
+	drawPoints(m_binShader, textureId, width, int(4 * numPixels));
+
+	// accumulate the maximum and negated minimum
+	const GLfloat lowest[] = {-numeric_limits<float>::max(), -numeric_limits<float>::max(),
+	                          -numeric_limits<float>::max(), -numeric_limits<float>::max()};
+	glBindFramebuffer(GL_FRAMEBUFFER, m_framebuffers[1]);
+	glViewport(0, 0, Columns, SumRows);
+	glClearBufferfv(GL_COLOR, 0, lowest);
+	glClearBufferfv(GL_COLOR, 1, lowest);
+	glBlendEquation(GL_MAX);
+	drawPoints(m_rangeShader, textureId, width, int(numPixels));
+
+	// read everything back
+	vector<GLfloat> bins(Columns * BinTargetHeight), maxima(4 * SumCells), minima(4 * SumCells);
+	glReadBuffer(GL_COLOR_ATTACHMENT0);
+	glReadPixels(0, 0, Columns, SumRows, GL_RGBA, GL_FLOAT, maxima.data());
+	glReadBuffer(GL_COLOR_ATTACHMENT1);
+	glReadPixels(0, 0, Columns, SumRows, GL_RGBA, GL_FLOAT, minima.data());
+	glBindFramebuffer(GL_FRAMEBUFFER, m_framebuffers[0]);
+	glReadBuffer(GL_COLOR_ATTACHMENT0);
+	glReadPixels(0, 0, Columns, BinTargetHeight, GL_RED, GL_FLOAT, bins.data());
+
+	// restore the state
+	glBindFramebuffer(GL_FRAMEBUFFER, previousFramebuffer);
+	glViewport(viewport[0], viewport[1], viewport[2], viewport[3]);
+	glBlendEquation(GL_FUNC_ADD);
+	glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+	if (!blend) glDisable(GL_BLEND);
+	if (scissor) glEnable(GL_SCISSOR_TEST);
+	if (depth) glEnable(GL_DEPTH_TEST);
+
+	// merge the copies of the histograms, and the partial sums, minima and maxima
+	auto ret = make_shared<PixelSummary>();
+	ret->numPixels = size_t(numPixels);
+	for (int c = 0; c < 3; ++c)
+	{
+		ret->bins[c].assign(PixelSummary::NumBins, 0);
+		for (int k = 0; k < Copies; ++k)
+		{
+			const GLfloat * copy = bins.data() + (c * Copies + k) * BinRows * Columns;
+			for (int b = 0; b < PixelSummary::NumBins; ++b)
+				ret->bins[c][b] += uint32_t(copy[b]);
+		}
+	}
+
+	const GLfloat * sums = bins.data() + SumRow * Columns;
+	for (int i = 0; i < SumCells; ++i)
+		ret->sum += sums[i];
+
+	for (int i = 0; i < SumCells; ++i)
+	{
+		ret->maximum = max(ret->maximum, max(maxima[4 * i + 0], maxima[4 * i + 1], maxima[4 * i + 2]));
+		ret->minimum = min(ret->minimum, -max(minima[4 * i + 0], minima[4 * i + 1], minima[4 * i + 2]));
+	}
+
+	spdlog::get("console")->trace("Summarizing the pixel statistics on the GPU took {} seconds.", (timer.elapsed() / 1000.f));
+	return ret;
+}
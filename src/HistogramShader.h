@@ -0,0 +1,48 @@
+//
+// Copyright (C) Wojciech Jarosz <wjarosz@gmail.com>. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can
+// be found in the LICENSE.txt file.
+//
+
+#pragma once
+
+#include <nanogui/opengl.h>
+#include <nanogui/glutil.h>
+#include <memory>
+#include "GLImage.h"
+
+/*!
+ * Computes the exposure-independent ImageStatistics::PixelSummary of an image that is already resident on the GPU.
+ *
+ * Every pixel is scattered as a point into a floating-point render target with additive blending, one point per
+ * channel into the histogram bins (which are derived from the bits of the float value, exactly like on the CPU),
+ * and one more into a sum. A second pass with GL_MAX blending computes the minimum and maximum. Each quantity is
+ * spread over many texels so that the float accumulation stays exact for counts and accurate for the sums.
+ *
+ * The results reflect the precision of the texture, so images stored as half floats produce slightly different
+ * minimum, maximum and average values than the full precision image.
+ *
+ * Needs a current OpenGL context.
+ */
+class HistogramShader
+{
+public:
+	HistogramShader();
+	~HistogramShader();
+
+	/*!
+	 * Summarize the base level of the texture textureId with the given size.
+	 *
+	 * @return The summary, or nullptr if the GPU path cannot handle an image of this size
+	 * 		   (e.g. because the counts would overflow the precision of a float)
+	 */
+	std::shared_ptr<const ImageStatistics::PixelSummary> summarize(GLuint textureId, int width, int height);
+
+private:
+	nanogui::GLShader m_binShader;
+	nanogui::GLShader m_rangeShader;
+	GLuint m_framebuffers[2] = {0, 0};
+	GLuint m_binTexture = 0;
+	GLuint m_rangeTextures[2] = {0, 0};
+	bool m_valid = false;
+};
@@ -21,7 +21,13 @@ using namespace std;
 ImageButton::ImageButton(Widget *parent, const string &caption)
 	: Widget (parent), m_caption(caption)
 {
-	mFontSize = 15;
+	mFontSize = FontSize;
+}
+
+ImageButton::~ImageButton()
+{
+	if (m_thumbnailImage)
+		nvgDeleteImage(m_context, m_thumbnailImage);
 }
 
 void ImageButton::recomputeStringClipping()
@@ -48,7 +54,9 @@ Vector2i ImageButton::preferredSize(NVGcontext *ctx) const
 	nvgFontSize(ctx, mFontSize);
 	float tw = nvgTextBounds(ctx, 0, 0, m_caption.c_str(), nullptr, nullptr);
 
-	return Vector2i(static_cast<int>(tw + iw + idSize) + 15, mFontSize + 6);
+	// thumbnails fit in a square at the right end of a button that is twice as high
+	int height = rowHeight(m_showThumbnail);
+	return Vector2i(static_cast<int>(tw + iw + idSize) + 15 + (m_showThumbnail ? height : 0), height);
 }
 
 bool ImageButton::mouseButtonEvent(const Vector2i &p, int button, bool down, int modifiers)
@@ -213,6 +221,36 @@ void ImageButton::draw(NVGcontext *ctx)
 	nvgFontFace(ctx, "icons");
 	float iconSize = nvgTextBounds(ctx, 0, 0, utf8(ENTYPO_ICON_PENCIL).data(), nullptr, nullptr);
 
+	// thumbnail
+	float thumbnailSize = 0.f;
+	if (m_showThumbnail)
+	{
+		// the thumbnail only changes when an image is loaded, so its NanoVG image is kept around until then
+		if (m_thumbnail != m_drawnThumbnail)
+		{
+			if (m_thumbnailImage)
+				nvgDeleteImage(ctx, m_thumbnailImage);
+			m_thumbnailImage = m_thumbnail ? nvgCreateImageRGBA(ctx, m_thumbnail->width, m_thumbnail->height, 0,
+			                                                    m_thumbnail->pixels.data()) : 0;
+			m_drawnThumbnail = m_thumbnail;
+			m_context = ctx;
+		}
+
+		thumbnailSize = mSize.y() - 4.f;
+		if (m_thumbnailImage)
+		{
+			float scale = thumbnailSize / max(m_drawnThumbnail->width, m_drawnThumbnail->height);
+			float w = m_drawnThumbnail->width * scale, h = m_drawnThumbnail->height * scale;
+			float x = mPos.x() + mSize.x() - 2 - (thumbnailSize + w) / 2, y = mPos.y() + 2 + (thumbnailSize - h) / 2;
+
+			nvgBeginPath(ctx);
+			nvgRect(ctx, x, y, w, h);
+			nvgFillPaint(ctx, nvgImagePattern(ctx, x, y, w, h, 0.f, m_thumbnailImage, 1.f));
+			nvgFill(ctx);
+		}
+		thumbnailSize += 5.f;
+	}
+
 	nvgFontSize(ctx, mFontSize);
 	nvgFontFace(ctx, m_isSelected ? "sans-bold" : "sans");
 
@@ -222,7 +260,7 @@ void ImageButton::draw(NVGcontext *ctx)
 	else if (mSize != m_sizeForWhichCutoffWasComputed)
 	{
 		m_cutoff = 0;
-		while (nvgTextBounds(ctx, 0, 0, m_caption.substr(m_cutoff).c_str(), nullptr, nullptr) > mSize.x() - 15 - idSize - iconSize)
+		while (nvgTextBounds(ctx, 0, 0, m_caption.substr(m_cutoff).c_str(), nullptr, nullptr) > mSize.x() - 15 - idSize - iconSize - thumbnailSize)
 			++m_cutoff;
 
 		m_sizeForWhichCutoffWasComputed = mSize;
@@ -258,7 +296,7 @@ void ImageButton::draw(NVGcontext *ctx)
 
 	Vector2f center = mPos.cast<float>() + mSize.cast<float>() * 0.5f;
 	Vector2f bottomRight = mPos.cast<float>() + mSize.cast<float>();
-	Vector2f textPos(bottomRight.x() - 5, center.y());
+	Vector2f textPos(bottomRight.x() - 5 - thumbnailSize, center.y());
 	NVGcolor regularTextColor = (m_isSelected || m_isReference || mMouseFocus) ? mTheme->mTextColor : Color(190, 100);
 	NVGcolor hightlightedTextColor = Color(190, 255);
 
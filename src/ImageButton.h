@@ -10,15 +10,21 @@
 #pragma once
 
 #include "Common.h"
+#include "ThumbnailCache.h"
 
 #include <nanogui/widget.h>
 
+#include <memory>
 #include <string>
 
 class ImageButton : public nanogui::Widget
 {
 public:
 	ImageButton(nanogui::Widget *parent, const std::string &caption);
+	~ImageButton();
+
+	/// The height of all buttons, which the image list lays its rows out with
+	static int rowHeight(bool showThumbnail)   { return showThumbnail ? 2 * (FontSize + 6) : FontSize + 6; }
 
 	Eigen::Vector2i preferredSize(NVGcontext *ctx) const override;
 	bool mouseButtonEvent(const Eigen::Vector2i &p, int button, bool down, int modifiers) override;
@@ -38,6 +44,11 @@ public:
 	void setIsSelected(bool isSelected)         { m_isSelected = isSelected; }
 	bool isReference() const                    { return m_isReference; }
 	void setIsReference(bool isReference)       { m_isReference = isReference; }
+	/// The thumbnail to show at the right end of the button, or null to leave its space empty for now
+	void setThumbnail(const std::shared_ptr<const Thumbnail> & thumbnail) { m_thumbnail = thumbnail; }
+	/// Whether the button is tall enough to show a thumbnail, instead of just the caption
+	bool showThumbnail() const                  { return m_showThumbnail; }
+	void setShowThumbnail(bool show)            { if (show != m_showThumbnail) { m_showThumbnail = show; recomputeStringClipping(); } }
 
 
 	std::string highlighted() const;
@@ -55,29 +66,9 @@ public:
 		m_referenceCallback = callback;
 	}
 
-
-	void swapWith(ImageButton & other)
-	{
-		std::swap(m_caption, other.m_caption);
-		std::swap(m_isModified, other.m_isModified);
-//		std::swap(m_isSelected, other.m_isSelected);
-//		std::swap(m_isReference, other.m_isReference);
-//		std::swap(m_selectedCallback, other.m_selectedCallback);
-//		std::swap(m_referenceCallback, other.m_referenceCallback);
-//		std::swap(m_id, other.m_id);
-		std::swap(m_progress, other.m_progress);
-		std::swap(m_highlightBegin, other.m_highlightBegin);
-		std::swap(m_highlightEnd, other.m_highlightEnd);
-		std::swap(mTooltip, other.mTooltip);
-
-		// swapping may need to recompute trimming
-		m_cutoff = 0;
-		m_sizeForWhichCutoffWasComputed = Eigen::Vector2i::Constant(0);
-		other.m_cutoff = 0;
-		other.m_sizeForWhichCutoffWasComputed = Eigen::Vector2i::Constant(0);
-	}
-
 private:
+	static const int FontSize = 15;
+
 	std::string m_caption;
 
 	bool m_isModified = false;
@@ -95,6 +86,12 @@ private:
 
 	float m_progress = -1.f;
 
+	bool m_showThumbnail = false;
+	std::shared_ptr<const Thumbnail> m_thumbnail;
+	std::shared_ptr<const Thumbnail> m_drawnThumbnail;  ///< The thumbnail m_thumbnailImage was created from
+	int m_thumbnailImage = 0;                           ///< The NanoVG image of m_drawnThumbnail, if any
+	NVGcontext * m_context = nullptr;                   ///< To delete m_thumbnailImage with
+
 public:
 	EIGEN_MAKE_ALIGNED_OPERATOR_NEW
 };
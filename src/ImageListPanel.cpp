@@ -11,14 +11,43 @@
 #include "HDRImageViewer.h"
 #include "MultiGraph.h"
 #include "Well.h"
+#include "BufferPool.h"
+#include "ParallelFor.h"
 #include <spdlog/spdlog.h>
 #include "Timer.h"
+#include "Trace.h"
 #include <tinydir.h>
+#include <mutex>
 #include <set>
 
 
 using namespace std;
 
+namespace
+{
+
+/// The thumbnail that the ThumbnailCache holds for a file, which is read only once, by whoever needs it first
+class StoredThumbnail
+{
+public:
+	explicit StoredThumbnail(const string & filename) : m_filename(filename) {}
+
+	const shared_ptr<const Thumbnail> & get()
+	{
+		call_once(m_read, [this]{m_thumbnail = ThumbnailCache::read(m_filename);});
+		return m_thumbnail;
+	}
+
+private:
+	string m_filename;
+	once_flag m_read;
+	shared_ptr<const Thumbnail> m_thumbnail;
+};
+
+} // namespace
+
+int ImageListPanel::s_prefetchCount = 2;
+
 ImageListPanel::ImageListPanel(Widget *parent, HDRViewScreen * screen, HDRImageViewer * imgViewer)
 	: Widget(parent),
 	  m_imageModifyDoneRequested(false),
@@ -71,6 +100,28 @@ ImageListPanel::ImageListPanel(Widget *parent, HDRViewScreen * screen, HDRImageV
 		m_graph->addPlot(Color(0, 255, 0, 150));
 		m_graph->addPlot(Color(0, 0, 255, 150));
 
+		// live statistics of the blend with the reference image
+		auto grid = new Widget(row);
+		auto agl = new AdvancedGridLayout({0, 4, 0});
+		grid->setLayout(agl);
+		agl->setColStretch(2, 1.0f);
+
+		agl->appendRow(0);
+		agl->setAnchor(new Label(grid, "Difference:", "sans", 14),
+		               AdvancedGridLayout::Anchor(0, agl->rowCount() - 1, Alignment::Fill, Alignment::Fill));
+
+		m_differenceRegion = new ComboBox(grid, {"Whole image", "Viewport"});
+		m_differenceRegion->setTooltip("Compute the statistics of the blend with the reference over the whole image, "
+		                               "or only over the visible part of it.");
+		m_differenceRegion->setFixedHeight(19);
+		m_differenceRegion->setCallback([this](int) { m_differenceKey = DifferenceKey(); });
+		agl->setAnchor(m_differenceRegion,
+		               AdvancedGridLayout::Anchor(2, agl->rowCount() - 1, Alignment::Fill, Alignment::Fill));
+
+		m_differenceLabel = new Label(row, "", "sans", 14);
+		m_differenceLabel->setTooltip("Mean, root mean square and maximum of the blended values of the current "
+		                              "and reference images, over all channels.");
+
 		row = new Widget(this);
 		row->setLayout(new GridLayout(Orientation::Horizontal, 5, Alignment::Fill, 0, 2));
 
@@ -131,12 +182,60 @@ ImageListPanel::ImageListPanel(Widget *parent, HDRViewScreen * screen, HDRImageV
 		m_channels->setCallback([imgViewer](int c) { imgViewer->setChannel(EChannel(c)); });
 		agl->setAnchor(m_channels,
 		               AdvancedGridLayout::Anchor(2, agl->rowCount() - 1, Alignment::Fill, Alignment::Fill));
+
+		agl->appendRow(4);  // spacing
+		agl->appendRow(0);
+
+		agl->setAnchor(new Label(grid, "Colormap:", "sans", 14),
+		               AdvancedGridLayout::Anchor(0, agl->rowCount() - 1, Alignment::Fill, Alignment::Fill));
+
+		m_colormaps = new ComboBox(grid, HDRImage::colormapNames());
+		m_colormaps->setTooltip("The colormap that shows the values of single-channel images (e.g. depth maps).");
+		m_colormaps->setFixedHeight(19);
+		m_colormaps->setCallback([imgViewer](int c) { imgViewer->setColormap(HDRImage::Colormap(c)); });
+		agl->setAnchor(m_colormaps,
+		               AdvancedGridLayout::Anchor(2, agl->rowCount() - 1, Alignment::Fill, Alignment::Fill));
+
+		agl->appendRow(4);  // spacing
+		agl->appendRow(0);
+
+		agl->setAnchor(new Label(grid, "Range:", "sans", 14),
+		               AdvancedGridLayout::Anchor(0, agl->rowCount() - 1, Alignment::Fill, Alignment::Fill));
+
+		// the range of single-channel values spread over the colormap, which only changes how they are shown
+		auto row = new Widget(grid);
+		row->setLayout(new BoxLayout(Orientation::Horizontal, Alignment::Fill, 0, 2));
+		m_rangeMin = new FloatBox<float>(row, 0.f);
+		m_rangeMax = new FloatBox<float>(row, 0.f);
+		m_autoRangeButton = new Button(row, "", ENTYPO_ICON_CYCLE);
+		for (auto box : {m_rangeMin, m_rangeMax})
+		{
+			box->setEditable(true);
+			box->setFixedSize(Vector2i(70, 19));
+			box->setAlignment(TextBox::Alignment::Right);
+			box->setCallback([this](float)
+			{
+				if (auto img = currentImage())
+					img->setSingleChannelRange(Vector2f(m_rangeMin->value(), m_rangeMax->value() - m_rangeMin->value()));
+			});
+		}
+		m_rangeMin->setTooltip("The single-channel value shown with the first color of the colormap.");
+		m_rangeMax->setTooltip("The single-channel value shown with the last color of the colormap.");
+		m_autoRangeButton->setFixedSize(Vector2i(19, 19));
+		m_autoRangeButton->setTooltip("Reset the range to that of the positive values of the image.");
+		m_autoRangeButton->setCallback([this]
+		{
+			if (auto img = currentImage())
+				img->resetSingleChannelRange();
+		});
+		agl->setAnchor(row,
+		               AdvancedGridLayout::Anchor(2, agl->rowCount() - 1, Alignment::Fill, Alignment::Fill));
 	}
 
 	// filter/search of open images GUI elemen ts
 	{
 		auto grid = new Widget(this);
-		auto agl = new AdvancedGridLayout({0, 2, 0, 2, 0, 2, 0});
+		auto agl = new AdvancedGridLayout({0, 2, 0, 2, 0, 2, 0, 2, 0});
 		grid->setLayout(agl);
 		agl->setColStretch(0, 1.0f);
 
@@ -146,6 +245,7 @@ ImageListPanel::ImageListPanel(Widget *parent, HDRViewScreen * screen, HDRImageV
 		m_eraseButton = new Button(grid, "", ENTYPO_ICON_ERASE);
 		m_regexButton = new Button(grid, ".*");
 		m_useShortButton = new Button(grid, "", ENTYPO_ICON_LIST);
+		m_thumbnailsButton = new Button(grid, "", ENTYPO_ICON_IMAGE);
 
 		m_filter->setEditable(true);
 		m_filter->setAlignment(TextBox::Alignment::Left);
@@ -185,8 +285,25 @@ ImageListPanel::ImageListPanel(Widget *parent, HDRViewScreen * screen, HDRImageV
 		agl->setAnchor(m_useShortButton,
 		               AdvancedGridLayout::Anchor(6, agl->rowCount() - 1, Alignment::Minimum, Alignment::Fill));
 
+		m_thumbnailsButton->setFixedWidth(19);
+		m_thumbnailsButton->setFixedHeight(19);
+		m_thumbnailsButton->setTooltip("Toggle showing a thumbnail of each image.");
+		m_thumbnailsButton->setFlags(Button::ToggleButton);
+		m_thumbnailsButton->setPushed(true);
+		m_thumbnailsButton->setChangeCallback([this](bool){ updateRows(); });
+		agl->setAnchor(m_thumbnailsButton,
+		               AdvancedGridLayout::Anchor(8, agl->rowCount() - 1, Alignment::Minimum, Alignment::Fill));
+
 	}
 
+	m_memoryLabel = new Label(this, "", "sans", 14);
+	m_memoryLabel->setTooltip("Memory used by the open images, and the budgets beyond which the least recently "
+	                          "viewed images are swapped out.");
+
+	// only the rows in view get a button (see updateImageButtons), so the list has no layout of its own
+	m_imageListWidget = new Well(this);
+	m_imageListWidget->setVisible(false);
+
 	m_numImagesCallback =
 		[this](void)
 		{
@@ -232,53 +349,111 @@ void ImageListPanel::focusFilter() {m_filter->requestFocus();}
 
 void ImageListPanel::repopulateImageList()
 {
-	// this currently just clears all the widgets and recreates all of them
-	// from scratch. this doesn't scale, but should be fine unless you have a
-	// lot of images, and makes the logic a lot simpler.
+	// m_matches is kept in step with m_images, but the filter needs to be applied to any new images
+	updateRows();
+	updateButtons();
+	m_updateFilterRequested = true;
+}
 
-	// prevent crash when the focus path includes any of the widgets we are destroying
-	m_screen->clearFocusPath();
-	m_imageButtons.clear();
+/*!
+ * Make a row for each image that passes the filter, and size the list for them. This does not create any
+ * widgets, updateImageButtons only sets up buttons for the rows in view.
+ */
+void ImageListPanel::updateRows()
+{
+	m_rows.clear();
+	for (int i = 0; i < numImages(); ++i)
+		if (m_matches[i])
+			m_rows.push_back(i);
+	++m_rowsVersion;
 
-	// clear everything
-	if (m_imageListWidget)
-		removeChild(m_imageListWidget);
+	int height = int(m_rows.size()) * ImageButton::rowHeight(m_thumbnailsButton->pushed());
+	if (m_imageListWidget->fixedHeight() != height || m_imageListWidget->visible() != !m_rows.empty())
+	{
+		m_imageListWidget->setFixedHeight(height);
+		m_imageListWidget->setVisible(!m_rows.empty());
+		m_screen->performLayout();
+	}
+}
 
-	m_imageListWidget = new Well(this);
-	m_imageListWidget->setLayout(new BoxLayout(Orientation::Vertical, Alignment::Fill, 0));
+/*!
+ * Set up a button for each row of the list that is in view, i.e. not clipped by the scroll panel the list is in.
+ * The buttons are reused for other rows as the list scrolls, and their captions and tooltips are only set when
+ * their row or the rows change, since trimming the captions to the available space is not free.
+ */
+void ImageListPanel::updateImageButtons()
+{
+	int rowHeight = ImageButton::rowHeight(m_thumbnailsButton->pushed());
 
-	for (int i = 0; i < numImages(); ++i)
+	// the part of the list that its ancestors do not clip, in its own coordinates
+	int top = 0, bottom = m_imageListWidget->height();
+	int offset = m_imageListWidget->absolutePosition().y();
+	for (Widget * w = m_imageListWidget->parent(); w; w = w->parent())
 	{
-		auto btn = new ImageButton(m_imageListWidget, image(i)->filename());
-		btn->setImageId(i+1);
-		btn->setSelectedCallback([&,i](int){setCurrentImageIndex(i);});
-		btn->setReferenceCallback([&,i](int){setReferenceImageIndex(i);});
+		int y = w->absolutePosition().y() - offset;
+		top = max(top, y);
+		bottom = min(bottom, y + w->height());
+	}
+	int first = max(0, top / rowHeight);
+	int count = m_imageListWidget->visible() ? max(0, min(int(m_rows.size()), (bottom + rowHeight - 1) / rowHeight) - first) : 0;
 
+	while (int(m_imageButtons.size()) < count)
+	{
+		auto btn = new ImageButton(m_imageListWidget, "");
+		// the ids are the 1-based rows of the list
+		btn->setSelectedCallback([this](int id)
+		{
+			if (id > 0 && id <= int(m_rows.size()))
+				setCurrentImageIndex(m_rows[id - 1]);
+		});
+		btn->setReferenceCallback([this](int id)
+		{
+			setReferenceImageIndex(id > 0 && id <= int(m_rows.size()) ? m_rows[id - 1] : -1);
+		});
 		m_imageButtons.push_back(btn);
+		m_buttonRows.emplace_back(-1, -1);
 	}
 
-    updateButtons();
-
-	updateFilter();
-
-	m_screen->performLayout();
+	for (int b = 0; b < int(m_imageButtons.size()); ++b)
+	{
+		auto btn = m_imageButtons[b];
+		btn->setVisible(b < count);
+		if (b >= count)
+			continue;
+
+		int row = first + b;
+		int i = m_rows[row];
+		auto img = image(i);
+		btn->setPosition(Vector2i(0, row * rowHeight));
+		btn->setSize(Vector2i(m_imageListWidget->width(), rowHeight));
+		btn->setShowThumbnail(m_thumbnailsButton->pushed());
+		btn->setIsSelected(i == m_current);
+		btn->setIsReference(i == m_reference);
+		btn->setIsModified(img->isModified());
+		btn->setProgress(img->progress());
+		btn->setThumbnail(img->thumbnail());
+
+		if (m_buttonRows[b] == make_pair(row, m_rowsVersion))
+			continue;
+		m_buttonRows[b] = make_pair(row, m_rowsVersion);
+
+		btn->setImageId(row + 1);
+		btn->setCaption(img->filename());
+		btn->setHighlightRange(m_beginShortOffset, m_endShortOffset);
+		if (m_useShortButton->pushed())
+		{
+			btn->setCaption(btn->highlighted());
+			btn->setHighlightRange(0, 0);
+		}
+		btn->setTooltip(
+				fmt::format("Path: {:s}\n\nResolution: ({:d}, {:d})", img->filename(), img->width(), img->height()));
+	}
 }
 
 void ImageListPanel::updateButtons()
 {
-    for (int i = 0; i < numImages(); ++i)
-    {
-        auto img = image(i);
-        auto btn = m_imageButtons[i];
-
-        btn->setIsSelected(i == m_current);
-        btn->setIsReference(i == m_reference);
-        btn->setCaption(img->filename());
-        btn->setIsModified(img->isModified());
-        btn->setProgress(img->progress());
-        btn->setTooltip(
-                fmt::format("Path: {:s}\n\nResolution: ({:d}, {:d})", img->filename(), img->width(), img->height()));
-    }
+    // the buttons in view pick up the new filenames and resolutions the next time they are drawn
+    ++m_rowsVersion;
 
     m_histogramUpdateRequested = true;
 //    updateHistogram();
@@ -302,7 +477,8 @@ bool ImageListPanel::swapImages(int index1, int index2)
 		return false;
 
 	swap(m_images[index1], m_images[index2]);
-	m_imageButtons[index1]->swapWith(*m_imageButtons[index2]);
+	swap(m_matches[index1], m_matches[index2]);
+	updateRows();
 
 	return true;
 }
@@ -342,6 +518,15 @@ void ImageListPanel::draw(NVGcontext *ctx)
 
 	if (m_updateFilterRequested)
 		updateFilter();
+	applyFilter();
+
+	// once the texture is resident, a histogram still being computed on the CPU can be finished on the GPU
+	if (m_histogramDirty &&
+		currentImage() &&
+		!currentImage()->isNull() &&
+		currentImage()->histograms() &&
+		!currentImage()->histograms()->ready())
+		currentImage()->recomputeHistograms(currentImage()->histogramExposure(), &m_histogramShader);
 
 	if (m_histogramDirty &&
 		currentImage() &&
@@ -367,20 +552,15 @@ void ImageListPanel::draw(NVGcontext *ctx)
 		m_graph->setRightHeader(fmt::format("{:.3f}", lazyHist->get()->maximum));
 		m_histogramDirty = false;
 	}
+
+	updateDifference();
+	updateColormapRange();
 	enableDisableButtons();
 
-	if (numImages() != (int)m_imageButtons.size())
-		spdlog::get("console")->error("Number of buttons and images don't match!");
-	else
-	{
-		for (int i = 0; i < numImages(); ++i)
-		{
-			auto img = image(i);
-			auto btn = m_imageButtons[i];
-			btn->setProgress(img->progress());
-			btn->setIsModified(img->isModified());
-		}
-	}
+	updateImageButtons();
+
+	prefetchNeighbors();
+	enforceMemoryBudget();
 
 	Widget::draw(ctx);
 }
@@ -391,7 +571,7 @@ void ImageListPanel::updateHistogram()
 	m_histogramDirty = true;
 
 	if (currentImage())
-		currentImage()->recomputeHistograms(m_imageViewer->exposure());
+		currentImage()->recomputeHistograms(m_imageViewer->exposure(), &m_histogramShader);
 	else
     {
         m_graph->setValues(VectorXf(), 0);
@@ -410,6 +590,77 @@ void ImageListPanel::updateHistogram()
 	m_histogramRequestTime = glfwGetTime();
 }
 
+void ImageListPanel::updateDifference()
+{
+	auto cur = currentImage();
+	auto ref = referenceImage();
+
+	// wait until both textures are complete, the key is reset so that modified images are picked up again
+	if (!cur || !ref || !cur->textureResident() || !ref->textureResident())
+	{
+		m_differenceKey = DifferenceKey();
+		m_differenceLabel->setCaption(cur && ref ? "Waiting for the images..." : "");
+		return;
+	}
+
+	// the statistics need every pixel, which textures paged in tile by tile don't have on the GPU
+	if (cur->virtualTexture() || ref->virtualTexture())
+	{
+		m_differenceKey = DifferenceKey();
+		m_differenceLabel->setCaption("Too large to compare");
+		return;
+	}
+
+	Vector2i lo = Vector2i::Zero(), hi = cur->size();
+	if (m_differenceRegion->selectedIndex() == 1)
+	{
+		lo = m_imageViewer->clampedImageCoordinateAt(Vector2f::Zero()).array().floor().cast<int>();
+		hi = m_imageViewer->clampedImageCoordinateAt(m_imageViewer->size().cast<float>()).array().ceil().cast<int>();
+	}
+
+	DifferenceKey key;
+	key.image = &cur->image();
+	key.reference = &ref->image();
+	key.imageOrientation = cur->orientation();
+	key.referenceOrientation = ref->orientation();
+	key.mode = m_imageViewer->blendMode();
+	key.regionMin = lo;
+	key.regionMax = hi;
+	key.imageRange = cur->singleChannelRange();
+	key.referenceRange = ref->singleChannelRange();
+	key.colormap = m_imageViewer->colormap();
+	if (key == m_differenceKey)
+		return;
+	m_differenceKey = key;
+
+	ImageShader::Texture curTexture(cur->glTextureId(), cur->isSingleChannel(), key.imageRange, cur->orientation().storedUV());
+	ImageShader::Texture refTexture(ref->glTextureId(), ref->isSingleChannel(), key.referenceRange, ref->orientation().storedUV());
+	curTexture.colormap = refTexture.colormap = key.colormap;
+
+	DifferenceStatistics stats;
+	if (m_differenceShader.compute(curTexture, cur->size(), refTexture, ref->size(), key.mode, lo, hi, stats))
+		m_differenceLabel->setCaption(stats.numPixels ?
+		                              fmt::format("Mean {:.3g}  RMSE {:.3g}  Max {:.3g}", stats.mean, stats.rmse, stats.maximum) :
+		                              "No finite values");
+	else
+		m_differenceLabel->setCaption("");
+}
+
+void ImageListPanel::updateColormapRange()
+{
+	auto cur = currentImage();
+	bool singleChannel = cur && !cur->isNull() && cur->isSingleChannel();
+	m_rangeMin->setEnabled(singleChannel);
+	m_rangeMax->setEnabled(singleChannel);
+	m_autoRangeButton->setEnabled(singleChannel);
+	if (!singleChannel || m_rangeMin->focused() || m_rangeMax->focused())
+		return;
+
+	Vector2f range = cur->singleChannelRange();
+	m_rangeMin->setValue(range.x());
+	m_rangeMax->setValue(range.x() + range.y());
+}
+
 void ImageListPanel::requestHistogramUpdate(bool force)
 {
 	if (force)
@@ -457,9 +708,10 @@ void ImageListPanel::runRequestedCallbacks()
 		{
 			int i = it - m_images.begin();
 			auto img = m_images[i];
-			if (img && img->canModify() && img->isNull())
+			if (img && img->canModify() && img->isNull() && !img->isEvicted())
 			{
 				it = m_images.erase(it);
+				m_matches.erase(m_matches.begin() + i);
 
 				if (i < m_current)
 					m_current--;
@@ -499,13 +751,23 @@ bool ImageListPanel::setCurrentImageIndex(int index, bool forceCallback)
 	if (index == m_current && !forceCallback)
 		return false;
 
-	if (isValid(m_current))
-		m_imageButtons[m_current]->setIsSelected(false);
-	if (isValid(index))
-		m_imageButtons[index]->setIsSelected(true);
+	// remember which way the user flips through the list, to prefetch the images further along that way
+	if (isValid(m_current) && isValid(index))
+	{
+		if (index == nextVisibleImage(m_current, Forward))
+			m_direction = Forward;
+		else if (index == nextVisibleImage(m_current, Backward))
+			m_direction = Backward;
+	}
 
 	m_previous = m_current;
 	m_current = index;
+	if (auto img = currentImage())
+	{
+		img->touch();
+		img->restorePixels();
+	}
+	prioritizeLoads();
 	m_imageViewer->setCurrentImage(currentImage());
 	m_screen->updateCaption();
     updateHistogram();
@@ -513,17 +775,241 @@ bool ImageListPanel::setCurrentImageIndex(int index, bool forceCallback)
 	return true;
 }
 
+/*!
+ * Load the current image first, followed by its neighbors in the list in order of their distance to it,
+ * since those are the ones the user is most likely to flip to next. At equal distance, the neighbor in the
+ * direction the user is flipping through the list goes first.
+ */
+void ImageListPanel::prioritizeLoads()
+{
+	if (!m_loadScheduler.numPending())
+		return;
+
+	vector<const void *> order;
+	order.reserve(m_images.size());
+	int current = isValid(m_current) ? m_current : 0;
+	int ahead = m_direction == Forward ? -1 : 1;
+	for (int d = 0; d < numImages(); ++d)
+	{
+		if (isValid(current + ahead * d))
+			order.push_back(m_images[current + ahead * d].get());
+		if (d > 0 && isValid(current - ahead * d))
+			order.push_back(m_images[current - ahead * d].get());
+	}
+	m_loadScheduler.prioritize(order);
+}
+
+/*!
+ * Loads, edits, spills and texture uploads show their progress or results on their own, and the deferred
+ * updates in draw() need more frames to happen.
+ */
+bool ImageListPanel::needsRedraw() const
+{
+	auto cur = currentImage();
+	if (m_buttonsUpdateRequested || m_updateFilterRequested || m_histogramUpdateRequested ||
+	    (m_histogramDirty && cur && !cur->isNull()) || m_loadScheduler.numPending() || m_filterTask)
+		return true;
+
+	for (auto img : {cur, referenceImage()})
+		if (img && !img->isNull() && (!img->textureResident() || img->texturePending()))
+			return true;
+
+	for (auto img : prefetchRing())
+		if (img->isEvicted() || (!img->isNull() && !img->textureResident()))
+			return true;
+
+	for (const auto & img : m_images)
+		if (!img->canModify() || img->isSpilling())
+			return true;
+	return false;
+}
+
+/*!
+ * Totals over all images, followed by a line for each image that is shown or has work going on, since
+ * listing every idle image would make the HUD as long as the image list.
+ */
+vector<string> ImageListPanel::performanceSummary() const
+{
+	auto megabytes = [](size_t bytes){return fmt::format("{:.1f} MB", bytes / double(1 << 20));};
+
+	size_t memory = 0, undo = 0, textures = 0;
+	int busy = 0, uploadLines = 0;
+	vector<string> details;
+	for (int i = 0; i < numImages(); ++i)
+	{
+		const GLImage & img = *m_images[i];
+		memory += img.memoryUsage();
+		undo += img.undoMemoryUsage();
+		textures += img.textureUsage();
+
+		bool modifying = !img.canModify();
+		int lines = img.isEvicted() ? 0 : img.uploadBacklog();
+		busy += modifying;
+		uploadLines += lines;
+		if (!modifying && !lines && i != m_current && i != m_reference)
+			continue;
+
+		string line = fmt::format("{}{}: RAM {}, undo {}, VRAM {}", i == m_current ? "* " : "  ", img.filename(),
+		                          megabytes(img.memoryUsage()), megabytes(img.undoMemoryUsage()),
+		                          megabytes(img.textureUsage()));
+		if (img.isEvicted())
+			line += ", evicted";
+		if (modifying)
+			line += fmt::format(", task {:.0f}%", 100.f * max(0.f, img.progress()));
+		if (lines)
+			line += fmt::format(", {} lines to upload", lines);
+		details.push_back(line);
+	}
+
+	vector<string> lines;
+	lines.push_back(fmt::format("Tasks: {} loads pending, {} images being modified, {} lines to upload",
+	                            m_loadScheduler.numPending(), busy, uploadLines));
+	lines.push_back(fmt::format("{} images: RAM {}, undo {}, VRAM {}",
+	                            numImages(), megabytes(memory), megabytes(undo), megabytes(textures)));
+	lines.push_back(BufferPool::summary());
+	lines.insert(lines.end(), details.begin(), details.end());
+	return lines;
+}
+
+/*!
+ * The images the user is most likely to flip to next: up to prefetchCount() visible images on each side of
+ * the current one, alternating between the next one ahead in the direction of the last flip and the next one
+ * behind. The ring ends before it would take up more than half of either budget (see GLImage::memoryBudget),
+ * which leaves the rest to the current, reference and recently viewed images.
+ */
+vector<GLImage *> ImageListPanel::prefetchRing() const
+{
+	vector<GLImage *> ring;
+	if (!isValid(m_current))
+		return ring;
+
+	EDirection behind = m_direction == Forward ? Backward : Forward;
+	int ahead = m_current, back = m_current;
+	size_t bytes = 0;
+	for (int n = 0; n < 2 * s_prefetchCount; ++n)
+	{
+		int & index = n % 2 ? back : ahead;
+		index = nextVisibleImage(index, n % 2 ? behind : m_direction);
+		GLImage * img = m_images[index].get();
+		// with only a few visible images, the two sides meet
+		if (index == m_current || find(ring.begin(), ring.end(), img) != ring.end())
+			continue;
+
+		// a conservative estimate: 4 floats per pixel, and another third for the mip levels of the texture
+		bytes += size_t(img->width()) * img->height() * sizeof(Color4);
+		if ((GLImage::memoryBudget() && bytes > GLImage::memoryBudget() / 2) ||
+		    (GLImage::textureBudget() && bytes / 3 * 4 > GLImage::textureBudget() / 2))
+			break;
+		ring.push_back(img);
+	}
+	return ring;
+}
+
+/*!
+ * Restore the evicted pixels of the prefetch ring and upload its textures ahead of time, so that flipping to
+ * one of these images shows it right away instead of streaming it in. This waits until the current and
+ * reference images are shown, and uploads to one texture for a few milliseconds per frame, to not slow down
+ * the interface.
+ */
+void ImageListPanel::prefetchNeighbors()
+{
+	const int PrefetchMilliseconds = 5;
+
+	for (auto img : {currentImage(), referenceImage()})
+		if (img && (!img->canModify() || img->isEvicted() || !img->textureResident()))
+			return;
+
+	bool uploaded = false;
+	for (auto img : prefetchRing())
+	{
+		if (img->isEvicted())
+			img->restorePixels();
+		else if (!uploaded && !img->isNull() && !img->textureResident())
+		{
+			img->prefetchTexture(PrefetchMilliseconds);
+			uploaded = true;
+		}
+	}
+}
+
+/*!
+ * Evict the least recently viewed images until their pixels and textures fit within the budgets
+ * (see GLImage::memoryBudget), and show the memory usage. The current and reference images, and the
+ * prefetch ring, always stay. The freed buffers that the BufferPool keeps for reuse count towards the
+ * memory budget too, and are given back first.
+ */
+void ImageListPanel::enforceMemoryBudget()
+{
+	size_t pooled = BufferPool::stats().bytesCached;
+	size_t memory = pooled, textures = 0;
+	vector<GLImage *> candidates, ring = prefetchRing();
+	for (int i = 0; i < numImages(); ++i)
+	{
+		memory += m_images[i]->memoryUsage();
+		textures += m_images[i]->textureUsage();
+		if (i != m_current && i != m_reference && find(ring.begin(), ring.end(), m_images[i].get()) == ring.end())
+			candidates.push_back(m_images[i].get());
+	}
+	TRACE_COUNTER("image memory (MB)", memory >> 20);
+	TRACE_COUNTER("texture memory (MB)", textures >> 20);
+
+	auto gigabytes = [](size_t bytes){return fmt::format("{:.1f} GB", bytes / double(1 << 30));};
+	auto budget = [&gigabytes](size_t bytes){return bytes ? gigabytes(bytes) : string("unlimited");};
+	string caption = fmt::format("RAM: {} of {}, GPU: {} of {}",
+	                             gigabytes(memory), budget(GLImage::memoryBudget()),
+	                             gigabytes(textures), budget(GLImage::textureBudget()));
+	if (m_memoryLabel->caption() != caption)
+		m_memoryLabel->setCaption(caption);
+
+	auto overMemory = [&memory]{return GLImage::memoryBudget() && memory > GLImage::memoryBudget();};
+	auto overTextures = [&textures]{return GLImage::textureBudget() && textures > GLImage::textureBudget();};
+	if (!overMemory() && !overTextures())
+		return;
+
+	if (overMemory() && pooled)
+	{
+		BufferPool::trim();
+		memory -= pooled;
+	}
+
+	sort(candidates.begin(), candidates.end(),
+	     [](const GLImage * a, const GLImage * b){return a->lastUsed() < b->lastUsed();});
+
+	for (auto img : candidates)
+	{
+		if (overTextures() && img->textureUsage() && img->canModify())
+		{
+			textures -= img->textureUsage();
+			img->evictTexture();
+		}
+
+		if (overMemory() && img->canEvict())
+		{
+			size_t bytes = img->memoryUsage(), texture = img->textureUsage();
+			// modified images first need to be spilled to disk, count them as freed in the meantime
+			if (img->evictPixels() || img->isSpilling())
+			{
+				memory -= bytes;
+				textures -= texture - img->textureUsage();
+			}
+		}
+
+		if (!overMemory() && !overTextures())
+			break;
+	}
+}
+
 bool ImageListPanel::setReferenceImageIndex(int index)
 {
 	if (index == m_reference)
 		return false;
 
-	if (isValid(m_reference))
-		m_imageButtons[m_reference]->setIsReference(false);
-	if (isValid(index))
-		m_imageButtons[index]->setIsReference(true);
-
 	m_reference = index;
+	if (auto img = referenceImage())
+	{
+		img->touch();
+		img->restorePixels();
+	}
 	m_imageViewer->setReferenceImage(referenceImage());
 
 	return true;
@@ -588,28 +1074,65 @@ void ImageListPanel::loadImages(const vector<string> & filenames)
 		tinydir_close(&dir);
 	}
 
-	// now start a bunch of asynchronous image loads
+	// now queue up the asynchronous image loads, the scheduler decides how many of them run at once
+	vector<pair<shared_ptr<StoredThumbnail>, ThumbnailCallback>> thumbnails;
 	for (auto filename : allFilenames)
 	{
 		shared_ptr<GLImage> image = make_shared<GLImage>();
 		image->setImageModifyDoneCallback([this](){m_imageModifyDoneRequested = true;});
 		image->setFilename(filename);
+		auto preview = image->previewCallback();
+		auto thumbnail = image->thumbnailCallback();
+		auto stored = make_shared<StoredThumbnail>(filename);
+		thumbnails.emplace_back(stored, thumbnail);
 		image->asyncModify(
-				[filename](const shared_ptr<const HDRImage> &) -> ImageCommandResult
+				[filename,preview,thumbnail,stored](const shared_ptr<const HDRImage> &) -> ImageCommandResult
 				{
 					Timer timer;
 					spdlog::get("console")->info("Trying to load image \"{}\"", filename);
-					shared_ptr<HDRImage> ret = loadImage(filename);
+
+					// unless the cache has a thumbnail, the preview makes one until the image is decoded
+					const auto & storedThumbnail = stored->get();
+					bool cached = storedThumbnail != nullptr;
+					if (cached)
+						thumbnail(storedThumbnail);
+					auto previewAndThumbnail = [&](const shared_ptr<const HDRImage> & p, int w, int h)
+					{
+						preview(p, w, h);
+						if (!cached)
+							thumbnail(make_shared<Thumbnail>(*p));
+					};
+
+					shared_ptr<HDRImage> ret = loadImage(filename, previewAndThumbnail);
 					if (ret)
+					{
 						spdlog::get("console")->info("Loaded \"{}\" [{:d}x{:d}] in {} seconds", filename, ret->width(), ret->height(), timer.elapsed() / 1000.f);
+						if (!cached)
+						{
+							auto t = make_shared<Thumbnail>(*ret);
+							thumbnail(t);
+							ThumbnailCache::write(filename, *t);
+						}
+					}
 					else
 						spdlog::get("console")->info("Loading \"{}\" failed", filename);
 					return {ret, nullptr};
-				});
+				},
+				m_loadScheduler.launcher(image.get(), filename));
         image->recomputeHistograms(m_imageViewer->exposure());
 		m_images.emplace_back(image);
+		// shown until the filter has been applied to it
+		m_matches.push_back(true);
 	}
 
+	// show the thumbnails stored in earlier sessions right away, instead of once each image is decoded
+	ThreadPool::instance().enqueue([thumbnails]
+	{
+		for (const auto & t : thumbnails)
+			if (auto thumbnail = t.first->get())
+				t.second(thumbnail);
+	});
+
 	m_numImagesCallback();
 	setCurrentImageIndex(int(m_images.size() - 1));
 }
@@ -641,6 +1164,7 @@ bool ImageListPanel::closeImage()
         next = nextVisibleImage(m_current, Forward);
 
 	m_images.erase(m_images.begin() + m_current);
+	m_matches.erase(m_matches.begin() + m_current);
 
 	int newIndex = next;
 	if (m_current < next)
@@ -658,6 +1182,7 @@ bool ImageListPanel::closeImage()
 void ImageListPanel::closeAllImages()
 {
 	m_images.clear();
+	m_matches.clear();
 
 	m_current = -1;
 	m_reference = -1;
@@ -670,6 +1195,36 @@ void ImageListPanel::closeAllImages()
 	m_numImagesCallback();
 }
 
+/*!
+ * Cancel the modification currently being applied to the selected image (if any).
+ *
+ * @return true if there was a pending modification to cancel
+ */
+bool ImageListPanel::cancelModify()
+{
+	return currentImage() && !currentImage()->isNull() && currentImage()->cancelModify();
+}
+
+/*!
+ * Cancel all image loads that haven't finished yet. Canceled images are removed
+ * from the list once their load task returns.
+ *
+ * @return the number of loads that were canceled
+ */
+int ImageListPanel::cancelLoads()
+{
+	int numCanceled = 0;
+	for (auto & img : m_images)
+		// images that are still empty and busy are being loaded
+		if (!img->canModify() && img->isNull() && !img->isEvicted() && img->cancelModify())
+			++numCanceled;
+
+	if (numCanceled)
+		spdlog::get("console")->info("Canceled loading {} image(s)", numCanceled);
+
+	return numCanceled;
+}
+
 void ImageListPanel::modifyImage(const ImageCommand & command)
 {
 	if (currentImage())
@@ -679,9 +1234,9 @@ void ImageListPanel::modifyImage(const ImageCommand & command)
 				{
 					auto ret = command(img);
 
-					// if no undo was provided, just create a FullImageUndo
+					// if no undo was provided, store the tiles that changed
 					if (!ret.second)
-						ret.second = make_shared<FullImageUndo>(*img);
+						ret.second = createImageUndo(*img, ret.first);
 
 					return ret;
 				});
@@ -698,9 +1253,9 @@ void ImageListPanel::modifyImage(const ImageCommandWithProgress & command)
 				{
 					auto ret = command(img, progress);
 
-					// if no undo was provided, just create a FullImageUndo
+					// if no undo was provided, store the tiles that changed
 					if (!ret.second)
-						ret.second = make_shared<FullImageUndo>(*img);
+						ret.second = createImageUndo(*img, ret.first);
 
 					return ret;
 				});
@@ -708,6 +1263,15 @@ void ImageListPanel::modifyImage(const ImageCommandWithProgress & command)
 	}
 }
 
+void ImageListPanel::reorientImage(const HDRImage::Orientation & change)
+{
+	if (!currentImage())
+		return;
+
+	m_images[m_current]->reorient(change);
+	m_imageModifyDoneCallback(m_current);
+}
+
 void ImageListPanel::undo()
 {
 	if (currentImage() && m_images[m_current]->undo())
@@ -755,118 +1319,148 @@ void ImageListPanel::setUseRegex(bool value)
 
 void ImageListPanel::updateFilter()
 {
-    string filter = m_filter->value();
-	m_previous = -1;
+    // the matching runs in the background, so typing in the filter stays responsive with thousands of images
+    if (m_filterTask)
+        m_filterTask->cancel();
 
-    // Image filtering
+    vector<const GLImage *> images;
+    vector<string> names;
+    for (int i = 0; i < numImages(); ++i)
     {
-        vector<string> activeImageNames;
-        size_t id = 1;
-        for (int i = 0; i < numImages(); ++i)
-        {
-            auto img = image(i);
-            auto btn = m_imageButtons[i];
-
-            btn->setVisible(matches(img->filename(), filter, useRegex()));
-            if (btn->visible())
-            {
-                btn->setImageId(id++);
-                activeImageNames.emplace_back(img->filename());
-            }
-        }
+        images.push_back(image(i).get());
+        names.push_back(image(i)->filename());
+    }
+    auto match = matcher(m_filter->value(), useRegex());
 
-        // determine common parts of filenames
-        // taken from tev
-        int beginShortOffset = 0;
-        int endShortOffset = 0;
-        if (!activeImageNames.empty())
+    m_filterTask = make_shared<AsyncTask<FilterResult>>(
+        [images, names, match](AtomicProgress & progress)
         {
-            string first = activeImageNames.front();
-            int firstSize = (int)first.size();
-            if (firstSize > 0)
+            FilterResult result;
+            result.images = images;
+            result.matches.resize(names.size());
+            parallel_for(BlockedRange(0, int(names.size())), [&](int begin, int end)
+            {
+                progress.checkCanceled();
+                for (int i = begin; i < end; ++i)
+                    result.matches[i] = match(names[i]);
+            });
+            progress.checkCanceled();
+
+            vector<const string *> activeImageNames;
+            for (size_t i = 0; i < names.size(); ++i)
+                if (result.matches[i])
+                    activeImageNames.push_back(&names[i]);
+
+            // determine common parts of filenames
+            // taken from tev
+            int beginShortOffset = 0;
+            int endShortOffset = 0;
+            if (!activeImageNames.empty())
             {
-                bool allStartWithSameChar = false;
-                do
+                const string & first = *activeImageNames.front();
+                int firstSize = (int)first.size();
+                if (firstSize > 0)
                 {
-                    int len = codePointLength(first[beginShortOffset]);
-
-                    allStartWithSameChar = all_of
-                            (
-                                    begin(activeImageNames),
-                                    end(activeImageNames),
-                                    [&first, beginShortOffset, len](const string& name)
-                                    {
-                                        if (beginShortOffset + len > (int)name.size())
-                                            return false;
-
-                                        for (int i = beginShortOffset; i < beginShortOffset + len; ++i)
-                                            if (name[i] != first[i])
+                    bool allStartWithSameChar = false;
+                    do
+                    {
+                        int len = codePointLength(first[beginShortOffset]);
+
+                        allStartWithSameChar = all_of
+                                (
+                                        begin(activeImageNames),
+                                        end(activeImageNames),
+                                        [&first, beginShortOffset, len](const string * name)
+                                        {
+                                            if (beginShortOffset + len > (int)name->size())
                                                 return false;
 
-                                        return true;
-                                    }
-                            );
-
-                    if (allStartWithSameChar)
-                        beginShortOffset += len;
+                                            for (int i = beginShortOffset; i < beginShortOffset + len; ++i)
+                                                if ((*name)[i] != first[i])
+                                                    return false;
+
+                                            return true;
+                                        }
+                                );
+
+                        if (allStartWithSameChar)
+                            beginShortOffset += len;
+                    }
+                    while (allStartWithSameChar && beginShortOffset < firstSize);
+
+                    bool allEndWithSameChar;
+                    do
+                    {
+                        char lastChar = first[firstSize - endShortOffset - 1];
+                        allEndWithSameChar = all_of
+                                (
+                                        begin(activeImageNames),
+                                        end(activeImageNames),
+                                        [lastChar, endShortOffset](const string * name)
+                                        {
+                                            int index = (int)name->size() - endShortOffset - 1;
+                                            return index >= 0 && (*name)[index] == lastChar;
+                                        }
+                                );
+
+                        if (allEndWithSameChar)
+                            ++endShortOffset;
+                    }
+                    while (allEndWithSameChar && endShortOffset < firstSize);
                 }
-                while (allStartWithSameChar && beginShortOffset < firstSize);
-
-                bool allEndWithSameChar;
-                do
-                {
-                    char lastChar = first[firstSize - endShortOffset - 1];
-                    allEndWithSameChar = all_of
-                            (
-                                    begin(activeImageNames),
-                                    end(activeImageNames),
-                                    [lastChar, endShortOffset](const string& name)
-                                    {
-                                        int index = (int)name.size() - endShortOffset - 1;
-                                        return index >= 0 && name[index] == lastChar;
-                                    }
-                            );
-
-                    if (allEndWithSameChar)
-                        ++endShortOffset;
-                }
-                while (allEndWithSameChar && endShortOffset < firstSize);
             }
-        }
 
-        for (int i = 0; i < numImages(); ++i)
-        {
-            auto btn = m_imageButtons[i];
+            result.beginShortOffset = beginShortOffset;
+            result.endShortOffset = endShortOffset;
+            return result;
+        });
+    m_filterTask->compute();
 
-            if (!btn->visible())
-                continue;
-
-            auto img = image(i);
-            btn->setCaption(img->filename());
+    m_updateFilterRequested = false;
+}
 
-            if (m_useShortButton->pushed())
-            {
-                btn->setHighlightRange(beginShortOffset, endShortOffset);
-                btn->setCaption(btn->highlighted());
-                btn->setHighlightRange(0, 0);
-            }
-            else
-            {
-                btn->setHighlightRange(beginShortOffset, endShortOffset);
-            }
+/*!
+ * Show the images that passed the filter once it has been applied in the background.
+ * If the list changed in the meantime, the filter is applied again instead.
+ */
+void ImageListPanel::applyFilter()
+{
+    if (!m_filterTask || !m_filterTask->ready())
+        return;
 
-        }
+    auto task = m_filterTask;
+    m_filterTask = nullptr;
 
-        if (m_current == -1 || (currentImage() && !m_imageButtons[m_current]->visible()))
-            setCurrentImageIndex(nthVisibleImageIndex(0));
+    FilterResult result;
+    try
+    {
+        result = task->get();
+    }
+    catch (const CanceledError &)
+    {
+        return;
+    }
 
-        if (m_reference == -1 || (referenceImage() && !m_imageButtons[referenceImageIndex()]->visible()))
-            setReferenceImageIndex(-1);
+    bool stale = int(result.images.size()) != numImages();
+    for (int i = 0; !stale && i < numImages(); ++i)
+        stale = result.images[i] != image(i).get();
+    if (stale)
+    {
+        m_updateFilterRequested = true;
+        return;
     }
 
-    m_updateFilterRequested = false;
+    m_matches = result.matches;
+    m_beginShortOffset = result.beginShortOffset;
+    m_endShortOffset = result.endShortOffset;
+    m_previous = -1;
+    updateRows();
+
+    if (m_current == -1 || (currentImage() && !m_matches[m_current]))
+        setCurrentImageIndex(nthVisibleImageIndex(0));
 
-    m_screen->performLayout();
+    if (m_reference == -1 || (referenceImage() && !m_matches[m_reference]))
+        setReferenceImageIndex(-1);
 }
 
 
@@ -886,31 +1480,21 @@ int ImageListPanel::nextVisibleImage(int index, EDirection direction) const
     {
         i = (i + numImages() + dir) % numImages();
     }
-    while (!m_imageButtons[i]->visible() && i != startIndex);
+    while (!m_matches[i] && i != startIndex);
 
     return i;
 }
 
 int ImageListPanel::nthVisibleImageIndex(int n) const
 {
-    int lastVisible = -1;
-    for (int i = 0; i < numImages(); ++i)
-    {
-        if (m_imageButtons[i]->visible())
-        {
-            lastVisible = i;
-            if (n == 0)
-                break;
-
-            --n;
-        }
-    }
-    return lastVisible;
+    if (m_rows.empty())
+        return -1;
+    return n >= 0 && n < int(m_rows.size()) ? m_rows[n] : m_rows.back();
 }
 
 bool ImageListPanel::nthImageIsVisible(int n) const
 {
-    return n >= 0 && n < int(m_imageButtons.size()) && m_imageButtons[n]->visible();
+    return isValid(n) && m_matches[n];
 }
 
 
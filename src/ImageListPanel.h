@@ -9,7 +9,10 @@
 #include <nanogui/widget.h>
 #include <vector>
 #include "Common.h"
+#include "DifferenceShader.h"
 #include "GLImage.h"
+#include "HistogramShader.h"
+#include "LoadScheduler.h"
 #include "Fwd.h"
 
 using namespace nanogui;
@@ -48,15 +51,31 @@ public:
 	bool closeImage();
 	void closeAllImages();
 
+	// Canceling pending operations
+	bool cancelModify();
+	int cancelLoads();
+
 	// Modify the image data
 	void modifyImage(const ImageCommand & command);
 	void modifyImage(const ImageCommandWithProgress & command);
+	/// Flip or rotate the current image for display only, see GLImage::reorient
+	void reorientImage(const HDRImage::Orientation & change);
 	void undo();
 	void redo();
 
 	//
 	void runRequestedCallbacks();
 
+	/// Whether anything shown in the panel or the image viewer may still change without any user input
+	bool needsRedraw() const;
+
+	/// Lines of text for the performance HUD: pending work, and the memory held by the images
+	std::vector<std::string> performanceSummary() const;
+
+	/// How many images on each side of the current one are kept loaded and uploaded ahead of time (see prefetchRing)
+	static int prefetchCount()              {return s_prefetchCount;}
+	static void setPrefetchCount(int count) {s_prefetchCount = count;}
+
 
 	void requestButtonsUpdate();
 	void requestHistogramUpdate(bool force = false);
@@ -83,14 +102,26 @@ private:
 	void updateButtons();
 	void enableDisableButtons();
 	void updateHistogram();
+	void updateDifference();
+	void updateColormapRange();
 	void updateFilter();
+	void applyFilter();
+	void updateRows();
+	void updateImageButtons();
+	void prioritizeLoads();
+	void enforceMemoryBudget();
+	std::vector<GLImage *> prefetchRing() const;
+	void prefetchNeighbors();
 	bool isValid(int index) const {return index >= 0 && index < numImages();}
 
 	std::vector<ImagePtr> m_images; ///< The loaded images
+	LoadScheduler m_loadScheduler;  ///< Runs the pending image loads, the ones nearest to the current image first
 	int m_current = -1;             ///< The currently selected image
 	int m_reference = -1;           ///< The currently selected reference image
 
 	int m_previous = -1;			///< The previously selected image
+	EDirection m_direction = Backward;  ///< The direction the user last flipped through the list in
+	static int s_prefetchCount;
 
 	std::atomic<bool> m_imageModifyDoneRequested;
 
@@ -111,20 +142,65 @@ private:
 	Button* m_eraseButton = nullptr;
 	Button* m_regexButton = nullptr;
 	Button * m_useShortButton = nullptr;
+	Button * m_thumbnailsButton = nullptr;
+	Label * m_memoryLabel = nullptr;
 	Widget * m_imageListWidget = nullptr;
 	ComboBox * m_blendModes = nullptr;
 	ComboBox * m_channels = nullptr;
-	std::vector<ImageButton*> m_imageButtons;
+	ComboBox * m_colormaps = nullptr;
+	FloatBox<float> * m_rangeMin = nullptr;     ///< The displayed range of single-channel images
+	FloatBox<float> * m_rangeMax = nullptr;
+	Button * m_autoRangeButton = nullptr;
+	std::vector<ImageButton*> m_imageButtons;      ///< The buttons of the rows in view, reused as the list scrolls
+	std::vector<std::pair<int, int>> m_buttonRows;  ///< The row and m_rowsVersion each button was last set up for
+	int m_rowsVersion = 0;                          ///< Changes whenever the captions or tooltips may have changed
+	std::vector<char> m_matches;                    ///< Whether each image passes the filter
+	std::vector<int> m_rows;                        ///< The images that pass the filter, which make up the list
+
+	/// Which images pass the filter, and the common prefix and suffix of their filenames
+	struct FilterResult
+	{
+		std::vector<const GLImage *> images;        ///< The images (in list order) the filter was applied to
+		std::vector<char> matches;
+		int beginShortOffset = 0, endShortOffset = 0;
+	};
+	std::shared_ptr<AsyncTask<FilterResult>> m_filterTask;
+	int m_beginShortOffset = 0, m_endShortOffset = 0;
 
 	ComboBox * m_xAxisScale = nullptr,
 			 * m_yAxisScale = nullptr;
 	MultiGraph * m_graph = nullptr;
+	HistogramShader m_histogramShader;
 	bool m_histogramDirty = false;
 	bool m_histogramUpdateRequested = false;
 	bool m_updateFilterRequested = true;
 	bool m_buttonsUpdateRequested = true;
 	double m_histogramRequestTime;
 
+	/// What the difference statistics were last computed for, to only recompute them when something changed
+	struct DifferenceKey
+	{
+		const HDRImage * image = nullptr;
+		const HDRImage * reference = nullptr;
+		HDRImage::Orientation imageOrientation, referenceOrientation;
+		EBlendMode mode = EBlendMode::NORMAL_BLEND;
+		Eigen::Vector2i regionMin = Eigen::Vector2i::Zero(), regionMax = Eigen::Vector2i::Zero();
+		Eigen::Vector2f imageRange = Eigen::Vector2f::Zero(), referenceRange = Eigen::Vector2f::Zero();
+		HDRImage::Colormap colormap = HDRImage::TURBO_COLORMAP;
+
+		bool operator==(const DifferenceKey & o) const
+		{
+			return image == o.image && reference == o.reference &&
+			       imageOrientation == o.imageOrientation && referenceOrientation == o.referenceOrientation &&
+			       mode == o.mode && regionMin == o.regionMin && regionMax == o.regionMax &&
+			       imageRange == o.imageRange && referenceRange == o.referenceRange && colormap == o.colormap;
+		}
+	};
+	ComboBox * m_differenceRegion = nullptr;
+	Label * m_differenceLabel = nullptr;
+	DifferenceShader m_differenceShader;
+	DifferenceKey m_differenceKey;
+
 public:
 	EIGEN_MAKE_ALIGNED_OPERATOR_NEW
 };
\ No newline at end of file
@@ -6,7 +6,10 @@
 
 #include "ImageShader.h"
 #include "Common.h"
+#include "CurveLUT.h"
 #include "DitherMatrix256.h"
+#include "GLImage.h"
+#include "HDRImage.h"
 #include <random>
 
 using namespace nanogui;
@@ -57,6 +60,37 @@ constexpr char const *const fragmentShader =
     uniform sampler2D reference;
 	uniform bool hasReference;
 
+	// the page table and geometry of a texture drawn through a VirtualTexture
+	struct VirtualTexture
+	{
+		bool enabled;
+		ivec2 size;
+		int numLevels;
+		int slots;
+	};
+	uniform usampler2D imagePages;
+	uniform VirtualTexture imageVirtual;
+	uniform usampler2D referencePages;
+	uniform VirtualTexture referenceVirtual;
+
+	uniform sampler2D colormap;
+	uniform bool imageSingleChannel;
+	uniform vec2 imageRange;
+	uniform int imageColormap;
+	uniform mat3 imageOrientation;
+	uniform bool referenceSingleChannel;
+	uniform vec2 referenceRange;
+	uniform int referenceColormap;
+	uniform mat3 referenceOrientation;
+
+	// the point-wise adjustment of the image, see ImageShader::Adjustment
+	uniform sampler2D adjustCurve;
+	uniform bool hasAdjustCurve;
+	uniform float curveEpsilon;
+	uniform float curveMaxWarp;
+	uniform vec3 adjustHSL;
+	uniform bool hasAdjustHSL;
+
 	uniform int blendMode;
     uniform float gain;
     uniform int channel;
@@ -131,6 +165,173 @@ constexpr char const *const fragmentShader =
 	    return XYZ2RGB * xyz;
 	}
 
+	// the false-color mapping of single-channel images, see HDRImage::singleChannelColor. Each row
+	// of the colormap texture holds one of the colormaps
+	vec4 singleChannelColor(float v, vec2 range, int map)
+	{
+		if (isnan(v) || v < range.x)
+			return vec4(0.0);
+		// clamp before converting, since infinite values don't fit in an int
+		float t = range.y > 0.0 ? min(255.0 * (v - range.x) / range.y, 255.0) : 0.0;
+		return texelFetch(colormap, ivec2(int(round(t)), map), 0);
+	}
+
+	// Samples the tile cache of a virtual texture at the stored texture coordinates st, whose derivatives in
+	// texels of the full-resolution level are dx and dy. The page at the level the footprint calls for points
+	// to its slot in the cache, or to the slot of its closest resident ancestor while it is not resident.
+	vec4 sampleVirtual(sampler2D cache, usampler2D pages, VirtualTexture virt, vec2 st, vec2 dx, vec2 dy)
+	{
+		float lod = 0.5 * log2(max(max(dot(dx, dx), dot(dy, dy)), 1e-20));
+		int level = clamp(int(floor(lod)), 0, virt.numLevels - 1);
+		ivec2 levelSize = max(virt.size >> level, ivec2(1));
+		ivec2 page = min(ivec2(st * vec2(levelSize)) / TILE_SIZE, (levelSize - 1) / TILE_SIZE);
+
+		// the levels are stacked on top of each other in the page table, the finest first
+		int row = 0;
+		for (int l = 0; l < level; ++l)
+			row += (max(virt.size.y >> l, 1) + TILE_SIZE - 1) / TILE_SIZE;
+		uvec4 entry = texelFetch(pages, ivec2(page.x, row + page.y), 0);
+		if (entry.a == 0u)
+			return vec4(0.0);
+
+		// the texels of a slot are offset by its border of one texel
+		int resident = int(entry.b);
+		vec2 inPage = st * vec2(max(virt.size >> resident, ivec2(1))) - vec2((page >> (resident - level)) * TILE_SIZE);
+		inPage = clamp(inPage, vec2(-0.5), vec2(float(TILE_SIZE) + 0.5));
+		float cacheSize = float(virt.slots * SLOT_SIZE);
+		vec2 p = (vec2(entry.rg) * float(SLOT_SIZE) + 1.0 + inPage) / cacheSize;
+		float scale = exp2(float(resident)) * cacheSize;
+		return textureGrad(cache, p, dx / scale, dy / scale);
+	}
+
+	// single-channel textures are swizzled to an opaque alpha, which would also apply to the
+	// border color, so handle the area outside of the image explicitly
+	vec4 sampleImage(sampler2D tex, usampler2D pages, VirtualTexture virt, vec2 uv, mat3 orientation,
+	                 bool singleChannel, vec2 range, int map)
+	{
+		vec2 st = (orientation * vec3(uv, 1.0)).xy;
+		// virtual textures pick their level from the texel footprint, whose derivatives are only defined
+		// outside of the branch below
+		vec2 dx = dFdx(st) * vec2(virt.size), dy = dFdy(st) * vec2(virt.size);
+		if (any(lessThan(uv, vec2(0.0))) || any(greaterThan(uv, vec2(1.0))))
+			return vec4(0.0);
+		vec4 value = virt.enabled ? sampleVirtual(tex, pages, virt, st, dx, dy) : texture(tex, st);
+		return singleChannel ? singleChannelColor(value.r, range, map) : value;
+	}
+
+	// interpolates the curve like CurveLUT::lookup
+	float lookupCurve(float v)
+	{
+		if (isnan(v))
+			return v;
+
+		float w = sign(v) * log2(1.0 + abs(v) / curveEpsilon);
+		float x = (clamp(w, -curveMaxWarp, curveMaxWarp) / curveMaxWarp * 0.5 + 0.5) * float(CURVE_LUT_SIZE - 1);
+		int i = min(int(floor(x)), CURVE_LUT_SIZE - 2);
+		float t = x - float(i);
+		float a = texelFetch(adjustCurve, ivec2(i, 0), 0).r;
+		if (t == 0.0)
+			return a;
+		return a + t * (texelFetch(adjustCurve, ivec2(i + 1, 0), 0).r - a);
+	}
+
+	// SatAdjust, RGBToHSL, HSLToRGB and HSLAdjust are ports of the functions in Colorspace.cpp
+	vec3 satAdjust(vec3 c, float s)
+	{
+		float mn = min(c.r, min(c.g, c.b));
+		float mx = max(c.r, max(c.g, c.b));
+		if (mn == mx)
+			return c;
+
+		float L = 0.5 * (mn + mx);
+		float S, y2;
+		if (L <= 0.5)
+		{
+			S = s * (mn < 0.0 ? 1.0 - mn : (mx - mn) / (mx + mn));
+			y2 = S > 1.0 ? 2.0 * L + S - 1.0 : L + L * S;
+		}
+		else
+		{
+			S = s * (mx > 1.0 ? mx : (mx - mn) / (2.0 - (mx + mn)));
+			y2 = S > 1.0 ? S : L + S - L * S;
+		}
+		float x2 = 2.0 * L - y2;
+
+		float t = 1.0 / (mx - mn);
+		return c * ((y2 - x2) * t) + vec3((mx * x2 - mn * y2) * t);
+	}
+
+	vec3 RGBToHSL(vec3 c)
+	{
+		float mn = min(c.r, min(c.g, c.b));
+		float mx = max(c.r, max(c.g, c.b));
+		float sum = mn + mx;
+		float diff = mx - mn;
+		float L = sum / 2.0;
+
+		if (diff < 1e-6)
+			return vec3(0.0, 0.0, L);
+
+		float S;
+		if (L <= 0.5)
+			S = mn < 0.0 ? 1.0 - mn : diff / sum;
+		else
+			S = mx > 1.0 ? mx : diff / (2.0 - sum);
+
+		float H;
+		if (c.r == mx)
+			H = (c.g - c.b) / diff;
+		else if (c.g == mx)
+			H = (c.b - c.r) / diff + 2.0;
+		else
+			H = (c.r - c.g) / diff + 4.0;
+		H /= 6.0;
+
+		return vec3(H - floor(H), S, L);
+	}
+
+	float hueToRGB(float x, float y, float hue)
+	{
+		hue -= floor(hue);
+		if (6.0 * hue < 1.0) return x + 6.0 * (y - x) * hue;
+		if (2.0 * hue < 1.0) return y;
+		if (3.0 * hue < 2.0) return x + 6.0 * (y - x) * (2.0 / 3.0 - hue);
+		return x;
+	}
+
+	vec3 HSLToRGB(vec3 hsl)
+	{
+		float H = hsl.x, S = hsl.y, L = hsl.z;
+		if (S <= 0.0)
+			return vec3(L);
+
+		float y = L < 0.5 ? (S > 1.0 ? 2.0 * L + S - 1.0 : L + L * S)
+		                  : (S > 1.0 ? S : L + S - L * S);
+		float x = 2.0 * L - y;
+		return vec3(hueToRGB(x, y, H + 1.0 / 3.0), hueToRGB(x, y, H), hueToRGB(x, y, H - 1.0 / 3.0));
+	}
+
+	// the hue shift (in degrees), saturation scale and lightness are in adjustment
+	vec3 HSLAdjust(vec3 c, vec3 adjustment)
+	{
+		if (adjustment.x == 0.0 && adjustment.z == 0.0)
+			return satAdjust(c, adjustment.y);
+
+		vec3 hsl = RGBToHSL(c);
+		c = HSLToRGB(vec3(hsl.x + adjustment.x / 360.0, hsl.y * adjustment.y, hsl.z));
+
+		// mix with black or white based on the desired lightness
+		float l = adjustment.z;
+		return l < 0.0 ? mix(c, vec3(0.0), -l) : mix(c, vec3(1.0), l);
+	}
+
+	vec3 adjust(vec3 c)
+	{
+		if (hasAdjustCurve)
+			c = vec3(lookupCurve(c.r), lookupCurve(c.g), lookupCurve(c.b));
+		return hasAdjustHSL ? HSLAdjust(c, adjustHSL) : c;
+	}
+
 	float labf(float t)
 	{
 		const float c1 = 0.008856451679;    // pow(6.0/29.0, 3.0);
@@ -288,11 +489,16 @@ constexpr char const *const fragmentShader =
             return;
         }
 
-        vec4 imageVal = texture(image, imageUV);
+        vec4 imageVal = sampleImage(image, imagePages, imageVirtual, imageUV, imageOrientation,
+                                    imageSingleChannel, imageRange, imageColormap);
+		// the false colors of single-channel images are not values that could be adjusted
+		if (!imageSingleChannel)
+			imageVal.rgb = adjust(imageVal.rgb);
 
 		if (hasReference)
 		{
-			vec4 referenceVal = texture(reference, referenceUV);
+			vec4 referenceVal = sampleImage(reference, referencePages, referenceVirtual, referenceUV, referenceOrientation,
+			                                referenceSingleChannel, referenceRange, referenceColormap);
 			imageVal = blend(imageVal, referenceVal);
 		}
 
@@ -315,15 +521,34 @@ void setDitherParams(GLShader & shader, GLuint textureId, bool hasDither)
 	shader.setUniform("randomness", randomness);
 }
 
+/// Bind the page table of a texture drawn through a VirtualTexture to the given unit, or disable paging
+void setVirtualParams(GLShader & shader, const string & name, const ImageShader::Texture & texture, int unit)
+{
+	glActiveTexture(GL_TEXTURE0 + unit);
+	glBindTexture(GL_TEXTURE_2D, texture.pageTable);
+
+	shader.setUniform(name + "Pages", unit);
+	shader.setUniform(name + "Virtual.enabled", (int)(texture.pageTable != 0));
+	shader.setUniform(name + "Virtual.size", texture.virtualSize);
+	shader.setUniform(name + "Virtual.numLevels", texture.numLevels);
+	shader.setUniform(name + "Virtual.slots", texture.cacheSlots);
+}
+
 void setImageParams(GLShader & shader,
-                    GLuint imageId,
+                    const ImageShader::Texture & image,
                     const Vector2f & scale,
                     const Vector2f & position,
                     float gain, float gamma, bool sRGB,
                     EChannel channel)
 {
 	glActiveTexture(GL_TEXTURE1);
-	glBindTexture(GL_TEXTURE_2D, imageId);
+	glBindTexture(GL_TEXTURE_2D, image.id);
+
+	shader.setUniform("imageSingleChannel", (int)image.singleChannel);
+	shader.setUniform("imageRange", image.range);
+	shader.setUniform("imageColormap", image.colormap);
+	shader.setUniform("imageOrientation", image.orientation);
+	setVirtualParams(shader, "image", image, 5);
 
 	shader.setUniform("gain", gain);
 	shader.setUniform("gamma", gamma);
@@ -336,13 +561,19 @@ void setImageParams(GLShader & shader,
 }
 
 void setReferenceParams(GLShader & shader,
-                        GLuint referenceId,
+                        const ImageShader::Texture & reference,
                         const Vector2f & scale,
                         const Vector2f & position,
                         EBlendMode blendMode)
 {
 	glActiveTexture(GL_TEXTURE2);
-	glBindTexture(GL_TEXTURE_2D, referenceId);
+	glBindTexture(GL_TEXTURE_2D, reference.id);
+
+	shader.setUniform("referenceSingleChannel", (int)reference.singleChannel);
+	shader.setUniform("referenceRange", reference.range);
+	shader.setUniform("referenceColormap", reference.colormap);
+	shader.setUniform("referenceOrientation", reference.orientation);
+	setVirtualParams(shader, "reference", reference, 6);
 
 	shader.setUniform("reference", 2);
 	shader.setUniform("referenceScale", scale);
@@ -350,6 +581,29 @@ void setReferenceParams(GLShader & shader,
 	shader.setUniform("blendMode", (int)blendMode);
 }
 
+void setColormapParams(GLShader & shader, GLuint colormapId)
+{
+	glActiveTexture(GL_TEXTURE3);
+	glBindTexture(GL_TEXTURE_2D, colormapId);
+	shader.setUniform("colormap", 3);
+}
+
+void setAdjustmentParams(GLShader & shader, const ImageShader::Adjustment & adjustment)
+{
+	shader.setUniform("hasAdjustCurve", (int)(adjustment.curve != 0));
+	if (adjustment.curve)
+	{
+		glActiveTexture(GL_TEXTURE4);
+		glBindTexture(GL_TEXTURE_2D, adjustment.curve);
+		shader.setUniform("adjustCurve", 4);
+		shader.setUniform("curveEpsilon", CurveLUT::Epsilon);
+		shader.setUniform("curveMaxWarp", CurveLUT::warp(CurveLUT::MaxValue));
+	}
+
+	shader.setUniform("hasAdjustHSL", (int)adjustment.hasHSL());
+	shader.setUniform("adjustHSL", adjustment.hsl);
+}
+
 } // namespace
 
 #define DEFINE_PARAMS(parent,name) m_shader.define(#name, to_string(parent::name))
@@ -378,6 +632,10 @@ ImageShader::ImageShader()
 	DEFINE_PARAMS(EBlendMode, DIFFERENCE_BLEND);
 	DEFINE_PARAMS(EBlendMode, RELATIVE_DIFFERENCE_BLEND);
 
+	m_shader.define("CURVE_LUT_SIZE", to_string(CurveLUT::Size));
+	m_shader.define("TILE_SIZE", to_string(VirtualTexture::TileSize));
+	m_shader.define("SLOT_SIZE", to_string(VirtualTexture::SlotSize));
+
 	// Gamma/exposure tonemapper with hasDither as a GLSL shader
 	m_shader.init("Tonemapper", vertexShader, fragmentShader);
 
@@ -405,6 +663,21 @@ ImageShader::ImageShader()
 	glPixelStorei(GL_UNPACK_ROW_LENGTH, 256);
 	glTexImage2D(GL_TEXTURE_2D, 0, GL_R32F, 256, 256,
 	             0, GL_RED, GL_FLOAT, (const GLvoid *) dither_matrix256);
+
+	// the false-color maps for single-channel images, one per row
+	vector<Color4> colors;
+	for (int c = 0; c < HDRImage::NUM_COLORMAPS; ++c)
+	{
+		const vector<Color4> & map = HDRImage::singleChannelColormap(HDRImage::Colormap(c));
+		colors.insert(colors.end(), map.begin(), map.end());
+	}
+	glGenTextures(1, &m_colormapTexId);
+	glBindTexture(GL_TEXTURE_2D, m_colormapTexId);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F, 256, HDRImage::NUM_COLORMAPS,
+	             0, GL_RGBA, GL_FLOAT, (const GLvoid *) colors.data());
 }
 
 ImageShader::~ImageShader()
@@ -412,9 +685,11 @@ ImageShader::~ImageShader()
 	m_shader.free();
 	if (m_ditherTexId)
 		glDeleteTextures(1, &m_ditherTexId);
+	if (m_colormapTexId)
+		glDeleteTextures(1, &m_colormapTexId);
 }
 
-void ImageShader::draw(GLuint imageId,
+void ImageShader::draw(const Texture & image,
 						const Vector2f & imageScale, const Vector2f & imagePosition,
 						float gain, float gamma, bool sRGB, bool hasDither,
 						EChannel channel, EBlendMode mode)
@@ -422,15 +697,19 @@ void ImageShader::draw(GLuint imageId,
 	m_shader.bind();
 
 	setDitherParams(m_shader, m_ditherTexId, hasDither);
-	setImageParams(m_shader, imageId, imageScale, imagePosition, gain, gamma, sRGB, channel);
+	setColormapParams(m_shader, m_colormapTexId);
+	setAdjustmentParams(m_shader, m_adjustment);
+	setImageParams(m_shader, image, imageScale, imagePosition, gain, gamma, sRGB, channel);
+	// integer samplers may not share a unit with the others, even when unused
+	setVirtualParams(m_shader, "reference", Texture(), 6);
 	m_shader.setUniform("hasImage", (int)true);
 	m_shader.setUniform("hasReference", (int)false);
 
 	m_shader.drawIndexed(GL_TRIANGLES, 0, 2);
 }
 
-void ImageShader::draw(GLuint imageId,
-                       GLuint referenceId,
+void ImageShader::draw(const Texture & image,
+                       const Texture & reference,
                        const Vector2f & imageScale, const Vector2f & imagePosition,
                        const Vector2f & referenceScale, const Vector2f & referencePosition,
                        float gain, float gamma, bool sRGB, bool hasDither,
@@ -439,8 +718,10 @@ void ImageShader::draw(GLuint imageId,
 	m_shader.bind();
 
 	setDitherParams(m_shader, m_ditherTexId, hasDither);
-	setImageParams(m_shader, imageId, imageScale, imagePosition, gain, gamma, sRGB, channel);
-	setReferenceParams(m_shader, referenceId, referenceScale, referencePosition, mode);
+	setColormapParams(m_shader, m_colormapTexId);
+	setAdjustmentParams(m_shader, m_adjustment);
+	setImageParams(m_shader, image, imageScale, imagePosition, gain, gamma, sRGB, channel);
+	setReferenceParams(m_shader, reference, referenceScale, referencePosition, mode);
 	m_shader.setUniform("hasImage", (int)true);
 	m_shader.setUniform("hasReference", (int)true);
 
@@ -8,6 +8,7 @@
 
 #include <nanogui/opengl.h>
 #include <nanogui/glutil.h>
+#include <Eigen/Core>
 #include "Common.h"
 
 /*!
@@ -16,18 +17,54 @@
 class ImageShader
 {
 public:
+	/// A texture to draw, along with how its values map to colors
+	struct Texture
+	{
+		Texture(GLuint id = 0, bool singleChannel = false, const Eigen::Vector2f & range = Eigen::Vector2f::Zero(),
+		        const Eigen::Matrix3f & orientation = Eigen::Matrix3f::Identity()) :
+			id(id), singleChannel(singleChannel), range(range), orientation(orientation) {}
+
+		GLuint id;
+		bool singleChannel;     ///< Whether to false-color the raw values of a single-channel image
+		Eigen::Vector2f range;  ///< The minimum and extent of the positive raw values, see HDRImage::singleChannelRange
+		Eigen::Matrix3f orientation;    ///< Maps displayed to stored texture coordinates, see HDRImage::Orientation::storedUV
+		int colormap = 0;       ///< The HDRImage::Colormap to false-color a single-channel image with
+
+		// images too large for a single texture are drawn from the tile cache (id) of a VirtualTexture
+		GLuint pageTable = 0;   ///< The page table of the VirtualTexture, or 0 if id is a regular texture
+		Eigen::Vector2i virtualSize = Eigen::Vector2i::Zero();  ///< Size of the full-resolution level
+		int numLevels = 1;      ///< Mip levels of the VirtualTexture
+		int cacheSlots = 0;     ///< Slots along each side of the tile cache
+	};
+
+	/*!
+	 * A point-wise adjustment of the values of the image (not the reference), to preview an edit before
+	 * it is applied to the pixels on the CPU. Each color channel goes through the curve first, then the
+	 * hue, saturation and lightness get adjusted.
+	 */
+	struct Adjustment
+	{
+		GLuint curve = 0;       ///< A texture with the values of a CurveLUT, or 0 for none
+		Eigen::Vector3f hsl = Eigen::Vector3f(0.f, 1.f, 0.f);  ///< The arguments of HSLAdjust, this default changes nothing
+
+		bool hasHSL() const     {return hsl != Eigen::Vector3f(0.f, 1.f, 0.f);}
+	};
+
 	ImageShader();
 	virtual ~ImageShader();
 
-	void draw(GLuint imageId,
+	const Adjustment & adjustment() const           {return m_adjustment;}
+	void setAdjustment(const Adjustment & a)        {m_adjustment = a;}
+
+	void draw(const Texture & image,
 	          const Eigen::Vector2f & scale,
 	          const Eigen::Vector2f & position,
 	          float gain, float gamma,
 	          bool sRGB, bool dither,
 	          EChannel channel, EBlendMode mode);
 
-	void draw(GLuint imageId,
-	          GLuint referenceId,
+	void draw(const Texture & image,
+	          const Texture & reference,
 	          const Eigen::Vector2f & imageScale,
 	          const Eigen::Vector2f & imagePosition,
 	          const Eigen::Vector2f & referenceScale,
@@ -39,4 +76,6 @@ public:
 private:
 	nanogui::GLShader m_shader;
 	GLuint m_ditherTexId = 0;
+	GLuint m_colormapTexId = 0;
+	Adjustment m_adjustment;
 };
\ No newline at end of file
@@ -0,0 +1,433 @@
+//
+// Copyright (C) Wojciech Jarosz <wjarosz@gmail.com>. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can
+// be found in the LICENSE.txt file.
+//
+
+#include "ImageStack.h"
+#include "Async.h"
+#include "ParallelFor.h"
+#include "PixelKernels.h"
+#include <algorithm>
+#include <cmath>
+#include <functional>
+#include <istream>
+#include <limits>
+#include <memory>
+#include <ostream>
+#include <stdexcept>
+#include <spdlog/spdlog.h>
+
+using namespace std;
+
+namespace
+{
+
+// pixels converted and accumulated at a time, so that they are still in the cache for all the statistics
+const int CHUNK = 1024;
+
+/*!
+ * The n pixels of scanline y starting at x0, as four-channel pixels with the NaNs replaced if requested.
+ * Points into the image if that needs no conversion, and into buffer (with room for CHUNK pixels) otherwise.
+ */
+const Color4 * stackPixels(const HDRImage & image, int x0, int y, int n, const StackOptions & options, Color4 * buffer)
+{
+	if (image.isSingleChannel())
+	{
+		auto values = image.intensity();
+		const float * row = values.data() + y * values.outerStride() + x0;
+		for (int i = 0; i < n; ++i)
+			buffer[i] = Color4(row[i], 1.f);
+	}
+	else if (options.replaceNaNs)
+		copy(&image(x0, y), &image(x0, y) + n, buffer);
+	else
+		return &image(x0, y);
+
+	if (options.replaceNaNs)
+		for (int i = 0; i < n; ++i)
+			if (!isfinite(buffer[i].sum()))
+				buffer[i] = Color4(options.nanColor, buffer[i].a);
+	return buffer;
+}
+
+using ImageTask = AsyncTask<shared_ptr<const HDRImage>>;
+
+/*!
+ * Hand the images read by @p read (nullptr if that failed) to @p process in order, reading the next image
+ * on the thread pool while the current one is processed.
+ */
+void forEachImage(const vector<string> & filenames, const function<shared_ptr<const HDRImage>(const string &)> & read,
+                  const function<void(size_t, const shared_ptr<const HDRImage> &)> & process)
+{
+	auto start = [&filenames,&read](size_t i)
+	{
+		auto task = make_shared<ImageTask>([&filenames,&read,i]{return read(filenames[i]);});
+		task->compute();
+		return task;
+	};
+
+	shared_ptr<ImageTask> next = filenames.empty() ? nullptr : start(0);
+	for (size_t i = 0; i < filenames.size(); ++i)
+	{
+		auto current = next;
+		next = i + 1 < filenames.size() ? start(i + 1) : nullptr;
+		process(i, current->get());
+	}
+}
+
+// the statistics of the n samples of one channel of a pixel, which are reordered in the process
+template <typename T>
+void reduceSamples(float * values, int n, unsigned statistics, float & mean, float & variance,
+                   float & minimum, float & maximum, float & median)
+{
+	// Welford's running mean and variance, in the order of the images, like StackAccumulator
+	T m = 0, m2 = 0;
+	for (int k = 0; k < n; ++k)
+	{
+		T delta = values[k] - m;
+		m += delta / T(k + 1);
+		m2 += delta * (values[k] - m);
+	}
+	mean = float(m);
+	variance = float(m2 / T(max(1, n - 1)));
+
+	if (statistics & (STACK_MINIMUM | STACK_MAXIMUM))
+	{
+		auto range = minmax_element(values, values + n);
+		minimum = *range.first;
+		maximum = *range.second;
+	}
+
+	if (statistics & STACK_MEDIAN)
+	{
+		// the average of the two middle values for an even number of samples
+		float * middle = values + n / 2;
+		nth_element(values, middle, values + n);
+		median = *middle;
+		if (n % 2 == 0)
+			median = 0.5f * (median + *max_element(values, middle));
+	}
+}
+
+} // namespace
+
+
+StackAccumulator::StackAccumulator(unsigned statistics, const StackOptions & options) :
+	m_statistics(statistics), m_options(options)
+{
+	// empty
+}
+
+void StackAccumulator::add(const HDRImage & image)
+{
+	if (m_count == 0)
+	{
+		m_width = image.width();
+		m_height = image.height();
+		size_t numPixels = size_t(m_width) * m_height;
+		if ((m_statistics & (STACK_MEAN | STACK_VARIANCE)) && m_options.doublePrecision)
+		{
+			m_meanD.assign(4 * numPixels, 0.0);
+			m_m2D.assign(4 * numPixels, 0.0);
+		}
+		else if (m_statistics & (STACK_MEAN | STACK_VARIANCE))
+		{
+			m_mean = HDRImage(m_width, m_height).setConstant(Color4(0.f));
+			m_m2 = HDRImage(m_width, m_height).setConstant(Color4(0.f));
+		}
+		if (m_statistics & STACK_MINIMUM)
+			m_min = HDRImage(m_width, m_height).setConstant(Color4(numeric_limits<float>::infinity()));
+		if (m_statistics & STACK_MAXIMUM)
+			m_max = HDRImage(m_width, m_height).setConstant(Color4(-numeric_limits<float>::infinity()));
+	}
+	else if (image.width() != m_width || image.height() != m_height)
+		throw invalid_argument("Images do not have the same size.");
+
+	m_count++;
+	float invCount = 1.f / m_count;
+	double invCountD = 1.0 / m_count;
+
+	parallel_for(BlockedRange(0, m_height), [this,&image,invCount,invCountD](int y0, int y1)
+	{
+		vector<Color4> buffer(CHUNK);
+		for (int y = y0; y < y1; ++y)
+			for (int x0 = 0; x0 < m_width; x0 += CHUNK)
+			{
+				int n = min(CHUNK, m_width - x0);
+				const Color4 * x = stackPixels(image, x0, y, n, m_options, buffer.data());
+				size_t offset = size_t(y) * m_width + x0;
+
+				if (m_mean.size())
+					accumulateMeanVariance(m_mean.data() + offset, m_m2.data() + offset, x, n, invCount);
+				else if (!m_meanD.empty())
+				{
+					// the same update as accumulateMeanVariance, for each of the 4n channel values
+					const float * values = (const float *) x;
+					double * mean = &m_meanD[4 * offset];
+					double * m2 = &m_m2D[4 * offset];
+					for (int i = 0; i < 4 * n; ++i)
+					{
+						double delta = values[i] - mean[i];
+						mean[i] += delta * invCountD;
+						m2[i] += delta * (values[i] - mean[i]);
+					}
+				}
+
+				if (m_min.size())
+				{
+					Color4 * minimum = m_min.data() + offset;
+					for (int i = 0; i < n; ++i)
+						minimum[i] = minimum[i].min(x[i]);
+				}
+				if (m_max.size())
+				{
+					Color4 * maximum = m_max.data() + offset;
+					for (int i = 0; i < n; ++i)
+						maximum[i] = maximum[i].max(x[i]);
+				}
+			}
+	});
+}
+
+HDRImage StackAccumulator::mean() const
+{
+	if (m_meanD.empty())
+		return m_mean;
+
+	HDRImage result(m_width, m_height);
+	const double * mean = m_meanD.data();
+	parallel_for(BlockedRange(0, int(result.size())), [&result,mean](int begin, int end)
+	{
+		for (int i = begin; i < end; ++i)
+			result(i) = Color4(float(mean[4 * i + 0]), float(mean[4 * i + 1]),
+			                   float(mean[4 * i + 2]), float(mean[4 * i + 3]));
+	});
+	return result;
+}
+
+HDRImage StackAccumulator::variance() const
+{
+	double scale = 1.0 / max(1, m_count - 1);
+	if (m_meanD.empty())
+		return m_m2 * Color4(float(scale));
+
+	HDRImage result(m_width, m_height);
+	const double * m2 = m_m2D.data();
+	parallel_for(BlockedRange(0, int(result.size())), [&result,m2,scale](int begin, int end)
+	{
+		for (int i = begin; i < end; ++i)
+			result(i) = Color4(float(m2[4 * i + 0] * scale), float(m2[4 * i + 1] * scale),
+			                   float(m2[4 * i + 2] * scale), float(m2[4 * i + 3] * scale));
+	});
+	return result;
+}
+
+
+namespace
+{
+const char StackMagic[8] = {'H', 'D', 'R', 'S', 'T', 'A', 'C', 'K'};
+
+// the accumulator arrays as (data, number of floats or doubles), in the order they are written in
+template <typename Image, typename Doubles>
+void forEachArray(Image & mean, Image & m2, Doubles & meanD, Doubles & m2D, Image & minimum, Image & maximum,
+                  const function<void(void *, size_t)> & f)
+{
+	for (Image * img : {&mean, &m2, &minimum, &maximum})
+		if (img->size())
+			f((void *) img->data(), sizeof(Color4) * img->size());
+	for (Doubles * values : {&meanD, &m2D})
+		if (!values->empty())
+			f((void *) values->data(), sizeof(double) * values->size());
+}
+} // namespace
+
+void StackAccumulator::write(ostream & out) const
+{
+	int32_t header[5] = {int32_t(m_statistics & ~unsigned(STACK_MEDIAN)), int32_t(m_options.doublePrecision), m_count, m_width, m_height};
+	out.write(StackMagic, sizeof(StackMagic));
+	out.write((const char *) header, sizeof(header));
+	forEachArray(m_mean, m_m2, m_meanD, m_m2D, m_min, m_max, [&out](void * data, size_t bytes)
+	{
+		out.write((const char *) data, bytes);
+	});
+	if (!out)
+		throw runtime_error("Cannot write the stack accumulators.");
+}
+
+void StackAccumulator::read(istream & in)
+{
+	char magic[sizeof(StackMagic)];
+	int32_t header[5];
+	if (!in.read(magic, sizeof(magic)) || !equal(magic, magic + sizeof(magic), StackMagic) ||
+	    !in.read((char *) header, sizeof(header)))
+		throw runtime_error("Cannot read the stack accumulators.");
+	if (unsigned(header[0]) != (m_statistics & ~unsigned(STACK_MEDIAN)) || bool(header[1]) != m_options.doublePrecision)
+		throw runtime_error("The stack accumulators were written for other statistics or another precision.");
+
+	// allocate the arrays like add() does for the first image
+	StackAccumulator restored(m_statistics, m_options);
+	if (header[2] > 0)
+	{
+		restored.add(HDRImage(header[3], header[4]));
+		forEachArray(restored.m_mean, restored.m_m2, restored.m_meanD, restored.m_m2D, restored.m_min, restored.m_max,
+		             [&in](void * data, size_t bytes)
+		{
+			if (!in.read((char *) data, bytes))
+				throw runtime_error("Cannot read the stack accumulators.");
+		});
+	}
+	restored.m_count = max(0, header[2]);
+	*this = move(restored);
+}
+
+
+StackStatistics computeStackStatistics(const vector<string> & filenames, unsigned statistics,
+                                       const StackOptions & options)
+{
+	auto console = spdlog::get("console");
+	StackStatistics result;
+
+	auto readWhole = [](const string & filename) -> shared_ptr<const HDRImage>
+	{
+		auto image = make_shared<HDRImage>();
+		if (!image->load(filename))
+		{
+			spdlog::get("console")->error("Cannot read image \"{}\". Skipping...", filename);
+			return nullptr;
+		}
+		return image;
+	};
+
+	if (!(statistics & STACK_MEDIAN))
+	{
+		// without a median, each image is read once and added right away
+		StackAccumulator accumulator(statistics, options);
+		forEachImage(filenames, readWhole, [&](size_t i, const shared_ptr<const HDRImage> & image)
+		{
+			if (!image)
+				return;
+			console->info("Accumulating image \"{}\"...", filenames[i]);
+			accumulator.add(*image);
+		});
+
+		result.count = accumulator.count();
+		if (statistics & STACK_MEAN)
+			result.mean = accumulator.mean();
+		if (statistics & STACK_VARIANCE)
+			result.variance = accumulator.variance();
+		if (statistics & STACK_MINIMUM)
+			result.minimum = accumulator.minimum();
+		if (statistics & STACK_MAXIMUM)
+			result.maximum = accumulator.maximum();
+		return result;
+	}
+
+	// the size of the images, from the header of the first one that can be read
+	int w = 0, h = 0;
+	for (auto & filename : filenames)
+		if (HDRImage::readSize(filename, w, h))
+			break;
+	if (w <= 0 || h <= 0)
+		return result;
+
+	// as many scanlines of all images as fit in the budget, but at least one
+	size_t rowBytes = size_t(w) * filenames.size() * sizeof(Color4);
+	int bandHeight = int(max(size_t(1), min(size_t(h), options.memoryBudget / rowBytes)));
+	int numBands = (h + bandHeight - 1) / bandHeight;
+	if (rowBytes > options.memoryBudget)
+		console->warn("A single scanline of all images takes {:.1f} MB, more than the memory budget.", rowBytes / 1048576.);
+	console->info("Streaming the images in {} band(s) of {} scanlines.", numBands, bandHeight);
+
+	// only the requested statistics get an image, the others are written to a scratch value
+	if (statistics & STACK_MEAN)
+		result.mean.resize(w, h);
+	if (statistics & STACK_VARIANCE)
+		result.variance.resize(w, h);
+	if (statistics & STACK_MINIMUM)
+		result.minimum.resize(w, h);
+	if (statistics & STACK_MAXIMUM)
+		result.maximum.resize(w, h);
+	result.median.resize(w, h);
+
+	size_t bandPixels = size_t(w) * bandHeight;
+	vector<Color4> samples(bandPixels * filenames.size());
+	vector<string> readable;
+
+	for (int top = 0; top < h; top += bandHeight)
+	{
+		int bottom = min(h, top + bandHeight);
+		bool firstBand = top == 0;
+		console->info("Reading scanlines [{},{}) of all images...", top, bottom);
+
+		// gather the band of each image (skipping the unreadable ones in the first band) into the samples
+		int n = 0;
+		const vector<string> & files = firstBand ? filenames : readable;
+		forEachImage(files,
+			[top,bottom](const string & filename) -> shared_ptr<const HDRImage>
+			{
+				auto image = make_shared<HDRImage>();
+				if (!image->loadRows(filename, top, bottom))
+					return nullptr;
+				return image;
+			},
+			[&](size_t i, const shared_ptr<const HDRImage> & image)
+			{
+				if (!image && firstBand)
+				{
+					console->error("Cannot read image \"{}\". Skipping...", files[i]);
+					return;
+				}
+				if (!image)
+					throw runtime_error(fmt::format("Cannot read scanlines [{},{}) of image \"{}\".", top, bottom, files[i]));
+				if (image->width() != w || image->height() != bottom - top)
+					throw invalid_argument("Images do not have the same size.");
+
+				if (firstBand)
+					readable.push_back(files[i]);
+				Color4 * slot = &samples[n++ * bandPixels];
+				parallel_for(BlockedRange(0, bottom - top), [&image,&options,slot,w](int y0, int y1)
+				{
+					vector<Color4> buffer(CHUNK);
+					for (int y = y0; y < y1; ++y)
+						for (int x0 = 0; x0 < w; x0 += CHUNK)
+						{
+							int count = min(CHUNK, w - x0);
+							const Color4 * pixels = stackPixels(*image, x0, y, count, options, buffer.data());
+							copy(pixels, pixels + count, slot + size_t(y) * w + x0);
+						}
+				});
+			});
+
+		if (n == 0)
+			return StackStatistics();
+
+		// all the statistics of each pixel in one pass over its samples
+		using Reduce = void (*)(float *, int, unsigned, float &, float &, float &, float &, float &);
+		Reduce reduce = options.doublePrecision ? Reduce(reduceSamples<double>) : Reduce(reduceSamples<float>);
+		parallel_for(BlockedRange(0, bottom - top), [&](int y0, int y1)
+		{
+			vector<float> values(n);
+			float scratch;
+			auto output = [&scratch](HDRImage & image, int x, int y, int c) -> float &
+			{
+				return image.size() ? image(x, y)[c] : scratch;
+			};
+			for (int y = y0; y < y1; ++y)
+				for (int x = 0; x < w; ++x)
+					for (int c = 0; c < 4; ++c)
+					{
+						size_t p = size_t(y) * w + x;
+						for (int k = 0; k < n; ++k)
+							values[k] = samples[k * bandPixels + p][c];
+
+						reduce(values.data(), n, statistics,
+						       output(result.mean, x, top + y, c), output(result.variance, x, top + y, c),
+						       output(result.minimum, x, top + y, c), output(result.maximum, x, top + y, c),
+						       result.median(x, top + y)[c]);
+					}
+		});
+		result.count = n;
+	}
+	return result;
+}
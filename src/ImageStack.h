@@ -0,0 +1,101 @@
+//
+// Copyright (C) Wojciech Jarosz <wjarosz@gmail.com>. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can
+// be found in the LICENSE.txt file.
+//
+
+#pragma once
+
+#include <cstddef>
+#include <iosfwd>
+#include <string>
+#include <vector>
+#include "HDRImage.h"
+
+/// The per-pixel statistics of a stack of images, to be combined bitwise
+enum StackStatistic : unsigned
+{
+	STACK_MEAN     = 1 << 0,
+	STACK_VARIANCE = 1 << 1,
+	STACK_MINIMUM  = 1 << 2,
+	STACK_MAXIMUM  = 1 << 3,
+	STACK_MEDIAN   = 1 << 4
+};
+
+struct StackOptions
+{
+	bool doublePrecision = false;           ///< Accumulate the mean and variance in doubles instead of floats
+	bool replaceNaNs = false;               ///< Replace NaNs and infinities with nanColor before accumulating
+	Color3 nanColor = Color3(0.f);
+	size_t memoryBudget = size_t(2) << 30;  ///< Bytes to use for holding the samples while computing a median
+};
+
+/*!
+ * @brief Accumulates the mean, variance, minimum and maximum of a stack of same-size images, one image at a time.
+ *
+ * Each image is added in one pass over its pixels, multithreaded over chunks of scanlines, which updates all
+ * the statistics at once: Welford's running mean and variance, and the running minimum and maximum. Only the
+ * accumulators are kept in memory, so the stack can have any number of images. Single-channel images count as
+ * gray, opaque images of their raw values.
+ */
+class StackAccumulator
+{
+public:
+	/// @param statistics   The statistics to accumulate, STACK_MEDIAN is ignored
+	explicit StackAccumulator(unsigned statistics, const StackOptions & options = StackOptions());
+
+	/// Add the next image of the stack. Throws an invalid_argument if it is not the size of the first one
+	void add(const HDRImage & image);
+
+	int count() const       {return m_count;}
+	int width() const       {return m_width;}
+	int height() const      {return m_height;}
+
+	HDRImage mean() const;
+	/// The unbiased sample variance, using the (n-1) Bessel correction
+	HDRImage variance() const;
+	HDRImage minimum() const    {return m_min;}
+	HDRImage maximum() const    {return m_max;}
+
+	/*!
+	 * Write the accumulators to a binary stream, so that accumulating can be resumed later with read().
+	 * Throws a runtime_error on failure.
+	 */
+	void write(std::ostream & out) const;
+	/*!
+	 * Replace the accumulators with the ones written by write(). Throws a runtime_error on failure, or if they
+	 * were written for other statistics or another precision than the ones of this accumulator.
+	 */
+	void read(std::istream & in);
+
+private:
+	unsigned m_statistics;
+	StackOptions m_options;
+	int m_count = 0, m_width = 0, m_height = 0;
+
+	// the running mean and sum of squared differences, in either precision
+	HDRImage m_mean, m_m2;
+	std::vector<double> m_meanD, m_m2D;
+	HDRImage m_min, m_max;
+};
+
+/// The results of computeStackStatistics. Statistics that weren't requested are null images
+struct StackStatistics
+{
+	HDRImage mean, variance, minimum, maximum, median;
+	int count = 0;          ///< The number of images that made it into the statistics
+};
+
+/*!
+ * Compute per-pixel statistics of a stack of same-size image files, including the median.
+ *
+ * The median needs all the samples of a pixel at once, so the stack is streamed through in bands of scanlines:
+ * for each band, the same scanlines of all images are read (with HDRImage::loadRows, so PFM and EXR files only
+ * decode those) into a buffer of at most options.memoryBudget bytes, and all statistics of the band are computed
+ * from it. The stack can therefore be much larger than memory. Without a median, each image is read once and
+ * simply added to a StackAccumulator. The next image is always read while the current one is accumulated.
+ *
+ * Images that cannot be read are skipped, as long as this happens for the first band.
+ */
+StackStatistics computeStackStatistics(const std::vector<std::string> & filenames, unsigned statistics,
+                                       const StackOptions & options = StackOptions());
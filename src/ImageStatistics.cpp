@@ -0,0 +1,231 @@
+//
+// Copyright (C) Wojciech Jarosz <wjarosz@gmail.com>. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can
+// be found in the LICENSE.txt file.
+//
+
+#include "ImageStatistics.h"
+#include "Common.h"
+#include "Timer.h"
+#include "Trace.h"
+#include "Colorspace.h"
+#include "ParallelFor.h"
+#include <algorithm>
+#include <cmath>
+#include <spdlog/spdlog.h>
+
+using namespace Eigen;
+using namespace std;
+
+namespace
+{
+
+/// Add count to the bins of hist overlapped by the (fractional) bin range [t0,t1), spreading it out uniformly
+void spreadCount(MatrixX3f & hist, int c, float t0, float t1, float count)
+{
+	int numBins = int(hist.rows());
+	if (!(t1 > 0))
+	{
+		hist(0, c) += count;
+		return;
+	}
+	if (!(t0 < numBins) || !std::isfinite(t1))
+	{
+		hist(numBins - 1, c) += count;
+		return;
+	}
+	if (t1 - t0 <= 0.f || int(t0) == int(t1))
+	{
+		hist(clamp(int(floor(t0)), 0, numBins - 1), c) += count;
+		return;
+	}
+
+	// whatever falls outside of the histogram's range goes into the first and last bins
+	float density = count / (t1 - t0);
+	if (t0 < 0)
+	{
+		hist(0, c) += -t0 * density;
+		t0 = 0;
+	}
+	if (t1 > numBins)
+	{
+		hist(numBins - 1, c) += (t1 - numBins) * density;
+		t1 = float(numBins);
+	}
+	for (int b = int(t0); b < numBins && b < t1; ++b)
+		hist(b, c) += (min(t1, float(b + 1)) - max(t0, float(b))) * density;
+}
+
+} // namespace
+
+
+// the in-class initialized constants are passed by reference (e.g. to std::vector::assign), so they need definitions
+const int ImageStatistics::PixelSummary::SubBinsPerOctave;
+const int ImageStatistics::PixelSummary::NumBins;
+const int ImageStatistics::PixelSummary::NonPositiveBin;
+
+int ImageStatistics::PixelSummary::bin(float v)
+{
+	uint32_t bits;
+	memcpy(&bits, &v, sizeof(bits));
+
+	// zero, negative values (including -0 and negative nans), and positive nans
+	if (bits == 0 || bits > 0x7f800000)
+		return NonPositiveBin;
+
+	// the exponent plus the 6 most significant mantissa bits
+	return int(bits >> 17);
+}
+
+void ImageStatistics::PixelSummary::binRange(int bin, float & lo, float & hi)
+{
+	uint32_t loBits = uint32_t(bin) << 17, hiBits = uint32_t(bin + 1) << 17;
+	hiBits = min(hiBits, 0x7f800000u);
+	memcpy(&lo, &loBits, sizeof(lo));
+	memcpy(&hi, &hiBits, sizeof(hi));
+}
+
+shared_ptr<const ImageStatistics::PixelSummary> ImageStatistics::summarize(const HDRImage &img, AtomicProgress progress)
+{
+	TRACE_ZONE("ImageStatistics::summarize");
+	// each thread accumulates into its own summary, which are merged at the end
+	ThreadPool & pool = ThreadPool::instance();
+	vector<PixelSummary> partials(pool.numThreads() + 1);
+
+	// single-channel images are summarized by the colors they are displayed with
+	bool singleChannel = img.isSingleChannel();
+	int w = img.width();
+
+	Timer timer;
+	BlockedRange range(0, img.width() * img.height());
+	progress.setNumSteps(range.end);
+	parallel_for(range, [&img,&partials,&progress,singleChannel,w](int begin, int end)
+	{
+		progress.checkCanceled();
+
+		PixelSummary & p = partials[ThreadPool::threadIndex()];
+		if (p.bins[0].empty())
+			for (int c = 0; c < 3; ++c)
+				p.bins[c].assign(PixelSummary::NumBins, 0);
+
+		float minimum = p.minimum, maximum = p.maximum;
+		double sum = 0.0;
+		for (int i = begin; i < end; ++i)
+		{
+			const Color4 val = singleChannel ? img.color(i % w, i / w) : img(i);
+			minimum = min(minimum, min(val.r, val.g, val.b));
+			maximum = max(maximum, max(val.r, val.g, val.b));
+			sum += double(val.r) + double(val.g) + double(val.b);
+
+			++p.bins[0][PixelSummary::bin(val.r)];
+			++p.bins[1][PixelSummary::bin(val.g)];
+			++p.bins[2][PixelSummary::bin(val.b)];
+		}
+		p.minimum = minimum;
+		p.maximum = maximum;
+		p.sum += sum;
+		p.numPixels += end - begin;
+
+		progress += end - begin;
+	});
+
+	auto ret = make_shared<PixelSummary>();
+	for (int c = 0; c < 3; ++c)
+		ret->bins[c].assign(PixelSummary::NumBins, 0);
+	for (const auto & p : partials)
+	{
+		if (p.bins[0].empty())
+			continue;
+		ret->minimum = min(ret->minimum, p.minimum);
+		ret->maximum = max(ret->maximum, p.maximum);
+		ret->sum += p.sum;
+		ret->numPixels += p.numPixels;
+		for (int c = 0; c < 3; ++c)
+			for (int b = 0; b < PixelSummary::NumBins; ++b)
+				ret->bins[c][b] += p.bins[c][b];
+	}
+
+	spdlog::get("console")->trace("Summarizing the pixel statistics took {} seconds.", (timer.elapsed() / 1000.f));
+	return ret;
+}
+
+shared_ptr<ImageStatistics> ImageStatistics::computeStatistics(const HDRImage &img, float exposure)
+{
+	return computeStatistics(summarize(img), exposure);
+}
+
+shared_ptr<ImageStatistics> ImageStatistics::computeStatistics(const shared_ptr<const PixelSummary> & summary, float exposure)
+{
+	TRACE_ZONE("ImageStatistics::computeStatistics");
+	static const int numBins = 256;
+	static const int numTicks = 8;
+	float displayMax = pow(2.f, -exposure);
+
+	auto ret = make_shared<ImageStatistics>();
+	for (int i = 0; i < ENumAxisScales; ++i)
+		ret->histogram[i].values = MatrixX3f::Zero(numBins, 3);
+
+	ret->summary = summary;
+	ret->exposure = exposure;
+	ret->minimum = summary->minimum;
+	ret->maximum = summary->maximum;
+
+	float gain = pow(2.f, exposure);
+	ret->average = summary->numPixels ? float(gain * summary->sum / (3 * summary->numPixels)) : 0.f;
+
+	// the edges of the summary bins at this exposure, and in sRGB
+	ArrayXf edges(PixelSummary::NumBins), sRGBEdges(PixelSummary::NumBins);
+	for (int b = 0; b < PixelSummary::NonPositiveBin; ++b)
+		PixelSummary::binRange(b, edges[b], edges[b + 1]);
+	edges *= gain;
+	LinearToSRGB(edges.data(), sRGBEdges.data(), edges.size());
+
+	// re-bin the logarithmically spaced summary bins into the histograms for this exposure
+	for (int c = 0; c < 3; ++c)
+	{
+		const auto & bins = summary->bins[c];
+		for (int b = 0; b < PixelSummary::NumBins; ++b)
+		{
+			float count = float(bins[b]);
+			if (count == 0.f)
+				continue;
+
+			if (b == PixelSummary::NonPositiveBin)
+			{
+				for (int i = 0; i < ENumAxisScales; ++i)
+					ret->histogram[i].values(0, c) += count;
+				continue;
+			}
+
+			float lo = edges[b], hi = edges[b + 1];
+			spreadCount(ret->histogram[ELinear].values, c, lo * numBins, hi * numBins, count);
+			spreadCount(ret->histogram[ESRGB].values, c, sRGBEdges[b] * numBins, sRGBEdges[b + 1] * numBins, count);
+			spreadCount(ret->histogram[ELog].values, c, normalizedLogScale(lo) * numBins, normalizedLogScale(hi) * numBins, count);
+		}
+	}
+
+
+	// Normalize each histogram according to its 10th-largest bin
+	MatrixXf temp;
+	for (int i = 0; i < ENumAxisScales; ++i)
+	{
+		temp = ret->histogram[i].values;
+		DenseIndex idx = temp.size() - 10;
+		nth_element(temp.data(), temp.data() + idx, temp.data() + temp.size());
+		ret->histogram[i].values /= temp(idx);
+	}
+
+	// create the tick marks
+	ret->histogram[ELinear].xTicks.setLinSpaced(numTicks+1, 0.0f, 1.0f);
+	ret->histogram[ESRGB].xTicks = ret->histogram[ELinear].xTicks.unaryExpr([](float v){return LinearToSRGB(v);});
+	ret->histogram[ELog].xTicks = ret->histogram[ELinear].xTicks.unaryExpr([](float v){return normalizedLogScale(v);});
+
+	// create the tick labels
+	auto & hist = ret->histogram[ELinear];
+	hist.xTickLabels.resize(numTicks + 1);
+	for (int i = 0; i <= numTicks; ++i)
+		hist.xTickLabels[i] = fmt::format("{:.3f}", displayMax * hist.xTicks[i]);
+	ret->histogram[ESRGB].xTickLabels = ret->histogram[ELog].xTickLabels = hist.xTickLabels;
+
+	return ret;
+}
@@ -0,0 +1,74 @@
+//
+// Copyright (C) Wojciech Jarosz <wjarosz@gmail.com>. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can
+// be found in the LICENSE.txt file.
+//
+
+#pragma once
+
+#include <cstdint>             // for uint32_t
+#include <Eigen/Core>          // for MatrixX3f, VectorXf
+#include <limits>              // for numeric_limits
+#include <memory>              // for shared_ptr
+#include <string>              // for string
+#include <vector>              // for vector
+#include "HDRImage.h"          // for HDRImage
+#include "Progress.h"          // for AtomicProgress
+
+
+struct ImageStatistics
+{
+	float minimum;
+	float average;
+	float maximum;
+	float exposure;
+
+	enum AxisScale : int
+	{
+		ELinear = 0,
+		ESRGB = 1,
+		ELog = 2,
+		ENumAxisScales = 3
+	};
+
+	struct Histogram
+	{
+		Eigen::MatrixX3f values;
+		Eigen::VectorXf xTicks;
+		std::vector<std::string> xTickLabels;
+	};
+
+	Histogram histogram[ENumAxisScales];
+
+	/*!
+	 * An exposure-independent summary of the pixel values, from which the statistics for any exposure can be
+	 * derived without looking at the pixels again.
+	 *
+	 * The histogram bins are defined by the exponent and the top mantissa bits of the (positive) float values,
+	 * so they are spaced logarithmically, with SubBinsPerOctave bins per power of two.
+	 */
+	struct PixelSummary
+	{
+		static const int SubBinsPerOctave = 64;
+		static const int NumBins = (0x7f800000 >> 17) + 2;    ///< all positive floats up to +inf, plus one bin for everything <= 0
+		static const int NonPositiveBin = NumBins - 1;
+
+		float minimum = std::numeric_limits<float>::infinity();
+		float maximum = -std::numeric_limits<float>::infinity();
+		double sum = 0.0;                                       ///< sum of the r, g and b values of all pixels
+		size_t numPixels = 0;
+		std::vector<uint32_t> bins[3];
+
+		/// The bin a value falls into
+		static int bin(float v);
+		/// The range [lo,hi) of values within a bin. Not meaningful for the NonPositiveBin
+		static void binRange(int bin, float & lo, float & hi);
+	};
+	std::shared_ptr<const PixelSummary> summary;
+
+	/// Compute the exposure-independent summary of the image in a single parallel pass
+	static std::shared_ptr<const PixelSummary> summarize(const HDRImage &img, AtomicProgress progress = AtomicProgress());
+	/// Derive the statistics for the given exposure from a previously computed summary
+	static std::shared_ptr<ImageStatistics> computeStatistics(const std::shared_ptr<const PixelSummary> & summary, float exposure);
+	static std::shared_ptr<ImageStatistics> computeStatistics(const HDRImage &img, float exposure);
+};
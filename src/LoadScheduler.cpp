@@ -0,0 +1,206 @@
+//
+// Copyright (C) Wojciech Jarosz <wjarosz@gmail.com>. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can
+// be found in the LICENSE.txt file.
+//
+
+#include "LoadScheduler.h"
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <unordered_map>
+
+using namespace std;
+
+namespace
+{
+
+// loads that have not been explicitly prioritized go behind all the ones that have, in the order they were scheduled
+const int64_t UNRANKED = int64_t(1) << 32;
+
+// files larger than this are only partially read ahead, so they don't push everything else out of the file cache
+const size_t MAX_READ_AHEAD = size_t(256) << 20;
+
+struct Job
+{
+	const void * key;
+	string filename;
+	ThreadPool::Task run;
+	function<bool()> pending;
+	int64_t sequence;
+	int64_t priority;           ///< Lower values are more important
+};
+
+// read the file sequentially in large chunks, just so that the decoder finds its contents in the file cache
+void readAhead(const Job & job)
+{
+	FILE * f = fopen(job.filename.c_str(), "rb");
+	if (!f)
+		return;     // let the decoder report the error
+
+	vector<char> buffer(size_t(1) << 20);
+	size_t total = 0;
+	while (total < MAX_READ_AHEAD && job.pending())
+	{
+		size_t n = fread(buffer.data(), 1, buffer.size(), f);
+		total += n;
+		if (n < buffer.size())
+			break;
+	}
+	fclose(f);
+}
+
+// remove and return the most important job in the list
+Job popBest(vector<Job> & jobs)
+{
+	auto best = min_element(jobs.begin(), jobs.end(),
+	                        [](const Job & a, const Job & b){return a.priority < b.priority;});
+	Job job = move(*best);
+	jobs.erase(best);
+	return job;
+}
+
+} // namespace
+
+
+struct LoadScheduler::State : public enable_shared_from_this<LoadScheduler::State>
+{
+	State(int r, int d) : maxReads(max(1, r)), maxDecodes(max(1, d)) {}
+
+	void finishRead(Job & job);
+	void finishDecode();
+	void dispatch(unique_lock<mutex> & lock);
+
+	const int maxReads, maxDecodes;
+
+	mutable mutex mtx;
+	vector<Job> toRead;         ///< Loads waiting for the I/O stage
+	vector<Job> toDecode;       ///< Loads whose file has been read, waiting for the decode stage
+	int numReading = 0;
+	int numDecoding = 0;
+	int64_t nextSequence = 0;
+	bool stopped = false;
+};
+
+void LoadScheduler::State::finishRead(Job & job)
+{
+	unique_lock<mutex> lock(mtx);
+	numReading--;
+	if (stopped)
+		return;
+
+	toDecode.push_back(move(job));
+	dispatch(lock);
+}
+
+void LoadScheduler::State::finishDecode()
+{
+	unique_lock<mutex> lock(mtx);
+	numDecoding--;
+	if (!stopped)
+		dispatch(lock);
+}
+
+/*!
+ * Start as many stages as the limits allow, most important first. Must be called with the lock held,
+ * which it releases before handing the work to the pool.
+ */
+void LoadScheduler::State::dispatch(unique_lock<mutex> & lock)
+{
+	auto self = shared_from_this();
+	vector<ThreadPool::Task> tasks;
+
+	// retire the loads that are no longer wanted without reading their files
+	for (auto * jobs : {&toRead, &toDecode})
+	{
+		auto retired = stable_partition(jobs->begin(), jobs->end(), [](const Job & job){return job.pending();});
+		for (auto it = retired; it != jobs->end(); ++it)
+			tasks.push_back(move(it->run));
+		jobs->erase(retired, jobs->end());
+	}
+
+	while (numDecoding < maxDecodes && !toDecode.empty())
+	{
+		auto job = make_shared<Job>(popBest(toDecode));
+		numDecoding++;
+		tasks.push_back([self,job]
+		{
+			job->run();
+			self->finishDecode();
+		});
+	}
+
+	// don't read much further ahead than the decoders can keep up with
+	while (numReading < maxReads && numReading + int(toDecode.size()) < maxReads + maxDecodes && !toRead.empty())
+	{
+		auto job = make_shared<Job>(popBest(toRead));
+		numReading++;
+		tasks.push_back([self,job]
+		{
+			readAhead(*job);
+			self->finishRead(*job);
+		});
+	}
+
+	lock.unlock();
+
+	ThreadPool & pool = ThreadPool::instance();
+	for (auto & task : tasks)
+		pool.enqueue(move(task));
+}
+
+
+LoadScheduler::LoadScheduler(int maxReads, int maxDecodes) :
+	m_state(make_shared<State>(maxReads, maxDecodes))
+{
+	// empty
+}
+
+LoadScheduler::~LoadScheduler()
+{
+	// stages that are already running only hold on to the state, so just drop everything still queued
+	lock_guard<mutex> lock(m_state->mtx);
+	m_state->stopped = true;
+	m_state->toRead.clear();
+	m_state->toDecode.clear();
+}
+
+int LoadScheduler::defaultMaxDecodes()
+{
+	// the decoders are parallelized themselves, so a few concurrent loads are enough to keep the pool busy
+	return max(2, min(4, int(ThreadPool::instance().numThreads()) / 2));
+}
+
+TaskLauncher LoadScheduler::launcher(const void * key, const string & filename)
+{
+	auto state = m_state;
+	return [state,key,filename](ThreadPool::Task run, function<bool()> pending)
+	{
+		unique_lock<mutex> lock(state->mtx);
+		int64_t sequence = state->nextSequence++;
+		state->toRead.push_back({key, filename, move(run), move(pending), sequence, UNRANKED + sequence});
+		state->dispatch(lock);
+	};
+}
+
+void LoadScheduler::prioritize(const vector<const void *> & keys)
+{
+	unordered_map<const void *, int64_t> ranks;
+	for (size_t i = 0; i < keys.size(); ++i)
+		ranks.emplace(keys[i], int64_t(i));
+
+	lock_guard<mutex> lock(m_state->mtx);
+	for (auto * jobs : {&m_state->toRead, &m_state->toDecode})
+		for (auto & job : *jobs)
+		{
+			auto it = ranks.find(job.key);
+			job.priority = it != ranks.end() ? it->second : UNRANKED + job.sequence;
+		}
+}
+
+int LoadScheduler::numPending() const
+{
+	lock_guard<mutex> lock(m_state->mtx);
+	return int(m_state->toRead.size() + m_state->toDecode.size()) + m_state->numReading + m_state->numDecoding;
+}
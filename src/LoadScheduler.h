@@ -0,0 +1,60 @@
+//
+// Copyright (C) Wojciech Jarosz <wjarosz@gmail.com>. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can
+// be found in the LICENSE.txt file.
+//
+
+#pragma once
+
+#include <memory>
+#include <string>
+#include <vector>
+#include "Async.h"
+
+/*!
+ * @brief Runs image loads on the ThreadPool with a bounded number of them in flight, most important first.
+ *
+ * Each load goes through two stages. The I/O stage reads the whole file sequentially, which brings it into the
+ * operating system's file cache, and the decode stage then runs the actual load task, which finds the data in
+ * memory. At most maxReads files are read and at most maxDecodes loads are decoded at the same time, and only
+ * a few files are read ahead of the decoders, so opening thousands of images neither floods the disk with
+ * competing requests nor the pool with tasks that all hold on to partially decoded images.
+ *
+ * Queued loads are started in order of priority, which can be changed at any time with prioritize().
+ * Loads that are canceled or abandoned (e.g. because their image was closed) while still queued skip
+ * reading the file and are retired right away.
+ */
+class LoadScheduler
+{
+public:
+	explicit LoadScheduler(int maxReads = 2, int maxDecodes = defaultMaxDecodes());
+	~LoadScheduler();
+
+	LoadScheduler(const LoadScheduler &) = delete;
+	LoadScheduler & operator=(const LoadScheduler &) = delete;
+
+	/*!
+	 * A launcher for an AsyncTask that loads @p filename. Until the next call to prioritize, the load is
+	 * queued behind all previously scheduled loads.
+	 *
+	 * @param key   Identifies the load in calls to prioritize, typically the image being loaded
+	 */
+	TaskLauncher launcher(const void * key, const std::string & filename);
+
+	/*!
+	 * Reorder the queued loads.
+	 *
+	 * @param keys  The keys of the loads, from most to least important. Loads with keys not in
+	 *              the list are moved behind all the others.
+	 */
+	void prioritize(const std::vector<const void *> & keys);
+
+	/// Number of loads that have not finished yet
+	int numPending() const;
+
+	static int defaultMaxDecodes();
+
+private:
+	struct State;
+	std::shared_ptr<State> m_state;
+};
@@ -0,0 +1,38 @@
+//
+// Copyright (C) Wojciech Jarosz <wjarosz@gmail.com>. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can
+// be found in the LICENSE.txt file.
+//
+
+#pragma once
+
+#include <cstddef>
+#include <string>
+
+/*!
+ * A read-only memory mapping of a whole file.
+ *
+ * The operating system pages the contents in lazily as they are accessed (and can drop them again under memory
+ * pressure), so uncompressed image data can be viewed in place without first reading it into an allocated buffer.
+ */
+class MappedFile
+{
+public:
+	/// Map the file, throwing a runtime_error if it cannot be opened or mapped
+	explicit MappedFile(const std::string & filename);
+	~MappedFile();
+
+	MappedFile(const MappedFile &) = delete;
+	MappedFile & operator=(const MappedFile &) = delete;
+
+	const unsigned char * data() const  {return m_data;}
+	size_t size() const                 {return m_size;}
+
+private:
+	const unsigned char * m_data = nullptr;
+	size_t m_size = 0;
+#if defined(_WIN32)
+	void * m_file = nullptr;
+	void * m_mapping = nullptr;
+#endif
+};
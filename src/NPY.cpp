@@ -0,0 +1,99 @@
+//
+// Copyright (C) Wojciech Jarosz <wjarosz@gmail.com>. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can
+// be found in the LICENSE.txt file.
+//
+
+#include "NPY.h"
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+
+using namespace std;
+
+
+namespace
+{
+
+/// The text following the quoted key in the header dictionary
+size_t findValue(const string & header, const char * key)
+{
+	size_t pos = header.find(string("'") + key + "'");
+	if (pos == string::npos)
+		throw runtime_error(string("parseNPYHeader: Missing '") + key + "' in header");
+	pos = header.find(':', pos);
+	if (pos == string::npos)
+		throw runtime_error("parseNPYHeader: Malformed header");
+	return pos + 1;
+}
+
+} // end namespace
+
+
+NPYHeader parseNPYHeader(const unsigned char * data, size_t size)
+{
+	if (size < 10 || memcmp(data, "\x93NUMPY", 6) != 0)
+		throw runtime_error("parseNPYHeader: Not an NPY file");
+
+	// version 1 stores the header length in 2 bytes, later versions in 4
+	int major = data[6];
+	size_t headerLength, headerOffset;
+	if (major == 1)
+	{
+		headerLength = size_t(data[8]) | (size_t(data[9]) << 8);
+		headerOffset = 10;
+	}
+	else
+	{
+		if (size < 12)
+			throw runtime_error("parseNPYHeader: Truncated header");
+		headerLength = size_t(data[8]) | (size_t(data[9]) << 8) | (size_t(data[10]) << 16) | (size_t(data[11]) << 24);
+		headerOffset = 12;
+	}
+	if (size < headerOffset + headerLength)
+		throw runtime_error("parseNPYHeader: Truncated header");
+
+	// the header is the repr of a python dict, e.g. {'descr': '<f4', 'fortran_order': False, 'shape': (480, 640), }
+	string header((const char *) data + headerOffset, headerLength);
+	NPYHeader ret;
+
+	size_t pos = header.find('\'', findValue(header, "descr"));
+	size_t end = pos == string::npos ? pos : header.find('\'', pos + 1);
+	if (end == string::npos)
+		throw runtime_error("parseNPYHeader: Malformed 'descr' in header");
+	ret.descr = header.substr(pos + 1, end - pos - 1);
+
+	pos = header.find_first_not_of(' ', findValue(header, "fortran_order"));
+	if (pos == string::npos)
+		throw runtime_error("parseNPYHeader: Malformed 'fortran_order' in header");
+	ret.fortranOrder = header.compare(pos, 4, "True") == 0;
+
+	pos = header.find('(', findValue(header, "shape"));
+	end = pos == string::npos ? pos : header.find(')', pos);
+	if (end == string::npos)
+		throw runtime_error("parseNPYHeader: Malformed 'shape' in header");
+	const char * p = header.c_str() + pos + 1;
+	while (p < header.c_str() + end)
+	{
+		char * next = nullptr;
+		unsigned long long dim = strtoull(p, &next, 10);
+		if (next == p)
+			break;
+		ret.shape.push_back(size_t(dim));
+		p = next;
+		while (*p == ',' || *p == ' ')
+			++p;
+	}
+
+	ret.dataOffset = headerOffset + headerLength;
+
+	// the item size is the number at the end of the type string
+	size_t numBytes = size_t(atoi(ret.descr.c_str() + min(ret.descr.size(), ret.descr.find_first_of("0123456789"))));
+	for (size_t dim : ret.shape)
+		numBytes *= dim;
+	if (size < ret.dataOffset + numBytes)
+		throw runtime_error("parseNPYHeader: File is too small for the array data");
+
+	return ret;
+}
@@ -0,0 +1,23 @@
+//
+// Copyright (C) Wojciech Jarosz <wjarosz@gmail.com>. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can
+// be found in the LICENSE.txt file.
+//
+
+#pragma once
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+/// The header of a NumPy .npy file, describing where and how the array is stored
+struct NPYHeader
+{
+	std::string descr;          ///< The array-protocol type string, e.g. "<f4" for little-endian 32-bit floats
+	bool fortranOrder = false;
+	std::vector<size_t> shape;
+	size_t dataOffset = 0;      ///< Offset of the array data from the start of the file
+};
+
+/// Parse the header of the .npy file contents [data,data+size), e.g. of a memory-mapped file. Throws on errors
+NPYHeader parseNPYHeader(const unsigned char * data, size_t size);
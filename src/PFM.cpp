@@ -5,12 +5,19 @@
 //
 
 #include "PFM.h"
+#include "MappedFile.h"
+#include "ParallelFor.h"
 #include <cstdio>
 #include <cstring>
 #include <iostream>
+#include <memory>
 #include <stdexcept>
 #include <cmath>
 #include <cstdint>
+#include <cstdlib>
+#include <cctype>
+#include <algorithm>
+#include <vector>
 
 using namespace std;
 
@@ -18,128 +25,173 @@ using namespace std;
 namespace
 {
 
-float reinterpretAsHostEndian(float f, bool bigEndian)
-{
-	static_assert(sizeof(float) == sizeof(unsigned int), "Sizes must match");
-
-	const auto* uchar = (const unsigned char *) &f;
-	uint32_t i;
-	if (bigEndian)
-		i = (uchar[3]<<0) | (uchar[2]<<8) | (uchar[1]<<16) | (uchar[0]<<24);
-	else
-		i = (uchar[0]<<0) | (uchar[1]<<8) | (uchar[2]<<16) | (uchar[3]<<24);
+// the header is short, so this much of the beginning of a file is enough to parse it
+const size_t HeaderBufferSize = 256;
+// the converted scanlines are written in blocks of about this many bytes
+const size_t WriteBlockSize = size_t(4) << 20;
 
-	float ret;
-	memcpy(&ret, &i, sizeof(float));
-	return ret;
+bool hostIsBigEndian()
+{
+	const uint32_t one = 1;
+	return *(const unsigned char *) &one == 0;
 }
 
-} // end namespace
+inline uint32_t byteSwapped(uint32_t i)
+{
+	return (i >> 24) | ((i >> 8) & 0xff00u) | ((i << 8) & 0xff0000u) | (i << 24);
+}
 
-bool isPFMImage(const char *filename) noexcept
+/// Value i of the pixel data src, scaled and (if Swap) byte-swapped. Loops over this vectorize.
+template <bool Swap>
+inline float decodeValue(const unsigned char * src, size_t i, float scale)
 {
-	FILE *f = nullptr;
-	int numInputsRead = 0;
+	uint32_t bits;
+	memcpy(&bits, src + i * sizeof(float), sizeof(bits));
+	if (Swap)
+		bits = byteSwapped(bits);
+	float f;
+	memcpy(&f, &bits, sizeof(f));
+	return scale * f;
+}
 
-	try
+/// Convert n pixels of Channels values each, storing them Stride floats apart with an opaque alpha after them
+template <bool Swap, int Channels, int Stride>
+void decode(const unsigned char * src, size_t n, float scale, float * dst)
+{
+	for (size_t p = 0; p < n; ++p)
 	{
-		f = fopen(filename, "rb");
-
-		if (!f)
-			throw runtime_error("loadPFMImage: Error opening");
+		for (int c = 0; c < Channels; ++c)
+			dst[p * Stride + c] = decodeValue<Swap>(src, p * Channels + c, scale);
+		if (Stride > Channels)
+			dst[p * Stride + Channels] = 1.f;
+	}
+}
 
-		char buffer[1024];
-		numInputsRead = fscanf(f, "%2s\n", buffer);
-		if (numInputsRead != 1)
-			throw runtime_error("loadPFMImage: Could not read number of channels in header");
+/// Parse the header at the beginning of the file contents [data,data+size), which need not hold the pixel data
+PFMHeader parseHeader(const unsigned char * data, size_t size)
+{
+	// parse a null-terminated copy
+	char buffer[HeaderBufferSize];
+	size_t n = min(size, sizeof(buffer) - 1);
+	memcpy(buffer, data, n);
+	buffer[n] = '\0';
+
+	PFMHeader header;
+	if (!hasPFMSignature(data, size))
+		throw runtime_error("parsePFMHeader: Cannot deduce number of channels from header");
+	header.numChannels = buffer[1] == 'f' ? 1 : 3;
+
+	char * p = buffer + 2;
+	char * end = nullptr;
+	long width = strtol(p, &end, 10);
+	long height = end != p ? strtol(p = end, &end, 10) : 0;
+	if (end == p || width <= 0 || height <= 0)
+		throw runtime_error("parsePFMHeader: Invalid image width or height");
+
+	float scale = strtof(p = end, &end);
+	if (end == p || !isspace(*end) || scale == 0.f)
+		throw runtime_error("parsePFMHeader: Invalid scale factor");
+
+	header.width = int(width);
+	header.height = int(height);
+	header.bigEndian = scale > 0.0f;
+	header.scale = fabsf(scale);
+	// a single whitespace character separates the header from the pixels
+	header.dataOffset = size_t(end - buffer) + 1;
+	return header;
+}
 
-	    if (!(strcmp(buffer, "Pf") == 0 || strcmp(buffer, "PF") == 0))
-			throw runtime_error("loadPFMImage: Cannot deduce number of channels from header");
+} // end namespace
 
-		int width, height;
-		numInputsRead = fscanf(f, "%d%d", &width, &height);
-		if (numInputsRead != 2 || width <= 0 || height <= 0)
-	    	throw runtime_error("loadPFMImage: Invalid image width or height");
+bool isPFMImage(const char *filename) noexcept
+{
+	// a single read of the beginning of the file, instead of scanning the header value by value
+	FILE *f = fopen(filename, "rb");
+	if (!f)
+		return false;
 
-		float scale;
-		numInputsRead = fscanf(f, "%f", &scale);
-		if (numInputsRead != 1)
-	    	throw runtime_error("loadPFMImage: Invalid file endianness. Big-Endian files not supported");
+	unsigned char buffer[HeaderBufferSize];
+	size_t size = fread(buffer, 1, sizeof(buffer), f);
+	fclose(f);
 
-		fclose(f);
+	try
+	{
+		parseHeader(buffer, size);
 		return true;
 	}
-	catch (const exception & e)
+	catch (const exception &)
 	{
-		fclose(f);
 		return false;
 	}
 }
 
 float * loadPFMImage(const char *filename, int *width, int *height, int *numChannels)
 {
-	float * data = nullptr;
-	FILE *f = nullptr;
-	int numInputsRead = 0;
-
 	try
 	{
-		f = fopen(filename, "rb");
-
-		if (!f)
-			throw runtime_error("loadPFMImage: Error opening");
-
-		char buffer[1024];
-		numInputsRead = fscanf(f, "%2s\n", buffer);
-		if (numInputsRead != 1)
-			throw runtime_error("loadPFMImage: Could not read number of channels in header");
-
-	    if (strcmp(buffer, "Pf") == 0)
-	        *numChannels = 1;
-	    else if (strcmp(buffer, "PF") == 0)
-	        *numChannels = 3;
-	    else
-			throw runtime_error("loadPFMImage: Cannot deduce number of channels from header");
-
-
-		numInputsRead = fscanf(f, "%d%d", width, height);
-		if (numInputsRead != 2 || *width <= 0 || *height <= 0)
-	    	throw runtime_error("loadPFMImage: Invalid image width or height");
-
-		float scale;
-		numInputsRead = fscanf(f, "%f", &scale);
-		if (numInputsRead != 1)
-	    	throw runtime_error("loadPFMImage: Invalid file endianness. Big-Endian files not supported");
-
-	    bool bigEndian = scale > 0.0f;
-
-		data = new float[(*width) * (*height) * 3];
-
-		if (fread(data, 1, 1, f) != 1)
-			throw runtime_error("loadPFMImage: Unknown error");
-
-		size_t numFloats = static_cast<size_t>((*width) * (*height) * (*numChannels));
-		if (fread(data, sizeof(float), numFloats, f) != numFloats)
-			throw runtime_error("loadPFMImage: Could not read all pixel data");
-
-		// multiply data by scale factor
-		scale = fabsf(scale);
-        for (size_t i = 0; i < numFloats; ++i)
-            data[i] = scale*reinterpretAsHostEndian(data[i], bigEndian);
-
-		fclose(f);
-		return data;
+		MappedFile file(filename);
+		PFMHeader header = parsePFMHeader(file.data(), file.size());
+
+		size_t n = size_t(header.width) * header.height * header.numChannels;
+		unique_ptr<float[]> data(new float[n]);
+		const unsigned char * src = file.data() + header.dataOffset;
+		parallel_for(BlockedRange(0, header.height), [&header,&data,src](int y0, int y1)
+		{
+			size_t lineSize = size_t(header.width) * header.numChannels;
+			decodePFMValues(header, src + y0 * lineSize * sizeof(float), (y1 - y0) * lineSize, data.get() + y0 * lineSize);
+		});
+
+		*width = header.width;
+		*height = header.height;
+		*numChannels = header.numChannels;
+		return data.release();
 	}
 	catch (const runtime_error & e)
 	{
-		fclose(f);
-		delete [] data;
 		throw runtime_error(string(e.what()) + " in file '" + filename + "'");
 	}
 }
 
-bool writePFMImage(const char *filename, int width, int height, int numChannels, const float *data)
+bool hasPFMSignature(const unsigned char * data, size_t size)
+{
+	return size >= 3 && data[0] == 'P' && (data[1] == 'f' || data[1] == 'F') && isspace(data[2]);
+}
+
+PFMHeader parsePFMHeader(const unsigned char * data, size_t size)
+{
+	PFMHeader header = parseHeader(data, size);
+	if (size < header.dataOffset + size_t(header.width) * header.height * header.numChannels * sizeof(float))
+		throw runtime_error("parsePFMHeader: File is too small for the pixel data");
+	return header;
+}
+
+void decodePFMValues(const PFMHeader & header, const unsigned char * src, size_t n, float * dst)
+{
+	if (header.bigEndian != hostIsBigEndian())
+		decode<true, 1, 1>(src, n, header.scale, dst);
+	else if (header.scale != 1.f)
+		decode<false, 1, 1>(src, n, header.scale, dst);
+	else
+		memcpy(dst, src, n * sizeof(float));
+}
+
+void decodePFMPixels(const PFMHeader & header, const unsigned char * src, size_t n, float * dst)
+{
+	if (header.bigEndian != hostIsBigEndian())
+		decode<true, 3, 4>(src, n, header.scale, dst);
+	else
+		decode<false, 3, 4>(src, n, header.scale, dst);
+}
+
+bool writePFMImage(const char *filename, int width, int height, int numChannels, const float *data, float gain)
 {
+	if (numChannels != 1 && numChannels != 3 && numChannels != 4)
+	{
+		cerr << "writePFMImage: Unsupported number of channels "
+			 << numChannels << " when writing file '" << filename << "'" << endl;
+		return false;
+	}
+
 	FILE *f = fopen(filename, "wb");
 
 	if (!f)
@@ -150,35 +202,40 @@ bool writePFMImage(const char *filename, int width, int height, int numChannels,
 
 	fprintf(f, numChannels == 1 ? "Pf\n" : "PF\n");
 	fprintf(f, "%d %d\n", width, height);
-
-	// determine system endianness
-	bool littleEndian = false;
+	// a negative scale marks little-endian data
+	fprintf(f, hostIsBigEndian() ? "1.0000000\n" : "-1.0000000\n");
+
+	// PFM stores the scanlines bottom-up, so flip them while converting blocks of them in parallel
+	int stored = numChannels == 1 ? 1 : 3;
+	size_t lineSize = size_t(width) * stored;
+	int blockLines = max(1, int(WriteBlockSize / (lineSize * sizeof(float))));
+	vector<float> block(size_t(min(blockLines, height)) * lineSize);
+	bool written = true;
+	for (int first = 0; first < height && written; first += blockLines)
 	{
-		int n = 1;
-		// little endian if true
-		if (*(char *)&n == 1)
-			littleEndian = true;
+		int numLines = min(blockLines, height - first);
+		parallel_for(BlockedRange(0, numLines), [&](int begin, int end)
+		{
+			for (int j = begin; j < end; ++j)
+			{
+				const float * src = data + size_t(height - 1 - first - j) * width * numChannels;
+				float * dst = block.data() + j * lineSize;
+				if (numChannels == stored)
+					for (size_t i = 0; i < lineSize; ++i)
+						dst[i] = gain * src[i];
+				else
+					for (int x = 0; x < width; ++x)
+						for (int c = 0; c < 3; ++c)
+							dst[3 * x + c] = gain * src[4 * x + c];
+			}
+		});
+		written = fwrite(block.data(), lineSize * sizeof(float), numLines, f) == size_t(numLines);
 	}
 
-	fprintf(f, littleEndian ? "-1.0000000\n" : "1.0000000\n");
-
-	if (numChannels == 3 || numChannels == 1)
+	if (fclose(f) != 0 || !written)
 	{
-		fwrite(&data[0], width * height * sizeof(float) * numChannels, 1, f);
-	}
-	else if (numChannels == 4)
-	{
-		for (int i = 0; i < width * height * 4; i += 4)
-			fwrite(&data[i], sizeof(float) * 3, 1, f);
-	}
-	else
-	{
-		fclose(f);
-		cerr << "writePFMImage: Unsupported number of channels "
-			 << numChannels << " when writing file '" << filename << "'" << endl;
+		cerr << "writePFMImage: Error writing file '" << filename << "'" << endl;
 		return false;
 	}
-
-	fclose(f);
 	return true;
 }
@@ -6,6 +6,30 @@
 
 #pragma once
 
+#include <cstddef>
+
+/// The header of a PFM file, describing where and how the pixel data is stored
+struct PFMHeader
+{
+	int width = 0, height = 0, numChannels = 0;
+	float scale = 1.f;          ///< The (positive) factor to multiply the stored values by
+	bool bigEndian = false;
+	size_t dataOffset = 0;      ///< Offset of the first (bottom-left) pixel from the start of the file
+};
+
 bool isPFMImage(const char *filename) noexcept;
-bool writePFMImage(const char *filename, int width, int height, int numChannels, const float *data);
+/*!
+ * Write the top-down scanlines of data, with numChannels (1, 3 or 4, alpha is dropped) floats per pixel, as a PFM
+ * file. The pixels are multiplied by gain, and converted in parallel into large blocks that are written at once.
+ */
+bool writePFMImage(const char *filename, int width, int height, int numChannels, const float *data, float gain = 1.f);
+/// Load the pixel data of a PFM file, as stored: bottom-up scanlines of 1 or 3 floats per pixel. Free with delete[]
 float * loadPFMImage(const char *filename, int *width, int *height, int *numChannels);
+/// Whether the file contents [data,data+size) start with the magic number of a PFM file
+bool hasPFMSignature(const unsigned char * data, size_t size);
+/// Parse the header of the PFM file contents [data,data+size), e.g. of a memory-mapped file. Throws on errors
+PFMHeader parsePFMHeader(const unsigned char * data, size_t size);
+/// Convert n values from the pixel data src of a PFM file to host-endian, scaled floats
+void decodePFMValues(const PFMHeader & header, const unsigned char * src, size_t n, float * dst);
+/// Convert n RGB pixels from the pixel data src of a PFM file to host-endian, scaled and opaque RGBA floats
+void decodePFMPixels(const PFMHeader & header, const unsigned char * src, size_t n, float * dst);
@@ -0,0 +1,243 @@
+//
+// Copyright (C) Wojciech Jarosz <wjarosz@gmail.com>. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can
+// be found in the LICENSE.txt file.
+//
+
+#include "PNG.h"
+#include "ParallelFor.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <zlib.h>
+
+using namespace std;
+
+namespace
+{
+
+// target amount of raw (filtered) data compressed by each task
+const size_t BAND_BYTES = 1 << 20;
+
+enum Filter : unsigned char
+{
+	FILTER_NONE = 0,
+	FILTER_SUB,
+	FILTER_UP,
+	FILTER_AVERAGE,
+	FILTER_PAETH
+};
+
+inline unsigned char paeth(int a, int b, int c)
+{
+	int p = a + b - c;
+	int pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+	return (unsigned char) (pa <= pb && pa <= pc ? a : pb <= pc ? b : c);
+}
+
+// filter one scanline (row) given the previous one (prev, all zeros for the first), with bpp bytes per pixel
+void filterScanline(Filter filter, const unsigned char * row, const unsigned char * prev,
+                    size_t rowBytes, size_t bpp, unsigned char * out)
+{
+	for (size_t i = 0; i < rowBytes; ++i)
+	{
+		int a = i >= bpp ? row[i - bpp] : 0;
+		int b = prev[i];
+		int c = i >= bpp ? prev[i - bpp] : 0;
+		switch (filter)
+		{
+			case FILTER_NONE:    out[i] = row[i]; break;
+			case FILTER_SUB:     out[i] = (unsigned char) (row[i] - a); break;
+			case FILTER_UP:      out[i] = (unsigned char) (row[i] - b); break;
+			case FILTER_AVERAGE: out[i] = (unsigned char) (row[i] - ((a + b) >> 1)); break;
+			case FILTER_PAETH:   out[i] = (unsigned char) (row[i] - paeth(a, b, c)); break;
+		}
+	}
+}
+
+// the usual heuristic for picking a filter: the smallest sum of the filtered bytes, interpreted as signed values
+size_t filterCost(const unsigned char * filtered, size_t rowBytes)
+{
+	size_t cost = 0;
+	for (size_t i = 0; i < rowBytes; ++i)
+		cost += abs((int) (signed char) filtered[i]);
+	return cost;
+}
+
+// the bytes of scanline y as stored in the file (16-bit samples are big-endian)
+const unsigned char * scanline(const unsigned char * data, int y, size_t rowBytes, int bitDepth,
+                               vector<unsigned char> & buffer)
+{
+	const unsigned char * row = data + y * rowBytes;
+	if (bitDepth == 8)
+		return row;
+
+	buffer.resize(rowBytes);
+	const uint16_t * samples = (const uint16_t *) row;
+	for (size_t i = 0; i < rowBytes / 2; ++i)
+	{
+		buffer[2 * i + 0] = (unsigned char) (samples[i] >> 8);
+		buffer[2 * i + 1] = (unsigned char) (samples[i] & 0xff);
+	}
+	return buffer.data();
+}
+
+struct Band
+{
+	vector<unsigned char> compressed;
+	uLong adler = 1;
+	uLong length = 0;   ///< Uncompressed length, for combining the checksums
+};
+
+// filter and deflate scanlines [y0, y1) into a raw deflate stream, which is only terminated if it is the last band
+void compressBand(const unsigned char * data, int y0, int y1, int height, size_t rowBytes, size_t bpp,
+                  int bitDepth, int level, Band & band)
+{
+	vector<unsigned char> filtered((rowBytes + 1) * (y1 - y0));
+	vector<unsigned char> current, previous, candidate(rowBytes);
+	vector<unsigned char> zeros(rowBytes, 0);
+
+	const unsigned char * prev = y0 > 0 ? scanline(data, y0 - 1, rowBytes, bitDepth, previous) : zeros.data();
+	for (int y = y0; y < y1; ++y)
+	{
+		const unsigned char * row = scanline(data, y, rowBytes, bitDepth, current);
+		unsigned char * out = &filtered[(y - y0) * (rowBytes + 1)];
+
+		if (level == 0)
+			out[0] = FILTER_NONE;
+		else if (level <= 2)
+			out[0] = FILTER_SUB;
+		else
+		{
+			size_t bestCost = SIZE_MAX;
+			for (int f = FILTER_NONE; f <= FILTER_PAETH; ++f)
+			{
+				filterScanline(Filter(f), row, prev, rowBytes, bpp, candidate.data());
+				size_t cost = filterCost(candidate.data(), rowBytes);
+				if (cost < bestCost)
+				{
+					bestCost = cost;
+					out[0] = (unsigned char) f;
+				}
+			}
+		}
+		filterScanline(Filter(out[0]), row, prev, rowBytes, bpp, out + 1);
+
+		// the converted 16-bit scanline becomes the previous one
+		swap(current, previous);
+		prev = bitDepth == 8 ? row : previous.data();
+	}
+
+	band.length = uLong(filtered.size());
+	band.adler = adler32(1, filtered.data(), uInt(filtered.size()));
+
+	z_stream stream = {};
+	if (deflateInit2(&stream, level, Z_DEFLATED, -15, 8, level <= 2 ? Z_DEFAULT_STRATEGY : Z_FILTERED) != Z_OK)
+		throw runtime_error("cannot initialize zlib.");
+
+	// leave room for the empty block of the sync flush
+	band.compressed.resize(deflateBound(&stream, uLong(filtered.size())) + 16);
+	stream.next_in = filtered.data();
+	stream.avail_in = uInt(filtered.size());
+	stream.next_out = band.compressed.data();
+	stream.avail_out = uInt(band.compressed.size());
+	int ret = deflate(&stream, y1 == height ? Z_FINISH : Z_SYNC_FLUSH);
+	band.compressed.resize(band.compressed.size() - stream.avail_out);
+	deflateEnd(&stream);
+	if (ret != (y1 == height ? Z_STREAM_END : Z_OK) || stream.avail_in != 0)
+		throw runtime_error("cannot compress pixel data.");
+}
+
+void writeUInt32(FILE * f, uint32_t v)
+{
+	unsigned char bytes[4] = {(unsigned char) (v >> 24), (unsigned char) (v >> 16),
+	                          (unsigned char) (v >> 8), (unsigned char) v};
+	if (fwrite(bytes, 1, 4, f) != 4)
+		throw runtime_error("cannot write to file.");
+}
+
+void writeChunk(FILE * f, const char * type, const unsigned char * data, size_t length)
+{
+	writeUInt32(f, uint32_t(length));
+	uLong crc = crc32(0, (const Bytef *) type, 4);
+	if (length)
+		crc = crc32(crc, data, uInt(length));
+	if (fwrite(type, 1, 4, f) != 4 || (length && fwrite(data, 1, length, f) != length))
+		throw runtime_error("cannot write to file.");
+	writeUInt32(f, uint32_t(crc));
+}
+
+} // end namespace
+
+
+bool writePNGImage(const char *filename, int width, int height, int numChannels, int bitDepth,
+                   const void *data, int level)
+{
+	FILE *f = nullptr;
+
+	try
+	{
+		if (numChannels < 1 || numChannels > 4 || (bitDepth != 8 && bitDepth != 16))
+			throw runtime_error("unsupported pixel format.");
+		level = std::max(0, std::min(9, level));
+
+		size_t bpp = size_t(numChannels) * bitDepth / 8;
+		size_t rowBytes = bpp * width;
+		int bandLines = int(std::max(size_t(1), BAND_BYTES / (rowBytes + 1)));
+		vector<Band> bands((height + bandLines - 1) / bandLines);
+
+		parallel_for(0, int(bands.size()), [&](int i)
+		{
+			int y0 = i * bandLines, y1 = std::min(height, y0 + bandLines);
+			compressBand((const unsigned char *) data, y0, y1, height, rowBytes, bpp, bitDepth, level, bands[i]);
+		});
+
+		f = fopen(filename, "wb");
+		if (!f)
+			throw runtime_error("cannot open file.");
+
+		static const unsigned char signature[8] = {137, 'P', 'N', 'G', '\r', '\n', 26, '\n'};
+		if (fwrite(signature, 1, 8, f) != 8)
+			throw runtime_error("cannot write to file.");
+
+		static const unsigned char colorTypes[4] = {0, 4, 2, 6};
+		unsigned char header[13] = {(unsigned char) (width >> 24), (unsigned char) (width >> 16),
+		                            (unsigned char) (width >> 8), (unsigned char) width,
+		                            (unsigned char) (height >> 24), (unsigned char) (height >> 16),
+		                            (unsigned char) (height >> 8), (unsigned char) height,
+		                            (unsigned char) bitDepth, colorTypes[numChannels - 1], 0, 0, 0};
+		writeChunk(f, "IHDR", header, sizeof(header));
+
+		// a zlib header matching the compression level, the bands (one per IDAT chunk), and the combined checksum
+		static const unsigned char zlibHeaders[10] = {0x01, 0x01, 0x5e, 0x5e, 0x5e, 0x5e, 0x9c, 0xda, 0xda, 0xda};
+		unsigned char zlibHeader[2] = {0x78, zlibHeaders[level]};
+		writeChunk(f, "IDAT", zlibHeader, 2);
+
+		uLong adler = 1;
+		for (auto & band : bands)
+		{
+			writeChunk(f, "IDAT", band.compressed.data(), band.compressed.size());
+			adler = adler32_combine(adler, band.adler, band.length);
+		}
+		unsigned char checksum[4] = {(unsigned char) (adler >> 24), (unsigned char) (adler >> 16),
+		                             (unsigned char) (adler >> 8), (unsigned char) adler};
+		writeChunk(f, "IDAT", checksum, 4);
+		writeChunk(f, "IEND", nullptr, 0);
+
+		fclose(f);
+		return true;
+	}
+	catch (const std::exception &e)
+	{
+		if (f)
+			fclose(f);
+		throw std::runtime_error(string("ERROR in writePNGImage: ") +
+		                         string(e.what()) +
+		                         string(" Unable to write PNG file '") +
+		                         string(filename) + "'");
+	}
+}
@@ -0,0 +1,25 @@
+//
+// Copyright (C) Wojciech Jarosz <wjarosz@gmail.com>. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can
+// be found in the LICENSE.txt file.
+//
+
+#pragma once
+
+/*!
+ * Write an 8- or 16-bit PNG file, filtering and compressing bands of scanlines in parallel.
+ *
+ * Each band is deflated independently and flushed to a byte boundary, and the bands are joined into a single
+ * zlib stream, so any PNG decoder can read the result. The price is a slightly larger file, since matches
+ * cannot reach back across band boundaries.
+ *
+ * @param numChannels   1 (gray), 2 (gray+alpha), 3 (RGB) or 4 (RGBA)
+ * @param bitDepth      8 or 16
+ * @param data          Interleaved samples: unsigned chars for 8-bit and unsigned shorts (in host byte order)
+ *                      for 16-bit images
+ * @param level         zlib compression level from 0 (none, fastest) to 9 (smallest). Levels up to 2 also use a
+ *                      fixed scanline filter instead of trying all of them on every scanline.
+ * @return              True on success, otherwise throws a runtime_error
+ */
+bool writePNGImage(const char *filename, int width, int height, int numChannels, int bitDepth,
+                   const void *data, int level = 6);
@@ -5,41 +5,275 @@
 //
 
 #include "ParallelFor.h"
-#include <future>
-#include <vector>
+#include "Trace.h"
+#include <algorithm>
+#include <exception>
+#include <string>
 
 using namespace std;
 
-// adapted from http://www.andythomason.com/2016/08/21/c-multithreading-an-effective-parallel-for-loop/
-// license unknown, presumed public domain
-void parallel_for(int begin, int end, int step, function<void(int, size_t)> body, bool serial)
+namespace
+{
+
+// index of the current thread within the pool, -1 for threads that do not belong to the pool
+thread_local int t_workerIndex = -1;
+atomic<size_t> s_maxConcurrency(0);
+
+// shared state of one parallel_for call. This is kept alive by any of the helper tasks that may
+// still be sitting in the pool's queues after the loop itself has finished.
+struct LoopState
 {
+	LoopState(int begin, int e, int s, size_t numIndices, const function<void(int, size_t)> * b) :
+		nextIndex(begin), end(e), step(s), remaining(numIndices), body(b), failed(false)
+	{
+		// empty
+	}
+
 	atomic<int> nextIndex;
-	nextIndex = begin;
-
-	auto policy = serial ? std::launch::deferred : std::launch::async;
-	size_t numCPUs = thread::hardware_concurrency();
-	vector< future<void> > futures(numCPUs);
-	for (size_t cpu = 0; cpu != numCPUs; ++cpu)
-	{
-		futures[cpu] = async(
-			policy,
-			[cpu, &nextIndex, end, step, &body]()
-			{
-				// just iterate, grabbing the next available atomic index in the range [begin, end)
-				while (true)
-				{
-					int i = nextIndex.fetch_add(step);
-					if (i >= end) break;
-					body(i, cpu);
-				}
-			});
-	}
-	for (auto & f : futures)
-		f.get();
+	const int end, step;
+	atomic<size_t> remaining;                   ///< Number of iterations that have not completed yet
+	const function<void(int, size_t)> * body;   ///< Only dereferenced while there are still iterations left
+
+	atomic<bool> failed;                        ///< Once an iteration threw, skip the remaining ones
+
+	mutex mtx;
+	condition_variable done;
+	exception_ptr error;
+};
+
+// just iterate, grabbing the next available atomic index in the range [begin, end)
+void runIterations(LoopState & state)
+{
+	TRACE_ZONE("parallel_for");
+	size_t thread = ThreadPool::threadIndex();
+	while (true)
+	{
+		int i = state.nextIndex.fetch_add(state.step);
+		if (i >= state.end)
+			break;
+
+		try
+		{
+			if (!state.failed)
+				(*state.body)(i, thread);
+		}
+		catch (...)
+		{
+			lock_guard<mutex> lock(state.mtx);
+			if (!state.error)
+				state.error = current_exception();
+			state.failed = true;
+		}
+
+		if (--state.remaining == 0)
+		{
+			lock_guard<mutex> lock(state.mtx);
+			state.done.notify_all();
+		}
+	}
+}
+
+} // namespace
+
+
+ThreadPool & ThreadPool::instance()
+{
+	static ThreadPool pool(max(1u, thread::hardware_concurrency()));
+	return pool;
+}
+
+ThreadPool::ThreadPool(size_t numThreads) :
+	m_numPending(0), m_nextQueue(0)
+{
+	for (size_t i = 0; i < numThreads; ++i)
+		m_queues.emplace_back(new Queue);
+
+	for (size_t i = 0; i < numThreads; ++i)
+		m_threads.emplace_back(&ThreadPool::workerLoop, this, i);
+}
+
+ThreadPool::~ThreadPool()
+{
+	{
+		lock_guard<mutex> lock(m_mutex);
+		m_stop = true;
+	}
+	m_wakeUp.notify_all();
+
+	for (auto & t : m_threads)
+		t.join();
+}
+
+size_t ThreadPool::maxConcurrency()
+{
+	return s_maxConcurrency;
+}
+
+void ThreadPool::setMaxConcurrency(size_t n)
+{
+	s_maxConcurrency = n;
+}
+
+size_t ThreadPool::threadIndex()
+{
+	return t_workerIndex >= 0 ? size_t(t_workerIndex) : instance().numThreads();
+}
+
+bool ThreadPool::isWorkerThread()
+{
+	return t_workerIndex >= 0;
+}
+
+void ThreadPool::enqueue(Task task)
+{
+	size_t index = isWorkerThread() ? size_t(t_workerIndex) : m_nextQueue++ % m_queues.size();
+	{
+		lock_guard<mutex> lock(m_queues[index]->mutex);
+		m_queues[index]->tasks.push_back(move(task));
+	}
+	++m_numPending;
+	TRACE_COUNTER("pending pool tasks", m_numPending.load());
+
+	// acquire the lock so that the notification cannot slip in between a worker
+	// checking for pending work and going to sleep
+	{
+		lock_guard<mutex> lock(m_mutex);
+	}
+	m_wakeUp.notify_one();
+}
+
+bool ThreadPool::pop(size_t index, Task & task)
+{
+	// newest task from our own queue first, since its data is most likely still in cache
+	{
+		Queue & q = *m_queues[index];
+		lock_guard<mutex> lock(q.mutex);
+		if (!q.tasks.empty())
+		{
+			task = move(q.tasks.back());
+			q.tasks.pop_back();
+			--m_numPending;
+			return true;
+		}
+	}
+
+	// otherwise, steal the oldest task from one of the other queues
+	for (size_t i = 1; i < m_queues.size(); ++i)
+	{
+		Queue & q = *m_queues[(index + i) % m_queues.size()];
+		lock_guard<mutex> lock(q.mutex);
+		if (!q.tasks.empty())
+		{
+			task = move(q.tasks.front());
+			q.tasks.pop_front();
+			--m_numPending;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+void ThreadPool::workerLoop(size_t index)
+{
+	t_workerIndex = int(index);
+	TRACE_THREAD_NAME("pool worker " + to_string(index));
+
+	Task task;
+	while (true)
+	{
+		if (pop(index, task))
+		{
+			task();
+			task = nullptr;
+			continue;
+		}
+
+		unique_lock<mutex> lock(m_mutex);
+		m_wakeUp.wait(lock, [this]{return m_stop || m_numPending > 0;});
+		if (m_stop && m_numPending == 0)
+			return;
+	}
+}
+
+
+void parallel_for(int begin, int end, int step, function<void(int, size_t)> body, bool serial)
+{
+	if (begin >= end)
+		return;
+
+	ThreadPool & pool = ThreadPool::instance();
+	size_t numIndices = (size_t(end - begin) + step - 1) / step;
+
+	size_t maxHelpers = pool.numThreads();
+	if (size_t limit = ThreadPool::maxConcurrency())
+		maxHelpers = min(maxHelpers, limit - 1);
+
+	if (serial || numIndices == 1 || maxHelpers == 0)
+	{
+		size_t thread = ThreadPool::threadIndex();
+		for (int i = begin; i < end; i += step)
+			body(i, thread);
+		return;
+	}
+
+	auto state = make_shared<LoopState>(begin, end, step, numIndices, &body);
+
+	// the calling thread works on the loop too, so we need at most one helper per remaining index
+	size_t numHelpers = min(maxHelpers, numIndices - 1);
+	for (size_t i = 0; i < numHelpers; ++i)
+		pool.enqueue([state]{runIterations(*state);});
+
+	runIterations(*state);
+
+	// helpers that start after all indices have been claimed return immediately, so we only need
+	// to wait for the iterations that are still in flight on other threads
+	{
+		unique_lock<mutex> lock(state->mtx);
+		state->done.wait(lock, [&state]{return state->remaining == 0;});
+	}
+
+	if (state->error)
+		rethrow_exception(state->error);
 }
 
 void parallel_for(int begin, int end, int step, function<void(int)> body, bool serial)
 {
 	parallel_for(begin, end, step, [&body](int i, size_t){body(i);}, serial);
-}
\ No newline at end of file
+}
+
+void parallel_for(const BlockedRange & range, function<void(int, int)> body, bool serial)
+{
+	if (range.begin >= range.end)
+		return;
+
+	int n = range.end - range.begin;
+	int grain = range.grainSize;
+	if (grain <= 0)
+	{
+		// aim for a few chunks per thread to balance the load without paying for many tiny tasks
+		size_t numThreads = ThreadPool::instance().numThreads();
+		if (size_t limit = ThreadPool::maxConcurrency())
+			numThreads = min(numThreads, limit);
+		int numChunks = int(4 * numThreads);
+		grain = max(1, (n + numChunks - 1) / numChunks);
+	}
+
+	int numChunks = (n + grain - 1) / grain;
+	parallel_for(0, numChunks, 1, [&range,&body,grain](int c, size_t)
+	{
+		int b = range.begin + c * grain;
+		body(b, min(range.end, b + grain));
+	}, serial);
+}
+
+void parallel_for(const BlockedRange2D & range, function<void(int, int, int, int)> body, bool serial)
+{
+	int numTilesX = range.numTilesX();
+	parallel_for(0, range.numTiles(), 1, [&range,&body,numTilesX](int t, size_t)
+	{
+		int x0 = range.x0 + (t % numTilesX) * range.tileW;
+		int y0 = range.y0 + (t / numTilesX) * range.tileH;
+		body(x0, y0, min(range.x1, x0 + range.tileW), min(range.y1, y0 + range.tileH));
+	}, serial);
+}
@@ -6,14 +6,120 @@
 
 #pragma once
 
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
 #include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/*!
+ * @brief A process-wide pool of persistent worker threads with work stealing.
+ *
+ * Each worker owns a task queue. Tasks enqueued from a worker go to the back of its own queue
+ * and are popped in LIFO order, while idle workers steal from the front of the other queues.
+ * Tasks enqueued from outside the pool are distributed round-robin.
+ *
+ * The pool is shared by parallel_for, AsyncTask and the OpenEXR global thread count,
+ * so that nested parallelism (e.g. a parallel_for inside an asynchronous image load)
+ * never creates more threads than there are CPUs.
+ */
+class ThreadPool
+{
+public:
+	using Task = std::function<void()>;
+
+	/// The single, lazily constructed, process-wide pool
+	static ThreadPool & instance();
+
+	/// Number of worker threads in the pool
+	size_t numThreads() const                   {return m_threads.size();}
+
+	/// Index of the calling thread within the pool, or numThreads() if called from a non-pool thread
+	static size_t threadIndex();
+
+	/// Whether the calling thread is one of the pool's workers
+	static bool isWorkerThread();
+
+	/*!
+	 * Upper bound on the number of threads (including the calling one) that each parallel_for runs on, or 0 for
+	 * all of them. The pool itself keeps its size, so this is mostly useful to measure the scaling of a loop.
+	 */
+	static size_t maxConcurrency();
+	static void setMaxConcurrency(size_t n);
+
+	/// Add a task to the pool. The task must not throw.
+	void enqueue(Task task);
+
+	~ThreadPool();
+
+private:
+	explicit ThreadPool(size_t numThreads);
+	ThreadPool(const ThreadPool &) = delete;
+	ThreadPool & operator=(const ThreadPool &) = delete;
+
+	struct Queue
+	{
+		std::mutex mutex;
+		std::deque<Task> tasks;
+	};
+
+	bool pop(size_t index, Task & task);
+	void workerLoop(size_t index);
+
+	std::vector<std::thread> m_threads;
+	std::vector<std::unique_ptr<Queue>> m_queues;
+
+	std::mutex m_mutex;                         ///< Guards sleeping/waking of idle workers
+	std::condition_variable m_wakeUp;
+	std::atomic<size_t> m_numPending;           ///< Number of tasks waiting in all the queues
+	std::atomic<size_t> m_nextQueue;            ///< Round-robin counter for tasks from non-pool threads
+	bool m_stop = false;
+};
+
+/*!
+ * @brief A 1D range [begin,end) to be split into chunks of at most grainSize indices by parallel_for
+ *
+ * A grain size <= 0 picks a chunk size automatically, so that there are a few chunks per thread in the pool.
+ */
+struct BlockedRange
+{
+	BlockedRange(int b, int e, int grain = 0) : begin(b), end(e), grainSize(grain) {}
+
+	int begin, end, grainSize;
+};
+
+/*!
+ * @brief A 2D range [x0,x1) x [y0,y1) to be split into tiles of at most tileW x tileH by parallel_for
+ *
+ * Tiles are traversed with x varying fastest, matching the column-major (x-contiguous) layout of HDRImage.
+ */
+struct BlockedRange2D
+{
+	BlockedRange2D(int x0_, int y0_, int x1_, int y1_, int tileW_ = 64, int tileH_ = 64) :
+		x0(x0_), y0(y0_), x1(x1_), y1(y1_), tileW(std::max(1, tileW_)), tileH(std::max(1, tileH_)) {}
+
+	int numTilesX() const   {return x1 > x0 ? (x1 - x0 + tileW - 1) / tileW : 0;}
+	int numTilesY() const   {return y1 > y0 ? (y1 - y0 + tileH - 1) / tileH : 0;}
+	int numTiles() const    {return numTilesX() * numTilesY();}
+
+	int x0, y0, x1, y1, tileW, tileH;
+};
 
 /*!
  * @brief 			Executes the body of a for loop in parallel
+ *
+ * The iterations are distributed over the threads of the ThreadPool. The calling thread participates in
+ * executing the loop, so nested calls from within a pool task never block waiting on an idle worker.
+ *
  * @param begin		The starting index of the for loop
  * @param end 		One past the ending index of the for loop
  * @param step 		How much to increment at each iteration when moving from begin to end
- * @param body 		The body of the for loop as a lambda, taking two parameters: the iterator index in [begin,end), and the CPU number
+ * @param body 		The body of the for loop as a lambda, taking two parameters: the iterator index in [begin,end), and
+ * 					the thread number in [0,ThreadPool::numThreads()]
  * @param serial 	Force the loop to execute in serial instead of parallel
  */
 void parallel_for(int begin, int end, int step, std::function<void(int, size_t)> body, bool serial = false);
@@ -23,16 +129,38 @@ void parallel_for(int begin, int end, int step, std::function<void(int, size_t)>
  */
 void parallel_for(int begin, int end, int step, std::function<void(int)> body, bool serial = false);
 
+/*!
+ * @brief 			Executes the body of a for loop in parallel, handing it whole chunks of the range at a time
+ *
+ * Compared to the per-index version, this pays the scheduling cost (an atomic increment and a call through
+ * std::function) only once per chunk, and lets the body keep its scratch data and inner loops tight.
+ *
+ * @param range 	The range to iterate over
+ * @param body 		The body of the loop as a lambda, taking the sub-range [begin,end) to process
+ * @param serial 	Force the loop to execute in serial instead of parallel
+ */
+void parallel_for(const BlockedRange & range, std::function<void(int begin, int end)> body, bool serial = false);
+
+/*!
+ * @brief 			Executes the body of a 2D loop in parallel over tiles
+ *
+ * @param range 	The 2D range to iterate over
+ * @param body 		The body of the loop as a lambda, taking the tile [x0,x1) x [y0,y1) to process
+ * @param serial 	Force the loop to execute in serial instead of parallel
+ */
+void parallel_for(const BlockedRange2D & range, std::function<void(int x0, int y0, int x1, int y1)> body,
+                  bool serial = false);
+
 
 
 // adapted from http://www.andythomason.com/2016/08/21/c-multithreading-an-effective-parallel-for-loop/
 // license unknown, presumed public domain
 inline void parallel_for(int begin, int end, std::function<void(int, size_t)> body, bool serial = false)
 {
-	parallel_for(begin, end, 1, body);
+	parallel_for(begin, end, 1, body, serial);
 }
 
 inline void parallel_for(int begin, int end, std::function<void(int)> body, bool serial = false)
 {
 	parallel_for(begin, end, 1, body, serial);
-}
\ No newline at end of file
+}
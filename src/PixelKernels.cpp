@@ -0,0 +1,268 @@
+//
+// Copyright (C) Wojciech Jarosz <wjarosz@gmail.com>. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can
+// be found in the LICENSE.txt file.
+//
+
+#include "PixelKernels.h"
+#include <cfloat>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#define HDRVIEW_X86_KERNELS
+#include <immintrin.h>
+#if defined(_MSC_VER) && !defined(__clang__)
+#include <intrin.h>
+// MSVC lets us use AVX2 intrinsics in any function
+#define AVX2_FUNCTION
+#else
+// GCC and Clang only compile AVX2 intrinsics in functions that are explicitly marked for it
+#define AVX2_FUNCTION __attribute__((target("avx2")))
+#endif
+#endif
+
+using namespace Eigen;
+
+// local functions
+namespace
+{
+
+struct Kernels
+{
+    const char * isa;
+    void (*scaleOffset)(Color4 *, const Color4 *, size_t, const Color4 &, const Color4 &);
+    void (*meanVariance)(Color4 *, Color4 *, const Color4 *, size_t, float);
+    void (*pow)(float *, const float *, size_t, float);
+};
+
+// coefficients of 2/ln(2) * atanh(t), i.e. log2((1+t)/(1-t)), in powers of t^2
+const float LOG2_C0 = 2.88539008f, LOG2_C1 = 0.961796694f, LOG2_C2 = 0.577078016f,
+            LOG2_C3 = 0.412198583f, LOG2_C4 = 0.320598898f;
+// coefficients of the Taylor series of 2^f = exp(f ln(2))
+const float EXP2_C1 = 0.693147181f, EXP2_C2 = 0.240226507f, EXP2_C3 = 0.0555041087f,
+            EXP2_C4 = 0.00961812911f, EXP2_C5 = 0.00133335581f, EXP2_C6 = 0.000154035304f;
+
+void scaleOffsetGeneric(Color4 * dst, const Color4 * src, size_t n, const Color4 & scale, const Color4 & offset)
+{
+    for (size_t i = 0; i < n; ++i)
+        dst[i].array() = src[i].array() * scale.array() + offset.array();
+}
+
+void meanVarianceGeneric(Color4 * mean, Color4 * m2, const Color4 * x, size_t n, float invCount)
+{
+    for (size_t i = 0; i < n; ++i)
+    {
+        Array4f delta = x[i].array() - mean[i].array();
+        mean[i].array() += delta * invCount;
+        m2[i].array() += delta * (x[i].array() - mean[i].array());
+    }
+}
+
+// log2 of a positive, normalized float
+inline float log2Approx(float x)
+{
+    uint32_t bits;
+    memcpy(&bits, &x, sizeof(float));
+    int e = int(bits >> 23) - 127;
+
+    // split off the exponent, keeping the mantissa m in [sqrt(1/2), sqrt(2)) so that t below is small
+    bits = (bits & 0x007fffff) | 0x3f800000;
+    float m;
+    memcpy(&m, &bits, sizeof(float));
+    if (m > 1.41421356f)
+    {
+        m *= 0.5f;
+        ++e;
+    }
+
+    float t = (m - 1.f) / (m + 1.f), t2 = t * t;
+    return float(e) + t * (LOG2_C0 + t2 * (LOG2_C1 + t2 * (LOG2_C2 + t2 * (LOG2_C3 + t2 * LOG2_C4))));
+}
+
+inline float exp2Approx(float y)
+{
+    if (y < -126.f)
+        return 0.f;
+    // overflows, like pow
+    if (y >= 128.f)
+        return std::numeric_limits<float>::infinity();
+
+    // 2^y = 2^i * 2^f, with f in [-1/2, 1/2]
+    float i = std::floor(y + 0.5f), f = y - i;
+    float p = 1.f + f * (EXP2_C1 + f * (EXP2_C2 + f * (EXP2_C3 + f * (EXP2_C4 + f * (EXP2_C5 + f * EXP2_C6)))));
+    // 2^128 is not a float, so scale by 2^127 twice there
+    float top = std::min(i, 127.f);
+    uint32_t bits = uint32_t(int(top) + 127) << 23;
+    float scale;
+    memcpy(&scale, &bits, sizeof(float));
+    return p * scale * (i - top + 1.f);
+}
+
+void powGeneric(float * dst, const float * src, size_t n, float exponent)
+{
+    for (size_t i = 0; i < n; ++i)
+    {
+        float x = src[i];
+        if (!std::isfinite(x))
+            dst[i] = x;
+        else
+            dst[i] = x >= FLT_MIN ? exp2Approx(exponent * log2Approx(x)) : 0.f;
+    }
+}
+
+#ifdef HDRVIEW_X86_KERNELS
+
+AVX2_FUNCTION
+void scaleOffsetAVX2(Color4 * dst, const Color4 * src, size_t n, const Color4 & scale, const Color4 & offset)
+{
+    // two pixels per register
+    const __m256 s = _mm256_setr_ps(scale.r, scale.g, scale.b, scale.a, scale.r, scale.g, scale.b, scale.a);
+    const __m256 o = _mm256_setr_ps(offset.r, offset.g, offset.b, offset.a, offset.r, offset.g, offset.b, offset.a);
+    const float * in = &src->r;
+    float * out = &dst->r;
+    size_t i = 0;
+    for (; i + 2 <= n; i += 2)
+        // multiply and add separately (no FMA) to match the generic kernel exactly
+        _mm256_storeu_ps(out + 4 * i, _mm256_add_ps(_mm256_mul_ps(_mm256_loadu_ps(in + 4 * i), s), o));
+    if (i < n)
+        scaleOffsetGeneric(dst + i, src + i, n - i, scale, offset);
+}
+
+AVX2_FUNCTION
+void meanVarianceAVX2(Color4 * mean, Color4 * m2, const Color4 * x, size_t n, float invCount)
+{
+    const __m256 inv = _mm256_set1_ps(invCount);
+    float * mu = &mean->r;
+    float * var = &m2->r;
+    const float * in = &x->r;
+    size_t i = 0;
+    for (; i + 2 <= n; i += 2)
+    {
+        __m256 v = _mm256_loadu_ps(in + 4 * i);
+        __m256 m = _mm256_loadu_ps(mu + 4 * i);
+        __m256 delta = _mm256_sub_ps(v, m);
+        m = _mm256_add_ps(m, _mm256_mul_ps(delta, inv));
+        _mm256_storeu_ps(mu + 4 * i, m);
+        __m256 s = _mm256_loadu_ps(var + 4 * i);
+        _mm256_storeu_ps(var + 4 * i, _mm256_add_ps(s, _mm256_mul_ps(delta, _mm256_sub_ps(v, m))));
+    }
+    if (i < n)
+        meanVarianceGeneric(mean + i, m2 + i, x + i, n - i, invCount);
+}
+
+AVX2_FUNCTION
+void powAVX2(float * dst, const float * src, size_t n, float exponent)
+{
+    const __m256 one = _mm256_set1_ps(1.f), half = _mm256_set1_ps(0.5f), p = _mm256_set1_ps(exponent);
+    const __m256 inf = _mm256_set1_ps(std::numeric_limits<float>::infinity());
+    const __m256i mantissaMask = _mm256_set1_epi32(0x007fffff), oneBits = _mm256_set1_epi32(0x3f800000);
+    const __m256i bias = _mm256_set1_epi32(127);
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8)
+    {
+        __m256 x = _mm256_loadu_ps(src + i);
+        __m256 valid = _mm256_cmp_ps(x, _mm256_set1_ps(FLT_MIN), _CMP_GE_OQ);
+        // also false for NaNs
+        __m256 finite = _mm256_cmp_ps(_mm256_andnot_ps(_mm256_set1_ps(-0.f), x), inf, _CMP_LT_OQ);
+
+        // log2(x), as in log2Approx
+        __m256i bits = _mm256_castps_si256(x);
+        __m256 e = _mm256_cvtepi32_ps(_mm256_sub_epi32(_mm256_srli_epi32(bits, 23), bias));
+        __m256 m = _mm256_castsi256_ps(_mm256_or_si256(_mm256_and_si256(bits, mantissaMask), oneBits));
+        __m256 big = _mm256_cmp_ps(m, _mm256_set1_ps(1.41421356f), _CMP_GT_OQ);
+        m = _mm256_blendv_ps(m, _mm256_mul_ps(m, half), big);
+        e = _mm256_add_ps(e, _mm256_and_ps(big, one));
+        __m256 t = _mm256_div_ps(_mm256_sub_ps(m, one), _mm256_add_ps(m, one));
+        __m256 t2 = _mm256_mul_ps(t, t);
+        __m256 poly = _mm256_add_ps(_mm256_set1_ps(LOG2_C3), _mm256_mul_ps(t2, _mm256_set1_ps(LOG2_C4)));
+        poly = _mm256_add_ps(_mm256_set1_ps(LOG2_C2), _mm256_mul_ps(t2, poly));
+        poly = _mm256_add_ps(_mm256_set1_ps(LOG2_C1), _mm256_mul_ps(t2, poly));
+        poly = _mm256_add_ps(_mm256_set1_ps(LOG2_C0), _mm256_mul_ps(t2, poly));
+        __m256 y = _mm256_mul_ps(p, _mm256_add_ps(e, _mm256_mul_ps(t, poly)));
+
+        // exp2(y), as in exp2Approx
+        valid = _mm256_and_ps(valid, _mm256_cmp_ps(y, _mm256_set1_ps(-126.f), _CMP_GE_OQ));
+        __m256 overflow = _mm256_cmp_ps(y, _mm256_set1_ps(128.f), _CMP_GE_OQ);
+        y = _mm256_min_ps(y, _mm256_set1_ps(128.f));
+        __m256 r = _mm256_floor_ps(_mm256_add_ps(y, half));
+        __m256 f = _mm256_sub_ps(y, r);
+        __m256 top = _mm256_min_ps(r, _mm256_set1_ps(127.f));
+        poly = _mm256_add_ps(_mm256_set1_ps(EXP2_C5), _mm256_mul_ps(f, _mm256_set1_ps(EXP2_C6)));
+        poly = _mm256_add_ps(_mm256_set1_ps(EXP2_C4), _mm256_mul_ps(f, poly));
+        poly = _mm256_add_ps(_mm256_set1_ps(EXP2_C3), _mm256_mul_ps(f, poly));
+        poly = _mm256_add_ps(_mm256_set1_ps(EXP2_C2), _mm256_mul_ps(f, poly));
+        poly = _mm256_add_ps(_mm256_set1_ps(EXP2_C1), _mm256_mul_ps(f, poly));
+        poly = _mm256_add_ps(one, _mm256_mul_ps(f, poly));
+        __m256 scale = _mm256_castsi256_ps(_mm256_slli_epi32(_mm256_add_epi32(_mm256_cvtps_epi32(top), bias), 23));
+
+        __m256 result = _mm256_mul_ps(_mm256_mul_ps(poly, scale), _mm256_add_ps(_mm256_sub_ps(r, top), one));
+        result = _mm256_blendv_ps(result, inf, overflow);
+        _mm256_storeu_ps(dst + i, _mm256_blendv_ps(x, _mm256_and_ps(valid, result), finite));
+    }
+    if (i < n)
+        powGeneric(dst + i, src + i, n - i, exponent);
+}
+
+bool cpuSupportsAVX2()
+{
+#if defined(_MSC_VER) && !defined(__clang__)
+    int info[4];
+    __cpuid(info, 0);
+    if (info[0] < 7)
+        return false;
+
+    // the CPU needs to support AVX, and the OS needs to save the YMM registers on context switches
+    __cpuid(info, 1);
+    bool osxsave = (info[2] & (1 << 27)) != 0;
+    bool avx = (info[2] & (1 << 28)) != 0;
+    if (!osxsave || !avx || (_xgetbv(0) & 6) != 6)
+        return false;
+
+    __cpuidex(info, 7, 0);
+    return (info[1] & (1 << 5)) != 0;
+#else
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2") != 0;
+#endif
+}
+
+#endif // HDRVIEW_X86_KERNELS
+
+const Kernels & kernels()
+{
+    static const Kernels k = []
+    {
+#ifdef HDRVIEW_X86_KERNELS
+        if (cpuSupportsAVX2())
+            return Kernels{"AVX2", scaleOffsetAVX2, meanVarianceAVX2, powAVX2};
+#endif
+        return Kernels{SimdInstructionSetsInUse(), scaleOffsetGeneric, meanVarianceGeneric, powGeneric};
+    }();
+    return k;
+}
+
+} // namespace
+
+
+const char * pixelKernelsISA()
+{
+    return kernels().isa;
+}
+
+void scaleOffsetPixels(Color4 * dst, const Color4 * src, size_t n, const Color4 & scale, const Color4 & offset)
+{
+    kernels().scaleOffset(dst, src, n, scale, offset);
+}
+
+void accumulateMeanVariance(Color4 * mean, Color4 * m2, const Color4 * x, size_t n, float invCount)
+{
+    kernels().meanVariance(mean, m2, x, n, invCount);
+}
+
+void powValues(float * dst, const float * src, size_t n, float exponent)
+{
+    kernels().pow(dst, src, n, exponent);
+}
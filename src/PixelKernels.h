@@ -0,0 +1,45 @@
+//
+// Copyright (C) Wojciech Jarosz <wjarosz@gmail.com>. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can
+// be found in the LICENSE.txt file.
+//
+
+#pragma once
+
+#include <cstddef>
+#include "Color.h"
+
+/*!
+ * Vectorized loops over contiguous arrays of Color4 pixels (or floats) for the simple per-pixel operations that
+ * dominate exposure changes, inversion, saving, color transfer functions and the statistics in hdrbatch.
+ *
+ * Every kernel has a portable implementation, which Eigen vectorizes for the instruction set the build targets
+ * (SSE2 on x86, NEON on ARM), and on x86 also an AVX2 implementation that processes two pixels per instruction.
+ * The implementation is picked once, at runtime, based on the CPU, so the same binary runs everywhere. Both
+ * evaluate the same operations in the same order.
+ *
+ * The destination may be the same array as a source, but the arrays must not overlap otherwise.
+ */
+
+/// Name of the instruction set the pixel kernels use on this CPU (for logging)
+const char * pixelKernelsISA();
+
+/// dst[i] = src[i] * scale + offset, for the n pixels starting at src
+void scaleOffsetPixels(Color4 * dst, const Color4 * src, size_t n, const Color4 & scale, const Color4 & offset);
+
+/*!
+ * One step of Welford's running mean and variance over n pixels.
+ *
+ * With delta = x - mean, updates mean += delta * invCount, followed by m2 += delta * (x - mean),
+ * where invCount is one over the number of samples accumulated so far (including x).
+ */
+void accumulateMeanVariance(Color4 * mean, Color4 * m2, const Color4 * x, size_t n, float invCount);
+
+/*!
+ * dst[i] = pow(src[i], exponent) for the n floats starting at src, with negative and zero inputs mapped to 0.
+ * Non-finite inputs (infinities and NaNs) are passed through unchanged.
+ *
+ * Uses polynomial approximations of log2 and exp2 instead of calling pow, with a maximum relative error of about
+ * 2e-7 * (1 + |exponent * log2(src[i])|), i.e. a few ulps for the usual gamma exponents.
+ */
+void powValues(float * dst, const float * src, size_t n, float exponent);
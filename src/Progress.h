@@ -9,6 +9,7 @@
 #include <cstdint>
 #include <cmath>
 #include <memory>
+#include <stdexcept>
 
 /*!
  * A fixed-point fractional number stored using an std::atomic
@@ -107,6 +108,16 @@ using AtomicFixed16 = AtomicFixed<std::int16_t, std::int32_t, 8>;
 using AtomicFixed32 = AtomicFixed<std::int32_t, std::int64_t, 16>;
 
 
+/*!
+ * Thrown from within a long-running operation once its AtomicProgress has been canceled.
+ */
+class CanceledError : public std::runtime_error
+{
+public:
+	CanceledError() : std::runtime_error("Operation was canceled") {}
+};
+
+
 /*!
  * Helper object to manage the progress display.
  * 	{
@@ -118,6 +129,9 @@ using AtomicFixed32 = AtomicFixed<std::int32_t, std::int64_t, 16>;
  *   	}
  * 	} // end progress p1
  *
+ * The progress also acts as a cooperative cancellation token shared by all child progresses:
+ * long-running loops should periodically call checkCanceled(), which throws a CanceledError
+ * once cancel() has been called on any progress sharing the same state.
  */
 class AtomicProgress
 {
@@ -139,9 +153,15 @@ public:
 	AtomicProgress& operator+=(int steps);
 	AtomicProgress& operator++()                {return ((*this)+=1);}
 
+	// cooperative cancellation
+	void cancel()                               {if (m_canceled) *m_canceled = true;}
+	bool canceled() const                       {return m_canceled && *m_canceled;}
+	void checkCanceled() const                  {if (canceled()) throw CanceledError();}
+
 private:
 	int m_numSteps;
 	float m_percentageOfParent, m_stepPercent;
 
 	std::shared_ptr<AtomicPercent32> m_atomicState;  ///< Atomic internal state of progress
+	std::shared_ptr<std::atomic<bool>> m_canceled;   ///< Whether the operation has been asked to stop
 };
\ No newline at end of file
@@ -0,0 +1,306 @@
+//
+// Copyright (C) Wojciech Jarosz <wjarosz@gmail.com>. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can
+// be found in the LICENSE.txt file.
+//
+
+#include "Resampler.h"
+#include "Timer.h"
+#include <list>
+#include <mutex>
+#include <tuple>
+#include <spdlog/spdlog.h>
+
+using namespace Eigen;
+using namespace std;
+
+namespace
+{
+
+// the warp fields of recent envmap conversions, most recently used first
+using WarpKey = tuple<int, int, int, int, int, int, int>;
+const size_t MaxCachedWarpBytes = size_t(512) << 20;
+mutex s_warpCacheMutex;
+list<pair<WarpKey, shared_ptr<const WarpField>>> s_warpCache;
+
+/// The filter kernels, and their radius at a scale of one
+float filterRadius(HDRImage::ResizeFilter filter)
+{
+	switch (filter)
+	{
+		case HDRImage::BOX_FILTER:      return 0.5f;
+		case HDRImage::TENT_FILTER:     return 1.f;
+		case HDRImage::MITCHELL_FILTER: return 2.f;
+		case HDRImage::LANCZOS_FILTER:  return 3.f;
+	}
+	return 1.f;
+}
+
+inline float sinc(float x)
+{
+	x *= float(M_PI);
+	return std::fabs(x) < 1e-5f ? 1.f : std::sin(x) / x;
+}
+
+float filterWeight(HDRImage::ResizeFilter filter, float x)
+{
+	switch (filter)
+	{
+		case HDRImage::BOX_FILTER:
+			// half-open, so that each source sample goes to exactly one output sample for integer factors
+			return (x >= -0.5f && x < 0.5f) ? 1.f : 0.f;
+		case HDRImage::TENT_FILTER:
+			return max(0.f, 1.f - std::fabs(x));
+		case HDRImage::MITCHELL_FILTER:
+		{
+			// Mitchell-Netravali with B = C = 1/3
+			const float B = 1.f / 3.f, C = 1.f / 3.f;
+			x = std::fabs(x);
+			if (x < 1.f)
+				return ((12 - 9 * B - 6 * C) * x * x * x + (-18 + 12 * B + 6 * C) * x * x + (6 - 2 * B)) / 6.f;
+			if (x < 2.f)
+				return ((-B - 6 * C) * x * x * x + (6 * B + 30 * C) * x * x + (-12 * B - 48 * C) * x + (8 * B + 24 * C)) / 6.f;
+			return 0.f;
+		}
+		case HDRImage::LANCZOS_FILTER:
+			return std::fabs(x) < 3.f ? sinc(x) * sinc(x / 3.f) : 0.f;
+	}
+	return 0.f;
+}
+
+/// wrapCoord, to apply the border mode to the taps
+int wrapIndex(int p, int size, HDRImage::BorderMode mode)
+{
+	if (p >= 0 && p < size)
+		return p;
+	switch (mode)
+	{
+		case HDRImage::EDGE:   return resampler::wrap<HDRImage::EDGE>(p, size);
+		case HDRImage::REPEAT: return resampler::wrap<HDRImage::REPEAT>(p, size);
+		case HDRImage::MIRROR: return resampler::wrap<HDRImage::MIRROR>(p, size);
+		default:               return -1;
+	}
+}
+
+/// dst row y is the weighted sum of the taps of src row y, for rows [y0,y1)
+template <typename T>
+void resizeRows(const T * src, ptrdiff_t srcStride, T * dst, ptrdiff_t dstStride, int dstWidth,
+                const resampler::PolyphaseWeights & w, int y0, int y1)
+{
+	for (int y = y0; y < y1; ++y)
+	{
+		const T * s = src + y * srcStride;
+		T * d = dst + y * dstStride;
+		const int * idx = w.indices.data();
+		const float * wt = w.weights.data();
+		for (int x = 0; x < dstWidth; ++x, idx += w.taps, wt += w.taps)
+		{
+			T sum = T(0.f);
+			for (int k = 0; k < w.taps; ++k)
+				sum += s[idx[k]] * wt[k];
+			d[x] = sum;
+		}
+	}
+}
+
+/// dst row y is the weighted sum of the tap rows of src, for rows [y0,y1)
+template <typename T>
+void resizeColumns(const T * src, ptrdiff_t srcStride, T * dst, ptrdiff_t dstStride, int width,
+                   const resampler::PolyphaseWeights & w, int y0, int y1)
+{
+	for (int y = y0; y < y1; ++y)
+	{
+		T * d = dst + y * dstStride;
+		fill(d, d + width, T(0.f));
+		for (int k = 0; k < w.taps; ++k)
+		{
+			float wt = w.weights[y * w.taps + k];
+			if (wt == 0.f)
+				continue;
+			const T * s = src + w.indices[y * w.taps + k] * srcStride;
+			for (int x = 0; x < width; ++x)
+				d[x] += s[x] * wt;
+		}
+	}
+}
+
+/// One separable resize with the same filter in both directions
+template <typename T>
+void resizeSeparable(const T * src, ptrdiff_t srcStride, int srcWidth, int srcHeight,
+                     T * dst, int dstWidth, int dstHeight,
+                     HDRImage::ResizeFilter filter, HDRImage::BorderMode mX, HDRImage::BorderMode mY,
+                     AtomicProgress & progress)
+{
+	resampler::PolyphaseWeights wx(srcWidth, dstWidth, filter, mX), wy(srcHeight, dstHeight, filter, mY);
+
+	// go through whichever intermediate size needs fewer multiply-adds
+	bool rowsFirst = double(dstWidth) * srcHeight * wx.taps + double(dstWidth) * dstHeight * wy.taps <=
+	                 double(srcWidth) * dstHeight * wy.taps + double(dstWidth) * dstHeight * wx.taps;
+	int tmpWidth = rowsFirst ? dstWidth : srcWidth, tmpHeight = rowsFirst ? srcHeight : dstHeight;
+	vector<T> tmp(size_t(tmpWidth) * tmpHeight);
+
+	AtomicProgress first(progress, 0.5f), second(progress, 0.5f);
+	first.setNumSteps(tmpHeight);
+	second.setNumSteps(dstHeight);
+	parallel_for(BlockedRange(0, tmpHeight), [&](int y0, int y1)
+	{
+		first.checkCanceled();
+		if (rowsFirst)
+			resizeRows(src, srcStride, tmp.data(), tmpWidth, dstWidth, wx, y0, y1);
+		else
+			resizeColumns(src, srcStride, tmp.data(), tmpWidth, srcWidth, wy, y0, y1);
+		first += y1 - y0;
+	});
+	parallel_for(BlockedRange(0, dstHeight), [&](int y0, int y1)
+	{
+		second.checkCanceled();
+		if (rowsFirst)
+			resizeColumns(tmp.data(), tmpWidth, dst, dstWidth, dstWidth, wy, y0, y1);
+		else
+			resizeRows(tmp.data(), tmpWidth, dst, dstWidth, dstWidth, wx, y0, y1);
+		second += y1 - y0;
+	});
+}
+
+template <typename T>
+void polyphaseResizeT(const T * src, ptrdiff_t srcStride, int srcWidth, int srcHeight,
+                      T * dst, int dstWidth, int dstHeight,
+                      HDRImage::ResizeFilter filter, HDRImage::BorderMode mX, HDRImage::BorderMode mY,
+                      bool usePyramid, AtomicProgress & progress)
+{
+	if (srcWidth <= 0 || srcHeight <= 0 || dstWidth <= 0 || dstHeight <= 0)
+		return;
+
+	// halve while the final filter would still be more than four times as wide as at a scale of one, which only
+	// pays off for the wider filters
+	int midWidth = srcWidth, midHeight = srcHeight;
+	if (usePyramid && filterRadius(filter) > 1.f)
+	{
+		while (midWidth >= 4 * dstWidth)
+			midWidth = (midWidth + 1) / 2;
+		while (midHeight >= 4 * dstHeight)
+			midHeight = (midHeight + 1) / 2;
+	}
+
+	if (midWidth == srcWidth && midHeight == srcHeight)
+		return resizeSeparable(src, srcStride, srcWidth, srcHeight, dst, dstWidth, dstHeight, filter, mX, mY, progress);
+
+	// a single box pass does all of the halving at once, like going down a box-filtered mip pyramid
+	vector<T> mid(size_t(midWidth) * midHeight);
+	AtomicProgress reduce(progress, 0.5f), filtering(progress, 0.5f);
+	resizeSeparable(src, srcStride, srcWidth, srcHeight, mid.data(), midWidth, midHeight,
+	                HDRImage::BOX_FILTER, mX, mY, reduce);
+	resizeSeparable(mid.data(), midWidth, midWidth, midHeight, dst, dstWidth, dstHeight, filter, mX, mY, filtering);
+}
+
+} // namespace
+
+
+resampler::PolyphaseWeights::PolyphaseWeights(int srcSize, int dstSize, HDRImage::ResizeFilter filter,
+                                               HDRImage::BorderMode mode)
+{
+	float ratio = float(srcSize) / dstSize;
+	float scale = max(1.f, ratio);
+	float support = filterRadius(filter) * scale;
+	taps = int(ceil(2 * support)) + 1;
+	indices.assign(size_t(dstSize) * taps, 0);
+	weights.assign(size_t(dstSize) * taps, 0.f);
+
+	for (int i = 0; i < dstSize; ++i)
+	{
+		// the center of output sample i, in source sample coordinates
+		float center = (i + 0.5f) * ratio - 0.5f;
+		int first = int(ceil(center - support));
+		float total = 0.f;
+		for (int k = 0; k < taps; ++k)
+		{
+			float w = filterWeight(filter, (first + k - center) / scale);
+			total += w;
+			int j = wrapIndex(first + k, srcSize, mode);
+			if (j >= 0)
+			{
+				indices[i * taps + k] = j;
+				weights[i * taps + k] = w;
+			}
+		}
+
+		// normalize, counting the taps outside a BLACK border as black samples
+		if (total != 0.f)
+			for (int k = 0; k < taps; ++k)
+				weights[i * taps + k] /= total;
+	}
+}
+
+void resampler::polyphaseResize(const Color4 * src, ptrdiff_t srcStride, int srcWidth, int srcHeight,
+                                Color4 * dst, int dstWidth, int dstHeight,
+                                HDRImage::ResizeFilter filter, HDRImage::BorderMode mX, HDRImage::BorderMode mY,
+                                bool usePyramid, AtomicProgress progress)
+{
+	polyphaseResizeT(src, srcStride, srcWidth, srcHeight, dst, dstWidth, dstHeight, filter, mX, mY, usePyramid, progress);
+}
+
+void resampler::polyphaseResize(const float * src, ptrdiff_t srcStride, int srcWidth, int srcHeight,
+                                float * dst, int dstWidth, int dstHeight,
+                                HDRImage::ResizeFilter filter, HDRImage::BorderMode mX, HDRImage::BorderMode mY,
+                                bool usePyramid, AtomicProgress progress)
+{
+	polyphaseResizeT(src, srcStride, srcWidth, srcHeight, dst, dstWidth, dstHeight, filter, mX, mY, usePyramid, progress);
+}
+
+
+WarpField::WarpField(int width, int height, int sourceWidth, int sourceHeight, const WarpFn & warp,
+                     int superSample, AtomicProgress progress) :
+	m_width(width), m_height(height), m_sourceWidth(sourceWidth), m_sourceHeight(sourceHeight),
+	m_superSample(max(1, superSample)), m_coords(size_t(width) * height * m_superSample * m_superSample)
+{
+	resampler::WarpFnCoords coords{warp, width, height, m_superSample, Array2f(sourceWidth, sourceHeight)};
+	progress.setNumSteps(height);
+	parallel_for(BlockedRange(0, height), [&](int y0, int y1)
+	{
+		progress.checkCanceled();
+		for (int y = y0; y < y1; ++y)
+			for (int x = 0; x < width; ++x)
+				coords(x, y, &m_coords[(size_t(y) * width + x) * m_superSample * m_superSample]);
+		progress += y1 - y0;
+	});
+}
+
+
+shared_ptr<const WarpField> envMapWarpField(EEnvMappingUVMode dst, EEnvMappingUVMode src,
+                                            int width, int height, int sourceWidth, int sourceHeight,
+                                            int superSample, AtomicProgress progress)
+{
+	WarpKey key(dst, src, width, height, sourceWidth, sourceHeight, max(1, superSample));
+	{
+		lock_guard<mutex> lock(s_warpCacheMutex);
+		for (auto it = s_warpCache.begin(); it != s_warpCache.end(); ++it)
+			if (it->first == key)
+			{
+				s_warpCache.splice(s_warpCache.begin(), s_warpCache, it);
+				return it->second;
+			}
+	}
+
+	// compute the field without holding the lock, two threads may occasionally both compute the same one
+	Timer timer;
+	auto field = make_shared<const WarpField>(width, height, sourceWidth, sourceHeight,
+	                                          // maps destination uvs back to the source parametrization
+	                                          [dst,src](const Vector2f & uv) { return dst == src ? uv : convertEnvMappingUV(src, dst, uv); },
+	                                          superSample, progress);
+	spdlog::get("console")->trace("Computing the envmap warp took: {} seconds.", (timer.elapsed()/1000.f));
+
+	lock_guard<mutex> lock(s_warpCacheMutex);
+	s_warpCache.emplace_front(key, field);
+	// keep the most recent field even if it alone is over the budget
+	size_t total = 0;
+	for (auto it = s_warpCache.begin(); it != s_warpCache.end(); ++it)
+	{
+		total += it->second->bytes();
+		if (it != s_warpCache.begin() && total > MaxCachedWarpBytes)
+		{
+			s_warpCache.erase(it, s_warpCache.end());
+			break;
+		}
+	}
+	return field;
+}
@@ -0,0 +1,308 @@
+//
+// Copyright (C) Wojciech Jarosz <wjarosz@gmail.com>. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can
+// be found in the LICENSE.txt file.
+//
+
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <vector>
+#include <Eigen/Core>
+#include "Common.h"
+#include "EnvMap.h"
+#include "HDRImage.h"
+#include "ParallelFor.h"
+#include "Progress.h"
+
+/*!
+ * @brief The source pixel coordinates of every supersample of a resampling, computed once.
+ *
+ * Environment map conversions spend most of their time in the trigonometry of the warp, which only depends on
+ * the mappings and the sizes, not on the pixels. A WarpField stores the result of the warp for each of the
+ * superSample x superSample samples of each destination pixel, so that it can be reused for any number of
+ * images of the same size (see envMapWarpField and HDRImage::resampled).
+ */
+class WarpField
+{
+public:
+	using WarpFn = std::function<Eigen::Vector2f(const Eigen::Vector2f &)>;
+
+	/*!
+	 * Evaluate warp, which maps [0,1]^2 destination to [0,1]^2 source coordinates, at the supersamples of a
+	 * width x height destination for a sourceWidth x sourceHeight source.
+	 */
+	WarpField(int width, int height, int sourceWidth, int sourceHeight, const WarpFn & warp,
+	          int superSample = 1, AtomicProgress progress = AtomicProgress());
+
+	int width() const               {return m_width;}
+	int height() const              {return m_height;}
+	int sourceWidth() const         {return m_sourceWidth;}
+	int sourceHeight() const        {return m_sourceHeight;}
+	int superSample() const         {return m_superSample;}
+	size_t bytes() const            {return m_coords.size() * sizeof(Eigen::Vector2f);}
+
+	/// The superSample^2 source pixel coordinates of destination pixel (x,y), row by row
+	const Eigen::Vector2f * samples(int x, int y) const
+	{
+		return &m_coords[(size_t(y) * m_width + x) * m_superSample * m_superSample];
+	}
+
+private:
+	int m_width, m_height, m_sourceWidth, m_sourceHeight, m_superSample;
+	std::vector<Eigen::Vector2f> m_coords;
+};
+
+/*!
+ * The WarpField for converting a sourceWidth x sourceHeight environment map with parametrization src into a
+ * width x height one with parametrization dst.
+ *
+ * The last few fields are cached (as long as they fit a memory budget), so converting a sequence of images
+ * of the same size only evaluates the warp once.
+ */
+std::shared_ptr<const WarpField> envMapWarpField(EEnvMappingUVMode dst, EEnvMappingUVMode src,
+                                                 int width, int height, int sourceWidth, int sourceHeight,
+                                                 int superSample = 1, AtomicProgress progress = AtomicProgress());
+
+
+namespace resampler
+{
+
+/*!
+ * Weights of a one-dimensional polyphase resize from srcSize to dstSize samples.
+ *
+ * Output sample i is the sum over the taps k of weights[i * taps + k] times the source sample
+ * indices[i * taps + k]. The filter is widened by the reduction factor when downsizing, so it also does the
+ * anti-aliasing. The indices already have the border mode applied, and the weights are normalized to sum to one
+ * (except for BLACK borders, which contribute zero).
+ */
+struct PolyphaseWeights
+{
+	PolyphaseWeights(int srcSize, int dstSize, HDRImage::ResizeFilter filter, HDRImage::BorderMode mode);
+
+	int taps = 0;
+	std::vector<int> indices;
+	std::vector<float> weights;
+};
+
+/*!
+ * Resize the srcWidth x srcHeight image at src, whose rows are srcStride pixels apart, into the contiguous
+ * dstWidth x dstHeight image at dst.
+ *
+ * The image is filtered in two separable passes over rows and columns, in the order that needs fewer operations.
+ * Both passes are multithreaded over rows, and the vertical pass accumulates whole source rows, so all accesses
+ * are sequential. With usePyramid, large reductions are first done (mostly) by a cheap box filter, down to
+ * between two and four times the target size.
+ */
+void polyphaseResize(const Color4 * src, std::ptrdiff_t srcStride, int srcWidth, int srcHeight,
+                     Color4 * dst, int dstWidth, int dstHeight,
+                     HDRImage::ResizeFilter filter, HDRImage::BorderMode mX, HDRImage::BorderMode mY,
+                     bool usePyramid, AtomicProgress progress = AtomicProgress());
+/// The same for single-channel images
+void polyphaseResize(const float * src, std::ptrdiff_t srcStride, int srcWidth, int srcHeight,
+                     float * dst, int dstWidth, int dstHeight,
+                     HDRImage::ResizeFilter filter, HDRImage::BorderMode mX, HDRImage::BorderMode mY,
+                     bool usePyramid, AtomicProgress progress = AtomicProgress());
+
+/// wrapCoord with the border mode known at compile time, -1 for BLACK
+template <HDRImage::BorderMode M>
+inline int wrap(int p, int size)
+{
+	switch (M)
+	{
+		case HDRImage::EDGE:
+			return p < 0 ? 0 : size - 1;
+		case HDRImage::REPEAT:
+			return ((p % size) + size) % size;
+		case HDRImage::MIRROR:
+		{
+			int frac = ((p % size) + size) % size;
+			return (std::abs(p) / size % 2 != 0) ? size - 1 - frac : frac;
+		}
+		default:
+			return -1;
+	}
+}
+
+template <HDRImage::BorderMode MX, HDRImage::BorderMode MY>
+inline Color4 fetch(const HDRImage & img, int x, int y)
+{
+	if (img.inBounds(x, y))
+		return img(x, y);
+	x = unsigned(x) < unsigned(img.width()) ? x : wrap<MX>(x, img.width());
+	y = unsigned(y) < unsigned(img.height()) ? y : wrap<MY>(y, img.height());
+	return (x < 0 || y < 0) ? Color4(0.f, 0.f, 0.f, 0.f) : img(x, y);
+}
+
+/// Weight of the photoshop bicubic filter (A = -0.75) at distance d
+inline float bicubicWeight(float d)
+{
+	const float A = -0.75f;
+	d = std::fabs(d);
+	return (d <= 1) ? ((A + 2.0f) * d - (A + 3.0f)) * d * d + 1.0f :
+	                  ((A * d - 5.0f * A) * d + 8.0f * A) * d - 4.0f * A;
+}
+
+/// HDRImage::sample, with the sampler and border modes known at compile time
+template <HDRImage::Sampler S, HDRImage::BorderMode MX, HDRImage::BorderMode MY>
+inline Color4 sample(const HDRImage & img, float sx, float sy)
+{
+	if (S == HDRImage::NEAREST)
+		return fetch<MX,MY>(img, int(std::floor(sx)), int(std::floor(sy)));
+
+	// shift so that pixels are defined at their centers
+	sx -= 0.5f;
+	sy -= 0.5f;
+	int x0 = int(std::floor(sx)), y0 = int(std::floor(sy));
+
+	if (S == HDRImage::BILINEAR)
+	{
+		float tx = sx - x0, ty = sy - y0;
+		return lerp(lerp(fetch<MX,MY>(img, x0, y0), fetch<MX,MY>(img, x0 + 1, y0), tx),
+		            lerp(fetch<MX,MY>(img, x0, y0 + 1), fetch<MX,MY>(img, x0 + 1, y0 + 1), tx), ty);
+	}
+
+	// the weights are separable, so only compute 4 + 4 of them instead of 16
+	float wx[4], wy[4];
+	for (int i = 0; i < 4; ++i)
+	{
+		wx[i] = bicubicWeight(sx - (x0 - 1 + i));
+		wy[i] = bicubicWeight(sy - (y0 - 1 + i));
+	}
+	Color4 val(0, 0, 0, 0);
+	float totalWeight = 0;
+	for (int j = 0; j < 4; ++j)
+		for (int i = 0; i < 4; ++i)
+		{
+			float weight = wx[i] * wy[j];
+			val += fetch<MX,MY>(img, x0 - 1 + i, y0 - 1 + j) * weight;
+			totalWeight += weight;
+		}
+	return val * (1.0f / totalWeight);
+}
+
+/// Supersample coordinates that come from evaluating a warp function for each sample
+struct WarpFnCoords
+{
+	const WarpField::WarpFn & warp;
+	int width, height, superSample;
+	Eigen::Array2f sourceSize;
+
+	void operator()(int x, int y, Eigen::Vector2f * coords) const
+	{
+		for (int yy = 0, k = 0; yy < superSample; ++yy)
+		{
+			float j = (yy + 0.5f) / superSample;
+			for (int xx = 0; xx < superSample; ++xx, ++k)
+			{
+				float i = (xx + 0.5f) / superSample;
+				coords[k] = warp(Eigen::Vector2f((x + i) / width, (y + j) / height)).array() * sourceSize;
+			}
+		}
+	}
+};
+
+/// Supersample coordinates looked up from a precomputed WarpField
+struct WarpFieldCoords
+{
+	const WarpField & field;
+
+	void operator()(int x, int y, Eigen::Vector2f * coords) const
+	{
+		const Eigen::Vector2f * s = field.samples(x, y);
+		std::copy(s, s + field.superSample() * field.superSample(), coords);
+	}
+};
+
+/// The coordinates of pixel (x + dx, y + dy), so that resampling into an image the size of a region computes that region
+template <typename Coords>
+struct OffsetCoords
+{
+	const Coords & coords;
+	int dx, dy;
+
+	void operator()(int x, int y, Eigen::Vector2f * c) const
+	{
+		coords(x + dx, y + dy, c);
+	}
+};
+
+/// Resample rows [y0,y1) of dst from src, averaging the supersamples that coords gives for each pixel
+template <HDRImage::Sampler S, HDRImage::BorderMode MX, HDRImage::BorderMode MY, typename Coords>
+void resampleRows(const HDRImage & src, HDRImage & dst, int y0, int y1, int superSample, const Coords & coords)
+{
+	int n = superSample * superSample;
+	std::vector<Eigen::Vector2f> samples(n);
+	float invN = 1.f / n;
+	for (int y = y0; y < y1; ++y)
+		for (int x = 0; x < dst.width(); ++x)
+		{
+			coords(x, y, samples.data());
+			Color4 sum(0, 0, 0, 0);
+			for (int k = 0; k < n; ++k)
+				sum += sample<S,MX,MY>(src, samples[k](0), samples[k](1));
+			dst(x, y) = sum * invN;
+		}
+}
+
+template <HDRImage::Sampler S, HDRImage::BorderMode MX, HDRImage::BorderMode MY, typename Coords>
+void resample(const HDRImage & src, HDRImage & dst, int superSample, const Coords & coords, AtomicProgress & progress)
+{
+	progress.setNumSteps(dst.height());
+	parallel_for(BlockedRange(0, dst.height()), [&](int y0, int y1)
+	{
+		progress.checkCanceled();
+		resampleRows<S,MX,MY>(src, dst, y0, y1, superSample, coords);
+		progress += y1 - y0;
+	});
+}
+
+template <HDRImage::Sampler S, HDRImage::BorderMode MX, typename Coords>
+void resample(const HDRImage & src, HDRImage & dst, int superSample, const Coords & coords,
+              HDRImage::BorderMode mY, AtomicProgress & progress)
+{
+	switch (mY)
+	{
+		case HDRImage::BLACK:  return resample<S,MX,HDRImage::BLACK>(src, dst, superSample, coords, progress);
+		case HDRImage::EDGE:   return resample<S,MX,HDRImage::EDGE>(src, dst, superSample, coords, progress);
+		case HDRImage::REPEAT: return resample<S,MX,HDRImage::REPEAT>(src, dst, superSample, coords, progress);
+		case HDRImage::MIRROR: return resample<S,MX,HDRImage::MIRROR>(src, dst, superSample, coords, progress);
+	}
+}
+
+template <HDRImage::Sampler S, typename Coords>
+void resample(const HDRImage & src, HDRImage & dst, int superSample, const Coords & coords,
+              HDRImage::BorderMode mX, HDRImage::BorderMode mY, AtomicProgress & progress)
+{
+	switch (mX)
+	{
+		case HDRImage::BLACK:  return resample<S,HDRImage::BLACK>(src, dst, superSample, coords, mY, progress);
+		case HDRImage::EDGE:   return resample<S,HDRImage::EDGE>(src, dst, superSample, coords, mY, progress);
+		case HDRImage::REPEAT: return resample<S,HDRImage::REPEAT>(src, dst, superSample, coords, mY, progress);
+		case HDRImage::MIRROR: return resample<S,HDRImage::MIRROR>(src, dst, superSample, coords, mY, progress);
+	}
+}
+
+/*!
+ * Resample src into dst, with the supersample coordinates given by coords, for any sampler and border modes.
+ *
+ * The runtime choices are turned into template arguments once, here, so the per-sample code has no branches
+ * on them and inlines the sampler.
+ */
+template <typename Coords>
+void resample(const HDRImage & src, HDRImage & dst, int superSample, const Coords & coords,
+              HDRImage::Sampler s, HDRImage::BorderMode mX, HDRImage::BorderMode mY, AtomicProgress & progress)
+{
+	switch (s)
+	{
+		case HDRImage::NEAREST:  return resample<HDRImage::NEAREST>(src, dst, superSample, coords, mX, mY, progress);
+		case HDRImage::BILINEAR: return resample<HDRImage::BILINEAR>(src, dst, superSample, coords, mX, mY, progress);
+		case HDRImage::BICUBIC:  return resample<HDRImage::BICUBIC>(src, dst, superSample, coords, mX, mY, progress);
+	}
+}
+
+} // namespace resampler
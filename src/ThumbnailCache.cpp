@@ -0,0 +1,257 @@
+//
+// Copyright (C) Wojciech Jarosz <wjarosz@gmail.com>. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can
+// be found in the LICENSE.txt file.
+//
+
+#include "ThumbnailCache.h"
+#include "Colorspace.h"
+#include "Common.h"
+#include "DirectoryWatcher.h"
+#include "HDRImage.h"
+#include "Trace.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <mutex>
+#include <sys/stat.h>
+#include <spdlog/fmt/fmt.h>
+#include <tinydir.h>
+
+#if defined(_WIN32)
+#include <direct.h>
+#include <sys/utime.h>
+#else
+#include <utime.h>
+#endif
+
+using namespace std;
+
+namespace
+{
+
+const char Magic[8] = {'H', 'D', 'R', 'V', 'T', 'H', 'M', '1'};
+
+mutex s_mutex;
+string s_directory = ThumbnailCache::defaultDirectory();
+
+string cacheDirectory()
+{
+	lock_guard<mutex> lock(s_mutex);
+	return s_directory;
+}
+
+// create the directory and any missing parents, returns whether it exists afterwards
+bool makeDirectories(const string & path)
+{
+	// the prefixes that already exist (or cannot be created, like drive letters) simply fail
+	for (size_t i = 1; i <= path.size(); ++i)
+		if (i == path.size() || path[i] == '/' || path[i] == '\\')
+#if defined(_WIN32)
+			_mkdir(path.substr(0, i).c_str());
+#else
+			mkdir(path.substr(0, i).c_str(), 0755);
+#endif
+
+	struct stat st;
+	return stat(path.c_str(), &st) == 0;
+}
+
+/*!
+ * The cache file for the current version of filename, and the key that identifies this version.
+ * Returns false if thumbnails are not stored, or the file does not exist.
+ */
+bool cacheFile(const string & filename, string & path, string & key)
+{
+	string directory = cacheDirectory();
+	FileStamp stamp;
+	if (directory.empty() || !fileStamp(filename, stamp))
+		return false;
+
+	key = fmt::format("{}\n{}\n{}", canonicalPath(filename), stamp.size, stamp.modified);
+
+	// 64-bit FNV-1a
+	uint64_t hash = 14695981039346656037ull;
+	for (unsigned char c : key)
+		hash = (hash ^ c) * 1099511628211ull;
+
+	path = fmt::format("{}/{:016x}.thumb", directory, hash);
+	return true;
+}
+
+// mark the file as recently used, for prune
+void touch(const string & path)
+{
+#if defined(_WIN32)
+	_utime(path.c_str(), nullptr);
+#else
+	utime(path.c_str(), nullptr);
+#endif
+}
+
+} // namespace
+
+
+Thumbnail::Thumbnail(const HDRImage & img)
+{
+	if (img.isNull())
+		return;
+
+	auto small = downsampledPreview(img, ThumbnailCache::Size);
+	width = small->width();
+	height = small->height();
+	pixels.resize(size_t(width) * height * 4);
+	for (int y = 0; y < height; ++y)
+		for (int x = 0; x < width; ++x)
+		{
+			Color4 c = small->color(x, y);
+			Color4 v = LinearToSRGB(c);
+			v.a = c.a;
+			for (int i = 0; i < 4; ++i)
+				pixels[4 * (x + y * width) + i] = uint8_t(::clamp(v[i] * 255.f + 0.5f, 0.f, 255.f));
+		}
+}
+
+
+string ThumbnailCache::directory()
+{
+	return cacheDirectory();
+}
+
+void ThumbnailCache::setDirectory(const string & directory)
+{
+	lock_guard<mutex> lock(s_mutex);
+	s_directory = directory;
+}
+
+string ThumbnailCache::defaultDirectory()
+{
+#if defined(_WIN32)
+	const char * base = getenv("LOCALAPPDATA");
+	return base ? string(base) + "\\hdrview\\thumbnails" : string();
+#elif defined(__APPLE__)
+	const char * home = getenv("HOME");
+	return home ? string(home) + "/Library/Caches/hdrview/thumbnails" : string();
+#else
+	const char * base = getenv("XDG_CACHE_HOME");
+	if (base && base[0])
+		return string(base) + "/hdrview/thumbnails";
+	const char * home = getenv("HOME");
+	return home ? string(home) + "/.cache/hdrview/thumbnails" : string();
+#endif
+}
+
+shared_ptr<const Thumbnail> ThumbnailCache::read(const string & filename)
+{
+	TRACE_ZONE("ThumbnailCache::read", filename);
+	string path, key;
+	if (!cacheFile(filename, path, key))
+		return nullptr;
+
+	shared_ptr<FILE> file(fopen(path.c_str(), "rb"), [](FILE * f){if (f) fclose(f);});
+	if (!file)
+		return nullptr;
+
+	// the header holds the magic number, the key, and the size of the thumbnail
+	char magic[sizeof(Magic)];
+	int32_t keySize;
+	if (fread(magic, sizeof(magic), 1, file.get()) != 1 || !equal(magic, magic + sizeof(magic), Magic) ||
+	    fread(&keySize, sizeof(keySize), 1, file.get()) != 1 || keySize != int32_t(key.size()))
+		return nullptr;
+
+	string storedKey(key.size(), '\0');
+	int32_t size[2];
+	if (fread(&storedKey[0], 1, key.size(), file.get()) != key.size() || storedKey != key ||
+	    fread(size, sizeof(size), 1, file.get()) != 1 ||
+	    size[0] <= 0 || size[0] > Size || size[1] <= 0 || size[1] > Size)
+		return nullptr;
+
+	auto thumbnail = make_shared<Thumbnail>();
+	thumbnail->width = size[0];
+	thumbnail->height = size[1];
+	thumbnail->pixels.resize(size_t(size[0]) * size[1] * 4);
+	if (fread(thumbnail->pixels.data(), 1, thumbnail->pixels.size(), file.get()) != thumbnail->pixels.size())
+		return nullptr;
+
+	file = nullptr;
+	touch(path);
+	return thumbnail;
+}
+
+bool ThumbnailCache::write(const string & filename, const Thumbnail & thumbnail)
+{
+	TRACE_ZONE("ThumbnailCache::write", filename);
+	string path, key;
+	if (thumbnail.isNull() || !cacheFile(filename, path, key) || !makeDirectories(cacheDirectory()))
+		return false;
+
+	// the thumbnails of earlier sessions only need to be cleaned up once new ones are added
+	static once_flag pruned;
+	call_once(pruned, prune);
+
+	// write to a temporary file first, so readers (e.g. other instances of HDRView) never see a partial thumbnail
+	string temporary = fmt::format("{}.{}.tmp", path, uintptr_t(&thumbnail));
+	{
+		shared_ptr<FILE> file(fopen(temporary.c_str(), "wb"), [](FILE * f){if (f) fclose(f);});
+		if (!file)
+			return false;
+
+		int32_t keySize = int32_t(key.size());
+		int32_t size[2] = {thumbnail.width, thumbnail.height};
+		bool ok = fwrite(Magic, sizeof(Magic), 1, file.get()) == 1 &&
+		          fwrite(&keySize, sizeof(keySize), 1, file.get()) == 1 &&
+		          fwrite(key.data(), 1, key.size(), file.get()) == key.size() &&
+		          fwrite(size, sizeof(size), 1, file.get()) == 1 &&
+		          fwrite(thumbnail.pixels.data(), 1, thumbnail.pixels.size(), file.get()) == thumbnail.pixels.size() &&
+		          fflush(file.get()) == 0;
+		if (!ok)
+		{
+			file = nullptr;
+			remove(temporary.c_str());
+			return false;
+		}
+	}
+
+	// rename does not replace existing files on Windows
+	remove(path.c_str());
+	if (rename(temporary.c_str(), path.c_str()) != 0)
+	{
+		remove(temporary.c_str());
+		return false;
+	}
+	return true;
+}
+
+void ThumbnailCache::prune()
+{
+	TRACE_ZONE("ThumbnailCache::prune");
+	string directory = cacheDirectory();
+	tinydir_dir dir;
+	if (directory.empty() || tinydir_open(&dir, directory.c_str()) == -1)
+		return;
+
+	vector<pair<FileStamp, string>> thumbnails;
+	int64_t total = 0;
+	for (; dir.has_next; tinydir_next(&dir))
+	{
+		tinydir_file file;
+		if (tinydir_readfile(&dir, &file) == -1)
+			break;
+
+		FileStamp stamp;
+		if (!file.is_reg || string(file.extension) != "thumb" || !fileStamp(file.path, stamp))
+			continue;
+
+		thumbnails.emplace_back(stamp, file.path);
+		total += stamp.size;
+	}
+	tinydir_close(&dir);
+
+	// reading a thumbnail touches it, so the least recently used ones are the least recently modified
+	sort(thumbnails.begin(), thumbnails.end(),
+	     [](const pair<FileStamp, string> & a, const pair<FileStamp, string> & b)
+	     {return a.first.modified < b.first.modified;});
+	for (size_t i = 0; i < thumbnails.size() && total > MaxCacheSize; ++i)
+		if (remove(thumbnails[i].second.c_str()) == 0)
+			total -= thumbnails[i].first.size;
+}
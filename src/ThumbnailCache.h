@@ -0,0 +1,62 @@
+//
+// Copyright (C) Wojciech Jarosz <wjarosz@gmail.com>. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can
+// be found in the LICENSE.txt file.
+//
+
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+#include "Fwd.h"
+
+/// A small 8-bit picture of an image, e.g. to find it in the list of open images
+struct Thumbnail
+{
+	int width = 0, height = 0;
+	std::vector<uint8_t> pixels;    ///< The width x height sRGB RGBA pixels, row by row from the top
+
+	Thumbnail() = default;
+	/// A quick downsampled copy of @p img that fits in ThumbnailCache::Size pixels, tonemapped at exposure 0
+	explicit Thumbnail(const HDRImage & img);
+
+	bool isNull() const {return pixels.empty();}
+};
+
+/// Receives a thumbnail, e.g. one found in the ThumbnailCache or computed while loading an image
+using ThumbnailCallback = std::function<void(const std::shared_ptr<const Thumbnail> & thumbnail)>;
+
+/*!
+ * @brief The thumbnails of image files, stored on disk to show them without decoding the images again.
+ *
+ * Each thumbnail is stored in its own file in directory(), named after a hash of the absolute path, size and
+ * modification time of the image file. The file also holds these three, and a thumbnail is only read back if
+ * they still match, so changing or replacing an image makes its old thumbnail unreachable instead of stale.
+ * Reading a thumbnail marks it as recently used, and once per session the least recently used ones are removed
+ * until the directory holds no more than MaxCacheSize bytes of them, which also cleans up the unreachable ones.
+ *
+ * All functions can be called from any thread. Failing to read or write a thumbnail is not an error, the image
+ * simply gets a new thumbnail the next time it is loaded.
+ */
+class ThumbnailCache
+{
+public:
+	static constexpr int Size = 64;                         ///< Thumbnails fit in Size x Size pixels
+	static constexpr int64_t MaxCacheSize = 64 << 20;       ///< In bytes, about 4000 thumbnails
+
+	/// Where the thumbnails are stored, or empty to not store them at all
+	static std::string directory();
+	static void setDirectory(const std::string & directory);
+	/// The per-user cache directory of the platform, e.g. ~/.cache/hdrview/thumbnails on Linux
+	static std::string defaultDirectory();
+
+	/// The stored thumbnail of the current version of @p filename, or null if there is none
+	static std::shared_ptr<const Thumbnail> read(const std::string & filename);
+	/// Store the thumbnail of the current version of @p filename, returns whether that worked
+	static bool write(const std::string & filename, const Thumbnail & thumbnail);
+	/// Remove the least recently used thumbnails until they take up no more than MaxCacheSize bytes
+	static void prune();
+};
@@ -0,0 +1,173 @@
+//
+// Copyright (C) Wojciech Jarosz <wjarosz@gmail.com>. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can
+// be found in the LICENSE.txt file.
+//
+
+#include "Trace.h"
+#include "Common.h"
+#include <cmath>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include <spdlog/fmt/fmt.h>
+
+using namespace std;
+
+namespace
+{
+
+struct Event
+{
+	const char * name;
+	char phase;                 ///< 'X' for zones and 'C' for counters, as in the Chrome trace format
+	int64_t begin, end;         ///< Nanoseconds, end is only used by zones
+	double value;               ///< Only used by counters
+	string detail;
+};
+
+// the events of one thread. Only that thread appends to it, so the mutex is uncontended except while writing
+struct ThreadBuffer
+{
+	mutex mtx;
+	vector<Event> events;
+	int id;
+	string name;
+};
+
+struct Registry
+{
+	mutex mtx;
+	vector<shared_ptr<ThreadBuffer>> buffers;  ///< Kept after their threads end, so no events get lost
+	int64_t start = 0;
+};
+
+Registry & registry()
+{
+	static Registry r;
+	return r;
+}
+
+ThreadBuffer & threadBuffer()
+{
+	thread_local shared_ptr<ThreadBuffer> t_buffer;
+	if (!t_buffer)
+	{
+		t_buffer = make_shared<ThreadBuffer>();
+		Registry & r = registry();
+		lock_guard<mutex> lock(r.mtx);
+		t_buffer->id = int(r.buffers.size());
+		r.buffers.push_back(t_buffer);
+	}
+	return *t_buffer;
+}
+
+void addEvent(Event && e)
+{
+	ThreadBuffer & buffer = threadBuffer();
+	lock_guard<mutex> lock(buffer.mtx);
+	buffer.events.push_back(move(e));
+}
+
+} // namespace
+
+
+namespace trace
+{
+
+namespace detail
+{
+
+atomic<bool> s_enabled(false);
+
+void addZone(const char * name, int64_t begin, int64_t end, string detail)
+{
+	addEvent({name, 'X', begin, end, 0.0, move(detail)});
+}
+
+} // namespace detail
+
+void start()
+{
+	{
+		Registry & r = registry();
+		lock_guard<mutex> lock(r.mtx);
+		if (r.start == 0)
+			r.start = detail::now();
+	}
+	detail::s_enabled = true;
+}
+
+void setThreadName(const string & name)
+{
+	ThreadBuffer & buffer = threadBuffer();
+	lock_guard<mutex> lock(buffer.mtx);
+	buffer.name = name;
+}
+
+void counter(const char * name, double value)
+{
+	if (enabled())
+		addEvent({name, 'C', detail::now(), 0, value, string()});
+}
+
+bool write(const string & filename)
+{
+	Registry & r = registry();
+	vector<shared_ptr<ThreadBuffer>> buffers;
+	int64_t start;
+	{
+		lock_guard<mutex> lock(r.mtx);
+		buffers = r.buffers;
+		start = r.start;
+	}
+
+	// timestamps are in microseconds since start()
+	auto micro = [start](int64_t t){return fmt::format("{:.3f}", (t - start) * 1e-3);};
+
+	string json = "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n";
+	bool first = true;
+	auto add = [&json,&first](const string & event)
+	{
+		json += first ? "  " : ",\n  ";
+		json += event;
+		first = false;
+	};
+
+	for (const auto & buffer : buffers)
+	{
+		lock_guard<mutex> lock(buffer->mtx);
+		if (!buffer->name.empty())
+			add(fmt::format("{{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": {}, \"args\": {{\"name\": {}}}}}",
+			                buffer->id, jsonString(buffer->name)));
+
+		for (const Event & e : buffer->events)
+		{
+			if (e.begin < start)
+				continue;
+
+			if (e.phase == 'X')
+			{
+				string event = fmt::format("{{\"name\": {}, \"ph\": \"X\", \"pid\": 1, \"tid\": {}, \"ts\": {}, \"dur\": {:.3f}",
+				                           jsonString(e.name), buffer->id, micro(e.begin), (e.end - e.begin) * 1e-3);
+				if (!e.detail.empty())
+					event += fmt::format(", \"args\": {{\"detail\": {}}}", jsonString(e.detail));
+				add(event + "}");
+			}
+			else
+				add(fmt::format("{{\"name\": {}, \"ph\": \"C\", \"pid\": 1, \"tid\": {}, \"ts\": {}, \"args\": {{\"value\": {}}}}}",
+				                jsonString(e.name), buffer->id, micro(e.begin),
+				                isfinite(e.value) ? fmt::format("{:.9g}", e.value) : "0"));
+		}
+	}
+	json += "\n]}\n";
+
+	FILE * f = fopen(filename.c_str(), "wb");
+	if (!f)
+		return false;
+	bool written = fwrite(json.data(), 1, json.size(), f) == json.size();
+	return fclose(f) == 0 && written;
+}
+
+} // namespace trace
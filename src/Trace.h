@@ -0,0 +1,104 @@
+//
+// Copyright (C) Wojciech Jarosz <wjarosz@gmail.com>. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can
+// be found in the LICENSE.txt file.
+//
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+
+/*!
+ * @brief Lightweight scoped tracing, written out as Chrome trace JSON.
+ *
+ * A zone records its name, the thread it ran on and its begin and end times, so nested zones show up nested
+ * in chrome://tracing or ui.perfetto.dev. Counters record a value over time.
+ *
+ * Nothing is recorded until start() is called, so an idle zone only costs a relaxed atomic load. Once started,
+ * a zone reads the clock twice and appends one event to a buffer of its thread. Building without
+ * HDRVIEW_TRACING compiles the TRACE_ macros below away entirely.
+ */
+namespace trace
+{
+
+namespace detail
+{
+extern std::atomic<bool> s_enabled;
+
+inline std::int64_t now()
+{
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void addZone(const char * name, std::int64_t begin, std::int64_t end, std::string detail);
+} // namespace detail
+
+/// Start recording zones and counters
+void start();
+/// Whether zones and counters are being recorded
+inline bool enabled()          {return detail::s_enabled.load(std::memory_order_relaxed);}
+/*!
+ * Write everything recorded so far to filename, in the Chrome trace event format.
+ * Recording goes on, so this can be called again later for a longer trace.
+ *
+ * @return True if writing was successful
+ */
+bool write(const std::string & filename);
+
+/// Name the calling thread in the trace
+void setThreadName(const std::string & name);
+/// Record the value of the counter name (a string literal) at this time
+void counter(const char * name, double value);
+
+/*!
+ * Records the time from its construction to its destruction as a zone.
+ *
+ * The name has to outlive the trace, i.e. be a string literal. The optional detail (e.g. a filename) is shown
+ * with the zone, and only copied if tracing is enabled.
+ */
+class Zone
+{
+public:
+	explicit Zone(const char * name) :
+		m_name(enabled() ? name : nullptr), m_begin(m_name ? detail::now() : 0) {}
+	Zone(const char * name, const std::string & info) :
+		m_name(enabled() ? name : nullptr), m_begin(m_name ? detail::now() : 0)
+	{
+		if (m_name)
+			m_detail = info;
+	}
+	~Zone()
+	{
+		if (m_name)
+			detail::addZone(m_name, m_begin, detail::now(), std::move(m_detail));
+	}
+
+private:
+	Zone(const Zone &) = delete;
+	Zone & operator=(const Zone &) = delete;
+
+	const char * m_name;
+	std::int64_t m_begin;
+	std::string m_detail;
+};
+
+} // namespace trace
+
+
+#define TRACE_CONCAT_IMPL(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_IMPL(a, b)
+
+#if defined(HDRVIEW_TRACING)
+/// A zone from here to the end of the enclosing scope, with a name and an optional detail string
+#define TRACE_ZONE(...) trace::Zone TRACE_CONCAT(traceZone, __LINE__)(__VA_ARGS__)
+#define TRACE_COUNTER(name, value) (trace::enabled() ? trace::counter(name, double(value)) : void())
+#define TRACE_THREAD_NAME(name) trace::setThreadName(name)
+#else
+#define TRACE_ZONE(...) do {} while (false)
+#define TRACE_COUNTER(name, value) do {} while (false)
+#define TRACE_THREAD_NAME(name) do {} while (false)
+#endif